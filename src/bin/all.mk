@@ -1,6 +1,7 @@
 SUBMAKEFILES := \
     radclient.mk \
     radict.mk \
+    raddetail.mk \
     radiusd.mk \
     radsniff.mk \
     radwho.mk \
@@ -127,7 +127,7 @@ fr_dict_attr_autoload_t radclient_dict_attr[] = {
 	{ .out = &attr_request_authenticator, .name = "Request-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_freeradius },
 
 	{ .out = &attr_chap_password, .name = "CHAP-Password", .type = FR_TYPE_OCTETS, .dict = &dict_radius },
-	{ .out = &attr_chap_password, .name = "CHAP-Challenge", .type = FR_TYPE_OCTETS, .dict = &dict_radius },
+	{ .out = &attr_chap_challenge, .name = "CHAP-Challenge", .type = FR_TYPE_OCTETS, .dict = &dict_radius },
 	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius },
 	{ NULL }
@@ -149,13 +149,19 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -F                     Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h                     Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                Set request id to 'id'.  Values may be 0..255\n");
+	fprintf(stderr, "  -l <seconds>           Run each step of a load test for 'seconds' (default 10).\n");
+	fprintf(stderr, "  -L <pps>[:<max>[:<step>]]\n");
+	fprintf(stderr, "                         Run a load test, sending 'pps' packets/s.  If 'max' is given, the\n");
+	fprintf(stderr, "                         rate is increased by 'step' until it reaches 'max'.\n");
 	fprintf(stderr, "  -n <num>               Send N requests/s\n");
+	fprintf(stderr, "  -N <sockets>           Open 'sockets' source ports per load test thread (default 1).\n");
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -P <proto>             Use proto (tcp or udp) for transport.\n");
 	fprintf(stderr, "  -r <retries>           If timeout, retry sending the packet 'retries' times.\n");
 	fprintf(stderr, "  -s                     Print out summary information of auth results.\n");
 	fprintf(stderr, "  -S <file>              read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>           Wait 'timeout' seconds before retrying (may be a floating point number).\n");
+	fprintf(stderr, "  -T <threads>           Send a load test from 'threads' threads (default 1).\n");
 	fprintf(stderr, "  -v                     Show program version information.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
@@ -762,6 +768,47 @@ static void deallocate_id(rc_request_t *request)
 	if (request->reply) fr_radius_packet_free(&request->reply);
 }
 
+/*
+ *	Fill in the password attributes from Cleartext-Password.
+ */
+static void request_password_update(rc_request_t *request)
+{
+	fr_pair_t *vp;
+
+	if ((vp = fr_pair_find_by_da(&request->request_pairs, attr_user_password)) != NULL) {
+		fr_pair_value_strdup(vp, request->password->vp_strvalue);
+
+	} else if ((vp = fr_pair_find_by_da(&request->request_pairs,
+					    attr_chap_password)) != NULL) {
+		uint8_t		buffer[17];
+		fr_pair_t	*challenge;
+		uint8_t	const	*vector;
+
+		/*
+		 *	Use Chap-Challenge pair if present,
+		 *	Request Authenticator otherwise.
+		 */
+		challenge = fr_pair_find_by_da(&request->request_pairs, attr_chap_challenge);
+		if (challenge && (challenge->vp_length == RADIUS_AUTH_VECTOR_LENGTH)) {
+			vector = challenge->vp_octets;
+		} else {
+			vector = request->packet->vector;
+		}
+
+		fr_radius_encode_chap_password(buffer,
+					       fr_rand() & 0xff, vector,
+					       request->password->vp_strvalue,
+					       request->password->vp_length);
+		fr_pair_value_memdup(vp, buffer, sizeof(buffer), false);
+
+	} else if (fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_password) != NULL) {
+		mschapv1_encode(request->packet, &request->request_pairs, request->password->vp_strvalue);
+
+	} else {
+		DEBUG("WARNING: No password in the request");
+	}
+}
+
 /*
  *	Send one packet.
  */
@@ -833,42 +880,7 @@ static int send_one_packet(rc_request_t *request)
 		 *	Update the password, so it can be encrypted with the
 		 *	new authentication vector.
 		 */
-		if (request->password) {
-			fr_pair_t *vp;
-
-			if ((vp = fr_pair_find_by_da(&request->request_pairs, attr_user_password)) != NULL) {
-				fr_pair_value_strdup(vp, request->password->vp_strvalue);
-
-			} else if ((vp = fr_pair_find_by_da(&request->request_pairs,
-							    attr_chap_password)) != NULL) {
-				uint8_t		buffer[17];
-				fr_pair_t	*challenge;
-				uint8_t	const	*vector;
-
-				/*
-				 *	Use Chap-Challenge pair if present,
-				 *	Request Authenticator otherwise.
-				 */
-				challenge = fr_pair_find_by_da(&request->request_pairs, attr_chap_challenge);
-				if (challenge && (challenge->vp_length == RADIUS_AUTH_VECTOR_LENGTH)) {
-					vector = challenge->vp_octets;
-				} else {
-					vector = request->packet->vector;
-				}
-
-				fr_radius_encode_chap_password(buffer,
-							       fr_rand() & 0xff, vector,
-							       request->password->vp_strvalue,
-							       request->password->vp_length);
-				fr_pair_value_memdup(vp, buffer, sizeof(buffer), false);
-
-			} else if (fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_password) != NULL) {
-				mschapv1_encode(request->packet, &request->request_pairs, request->password->vp_strvalue);
-
-			} else {
-				DEBUG("WARNING: No password in the request");
-			}
-		}
+		if (request->password) request_password_update(request);
 
 		request->timestamp = fr_time();
 		request->tries = 1;
@@ -1112,6 +1124,624 @@ packet_done:
 	return 0;
 }
 
+/*
+ *	Load testing.
+ *
+ *	The requests read from the input files are used as templates,
+ *	which are sent round-robin.  Sending is paced by the load
+ *	generator, and not by the replies, so the offered load doesn't
+ *	drop when the server slows down.  Packets aren't retransmitted,
+ *	and replies aren't decoded or filtered.
+ */
+#ifndef MSG_WAITFORONE
+static int sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < vlen; i++) {
+		ssize_t slen;
+
+		slen = sendmsg(fd, &msgvec[i].msg_hdr, flags);
+		if (slen < 0) return (i > 0) ? (int) i : -1;
+
+		msgvec[i].msg_len = slen;
+	}
+
+	return i;
+}
+
+static int recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags, UNUSED struct timespec *timeout)
+{
+	unsigned int i;
+
+	for (i = 0; i < vlen; i++) {
+		ssize_t slen;
+
+		slen = recvmsg(fd, &msgvec[i].msg_hdr, flags);
+		if (slen < 0) return (i > 0) ? (int) i : -1;
+
+		msgvec[i].msg_len = slen;
+	}
+
+	return i;
+}
+#endif
+
+static fr_load_config_t load_config;
+static bool		load_test = false;
+static int		load_threads = 1;
+static int		load_sockets = 1;
+
+/** Tell the load generator we're finished with a packet
+ *
+ * Lost packets count as replies, otherwise the load generator would
+ * wait forever for them.
+ */
+static void rc_load_reply_done(rc_load_thread_t *thread, fr_time_t start)
+{
+	if (fr_load_generator_have_reply(thread->l, start) == FR_LOAD_DONE) fr_event_loop_exit(thread->el, 1);
+}
+
+static void rc_load_timeout(fr_event_list_t *el, fr_time_t now, void *uctx);
+
+/** Set the timer for the oldest outstanding packet
+ *
+ */
+static void rc_load_timer_set(rc_load_thread_t *thread)
+{
+	rc_load_slot_t *slot;
+
+	slot = fr_dlist_head(&thread->outstanding);
+	if (!slot) {
+		if (thread->ev) fr_event_timer_delete(&thread->ev);
+		return;
+	}
+
+	if (fr_event_timer_at(thread->ctx, thread->el, &thread->ev, slot->start + timeout,
+			      rc_load_timeout, thread) < 0) {
+		fr_perror("radclient: Failed inserting timer");
+		fr_exit_now(1);
+	}
+}
+
+/** Release the ID used by a packet
+ *
+ */
+static void rc_load_slot_free(rc_load_thread_t *thread, rc_load_slot_t *slot)
+{
+	fr_dlist_remove(&thread->outstanding, slot);
+	slot->active = false;
+	slot->sock->outstanding--;
+
+	/*
+	 *	Don't leave a timer running when there's nothing
+	 *	left to time out.  Otherwise the event loop can't
+	 *	tell that the test is over.
+	 */
+	if (fr_dlist_empty(&thread->outstanding) && thread->ev) fr_event_timer_delete(&thread->ev);
+}
+
+/** Expire packets which have had no reply
+ *
+ */
+static void rc_load_timeout(UNUSED fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	rc_load_thread_t	*thread = uctx;
+	rc_load_slot_t		*slot;
+
+	while ((slot = fr_dlist_head(&thread->outstanding)) != NULL) {
+		fr_time_t start = slot->start;
+
+		if ((start + timeout) > now) break;
+
+		thread->stats.lost++;
+		rc_load_slot_free(thread, slot);
+		rc_load_reply_done(thread, start);
+	}
+
+	rc_load_timer_set(thread);
+}
+
+/** Send all of the queued packets
+ *
+ */
+static void rc_load_flush(rc_load_thread_t *thread)
+{
+	rc_load_socket_t	*sock = thread->batch_sock;
+	int			i, num = thread->batch_num, sent;
+	uint8_t			failed[RC_LOAD_BATCH];
+
+	if (!num) return;
+
+	sent = sendmmsg(sock->fd, thread->batch, num, 0);
+	if (sent < 0) {
+		ERROR("Failed sending packets: %s", fr_syserror(errno));
+		sent = 0;
+	}
+	thread->stats.sent += sent;
+
+	/*
+	 *	Telling the load generator about failures may
+	 *	queue more packets, so the batch has to be empty
+	 *	first.
+	 */
+	for (i = sent; i < num; i++) failed[i] = thread->batch_data[i][1];
+	thread->batch_num = 0;
+	thread->batch_sock = NULL;
+
+	/*
+	 *	Anything the kernel wouldn't take is treated as
+	 *	failed.
+	 */
+	for (i = sent; i < num; i++) {
+		rc_load_slot_t	*slot = &sock->slot[failed[i]];
+		fr_time_t	start = slot->start;
+
+		thread->stats.failed++;
+		rc_load_slot_free(thread, slot);
+		rc_load_reply_done(thread, start);
+	}
+}
+
+/** Send queued packets at the end of every event loop pass
+ *
+ * Also notices when the load generator is done, and there's
+ * nothing left to wait for.
+ */
+static void rc_load_post(fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rc_load_thread_t *thread = uctx;
+
+	rc_load_flush(thread);
+
+	if ((fr_event_list_num_timers(el) == 0) && fr_dlist_empty(&thread->outstanding)) fr_event_loop_exit(el, 1);
+}
+
+static void rc_load_recv(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx);
+
+static void rc_load_socket_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				 int fd_errno, UNUSED void *uctx)
+{
+	ERROR("Socket error: %s", fr_syserror(fd_errno));
+	fr_exit_now(1);
+}
+
+static int _rc_load_socket_free(rc_load_socket_t *sock)
+{
+	if (sock->fd >= 0) {
+		fr_event_fd_delete(sock->thread->el, sock->fd, FR_EVENT_FILTER_IO);
+		close(sock->fd);
+	}
+
+	return 0;
+}
+
+/** Open another source socket, with another 256 IDs
+ *
+ */
+static rc_load_socket_t *rc_load_socket_alloc(rc_load_thread_t *thread)
+{
+	rc_load_socket_t	*sock;
+	struct sockaddr_storage	dst;
+	socklen_t		dst_len;
+	uint16_t		port = 0;
+	fr_ipaddr_t const	*dst_ipaddr = &request_head->packet->socket.inet.dst_ipaddr;
+	uint16_t		dst_port = request_head->packet->socket.inet.dst_port;
+
+	if (thread->num_sockets == RC_LOAD_MAX_SOCKETS) return NULL;
+
+	MEM(sock = talloc_zero(thread->ctx, rc_load_socket_t));
+	sock->thread = thread;
+
+	sock->fd = fr_socket_server_udp(&client_ipaddr, &port, NULL, true);
+	if (sock->fd < 0) {
+		fr_perror("Error opening socket");
+	error:
+		talloc_free(sock);
+		return NULL;
+	}
+	talloc_set_destructor(sock, _rc_load_socket_free);
+
+	if (fr_socket_bind(sock->fd, &client_ipaddr, &port, NULL) < 0) {
+		fr_perror("Error binding socket");
+		goto error;
+	}
+
+	/*
+	 *	All packets go to the same server, so the socket can
+	 *	be connected.  The kernel then filters out packets
+	 *	from anywhere else.
+	 */
+	if ((fr_ipaddr_to_sockaddr(&dst, &dst_len, dst_ipaddr, dst_port) < 0) ||
+	    (connect(sock->fd, (struct sockaddr *) &dst, dst_len) < 0)) {
+		ERROR("Error connecting socket: %s", fr_syserror(errno));
+		goto error;
+	}
+	sock->port = port;
+
+	if (fr_event_fd_insert(sock, thread->el, sock->fd, rc_load_recv, NULL, rc_load_socket_error, sock) < 0) {
+		fr_perror("Failed inserting socket");
+		goto error;
+	}
+
+	thread->sockets[thread->num_sockets++] = sock;
+
+	return sock;
+}
+
+/** Find a socket with a free ID
+ *
+ * Each batch of packets uses one socket, so that it can be sent with
+ * one system call.  Consecutive batches use different sockets, which
+ * spreads the load over the server's receive queues.
+ */
+static rc_load_socket_t *rc_load_socket_get(rc_load_thread_t *thread)
+{
+	rc_load_socket_t	*sock;
+	int			i;
+
+	sock = thread->batch_sock;
+	if (sock && (sock->outstanding < 256)) return sock;
+
+	rc_load_flush(thread);
+
+	for (i = 0; i < thread->num_sockets; i++) {
+		sock = thread->sockets[thread->next_socket++];
+		if (thread->next_socket == thread->num_sockets) thread->next_socket = 0;
+
+		if (sock->outstanding < 256) goto done;
+	}
+
+	/*
+	 *	All of the IDs are in use.
+	 */
+	sock = rc_load_socket_alloc(thread);
+	if (!sock) return NULL;
+
+done:
+	thread->batch_sock = sock;
+	return sock;
+}
+
+/** Encode a packet and queue it for sending
+ *
+ * Called by the load generator.
+ */
+static int rc_load_send(fr_time_t now, void *uctx)
+{
+	rc_load_thread_t	*thread = uctx;
+	rc_request_t		*request = thread->next_request;
+	rc_load_socket_t	*sock;
+	rc_load_slot_t		*slot;
+	uint8_t			*packet;
+	ssize_t			slen;
+	int			i;
+
+	thread->next_request = request->next ? request->next : request_head;
+
+	sock = rc_load_socket_get(thread);
+	if (!sock) {
+		thread->stats.no_id++;
+		rc_load_reply_done(thread, now);
+		return 0;
+	}
+
+	while (sock->slot[sock->next_id].active) sock->next_id++;
+	slot = &sock->slot[sock->next_id];
+
+	/*
+	 *	Each packet gets a new Request Authenticator, so the
+	 *	server doesn't treat a packet which reuses an ID as
+	 *	a duplicate.
+	 */
+	packet = thread->batch_data[thread->batch_num];
+	for (i = 0; i < 4; i++) ((uint32_t *) (packet + 4))[i] = fr_rand();
+
+	slen = fr_radius_encode(packet, RADIUS_MAX_PACKET_SIZE, NULL, secret, talloc_array_length(secret) - 1,
+				request->packet->code, sock->next_id, request->request_pairs);
+	if ((slen < 0) ||
+	    (fr_radius_sign(packet, NULL, (uint8_t const *) secret, talloc_array_length(secret) - 1) < 0)) {
+		fr_perror("radclient: Failed encoding packet");
+		thread->stats.failed++;
+		rc_load_reply_done(thread, now);
+		return 0;
+	}
+	sock->next_id++;
+
+	slot->sock = sock;
+	slot->start = now;
+	slot->active = true;
+	memcpy(slot->header, packet, sizeof(slot->header));
+	sock->outstanding++;
+
+	fr_dlist_insert_tail(&thread->outstanding, slot);
+	if (!thread->ev) rc_load_timer_set(thread);
+
+	thread->batch_iov[thread->batch_num].iov_len = slen;
+	thread->batch_num++;
+
+	if (thread->batch_num == RC_LOAD_BATCH) rc_load_flush(thread);
+
+	return 0;
+}
+
+/** Process one reply
+ *
+ */
+static void rc_load_reply(rc_load_thread_t *thread, rc_load_socket_t *sock, uint8_t *data, size_t data_len,
+			  fr_time_t now)
+{
+	rc_load_slot_t	*slot;
+	fr_time_t	start;
+	size_t		packet_len = data_len;
+	decode_fail_t	reason;
+
+	if (!fr_radius_ok(data, &packet_len, RADIUS_MAX_ATTRIBUTES, false, &reason)) {
+		thread->stats.invalid++;
+		return;
+	}
+
+	slot = &sock->slot[data[1]];
+	if (!slot->active) {
+		thread->stats.unexpected++;
+		return;
+	}
+
+	/*
+	 *	Not a real reply.  Keep waiting for one.
+	 */
+	if (fr_radius_verify(data, slot->header, (uint8_t const *) secret, talloc_array_length(secret) - 1) < 0) {
+		thread->stats.invalid++;
+		return;
+	}
+
+	start = slot->start;
+	fr_histogram_add(thread->latency, fr_time_delta_to_usec(now - start));
+
+	switch (data[0]) {
+	case FR_CODE_ACCESS_ACCEPT:
+	case FR_CODE_ACCOUNTING_RESPONSE:
+	case FR_CODE_COA_ACK:
+	case FR_CODE_DISCONNECT_ACK:
+		thread->stats.accepted++;
+		break;
+
+	case FR_CODE_ACCESS_CHALLENGE:
+		break;
+
+	default:
+		thread->stats.rejected++;
+	}
+	thread->stats.received++;
+
+	rc_load_slot_free(thread, slot);
+	rc_load_reply_done(thread, start);
+}
+
+/** Read as many replies as are available
+ *
+ */
+static void rc_load_recv(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	rc_load_socket_t	*sock = uctx;
+	rc_load_thread_t	*thread = sock->thread;
+	int			i, received;
+	fr_time_t		now;
+
+	do {
+		received = recvmmsg(sock->fd, thread->rx, RC_LOAD_BATCH, MSG_DONTWAIT, NULL);
+		if (received <= 0) break;
+
+		now = fr_time();
+		for (i = 0; i < received; i++) {
+			rc_load_reply(thread, sock, thread->rx_data[i], thread->rx[i].msg_len, now);
+		}
+	} while (received == RC_LOAD_BATCH);
+}
+
+/** Run one share of the load
+ *
+ */
+static void *rc_load_thread(void *uctx)
+{
+	rc_load_thread_t	*thread = uctx;
+	int			i;
+
+	thread->el = fr_event_list_alloc(thread->ctx, NULL, NULL);
+	if (!thread->el) {
+		fr_perror("radclient: Failed creating event list");
+	error:
+		thread->error = true;
+		return NULL;
+	}
+
+	fr_dlist_init(&thread->outstanding, rc_load_slot_t, entry);
+	thread->next_request = request_head;
+
+	for (i = 0; i < RC_LOAD_BATCH; i++) {
+		thread->batch_iov[i].iov_base = thread->batch_data[i];
+		thread->batch[i].msg_hdr.msg_iov = &thread->batch_iov[i];
+		thread->batch[i].msg_hdr.msg_iovlen = 1;
+
+		thread->rx_iov[i].iov_base = thread->rx_data[i];
+		thread->rx_iov[i].iov_len = sizeof(thread->rx_data[i]);
+		thread->rx[i].msg_hdr.msg_iov = &thread->rx_iov[i];
+		thread->rx[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (i = 0; i < load_sockets; i++) if (!rc_load_socket_alloc(thread)) goto error;
+
+	thread->latency = fr_histogram_alloc(thread->ctx, 5, fr_time_delta_to_usec(timeout));
+	if (!thread->latency) {
+		fr_perror("radclient");
+		goto error;
+	}
+
+	thread->l = fr_load_generator_create(thread->ctx, thread->el, &thread->config, rc_load_send, thread);
+	if (!thread->l) {
+		ERROR("Failed creating load generator");
+		goto error;
+	}
+
+	if (fr_event_post_insert(thread->el, rc_load_post, thread) < 0) {
+		fr_perror("radclient");
+		goto error;
+	}
+
+	fr_load_generator_start(thread->l);
+	fr_event_loop(thread->el);
+	fr_load_generator_stop(thread->l);
+
+	return NULL;
+}
+
+/** Divide a rate between the threads
+ *
+ */
+static inline uint32_t rc_load_share(uint32_t value, int id)
+{
+	return (value / load_threads) + (((uint32_t) id < (value % load_threads)) ? 1 : 0);
+}
+
+/** Run the load test, and print the results
+ *
+ */
+static int rc_load_run(void)
+{
+	rc_request_t		*request;
+	rc_load_thread_t	*threads;
+	rc_load_stats_t		total = { 0 };
+	fr_histogram_t		*latency;
+	fr_time_t		start;
+	double			elapsed;
+	int			i;
+
+	/*
+	 *	CHAP-Password is normally calculated from the Request
+	 *	Authenticator, which changes with every packet.  Add
+	 *	a fixed CHAP-Challenge instead, so the passwords only
+	 *	need to be calculated once.
+	 */
+	for (request = request_head; request; request = request->next) {
+		if (!request->password) continue;
+
+		if (fr_pair_find_by_da(&request->request_pairs, attr_chap_password) &&
+		    !fr_pair_find_by_da(&request->request_pairs, attr_chap_challenge)) {
+			fr_pair_t *vp;
+
+			MEM(pair_update_request(&vp, attr_chap_challenge) >= 0);
+			fr_pair_value_memdup(vp, request->packet->vector, sizeof(request->packet->vector), false);
+		}
+
+		request_password_update(request);
+	}
+
+	threads = talloc_zero_array(NULL, rc_load_thread_t, load_threads);
+	if (!threads) {
+	oom:
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	latency = fr_histogram_alloc(threads, 5, fr_time_delta_to_usec(timeout));
+	if (!latency) goto oom;
+
+	start = fr_time();
+	for (i = 0; i < load_threads; i++) {
+		rc_load_thread_t	*thread = &threads[i];
+		uint64_t		backlog;
+		int			ret;
+
+		thread->id = i;
+		thread->ctx = talloc_new(NULL);
+		if (!thread->ctx) goto oom;
+
+		thread->config = load_config;
+		thread->config.start_pps = rc_load_share(load_config.start_pps, i);
+		thread->config.max_pps = rc_load_share(load_config.max_pps, i);
+		thread->config.step = rc_load_share(load_config.step, i);
+		if (!thread->config.step) thread->config.step = 1;
+
+		/*
+		 *	Run the timer roughly every millisecond,
+		 *	rather than once per packet.
+		 */
+		thread->config.parallel = thread->config.start_pps / 1000;
+		if (thread->config.parallel < 1) thread->config.parallel = 1;
+		if (thread->config.parallel > RC_LOAD_BATCH) thread->config.parallel = RC_LOAD_BATCH;
+
+		/*
+		 *	Allow the backlog to grow to whatever can be
+		 *	sent within one timeout, which means the
+		 *	generator never waits for replies.  The limit
+		 *	is so that pps * milliseconds fits in 32 bits.
+		 */
+		backlog = fr_time_delta_to_msec(timeout);
+		if ((backlog * thread->config.max_pps) > UINT32_MAX) backlog = UINT32_MAX / thread->config.max_pps;
+		thread->config.milliseconds = backlog;
+
+		ret = pthread_create(&thread->pthread_id, NULL, rc_load_thread, thread);
+		if (ret != 0) {
+			ERROR("Failed creating thread: %s", fr_syserror(ret));
+			fr_exit_now(1);
+		}
+	}
+
+	for (i = 0; i < load_threads; i++) {
+		rc_load_thread_t *thread = &threads[i];
+
+		pthread_join(thread->pthread_id, NULL);
+		if (thread->error) fr_exit_now(1);
+
+		total.sent += thread->stats.sent;
+		total.received += thread->stats.received;
+		total.accepted += thread->stats.accepted;
+		total.rejected += thread->stats.rejected;
+		total.lost += thread->stats.lost;
+		total.invalid += thread->stats.invalid;
+		total.unexpected += thread->stats.unexpected;
+		total.no_id += thread->stats.no_id;
+		total.failed += thread->stats.failed;
+
+		(void) fr_histogram_merge(latency, thread->latency);
+
+		talloc_free(thread->ctx);
+	}
+	elapsed = fr_time_delta_to_msec(fr_time() - start) / 1000.0;
+
+	fr_perror("Load test summary:\n"
+		  "\tThreads       : %i\n"
+		  "\tDuration      : %.3f s\n"
+		  "\tSent          : %" PRIu64 "\n"
+		  "\tReceived      : %" PRIu64 " (%.1f/s)\n"
+		  "\tAccepted      : %" PRIu64 "\n"
+		  "\tRejected      : %" PRIu64 "\n"
+		  "\tLost          : %" PRIu64 "\n"
+		  "\tInvalid       : %" PRIu64 "\n"
+		  "\tUnexpected    : %" PRIu64 "\n"
+		  "\tNo free ID    : %" PRIu64 "\n"
+		  "\tSend failed   : %" PRIu64 "\n"
+		  "\tLatency p50   : %.3f ms\n"
+		  "\tLatency p90   : %.3f ms\n"
+		  "\tLatency p99   : %.3f ms\n"
+		  "\tLatency p99.9 : %.3f ms\n"
+		  "\tLatency max   : %.3f ms",
+		  load_threads, elapsed,
+		  total.sent,
+		  total.received, elapsed > 0 ? total.received / elapsed : 0,
+		  total.accepted, total.rejected, total.lost, total.invalid, total.unexpected,
+		  total.no_id, total.failed,
+		  fr_histogram_percentile(latency, 50) / 1000.0,
+		  fr_histogram_percentile(latency, 90) / 1000.0,
+		  fr_histogram_percentile(latency, 99) / 1000.0,
+		  fr_histogram_percentile(latency, 99.9) / 1000.0,
+		  fr_histogram_max(latency) / 1000.0);
+
+	talloc_free(threads);
+
+	return (total.received > 0) ? 0 : -1;
+}
+
 int main(int argc, char **argv)
 {
 	int		c;
@@ -1164,7 +1794,7 @@ int main(int argc, char **argv)
 	default_log.fd = STDOUT_FILENO;
 	default_log.print_level = false;
 
-	while ((c = getopt(argc, argv, "46c:C:d:D:f:Fhi:n:p:P:r:sS:t:vx")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "46c:C:d:D:f:Fhi:l:L:n:N:p:P:r:sS:t:T:vx")) != -1) switch (c) {
 		case '4':
 			force_af = AF_INET;
 			break;
@@ -1234,11 +1864,42 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'l':
+			load_config.duration = atoi(optarg);
+			if (load_config.duration == 0) usage();
+			break;
+
+		case 'L':
+		{
+			char *p;
+
+			load_config.start_pps = strtoul(optarg, &p, 10);
+			load_config.max_pps = load_config.start_pps;
+			if (*p == ':') {
+				load_config.max_pps = strtoul(p + 1, &p, 10);
+				if (*p == ':') load_config.step = strtoul(p + 1, &p, 10);
+			}
+			if (*p || !load_config.start_pps || (load_config.max_pps < load_config.start_pps)) usage();
+
+			/*
+			 *	For a fixed rate, any step will end the
+			 *	test after the first one.
+			 */
+			if (!load_config.step) load_config.step = load_config.start_pps;
+			load_test = true;
+		}
+			break;
+
 		case 'n':
 			persec = atoi(optarg);
 			if (persec <= 0) usage();
 			break;
 
+		case 'N':
+			load_sockets = atoi(optarg);
+			if ((load_sockets < 1) || (load_sockets > RC_LOAD_MAX_SOCKETS)) usage();
+			break;
+
 			/*
 			 *	Note that sending MANY requests in
 			 *	parallel can over-run the kernel
@@ -1308,6 +1969,11 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'T':
+			load_threads = atoi(optarg);
+			if (load_threads < 1) usage();
+			break;
+
 		case 'v':
 			fr_debug_lvl = 1;
 			DEBUG("%s", radclient_version);
@@ -1329,6 +1995,20 @@ int main(int argc, char **argv)
 		ERROR("Insufficient arguments");
 		usage();
 	}
+
+	if (load_test) {
+		if (ipproto != IPPROTO_UDP) {
+			ERROR("Load tests can only be run over UDP");
+			usage();
+		}
+
+		if ((uint32_t) load_threads > load_config.start_pps) {
+			ERROR("Load tests need at least one packet/s per thread");
+			usage();
+		}
+
+		if (!load_config.duration) load_config.duration = 10;
+	}
 	/*
 	 *	Mismatch between the binary and the libraries it depends on
 	 */
@@ -1482,6 +2162,11 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 *	Load tests replace the normal send / receive loop.
+	 */
+	if (load_test) fr_exit_now((rc_load_run() < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+
 	/*
 	 *	Walk over the packets to send, until
 	 *	we're all done.
@@ -26,6 +26,11 @@
 RCSIDH(radclient_h, "$Id$")
 
 #include <freeradius-devel/util/base.h>
+#include <freeradius-devel/util/histogram.h>
+#include <freeradius-devel/io/load.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -89,6 +94,99 @@ struct rc_request {
 	char const	*name;		//!< Test name (as specified in the request).
 };
 
+#define RC_LOAD_BATCH		64	//!< Maximum packets per sendmmsg() / recvmmsg() call.
+#define RC_LOAD_MAX_SOCKETS	1024	//!< Maximum source sockets per load test thread.
+
+#ifndef MSG_WAITFORONE
+/*
+ *	Platforms without sendmmsg() / recvmmsg() send and
+ *	receive one packet per system call.
+ */
+struct mmsghdr {
+	struct msghdr	msg_hdr;
+	unsigned int	msg_len;
+};
+#endif
+
+typedef struct rc_load_thread_s rc_load_thread_t;
+typedef struct rc_load_socket_s rc_load_socket_t;
+
+/** A packet sent during a load test, which is waiting for a reply
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the thread's list of outstanding packets.
+	rc_load_socket_t	*sock;		//!< Socket the packet was sent on.
+	fr_time_t		start;		//!< When the load generator asked for the packet.
+	uint8_t			header[RADIUS_HEADER_LENGTH];	//!< Code, ID and Request Authenticator,
+							//!< used to verify the reply.
+	bool			active;		//!< Whether the ID is in use.
+} rc_load_slot_t;
+
+/** A source socket, which has its own 256 RADIUS IDs
+ *
+ */
+struct rc_load_socket_s {
+	int			fd;		//!< Connected to the server.
+	uint16_t		port;		//!< Local port.
+	rc_load_thread_t	*thread;	//!< Thread which owns the socket.
+
+	int			outstanding;	//!< Number of IDs in use.
+	uint8_t			next_id;	//!< Where to start looking for a free ID.
+	rc_load_slot_t		slot[256];	//!< Indexed by RADIUS ID.
+};
+
+typedef struct {
+	uint64_t		sent;		//!< Packets sent.
+	uint64_t		received;	//!< Valid replies received.
+	uint64_t		accepted;	//!< Replies which were an ACK of some kind.
+	uint64_t		rejected;	//!< Replies which were a NAK of some kind.
+	uint64_t		lost;		//!< Packets which timed out.
+	uint64_t		invalid;	//!< Replies which failed verification.
+	uint64_t		unexpected;	//!< Replies to IDs which weren't in use.
+	uint64_t		no_id;		//!< Packets not sent because all IDs were in use.
+	uint64_t		failed;		//!< Packets which couldn't be encoded or sent.
+} rc_load_stats_t;
+
+/** A thread which sends a share of the load
+ *
+ * Each thread has its own event list, load generator, sockets and
+ * statistics.  Nothing is shared between threads, except the request
+ * templates, which are read-only.
+ */
+struct rc_load_thread_s {
+	int			id;		//!< Thread number.
+	pthread_t		pthread_id;
+	TALLOC_CTX		*ctx;		//!< Thread specific talloc tree.
+	fr_event_list_t		*el;
+
+	fr_load_config_t	config;		//!< This thread's share of the load.
+	fr_load_t		*l;
+
+	rc_load_socket_t	*sockets[RC_LOAD_MAX_SOCKETS];
+	int			num_sockets;
+	int			next_socket;	//!< Socket to use for the next batch.
+
+	rc_request_t		*next_request;	//!< Template for the next packet.
+
+	fr_dlist_head_t		outstanding;	//!< Packets waiting for replies, oldest first.
+	fr_event_timer_t const	*ev;		//!< Fires when the oldest packet times out.
+
+	rc_load_socket_t	*batch_sock;	//!< Socket the queued packets will be sent on.
+	int			batch_num;	//!< Number of queued packets.
+	struct mmsghdr		batch[RC_LOAD_BATCH];
+	struct iovec		batch_iov[RC_LOAD_BATCH];
+	uint8_t			batch_data[RC_LOAD_BATCH][RADIUS_MAX_PACKET_SIZE];
+
+	struct mmsghdr		rx[RC_LOAD_BATCH];
+	struct iovec		rx_iov[RC_LOAD_BATCH];
+	uint8_t			rx_data[RC_LOAD_BATCH][RADIUS_MAX_PACKET_SIZE];
+
+	rc_load_stats_t		stats;
+	fr_histogram_t		*latency;	//!< Time from request to reply, in microseconds.
+	bool			error;		//!< The thread couldn't start.
+};
+
 #ifdef __cplusplus
 }
 #endif
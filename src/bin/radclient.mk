@@ -1,6 +1,7 @@
 TARGET		:= radclient
 SOURCES		:= radclient.c ${top_srcdir}/src/modules/rlm_mschap/smbdes.c \
-		   ${top_srcdir}/src/modules/rlm_mschap/mschap.c
+		   ${top_srcdir}/src/modules/rlm_mschap/mschap.c \
+		   ${top_srcdir}/src/lib/io/load.c
 
 TGT_PREREQS	:= libfreeradius-util.a libfreeradius-radius.a
 
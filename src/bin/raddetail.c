@@ -0,0 +1,533 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file raddetail.c
+ * @brief Convert detail files between the text and binary formats, and index binary files.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/internal/detail.h>
+#include <freeradius-devel/util/base.h>
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/pair_legacy.h>
+#include <freeradius-devel/util/syserror.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+#define DEBUG(fmt, ...)		if (fr_log_fp && (fr_debug_lvl > 0)) fprintf(fr_log_fp , fmt "\n", ## __VA_ARGS__)
+
+static fr_dict_t	*dict_freeradius;
+static fr_dict_t	*dict;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: raddetail [OPTS] <file>\n");
+	fprintf(stderr, "Converts a text detail file to the binary format, or a binary one to text.\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -I                     Only (re)build the index for a binary detail file.\n");
+	fprintf(stderr, "  -i <records>           Write an index entry every <records> records.  Requires -o.\n");
+	fprintf(stderr, "  -o <file>              Write the output to <file> instead of stdout.\n");
+	fprintf(stderr, "  -p <protocol>          Protocol of the packets in the file (defaults to radius).\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+/** Set the header fields which the text format writes as attributes
+ *
+ * @return
+ *	- true if the line was one of the header fields, and should be freed.
+ *	- false if it's a normal attribute.
+ */
+static bool text_hdr_field(fr_detail_binary_t *hdr, fr_pair_t const *vp)
+{
+	char const *name = vp->da->name;
+
+	if (strcmp(name, "Packet-Type") == 0) {
+		hdr->code = vp->vp_uint32;
+		return true;
+	}
+
+	if ((strcmp(name, "Packet-Src-IP-Address") == 0) || (strcmp(name, "Packet-Src-IPv6-Address") == 0)) {
+		hdr->src_ipaddr = vp->vp_ip;
+		return true;
+	}
+
+	if ((strcmp(name, "Packet-Dst-IP-Address") == 0) || (strcmp(name, "Packet-Dst-IPv6-Address") == 0)) {
+		hdr->dst_ipaddr = vp->vp_ip;
+		return true;
+	}
+
+	if (strcmp(name, "Packet-Src-Port") == 0) {
+		hdr->src_port = vp->vp_uint16;
+		return true;
+	}
+
+	if (strcmp(name, "Packet-Dst-Port") == 0) {
+		hdr->dst_port = vp->vp_uint16;
+		return true;
+	}
+
+	return false;
+}
+
+/** Encode one text record, and write it out
+ *
+ */
+static int text_record_write(FILE *out, fr_detail_binary_t *hdr, fr_pair_t **vps)
+{
+	fr_dbuff_t		dbuff;
+	fr_dbuff_uctx_talloc_t	tctx;
+	fr_cursor_t		cursor;
+	ssize_t			slen;
+	int			ret = 0;
+
+	/*
+	 *	Both addresses have to be there, or neither.
+	 */
+	if (hdr->src_ipaddr.af != hdr->dst_ipaddr.af) hdr->src_ipaddr.af = hdr->dst_ipaddr.af = AF_UNSPEC;
+
+	if (!fr_dbuff_init_talloc(NULL, &dbuff, &tctx, 4096, FR_DETAIL_BINARY_HDR_LEN + FR_DETAIL_BINARY_MAX_LEN)) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	fr_cursor_init(&cursor, vps);
+	slen = fr_detail_binary_encode(&dbuff, hdr, &cursor, dict);
+	if (slen < 0) {
+		ret = -1;
+	} else if (fwrite(fr_dbuff_start(&dbuff), slen, 1, out) != 1) {
+		fr_strerror_printf("Failed writing record: %s", fr_syserror(errno));
+		ret = -1;
+	}
+
+	talloc_free(fr_dbuff_buff(&dbuff));
+
+	return ret;
+}
+
+/** Convert a text detail file to binary records
+ *
+ */
+static int text_to_binary(FILE *in, FILE *out)
+{
+	char			buffer[8192];
+	fr_pair_t		*vps = NULL;
+	fr_detail_binary_t	hdr;
+	bool			in_record = false, done = false;
+	int			lineno = 0, records = 0, ret = -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	for (;;) {
+		fr_pair_t	*vp;
+		char		*p;
+		bool		eof;
+
+		eof = (fgets(buffer, sizeof(buffer), in) == NULL);
+		if (eof) {
+			if (ferror(in)) {
+				fr_strerror_printf("Failed reading input: %s", fr_syserror(errno));
+				goto error;
+			}
+			buffer[0] = '\0';
+		}
+
+		lineno++;
+
+		p = strchr(buffer, '\n');
+		if (p) *p = '\0';
+
+		/*
+		 *	A blank line ends the record, as does the end
+		 *	of the file.
+		 */
+		if (!buffer[0]) {
+			if (in_record && !done) {
+				if (text_record_write(out, &hdr, &vps) < 0) goto error;
+				records++;
+			}
+
+			fr_pair_list_free(&vps);
+			memset(&hdr, 0, sizeof(hdr));
+			in_record = done = false;
+
+			if (eof) break;
+			continue;
+		}
+
+		/*
+		 *	The date line starts a record.
+		 */
+		if (buffer[0] != '\t') {
+			if (in_record) {
+				fr_strerror_printf("Line %d: Missing blank line before record", lineno);
+				goto error;
+			}
+			in_record = true;
+			continue;
+		}
+
+		if (!in_record) {
+			fr_strerror_printf("Line %d: Attribute outside of a record", lineno);
+			goto error;
+		}
+
+		p = buffer + 1;
+
+		if (strncasecmp(p, "Request-Authenticator", 21) == 0) continue;
+
+		/*
+		 *	Records which the detail reader has already
+		 *	processed don't need to be converted.
+		 */
+		if (strncasecmp(p, "Done", 4) == 0) {
+			done = true;
+			continue;
+		}
+
+		if (strncasecmp(p, "Timestamp = ", 12) == 0) {
+			hdr.timestamp = ((fr_unix_time_t) strtoull(p + 12, NULL, 10)) * NSEC;
+			continue;
+		}
+
+		vp = NULL;
+		if ((fr_pair_list_afrom_str(NULL, dict, p, &vp) <= 0) || !vp) {
+			fr_strerror_printf_push("Line %d: Failed parsing attribute", lineno);
+			goto error;
+		}
+
+		if (text_hdr_field(&hdr, vp)) {
+			fr_pair_list_free(&vp);
+			continue;
+		}
+
+		fr_pair_add(&vps, vp);
+	}
+
+	DEBUG("Wrote %d records", records);
+	ret = 0;
+
+error:
+	fr_pair_list_free(&vps);
+	return ret;
+}
+
+/** Print the header fields in the same way as rlm_detail
+ *
+ */
+static void binary_hdr_print(FILE *out, fr_detail_binary_t const *hdr)
+{
+	fr_dict_attr_t const	*da;
+	char const		*name = NULL;
+	char			buffer[FR_IPADDR_STRLEN];
+	time_t			when = hdr->timestamp / NSEC;
+	struct tm		tm;
+
+	localtime_r(&when, &tm);
+	strftime(buffer, sizeof(buffer), "%a %b %e %H:%M:%S %Y", &tm);
+	fprintf(out, "%s\n", buffer);
+
+	da = fr_dict_attr_by_name(dict, "Packet-Type");
+	if (da) name = fr_dict_enum_name_by_value(da, fr_box_uint32(hdr->code));
+	if (name) {
+		fprintf(out, "\tPacket-Type = %s\n", name);
+	} else {
+		fprintf(out, "\tPacket-Type = %u\n", hdr->code);
+	}
+
+	if (hdr->src_ipaddr.af == AF_UNSPEC) return;
+
+	fprintf(out, "\tPacket-Src-%s-Address = %s\n", (hdr->src_ipaddr.af == AF_INET) ? "IP" : "IPv6",
+		fr_inet_ntop(buffer, sizeof(buffer), &hdr->src_ipaddr));
+	fprintf(out, "\tPacket-Dst-%s-Address = %s\n", (hdr->dst_ipaddr.af == AF_INET) ? "IP" : "IPv6",
+		fr_inet_ntop(buffer, sizeof(buffer), &hdr->dst_ipaddr));
+	fprintf(out, "\tPacket-Src-Port = %u\n", hdr->src_port);
+	fprintf(out, "\tPacket-Dst-Port = %u\n", hdr->dst_port);
+}
+
+/** Convert binary records to the text format
+ *
+ * Damaged records are skipped, and we look for the next sync marker.
+ */
+static int binary_to_text(uint8_t const *data, size_t data_len, FILE *out)
+{
+	uint8_t const		*p = data, *end = data + data_len;
+	int			records = 0, damaged = 0;
+
+	while (p < end) {
+		fr_detail_binary_t	hdr;
+		fr_pair_t		*vps = NULL, *vp;
+		fr_cursor_t		cursor;
+		ssize_t			slen;
+
+		slen = fr_detail_binary_hdr_decode(&hdr, p, end - p);
+		if (slen == 0) {
+			fr_strerror_printf("Truncated record at offset %zu", (size_t) (p - data));
+			fr_perror("raddetail");
+			damaged++;
+			break;
+		}
+
+		if ((slen < 0) || (fr_detail_binary_verify(p, end - p) < 0)) {
+			fr_strerror_printf_push("Damaged record at offset %zu", (size_t) (p - data));
+			fr_perror("raddetail");
+			damaged++;
+
+		resync:
+			slen = fr_detail_binary_sync(p + 1, (end - p) - 1);
+			if (slen < 0) break;
+
+			p += slen + 1;
+			continue;
+		}
+
+		fr_cursor_init(&cursor, &vps);
+		if (fr_detail_binary_decode_pairs(NULL, &cursor, dict, p + FR_DETAIL_BINARY_HDR_LEN, hdr.length) < 0) {
+			fr_strerror_printf_push("Failed decoding record at offset %zu", (size_t) (p - data));
+			fr_perror("raddetail");
+			fr_pair_list_free(&vps);
+			damaged++;
+			goto resync;
+		}
+
+		binary_hdr_print(out, &hdr);
+
+		for (vp = fr_cursor_head(&cursor); vp; vp = fr_cursor_next(&cursor)) {
+			vp->op = T_OP_EQ;
+			fr_pair_fprint(out, vp);
+		}
+		fr_pair_list_free(&vps);
+
+		if (hdr.flags & FR_DETAIL_BINARY_FLAG_DONE) fprintf(out, "\tDone = yes\n");
+		fprintf(out, "\tTimestamp = %" PRIu64 "\n\n", (uint64_t) (hdr.timestamp / NSEC));
+
+		records++;
+		p += FR_DETAIL_BINARY_HDR_LEN + hdr.length;
+	}
+
+	DEBUG("Wrote %d records, skipped %d damaged records", records, damaged);
+
+	return damaged ? -1 : 0;
+}
+
+static int binary_file_read(TALLOC_CTX *ctx, uint8_t **out, size_t *out_len, FILE *in)
+{
+	uint8_t	*data = NULL;
+	size_t	len = 0, size = 0, nread;
+
+	do {
+		if (len == size) {
+			size = size ? size * 2 : 65536;
+			data = talloc_realloc(ctx, data, uint8_t, size);
+			if (!data) {
+				fr_strerror_printf("Out of memory");
+				return -1;
+			}
+		}
+
+		nread = fread(data + len, 1, size - len, in);
+		len += nread;
+	} while (nread > 0);
+
+	if (ferror(in)) {
+		fr_strerror_printf("Failed reading input: %s", fr_syserror(errno));
+		talloc_free(data);
+		return -1;
+	}
+
+	*out = data;
+	*out_len = len;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char const	*dict_dir = DICTDIR;
+	char const	*protocol = "radius";
+	char const	*filename, *out_filename = NULL;
+	char		c;
+	int		ret = EXIT_FAILURE;
+	uint32_t	interval = 0;
+	bool		index_only = false;
+	FILE		*in = NULL, *out = stdout;
+	uint8_t		magic[4];
+	size_t		magic_len;
+	TALLOC_CTX	*autofree;
+
+	/*
+	 *	Must be called first, so the handler is called last
+	 */
+	fr_thread_local_atexit_setup();
+
+	autofree = talloc_autofree_context();
+
+#ifndef NDEBUG
+	if (fr_fault_setup(autofree, getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("raddetail");
+		fr_exit(EXIT_FAILURE);
+	}
+#endif
+
+	talloc_set_log_stderr();
+
+	fr_log_fp = stderr;
+
+	while ((c = getopt(argc, argv, "D:Ii:o:p:xh")) != -1) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'I':
+			index_only = true;
+			break;
+
+		case 'i':
+			interval = atoi(optarg);
+			if (!interval) usage();
+			break;
+
+		case 'o':
+			out_filename = optarg;
+			break;
+
+		case 'p':
+			protocol = optarg;
+			break;
+
+		case 'x':
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) usage();
+	filename = argv[0];
+
+	if (index_only) {
+		int entries;
+
+		entries = fr_detail_index_build(filename, interval);
+		if (entries < 0) {
+			fr_perror("raddetail");
+			goto finish;
+		}
+
+		DEBUG("Wrote %d index entries", entries);
+		ret = EXIT_SUCCESS;
+		goto finish;
+	}
+
+	if (interval && !out_filename) usage();
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("raddetail");
+		goto finish;
+	}
+
+	if (!fr_dict_global_ctx_init(autofree, dict_dir)) {
+		fr_perror("raddetail");
+		goto finish;
+	}
+
+	if ((fr_dict_internal_afrom_file(&dict_freeradius, FR_DICTIONARY_INTERNAL_DIR) < 0) ||
+	    (fr_dict_protocol_afrom_file(&dict, protocol, NULL) < 0)) {
+		fr_perror("raddetail");
+		goto finish;
+	}
+
+	in = fopen(filename, "r");
+	if (!in) {
+		fprintf(stderr, "raddetail: Failed opening %s: %s\n", filename, fr_syserror(errno));
+		goto finish;
+	}
+
+	if (out_filename) {
+		out = fopen(out_filename, "w");
+		if (!out) {
+			fprintf(stderr, "raddetail: Failed opening %s: %s\n", out_filename, fr_syserror(errno));
+			out = stdout;
+			goto finish;
+		}
+	}
+
+	magic_len = fread(magic, 1, sizeof(magic), in);
+	rewind(in);
+
+	if (fr_detail_binary_is_binary(magic, magic_len)) {
+		uint8_t	*data;
+		size_t	data_len;
+
+		if (interval) usage();
+
+		if (binary_file_read(autofree, &data, &data_len, in) < 0) {
+			fr_perror("raddetail");
+			goto finish;
+		}
+
+		if (binary_to_text(data, data_len, out) < 0) goto finish;
+	} else {
+		if (text_to_binary(in, out) < 0) {
+			fr_perror("raddetail");
+			goto finish;
+		}
+	}
+
+	if (fflush(out) != 0) {
+		fprintf(stderr, "raddetail: Failed writing output: %s\n", fr_syserror(errno));
+		goto finish;
+	}
+
+	if (interval) {
+		int entries;
+
+		entries = fr_detail_index_build(out_filename, interval);
+		if (entries < 0) {
+			fr_perror("raddetail");
+			goto finish;
+		}
+		DEBUG("Wrote %d index entries", entries);
+	}
+
+	ret = EXIT_SUCCESS;
+
+finish:
+	if (in) fclose(in);
+	if (out != stdout) fclose(out);
+
+	if (dict) fr_dict_free(&dict);
+	if (dict_freeradius) fr_dict_free(&dict_freeradius);
+
+	talloc_free(autofree);
+
+	return ret;
+}
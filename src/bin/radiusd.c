@@ -1032,6 +1032,11 @@ cleanup:
 	 */
 	unlang_free();
 
+	/*
+	 *	All of the threads which record latencies have exited.
+	 */
+	fr_latency_free();
+
 #ifdef HAVE_OPENSSL_CRYPTO_H
 	fr_openssl_free();		/* Cleanup any memory alloced by OpenSSL and placed into globals */
 #endif
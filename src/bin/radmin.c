@@ -496,6 +496,16 @@ static int cmd_stats_memory(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_inf
 	return -1;
 }
 
+static int cmd_stats_latency(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	if (fr_latency_fprint(fp, (info->argc > 0) ? info->argv[0] : NULL) < 0) {
+		fprintf(fp_err, "Failed reading latency statistics: %s\n", fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
 static int cmd_set_debug_level(UNUSED FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
 {
 	int level = atoi(info->argv[0]);
@@ -993,6 +1003,15 @@ static fr_cmd_table_t cmd_table[] = {
 		.read_only = true,
 	},
 
+	{
+		.parent = "stats",
+		.name = "latency",
+		.syntax = "[STRING]",
+		.func = cmd_stats_latency,
+		.help = "Show latency percentiles for requests, module calls and trunks, or for one named tracker.",
+		.read_only = true,
+	},
+
 	{
 		.parent = "set",
 		.name = "debug",
@@ -34,10 +34,17 @@ RCSID("$Id$")
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/util/conf.h>
 #include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/hex.h>
 #include <freeradius-devel/util/pcap.h>
 #include <freeradius-devel/util/timeval.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #ifdef HAVE_COLLECTDC_H
 #  include <collectd/client.h>
 #endif
@@ -46,15 +53,35 @@ RCSID("$Id$")
 
 #define RS_ASSERT(_x) if (!(_x) && !fr_cond_assert(_x)) exit(1)
 
+/** Open addressed table of requests
+ *
+ * Keyed on the reply we expect to see, using the same fields as fr_packet_cmp().
+ */
+typedef struct {
+	rs_request_t		**slots;		//!< Power of 2 sized array of requests.
+	uint32_t		mask;			//!< Number of slots - 1.
+	uint32_t		num;			//!< Number of requests in the table.
+} rs_request_table_t;
+
 static rs_t *conf;
 static struct timeval start_pcap = {0, 0};
-static char timestr[50];
+static _Thread_local char timestr[50];
 
-static rbtree_t *request_tree = NULL;
-static rbtree_t *link_tree = NULL;
+/*
+ *	Each worker thread links its own flows, so the request
+ *	table and link tree are per thread.
+ */
+static _Thread_local rs_request_table_t *request_table = NULL;
+static _Thread_local rbtree_t *link_tree = NULL;
 static fr_event_list_t *events;
 static bool cleanup;
 
+static rs_worker_t *workers;			//!< Array of conf->workers worker threads.
+static rs_update_t stats_update;		//!< How stats are written.  stats is NULL until
+						//!< rs_install_stats_processor() is called.
+static _Atomic(uint64_t) captured;		//!< Packets processed, for the capture limit.
+static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;	//!< Serialises writes to the output pcap.
+
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
 
 typedef int (*rbcmp)(void const *, void const *);
@@ -107,6 +134,7 @@ fr_dict_attr_autoload_t radsniff_dict_attr[] = {
 };
 
 static void NEVER_RETURNS usage(int status);
+static void rs_signal_self(int sig);
 
 /** Fork and kill the parent process, writing out our PID
  *
@@ -783,6 +811,44 @@ static void rs_stats_print_csv(rs_update_t *this, rs_stats_t *stats, UNUSED stru
 	fprintf(stdout , "%s\n", buffer);
 }
 
+/** Add the interval counters from a worker's stats to the main stats, and clear them
+ *
+ */
+static void rs_stats_merge(rs_stats_t *stats, rs_stats_t *worker_stats)
+{
+	size_t i, j;
+
+	for (i = 0; i < NUM_ELEMENTS(rs_useful_codes); i++) {
+		rs_latency_t *out = &stats->exchange[rs_useful_codes[i]];
+		rs_latency_t *in = &worker_stats->exchange[rs_useful_codes[i]];
+
+		out->interval.received_total += in->interval.received_total;
+		out->interval.linked_total += in->interval.linked_total;
+		out->interval.unlinked_total += in->interval.unlinked_total;
+		out->interval.reused_total += in->interval.reused_total;
+		out->interval.lost_total += in->interval.lost_total;
+		for (j = 0; j < NUM_ELEMENTS(out->interval.rt_total); j++) {
+			out->interval.rt_total[j] += in->interval.rt_total[j];
+		}
+
+		out->interval.latency_total += in->interval.latency_total;
+		if (in->interval.latency_high > out->interval.latency_high) {
+			out->interval.latency_high = in->interval.latency_high;
+		}
+		if (in->interval.latency_low &&
+		    (!out->interval.latency_low || (in->interval.latency_low < out->interval.latency_low))) {
+			out->interval.latency_low = in->interval.latency_low;
+		}
+
+		memset(&in->interval, 0, sizeof(in->interval));
+	}
+
+	/*
+	 *	A worker which ran out of memory mutes everything.
+	 */
+	if (timercmp(&worker_stats->quiet, &stats->quiet, >)) stats->quiet = worker_stats->quiet;
+}
+
 /** Process stats for a single interval
  *
  */
@@ -804,6 +870,17 @@ static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
 
 	stats->intervals++;
 
+	/*
+	 *	Pull in what the workers saw during the interval.
+	 */
+	for (i = 0; i < (size_t) conf->workers; i++) {
+		rs_worker_t *worker = &workers[i];
+
+		pthread_mutex_lock(&worker->stats_mutex);
+		rs_stats_merge(stats, &worker->stats);
+		pthread_mutex_unlock(&worker->stats_mutex);
+	}
+
 	for (in_p = this->in;
 	     in_p;
 	     in_p = in_p->next) {
@@ -815,6 +892,27 @@ static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
 		}
 	}
 
+	{
+		bool dropped = false;
+
+		for (i = 0; i < (size_t) conf->workers; i++) {
+			rs_worker_t *worker = &workers[i];
+
+			if (!worker->dropped) continue;
+
+			ERROR("Worker %i dropped %" PRIu64 " packets: Queue full", worker->id, worker->dropped);
+			worker->dropped = 0;
+			dropped = true;
+		}
+
+		if (dropped) {
+			ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
+
+			rs_tv_add_ms(&now, conf->stats.timeout, &stats->quiet);
+			goto clear;
+		}
+	}
+
 	/*
 	 *	Stats temporarily muted
 	 */
@@ -885,30 +983,30 @@ static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
 				      fr_pcap_t *in, struct timeval *now, bool live)
 {
 	static fr_event_timer_t	const *event;
-	static rs_update_t	update;
+	rs_update_t		*update = &stats_update;
 
-	memset(&update, 0, sizeof(update));
+	memset(update, 0, sizeof(*update));
 
-	update.list = el;
-	update.stats = stats;
-	update.in = in;
+	update->list = el;
+	update->stats = stats;
+	update->in = in;
 
 	switch (conf->stats.out) {
 	default:
 	case RS_STATS_OUT_STDIO_FANCY:
-		update.head = NULL;
-		update.body = rs_stats_print_fancy;
+		update->head = NULL;
+		update->body = rs_stats_print_fancy;
 		break;
 
 	case RS_STATS_OUT_STDIO_CSV:
-		update.head = rs_stats_print_csv_header;
-		update.body = rs_stats_print_csv;
+		update->head = rs_stats_print_csv_header;
+		update->body = rs_stats_print_csv;
 		break;
 
 #ifdef HAVE_COLLECTDC_H
 	case RS_STATS_OUT_COLLECTD:
-		update.head = NULL;
-		update.body = NULL;
+		update->head = NULL;
+		update->body = NULL;
 		break;
 #endif
 	}
@@ -924,7 +1022,7 @@ static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
 	}
 
 	if (fr_event_timer_at(NULL, events, (void *) &event,
-			      fr_time_from_timeval(now), rs_stats_process, &update) < 0) {
+			      fr_time_from_timeval(now), rs_stats_process, update) < 0) {
 		ERROR("Failed inserting stats event");
 		return -1;
 	}
@@ -970,18 +1068,176 @@ static int rs_get_pairs(TALLOC_CTX *ctx, fr_pair_t **out, fr_pair_t *vps, fr_dic
 	return count;
 }
 
+static uint32_t rs_ipaddr_hash(fr_ipaddr_t const *ipaddr, uint32_t hash)
+{
+	switch (ipaddr->af) {
+	case AF_INET:
+		return fr_hash_update(&ipaddr->addr.v4, sizeof(ipaddr->addr.v4), hash);
+
+	case AF_INET6:
+		return fr_hash_update(&ipaddr->addr.v6, sizeof(ipaddr->addr.v6), hash);
+
+	default:
+		return hash;
+	}
+}
+
+/** Hash the fields fr_packet_cmp() compares
+ *
+ */
+static uint32_t rs_packet_hash(fr_radius_packet_t const *packet)
+{
+	uint32_t hash;
+
+	hash = fr_hash(&packet->id, sizeof(packet->id));
+	hash = fr_hash_update(&packet->socket.fd, sizeof(packet->socket.fd), hash);
+	hash = fr_hash_update(&packet->socket.inet.src_port, sizeof(packet->socket.inet.src_port), hash);
+	hash = fr_hash_update(&packet->socket.inet.dst_port, sizeof(packet->socket.inet.dst_port), hash);
+	hash = rs_ipaddr_hash(&packet->socket.inet.src_ipaddr, hash);
+
+	return rs_ipaddr_hash(&packet->socket.inet.dst_ipaddr, hash);
+}
+
+static rs_request_table_t *rs_request_table_alloc(TALLOC_CTX *ctx, uint32_t size)
+{
+	rs_request_table_t *table;
+
+	table = talloc_zero(ctx, rs_request_table_t);
+	if (!table) return NULL;
+
+	table->slots = talloc_zero_array(table, rs_request_t *, size);
+	if (!table->slots) {
+		talloc_free(table);
+		return NULL;
+	}
+	table->mask = size - 1;
+
+	return table;
+}
+
+/** Find the request which expects a given reply
+ *
+ */
+static rs_request_t *rs_request_table_find(rs_request_table_t *table, fr_radius_packet_t const *expect)
+{
+	uint32_t	i;
+	rs_request_t	*request;
+
+	for (i = rs_packet_hash(expect) & table->mask;
+	     (request = table->slots[i]);
+	     i = (i + 1) & table->mask) {
+		if (fr_packet_cmp(request->expect, expect) == 0) return request;
+	}
+
+	return NULL;
+}
+
+static void rs_request_table_place(rs_request_table_t *table, rs_request_t *request)
+{
+	uint32_t i;
+
+	for (i = rs_packet_hash(request->expect) & table->mask;
+	     table->slots[i];
+	     i = (i + 1) & table->mask);
+
+	table->slots[i] = request;
+}
+
+/** Add a request, doubling the number of slots if the table is half full
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if a request expecting the same reply is already in the table,
+ *	  or we ran out of memory.
+ */
+static int rs_request_table_insert(rs_request_table_t *table, rs_request_t *request)
+{
+	if (rs_request_table_find(table, request->expect)) return -1;
+
+	if ((table->num + 1) > ((table->mask + 1) / 2)) {
+		rs_request_t	**old = table->slots;
+		uint32_t	i, old_size = table->mask + 1;
+
+		table->slots = talloc_zero_array(table, rs_request_t *, old_size * 2);
+		if (!table->slots) {
+			table->slots = old;
+			return -1;
+		}
+		table->mask = (old_size * 2) - 1;
+
+		for (i = 0; i < old_size; i++) {
+			if (old[i]) rs_request_table_place(table, old[i]);
+		}
+		talloc_free(old);
+	}
+
+	rs_request_table_place(table, request);
+	request->in_request_table = true;
+	table->num++;
+
+	return 0;
+}
+
+/** Remove a request
+ *
+ * Shifts later entries in the same run back, so lookups never
+ * need to skip over deleted slots.
+ */
+static void rs_request_table_delete(rs_request_table_t *table, rs_request_t *request)
+{
+	uint32_t i, j, home;
+
+	for (i = rs_packet_hash(request->expect) & table->mask;
+	     table->slots[i] != request;
+	     i = (i + 1) & table->mask) {
+		if (!fr_cond_assert(table->slots[i])) return;
+	}
+
+	table->slots[i] = NULL;
+	request->in_request_table = false;
+	table->num--;
+
+	for (j = (i + 1) & table->mask; table->slots[j]; j = (j + 1) & table->mask) {
+		home = rs_packet_hash(table->slots[j]->expect) & table->mask;
+
+		/*
+		 *	Move the entry into the hole, unless its
+		 *	home slot is cyclically between the hole
+		 *	and where it is now.
+		 */
+		if (((j - home) & table->mask) < ((j - i) & table->mask)) continue;
+
+		table->slots[i] = table->slots[j];
+		table->slots[j] = NULL;
+		i = j;
+	}
+}
+
+/** Remove all requests from the table, without freeing them
+ *
+ */
+static void rs_request_table_clear(rs_request_table_t *table)
+{
+	uint32_t i;
+
+	for (i = 0; i <= table->mask; i++) {
+		if (!table->slots[i]) continue;
+
+		table->slots[i]->in_request_table = false;
+		table->slots[i] = NULL;
+	}
+	table->num = 0;
+}
+
 static int _request_free(rs_request_t *request)
 {
 	int ret;
 
 	/*
-	 *	If we're attempting to cleanup the request, and it's no longer in the request_tree
+	 *	If we're attempting to cleanup the request, and it's no longer in the request_table
 	 *	something has gone very badly wrong.
 	 */
-	if (request->in_request_tree) {
-		ret = rbtree_deletebydata(request_tree, request);
-		RS_ASSERT(ret);
-	}
+	if (request->in_request_table) rs_request_table_delete(request_table, request);
 
 	if (request->in_link_tree) {
 		ret = rbtree_deletebydata(link_tree, request);
@@ -1087,6 +1343,17 @@ static int rs_packet_cmp(rs_request_t const *a, rs_request_t const *b)
 	return fr_packet_cmp(a->expect, b->expect);
 }
 
+/** Write a packet to the output pcap
+ *
+ * Workers may write packets at the same time, so this is serialised.
+ */
+static inline void rs_pcap_dump(fr_pcap_t *out, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	pthread_mutex_lock(&dump_mutex);
+	pcap_dump((void *)out->dumper, header, data);
+	pthread_mutex_unlock(&dump_mutex);
+}
+
 static inline int rs_response_to_pcap(rs_event_t *event, rs_request_t *request, struct pcap_pkthdr const *header,
 				      uint8_t const *data)
 {
@@ -1115,8 +1382,7 @@ static inline int rs_response_to_pcap(rs_event_t *event, rs_request_t *request,
 		 *	hit our start point.
 		 */
 		if (request->capture_p->header) do {
-			pcap_dump((void *)event->out->dumper, request->capture_p->header,
-				  request->capture_p->data);
+			rs_pcap_dump(event->out, request->capture_p->header, request->capture_p->data);
 			TALLOC_FREE(request->capture_p->header);
 			TALLOC_FREE(request->capture_p->data);
 
@@ -1132,7 +1398,7 @@ static inline int rs_response_to_pcap(rs_event_t *event, rs_request_t *request,
 	/*
 	 *	Now log the response
 	 */
-	pcap_dump((void *)event->out->dumper, header, data);
+	rs_pcap_dump(event->out, header, data);
 
 	return 0;
 }
@@ -1169,7 +1435,7 @@ static inline int rs_request_to_pcap(rs_event_t *event, rs_request_t *request, s
 		return 0;
 	}
 
-	pcap_dump((void *)event->out->dumper, header, data);
+	rs_pcap_dump(event->out, header, data);
 
 	return 0;
 }
@@ -1202,7 +1468,6 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	fr_radius_packet_t		*packet;		/* Current packet were processing */
@@ -1307,7 +1572,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	packet = fr_radius_alloc(conf, false);
+	packet = fr_radius_alloc(event->ctx, false);
 	if (!packet) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1364,8 +1629,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	case FR_CODE_STATUS_CLIENT:
 	{
 		/* look for a matching request and use it for decoding */
-		search.expect = packet;
-		original = rbtree_finddata(request_tree, &search);
+		original = rs_request_table_find(request_table, packet);
 
 		/*
 		 *	Verify this code is allowed
@@ -1386,9 +1650,9 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			int ret;
 			FILE *log_fp = fr_log_fp;
 
-			fr_log_fp = NULL;
+			if (!conf->workers) fr_log_fp = NULL;
 			ret = fr_radius_packet_verify(packet, original->expect, conf->radius_secret);
-			fr_log_fp = log_fp;
+			if (!conf->workers) fr_log_fp = log_fp;
 			if (ret != 0) {
 				fr_perror("Failed verifying packet ID %d", packet->id);
 				fr_radius_packet_free(&packet);
@@ -1404,10 +1668,10 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			int ret;
 			FILE *log_fp = fr_log_fp;
 
-			fr_log_fp = NULL;
+			if (!conf->workers) fr_log_fp = NULL;
 			ret = fr_radius_packet_decode(packet, original ? original->expect : NULL,
 						      RADIUS_MAX_ATTRIBUTES, false, conf->radius_secret);
-			fr_log_fp = log_fp;
+			if (!conf->workers) fr_log_fp = log_fp;
 			if (ret != 0) {
 				fr_radius_packet_free(&packet);
 				REDEBUG("Failed decoding");
@@ -1513,9 +1777,9 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 				int ret;
 				FILE *log_fp = fr_log_fp;
 
-				fr_log_fp = NULL;
+				if (!conf->workers) fr_log_fp = NULL;
 				ret = fr_radius_packet_verify(packet, NULL, conf->radius_secret);
-				fr_log_fp = log_fp;
+				if (!conf->workers) fr_log_fp = log_fp;
 				if (ret != 0) {
 					fr_perror("Failed verifying packet ID %d", packet->id);
 					fr_radius_packet_free(&packet);
@@ -1537,10 +1801,10 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			int ret;
 			FILE *log_fp = fr_log_fp;
 
-			fr_log_fp = NULL;
+			if (!conf->workers) fr_log_fp = NULL;
 			ret = fr_radius_packet_decode(packet, NULL,
 						      RADIUS_MAX_ATTRIBUTES, false, conf->radius_secret);
-			fr_log_fp = log_fp;
+			if (!conf->workers) fr_log_fp = log_fp;
 
 			if (ret != 0) {
 				fr_radius_packet_free(&packet);
@@ -1581,7 +1845,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			rs_request_t *tuple;
 
 			original = rbtree_finddata(link_tree, &search);
-			tuple = rbtree_finddata(request_tree, &search);
+			tuple = rs_request_table_find(request_table, search.expect);
 
 			/*
 			 *	If the packet we matched using attributes is not the same
@@ -1595,7 +1859,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	Detect duplicates using the normal 5-tuple of src/dst ips/ports id
 		 */
 		} else {
-			original = rbtree_finddata(request_tree, &search);
+			original = rs_request_table_find(request_table, search.expect);
 			if (original && (memcmp(original->expect->vector, packet->vector,
 			    			sizeof(original->expect->vector)) != 0)) {
 				/*
@@ -1640,8 +1904,8 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			original->packet = talloc_steal(original, packet);
 
 			/* Request may need to be reinserted as the 5 tuple of the response may of changed */
-			if (rs_packet_cmp(original, &search) != 0) {
-				rbtree_deletebydata(request_tree, original);
+			if (original->in_request_table && (rs_packet_cmp(original, &search) != 0)) {
+				rs_request_table_delete(request_table, original);
 			}
 
 			fr_radius_packet_free(&original->expect);
@@ -1653,7 +1917,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = talloc_zero(conf, rs_request_t);
+			original = talloc_zero(event->ctx, rs_request_t);
 			talloc_set_destructor(original, _request_free);
 
 			original->id = count;
@@ -1695,13 +1959,12 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			}
 		}
 
-		if (!original->in_request_tree) {
-			bool ret;
+		if (!original->in_request_table) {
+			int ret;
 
 			/* We should never have conflicts */
-			ret = rbtree_insert(request_tree, original);
-			RS_ASSERT(ret);
-			original->in_request_tree = true;
+			ret = rs_request_table_insert(request_table, original);
+			RS_ASSERT(ret == 0);
 		}
 
 		/*
@@ -1793,14 +2056,169 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		fr_radius_packet_free(&packet);
 	}
 
-	captured++;
 	/*
-	 *	We've hit our capture limit, break out of the event loop
+	 *	We've hit our capture limit, break out of the event loop.
+	 *	Workers can't touch the main event list, so they signal
+	 *	the main thread instead.
 	 */
-	if ((conf->limit > 0) && (captured >= conf->limit)) {
-		INFO("Captured %" PRIu64 " packets, exiting...", captured);
+	if ((conf->limit > 0) &&
+	    ((atomic_fetch_add_explicit(&captured, 1, memory_order_relaxed) + 1) == conf->limit)) {
+		INFO("Captured %" PRIu64 " packets, exiting...", conf->limit);
+		if (conf->workers) {
+			rs_signal_self(SIGTERM);
+		} else {
+			fr_event_loop_exit(events, 1);
+		}
+	}
+}
+
+/** Hash the flow a packet belongs to
+ *
+ * The hash is symmetric, so a request and its response produce the same
+ * value, and are processed by the same worker.  When linking requests by
+ * attribute, retransmissions may use a different port or ID, so only the
+ * addresses are hashed.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the packet is too short or not IP.
+ */
+static int rs_packet_flow_hash(uint32_t *out, fr_pcap_t *in, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	uint8_t const		*p = data, *end = data + header->caplen;
+	uint8_t const		*src, *dst;
+	size_t			addr_len;
+	udp_header_t const	*udp;
+	ssize_t			len;
+	uint32_t		hash_src, hash_dst;
+
+	len = fr_pcap_link_layer_offset(data, header->caplen, in->link_layer);
+	if ((len < 0) || ((p + len) >= end)) return -1;
+	p += len;
+
+	switch ((p[0] & 0xf0) >> 4) {
+	case 4:
+	{
+		ip_header_t const *ip = (ip_header_t const *)p;
+
+		if ((p + sizeof(*ip)) > end) return -1;
+
+		src = (uint8_t const *) &ip->ip_src;
+		dst = (uint8_t const *) &ip->ip_dst;
+		addr_len = sizeof(ip->ip_src);
+		p += (0x0f & ip->ip_vhl) * 4;
+	}
+		break;
+
+	case 6:
+	{
+		ip_header6_t const *ip6 = (ip_header6_t const *)p;
+
+		if ((p + sizeof(*ip6)) > end) return -1;
+
+		src = (uint8_t const *) &ip6->ip_src;
+		dst = (uint8_t const *) &ip6->ip_dst;
+		addr_len = sizeof(ip6->ip_src);
+		p += sizeof(*ip6);
+	}
+		break;
+
+	default:
+		return -1;
+	}
+
+	if ((p + sizeof(udp_header_t) + sizeof(radius_packet_t)) > end) return -1;
+	udp = (udp_header_t const *)p;
+
+	hash_src = fr_hash(src, addr_len);
+	hash_dst = fr_hash(dst, addr_len);
+
+	if (conf->link_da_num > 0) {
+		*out = hash_src ^ hash_dst;
+		return 0;
+	}
+
+	hash_src = fr_hash_update(&udp->src, sizeof(udp->src), hash_src);
+	hash_dst = fr_hash_update(&udp->dst, sizeof(udp->dst), hash_dst);
+
+	*out = fr_hash_update(&((radius_packet_t const *)(p + sizeof(*udp)))->id, 1, hash_src ^ hash_dst);
+	return 0;
+}
+
+/** Process a packet, or queue it for the worker which handles its flow
+ *
+ */
+static void rs_packet_dispatch(uint64_t count, rs_event_t *event, struct pcap_pkthdr const *header,
+			       uint8_t const *data)
+{
+	rs_worker_t	*worker;
+	rs_work_t	*work;
+	uint32_t	hash;
+
+	if (!conf->workers) {
+		rs_packet_process(count, event, header, data);
+		return;
+	}
+
+	if ((conf->limit > 0) && (atomic_load_explicit(&captured, memory_order_relaxed) >= conf->limit)) {
 		fr_event_loop_exit(events, 1);
+		return;
+	}
+
+	/*
+	 *	Set it here, so the workers only ever read it.
+	 */
+	if (!start_pcap.tv_sec) start_pcap = header->ts;
+
+	/*
+	 *	Packets we can't parse go to the first worker,
+	 *	which logs the error.
+	 */
+	if (rs_packet_flow_hash(&hash, event->in, header, data) < 0) hash = 0;
+	worker = &workers[hash % conf->workers];
+
+	pthread_mutex_lock(&worker->mutex);
+	while ((worker->tail - worker->head) >= RS_WORKER_QUEUE_SIZE) {
+		/*
+		 *	Blocking a live capture would just make
+		 *	libpcap drop the packets instead.  At least
+		 *	this way we know where they were lost.
+		 */
+		if (event->in->type == PCAP_INTERFACE_IN) {
+			pthread_mutex_unlock(&worker->mutex);
+			worker->dropped++;
+			return;
+		}
+
+		pthread_cond_wait(&worker->space, &worker->mutex);
 	}
+	pthread_mutex_unlock(&worker->mutex);
+
+	/*
+	 *	The worker doesn't look at the slot until we
+	 *	advance the tail, so it can be filled without
+	 *	holding the lock.
+	 */
+	work = &worker->queue[worker->tail & (RS_WORKER_QUEUE_SIZE - 1)];
+	if (talloc_array_length(work->data) < header->caplen) {
+		uint8_t *buff;
+
+		buff = talloc_realloc(workers, work->data, uint8_t, header->caplen);
+		if (!buff) {
+			ERROR("Failed allocating memory to queue packet");
+			return;
+		}
+		work->data = buff;
+	}
+	memcpy(work->data, data, header->caplen);
+	work->header = *header;
+	work->in = event->in;
+	work->count = count;
+
+	pthread_mutex_lock(&worker->mutex);
+	worker->tail++;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
 }
 
 static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *ctx)
@@ -1871,7 +2289,7 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 			} while (fr_event_timer_run(el, &now) == 1);
 			count++;
 
-			rs_packet_process(count, event, header, data);
+			rs_packet_dispatch(count, event, header, data);
 		}
 		return;
 	}
@@ -1892,7 +2310,7 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 		}
 
 		count++;
-		rs_packet_process(count, event, header, data);
+		rs_packet_dispatch(count, event, header, data);
 	}
 }
 
@@ -2040,24 +2458,226 @@ static int rs_build_event_flags(int *flags, fr_table_num_sorted_t const *map, si
 	return i;
 }
 
-/** Callback for when the request is removed from the request tree
+/** Callback for when the request is removed from the link tree
  *
  * @param request being removed.
  */
-static void _unmark_request(void *request)
+static void _unmark_link(void *request)
 {
 	rs_request_t *this = request;
-	this->in_request_tree = false;
+	this->in_link_tree = false;
 }
 
-/** Callback for when the request is removed from the link tree
+/** Allocate the request table and link tree for the calling thread
  *
- * @param request being removed.
  */
-static void _unmark_link(void *request)
+static int rs_tables_alloc(TALLOC_CTX *ctx)
 {
-	rs_request_t *this = request;
-	this->in_link_tree = false;
+	request_table = rs_request_table_alloc(ctx, RS_REQUEST_TABLE_SIZE);
+	if (!request_table) {
+		ERROR("Failed creating request table");
+		return -1;
+	}
+
+	if (conf->link_da_num > 0) {
+		link_tree = rbtree_talloc_alloc(ctx, (rbcmp) rs_rtx_cmp, rs_request_t, _unmark_link, 0);
+		if (!link_tree) {
+			ERROR("Failed creating RTX tree");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Run any request timeouts which are due
+ *
+ */
+static inline void rs_worker_timers(rs_worker_t *worker, fr_time_t now)
+{
+	while (fr_event_timer_run(worker->event.list, &now) == 1);
+}
+
+/** Process packets queued by the capture thread
+ *
+ */
+static void *rs_worker_thread(void *arg)
+{
+	rs_worker_t	*worker = arg;
+	TALLOC_CTX	*ctx;
+
+	/*
+	 *	Each worker has its own talloc tree, so it never
+	 *	allocates in a context another thread is using.
+	 */
+	ctx = talloc_init_const("radsniff worker");
+	if (!ctx || (rs_tables_alloc(ctx) < 0)) {
+	oom:
+		ERROR("Worker %i failed allocating memory", worker->id);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	worker->event.list = fr_event_list_alloc(ctx, NULL, NULL);
+	if (!worker->event.list) goto oom;
+
+	/*
+	 *	Requests get their own context, so they can be freed
+	 *	while the event list still exists.
+	 */
+	worker->event.ctx = talloc_new(ctx);
+	if (!worker->event.ctx) goto oom;
+
+	pthread_mutex_lock(&worker->mutex);
+	for (;;) {
+		uint32_t i, num;
+
+		while (worker->head == worker->tail) {
+			struct timespec when;
+
+			if (worker->exiting) goto done;
+
+			/*
+			 *	For files, timeouts are driven by
+			 *	the timestamps of the packets.
+			 */
+			if (!conf->from_dev) {
+				pthread_cond_wait(&worker->cond, &worker->mutex);
+				continue;
+			}
+
+			/*
+			 *	For live captures, wake up regularly
+			 *	to expire requests which never see a
+			 *	response.
+			 */
+			clock_gettime(CLOCK_REALTIME, &when);
+			when.tv_nsec += 100000000;
+			if (when.tv_nsec >= NSEC) {
+				when.tv_sec++;
+				when.tv_nsec -= NSEC;
+			}
+			if (pthread_cond_timedwait(&worker->cond, &worker->mutex, &when) != ETIMEDOUT) continue;
+
+			pthread_mutex_unlock(&worker->mutex);
+			pthread_mutex_lock(&worker->stats_mutex);
+			rs_worker_timers(worker, fr_time());
+			pthread_mutex_unlock(&worker->stats_mutex);
+			pthread_mutex_lock(&worker->mutex);
+		}
+
+		num = worker->tail - worker->head;
+		if (num > RS_WORKER_BATCH) num = RS_WORKER_BATCH;
+		pthread_mutex_unlock(&worker->mutex);
+
+		pthread_mutex_lock(&worker->stats_mutex);
+		for (i = 0; i < num; i++) {
+			rs_work_t *work = &worker->queue[(worker->head + i) & (RS_WORKER_QUEUE_SIZE - 1)];
+
+			rs_worker_timers(worker, fr_time_from_timeval(&work->header.ts));
+
+			if ((conf->limit > 0) &&
+			    (atomic_load_explicit(&captured, memory_order_relaxed) >= conf->limit)) continue;
+
+			worker->event.in = work->in;
+			rs_packet_process(work->count, &worker->event, &work->header, work->data);
+		}
+		pthread_mutex_unlock(&worker->stats_mutex);
+
+		pthread_mutex_lock(&worker->mutex);
+		worker->head += num;
+		pthread_cond_signal(&worker->space);
+	}
+
+done:
+	pthread_mutex_unlock(&worker->mutex);
+
+	/*
+	 *	Requests which are still outstanding are freed
+	 *	without being counted as lost, as they are when
+	 *	radsniff runs in a single thread.
+	 */
+	rs_request_table_clear(request_table);
+	TALLOC_FREE(link_tree);
+	TALLOC_FREE(worker->event.ctx);
+	talloc_free(ctx);
+	request_table = NULL;
+
+	return NULL;
+}
+
+/** Start the worker threads
+ *
+ */
+static int rs_workers_start(fr_pcap_t *out)
+{
+	int i, ret;
+
+	workers = talloc_zero_array(conf, rs_worker_t, conf->workers);
+	if (!workers) {
+		ERROR("Failed allocating memory for workers");
+		return -1;
+	}
+
+	for (i = 0; i < conf->workers; i++) {
+		rs_worker_t *worker = &workers[i];
+
+		worker->id = i;
+		worker->event.out = out;
+		worker->event.stats = &worker->stats;
+
+		pthread_mutex_init(&worker->mutex, NULL);
+		pthread_mutex_init(&worker->stats_mutex, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		pthread_cond_init(&worker->space, NULL);
+
+		ret = pthread_create(&worker->thread, NULL, rs_worker_thread, worker);
+		if (ret != 0) {
+			ERROR("Failed creating worker thread: %s", fr_syserror(ret));
+			conf->workers = i;
+			return -1;
+		}
+	}
+
+	DEBUG("Processing packets in %i worker threads", conf->workers);
+
+	return 0;
+}
+
+/** Tell the workers to finish the packets they have queued, and wait for them to exit
+ *
+ * @param[in] stats	to add what the workers counted since the last
+ *			stats interval to.  May be NULL.
+ */
+static void rs_workers_stop(rs_stats_t *stats)
+{
+	int i;
+
+	if (!workers) return;
+
+	for (i = 0; i < conf->workers; i++) {
+		rs_worker_t *worker = &workers[i];
+
+		pthread_mutex_lock(&worker->mutex);
+		worker->exiting = true;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->mutex);
+	}
+
+	for (i = 0; i < conf->workers; i++) {
+		rs_worker_t *worker = &workers[i];
+
+		pthread_join(worker->thread, NULL);
+
+		if (stats) rs_stats_merge(stats, &worker->stats);
+
+		pthread_mutex_destroy(&worker->mutex);
+		pthread_mutex_destroy(&worker->stats_mutex);
+		pthread_cond_destroy(&worker->cond);
+		pthread_cond_destroy(&worker->space);
+	}
+
+	conf->workers = 0;
+	TALLOC_FREE(workers);
 }
 
 #ifdef HAVE_COLLECTDC_H
@@ -2175,6 +2795,7 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -R <filter>           RADIUS attribute response filter.\n");
 	fprintf(output, "  -s <secret>           RADIUS secret.\n");
 	fprintf(output, "  -S                    Write PCAP data to stdout.\n");
+	fprintf(output, "  -t <threads>          Process packets in <threads> worker threads (max %i).\n", RS_MAX_WORKERS);
 	fprintf(output, "  -v                    Show program version information and exit.\n");
 	fprintf(output, "  -w <file>             Write output packets to file.\n");
 	fprintf(output, "  -x                    Print more debugging information.\n");
@@ -2264,7 +2885,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != -1) {
+	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mp:P:qr:R:s:St:vw:xXW:T:P:N:O:")) != -1) {
 		switch (c) {
 		case 'a':
 		{
@@ -2402,6 +3023,14 @@ int main(int argc, char *argv[])
 			conf->to_stdout = true;
 			break;
 
+		case 't':
+			conf->workers = atoi(optarg);
+			if ((conf->workers < 1) || (conf->workers > RS_MAX_WORKERS)) {
+				ERROR("Invalid number of threads \"%s\", must be between 1 and %i", optarg, RS_MAX_WORKERS);
+				usage(1);
+			}
+			break;
+
 		case 'v':
 #ifdef HAVE_COLLECTDC_H
 			INFO("%s, %s, collectdclient version %s", radsniff_version, pcap_lib_version(),
@@ -2609,12 +3238,6 @@ int main(int argc, char *argv[])
 		if (conf->link_da_num < 0) {
 			usage(64);
 		}
-
-		link_tree = rbtree_talloc_alloc(conf, (rbcmp) rs_rtx_cmp, rs_request_t, _unmark_link, 0);
-		if (!link_tree) {
-			ERROR("Failed creating RTX tree");
-			goto finish;
-		}
 	}
 
 	if (conf->filter_request) {
@@ -2666,13 +3289,10 @@ int main(int argc, char *argv[])
 	}
 
 	/*
-	 *	Setup the request tree
+	 *	Setup the request table and link tree.  Worker
+	 *	threads setup their own.
 	 */
-	request_tree = rbtree_talloc_alloc(conf, (rbcmp) rs_packet_cmp, rs_request_t, _unmark_request, 0);
-	if (!request_tree) {
-		ERROR("Failed creating request tree");
-		goto finish;
-	}
+	if (!conf->workers && (rs_tables_alloc(conf) < 0)) goto finish;
 
 	/*
 	 *	Get the default capture device
@@ -2923,6 +3543,11 @@ int main(int argc, char *argv[])
 			rs_install_stats_processor(stats, events, in, &now, false);
 		}
 
+		/*
+		 *  Start the workers before any packets are read
+		 */
+		if (conf->workers && (rs_workers_start(out) < 0)) goto finish;
+
 		/*
 		 *  Now add fd's for each of the pcap sessions we opened
 		 */
@@ -2933,6 +3558,7 @@ int main(int argc, char *argv[])
 
 			event = talloc_zero(events, rs_event_t);
 			event->list = events;
+			event->ctx = conf;
 			event->in = in_p;
 			event->out = out;
 			event->stats = stats;
@@ -2991,6 +3617,18 @@ int main(int argc, char *argv[])
 	DEBUG2("Done sniffing");
 
 finish:
+	/*
+	 *	Workers must finish with the queued packets before
+	 *	the final stats are written, and before conf is freed.
+	 */
+	rs_workers_stop(stats);
+
+	/*
+	 *	Write out whatever was counted since the last
+	 *	stats interval.
+	 */
+	if (stats_update.stats) rs_stats_process(stats_update.list, fr_time(), &stats_update);
+
 	cleanup = true;
 
 	if (conf->daemonize) unlink(conf->pidfile);
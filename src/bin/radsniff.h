@@ -28,6 +28,7 @@
 RCSIDH(radsniff_h, "$Id$")
 
 #include <sys/types.h>
+#include <pthread.h>
 
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/util/pcap.h>
@@ -44,6 +45,11 @@ RCSIDH(radsniff_h, "$Id$")
 #define RS_RETRANSMIT_MAX	5		//!< Maximum number of times we expect to see a packet retransmitted
 #define RS_MAX_ATTRS		50		//!< Maximum number of attributes we can filter on.
 #define RS_SOCKET_REOPEN_DELAY  5000		//!< How long we delay re-opening a collectd socket.
+#define RS_MAX_WORKERS		64		//!< Maximum number of worker threads.
+#define RS_WORKER_QUEUE_SIZE	4096		//!< Packets which can be queued for each worker.  Must be
+						//!< a power of 2.
+#define RS_WORKER_BATCH		64		//!< Maximum packets a worker processes per queue lock.
+#define RS_REQUEST_TABLE_SIZE	1024		//!< Initial number of slots in the request table.
 
 /*
  *	Logging macros
@@ -210,7 +216,7 @@ typedef struct {
 
 	fr_pair_t		*link_vps;		//!< fr_pair_ts used to link retransmissions.
 
-	bool			in_request_tree;	//!< Whether the request is currently in the request tree.
+	bool			in_request_table;	//!< Whether the request is currently in the request table.
 	bool			in_link_tree;		//!< Whether the request is currently in the linked tree.
 } rs_request_t;
 
@@ -224,8 +230,49 @@ typedef struct {
 	fr_pcap_t		*out;			//!< Where to write output.
 
 	rs_stats_t		*stats;			//!< Where to write stats.
+
+	TALLOC_CTX		*ctx;			//!< Where to allocate packets and requests.
 } rs_event_t;
 
+/** A captured packet, copied so a worker thread can process it
+ *
+ */
+typedef struct {
+	struct pcap_pkthdr	header;			//!< PCAP packet header.
+	uint8_t			*data;			//!< PCAP packet data.  Grown as needed, and
+							//!< reused for later packets.
+	fr_pcap_t		*in;			//!< PCAP handle the packet was received on.
+	uint64_t		count;			//!< Packet counter.
+} rs_work_t;
+
+/** A thread which links requests and responses for a subset of flows
+ *
+ * The capture thread hashes each packet's addresses, ports and ID, so a
+ * request and its response always go to the same worker.  Each worker has
+ * its own request table, event list and stats, so workers never share
+ * state.
+ */
+typedef struct {
+	pthread_t		thread;
+	int			id;			//!< Worker number.
+
+	pthread_mutex_t		mutex;			//!< Protects the queue indexes and exiting.
+	pthread_cond_t		cond;			//!< Signalled when packets are queued.
+	pthread_cond_t		space;			//!< Signalled when packets are dequeued.
+	rs_work_t		queue[RS_WORKER_QUEUE_SIZE];	//!< Packets waiting to be processed.
+	uint32_t		head;			//!< Next packet the worker will process.
+	uint32_t		tail;			//!< Next slot the capture thread will fill.
+	bool			exiting;		//!< Process what's queued, then exit.
+
+	uint64_t		dropped;		//!< Packets dropped because the queue was full.
+							//!< Only used by the capture thread.
+
+	pthread_mutex_t		stats_mutex;		//!< Held while the worker updates its stats.
+	rs_stats_t		stats;			//!< Merged by the stats interval event.
+
+	rs_event_t		event;			//!< Passed to rs_packet_process().
+} rs_worker_t;
+
 typedef struct rs_update rs_update_t;
 
 /** Callback for printing stats header.
@@ -298,6 +345,9 @@ struct rs {
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
 	uint64_t		limit;			//!< Maximum number of packets to capture
 
+	int			workers;		//!< Number of threads to process packets in.
+							//!< 0 processes them in the capture thread.
+
 	struct {
 		int			interval;		//!< Time between stats updates in seconds.
 		stats_out_t		out;			//!< Where to write stats.
@@ -31,6 +31,9 @@ RCSID("$Id$")
 
 #include <talloc.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
@@ -81,6 +84,7 @@ typedef struct {
 
 	bool			dead;			//!< is it dead?
 	bool			blocked;		//!< is it blocked?
+	bool			stream;			//!< connected stream socket, so writes can be corked.
 
 	size_t			outstanding;		//!< number of outstanding packets sent to the worker
 	fr_listen_t		*listen;		//!< I/O ctx and functions.
@@ -92,6 +96,7 @@ typedef struct {
 
 	fr_channel_data_t	*pending;		//!< the currently pending partial packet
 	fr_heap_t		*waiting;		//!< packets waiting to be written
+	fr_dlist_t		flush_entry;		//!< in the list of sockets with replies to write
 	fr_io_stats_t		stats;
 } fr_network_socket_t;
 
@@ -126,6 +131,7 @@ struct fr_network_s {
 	fr_event_list_t		*el;			//!< our event list
 
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
+	fr_dlist_head_t		flush;			//!< sockets with replies waiting to be written
 
 	fr_io_stats_t		stats;
 
@@ -897,6 +903,24 @@ static void fr_network_error(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 }
 
 
+/** Cork or uncork a stream socket
+ *
+ * While corked, the kernel holds back partial segments, so a batch of
+ * small replies goes out in as few segments as possible.
+ */
+static inline void fr_network_socket_cork(fr_network_socket_t *s, bool cork)
+{
+#if defined(TCP_CORK)
+	int on = cork;
+
+	(void) setsockopt(s->listen->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+	int on = cork;
+
+	(void) setsockopt(s->listen->fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#endif
+}
+
 /** Write packets to the network.
  *
  * @param el the event list
@@ -910,6 +934,7 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 	fr_listen_t *li = s->listen;
 	fr_network_t *nr = s->nr;
 	fr_channel_data_t *cd;
+	bool corked = false;
 
 	(void) talloc_get_type_abort(nr, fr_network_t);
 
@@ -925,6 +950,15 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		cd = fr_heap_pop(s->waiting);
 	}
 
+	/*
+	 *	If there's more than one reply to write, send them
+	 *	as one batch.
+	 */
+	if (cd && s->stream && (fr_heap_num_elements(s->waiting) > 0)) {
+		fr_network_socket_cork(s, true);
+		corked = true;
+	}
+
 	while (cd != NULL) {
 		int rcode;
 
@@ -965,6 +999,8 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 					cd = (fr_channel_data_t *) lm;
 				}
 
+				if (corked) fr_network_socket_cork(s, false);
+
 				if (!s->blocked) {
 					if (fr_event_fd_insert(nr, nr->el, s->listen->fd,
 							       fr_network_read,
@@ -1023,10 +1059,14 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		cd = fr_heap_pop(s->waiting);
 	}
 
+	if (corked) fr_network_socket_cork(s, false);
+
 	/*
 	 *	We've successfully written all of the packets.  Remove
-	 *	the write callback.
+	 *	the write callback, if we added one.
 	 */
+	if (!s->blocked) return;
+
 	if (fr_event_fd_insert(nr, nr->el, s->listen->fd,
 			       fr_network_read,
 			       NULL,
@@ -1046,6 +1086,7 @@ static int _network_socket_free(fr_network_socket_t *s)
 
 	rbtree_deletebydata(nr->sockets, s);
 	rbtree_deletebydata(nr->sockets_by_num, s);
+	if (fr_dlist_entry_in_list(&s->flush_entry)) fr_dlist_remove(&nr->flush, s);
 
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
 
@@ -1099,6 +1140,7 @@ static void fr_network_listen_callback(void *ctx, void const *data, size_t data_
 	s->number = nr->num_sockets++;
 
 	MEM(s->waiting = fr_heap_alloc(s, waiting_cmp, fr_channel_data_t, channel.heap_id));
+	fr_dlist_entry_init(&s->flush_entry);
 
 	talloc_set_destructor(s, _network_socket_free);
 
@@ -1129,6 +1171,18 @@ static void fr_network_listen_callback(void *ctx, void const *data, size_t data_
 	app_io = s->listen->app_io;
 	s->filter = FR_EVENT_FILTER_IO;
 
+	/*
+	 *	Replies to connected stream sockets are written in
+	 *	batches.
+	 */
+	if (s->listen->connected) {
+		int		type;
+		socklen_t	len = sizeof(type);
+
+		s->stream = (getsockopt(s->listen->fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0) &&
+			    (type == SOCK_STREAM);
+	}
+
 	if (fr_event_fd_insert(nr, nr->el, s->listen->fd,
 			       fr_network_read,
 			       NULL,
@@ -1180,6 +1234,7 @@ static void fr_network_directory_callback(void *ctx, void const *data, size_t da
 	s->number = nr->num_sockets++;
 
 	MEM(s->waiting = fr_heap_alloc(s, waiting_cmp, fr_channel_data_t, channel.heap_id));
+	fr_dlist_entry_init(&s->flush_entry);
 
 	talloc_set_destructor(s, _network_socket_free);
 
@@ -1329,14 +1384,14 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 {
 	fr_channel_data_t *cd;
 	fr_network_t *nr = talloc_get_type_abort(uctx, fr_network_t);
+	fr_network_socket_t *s;
 
 	/*
-	 *	Pull the replies off of our global heap, and try to
-	 *	push them to the individual sockets.
+	 *	Pull the replies off of our global heap, and queue
+	 *	them on the individual sockets.
 	 */
 	while ((cd = fr_heap_pop(nr->replies)) != NULL) {
 		fr_listen_t *li;
-		fr_network_socket_t *s;
 
 		li = cd->listen;
 
@@ -1382,17 +1437,24 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 			continue;
 		}
 
+		(void) fr_heap_insert(s->waiting, cd);
+
 		/*
-		 *	No pending message, let's try writing it.
-		 *
 		 *	If there is a pending message, then we're
-		 *	waiting for IO write to become ready.
+		 *	waiting for IO write to become ready, and the
+		 *	write callback will send this one, too.
 		 */
-		if (!s->pending) {
-			fr_assert(!s->blocked);
-			(void) fr_heap_insert(s->waiting, cd);
-			fr_network_write(nr->el, s->listen->fd, 0, s);
-		}
+		if (s->pending) continue;
+
+		fr_assert(!s->blocked);
+		if (!fr_dlist_entry_in_list(&s->flush_entry)) fr_dlist_insert_tail(&nr->flush, s);
+	}
+
+	/*
+	 *	Write all of the replies for each socket in one go.
+	 */
+	while ((s = fr_dlist_pop_head(&nr->flush)) != NULL) {
+		fr_network_write(nr->el, s->listen->fd, 0, s);
 	}
 }
 
@@ -1669,6 +1731,7 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 	}
 
 	nr->replies = fr_heap_alloc(nr, reply_cmp, fr_channel_data_t, channel.heap_id);
+	fr_dlist_init(&nr->flush, fr_network_socket_t, flush_entry);
 	if (!nr->replies) {
 		fr_strerror_printf_push("Failed creating heap for replies");
 		goto fail2;
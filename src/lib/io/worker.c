@@ -59,6 +59,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/channel.h>
 #include <freeradius-devel/io/message.h>
 #include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/server/latency.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/dlist.h>
 
@@ -100,6 +101,7 @@ struct fr_worker_s {
 	fr_io_stats_t		stats;		//!< input / output stats
 	fr_time_elapsed_t	cpu_time;	//!< histogram of total CPU time per request
 	fr_time_elapsed_t	wall_clock;	//!< histogram of wall clock time per request
+	fr_histogram_t		*latency;	//!< Our histogram for the "request" latency tracker.
 
 	uint64_t    		num_naks;	//!< number of messages which were nak'd
 	uint64_t    		num_active;	//!< number of active requests
@@ -462,6 +464,7 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 	 */
 	fr_time_elapsed_update(&worker->cpu_time, now, now + reply->reply.processing_time);
 	fr_time_elapsed_update(&worker->wall_clock, reply->reply.request_time, now);
+	fr_latency_add(worker->latency, reply->reply.request_time, now);
 
 	RDEBUG("Finished request");
 
@@ -1071,6 +1074,7 @@ fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const *
 			      fr_worker_config_t *config)
 {
 	fr_worker_t *worker;
+	fr_latency_t *lat;
 
 	worker = talloc_zero(ctx, fr_worker_t);
 	if (!worker) {
@@ -1151,6 +1155,16 @@ nomem:
 		goto fail;
 	}
 
+	/*
+	 *	End to end latency of every request this worker replies
+	 *	to.  Shared by all workers, and read with "stats latency".
+	 */
+	lat = fr_latency_register("request");
+	if (!lat) goto fail;
+
+	worker->latency = fr_latency_writer_alloc(lat);
+	if (!worker->latency) goto fail;
+
 	thread_local_worker = worker;
 
 	return worker;
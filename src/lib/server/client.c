@@ -42,7 +42,18 @@ RCSID("$Id$")
 #include <fcntl.h>
 #include <sys/stat.h>
 
-//#define WITH_TRIE (1)
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/*
+ *	Clients are looked up with a longest prefix match in a
+ *	path-compressed trie.  Undefine this to use one rbtree per
+ *	prefix length instead.
+ */
+#define WITH_TRIE (1)
 
 /** Group of clients
  *
@@ -59,7 +70,7 @@ struct rad_client_list {
 #endif
 };
 
-static RADCLIENT_LIST	*root_clients = NULL;	//!< Global client list.
+static _Atomic(RADCLIENT_LIST *) root_clients;	//!< Global client list.  Swapped atomically on reload.
 
 #ifndef WITH_TRIE
 static int client_cmp(void const *one, void const *two)
@@ -83,7 +94,23 @@ static int client_cmp(void const *one, void const *two)
 
 void client_list_free(void)
 {
-	TALLOC_FREE(root_clients);
+	talloc_free(atomic_exchange_explicit(&root_clients, NULL, memory_order_acq_rel));
+}
+
+/** Replace the global client list
+ *
+ * Lookups which are in progress continue to use the old list, and
+ * lookups started after this function returns use the new one.
+ *
+ * @note The old list, and the clients it contains, must not be freed
+ *	until all requests which may reference its clients have completed.
+ *
+ * @param[in] clients	to install as the global client list.
+ * @return The previous global client list, which may be NULL.
+ */
+RADCLIENT_LIST *client_list_swap(RADCLIENT_LIST *clients)
+{
+	return atomic_exchange_explicit(&root_clients, clients, memory_order_acq_rel);
 }
 
 /** Free a client
@@ -143,16 +170,10 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 }
 
 #ifdef WITH_TRIE
-/*
- *	@todo - either support client definitions where "proto = *",
- *	or udpate this code to allow for that.  i.e. we create yet
- *	another set of v4/v6 tries, for "proto = *" clients.  And then
- *	do lookups there, too.  Or, just unify the udp/tcp tries, and
- *	instead do post-processing?  Though those two clients can have
- *	different secrets... and the trie code doesn't allow 2
- *	fr_trie_user_t nodes in a row.  So we would have to instead
- *	handle that ourselves, with a wrapper around the RADCLIENT
- *	structure that does udp/tcp/wildcard demultiplexing
+/** Return the trie for a particular address family and protocol
+ *
+ * Clients with "proto = *" (IPPROTO_IP) are inserted into both the
+ * UDP and TCP tries, so the caller has to handle that case itself.
  */
 static fr_trie_t *clients_trie(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr,
 			       int proto)
@@ -182,8 +203,7 @@ static fr_trie_t *clients_trie(RADCLIENT_LIST const *clients, fr_ipaddr_t const
 bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
 #ifdef WITH_TRIE
-	fr_trie_t *trie;
-#else
+	fr_trie_t *trie, *tcp_trie = NULL;
 #endif
 	RADCLIENT *old;
 	char buffer[FR_IPADDR_PREFIX_STRLEN];
@@ -265,11 +285,12 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 			/*
 			 *	Initialize the global list, if not done already.
 			 */
-			if (!root_clients) {
-				root_clients = client_list_init(NULL);
-				if (!root_clients) return false;
+			clients = atomic_load_explicit(&root_clients, memory_order_acquire);
+			if (!clients) {
+				clients = client_list_init(NULL);
+				if (!clients) return false;
+				atomic_store_explicit(&root_clients, clients, memory_order_release);
 			}
-			clients = root_clients;
 		}
 	}
 
@@ -278,10 +299,17 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 #ifdef WITH_TRIE
 	trie = clients_trie(clients, &client->ipaddr, client->proto);
 
+	/*
+	 *	Wildcard clients go into both tries, and conflict
+	 *	with an existing client for either protocol.
+	 */
+	if (client->proto == IPPROTO_IP) tcp_trie = clients_trie(clients, &client->ipaddr, IPPROTO_TCP);
+
 	/*
 	 *	Cannot insert the same client twice.
 	 */
 	old = fr_trie_match(trie, &client->ipaddr.addr, client->ipaddr.prefix);
+	if (!old && tcp_trie) old = fr_trie_match(tcp_trie, &client->ipaddr.addr, client->ipaddr.prefix);
 
 #else  /* WITH_TRIE */
 
@@ -323,6 +351,12 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		client_free(client);
 		return false;
 	}
+
+	if (tcp_trie && (fr_trie_insert(tcp_trie, &client->ipaddr.addr, client->ipaddr.prefix, client) < 0)) {
+		(void) fr_trie_remove(trie, &client->ipaddr.addr, client->ipaddr.prefix);
+		client_free(client);
+		return false;
+	}
 #else
 	if (!rbtree_insert(clients->tree[client->ipaddr.prefix], client)) {
 		client_free(client);
@@ -347,7 +381,8 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 
 	if (!client) return;
 
-	if (!clients) clients = root_clients;
+	if (!clients) clients = atomic_load_explicit(&root_clients, memory_order_acquire);
+	if (!clients) return;
 
 	fr_assert(client->ipaddr.prefix <= 128);
 
@@ -358,6 +393,11 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 	 *	Don't free the client.  The caller is responsible for that.
 	 */
 	(void) fr_trie_remove(trie, &client->ipaddr.addr, client->ipaddr.prefix);
+
+	if (client->proto == IPPROTO_IP) {
+		trie = clients_trie(clients, &client->ipaddr, IPPROTO_TCP);
+		(void) fr_trie_remove(trie, &client->ipaddr.addr, client->ipaddr.prefix);
+	}
 #else
 
 	if (!clients->tree[client->ipaddr.prefix]) return;
@@ -378,23 +418,32 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
 RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
 {
 #ifdef WITH_TRIE
-	fr_trie_t *trie;
+	RADCLIENT *client;
 #else
 	int i, max;
 	RADCLIENT my_client, *client;
 #endif
 
-	if (!clients) clients = root_clients;
+	if (!clients) clients = atomic_load_explicit(&root_clients, memory_order_acquire);
 
 	if (!clients || !ipaddr) return NULL;
 
+	if ((ipaddr->af != AF_INET) && (ipaddr->af != AF_INET6)) return NULL;
+
 #ifdef WITH_TRIE
-	trie = clients_trie(clients, ipaddr, proto);
+	client = fr_trie_lookup(clients_trie(clients, ipaddr, proto), &ipaddr->addr, ipaddr->prefix);
+
+	/*
+	 *	Wildcard lookups match clients of either protocol.
+	 */
+	if (!client && (proto == IPPROTO_IP)) {
+		client = fr_trie_lookup(clients_trie(clients, ipaddr, IPPROTO_TCP), &ipaddr->addr, ipaddr->prefix);
+	}
 
-	return fr_trie_lookup(trie, &ipaddr->addr, ipaddr->prefix);
+	return client;
 #else
 
-	if (proto == AF_INET) {
+	if (ipaddr->af == AF_INET) {
 		max = 32;
 	} else {
 		max = 128;
@@ -586,7 +635,7 @@ RADCLIENT_LIST *client_list_parse_section(CONF_SECTION *section, int proto, TLS_
 	 *	The old one is still referenced from the original
 	 *	configuration, and will be freed when that is freed.
 	 */
-	if (global) root_clients = clients;
+	if (global) (void) client_list_swap(clients);
 
 	return clients;
 }
@@ -117,6 +117,8 @@ RADCLIENT_LIST	*client_list_init(CONF_SECTION *cs);
 
 void		client_list_free(void);
 
+RADCLIENT_LIST	*client_list_swap(RADCLIENT_LIST *clients);
+
 RADCLIENT_LIST	*client_list_parse_section(CONF_SECTION *section, int proto, bool tls_required);
 
 void		client_free(RADCLIENT *client);
@@ -34,10 +34,12 @@ RCSID("$Id$")
 #include <freeradius-devel/util/pair_legacy.h>
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/thread_local.h>
+#include <freeradius-devel/unlang/interpret.h>
 
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.h>
 
 #include <sys/file.h>
+#include <signal.h>
 
 #include <fcntl.h>
 #include <ctype.h>
@@ -45,6 +47,9 @@ RCSID("$Id$")
 #ifdef HAVE_SYS_WAIT_H
 #	include <sys/wait.h>
 #endif
+#ifdef HAVE_SPAWN_H
+#	include <spawn.h>
+#endif
 #ifndef WEXITSTATUS
 #	define WEXITSTATUS(stat_val) ((unsigned)(stat_val) >> 8)
 #endif
@@ -54,6 +59,17 @@ RCSID("$Id$")
 
 #define MAX_ARGV (256)
 
+/*
+ *	posix_spawn() lets libc use vfork() or clone(CLONE_VM) where it
+ *	can, so that starting a program doesn't have to copy the page
+ *	tables of a large server.  We only use it when the child can be
+ *	told to close all the descriptors we don't pass to it.
+ */
+#if defined(HAVE_SPAWN_H) && defined(HAVE_POSIX_SPAWN) && \
+    (defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP) || defined(POSIX_SPAWN_CLOEXEC_DEFAULT))
+#	define USE_POSIX_SPAWN
+#endif
+
 static void fr_exec_pair_to_env(request_t *request, fr_pair_t *input_pairs, char **envp, size_t envlen, bool shell_escape)
 {
 	char			*p;
@@ -116,6 +132,7 @@ static void fr_exec_pair_to_env(request_t *request, fr_pair_t *input_pairs, char
 	}
 }
 
+#ifndef USE_POSIX_SPAWN
 /*
  *	Child process.
  *
@@ -205,6 +222,95 @@ static NEVER_RETURNS void fr_exec_child(request_t *request, char **argv, char **
 	 */
 	exit(2);
 }
+#endif
+
+/** Start a child process
+ *
+ * Uses posix_spawn() where available, and falls back to fork() and
+ * fr_exec_child() otherwise.  The child gets the same descriptors in
+ * either case.
+ *
+ * @return
+ *	- PID of the child process.
+ *	- -1 on failure, with errno set.
+ */
+static pid_t fr_exec_spawn(request_t *request, char **argv, char **envp,
+			   bool exec_wait, int *input_fd, int *output_fd,
+			   int to_child[static 2], int from_child[static 2])
+{
+	pid_t	pid;
+
+#ifdef USE_POSIX_SPAWN
+	posix_spawn_file_actions_t	actions;
+	posix_spawnattr_t		attr;
+	int				ret;
+
+	ret = posix_spawn_file_actions_init(&actions);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+
+	ret = posix_spawnattr_init(&attr);
+	if (ret != 0) {
+		posix_spawn_file_actions_destroy(&actions);
+		errno = ret;
+		return -1;
+	}
+
+	if (exec_wait && input_fd) {
+		ret = posix_spawn_file_actions_adddup2(&actions, to_child[0], STDIN_FILENO);
+	} else {
+		ret = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDWR, 0);
+	}
+	if (ret != 0) goto done;
+
+	if (exec_wait && output_fd) {
+		ret = posix_spawn_file_actions_adddup2(&actions, from_child[1], STDOUT_FILENO);
+	} else {
+		ret = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_RDWR, 0);
+	}
+	if (ret != 0) goto done;
+
+	/*
+	 *	As with fr_exec_child(), error messages only go to
+	 *	our STDERR if we're debugging.
+	 */
+	if (!request || !RDEBUG_ENABLED) {
+		ret = posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_RDWR, 0);
+		if (ret != 0) goto done;
+	}
+
+#  ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+	ret = posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#  else
+	/*
+	 *	Close everything the child wasn't explicitly given.
+	 */
+	ret = posix_spawnattr_setflags(&attr, POSIX_SPAWN_CLOEXEC_DEFAULT);
+	if (ret == 0) ret = posix_spawn_file_actions_addinherit_np(&actions, STDIN_FILENO);
+	if (ret == 0) ret = posix_spawn_file_actions_addinherit_np(&actions, STDOUT_FILENO);
+	if (ret == 0) ret = posix_spawn_file_actions_addinherit_np(&actions, STDERR_FILENO);
+#  endif
+	if (ret != 0) goto done;
+
+	ret = posix_spawn(&pid, argv[0], &actions, &attr, argv, envp);
+
+done:
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+#else
+	pid = fork();
+	if (pid == 0) fr_exec_child(request, argv, envp, exec_wait, input_fd, output_fd, to_child, from_child);
+#endif
+
+	return pid;
+}
 
 /** Start a process
  *
@@ -280,10 +386,7 @@ pid_t radius_start_program(char const *cmd, request_t *request, bool exec_wait,
 	envp[0] = NULL;
 	if (input_pairs) fr_exec_pair_to_env(request, input_pairs, envp, MAX_ENVP, shell_escape);
 
-	pid = fork();
-	if (pid == 0) {
-		fr_exec_child(request, argv, envp, exec_wait, input_fd, output_fd, to_child, from_child);
-	}
+	pid = fr_exec_spawn(request, argv, envp, exec_wait, input_fd, output_fd, to_child, from_child);
 
 	/*
 	 *	Free child environment variables
@@ -294,7 +397,7 @@ pid_t radius_start_program(char const *cmd, request_t *request, bool exec_wait,
 	 *	Parent process.
 	 */
 	if (pid < 0) {
-		ERROR("Couldn't fork %s: %s", argv[0], fr_syserror(errno));
+		ERROR("Couldn't start %s: %s", argv[0], fr_syserror(errno));
 		if (exec_wait) {
 			/* safe because these either need closing or are == -1 */
 			close(to_child[0]);
@@ -647,15 +750,10 @@ int fr_exec_nowait(request_t *request, fr_value_box_t *vb, fr_pair_t *env_pairs)
 		for (i = 0; i < argc; i++) RDEBUG3("arg[%d] %s", i, argv[i]);
 	}
 
-	pid = fork();
-
-	/*
-	 *	The child never returns from calling fr_exec_child();
-	 */
-	if (pid == 0) {
-		int unused[2];
+	{
+		int unused[2] = { -1, -1 };
 
-		fr_exec_child(request, argv, envp, false, NULL, NULL, unused, unused);
+		pid = fr_exec_spawn(request, argv, envp, false, NULL, NULL, unused, unused);
 	}
 
 	/*
@@ -664,7 +762,7 @@ int fr_exec_nowait(request_t *request, fr_value_box_t *vb, fr_pair_t *env_pairs)
 	talloc_free(envp);
 
 	if (pid < 0) {
-		ERROR("Couldn't fork %s: %s", argv[0], fr_syserror(errno));
+		ERROR("Couldn't start %s: %s", argv[0], fr_syserror(errno));
 		talloc_free(argv);
 		return -1;
 	}
@@ -762,14 +860,7 @@ int fr_exec_wait_start(request_t *request, fr_value_box_t *vb, fr_pair_t *env_pa
 		}
 	}
 
-	pid = fork();
-
-	/*
-	 *	The child never returns from calling fr_exec_child();
-	 */
-	if (pid == 0) {
-		fr_exec_child(request, argv, envp, true, input_fd, output_fd, to_child, from_child);
-	}
+	pid = fr_exec_spawn(request, argv, envp, true, input_fd, output_fd, to_child, from_child);
 
 	/*
 	 *	Parent process.  Do all necessary cleanups.
@@ -777,7 +868,7 @@ int fr_exec_wait_start(request_t *request, fr_value_box_t *vb, fr_pair_t *env_pa
 	talloc_free(envp);
 
 	if (pid < 0) {
-		ERROR("Couldn't fork %s: %s", argv[0], fr_syserror(errno));
+		ERROR("Couldn't start %s: %s", argv[0], fr_syserror(errno));
 		if (input_fd) {
 			close(to_child[0]);
 			close(to_child[1]);
@@ -809,3 +900,449 @@ int fr_exec_wait_start(request_t *request, fr_value_box_t *vb, fr_pair_t *env_pa
 
 	return 0;
 }
+
+/** A long-lived helper process
+ *
+ */
+struct fr_exec_helper_s {
+	fr_exec_helper_pool_t	*pool;
+
+	pid_t			pid;			//!< -1 if the helper isn't running.
+	int			to_helper;		//!< Helper's stdin.
+	int			from_helper;		//!< Helper's stdout.
+
+	bool			busy;			//!< Waiting for an answer from the helper.
+	fr_exec_helper_request_t *hr;			//!< Request being processed.  NULL if idle,
+							///< or if the request was cancelled.
+
+	size_t			used;			//!< How much of the buffer has been read.
+	char			buffer[8192];
+};
+
+struct fr_exec_helper_pool_s {
+	fr_event_list_t		*el;
+	char const		*name;			//!< Used in log messages.
+	char const		*program;		//!< Command line of the helpers.
+
+	fr_exec_helper_line_t	line;			//!< Called for each line of an answer.
+	void			*uctx;			//!< Passed to line.
+
+	uint32_t		count;			//!< How many helpers there are.
+	fr_exec_helper_t	**helpers;
+	fr_dlist_head_t		queue;			//!< Requests waiting for an idle helper.
+};
+
+static void exec_helper_read(fr_event_list_t *el, int fd, int flags, void *uctx);
+static void exec_helper_error(fr_event_list_t *el, int fd, int flags, int fd_errno, void *uctx);
+
+/** Start a helper
+ *
+ */
+static int exec_helper_start(fr_exec_helper_t *helper)
+{
+	fr_exec_helper_pool_t	*pool = helper->pool;
+	pid_t			pid;
+	int			to_helper = -1, from_helper = -1;
+
+	/*
+	 *	The helper isn't associated with any request, so the
+	 *	command can't contain any expansions.
+	 */
+	pid = radius_start_program(pool->program, NULL, true, &to_helper, &from_helper, NULL, false);
+	if (pid < 0) {
+		PERROR("Failed starting %s", pool->name);
+		return -1;
+	}
+
+	if (fr_nonblock(from_helper) < 0) {
+		PERROR("Failed setting %s output to non-blocking", pool->name);
+		goto error;
+	}
+
+	if (fr_event_fd_insert(helper, pool->el, from_helper,
+			       exec_helper_read, NULL, exec_helper_error, helper) < 0) {
+		PERROR("Failed adding %s to the event loop", pool->name);
+		goto error;
+	}
+
+	helper->pid = pid;
+	helper->to_helper = to_helper;
+	helper->from_helper = from_helper;
+	helper->used = 0;
+
+	DEBUG3("Started %s %u", pool->name, pid);
+
+	return 0;
+
+error:
+	close(to_helper);
+	close(from_helper);
+	kill(pid, SIGTERM);
+	(void) fr_event_pid_wait(pool->el, pool->el, NULL, pid, NULL, NULL);
+
+	return -1;
+}
+
+/** Stop a helper
+ *
+ * The helper is restarted the next time a request needs it.
+ */
+static void exec_helper_stop(fr_exec_helper_t *helper)
+{
+	fr_exec_helper_pool_t *pool = helper->pool;
+
+	if (helper->pid < 0) return;
+
+	(void) fr_event_fd_delete(pool->el, helper->from_helper, FR_EVENT_FILTER_IO);
+	close(helper->to_helper);
+	close(helper->from_helper);
+
+	kill(helper->pid, SIGTERM);
+	(void) fr_event_pid_wait(pool->el, pool->el, NULL, helper->pid, NULL, NULL);
+
+	helper->pid = -1;
+	helper->to_helper = -1;
+	helper->from_helper = -1;
+	helper->busy = false;
+	helper->hr = NULL;
+	helper->used = 0;
+}
+
+/** Tell a request it's done, and resume it
+ *
+ */
+static void exec_helper_request_done(fr_exec_helper_request_t *hr)
+{
+	hr->helper = NULL;
+
+	unlang_interpret_resumable(hr->request);
+}
+
+/** Send a request to an idle helper, starting it if necessary
+ *
+ */
+static int exec_helper_send(fr_exec_helper_t *helper, fr_exec_helper_request_t *hr)
+{
+	fr_exec_helper_pool_t	*pool = helper->pool;
+	request_t		*request = hr->request;
+	size_t			done = 0;
+
+	fr_assert(!helper->busy);
+
+	if ((helper->pid < 0) && (exec_helper_start(helper) < 0)) {
+		RPERROR("Failed starting %s", pool->name);
+		return -1;
+	}
+
+	/*
+	 *	The query is no larger than a pipe buffer, and the
+	 *	helper is idle, so this doesn't block.
+	 */
+	while (done < hr->query_len) {
+		ssize_t slen;
+
+		slen = write(helper->to_helper, hr->query + done, hr->query_len - done);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			REDEBUG("Failed writing to %s: %s", pool->name, fr_syserror(errno));
+			exec_helper_stop(helper);
+			return -1;
+		}
+		done += slen;
+	}
+
+	helper->busy = true;
+	helper->hr = hr;
+	hr->helper = helper;
+
+	return 0;
+}
+
+/** Give queued requests to idle helpers
+ *
+ */
+static void exec_helper_run_queue(fr_exec_helper_pool_t *pool)
+{
+	uint32_t i;
+
+	for (i = 0; i < pool->count; i++) {
+		fr_exec_helper_t		*helper = pool->helpers[i];
+		fr_exec_helper_request_t	*hr;
+
+		while (!helper->busy && (hr = fr_dlist_pop_head(&pool->queue))) {
+			if (exec_helper_send(helper, hr) < 0) {
+				hr->result = -1;
+				exec_helper_request_done(hr);
+			}
+		}
+	}
+}
+
+/** Fail the request a helper is processing, and restart the helper
+ *
+ */
+static void exec_helper_restart(fr_exec_helper_t *helper)
+{
+	fr_exec_helper_pool_t *pool = helper->pool;
+
+	if (helper->hr) {
+		helper->hr->result = -1;
+		exec_helper_request_done(helper->hr);
+	}
+	exec_helper_stop(helper);
+	exec_helper_run_queue(pool);
+}
+
+static void exec_helper_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_exec_helper_t	*helper = talloc_get_type_abort(uctx, fr_exec_helper_t);
+	fr_exec_helper_pool_t	*pool = helper->pool;
+	ssize_t			slen;
+	char			*p, *end, *eol;
+
+	slen = read(helper->from_helper, helper->buffer + helper->used, sizeof(helper->buffer) - helper->used - 1);
+	if (slen < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+		ERROR("Failed reading from %s: %s", pool->name, fr_syserror(errno));
+		exec_helper_restart(helper);
+		return;
+	}
+
+	if (slen == 0) {
+		ERROR("%s %u exited", pool->name, helper->pid);
+		exec_helper_restart(helper);
+		return;
+	}
+
+	helper->used += slen;
+	p = helper->buffer;
+	end = helper->buffer + helper->used;
+
+	while ((eol = memchr(p, '\n', end - p)) != NULL) {
+		fr_exec_helper_request_t	*hr = helper->hr;
+		int				ret;
+
+		/*
+		 *	Helpers only write in answer to a query.
+		 */
+		if (!helper->busy) {
+			ERROR("Unexpected output from %s", pool->name);
+			exec_helper_restart(helper);
+			return;
+		}
+
+		*eol = '\0';
+		if ((eol > p) && (eol[-1] == '\r')) eol[-1] = '\0';
+
+		ret = pool->line(hr, p, pool->uctx);
+		if (ret < 0) {
+			exec_helper_restart(helper);
+			return;
+		}
+
+		if (ret == 1) {
+			/*
+			 *	There's only ever one query
+			 *	outstanding, so anything after the
+			 *	end of the answer is junk.
+			 */
+			if (eol + 1 != end) {
+				ERROR("Unexpected output from %s", pool->name);
+				exec_helper_restart(helper);
+				return;
+			}
+
+			helper->busy = false;
+			helper->hr = NULL;
+			helper->used = 0;
+
+			/*
+			 *	The request may have been cancelled
+			 *	while the helper was busy.
+			 */
+			if (hr) exec_helper_request_done(hr);
+			exec_helper_run_queue(pool);
+			return;
+		}
+
+		p = eol + 1;
+	}
+
+	if (p == helper->buffer) {
+		if (helper->used < (sizeof(helper->buffer) - 1)) return;
+
+		ERROR("Line from %s is too long", pool->name);
+		exec_helper_restart(helper);
+		return;
+	}
+
+	helper->used = end - p;
+	memmove(helper->buffer, p, helper->used);
+}
+
+static void exec_helper_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	fr_exec_helper_t	*helper = talloc_get_type_abort(uctx, fr_exec_helper_t);
+
+	ERROR("%s %u failed: %s", helper->pool->name, helper->pid, fr_syserror(fd_errno));
+
+	exec_helper_restart(helper);
+}
+
+/** Allocate a pool of helpers, and start them
+ *
+ * @param[in] ctx	to allocate the pool in.
+ * @param[in] el	to read the helpers' answers in.
+ * @param[in] name	of the helpers, used in log messages.
+ * @param[in] program	to run.  Can't contain expansions.
+ * @param[in] count	How many helpers to run.
+ * @param[in] line	called for each line of an answer.
+ * @param[in] uctx	passed to line.
+ * @return
+ *	- A new pool.
+ *	- NULL on failure.
+ */
+fr_exec_helper_pool_t *fr_exec_helper_pool_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+						 char const *name, char const *program, uint32_t count,
+						 fr_exec_helper_line_t line, void *uctx)
+{
+	fr_exec_helper_pool_t	*pool;
+	uint32_t		i;
+
+	MEM(pool = talloc_zero(ctx, fr_exec_helper_pool_t));
+	pool->el = el;
+	MEM(pool->name = talloc_typed_strdup(pool, name));
+	MEM(pool->program = talloc_typed_strdup(pool, program));
+	pool->line = line;
+	pool->uctx = uctx;
+	pool->count = count;
+	fr_dlist_init(&pool->queue, fr_exec_helper_request_t, entry);
+
+	MEM(pool->helpers = talloc_zero_array(pool, fr_exec_helper_t *, count));
+	for (i = 0; i < count; i++) {
+		fr_exec_helper_t *helper;
+
+		MEM(helper = pool->helpers[i] = talloc_zero(pool->helpers, fr_exec_helper_t));
+		helper->pool = pool;
+		helper->pid = -1;
+		helper->to_helper = -1;
+		helper->from_helper = -1;
+
+		if (exec_helper_start(helper) < 0) {
+			fr_exec_helper_pool_stop(pool);
+			talloc_free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+/** Kill all the helpers in a pool, and wait for them to exit
+ *
+ * Used when the event loop is going away, so the helpers can't be
+ * reaped asynchronously.
+ */
+void fr_exec_helper_pool_stop(fr_exec_helper_pool_t *pool)
+{
+	uint32_t i;
+
+	for (i = 0; i < pool->count; i++) {
+		fr_exec_helper_t *helper = pool->helpers[i];
+
+		if (!helper || (helper->pid < 0)) continue;
+
+		(void) fr_event_fd_delete(pool->el, helper->from_helper, FR_EVENT_FILTER_IO);
+		close(helper->to_helper);
+		close(helper->from_helper);
+
+		kill(helper->pid, SIGTERM);
+		(void) waitpid(helper->pid, NULL, 0);
+		helper->pid = -1;
+	}
+}
+
+/** Initialise a request for a helper
+ *
+ * @param[out] hr		to initialise.
+ * @param[in] request		The current request.
+ * @param[in] query		to write to the helper.  Must remain valid
+ *				until the helper has answered.
+ * @param[in] query_len		Length of the query.
+ * @param[in] uctx		passed to the line callback.
+ */
+void fr_exec_helper_request_init(fr_exec_helper_request_t *hr, request_t *request,
+				 char const *query, size_t query_len, void *uctx)
+{
+	memset(hr, 0, sizeof(*hr));
+	fr_dlist_entry_init(&hr->entry);
+	hr->request = request;
+	hr->query = query;
+	hr->query_len = query_len;
+	hr->uctx = uctx;
+}
+
+/** Give a request to an idle helper, or queue it until one is available
+ *
+ * When the helper answers, hr->result is set, and the request is
+ * marked as resumable.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the request couldn't be sent to a helper.
+ */
+int fr_exec_helper_enqueue(fr_exec_helper_pool_t *pool, fr_exec_helper_request_t *hr)
+{
+	uint32_t i;
+
+	/*
+	 *	Prefer helpers which are already running.
+	 */
+	for (i = 0; i < pool->count; i++) {
+		if (!pool->helpers[i]->busy && (pool->helpers[i]->pid >= 0)) return exec_helper_send(pool->helpers[i], hr);
+	}
+
+	for (i = 0; i < pool->count; i++) {
+		if (!pool->helpers[i]->busy) return exec_helper_send(pool->helpers[i], hr);
+	}
+
+	fr_dlist_insert_tail(&pool->queue, hr);
+
+	return 0;
+}
+
+/** Stop waiting for a helper
+ *
+ * @param[in] pool	the request was given to.
+ * @param[in] hr	to remove.
+ * @param[in] timeout	If true, the helper processing the request is hung.
+ *			It's killed, and will be restarted for the next
+ *			request.  Otherwise, the helper's answer is
+ *			discarded when it arrives.
+ * @return
+ *	- true if the request was still waiting.
+ *	- false if the helper had already answered.
+ */
+bool fr_exec_helper_dequeue(fr_exec_helper_pool_t *pool, fr_exec_helper_request_t *hr, bool timeout)
+{
+	fr_exec_helper_t *helper = hr->helper;
+
+	if (!helper) {
+		if (!fr_dlist_entry_in_list(&hr->entry)) return false;
+
+		fr_dlist_remove(&pool->queue, hr);
+		return true;
+	}
+
+	hr->helper = NULL;
+	helper->hr = NULL;
+
+	if (timeout) {
+		exec_helper_stop(helper);
+		exec_helper_run_queue(pool);
+	}
+
+	return true;
+}
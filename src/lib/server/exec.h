@@ -38,6 +38,8 @@ extern "C" {
 #endif
 
 #include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/pair.h>
 
 #include <sys/types.h>
@@ -63,6 +65,65 @@ int	fr_exec_wait_start(request_t *request, fr_value_box_t *vb, fr_pair_t *env_pa
 
 void	fr_exec_waitpid(pid_t pid);
 
+/** @name Long-lived helper processes
+ *
+ * A pool of copies of a program which read queries on stdin, and write
+ * answers on stdout, one query at a time.  Requests are written to an
+ * idle helper, and yield until it answers.  Requests which arrive when
+ * all helpers are busy wait in a queue.  Helpers which exit, write junk,
+ * or are killed after a timeout are restarted when next needed.
+ *
+ * Pools aren't thread safe.  Each worker thread should have its own.
+ *
+ * @{
+ */
+typedef struct fr_exec_helper_s fr_exec_helper_t;
+typedef struct fr_exec_helper_pool_s fr_exec_helper_pool_t;
+
+/** A request waiting for, or being processed by, a helper
+ *
+ */
+typedef struct {
+	request_t		*request;
+	char const		*query;			//!< To write to the helper.  Must fit in a pipe buffer.
+	size_t			query_len;
+	void			*uctx;			//!< Passed to the line callback.
+
+	fr_dlist_t		entry;			//!< Entry in the queue of requests waiting for a helper.
+	fr_exec_helper_t	*helper;		//!< Helper processing the request.  NULL if still
+							///< queued, or done.
+	int			result;			//!< Set by the line callback.  -1 if the helper failed.
+} fr_exec_helper_request_t;
+
+/** Process one line of a helper's answer
+ *
+ * @param[in] hr	being answered.  NULL if the request was cancelled
+ *			while the helper was busy, in which case the line
+ *			only needs checking for the end of the answer.
+ * @param[in] line	without the trailing newline.
+ * @param[in] uctx	passed to #fr_exec_helper_pool_alloc.
+ * @return
+ *	- 1 if this was the end of the answer.  hr->result should have been set.
+ *	- 0 if there's more to come.
+ *	- -1 if the answer is invalid.  The callback should log why.  The
+ *	  request fails, and the helper is restarted.
+ */
+typedef int (*fr_exec_helper_line_t)(fr_exec_helper_request_t *hr, char *line, void *uctx);
+
+fr_exec_helper_pool_t	*fr_exec_helper_pool_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+						   char const *name, char const *program, uint32_t count,
+						   fr_exec_helper_line_t line, void *uctx);
+
+void	fr_exec_helper_pool_stop(fr_exec_helper_pool_t *pool);
+
+void	fr_exec_helper_request_init(fr_exec_helper_request_t *hr, request_t *request,
+				    char const *query, size_t query_len, void *uctx);
+
+int	fr_exec_helper_enqueue(fr_exec_helper_pool_t *pool, fr_exec_helper_request_t *hr);
+
+bool	fr_exec_helper_dequeue(fr_exec_helper_pool_t *pool, fr_exec_helper_request_t *hr, bool timeout);
+/** @} */
+
 #ifdef __cplusplus
 }
 #endif
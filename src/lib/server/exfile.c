@@ -27,11 +27,24 @@
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/exfile.h>
 
+#include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#include <limits.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
 typedef struct {
 	int			fd;			//!< File descriptor associated with an entry.
 	uint32_t		hash;			//!< Hash for cheap comparison.
@@ -41,6 +54,69 @@ typedef struct {
 	char			*filename;		//!< Filename.
 } exfile_entry_t;
 
+/** A formatted record waiting to be written by the writer thread
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the pending list for the file.
+	char const		*filename;		//!< File to write the record to.
+	uint32_t		hash;			//!< Hash of the filename.
+	mode_t			permissions;		//!< To create the file with.
+	gid_t			gid;			//!< To chown the file to.  -1 to leave it alone.
+	size_t			len;			//!< Length of the data.
+	uint8_t			*data;			//!< Formatted record.
+} exfile_record_t;
+
+/** Records for one file, which are written together
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the writer's list of files.
+	char const		*filename;		//!< Of the file.  Belongs to the first record.
+	uint32_t		hash;			//!< Hash of the filename.
+	size_t			len;			//!< Total length of pending records.
+	fr_time_t		first;			//!< When the oldest record was queued.
+	fr_dlist_head_t		records;		//!< Records waiting to be written.
+} exfile_pending_t;
+
+/** Slot in the queue between the workers and the writer thread
+ *
+ * The queue is a bounded ring where each slot carries a sequence number,
+ * so that any number of workers can push without taking a lock.  Only
+ * the writer thread pops records.
+ */
+typedef struct {
+	_Atomic(uint64_t)	seq;			//!< Which lap of the ring the slot is ready for.
+	exfile_record_t		*record;
+} exfile_slot_t;
+
+/** State for the asynchronous writer
+ *
+ */
+typedef struct {
+	exfile_writer_conf_t	conf;			//!< Copy of the writer configuration.
+
+	pthread_t		thread;			//!< Writer thread.
+	bool			running;		//!< Whether the writer thread was started.
+	bool			stop;			//!< Tell the writer thread to exit.
+
+	pthread_mutex_t		mutex;			//!< Protects the condition variables.
+	pthread_cond_t		wakeup;			//!< Signalled when there's data to write.
+	pthread_cond_t		space;			//!< Signalled when records have been taken off the queue.
+	uint32_t		waiting;		//!< Number of workers waiting for space.
+
+	exfile_slot_t		*slots;			//!< The queue.
+	uint64_t		mask;			//!< Number of slots - 1.
+	_Atomic(uint64_t)	head;			//!< Next slot a worker will write to.
+	uint64_t		tail;			//!< Next slot the writer will read.  Only
+							//!< used by the writer thread.
+
+	_Atomic(uint64_t)	queued;			//!< Bytes in the queue.
+	_Atomic(uint64_t)	dropped;		//!< Records we failed to queue.
+
+	fr_dlist_head_t		pending;		//!< Files with records waiting to be written.
+} exfile_writer_t;
+
 
 struct exfile_s {
 	uint32_t		max_entries;		//!< How many file descriptors we keep track of.
@@ -52,6 +128,18 @@ struct exfile_s {
 	CONF_SECTION		*conf;			//!< Conf section to search for triggers.
 	char const		*trigger_prefix;	//!< Trigger path in the global trigger section.
 	fr_pair_t		*trigger_args;		//!< Arguments to pass to trigger.
+	exfile_writer_t		*writer;		//!< Asynchronous writer.  NULL if records are
+							//!< written by the caller.
+};
+
+CONF_PARSER const exfile_writer_config[] = {
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, exfile_writer_conf_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET("queue_size", FR_TYPE_UINT32, exfile_writer_conf_t, queue_size), .dflt = "4096" },
+	{ FR_CONF_OFFSET("flush_size", FR_TYPE_SIZE, exfile_writer_conf_t, flush_size), .dflt = "65536" },
+	{ FR_CONF_OFFSET("flush_interval", FR_TYPE_TIME_DELTA, exfile_writer_conf_t, flush_interval), .dflt = "0.1" },
+	{ FR_CONF_OFFSET("fsync", FR_TYPE_BOOL, exfile_writer_conf_t, fsync), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_wait", FR_TYPE_TIME_DELTA, exfile_writer_conf_t, max_wait), .dflt = "1.0" },
+	CONF_PARSER_TERMINATOR
 };
 
 #define MAX_TRY_LOCK 4			//!< How many times we attempt to acquire a lock
@@ -116,10 +204,19 @@ static void exfile_cleanup_entry(exfile_t *ef, request_t *request, exfile_entry_
 }
 
 
+static void exfile_writer_stop(exfile_t *ef);
+
 static int _exfile_free(exfile_t *ef)
 {
 	uint32_t i;
 
+	/*
+	 *	Write anything still queued before closing the files.
+	 */
+	if (ef->writer) exfile_writer_stop(ef);
+
+	if (!ef->locking) return 0;
+
 	pthread_mutex_lock(&ef->mutex);
 
 	for (i = 0; i < ef->max_entries; i++) {
@@ -157,6 +254,8 @@ exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle,
 	ef->max_idle = max_idle;
 	ef->locking = locking;
 
+	talloc_set_destructor(ef, _exfile_free);
+
 	/*
 	 *	If we're not locking the files, just return the
 	 *	handle.  Each call to exfile_open() will just open a
@@ -166,17 +265,17 @@ exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle,
 
 	ef->entries = talloc_zero_array(ef, exfile_entry_t, max_entries);
 	if (!ef->entries) {
+		ef->locking = false;
 		talloc_free(ef);
 		return NULL;
 	}
 
 	if (pthread_mutex_init(&ef->mutex, NULL) != 0) {
+		ef->locking = false;
 		talloc_free(ef);
 		return NULL;
 	}
 
-	talloc_set_destructor(ef, _exfile_free);
-
 	return ef;
 }
 
@@ -552,3 +651,485 @@ int exfile_close(exfile_t *ef, request_t *request, int fd)
 	fr_strerror_printf("Attempt to unlock file which is not tracked");
 	return -1;
 }
+
+/** Write all of an iovec array, resuming after short writes
+ *
+ * @param[in] fd	to write to.
+ * @param[in] iov	data to write.  Modified if the write is short.
+ * @param[in] iovcnt	number of elements in iov.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int exfile_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t slen;
+
+		slen = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		/*
+		 *	Skip the buffers we've written, and adjust
+		 *	the one we stopped part way through.
+		 */
+		while ((iovcnt > 0) && ((size_t) slen >= iov->iov_len)) {
+			slen -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = ((uint8_t *) iov->iov_base) + slen;
+			iov->iov_len -= slen;
+		}
+	}
+
+	return 0;
+}
+
+/** Open a file, and write data to it
+ *
+ */
+static int exfile_write_fd(exfile_t *ef, request_t *request, char const *filename, mode_t permissions, gid_t gid,
+			   struct iovec *iov, int iovcnt, bool sync)
+{
+	int fd, ret = 0;
+
+	fd = exfile_open(ef, request, filename, permissions);
+	if (fd < 0) return -1;
+
+	if ((gid != (gid_t) -1) && (fchown(fd, -1, gid) < 0)) {
+		ROPTIONAL(RWDEBUG, WARN, "Unable to change system group of \"%s\": %s", filename, fr_syserror(errno));
+	}
+
+	if (exfile_writev(fd, iov, iovcnt) < 0) {
+		fr_strerror_printf("Failed writing to \"%s\": %s", filename, fr_syserror(errno));
+		ret = -1;
+	}
+
+	if (sync && (ret == 0) && (fsync(fd) < 0)) {
+		fr_strerror_printf("Failed syncing \"%s\": %s", filename, fr_syserror(errno));
+		ret = -1;
+	}
+
+	exfile_close(ef, request, fd);
+
+	return ret;
+}
+
+/** Write a file's pending records as a batch
+ *
+ */
+static void exfile_writer_flush(exfile_t *ef, exfile_pending_t *pending)
+{
+	exfile_writer_t		*w = ef->writer;
+	exfile_record_t		*first = fr_dlist_head(&pending->records);
+	exfile_record_t		*rec;
+	struct iovec		*iov;
+	int			i = 0;
+
+	MEM(iov = talloc_array(pending, struct iovec, fr_dlist_num_elements(&pending->records)));
+	for (rec = first; rec; rec = fr_dlist_next(&pending->records, rec)) {
+		iov[i].iov_base = rec->data;
+		iov[i].iov_len = rec->len;
+		i++;
+	}
+
+	if (exfile_write_fd(ef, NULL, first->filename, first->permissions, first->gid, iov, i, w->conf.fsync) < 0) {
+		PERROR("Lost %i records", i);
+	}
+
+	fr_dlist_remove(&w->pending, pending);
+	talloc_free(pending);
+}
+
+/** Take a record off the queue
+ *
+ */
+static exfile_record_t *exfile_writer_pop(exfile_writer_t *w)
+{
+	exfile_slot_t	*slot = &w->slots[w->tail & w->mask];
+	exfile_record_t	*rec;
+
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire) != (w->tail + 1)) return NULL;
+
+	rec = slot->record;
+	atomic_store_explicit(&slot->seq, w->tail + w->mask + 1, memory_order_release);
+	w->tail++;
+
+	return rec;
+}
+
+/** Move records from the queue onto the pending list for their file
+ *
+ */
+static void exfile_writer_drain(exfile_writer_t *w)
+{
+	exfile_record_t		*rec;
+	uint64_t		drained = 0;
+
+	while ((rec = exfile_writer_pop(w))) {
+		exfile_pending_t	*pending;
+
+		drained += rec->len;
+
+		for (pending = fr_dlist_head(&w->pending);
+		     pending;
+		     pending = fr_dlist_next(&w->pending, pending)) {
+			if ((pending->hash == rec->hash) && (strcmp(pending->filename, rec->filename) == 0)) break;
+		}
+
+		if (!pending) {
+			MEM(pending = talloc_zero(NULL, exfile_pending_t));
+			pending->filename = rec->filename;
+			pending->hash = rec->hash;
+			pending->first = fr_time();
+			fr_dlist_talloc_init(&pending->records, exfile_record_t, entry);
+			fr_dlist_insert_tail(&w->pending, pending);
+		}
+
+		talloc_steal(pending, rec);
+		fr_dlist_insert_tail(&pending->records, rec);
+		pending->len += rec->len;
+	}
+
+	if (!drained) return;
+
+	atomic_fetch_sub_explicit(&w->queued, drained, memory_order_relaxed);
+
+	/*
+	 *	Let any workers waiting for space know there is some.
+	 */
+	pthread_mutex_lock(&w->mutex);
+	if (w->waiting) pthread_cond_broadcast(&w->space);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/** Batch queued records into large writes
+ *
+ * Records are grouped by file.  A file's records are written when they
+ * reach flush_size, when the oldest has waited for flush_interval, or
+ * when the writer is stopped.
+ */
+static void *exfile_writer_thread(void *arg)
+{
+	exfile_t		*ef = arg;
+	exfile_writer_t		*w = ef->writer;
+	bool			stop = false;
+
+	for (;;) {
+		exfile_pending_t	*pending, *next;
+		fr_time_t		now, wake;
+		struct timespec		ts;
+
+		exfile_writer_drain(w);
+
+		now = fr_time();
+		wake = now + w->conf.flush_interval;
+
+		for (pending = fr_dlist_head(&w->pending); pending; pending = next) {
+			next = fr_dlist_next(&w->pending, pending);
+
+			if (stop || (pending->len >= w->conf.flush_size) ||
+			    ((now - pending->first) >= w->conf.flush_interval)) {
+				exfile_writer_flush(ef, pending);
+				continue;
+			}
+
+			if ((pending->first + w->conf.flush_interval) < wake) wake = pending->first + w->conf.flush_interval;
+		}
+
+		/*
+		 *	The workers have finished, so nothing else
+		 *	will be queued.
+		 */
+		if (stop) break;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += (wake - now) / NSEC;
+		ts.tv_nsec += (wake - now) % NSEC;
+		if (ts.tv_nsec >= NSEC) {
+			ts.tv_sec++;
+			ts.tv_nsec -= NSEC;
+		}
+
+		pthread_mutex_lock(&w->mutex);
+		if (!w->stop && (atomic_load_explicit(&w->queued, memory_order_relaxed) < w->conf.flush_size)) {
+			pthread_cond_timedwait(&w->wakeup, &w->mutex, &ts);
+		}
+		stop = w->stop;
+		pthread_mutex_unlock(&w->mutex);
+	}
+
+	return NULL;
+}
+
+/** Stop the writer thread, writing any records which are still queued
+ *
+ */
+static void exfile_writer_stop(exfile_t *ef)
+{
+	exfile_writer_t *w = ef->writer;
+	uint64_t	dropped;
+
+	if (w->running) {
+		pthread_mutex_lock(&w->mutex);
+		w->stop = true;
+		pthread_cond_signal(&w->wakeup);
+		pthread_mutex_unlock(&w->mutex);
+
+		pthread_join(w->thread, NULL);
+		w->running = false;
+	}
+
+	dropped = atomic_load(&w->dropped);
+	if (dropped) WARN("Dropped %" PRIu64 " records because the writer couldn't keep up", dropped);
+
+	pthread_cond_destroy(&w->space);
+	pthread_cond_destroy(&w->wakeup);
+	pthread_mutex_destroy(&w->mutex);
+
+	TALLOC_FREE(ef->writer);
+}
+
+/** Start a thread to write records passed to exfile_write()
+ *
+ * Instead of each worker opening, locking and writing to the file itself,
+ * exfile_write() copies the record to a queue, and returns.  A writer thread
+ * takes records off the queue, and writes each file's records together.
+ *
+ * When the queue is full, exfile_write() waits for the writer to catch up,
+ * for at most max_wait.
+ *
+ * Must be called after the server has forked, and before any calls to
+ * exfile_write().  Does nothing if conf->async is false.
+ *
+ * @param[in] ef	to start the writer for.
+ * @param[in] conf	for the writer.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int exfile_writer_start(exfile_t *ef, exfile_writer_conf_t const *conf)
+{
+	exfile_writer_t	*w;
+	uint64_t	i, size = 1;
+	int		ret;
+
+	if (!conf->async) return 0;
+
+	if (ef->writer) {
+		fr_strerror_printf("Writer is already running");
+		return -1;
+	}
+
+	MEM(w = talloc_zero(ef, exfile_writer_t));
+	w->conf = *conf;
+
+	/*
+	 *	The writer thread sleeps for at most flush_interval,
+	 *	and is woken when flush_size bytes are queued.  If
+	 *	either is 0, it never sleeps.
+	 */
+	FR_INTEGER_BOUND_CHECK("writer.queue_size", w->conf.queue_size, >=, 16);
+	FR_INTEGER_BOUND_CHECK("writer.queue_size", w->conf.queue_size, <=, 1048576);
+
+	FR_SIZE_BOUND_CHECK("writer.flush_size", w->conf.flush_size, >=, (size_t)1024);
+	FR_SIZE_BOUND_CHECK("writer.flush_size", w->conf.flush_size, <=, (size_t)(16 * 1024 * 1024));
+
+	FR_TIME_DELTA_BOUND_CHECK("writer.flush_interval", w->conf.flush_interval, >=, fr_time_delta_from_msec(1));
+	FR_TIME_DELTA_BOUND_CHECK("writer.flush_interval", w->conf.flush_interval, <=, fr_time_delta_from_sec(10));
+
+	FR_TIME_DELTA_BOUND_CHECK("writer.max_wait", w->conf.max_wait, >=, 0);
+	FR_TIME_DELTA_BOUND_CHECK("writer.max_wait", w->conf.max_wait, <=, fr_time_delta_from_sec(10));
+
+	while (size < w->conf.queue_size) size <<= 1;
+	w->mask = size - 1;
+	MEM(w->slots = talloc_array(w, exfile_slot_t, size));
+	for (i = 0; i < size; i++) atomic_init(&w->slots[i].seq, i);
+	atomic_init(&w->head, 0);
+	atomic_init(&w->queued, 0);
+	atomic_init(&w->dropped, 0);
+	fr_dlist_talloc_init(&w->pending, exfile_pending_t, entry);
+
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->wakeup, NULL);
+	pthread_cond_init(&w->space, NULL);
+
+	ef->writer = w;
+
+	ret = pthread_create(&w->thread, NULL, exfile_writer_thread, ef);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating writer thread: %s", fr_syserror(ret));
+		exfile_writer_stop(ef);
+		return -1;
+	}
+	w->running = true;
+
+	return 0;
+}
+
+/** Put a record on the queue
+ *
+ * @return
+ *	- true if the record was queued.
+ *	- false if the queue is full.
+ */
+static bool exfile_writer_push(exfile_writer_t *w, exfile_record_t *rec)
+{
+	exfile_slot_t	*slot;
+	uint64_t	pos = atomic_load_explicit(&w->head, memory_order_relaxed);
+
+	for (;;) {
+		int64_t diff;
+
+		slot = &w->slots[pos & w->mask];
+		diff = (int64_t) atomic_load_explicit(&slot->seq, memory_order_acquire) - (int64_t) pos;
+
+		/*
+		 *	The writer hasn't read this slot yet.
+		 */
+		if (diff < 0) return false;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&w->head, &pos, pos + 1,
+								  memory_order_relaxed, memory_order_relaxed)) break;
+			continue;
+		}
+
+		pos = atomic_load_explicit(&w->head, memory_order_relaxed);
+	}
+
+	slot->record = rec;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+	return true;
+}
+
+/** Write a record to a file
+ *
+ * If exfile_writer_start() has been called, the record is copied to the
+ * writer's queue, and will be written later.  Otherwise the file is opened,
+ * locked, written to, and closed before returning.
+ *
+ * @param[in] ef		The logfile context returned from exfile_init().
+ * @param[in] request		The current request.
+ * @param[in] filename		the file to write to.
+ * @param[in] permissions	to use if the file is created.
+ * @param[in] gid		to change the group of the file to.  -1 to leave it unchanged.
+ * @param[in] iov		the record to write.
+ * @param[in] iovcnt		number of elements in iov.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, or if the queue stayed full for max_wait.
+ */
+int exfile_write(exfile_t *ef, request_t *request, char const *filename, mode_t permissions, gid_t gid,
+		 struct iovec const *iov, int iovcnt)
+{
+	exfile_writer_t	*w = ef->writer;
+	exfile_record_t	*rec;
+	size_t		len = 0, filename_len;
+	uint64_t	queued;
+	uint8_t		*p;
+	int		i;
+
+	if (!w) {
+		struct iovec	*my_iov;
+		int		ret;
+
+		/*
+		 *	exfile_writev() updates the iovec after short writes.
+		 */
+		MEM(my_iov = talloc_memdup(NULL, iov, sizeof(*iov) * iovcnt));
+		ret = exfile_write_fd(ef, request, filename, permissions, gid, my_iov, iovcnt, false);
+		talloc_free(my_iov);
+
+		return ret;
+	}
+
+	for (i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+	if (!len) return 0;
+
+	/*
+	 *	The record, its data, and the filename all
+	 *	go in one allocation.
+	 */
+	filename_len = strlen(filename);
+	MEM(rec = talloc_zero_pooled_object(NULL, exfile_record_t, 2, len + filename_len + 1));
+	MEM(rec->data = talloc_array(rec, uint8_t, len));
+	rec->filename = talloc_bstrndup(rec, filename, filename_len);
+	rec->hash = fr_hash_string(filename);
+	rec->permissions = permissions;
+	rec->gid = gid;
+	rec->len = len;
+
+	for (i = 0, p = rec->data; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	/*
+	 *	Count the bytes before the writer can see the
+	 *	record, so the count never goes negative.
+	 */
+	queued = atomic_fetch_add_explicit(&w->queued, len, memory_order_relaxed);
+
+	if (!exfile_writer_push(w, rec)) {
+		struct timespec	ts;
+		bool		queued_ok = false;
+
+		/*
+		 *	The disk isn't keeping up.  Wait for the
+		 *	writer to make space, rather than letting
+		 *	the backlog grow without bound.
+		 */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += w->conf.max_wait / NSEC;
+		ts.tv_nsec += w->conf.max_wait % NSEC;
+		if (ts.tv_nsec >= NSEC) {
+			ts.tv_sec++;
+			ts.tv_nsec -= NSEC;
+		}
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "Queue for \"%s\" is full, waiting for the writer", filename);
+
+		pthread_mutex_lock(&w->mutex);
+		w->waiting++;
+		pthread_cond_signal(&w->wakeup);
+		for (;;) {
+			queued_ok = exfile_writer_push(w, rec);
+			if (queued_ok) break;
+
+			if (pthread_cond_timedwait(&w->space, &w->mutex, &ts) == ETIMEDOUT) {
+				queued_ok = exfile_writer_push(w, rec);
+				break;
+			}
+		}
+		w->waiting--;
+		pthread_mutex_unlock(&w->mutex);
+
+		if (!queued_ok) {
+			atomic_fetch_sub_explicit(&w->queued, len, memory_order_relaxed);
+			atomic_fetch_add_explicit(&w->dropped, 1, memory_order_relaxed);
+			talloc_free(rec);
+			fr_strerror_printf("Queue for \"%s\" is full", filename);
+			return -1;
+		}
+	}
+
+	/*
+	 *	Wake the writer as soon as there's enough to
+	 *	write, instead of waiting for flush_interval.
+	 */
+	if ((queued < w->conf.flush_size) && ((queued + len) >= w->conf.flush_size)) {
+		pthread_mutex_lock(&w->mutex);
+		pthread_cond_signal(&w->wakeup);
+		pthread_mutex_unlock(&w->mutex);
+	}
+
+	return 0;
+}
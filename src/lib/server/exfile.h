@@ -25,8 +25,11 @@
  */
 RCSIDH(exfile_h, "$Id$")
 
+#include <freeradius-devel/server/cf_parse.h>
 #include <freeradius-devel/server/request.h>
 
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,6 +38,20 @@ extern "C" {
  */
 typedef struct exfile_s exfile_t;
 
+/** Configuration for the asynchronous writer
+ *
+ */
+typedef struct {
+	bool			async;			//!< Hand records to a writer thread.
+	uint32_t		queue_size;		//!< Maximum number of records waiting to be written.
+	size_t			flush_size;		//!< Write a file's records once this many bytes are pending.
+	fr_time_delta_t		flush_interval;		//!< Maximum time a record waits before being written.
+	bool			fsync;			//!< fsync() each file after writing a batch.
+	fr_time_delta_t		max_wait;		//!< How long to wait for space when the queue is full.
+} exfile_writer_conf_t;
+
+extern CONF_PARSER const exfile_writer_config[];
+
 exfile_t	*exfile_init(TALLOC_CTX *ctx, uint32_t entries, uint32_t idle, bool locking);
 
 void		exfile_enable_triggers(exfile_t *ef, CONF_SECTION *cs, char const *trigger_prefix,
@@ -45,6 +62,11 @@ int		exfile_open(exfile_t *lf, request_t *request, char const *filename,
 
 int		exfile_close(exfile_t *lf, request_t *request, int fd);
 
+int		exfile_writer_start(exfile_t *ef, exfile_writer_conf_t const *conf);
+
+int		exfile_write(exfile_t *ef, request_t *request, char const *filename, mode_t permissions, gid_t gid,
+			     struct iovec const *iov, int iovcnt);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,280 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/latency.c
+ * @brief Named latency histograms, written per thread and merged on demand.
+ *
+ * Each tracker has a name such as "request" or "module.sql".  Every
+ * thread which records latencies for a tracker gets its own histogram
+ * from fr_latency_writer_alloc(), and updates it without locking.  The
+ * histograms belong to the tracker, not to the thread, so the values a
+ * thread recorded are still counted after the thread exits.
+ *
+ * Readers take the registry lock, and merge the per-thread histograms
+ * into a new one.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/latency.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/strerror.h>
+
+#include <pthread.h>
+
+/*
+ *	Latencies are recorded in microseconds, with an error of
+ *	about 3%.  Anything over a minute is recorded as a minute.
+ */
+#define LATENCY_PRECISION	(5)
+#define LATENCY_MAX		((uint64_t) 60 * 1000000)
+
+struct fr_latency_s {
+	char const		*name;			//!< Of the tracker.
+	fr_histogram_t		**writers;		//!< One histogram per writer.
+	fr_dlist_t		entry;			//!< In the registry.
+};
+
+static pthread_mutex_t		latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TALLOC_CTX		*latency_ctx;		//!< Holds all of the trackers.
+static fr_dlist_head_t		latency_list;		//!< Of trackers, in the order they were registered.
+
+static fr_latency_t *latency_find(char const *name)
+{
+	fr_latency_t *lat = NULL;
+
+	while ((lat = fr_dlist_next(&latency_list, lat))) {
+		if (strcmp(lat->name, name) == 0) return lat;
+	}
+
+	return NULL;
+}
+
+/** Find or create a named tracker
+ *
+ * Registering a name which already exists returns the existing tracker,
+ * so every thread, and every instance of an object, can call this with
+ * the same name.
+ *
+ * @param[in] name	of the tracker, e.g. "module.sql".
+ * @return
+ *	- The tracker.
+ *	- NULL on error.
+ */
+fr_latency_t *fr_latency_register(char const *name)
+{
+	fr_latency_t	*lat;
+
+	pthread_mutex_lock(&latency_mutex);
+	if (!latency_ctx) {
+		latency_ctx = talloc_init("latency trackers");
+		if (!latency_ctx) {
+		oom:
+			pthread_mutex_unlock(&latency_mutex);
+			fr_strerror_printf("Out of memory");
+			return NULL;
+		}
+		fr_dlist_talloc_init(&latency_list, fr_latency_t, entry);
+	}
+
+	lat = latency_find(name);
+	if (lat) {
+		pthread_mutex_unlock(&latency_mutex);
+		return lat;
+	}
+
+	lat = talloc_zero(latency_ctx, fr_latency_t);
+	if (!lat) goto oom;
+
+	lat->name = talloc_strdup(lat, name);
+	lat->writers = talloc_array(lat, fr_histogram_t *, 0);
+	if (!lat->name || !lat->writers) {
+		talloc_free(lat);
+		goto oom;
+	}
+
+	fr_dlist_insert_tail(&latency_list, lat);
+	pthread_mutex_unlock(&latency_mutex);
+
+	return lat;
+}
+
+/** Allocate a histogram for one thread to record latencies in
+ *
+ * The caller should cache the result, and must only record values in
+ * it from a single thread.  The histogram is freed by fr_latency_free().
+ *
+ * @param[in] lat	to add the histogram to.
+ * @return
+ *	- A histogram to pass to fr_latency_add().
+ *	- NULL on error.
+ */
+fr_histogram_t *fr_latency_writer_alloc(fr_latency_t *lat)
+{
+	fr_histogram_t	*h, **writers;
+	size_t		len;
+
+	pthread_mutex_lock(&latency_mutex);
+	h = fr_histogram_alloc(lat, LATENCY_PRECISION, LATENCY_MAX);
+	if (!h) {
+	error:
+		pthread_mutex_unlock(&latency_mutex);
+		return NULL;
+	}
+
+	len = talloc_array_length(lat->writers);
+	writers = talloc_realloc(lat, lat->writers, fr_histogram_t *, len + 1);
+	if (!writers) {
+		talloc_free(h);
+		fr_strerror_printf("Out of memory");
+		goto error;
+	}
+	writers[len] = h;
+	lat->writers = writers;
+	pthread_mutex_unlock(&latency_mutex);
+
+	return h;
+}
+
+/** Merge all of the histograms of a tracker, with the lock held
+ *
+ */
+static fr_histogram_t *latency_merge(TALLOC_CTX *ctx, fr_latency_t *lat)
+{
+	fr_histogram_t	*merged;
+	size_t		i, len;
+
+	merged = fr_histogram_alloc(ctx, LATENCY_PRECISION, LATENCY_MAX);
+	if (!merged) return NULL;
+
+	len = talloc_array_length(lat->writers);
+	for (i = 0; i < len; i++) (void) fr_histogram_merge(merged, lat->writers[i]);
+
+	return merged;
+}
+
+/** Merge the histograms of every thread which has recorded values for a tracker
+ *
+ * @param[in] ctx	to allocate the result in.
+ * @param[in] lat	to merge.
+ * @return
+ *	- A histogram of all of the values recorded, in microseconds.
+ *	- NULL on error.
+ */
+fr_histogram_t *fr_latency_merge(TALLOC_CTX *ctx, fr_latency_t *lat)
+{
+	fr_histogram_t	*merged;
+
+	pthread_mutex_lock(&latency_mutex);
+	merged = latency_merge(ctx, lat);
+	pthread_mutex_unlock(&latency_mutex);
+
+	return merged;
+}
+
+/** Call a function for every tracker, with its merged histogram
+ *
+ * The registry is locked while the callback runs, so the callback must
+ * not register trackers or allocate writers.
+ *
+ * @param[in] callback	to call.
+ * @param[in] uctx	to pass to the callback.
+ * @return
+ *	- 0 on success.
+ *	- <0 if the callback stopped the walk, or on error.
+ */
+int fr_latency_walk(fr_latency_walk_t callback, void *uctx)
+{
+	fr_latency_t	*lat = NULL;
+	int		ret = 0;
+
+	pthread_mutex_lock(&latency_mutex);
+	if (!latency_ctx) {
+		pthread_mutex_unlock(&latency_mutex);
+		return 0;
+	}
+
+	while ((lat = fr_dlist_next(&latency_list, lat))) {
+		fr_histogram_t *merged;
+
+		merged = latency_merge(NULL, lat);
+		if (!merged) {
+			ret = -1;
+			break;
+		}
+
+		ret = callback(lat->name, merged, uctx);
+		talloc_free(merged);
+		if (ret < 0) break;
+	}
+	pthread_mutex_unlock(&latency_mutex);
+
+	return ret;
+}
+
+typedef struct {
+	FILE		*fp;			//!< To print to.
+	char const	*name;			//!< Of the tracker to print, or NULL for all of them.
+} latency_fprint_ctx_t;
+
+static int latency_fprint(char const *name, fr_histogram_t const *merged, void *uctx)
+{
+	latency_fprint_ctx_t	*ctx = uctx;
+	FILE			*fp = ctx->fp;
+	uint64_t		count;
+
+	if (ctx->name && (strcmp(ctx->name, name) != 0)) return 0;
+
+	count = fr_histogram_count(merged);
+
+	fprintf(fp, "%s.count\t\t%" PRIu64 "\n", name, count);
+	fprintf(fp, "%s.mean_us\t\t%" PRIu64 "\n", name, count ? fr_histogram_sum(merged) / count : 0);
+	fprintf(fp, "%s.p50_us\t\t%" PRIu64 "\n", name, fr_histogram_percentile(merged, 50));
+	fprintf(fp, "%s.p90_us\t\t%" PRIu64 "\n", name, fr_histogram_percentile(merged, 90));
+	fprintf(fp, "%s.p99_us\t\t%" PRIu64 "\n", name, fr_histogram_percentile(merged, 99));
+	fprintf(fp, "%s.p99.9_us\t%" PRIu64 "\n", name, fr_histogram_percentile(merged, 99.9));
+	fprintf(fp, "%s.max_us\t\t%" PRIu64 "\n", name, fr_histogram_max(merged));
+
+	return 0;
+}
+
+/** Print the latency percentiles of one or all trackers
+ *
+ * @param[in] fp	to print to.
+ * @param[in] name	of the tracker to print.  NULL prints all of them.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_latency_fprint(FILE *fp, char const *name)
+{
+	return fr_latency_walk(latency_fprint, &(latency_fprint_ctx_t){ .fp = fp, .name = name });
+}
+
+/** Free all of the trackers, and their histograms
+ *
+ * Must only be called once all threads which record latencies have exited.
+ */
+void fr_latency_free(void)
+{
+	pthread_mutex_lock(&latency_mutex);
+	TALLOC_FREE(latency_ctx);
+	pthread_mutex_unlock(&latency_mutex);
+}
@@ -0,0 +1,79 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/latency.h
+ * @brief Named latency histograms, written per thread and merged on demand.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(latency_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/util/histogram.h>
+#include <freeradius-devel/util/time.h>
+
+#include <stdio.h>
+
+typedef struct fr_latency_s fr_latency_t;
+
+/** Callback for walking over the registered trackers
+ *
+ * @param[in] name	of the tracker.
+ * @param[in] merged	histogram of all of the values recorded by all threads.
+ *			In microseconds.
+ * @param[in] uctx	passed to fr_latency_walk().
+ * @return
+ *	- 0 to continue walking.
+ *	- <0 to stop.
+ */
+typedef int (*fr_latency_walk_t)(char const *name, fr_histogram_t const *merged, void *uctx);
+
+fr_latency_t	*fr_latency_register(char const *name) CC_HINT(nonnull);
+
+fr_histogram_t	*fr_latency_writer_alloc(fr_latency_t *lat) CC_HINT(nonnull);
+
+fr_histogram_t	*fr_latency_merge(TALLOC_CTX *ctx, fr_latency_t *lat) CC_HINT(nonnull(2));
+
+int		fr_latency_walk(fr_latency_walk_t callback, void *uctx) CC_HINT(nonnull(1));
+
+int		fr_latency_fprint(FILE *fp, char const *name) CC_HINT(nonnull(1));
+
+void		fr_latency_free(void);
+
+/** Record a latency in a histogram returned by fr_latency_writer_alloc()
+ *
+ * @param[in] h		to record the latency in.  May be NULL, in which case
+ *			nothing is recorded.
+ * @param[in] start	When the operation started.
+ * @param[in] now	When the operation finished.
+ */
+static inline void fr_latency_add(fr_histogram_t *h, fr_time_t start, fr_time_t now)
+{
+	if (!h || (now < start)) return;
+
+	fr_histogram_add(h, fr_time_delta_to_usec(now - start));
+}
+
+#ifdef __cplusplus
+}
+#endif
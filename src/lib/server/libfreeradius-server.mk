@@ -16,6 +16,7 @@ SOURCES	:= \
 	dl_module.c \
 	exec.c \
 	exfile.c \
+	latency.c \
 	log.c \
 	main_config.c \
 	main_loop.c \
@@ -1216,6 +1216,8 @@ static int _module_thread_instantiate(void *instance, void *uctx)
 	module_instance_t		*mi = talloc_get_type_abort(instance, module_instance_t);
 	module_thread_instance_t	*ti;
 	_thread_intantiate_ctx_t	*thread_inst_ctx = uctx;
+	fr_latency_t			*lat;
+	char				*lat_name;
 	int				ret;
 
 	MEM(ti = talloc_zero(thread_inst_ctx->array, module_thread_instance_t));
@@ -1223,6 +1225,19 @@ static int _module_thread_instantiate(void *instance, void *uctx)
 	ti->module = mi->module;
 	ti->mod_inst = mi->dl_inst->data;	/* For efficient lookups */
 
+	/*
+	 *	Every thread records calls to this module instance
+	 *	in its own histogram.  They're merged when read.
+	 */
+	MEM(lat_name = talloc_asprintf(NULL, "module.%s", mi->name));
+	lat = fr_latency_register(lat_name);
+	talloc_free(lat_name);
+	if (lat) ti->latency = fr_latency_writer_alloc(lat);
+	if (!ti->latency) {
+		PERROR("Failed allocating latency histogram for module \"%s\"", mi->name);
+		return -1;
+	}
+
 	if (mi->module->thread_inst_size) {
 		MEM(ti->data = talloc_zero_array(ti, uint8_t, mi->module->thread_inst_size));
 
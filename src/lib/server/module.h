@@ -33,6 +33,7 @@ extern "C" {
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/unlang/action.h>
 #include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/histogram.h>
 
 typedef struct module_s				module_t;
 typedef struct module_method_names_s		module_method_names_t;
@@ -241,6 +242,12 @@ struct module_thread_instance_s {
 
 	uint64_t			total_calls;	//! total number of times we've been called
 	uint64_t			active_callers; //! number of active callers.  i.e. number of current yields
+
+	fr_histogram_t			*latency;	//!< This thread's histogram for the module's
+							///< latency tracker.
+
+	fr_time_delta_t			latency_ewma;	//!< Smoothed latency of this thread's calls, used
+							///< to rank modules in load-balance sections.
 };
 
 /** Map string values to module state method
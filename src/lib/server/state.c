@@ -35,6 +35,11 @@
  * When the next request is received, #fr_state_to_request is called to transfer
  * the fr_pair_ts and state ctx to the new request.
  *
+ * Entries are spread over a number of shards, selected by a hash of the
+ * state value.  Each shard has its own lock, hash table, expiry list and
+ * share of max_sessions, so workers only contend when they're handling
+ * sessions in the same shard.
+ *
  * The ownership of the state_ctx and state fr_pair_ts is transferred as below:
  *
  * @verbatim
@@ -51,10 +56,29 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** Maximum number of shards in a thread safe state tree.  Must be a power of 2
+ *
+ */
+#define STATE_SHARDS_MAX		64
+
+/** Minimum share of max_sessions for each shard
+ *
+ * State values aren't spread perfectly evenly, so with too small a share
+ * sessions would be rejected long before max_sessions was reached.
+ */
+#define STATE_SHARD_MIN_SESSIONS	256
+
 /** Holds a state value, and associated fr_pair_ts and data
  *
  */
@@ -112,28 +136,49 @@ typedef struct {
 	request_t			*thawed;			//!< The request that thawed this entry.
 } fr_state_entry_t;
 
-struct fr_state_tree_s {
-	uint64_t		id;				//!< Next ID to assign.
+/** A subset of the state entries, with its own lock
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	fr_hash_table_t		*ht;				//!< Hash table used to lookup state value.
+	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+	uint32_t		max_sessions;			//!< Maximum number of sessions in this shard.
+
 	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
+	uint64_t		locked;				//!< Number of times the mutex was acquired.
+	uint64_t		contended;			//!< Number of times the mutex was held by
+								//!< another thread when we tried to acquire it.
+} fr_state_shard_t;
+
+struct fr_state_tree_s {
+	_Atomic(uint64_t)	id;				//!< Next ID to assign.
 	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	rbtree_t		*tree;				//!< rbtree used to lookup state value.
-	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
 
 	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
 
-	bool			thread_safe;			//!< Whether we lock the tree whilst modifying it.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	bool			thread_safe;			//!< Whether we lock the shards whilst modifying them.
+
+	uint32_t		num_shards;			//!< Number of shards.  Always a power of 2.
+	fr_state_shard_t	*shards;			//!< Array of shards.
 
 	uint8_t			server_id;			//!< ID to use for load balancing.
 
 	fr_dict_attr_t const	*da;				//!< State attribute used.
 };
 
-#define PTHREAD_MUTEX_LOCK if (state->thread_safe) pthread_mutex_lock
-#define PTHREAD_MUTEX_UNLOCK if (state->thread_safe) pthread_mutex_unlock
+static void state_entry_unlink(fr_state_shard_t *shard, fr_state_entry_t *entry);
+
+/** Hash a fr_state_entry_t based on its state value i.e. the value of the attribute
+ *
+ */
+static uint32_t state_entry_hash(void const *data)
+{
+	fr_state_entry_t const *entry = data;
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+	return fr_hash(entry->state, sizeof(entry->state));
+}
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -145,32 +190,74 @@ static int state_entry_cmp(void const *one, void const *two)
 	return memcmp(a->state, b->state, sizeof(a->state));
 }
 
+/** Return the shard a state value belongs to
+ *
+ * Uses the upper bits of the hash, as the lower bits select the
+ * bucket within the shard's hash table.
+ */
+static inline CC_HINT(always_inline) fr_state_shard_t *state_shard(fr_state_tree_t *state,
+								   fr_state_entry_t const *entry)
+{
+	return &state->shards[(state_entry_hash(entry) >> 16) & (state->num_shards - 1)];
+}
+
+/** Lock a shard, recording whether we had to wait for it
+ *
+ */
+static inline CC_HINT(always_inline) void state_shard_lock(fr_state_tree_t *state, fr_state_shard_t *shard)
+{
+	if (!state->thread_safe) return;
+
+	if (pthread_mutex_trylock(&shard->mutex) != 0) {
+		pthread_mutex_lock(&shard->mutex);
+		shard->contended++;
+	}
+	shard->locked++;
+}
+
+static inline CC_HINT(always_inline) void state_shard_unlock(fr_state_tree_t *state, fr_state_shard_t *shard)
+{
+	if (!state->thread_safe) return;
+
+	pthread_mutex_unlock(&shard->mutex);
+}
+
 /** Free the state tree
  *
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
-	fr_state_entry_t *entry;
-
-	if (state->thread_safe) pthread_mutex_destroy(&state->mutex);
+	fr_state_entry_t	*entry;
+	uint32_t		i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while ((entry = fr_dlist_head(&state->to_expire))) {
-		DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
-		state_entry_unlink(state, entry);
-		talloc_free(entry);
-	}
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
 
-	/*
-	 *	Free the rbtree
-	 */
-	talloc_free(state->tree);
+		if (!shard->ht) continue;
+
+		while ((entry = fr_dlist_head(&shard->to_expire))) {
+			DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
+			state_entry_unlink(shard, entry);
+			talloc_free(entry);
+		}
+
+		/*
+		 *	Free the hash table
+		 */
+		talloc_free(shard->ht);
+
+		if (state->thread_safe) pthread_mutex_destroy(&shard->mutex);
+	}
 
 	return 0;
 }
 
 /** Initialise a new state tree
+ *
+ * If the tree is thread safe, entries are split between up to #STATE_SHARDS_MAX
+ * shards, each with an equal share of max_sessions.
  *
  * @param[in] ctx		to link the lifecycle of the state tree to.
  * @param[in] da		Attribute used to store and retrieve state from.
@@ -185,7 +272,8 @@ static int _state_tree_free(fr_state_tree_t *state)
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, bool thread_safe,
 				    uint32_t max_sessions, uint32_t timeout, uint8_t server_id)
 {
-	fr_state_tree_t *state;
+	fr_state_tree_t	*state;
+	uint32_t	i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
@@ -193,6 +281,19 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 	state->max_sessions = max_sessions;
 	state->timeout = timeout;
 
+	/*
+	 *	Only split the entries up if multiple threads
+	 *	will be using the tree, and each shard gets a
+	 *	reasonable share of the sessions.
+	 */
+	state->num_shards = 1;
+	if (thread_safe) {
+		state->num_shards = STATE_SHARDS_MAX;
+		while ((state->num_shards > 1) && ((max_sessions / state->num_shards) < STATE_SHARD_MIN_SESSIONS)) {
+			state->num_shards >>= 1;
+		}
+	}
+
 	/*
 	 *	Create a break in the contexts.
 	 *	We still want this to be freed at the same time
@@ -202,46 +303,61 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 	 */
 	talloc_link_ctx(ctx, state);
 
-	if (thread_safe && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
+	state->shards = talloc_zero_array(state, fr_state_shard_t, state->num_shards);
+	if (!state->shards) {
 		talloc_free(state);
 		return NULL;
 	}
+	state->thread_safe = thread_safe;
+	talloc_set_destructor(state, _state_tree_free);
 
-	fr_dlist_talloc_init(&state->to_expire, fr_state_entry_t, list);
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = rbtree_talloc_alloc(NULL, state_entry_cmp, fr_state_entry_t, NULL, 0);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+		shard->max_sessions = (max_sessions + state->num_shards - 1) / state->num_shards;
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	hash table, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->ht = fr_hash_table_create(NULL, state_entry_hash, state_entry_cmp, NULL);
+		if (!shard->ht) {
+			talloc_free(state);
+			return NULL;
+		}
+
+		if (thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(shard->ht);
+			shard->ht = NULL;
+			talloc_free(state);
+			return NULL;
+		}
+
+		fr_dlist_talloc_init(&shard->to_expire, fr_state_entry_t, list);
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	state->da = da;		/* Remember which attribute we use to load/store state */
 	state->server_id = server_id;
-	state->thread_safe = thread_safe;
 
 	return state;
 }
 
-/** Unlink an entry and remove if from the tree
+/** Unlink an entry and remove if from the shard
  *
+ * @note Called with the shard locked.
  */
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+static void state_entry_unlink(fr_state_shard_t *shard, fr_state_entry_t *entry)
 {
 	/*
 	 *	Check the memory is still valid
 	 */
 	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 
-	fr_dlist_remove(&state->to_expire, entry);
+	fr_dlist_remove(&shard->to_expire, entry);
 
-	rbtree_deletebydata(state->tree, entry);
+	fr_hash_table_delete(shard->ht, entry);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
@@ -284,119 +400,85 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Unlink entries in a shard which have expired
+ *
+ * @note Called with the shard locked.
  *
- * @note Called with the mutex held.
+ * @param[in] shard	to clean up.
+ * @param[in] now	Current time.
+ * @param[out] to_free	List to add the unlinked entries to.  They're freed
+ *			by the caller once the shard is unlocked.
+ * @return The number of entries unlinked.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request,
-					    fr_radius_packet_t *packet, fr_state_entry_t *old)
+static uint64_t state_shard_expire(fr_state_shard_t *shard, time_t now, fr_dlist_head_t *to_free)
 {
-	size_t			i;
-	uint32_t		x;
-	time_t			now = time(NULL);
-	fr_pair_t		*vp;
 	fr_state_entry_t	*entry, *next;
-
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
 	uint64_t		timed_out = 0;
-	bool			too_many = false;
-	fr_dlist_head_t		to_free;
-
-	fr_dlist_init(&to_free, fr_state_entry_t, list);
 
 	/*
-	 *	Clean up old entries.
+	 *	The list is ordered by cleanup time, so we can stop
+	 *	at the first entry which hasn't expired.
 	 */
-	for (entry = fr_dlist_head(&state->to_expire);
+	for (entry = fr_dlist_head(&shard->to_expire);
 	     entry != NULL;
 	     entry = next) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
-		next = fr_dlist_next(&state->to_expire, entry);		/* Advance *before* potential unlinking */
+		next = fr_dlist_next(&shard->to_expire, entry);		/* Advance *before* potential unlinking */
 
-		if (entry == old) continue;
-
-		/*
-		 *	Too old, we can delete it.
-		 */
-		if (entry->cleanup < now) {
-			state_entry_unlink(state, entry);
-			fr_dlist_insert_tail(&to_free, entry);
-			timed_out++;
-			continue;
-		}
+		if (entry->cleanup >= now) break;
 
-		break;
+		state_entry_unlink(shard, entry);
+		fr_dlist_insert_tail(to_free, entry);
+		timed_out++;
 	}
 
-	state->timed_out += timed_out;
-
-	if (!old && (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions)) too_many = true;
-
-	/*
-	 *	Record the information from the old state, we may base the
-	 *	new state off the old one.
-	 *
-	 *	Once we release the mutex, the state of old becomes indeterminate
-	 *	so we have to grab the values now.
-	 */
-	if (old) {
-		old_tries = old->tries;
-
-		memcpy(old_state, old->state, sizeof(old_state));
+	shard->timed_out += timed_out;
 
-		/*
-		 *	The old one isn't used any more, so we can free it.
-		 */
-		if (fr_dlist_empty(&old->data)) {
-			state_entry_unlink(state, old);
-			fr_dlist_insert_tail(&to_free, old);
-		}
-	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	return timed_out;
+}
 
-	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
+/** Create a new state entry
+ *
+ * @note Called with no shards locked.
+ *
+ * @param[in] state		tree to insert the entry into.
+ * @param[in] request		The current request.
+ * @param[in] packet		to add the State attribute to.
+ * @param[in] old_state		value of the previous entry in this sequence.
+ *				May be NULL if this is the first round.
+ * @param[in] old_tries		rounds recorded in the previous entry.
+ * @param[out] shard_out	The shard the new entry was inserted into.  It's
+ *				left locked, and must be unlocked by the caller.
+ * @return
+ *	- The new entry.
+ *	- NULL on error.  No shard is locked.
+ */
+static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request, fr_radius_packet_t *packet,
+					    uint8_t const *old_state, int old_tries, fr_state_shard_t **shard_out)
+{
+	size_t			i;
+	uint32_t		x;
+	time_t			now = time(NULL);
+	fr_pair_t		*vp, *new_vp = NULL;
+	fr_state_entry_t	*entry, *to_free_entry;
+	fr_state_shard_t	*shard;
 
-	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
-	 */
-	while ((entry = fr_dlist_head(&to_free)) != NULL) {
-		fr_dlist_remove(&to_free, entry);
-		talloc_free(entry);
-	}
+	uint64_t		timed_out;
+	bool			too_many = false;
+	fr_dlist_head_t		to_free;
 
-	/*
-	 *	Have to do this post-cleanup, else we end up returning with
-	 *	a list full of entries to free with none of them being
-	 *	freed which is bad...
-	 */
-	if (too_many) {
-		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
-		       state->max_sessions);
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+	fr_dlist_init(&to_free, fr_state_entry_t, list);
 
 	/*
 	 *	Allocation doesn't need to occur inside the critical region
 	 *	and would add significantly to contention.
 	 */
 	entry = talloc_zero(NULL, fr_state_entry_t);
-	if (!entry) {
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+	if (!entry) return NULL;
 
 	request_data_list_init(&entry->data);
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add_explicit(&state->id, 1, memory_order_relaxed);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -445,7 +527,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		 *	16 octets of randomness should be enough to
 		 *	have a globally unique state.
 		 */
-		if (old) {
+		if (old_state) {
 			memcpy(entry->state, old_state, sizeof(entry->state));
 			entry->tries = old_tries + 1;
 		/*
@@ -475,16 +557,10 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		 */
 		entry->state_comp.server_id = state->server_id;
 
-		MEM(vp = fr_pair_afrom_da(packet, state->da));
-		fr_pair_value_memdup(vp, entry->state, sizeof(entry->state), false);
-		fr_pair_add(&packet->vps, vp);
+		MEM(new_vp = fr_pair_afrom_da(packet, state->da));
+		fr_pair_value_memdup(new_vp, entry->state, sizeof(entry->state), false);
 	}
 
-	DEBUG4("State ID %" PRIu64 " created, value 0x%pH, expires %" PRIu64 "s",
-	       entry->id, fr_box_octets(entry->state, sizeof(entry->state)), (uint64_t)entry->cleanup - now);
-
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -493,9 +569,60 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	 */
 	*((uint32_t *)(&entry->state_comp.server_hash)) ^= fr_hash_string(cf_section_name2(request->server_cs));
 
-	if (!rbtree_insert(state->tree, entry)) {
+	/*
+	 *	The final state value determines which shard the
+	 *	entry lives in.
+	 */
+	shard = state_shard(state, entry);
+
+	/*
+	 *	Clean up old entries.
+	 */
+	state_shard_lock(state, shard);
+	timed_out = state_shard_expire(shard, now, &to_free);
+
+	if (!old_state && ((uint32_t) fr_hash_table_num_elements(shard->ht) >= shard->max_sessions)) too_many = true;
+	state_shard_unlock(state, shard);
+
+	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
+
+	/*
+	 *	Now free the unlinked entries.
+	 *
+	 *	We do it here as freeing may involve significantly more
+	 *	work than just freeing the data.
+	 *
+	 *	If there's request data that was persisted it will now
+	 *	be freed also, and it may have complex destructors associated
+	 *	with it.
+	 */
+	while ((to_free_entry = fr_dlist_head(&to_free)) != NULL) {
+		fr_dlist_remove(&to_free, to_free_entry);
+		talloc_free(to_free_entry);
+	}
+
+	/*
+	 *	Have to do this post-cleanup, else we end up returning with
+	 *	a list full of entries to free with none of them being
+	 *	freed which is bad...
+	 */
+	if (too_many) {
+		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
+		       state->max_sessions);
+		talloc_free(new_vp);
+		talloc_free(entry);
+		return NULL;
+	}
+
+	DEBUG4("State ID %" PRIu64 " created, value 0x%pH, expires %" PRIu64 "s",
+	       entry->id, fr_box_octets(entry->state, sizeof(entry->state)), (uint64_t)entry->cleanup - now);
+
+	state_shard_lock(state, shard);
+
+	if (!fr_hash_table_insert(shard->ht, entry)) {
+		state_shard_unlock(state, shard);
 		RERROR("Failed inserting state entry - Insertion into state tree failed");
-		fr_pair_delete_by_da(&packet->vps, state->da);
+		talloc_free(new_vp);
 		talloc_free(entry);
 		return NULL;
 	}
@@ -504,17 +631,34 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	 *	Link it to the end of the list, which is implicitely
 	 *	ordered by cleanup time.
 	 */
-	fr_dlist_insert_tail(&state->to_expire, entry);
+	fr_dlist_insert_tail(&shard->to_expire, entry);
+
+	if (new_vp) fr_pair_add(&packet->vps, new_vp);
+
+	*shard_out = shard;
 
 	return entry;
 }
 
 /** Find the entry, based on the State attribute
  *
+ * @note Called with no shards locked.
+ *
+ * @param[in] state		tree to search in.
+ * @param[in] request		The current request.
+ * @param[in] vb		Value of the State attribute.
+ * @param[out] shard_out	The shard the entry would be in.  It's left
+ *				locked whether or not the entry is found, and
+ *				must be unlocked by the caller.
+ * @return
+ *	- The entry.
+ *	- NULL if no entry matched.
  */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, request_t *request, fr_value_box_t const *vb)
+static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, request_t *request, fr_value_box_t const *vb,
+					  fr_state_shard_t **shard_out)
 {
-	fr_state_entry_t *entry, my_entry;
+	fr_state_entry_t	*entry, my_entry;
+	fr_state_shard_t	*shard;
 
 	/*
 	 *	Assume our own State first.
@@ -543,7 +687,11 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, request_t *req
 	 */
 	my_entry.state_comp.server_hash ^= fr_hash_string(cf_section_name2(request->server_cs));
 
-	entry = rbtree_finddata(state->tree, &my_entry);
+	shard = state_shard(state, &my_entry);
+	state_shard_lock(state, shard);
+	*shard_out = shard;
+
+	entry = fr_hash_table_find_by_data(shard->ht, &my_entry);
 
 	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
 
@@ -556,19 +704,19 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, request_t *req
 void fr_state_discard(fr_state_tree_t *state, request_t *request)
 {
 	fr_state_entry_t	*entry;
+	fr_state_shard_t	*shard;
 	fr_pair_t		*vp;
 
 	vp = fr_pair_find_by_da(&request->request_pairs, state->da);
 	if (!vp) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, &vp->data);
+	entry = state_entry_find(state, request, &vp->data, &shard);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		state_shard_unlock(state, shard);
 		return;
 	}
-	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_entry_unlink(shard, entry);
+	state_shard_unlock(state, shard);
 
 	/*
 	 *	If fr_state_to_request was never called, this ensures
@@ -601,11 +749,12 @@ void fr_state_discard(fr_state_tree_t *state, request_t *request)
  * @note Does not copy the actual fr_pair_ts.  The fr_pair_ts and their context
  *	are transferred between state entries as the conversation progresses.
  *
- * @note Called with the mutex free.
+ * @note Called with no shards locked.
  */
 void fr_state_to_request(fr_state_tree_t *state, request_t *request)
 {
 	fr_state_entry_t	*entry;
+	fr_state_shard_t	*shard;
 	TALLOC_CTX		*old_ctx = NULL;
 	fr_pair_t		*vp;
 
@@ -621,13 +770,12 @@ void fr_state_to_request(fr_state_tree_t *state, request_t *request)
 		return;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, &vp->data);
+	entry = state_entry_find(state, request, &vp->data, &shard);
 	if (entry) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);
 		if (entry->thawed) {
 			REDEBUG("State entry has already been thawed by a request %"PRIu64, entry->thawed->number);
-			PTHREAD_MUTEX_UNLOCK(&state->mutex);
+			state_shard_unlock(state, shard);
 			return;
 		}
 		if (request->state_ctx) old_ctx = request->state_ctx;	/* Store for later freeing */
@@ -643,7 +791,7 @@ void fr_state_to_request(fr_state_tree_t *state, request_t *request)
 		entry->vps = NULL;
 		entry->thawed = request;
 	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_shard_unlock(state, shard);
 
 	if (request->state) {
 		RDEBUG2("Restored &session-state");
@@ -672,8 +820,12 @@ void fr_state_to_request(fr_state_tree_t *state, request_t *request)
 int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 {
 	fr_state_entry_t	*entry, *old = NULL;
+	fr_state_shard_t	*shard;
 	fr_dlist_head_t		data;
 	fr_pair_t		*vp;
+	uint8_t			old_state[sizeof(entry->state)];
+	int			old_tries = 0;
+	bool			have_old = false;
 
 	request_data_list_init(&data);
 	request_data_by_persistance(&data, request, true);
@@ -685,14 +837,38 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 		log_request_pair_list(L_DBG_LVL_2, request, request->state, "&session-state.");
 	}
 
+	/*
+	 *	Record the information from the old state, we may base the
+	 *	new state off the old one.
+	 *
+	 *	The new entry may be in a different shard, so once we
+	 *	release the lock, the state of old becomes indeterminate,
+	 *	and we have to grab the values now.
+	 */
 	vp = fr_pair_find_by_da(&request->request_pairs, state->da);
+	if (vp) {
+		old = state_entry_find(state, request, &vp->data, &shard);
+		if (old) {
+			have_old = true;
+			old_tries = old->tries;
+			memcpy(old_state, old->state, sizeof(old_state));
+
+			/*
+			 *	The old one isn't used any more, so we can free it.
+			 */
+			if (fr_dlist_empty(&old->data)) {
+				state_entry_unlink(shard, old);
+			} else {
+				old = NULL;
+			}
+		}
+		state_shard_unlock(state, shard);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (vp) old = state_entry_find(state, request, &vp->data);
+		talloc_free(old);
+	}
 
-	entry = state_entry_create(state, request, request->reply, old);
+	entry = state_entry_create(state, request, request->reply, have_old ? old_state : NULL, old_tries, &shard);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		RERROR("Creating state entry failed");
 		request_data_restore(request, &data);	/* Put it back again */
 		return -1;
@@ -709,7 +885,7 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 	request->state_ctx = NULL;
 	request->state_pairs = NULL;
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_shard_unlock(state, shard);
 
 	RDEBUG3("%s - saved", state->da->name);
 	REQUEST_VERIFY(request);
@@ -849,7 +1025,7 @@ void fr_state_detach(request_t *request, bool will_free)
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	return atomic_load_explicit(&state->id, memory_order_relaxed);
 }
 
 /** Return number of entries that timed out
@@ -857,7 +1033,16 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	uint64_t	timed_out = 0;
+	uint32_t	i;
+
+	for (i = 0; i < state->num_shards; i++) {
+		state_shard_lock(state, &state->shards[i]);
+		timed_out += state->shards[i].timed_out;
+		state_shard_unlock(state, &state->shards[i]);
+	}
+
+	return timed_out;
 }
 
 /** Return number of entries we're currently tracking
@@ -865,5 +1050,45 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return (uint32_t)rbtree_num_elements(state->tree);
+	uint32_t	tracked = 0;
+	uint32_t	i;
+
+	for (i = 0; i < state->num_shards; i++) {
+		state_shard_lock(state, &state->shards[i]);
+		tracked += (uint32_t)fr_hash_table_num_elements(state->shards[i].ht);
+		state_shard_unlock(state, &state->shards[i]);
+	}
+
+	return tracked;
+}
+
+/** Return how often the shard locks were acquired, and how often we had to wait for them
+ *
+ * The counters are read without taking the locks, so that reading them
+ * doesn't add to the contention.  They may be slightly out of date.
+ *
+ * @param[in] state		to return lock statistics for.
+ * @param[out] locked		Number of times a shard lock was acquired.
+ * @param[out] contended	Number of times a shard lock was held by
+ *				another thread when we tried to acquire it.
+ */
+void fr_state_lock_stats(fr_state_tree_t *state, uint64_t *locked, uint64_t *contended)
+{
+	uint32_t	i;
+
+	*locked = 0;
+	*contended = 0;
+
+	for (i = 0; i < state->num_shards; i++) {
+		*locked += state->shards[i].locked;
+		*contended += state->shards[i].contended;
+	}
+}
+
+/** Return the number of shards the entries are split between
+ *
+ */
+uint32_t fr_state_num_shards(fr_state_tree_t *state)
+{
+	return state->num_shards;
 }
@@ -52,6 +52,8 @@ void	fr_state_detach(request_t *request, bool will_free);
 uint64_t fr_state_entries_created(fr_state_tree_t *state);
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state);
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state);
+void	fr_state_lock_stats(fr_state_tree_t *state, uint64_t *locked, uint64_t *contended);
+uint32_t fr_state_num_shards(fr_state_tree_t *state);
 
 #ifdef __cplusplus
 }
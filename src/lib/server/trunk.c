@@ -38,6 +38,7 @@ typedef struct fr_trunk_s fr_trunk_t;
 #include <freeradius-devel/server/trunk.h>
 
 #include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/server/latency.h>
 #include <freeradius-devel/server/trigger.h>
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/misc.h>
@@ -111,6 +112,9 @@ struct fr_trunk_request_s {
 
 	fr_time_t		last_freed;		//!< Last time this request was freed.
 
+	fr_time_t		last_sent;		//!< When the request was last written to a
+							///< connection.  Used to record the RTT.
+
 	bool			bound_to_conn;		//!< Fail the request if there's an attempt to
 							///< re-enqueue it.
 
@@ -185,6 +189,10 @@ struct fr_trunk_s {
 
 	fr_trunk_conf_t		conf;			//!< Trunk common configuration.
 
+	fr_histogram_t		*rtt;			//!< This thread's histogram for the trunk's
+							///< latency tracker.  Records the time between
+							///< sending a request and it completing.
+
 	fr_dlist_head_t		free_requests;		//!< Requests in the unassigned state.  Waiting to be
 							///< enqueued.
 
@@ -1050,6 +1058,7 @@ static void trunk_request_enter_sent(fr_trunk_request_t *treq)
 
 	REQUEST_STATE_TRANSITION(FR_TRUNK_REQUEST_STATE_SENT);
 	fr_dlist_insert_tail(&tconn->sent, treq);
+	treq->last_sent = fr_time();
 
 	/*
 	 *	Update the connection's sent stats
@@ -1810,6 +1819,9 @@ void fr_trunk_request_signal_complete(fr_trunk_request_t *treq)
 
 	switch (treq->pub.state) {
 	case FR_TRUNK_REQUEST_STATE_SENT:
+		fr_latency_add(trunk->rtt, treq->last_sent, fr_time());
+		FALL_THROUGH;
+
 	case FR_TRUNK_REQUEST_STATE_PENDING:	/* Got immediate response, i.e. cached */
 		trunk_request_enter_complete(treq);
 		break;
@@ -4503,6 +4515,21 @@ fr_trunk_t *fr_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 	trunk->el = el;
 	trunk->log_prefix = talloc_strdup(trunk, log_prefix);
 
+	/*
+	 *	Trunks with the same log prefix, i.e. the trunks
+	 *	for the same module in different threads, share
+	 *	a tracker.
+	 */
+	if (log_prefix) {
+		fr_latency_t	*lat;
+		char		*lat_name;
+
+		MEM(lat_name = talloc_asprintf(NULL, "trunk.%s", log_prefix));
+		MEM(lat = fr_latency_register(lat_name));
+		talloc_free(lat_name);
+		MEM(trunk->rtt = fr_latency_writer_alloc(lat));
+	}
+
 	memcpy(&trunk->funcs, funcs, sizeof(trunk->funcs));
 	if (!trunk->funcs.connection_prioritise) {
 		trunk->funcs.connection_prioritise = _trunk_connection_order_by_shortest_queue;
@@ -2717,6 +2717,33 @@ static unlang_t *compile_load_balance_subsection(unlang_t *parent, unlang_compil
 		case TMPL_TYPE_EXEC:
 			break;
 		}
+
+		/*
+		 *	Keys are mapped to children by rendezvous
+		 *	hashing, so each child needs an identity which
+		 *	doesn't depend on its position in the section.
+		 *	That's its name, plus which of the children with
+		 *	that name it is.  Adding or removing one child
+		 *	then only moves the keys which map to it.
+		 */
+		if (g->num_children) {
+			unlang_t	*child, *prev;
+			int		i = 0;
+
+			MEM(gext->child_hash = talloc_array(gext, uint32_t, g->num_children));
+
+			for (child = g->children; child != NULL; child = child->next) {
+				uint32_t	hash, dup = 0;
+				char const	*name = child->name ? child->name : unlang_ops[child->type].name;
+
+				for (prev = g->children; prev != child; prev = prev->next) {
+					if (strcmp(prev->name ? prev->name : unlang_ops[prev->type].name, name) == 0) dup++;
+				}
+
+				hash = fr_hash_string(name);
+				gext->child_hash[i++] = fr_hash_update(&dup, sizeof(dup), hash);
+			}
+		}
 	}
 
 	return c;
@@ -31,6 +31,122 @@
 
 #define unlang_redundant_load_balance unlang_load_balance
 
+/** Return the n'th child of a group
+ *
+ */
+static unlang_t *load_balance_child(unlang_group_t *g, uint32_t n)
+{
+	unlang_t *child;
+
+	for (child = g->children; child != NULL; child = child->next) {
+		if (!n--) return child;
+	}
+
+	return g->children;
+}
+
+/** Mix the bits of a hash, so that every input bit affects every output bit
+ *
+ * This is the finaliser from MurmurHash3.  FNV only moves changes
+ * towards the top of the hash, so the scores of children which are
+ * hashed with the same key would otherwise be ranked by the child
+ * alone, and most keys would go to the same one.
+ */
+static inline CC_HINT(always_inline) uint32_t load_balance_mix(uint32_t hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+/** Pick a child by rendezvous (highest random weight) hashing
+ *
+ * Each child is scored by mixing the hash of the key with the hash of
+ * the child's identity, and the child with the highest score wins.
+ * Unlike "hash modulo number of children", adding or removing a child
+ * only moves the keys which map to that child.  All other keys stay
+ * where they were, so sessions keep going to the same module.
+ */
+static unlang_t *load_balance_by_hash(unlang_group_t *g, unlang_load_balance_t *gext, char const *key, size_t len)
+{
+	unlang_t	*child, *found = g->children;
+	uint32_t	hash, score, best = 0;
+	int		i = 0;
+
+	hash = fr_hash(key, len);
+
+	for (child = g->children; child != NULL; child = child->next, i++) {
+		score = load_balance_mix(hash ^ gext->child_hash[i]);
+		if (!i || (score > best)) {
+			best = score;
+			found = child;
+		}
+	}
+
+	return found;
+}
+
+/** Return how busy a child is in this thread
+ *
+ * The cost is the module's smoothed latency, scaled by the number of
+ * calls to it which are still outstanding.  Modules which haven't been
+ * called yet have the lowest cost, so they get tried first.
+ *
+ * @return
+ *	- The cost of calling the child.
+ *	- -1 if the child isn't a module call, so we know nothing about it.
+ */
+static int64_t load_balance_cost(unlang_t *child)
+{
+	module_thread_instance_t *thread;
+
+	if (child->type != UNLANG_TYPE_MODULE) return -1;
+
+	thread = module_thread(unlang_generic_to_module(child)->instance);
+	if (!thread) return -1;
+
+	return (fr_time_delta_to_usec(thread->latency_ewma) + 1) * (int64_t) (thread->active_callers + 1);
+}
+
+/** Pick the least loaded of two random children
+ *
+ * This is the "power of two choices", as in lib/io/network.c.  It
+ * avoids sending everything to the module which happens to be least
+ * loaded right now, while still steering traffic away from modules
+ * which are slow, or have many calls outstanding.
+ *
+ * The counters are per thread, so each worker balances its own load.
+ * If either child isn't a module call, we just use the first random
+ * choice.
+ */
+static unlang_t *load_balance_by_load(unlang_group_t *g)
+{
+	uint32_t	a, b;
+	unlang_t	*first, *second;
+	int64_t		cost_a, cost_b;
+
+	if (g->num_children == 1) return g->children;
+
+	a = fr_rand() % g->num_children;
+	b = fr_rand() % (g->num_children - 1);
+	if (b >= a) b++;
+
+	first = load_balance_child(g, a);
+	second = load_balance_child(g, b);
+
+	cost_a = load_balance_cost(first);
+	if (cost_a < 0) return first;
+
+	cost_b = load_balance_cost(second);
+	if (cost_b < 0) return first;
+
+	return (cost_b < cost_a) ? second : first;
+}
+
 static unlang_action_t unlang_load_balance_next(rlm_rcode_t *p_result, request_t *request)
 {
 	unlang_stack_t			*stack = request->stack;
@@ -122,8 +238,6 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 	unlang_group_t			*g;
 	unlang_load_balance_t	*gext = NULL;
 
-	uint32_t count = 0;
-
 	g = unlang_generic_to_group(instruction);
 	if (!g->num_children) {
 		*p_result = RLM_MODULE_NOOP;
@@ -137,7 +251,7 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 	redundant = talloc_get_type_abort(frame->state, unlang_frame_state_redundant_t);
 
 	if (gext && gext->vpt) {
-		uint32_t hash, start;
+		uint32_t start;
 		ssize_t slen;
 		char const *p = NULL;
 		char buffer[1024];
@@ -156,7 +270,7 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 			slen = tmpl_find_vp(&vp, request, gext->vpt);
 			if (slen < 0) {
 				REDEBUG("Failed finding attribute %s", gext->vpt->name);
-				goto randomly_choose;
+				goto load_balance;
 			}
 
 			switch (tmpl_da(gext->vpt)->type) {
@@ -177,61 +291,33 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 				break;
 
 			default:
-				goto randomly_choose;
+				goto load_balance;
 			}
 
+			RDEBUG3("load-balance starting at child %d", (int) start);
+
+			redundant->found = load_balance_child(g, start);
+
 		} else {
 			slen = tmpl_expand(&p, buffer, sizeof(buffer), request, gext->vpt, NULL, NULL);
 			if (slen < 0) {
 				REDEBUG("Failed expanding template");
-				goto randomly_choose;
+				goto load_balance;
 			}
 
-			hash = fr_hash(p, slen);
-
-			start = hash % g->num_children;;
-		}
-
-		RDEBUG3("load-balance starting at child %d", (int) start);
+			redundant->found = load_balance_by_hash(g, gext, p, slen);
 
-		count = 0;
-		for (redundant->child = redundant->found = g->children;
-		     redundant->child != NULL;
-		     redundant->child = redundant->child->next) {
-			count++;
-			if (count == start) {
-				redundant->found = redundant->child;
-				break;
-			}
+			RDEBUG3("load-balance key hashes to %s", redundant->found->debug_name);
 		}
 
 	} else {
-	randomly_choose:
-		count = 0;
-
+	load_balance:
 		/*
-		 *	Choose a child at random.
-		 *
-		 *	@todo - leverage the "power of 2", as per
-		 *      lib/io/network.c.  This is good enough for
-		 *      most purposes.  However, in order to do this,
-		 *      we need to track active callers across
-		 *      *either* multiple modules in one thread, *or*
-		 *      across multiple threads.
-		 *
-		 *	We don't have thread-specific instance data
-		 *	for this load-balance section.  So for now,
-		 *	just pick a random child.
+		 *	Choose a child based on how busy the modules
+		 *	are in this thread, or at random if we don't
+		 *	know.
 		 */
-		for (redundant->child = redundant->found = g->children;
-		     redundant->child != NULL;
-		     redundant->child = redundant->child->next) {
-			count++;
-
-			if ((count * (fr_rand() & 0xffffff)) < (uint32_t) 0x1000000) {
-				redundant->found = redundant->child;
-			}
-		}
+		redundant->found = load_balance_by_load(g);
 	}
 
 	/*
@@ -32,6 +32,7 @@ extern "C" {
 typedef struct {
 	unlang_group_t	group;
 	tmpl_t		*vpt;
+	uint32_t	*child_hash;	//!< Hash of each child's name, for rendezvous hashing.
 } unlang_load_balance_t;
 
 /** State of a redundant operation
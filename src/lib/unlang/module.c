@@ -27,6 +27,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/server/cond.h>
+#include <freeradius-devel/server/latency.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/request_data.h>
@@ -54,6 +55,31 @@ typedef struct {
 	fr_event_timer_t const		*ev;		//!< Event in this worker's event heap.
 } unlang_module_event_t;
 
+/** Record how long a call into a module took
+ *
+ * Updates the thread's latency histogram, and the smoothed latency
+ * which load-balance sections use to pick the least loaded module.
+ * The smoothing is the same as for TCP's SRTT, i.e. 1/8 of each new
+ * sample.
+ */
+static inline CC_HINT(always_inline) void module_latency_add(module_thread_instance_t *thread, fr_time_t start)
+{
+	fr_time_t	now = fr_time();
+	fr_time_delta_t	rtt;
+
+	if (now < start) return;
+
+	fr_latency_add(thread->latency, start, now);
+
+	rtt = now - start;
+	if (!thread->latency_ewma) {
+		thread->latency_ewma = rtt;
+	} else {
+		thread->latency_ewma += (rtt - thread->latency_ewma) / 8;
+	}
+	if (!thread->latency_ewma) thread->latency_ewma = 1;
+}
+
 /** Call the callback registered for a read I/O event
  *
  * @param[in] el	containing the event (not passed to the callback).
@@ -708,6 +734,7 @@ static unlang_action_t unlang_module_resume(rlm_rcode_t *p_result, request_t *re
 	}
 
 	state->thread->active_callers--;
+	module_latency_add(state->thread, state->start);
 
 	/*
 	 *	The module is done.  But, running it pushed one or
@@ -819,6 +846,7 @@ static unlang_action_t unlang_module(rlm_rcode_t *p_result, request_t *request)
 	 *	For logging unresponsive children.
 	 */
 	state->thread->total_calls++;
+	state->start = fr_time();
 
 	caller = request->module;
 	request->module = mc->instance->name;
@@ -859,6 +887,8 @@ static unlang_action_t unlang_module(rlm_rcode_t *p_result, request_t *request)
 		return UNLANG_ACTION_YIELD;
 	}
 
+	module_latency_add(state->thread, state->start);
+
 done:
 	fr_assert(unlang_indent == request->log.unlang_indent);
 	fr_assert(rcode >= RLM_MODULE_REJECT);
@@ -63,6 +63,9 @@ typedef struct {
 	unlang_module_resume_t		resume;			//!< resumption handler
 	unlang_module_signal_t		signal;			//!< for signal handlers
 	/** @} */
+
+	fr_time_t			start;			//!< When the module was called, for
+								///< the module's latency histogram.
 } unlang_frame_state_module_t;
 
 static inline unlang_module_t *unlang_generic_to_module(unlang_t *p)
@@ -1,6 +1,7 @@
 SUBMAKEFILES := \
 	dbuff_tests.mk \
 	heap_tests.mk \
+	histogram_tests.mk \
 	libfreeradius-util.mk \
 	sbuff_tests.mk \
 	strerror_tests.mk
@@ -0,0 +1,278 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Log-linear (HDR style) histograms
+ *
+ * Values below 2^precision each get their own bucket.  Above that, every
+ * power of two is split into 2^precision linear sub-buckets, so the error
+ * in any value read back is at most 1 part in 2^precision, no matter how
+ * large the value is.
+ *
+ * A histogram has one writer, which updates it without locks or atomic
+ * read-modify-write instructions.  Any thread may read it, or merge it
+ * into another histogram, at any time.  A reader sees each counter either
+ * before or after an update, but the counters may be slightly out of step
+ * with each other.
+ *
+ * @file src/lib/util/histogram.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/histogram.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/strerror.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+struct fr_histogram_s {
+	unsigned int		precision;		//!< log2 of the number of sub-buckets.
+	uint64_t		max;			//!< Larger values are recorded as this.
+	uint32_t		num_buckets;
+
+	_Atomic(uint64_t)	count;			//!< Number of values added.
+	_Atomic(uint64_t)	sum;			//!< Sum of the values added.
+	_Atomic(uint64_t)	largest;		//!< Largest value added.
+
+	_Atomic(uint64_t)	buckets[];
+};
+
+/*
+ *	Only the owner updates a histogram, so there's no need for an
+ *	atomic increment.  The relaxed load and store just make sure
+ *	readers never see a torn value.
+ */
+#define COUNTER_ADD(_c, _n) atomic_store_explicit(&(_c), atomic_load_explicit(&(_c), memory_order_relaxed) + (_n), \
+						  memory_order_relaxed)
+#define COUNTER_GET(_c) atomic_load_explicit(&(_c), memory_order_relaxed)
+
+static inline CC_HINT(always_inline) uint32_t histogram_index(unsigned int precision, uint64_t value)
+{
+	unsigned int	shift;
+
+	if (value < ((uint64_t) 1 << precision)) return value;
+
+	/*
+	 *	The top (precision + 1) bits of the value give the
+	 *	bucket within the power of two.
+	 */
+	shift = fr_high_bit_pos(value) - (precision + 1);
+
+	return (shift << precision) + (value >> shift);
+}
+
+/** Return the largest value which is recorded in a bucket
+ *
+ */
+static uint64_t histogram_bucket_max(unsigned int precision, uint32_t idx)
+{
+	unsigned int	shift;
+	uint64_t	mantissa;
+
+	if (idx < ((uint32_t) 2 << precision)) return idx;
+
+	shift = (idx >> precision) - 1;
+	mantissa = idx - ((uint64_t) shift << precision);
+
+	return ((mantissa + 1) << shift) - 1;
+}
+
+/** Allocate a histogram
+ *
+ * @param[in] ctx		to allocate the histogram in.
+ * @param[in] precision		log2 of the number of sub-buckets per power of two.
+ *				5 gives an error of about 3%, 7 about 1%.
+ * @param[in] max		Largest value to track.  Larger values are
+ *				recorded as max.
+ * @return
+ *	- A new histogram.
+ *	- NULL on error.
+ */
+fr_histogram_t *fr_histogram_alloc(TALLOC_CTX *ctx, unsigned int precision, uint64_t max)
+{
+	fr_histogram_t	*h;
+	uint32_t	num_buckets, i;
+
+	if ((precision < 1) || (precision > 16)) {
+		fr_strerror_printf("Histogram precision must be between 1 and 16");
+		return NULL;
+	}
+
+	if (!max) max = UINT64_MAX;
+
+	num_buckets = histogram_index(precision, max) + 1;
+
+	h = (fr_histogram_t *) talloc_zero_size(ctx, sizeof(*h) + (sizeof(h->buckets[0]) * num_buckets));
+	if (!h) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	talloc_set_name_const(h, "fr_histogram_t");
+
+	h->precision = precision;
+	h->max = max;
+	h->num_buckets = num_buckets;
+
+	atomic_init(&h->count, 0);
+	atomic_init(&h->sum, 0);
+	atomic_init(&h->largest, 0);
+	for (i = 0; i < num_buckets; i++) atomic_init(&h->buckets[i], 0);
+
+	return h;
+}
+
+/** Record a value
+ *
+ * Must only be called by the thread which owns the histogram.
+ */
+void fr_histogram_add(fr_histogram_t *h, uint64_t value)
+{
+	if (value > h->max) value = h->max;
+
+	COUNTER_ADD(h->buckets[histogram_index(h->precision, value)], 1);
+	COUNTER_ADD(h->count, 1);
+	COUNTER_ADD(h->sum, value);
+
+	if (value > COUNTER_GET(h->largest)) atomic_store_explicit(&h->largest, value, memory_order_relaxed);
+}
+
+/** Add the counts from one histogram to another
+ *
+ * src may be in use by another thread.  dst must be owned by the caller.
+ *
+ * @param[in] dst	to add the counts to.
+ * @param[in] src	to read the counts from.  Must have been allocated
+ *			with the same precision and max as dst.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the histograms are incompatible.
+ */
+int fr_histogram_merge(fr_histogram_t *dst, fr_histogram_t const *src)
+{
+	uint32_t	i;
+	uint64_t	largest;
+
+	if ((dst->precision != src->precision) || (dst->num_buckets != src->num_buckets)) {
+		fr_strerror_printf("Histograms have different layouts");
+		return -1;
+	}
+
+	for (i = 0; i < src->num_buckets; i++) {
+		uint64_t count = COUNTER_GET(src->buckets[i]);
+
+		if (count) COUNTER_ADD(dst->buckets[i], count);
+	}
+
+	COUNTER_ADD(dst->count, COUNTER_GET(src->count));
+	COUNTER_ADD(dst->sum, COUNTER_GET(src->sum));
+
+	largest = COUNTER_GET(src->largest);
+	if (largest > COUNTER_GET(dst->largest)) atomic_store_explicit(&dst->largest, largest, memory_order_relaxed);
+
+	return 0;
+}
+
+/** Reset all of the counts
+ *
+ * Must only be called by the thread which owns the histogram.
+ */
+void fr_histogram_clear(fr_histogram_t *h)
+{
+	uint32_t i;
+
+	for (i = 0; i < h->num_buckets; i++) atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+
+	atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+	atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+	atomic_store_explicit(&h->largest, 0, memory_order_relaxed);
+}
+
+/** Return the number of values recorded
+ *
+ */
+uint64_t fr_histogram_count(fr_histogram_t const *h)
+{
+	return COUNTER_GET(h->count);
+}
+
+/** Return the sum of the values recorded
+ *
+ */
+uint64_t fr_histogram_sum(fr_histogram_t const *h)
+{
+	return COUNTER_GET(h->sum);
+}
+
+/** Return the largest value recorded
+ *
+ */
+uint64_t fr_histogram_max(fr_histogram_t const *h)
+{
+	return COUNTER_GET(h->largest);
+}
+
+/** Return the value below which a given percentage of the recorded values fall
+ *
+ * The result is the largest value in the bucket which holds the percentile,
+ * so it is never less than the exact value, and never more than the largest
+ * value recorded.
+ *
+ * @param[in] h			to examine.
+ * @param[in] percentile	between 0 and 100, e.g. 99.9.
+ * @return
+ *	- The value at the percentile.
+ *	- 0 if no values have been recorded.
+ */
+uint64_t fr_histogram_percentile(fr_histogram_t const *h, double percentile)
+{
+	uint64_t	count, rank, seen = 0, largest;
+	uint32_t	i;
+
+	/*
+	 *	Sum the buckets, rather than using h->count, so that
+	 *	we're consistent if the owner is adding values.
+	 */
+	count = 0;
+	for (i = 0; i < h->num_buckets; i++) count += COUNTER_GET(h->buckets[i]);
+	if (!count) return 0;
+
+	if (percentile < 0) percentile = 0;
+	if (percentile > 100) percentile = 100;
+
+	rank = (uint64_t) (((percentile / 100) * count) + 0.5);
+	if (rank < 1) rank = 1;
+
+	largest = COUNTER_GET(h->largest);
+
+	for (i = 0; i < h->num_buckets; i++) {
+		seen += COUNTER_GET(h->buckets[i]);
+		if (seen >= rank) {
+			uint64_t value = histogram_bucket_max(h->precision, i);
+
+			if (value > h->max) value = h->max;
+			if (largest && (value > largest)) value = largest;
+
+			return value;
+		}
+	}
+
+	return largest;
+}
@@ -0,0 +1,56 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Log-linear (HDR style) histograms
+ *
+ * @file src/lib/util/histogram.h
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(histogram_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+
+#include <stdint.h>
+#include <talloc.h>
+
+typedef struct fr_histogram_s fr_histogram_t;
+
+fr_histogram_t	*fr_histogram_alloc(TALLOC_CTX *ctx, unsigned int precision, uint64_t max) CC_HINT(warn_unused_result);
+
+void		fr_histogram_add(fr_histogram_t *h, uint64_t value) CC_HINT(nonnull);
+
+int		fr_histogram_merge(fr_histogram_t *dst, fr_histogram_t const *src) CC_HINT(nonnull);
+
+void		fr_histogram_clear(fr_histogram_t *h) CC_HINT(nonnull);
+
+uint64_t	fr_histogram_count(fr_histogram_t const *h) CC_HINT(nonnull);
+
+uint64_t	fr_histogram_sum(fr_histogram_t const *h) CC_HINT(nonnull);
+
+uint64_t	fr_histogram_max(fr_histogram_t const *h) CC_HINT(nonnull);
+
+uint64_t	fr_histogram_percentile(fr_histogram_t const *h, double percentile) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,107 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "histogram.c"
+
+/*
+ *	Every value must land in a bucket whose range includes it,
+ *	and the buckets must be contiguous.
+ */
+static void histogram_buckets(void)
+{
+	unsigned int	precision;
+
+	for (precision = 1; precision <= 8; precision++) {
+		uint64_t	value;
+		uint32_t	idx, last = 0;
+
+		for (value = 0; value < 1000000; value++) {
+			idx = histogram_index(precision, value);
+
+			TEST_CHECK(histogram_bucket_max(precision, idx) >= value);
+			TEST_MSG("precision %u, value %" PRIu64 " is above the max of bucket %u", precision, value, idx);
+
+			TEST_CHECK((idx == last) || (idx == last + 1));
+			TEST_MSG("precision %u, value %" PRIu64 " skipped from bucket %u to %u", precision, value, last, idx);
+
+			if ((idx != last) && (idx > 0)) {
+				TEST_CHECK(histogram_bucket_max(precision, last) == value - 1);
+				TEST_MSG("precision %u, bucket %u ends at %" PRIu64 ", expected %" PRIu64,
+					 precision, last, histogram_bucket_max(precision, last), value - 1);
+			}
+			last = idx;
+		}
+
+		idx = histogram_index(precision, UINT64_MAX);
+		TEST_CHECK(histogram_bucket_max(precision, idx) == UINT64_MAX);
+		TEST_MSG("precision %u, last bucket %u doesn't end at UINT64_MAX", precision, idx);
+	}
+}
+
+static void histogram_percentiles(void)
+{
+	fr_histogram_t	*h;
+	uint64_t	i, value;
+
+	h = fr_histogram_alloc(NULL, 7, 0);
+	TEST_CHECK(h != NULL);
+
+	TEST_CHECK(fr_histogram_percentile(h, 50) == 0);
+
+	for (i = 1; i <= 100000; i++) fr_histogram_add(h, i);
+
+	TEST_CHECK(fr_histogram_count(h) == 100000);
+	TEST_CHECK(fr_histogram_sum(h) == (uint64_t) 100000 * 100001 / 2);
+	TEST_CHECK(fr_histogram_max(h) == 100000);
+
+	/*
+	 *	Precision 7 means the values are within 1 in 128.
+	 */
+	value = fr_histogram_percentile(h, 50);
+	TEST_CHECK((value >= 50000) && (value <= 50000 + (50000 / 128)));
+	TEST_MSG("p50 %" PRIu64, value);
+
+	value = fr_histogram_percentile(h, 99.9);
+	TEST_CHECK((value >= 99900) && (value <= 100000));
+	TEST_MSG("p99.9 %" PRIu64, value);
+
+	TEST_CHECK(fr_histogram_percentile(h, 100) == 100000);
+
+	fr_histogram_clear(h);
+	TEST_CHECK(fr_histogram_count(h) == 0);
+	TEST_CHECK(fr_histogram_percentile(h, 99) == 0);
+
+	talloc_free(h);
+}
+
+static void histogram_merge(void)
+{
+	fr_histogram_t	*a, *b, *c;
+	uint64_t	i;
+
+	a = fr_histogram_alloc(NULL, 5, 1000000);
+	b = fr_histogram_alloc(NULL, 5, 1000000);
+	c = fr_histogram_alloc(NULL, 6, 1000000);
+	TEST_CHECK(a && b && c);
+
+	for (i = 0; i < 1000; i++) fr_histogram_add(a, 10);
+	for (i = 0; i < 10; i++) fr_histogram_add(b, 5000000);	/* clamped to max */
+
+	TEST_CHECK(fr_histogram_merge(a, b) == 0);
+	TEST_CHECK(fr_histogram_count(a) == 1010);
+	TEST_CHECK(fr_histogram_max(a) == 1000000);
+	TEST_CHECK(fr_histogram_percentile(a, 50) == 10);
+	TEST_CHECK(fr_histogram_percentile(a, 100) == 1000000);
+
+	TEST_CHECK(fr_histogram_merge(a, c) < 0);
+
+	talloc_free(a);
+	talloc_free(b);
+	talloc_free(c);
+}
+
+TEST_LIST = {
+	{ "histogram_buckets",		histogram_buckets	},
+	{ "histogram_percentiles",	histogram_percentiles	},
+	{ "histogram_merge",		histogram_merge		},
+	{ NULL }
+};
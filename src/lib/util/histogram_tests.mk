@@ -0,0 +1,8 @@
+TARGET		:= histogram_tests
+
+SOURCES		:= histogram_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+
+TGT_PREREQS	+= libfreeradius-util.a
@@ -29,6 +29,7 @@ SOURCES		:= \
 		   hash.c \
 		   heap.c \
 		   hex.c \
+		   histogram.c \
 		   hmac_md5.c \
 		   hmac_sha1.c \
 		   hw.c \
@@ -4249,6 +4249,14 @@ parse:
 	}
 		goto finish;
 
+	/*
+	 *	If fr_hostname_lookups is set (the default), anything
+	 *	which isn't an address is resolved with getaddrinfo().
+	 *	That blocks the calling thread, and it happens at run
+	 *	time too, e.g. when an xlat expansion is cast to an
+	 *	address on a worker.  Use the async resolver in
+	 *	rlm_unbound for names which aren't known in advance.
+	 */
 	case FR_TYPE_IPV4_ADDR:
 	{
 		fr_ipaddr_t addr;
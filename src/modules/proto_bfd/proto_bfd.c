@@ -35,51 +35,32 @@
 #include <freeradius-devel/util/socket.h>
 #include <freeradius-devel/util/time.h>
 
-#define BFD_MAX_SECRET_LENGTH 20
-
-typedef enum bfd_session_state_t {
-	BFD_STATE_ADMIN_DOWN = 0,
-	BFD_STATE_DOWN,
-	BFD_STATE_INIT,
-	BFD_STATE_UP
-} bfd_session_state_t;
-
-typedef enum bfd_diag_t {
-	BFD_DIAG_NONE = 0,
-	BFD_CTRL_EXPIRED,
-	BFD_ECHO_FAILED,
-	BFD_NEIGHBOR_DOWN,
-	BFD_FORWARD_PLANE_RESET,
-	BFD_PATH_DOWN,
-	BFD_CONCATENATED_PATH_DOWN,
-	BFD_ADMIN_DOWN,
-	BFD_REVERSE_CONCAT_PATH_DOWN
-} bfd_diag_t;
-
-typedef enum bfd_auth_type_t {
-	BFD_AUTH_RESERVED = 0,
-	BFD_AUTH_SIMPLE,
-	BFD_AUTH_KEYED_MD5,
-	BFD_AUTH_MET_KEYED_MD5,
-	BFD_AUTH_KEYED_SHA1,
-	BFD_AUTH_MET_KEYED_SHA1,
-} bfd_auth_type_t;
-
-#define BFD_AUTH_INVALID (BFD_AUTH_MET_KEYED_SHA1 + 1)
+#include "proto_bfd.h"
+
+/*
+ *	How many packets we read or write in one system call.
+ */
+#define BFD_BATCH	64
+
+/*
+ *	Transmit times are rounded to this, so that sessions with
+ *	similar intervals fire in the same pass of the event loop,
+ *	and their packets go out in one sendmmsg() call.
+ */
+#define BFD_TX_SLOT	fr_time_delta_from_msec(1)
+
+typedef struct bfd_socket_s bfd_socket_t;
 
 typedef struct {
 	int		number;
 
 	fr_socket_t socket;
 
-	fr_event_list_t *el;
+	bfd_socket_t	*sock;		//!< The socket this session sends and receives on.
+	fr_event_list_t *el;		//!< The socket's event list.
 	CONF_SECTION	*server_cs;
 	CONF_SECTION	*unlang;
 
-	bool		blocked;
-	int		pipefd[2];
-	pthread_t	pthread_id;
-
 	bfd_auth_type_t auth_type;
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
 	size_t		secret_len;
@@ -92,6 +73,8 @@ typedef struct {
 
 	fr_event_timer_t const	*ev_timeout;
 	fr_event_timer_t const	*ev_packet;
+	fr_time_t	timeout_at;	//!< When ev_timeout fires.
+	fr_time_t	detect_at;	//!< When the session really times out.
 	fr_time_t	last_recv;
 	fr_time_t	next_recv;
 	fr_time_t	last_sent;
@@ -130,84 +113,7 @@ typedef struct {
 	int		passive;
 } bfd_state_t;
 
-typedef struct {
-	uint8_t		auth_type;
-	uint8_t		auth_len;
-	uint8_t		key_id;
-} __attribute__ ((packed)) bfd_auth_basic_t;
-
-
-typedef struct {
-	uint8_t		auth_type;
-	uint8_t		auth_len;
-	uint8_t		key_id;
-	uint8_t		password[16];
-} __attribute__ ((packed)) bfd_auth_simple_t;
-
-typedef struct {
-	uint8_t		auth_type;
-	uint8_t		auth_len;
-	uint8_t		key_id;
-	uint8_t		reserved;
-	uint32_t	sequence_no;
-	uint8_t		digest[MD5_DIGEST_LENGTH];
-} __attribute__ ((packed)) bfd_auth_md5_t;
-
-typedef struct {
-	uint8_t		auth_type;
-	uint8_t		auth_len;
-	uint8_t		key_id;
-	uint8_t		reserved;
-	uint32_t	sequence_no;
-	uint8_t		digest[SHA1_DIGEST_LENGTH];
-} __attribute__ ((packed)) bfd_auth_sha1_t;
-
-typedef union bfd_auth_t {
-	bfd_auth_basic_t        basic;
-	bfd_auth_simple_t	password;
-	bfd_auth_md5_t		md5;
-	bfd_auth_sha1_t		sha1;
-} __attribute__ ((packed)) bfd_auth_t;
-
-
-/*
- *	A packet
- */
-typedef struct {
-#ifdef WORDS_BIGENDIAN
-	unsigned int	version : 3;
-	unsigned int	diag : 5;
-	unsigned int	state : 2;
-	unsigned int	poll : 1;
-	unsigned int	final : 1;
-	unsigned int	control_plane_independent : 1;
-	unsigned int	auth_present : 1;
-	unsigned int	demand : 1;
-	unsigned int	multipoint : 1;
-#else
-	unsigned int	diag : 5;
-	unsigned int	version : 3;
-
-	unsigned int	multipoint : 1;
-	unsigned int	demand : 1;
-	unsigned int	auth_present : 1;
-	unsigned int	control_plane_independent : 1;
-	unsigned int	final : 1;
-	unsigned int	poll : 1;
-	unsigned int	state : 2;
-#endif
-	uint8_t		detect_multi;
-	uint8_t		length;
-	uint32_t	my_disc;
-	uint32_t	your_disc;
-	uint32_t	desired_min_tx_interval;
-	uint32_t	required_min_rx_interval;
-	uint32_t	min_echo_rx_interval;
-	bfd_auth_t	auth;
-} __attribute__ ((packed)) bfd_packet_t;
-
-
-typedef struct {
+struct bfd_socket_s {
 	fr_ipaddr_t	my_ipaddr;
 	uint16_t	my_port;
 
@@ -226,8 +132,28 @@ typedef struct {
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
 	size_t		secret_len;
 
-	rbtree_t	*session_tree;
-} bfd_socket_t;
+	rbtree_t	*session_tree;		//!< Sessions by peer address.
+	rbtree_t	*disc_tree;		//!< Sessions by our discriminator.
+
+	int		fd;			//!< Shared by all sessions.
+	fr_event_list_t	*el;			//!< Runs all session timers, and reads from fd.
+	bool		own_thread;		//!< We created the thread which runs el.
+	pthread_t	pthread_id;
+
+	/*
+	 *	Packets are queued while the timers run, and sent in
+	 *	one call after the event loop has serviced everything.
+	 */
+	struct mmsghdr	tx[BFD_BATCH];
+	struct iovec	tx_iov[BFD_BATCH];
+	bfd_packet_t	tx_packet[BFD_BATCH];
+	unsigned int	tx_queued;
+
+	struct mmsghdr	rx[BFD_BATCH];
+	struct iovec	rx_iov[BFD_BATCH];
+	bfd_packet_t	rx_packet[BFD_BATCH];
+	struct sockaddr_storage rx_src[BFD_BATCH];
+};
 
 static fr_dict_t const *dict_bfd;
 
@@ -252,128 +178,90 @@ void bfd_init(fr_event_list_t *xel)
 	event_list = xel;
 }
 
-static void bfd_pthread_free(bfd_state_t *session)
+#ifndef HAVE_RECVMMSG
+static int recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags, UNUSED struct timespec *timeout)
 {
-	session->blocked = true;
+	unsigned int i;
 
-	close(session->pipefd[0]);
-	close(session->pipefd[1]);
+	for (i = 0; i < vlen; i++) {
+		ssize_t slen;
 
-	talloc_free(session->el);
+		slen = recvmsg(fd, &msgvec[i].msg_hdr, flags);
+		if (slen < 0) return (i > 0) ? (int) i : -1;
 
-	session->el = NULL;
-	session->pipefd[0] = session->pipefd[1] = -1;
+		msgvec[i].msg_len = slen;
+	}
 
-	session->blocked = false;
+	return i;
 }
+#endif
 
 /*
- *	A child thread reads the packet from a pipe, and processes it.
+ *	Send all of the queued packets.
  */
-static void bfd_pipe_recv(UNUSED fr_event_list_t *xel, int fd, UNUSED int flags, void *ctx)
+static void bfd_socket_flush(UNUSED fr_event_list_t *xel, UNUSED fr_time_t now, void *ctx)
 {
-	ssize_t num;
-	bfd_state_t *session = ctx;
-	bfd_packet_t bfd;
-
-	if (session->blocked) return;
+	bfd_socket_t	*sock = ctx;
+	unsigned int	sent = 0;
+	int		rcode;
+
+	while (sent < sock->tx_queued) {
+		rcode = sendmmsg(sock->fd, &sock->tx[sent], sock->tx_queued - sent, 0);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			/*
+			 *	Skip the packet which failed, and
+			 *	carry on with the rest.
+			 */
+			ERROR("Failed sending packet: %s", fr_syserror(errno));
+			sent++;
+			continue;
+		}
 
-	/*
-	 *	Read the header
-	 */
-	num = read(fd, &bfd, 4);
-	if ((num < 4) || (bfd.length < 4)) {
-	fail:
-		ERROR("BFD Failed reading from pipe!");
-		session->blocked = true;
-		return;
+		sent += rcode;
 	}
 
-	/*
-	 *	This is already checked in the caller, but what the heck...
-	 */
-	if (bfd.length > sizeof(bfd)) goto fail;
-
-	/*
-	 *	Read the rest of the packet.
-	 */
-	num = read(fd, ((uint8_t *) &bfd) + 4, bfd.length - 4);
-	if ((num < 0) || ((num + 4) != bfd.length)) goto fail;
-
-	bfd_process(session, &bfd);
+	sock->tx_queued = 0;
 }
 
 /*
- *	Do nothing more than read from the sockets and process the
- *	timers.
+ *	Queue a packet for sending.  It's copied, so the caller
+ *	can re-use its buffer.
  */
-static void *bfd_child_thread(void *ctx)
+static void bfd_queue_packet(bfd_state_t *session, bfd_packet_t const *bfd)
 {
-	bfd_state_t *session = ctx;
+	bfd_socket_t	*sock = session->sock;
+	unsigned int	i;
 
-	DEBUG("BFD %d starting child thread", session->number);
-	bfd_start_control(session);
+	if (sock->tx_queued == BFD_BATCH) bfd_socket_flush(sock->el, 0, sock);
 
-	fr_event_loop(session->el);
+	i = sock->tx_queued++;
 
-	bfd_pthread_free(session);
+	memcpy(&sock->tx_packet[i], bfd, bfd->length);
 
-	return NULL;
-}
+	sock->tx_iov[i].iov_base = &sock->tx_packet[i];
+	sock->tx_iov[i].iov_len = bfd->length;
 
+	memset(&sock->tx[i], 0, sizeof(sock->tx[i]));
+	sock->tx[i].msg_hdr.msg_name = &session->remote_sockaddr;
+	sock->tx[i].msg_hdr.msg_namelen = session->salen;
+	sock->tx[i].msg_hdr.msg_iov = &sock->tx_iov[i];
+	sock->tx[i].msg_hdr.msg_iovlen = 1;
+}
 
-static int bfd_pthread_create(bfd_state_t *session)
+/*
+ *	Run all of the sessions for a socket.
+ */
+static void *bfd_socket_thread(void *ctx)
 {
-	pthread_attr_t attr;
-
-	if (pipe(session->pipefd) < 0) {
-		ERROR("Failed opening pipe: %s", fr_syserror(errno));
-		return 0;
-	}
+	bfd_socket_t *sock = ctx;
 
-	session->el = fr_event_list_alloc(session, NULL, NULL);
-	if (!session->el) {
-		ERROR("Failed creating event list");
-	close_pipes:
-		close(session->pipefd[0]);
-		close(session->pipefd[1]);
-		session->pipefd[0] = session->pipefd[1] = -1;
-		return 0;
-	}
-
-#ifdef O_NONBLOCK
-	fcntl(session->pipefd[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
-	fcntl(session->pipefd[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
-#endif
-
-	if (fr_event_fd_insert(session, session->el, session->pipefd[0],
-			       bfd_pipe_recv,
-			       NULL,
-			       NULL,
-			       session) < 0) {
-		PERROR("Failed inserting file descriptor into event list");
-		goto close_pipes;
-	}
+	DEBUG("BFD starting thread for %u sessions", rbtree_num_elements(sock->session_tree));
 
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	fr_event_loop(sock->el);
 
-	/*
-	 *	Create the thread detached, so that it cleans up it's
-	 *	own memory when it exits.
-	 *
-	 *	Note that the function returns non-zero on error, NOT
-	 *	-1.  The return code is the error, and errno isn't set.
-	 */
-	if (fr_schedule_pthread_create(&session->pthread_id, bfd_child_thread, session) < 0) {
-		talloc_free(session->el);
-		session->el = NULL;
-		PERROR("Thread create failed");
-		goto close_pipes;
-	}
-	pthread_attr_destroy(&attr);
-
-	return 1;
+	return NULL;
 }
 
 static const char *bfd_state[] = {
@@ -413,16 +301,7 @@ static void bfd_trigger(bfd_state_t *session)
 
 static void bfd_session_free(void *ctx)
 {
-	bfd_state_t *session = ctx;
-
-	if (event_list != session->el) {
-		/*
-		 *	FIXME: this isn't particularly safe.
-		 */
-		bfd_pthread_free(session);
-	}
-
-	talloc_free(session);
+	talloc_free(ctx);
 }
 
 
@@ -482,10 +361,19 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 	 */
 	session->number = sock->number++;
 	session->socket.fd = sockfd;
+	session->sock = sock;
+	session->el = sock->el;
 	session->session_state = BFD_STATE_DOWN;
 	session->server_cs = sock->server_cs;
 	session->unlang = sock->unlang;
-	session->local_disc = fr_rand();
+
+	/*
+	 *	Packets are demultiplexed by our discriminator, so it
+	 *	has to be unique, and non-zero.
+	 */
+	do {
+		session->local_disc = fr_rand();
+	} while (!session->local_disc || rbtree_finddata(sock->disc_tree, session));
 	session->remote_disc = 0;
 	session->local_diag = BFD_DIAG_NONE;
 	session->desired_min_tx_interval = sock->min_tx_interval * 1000;
@@ -593,25 +481,19 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 		return NULL;
 	}
 
+	if (!rbtree_insert(sock->disc_tree, session)) {
+		ERROR("FAILED creating new session!");
+		rbtree_deletebydata(sock->session_tree, session);
+		return NULL;
+	}
+
 	bfd_trigger(session);
 
 	/*
-	 *	Check for threaded / non-threaded operation.
+	 *	The socket's event list isn't running yet, so it's
+	 *	safe to start the timers from here.
 	 */
-	if (event_list) {
-		session->el = event_list;
-
-		bfd_start_control(session);
-
-		session->pipefd[0] = session->pipefd[1] = -1;
-		session->pthread_id = pthread_self();
-	} else {
-		if (!bfd_pthread_create(session)) {
-			rbtree_deletebydata(sock->session_tree, session);
-			talloc_free(session);
-			return NULL;
-		}
-	}
+	bfd_start_control(session);
 
 	return session;
 }
@@ -895,17 +777,14 @@ static void bfd_send_packet(UNUSED fr_event_list_t *eel, UNUSED fr_time_t now, v
 
 	DEBUG("BFD %d sending packet state %s",
 	      session->number, bfd_state[session->session_state]);
-	if (sendto(session->socket.fd, &bfd, bfd.length, 0,
-		   (struct sockaddr *) &session->remote_sockaddr,
-		   session->salen) < 0) {
-		ERROR("Failed sending packet: %s", fr_syserror(errno));
-	}
+	bfd_queue_packet(session, &bfd);
 }
 
 static int bfd_start_packets(bfd_state_t *session)
 {
-	uint32_t	interval, base;
+	uint32_t	interval, base, max;
 	uint64_t	jitter;
+	fr_time_t	when;
 
 	/*
 	 *	Reset the timers.
@@ -932,12 +811,24 @@ static int bfd_start_packets(bfd_state_t *session)
 	jitter >>= 32;
 	jitter *= interval;
 	jitter >>= 32;
+	max = interval;
 	interval = base;
 	interval += jitter;
 
-	if (fr_event_timer_in(session, session->el, &session->ev_packet,
-			      fr_time_delta_from_usec(interval),
-			      bfd_send_packet, session) < 0) {
+	/*
+	 *	Round the time up to the next slot, so that the
+	 *	sessions which are due at about the same time all
+	 *	send together.  If that would take us past the full
+	 *	interval, round down instead.  The jitter is still
+	 *	random, it's just less precise.
+	 */
+	when = session->last_sent + fr_time_delta_from_usec(interval);
+	when += BFD_TX_SLOT - 1;
+	when -= when % BFD_TX_SLOT;
+	if (when > (session->last_sent + fr_time_delta_from_usec(max))) when -= BFD_TX_SLOT;
+
+	if (fr_event_timer_at(session, session->el, &session->ev_packet,
+			      when, bfd_send_packet, session) < 0) {
 		fr_assert("Failed to insert event" == NULL);
 	}
 
@@ -949,8 +840,6 @@ static void bfd_set_timeout(bfd_state_t *session, fr_time_t when)
 {
 	fr_time_t now = when;
 
-	fr_event_timer_delete(&session->ev_timeout);
-
 	now += fr_time_delta_from_usec(session->detection_time);
 
 	if (session->detect_multi >= 2) {
@@ -963,6 +852,17 @@ static void bfd_set_timeout(bfd_state_t *session, fr_time_t when)
 		session->next_recv += fr_time_delta_from_usec(delay);
 	}
 
+	/*
+	 *	This is called for every packet we receive.  If the
+	 *	timer is already set to fire before the new deadline,
+	 *	just move the deadline, and let the timer re-arm
+	 *	itself when it fires.  That saves removing and
+	 *	re-inserting it for every packet.
+	 */
+	session->detect_at = now;
+	if (session->ev_timeout && (session->timeout_at <= now)) return;
+
+	session->timeout_at = now;
 	if (fr_event_timer_at(session, session->el, &session->ev_timeout,
 			      now, bfd_detection_timeout, session) < 0) {
 		fr_assert("Failed to insert event" == NULL);
@@ -1084,6 +984,18 @@ static void bfd_detection_timeout(UNUSED fr_event_list_t *eel, fr_time_t now, vo
 {
 	bfd_state_t *session = ctx;
 
+	/*
+	 *	We've received packets since the timer was set.
+	 */
+	if (session->detect_at > now) {
+		session->timeout_at = session->detect_at;
+		if (fr_event_timer_at(session, session->el, &session->ev_timeout,
+				      session->detect_at, bfd_detection_timeout, session) < 0) {
+			fr_assert("Failed to insert event" == NULL);
+		}
+		return;
+	}
+
 	DEBUG("BFD %d Timeout state %s ****** ", session->number,
 	      bfd_state[session->session_state]);
 
@@ -1139,11 +1051,7 @@ static void bfd_poll_response(bfd_state_t *session)
 
 	bfd_sign(session, &bfd);
 
-	if (sendto(session->socket.fd, &bfd, bfd.length, 0,
-		   (struct sockaddr *) &session->remote_sockaddr,
-		   session->salen) < 0) {
-		ERROR("Failed sending poll response: %s", fr_syserror(errno));
-	}
+	bfd_queue_packet(session, &bfd);
 }
 
 
@@ -1397,133 +1305,165 @@ static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd)
  *	Check if an incoming request is "ok"
  *
  *	It takes packets, not requests.  It sees if the packet looks
- *	OK.  If so, it does a number of sanity checks on it.
+ *	OK.  If so, it does a number of sanity checks on it, finds the
+ *	session, and processes the packet.
  */
-static int bfd_socket_recv(rad_listen_t *listener)
+static int bfd_socket_demux(bfd_socket_t *sock, bfd_packet_t *bfd, ssize_t rcode,
+			    struct sockaddr_storage *src, socklen_t sizeof_src)
 {
-	ssize_t		rcode;
-	bfd_socket_t	*sock = listener->data;
 	bfd_state_t	*session;
 	bfd_state_t	my_session;
-	struct sockaddr_storage src;
-	socklen_t	sizeof_src = sizeof(src);
-	bfd_packet_t	bfd;
-
-	rcode = recvfrom(listener->fd, &bfd, sizeof(bfd), 0,
-			 (struct sockaddr *)&src, &sizeof_src);
-	if (rcode < 0) {
-		ERROR("Failed receiving packet: %s", fr_syserror(errno));
-		return 0;
-	}
 
 	if (rcode < 24) {
 		DEBUG("BFD packet is too short (%d < 24)", (int) rcode);
 		return 0;
 	}
 
-	if (bfd.version != 1) {
-		DEBUG("BFD packet has wrong version (%d != 1)", bfd.version);
+	if (bfd->version != 1) {
+		DEBUG("BFD packet has wrong version (%d != 1)", bfd->version);
 		return 0;
 	}
 
-	if (bfd.length < 24) {
-		DEBUG("BFD packet has wrong length (%d < 24)", bfd.length);
+	if (bfd->length < 24) {
+		DEBUG("BFD packet has wrong length (%d < 24)", bfd->length);
 		return 0;
 	}
 
-	if (bfd.length > sizeof(bfd)) {
-		DEBUG("BFD packet has wrong length (%d > %zd)", bfd.length, sizeof(bfd));
+	if (bfd->length > sizeof(*bfd)) {
+		DEBUG("BFD packet has wrong length (%d > %zd)", bfd->length, sizeof(*bfd));
 		return 0;
 	}
 
-	if (bfd.auth_present) {
-		if (bfd.length < 26) {
+	if (bfd->auth_present) {
+		if (bfd->length < 26) {
 			DEBUG("BFD packet has wrong length (%d < 26)",
-			      bfd.length);
+			      bfd->length);
 			return 0;
 		}
 
-		if (bfd.length < 24 + bfd.auth.basic.auth_len) {
+		if (bfd->length < 24 + bfd->auth.basic.auth_len) {
 			DEBUG("BFD packet is too short (%d < %d)",
-			      bfd.length, 24 + bfd.auth.basic.auth_len);
+			      bfd->length, 24 + bfd->auth.basic.auth_len);
 			return 0;
 
 		}
 
-		if (bfd.length != 24 + bfd.auth.basic.auth_len) {
+		if (bfd->length != 24 + bfd->auth.basic.auth_len) {
 			DEBUG("WARNING: What is the extra data?");
 		}
 
 	}
 
-	if (bfd.detect_multi == 0) {
+	if (bfd->detect_multi == 0) {
 		DEBUG("BFD packet has detect_multi == 0");
 		return 0;
 	}
 
-	if (bfd.multipoint != 0) {
+	if (bfd->multipoint != 0) {
 		DEBUG("BFD packet has multi != 0");
 		return 0;
 	}
 
-	if (bfd.my_disc == 0) {
+	if (bfd->my_disc == 0) {
 		DEBUG("BFD packet has my_disc == 0");
 		return 0;
 	}
 
-	if ((bfd.your_disc == 0) &&
-	    !((bfd.state == BFD_STATE_DOWN) ||
-	      (bfd.state == BFD_STATE_ADMIN_DOWN))) {
+	if ((bfd->your_disc == 0) &&
+	    !((bfd->state == BFD_STATE_DOWN) ||
+	      (bfd->state == BFD_STATE_ADMIN_DOWN))) {
 		DEBUG("BFD packet has invalid your-disc / state");
 		return 0;
 	}
 
-	/*
-	 *	We SHOULD use "your_disc", but what the heck.
-	 */
 	fr_ipaddr_from_sockaddr(&my_session.socket.inet.dst_ipaddr,
-				&my_session.socket.inet.dst_port, &src, sizeof_src);
+				&my_session.socket.inet.dst_port, src, sizeof_src);
 
-	session = rbtree_finddata(sock->session_tree, &my_session);
-	if (!session) {
-		DEBUG("BFD unknown peer");
-		return 0;
-	}
+	/*
+	 *	Once the peer knows our discriminator, use it to find
+	 *	the session (Section 6.3).  Until then, all we have is
+	 *	the source address.
+	 */
+	if (bfd->your_disc != 0) {
+		my_session.local_disc = bfd->your_disc;
 
-	if (!event_list) {
-		uint8_t *p = (uint8_t *) &bfd;
-		size_t total = bfd.length;
+		session = rbtree_finddata(sock->disc_tree, &my_session);
+		if (!session) {
+			DEBUG("BFD unknown discriminator %08x", bfd->your_disc);
+			return 0;
+		}
 
 		/*
-		 *	A child has had a problem.  Do some cleanups.
+		 *	We only do single hop, so the packet has to
+		 *	come from the peer we're talking to.
 		 */
-		if (session->blocked) bfd_pthread_free(session);
+		if (fr_ipaddr_cmp(&session->socket.inet.dst_ipaddr, &my_session.socket.inet.dst_ipaddr) != 0) {
+			DEBUG("BFD %d packet came from the wrong address", session->number);
+			return 0;
+		}
 
-		/*
-		 *	No event list, try to create a new one.
-		 */
-		if (!session->el && !bfd_pthread_create(session)) {
-			DEBUG("BFD %d - error trying to create child thread",
-			      session->number);
+	} else {
+		session = rbtree_finddata(sock->session_tree, &my_session);
+		if (!session) {
+			DEBUG("BFD unknown peer");
 			return 0;
 		}
+	}
 
-		do {
-			rcode = write(session->pipefd[1], p, total);
-			if ((rcode < 0) && (errno == EINTR)) continue;
+	return bfd_process(session, bfd);
+}
 
-			if (rcode < 0) {
-				session->blocked = true;
-				return 0;
+/*
+ *	Read as many packets as are available, and process them.
+ */
+static void bfd_socket_read(UNUSED fr_event_list_t *xel, UNUSED int fd, UNUSED int flags, void *ctx)
+{
+	bfd_socket_t	*sock = ctx;
+	int		i, received;
+
+	do {
+		for (i = 0; i < BFD_BATCH; i++) {
+			sock->rx[i].msg_hdr.msg_namelen = sizeof(sock->rx_src[i]);
+		}
+
+		received = recvmmsg(sock->fd, sock->rx, BFD_BATCH, MSG_DONTWAIT, NULL);
+		if (received < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+				ERROR("Failed receiving packet: %s", fr_syserror(errno));
 			}
+			return;
+		}
+
+		for (i = 0; i < received; i++) {
+			bfd_socket_demux(sock, &sock->rx_packet[i], sock->rx[i].msg_len,
+					 &sock->rx_src[i], sock->rx[i].msg_hdr.msg_namelen);
+		}
+	} while (received == BFD_BATCH);
+}
 
-			total -= rcode;
-			p += rcode;
-		} while (total > 0);
+/*
+ *	Called by the listener, when the sessions are run from the
+ *	main event loop.  If we have our own thread, it reads from
+ *	the socket instead, and there's nothing to do here.
+ */
+static int bfd_socket_recv(rad_listen_t *listener)
+{
+	ssize_t		rcode;
+	bfd_socket_t	*sock = listener->data;
+	struct sockaddr_storage src;
+	socklen_t	sizeof_src = sizeof(src);
+	bfd_packet_t	bfd;
+
+	if (sock->own_thread) return 0;
+
+	rcode = recvfrom(listener->fd, &bfd, sizeof(bfd), 0,
+			 (struct sockaddr *)&src, &sizeof_src);
+	if (rcode < 0) {
+		ERROR("Failed receiving packet: %s", fr_syserror(errno));
 		return 0;
 	}
 
-	return bfd_process(session, &bfd);
+	return bfd_socket_demux(sock, &bfd, rcode, &src, sizeof_src);
 }
 
 static int bfd_parse_ip_port(CONF_SECTION *cs, fr_ipaddr_t *ipaddr, uint16_t *port)
@@ -1629,6 +1569,13 @@ static int bfd_session_cmp(const void *one, const void *two)
 	return fr_ipaddr_cmp(&a->socket.inet.dst_ipaddr, &b->socket.inet.dst_ipaddr);
 }
 
+static int bfd_disc_cmp(const void *one, const void *two)
+{
+	const bfd_state_t *a = one, *b = two;
+
+	return (a->local_disc > b->local_disc) - (a->local_disc < b->local_disc);
+}
+
 static fr_table_num_sorted_t const auth_types[] = {
 	{ L("keyed-md5"),		BFD_AUTH_KEYED_MD5	},
 	{ L("keyed-sha1"),		BFD_AUTH_KEYED_SHA1	},
@@ -1657,6 +1604,8 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 
 	if (cf_pair_parse(sock, cs, "interface", FR_ITEM_POINTER(FR_TYPE_STRING, &sock->interface), NULL, T_INVALID) < 0) return -1;
 
+	if (cf_pair_parse(sock, cs, "min_transmit_interval", FR_ITEM_POINTER(FR_TYPE_UINT32,
+			  &sock->min_tx_interval), "1000", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "min_receive_interval", FR_ITEM_POINTER(FR_TYPE_UINT32,
 			  &sock->min_rx_interval), "1000", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "max_timeouts", FR_ITEM_POINTER(FR_TYPE_UINT32,
@@ -1717,6 +1666,12 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+	sock->disc_tree = rbtree_talloc_alloc(sock, bfd_disc_cmp, bfd_state_t, NULL, 0);
+	if (!sock->disc_tree) {
+		ERROR("Failed creating session tree!");
+		return -1;
+	}
+
 	/*
 	 *	Find the sibling "bfd" section of the "listen" section.
 	 */
@@ -1757,6 +1712,49 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+	sock->fd = this->fd;
+
+	{
+		int i;
+
+		for (i = 0; i < BFD_BATCH; i++) {
+			sock->rx_iov[i].iov_base = &sock->rx_packet[i];
+			sock->rx_iov[i].iov_len = sizeof(sock->rx_packet[i]);
+
+			sock->rx[i].msg_hdr.msg_name = &sock->rx_src[i];
+			sock->rx[i].msg_hdr.msg_iov = &sock->rx_iov[i];
+			sock->rx[i].msg_hdr.msg_iovlen = 1;
+		}
+	}
+
+	/*
+	 *	All of the sessions on a socket run in one event
+	 *	list.  If the server gave us one, use that.
+	 *	Otherwise, create a thread of our own for them.
+	 */
+	if (event_list) {
+		sock->el = event_list;
+	} else {
+		sock->el = fr_event_list_alloc(sock, NULL, NULL);
+		if (!sock->el) {
+			PERROR("Failed creating event list");
+			close(this->fd);
+			return -1;
+		}
+
+		if (fr_event_fd_insert(sock, sock->el, sock->fd, bfd_socket_read, NULL, NULL, sock) < 0) {
+			PERROR("Failed inserting file descriptor into event list");
+			close(this->fd);
+			return -1;
+		}
+	}
+
+	if (fr_event_post_insert(sock->el, bfd_socket_flush, sock) < 0) {
+		PERROR("Failed inserting post-processing callback");
+		close(this->fd);
+		return -1;
+	}
+
 	/*
 	 *	Bootstrap the initial set of connections.
 	 */
@@ -1764,6 +1762,14 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+	if (event_list) return 0;
+
+	if (fr_schedule_pthread_create(&sock->pthread_id, bfd_socket_thread, sock) < 0) {
+		PERROR("Thread create failed");
+		return -1;
+	}
+	sock->own_thread = true;
+
 	return 0;
 }
 
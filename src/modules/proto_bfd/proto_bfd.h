@@ -0,0 +1,136 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ * @file proto_bfd.h
+ * @brief BFD packet and session state definitions.
+ *
+ * @copyright 2012 Network RADIUS SARL (legal@networkradius.com)
+ */
+RCSIDH(proto_bfd_h, "$Id$")
+
+#include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/sha1.h>
+
+#define BFD_MAX_SECRET_LENGTH 20
+
+typedef enum bfd_session_state_t {
+	BFD_STATE_ADMIN_DOWN = 0,
+	BFD_STATE_DOWN,
+	BFD_STATE_INIT,
+	BFD_STATE_UP
+} bfd_session_state_t;
+
+typedef enum bfd_diag_t {
+	BFD_DIAG_NONE = 0,
+	BFD_CTRL_EXPIRED,
+	BFD_ECHO_FAILED,
+	BFD_NEIGHBOR_DOWN,
+	BFD_FORWARD_PLANE_RESET,
+	BFD_PATH_DOWN,
+	BFD_CONCATENATED_PATH_DOWN,
+	BFD_ADMIN_DOWN,
+	BFD_REVERSE_CONCAT_PATH_DOWN
+} bfd_diag_t;
+
+typedef enum bfd_auth_type_t {
+	BFD_AUTH_RESERVED = 0,
+	BFD_AUTH_SIMPLE,
+	BFD_AUTH_KEYED_MD5,
+	BFD_AUTH_MET_KEYED_MD5,
+	BFD_AUTH_KEYED_SHA1,
+	BFD_AUTH_MET_KEYED_SHA1,
+} bfd_auth_type_t;
+
+#define BFD_AUTH_INVALID (BFD_AUTH_MET_KEYED_SHA1 + 1)
+
+typedef struct {
+	uint8_t		auth_type;
+	uint8_t		auth_len;
+	uint8_t		key_id;
+} __attribute__ ((packed)) bfd_auth_basic_t;
+
+
+typedef struct {
+	uint8_t		auth_type;
+	uint8_t		auth_len;
+	uint8_t		key_id;
+	uint8_t		password[16];
+} __attribute__ ((packed)) bfd_auth_simple_t;
+
+typedef struct {
+	uint8_t		auth_type;
+	uint8_t		auth_len;
+	uint8_t		key_id;
+	uint8_t		reserved;
+	uint32_t	sequence_no;
+	uint8_t		digest[MD5_DIGEST_LENGTH];
+} __attribute__ ((packed)) bfd_auth_md5_t;
+
+typedef struct {
+	uint8_t		auth_type;
+	uint8_t		auth_len;
+	uint8_t		key_id;
+	uint8_t		reserved;
+	uint32_t	sequence_no;
+	uint8_t		digest[SHA1_DIGEST_LENGTH];
+} __attribute__ ((packed)) bfd_auth_sha1_t;
+
+typedef union bfd_auth_t {
+	bfd_auth_basic_t        basic;
+	bfd_auth_simple_t	password;
+	bfd_auth_md5_t		md5;
+	bfd_auth_sha1_t		sha1;
+} __attribute__ ((packed)) bfd_auth_t;
+
+
+/*
+ *	A packet
+ */
+typedef struct {
+#ifdef WORDS_BIGENDIAN
+	unsigned int	version : 3;
+	unsigned int	diag : 5;
+	unsigned int	state : 2;
+	unsigned int	poll : 1;
+	unsigned int	final : 1;
+	unsigned int	control_plane_independent : 1;
+	unsigned int	auth_present : 1;
+	unsigned int	demand : 1;
+	unsigned int	multipoint : 1;
+#else
+	unsigned int	diag : 5;
+	unsigned int	version : 3;
+
+	unsigned int	multipoint : 1;
+	unsigned int	demand : 1;
+	unsigned int	auth_present : 1;
+	unsigned int	control_plane_independent : 1;
+	unsigned int	final : 1;
+	unsigned int	poll : 1;
+	unsigned int	state : 2;
+#endif
+	uint8_t		detect_multi;
+	uint8_t		length;
+	uint32_t	my_disc;
+	uint32_t	your_disc;
+	uint32_t	desired_min_tx_interval;
+	uint32_t	required_min_rx_interval;
+	uint32_t	min_echo_rx_interval;
+	bfd_auth_t	auth;
+} __attribute__ ((packed)) bfd_packet_t;
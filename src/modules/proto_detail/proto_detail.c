@@ -22,6 +22,7 @@
  * @copyright 2017 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
  * @copyright 2016 Alan DeKok (aland@freeradius.org)
  */
+#include <freeradius-devel/internal/detail.h>
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
@@ -232,6 +233,57 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, UNUSED void *parent,
 	return dl_module_instance(ctx, out, transport_cs, parent_inst, name, DL_MODULE_TYPE_SUBMODULE);
 }
 
+/** Decode a binary detail entry
+ *
+ * proto_detail_work has already checked the CRC.
+ */
+static int decode_binary(proto_detail_t const *inst, request_t *request, uint8_t *const data, size_t data_len)
+{
+	fr_detail_binary_t	hdr;
+	fr_pair_t		*vp;
+	fr_cursor_t		cursor;
+
+	if ((fr_detail_binary_hdr_decode(&hdr, data, data_len) <= 0) ||
+	    ((data_len - FR_DETAIL_BINARY_HDR_LEN) < hdr.length)) {
+		RPEDEBUG("Malformed binary entry");
+		return -1;
+	}
+
+	/*
+	 *	Set the original src/dst ip/port
+	 */
+	if (hdr.src_ipaddr.af != AF_UNSPEC) {
+		request->packet->socket.inet.src_ipaddr = hdr.src_ipaddr;
+		request->packet->socket.inet.dst_ipaddr = hdr.dst_ipaddr;
+		request->packet->socket.inet.src_port = hdr.src_port;
+		request->packet->socket.inet.dst_port = hdr.dst_port;
+	}
+
+	fr_cursor_init(&cursor, &request->request_pairs);
+	fr_cursor_tail(&cursor);	/* Ensure we only free what we add on error */
+
+	if (fr_detail_binary_decode_pairs(request->packet, &cursor, request->dict,
+					  data + FR_DETAIL_BINARY_HDR_LEN, hdr.length) < 0) {
+		RPEDEBUG("Failed decoding binary entry");
+		fr_cursor_free_list(&cursor);
+		return -1;
+	}
+
+	/*
+	 *	The original time at which we received the
+	 *	packet.  We need this to properly calculate
+	 *	Acct-Delay-Time.
+	 */
+	vp = fr_pair_afrom_da(request->packet, attr_packet_original_timestamp);
+	if (vp) {
+		vp->vp_date = hdr.timestamp;
+		vp->type = VT_DATA;
+		fr_cursor_append(&cursor, vp);
+	}
+
+	return inst->app_io->decode(inst->app_io_instance, request, data, data_len);
+}
+
 /** Decode the packet, and set the request->process function
  *
  */
@@ -259,6 +311,8 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 	request->reply->socket.inet.src_ipaddr = request->packet->socket.inet.src_ipaddr;
 	request->reply->socket.inet.dst_ipaddr = request->packet->socket.inet.src_ipaddr;
 
+	if (fr_detail_binary_is_binary(data, data_len)) return decode_binary(inst, request, data, data_len);
+
 	end = data + data_len;
 
 	MPRINT("HEADER %s", data);
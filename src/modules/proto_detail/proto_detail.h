@@ -88,13 +88,17 @@ struct proto_detail_work_s {
 	char const			*filename_work;		//!< work file name
 
 	uint32_t			poll_interval;		//!< interval between polling
+	uint32_t			num_work_files;		//!< number of work files to read in parallel
 
 	fr_retry_config_t		retry_config;		//!< retry config with irt, mrt, etc.
 	uint32_t			max_outstanding;	//!< number of packets to run in parallel
+	fr_time_delta_t			target_latency;		//!< slow down reading if packets take longer than this
 
 	bool				track_progress;		//!< do we track progress by writing?
+	uint32_t			checkpoint_interval;	//!< write a checkpoint after this many packets
 	bool				retransmit;		//!< are we retransmitting on error?
 	bool				immediate;		//!< start reading the detail files immediately
+	fr_unix_time_t			replay_from;		//!< skip binary entries received before this
 
 	int				mode;			//!< O_RDWR or O_RDONLY
 
@@ -103,6 +107,19 @@ struct proto_detail_work_s {
 
 typedef struct proto_detail_work_thread_s proto_detail_work_thread_t;
 
+/*
+ *	One of the work files which the directory reader fills.
+ */
+typedef struct {
+	proto_detail_work_thread_t	*thread;		//!< directory reader which owns this work file
+	char const			*filename_work;		//!< work file name
+	int				vnode_fd;		//!< file descriptor for vnode_delete
+	fr_event_timer_t const		*ev;			//!< for polling and lock timers
+	fr_time_delta_t			lock_interval;		//!< interval between trying the locks.
+	bool				busy;			//!< a worker is reading the file.
+								//!< Protected by the worker_mutex.
+} proto_detail_file_slot_t;
+
 struct proto_detail_work_thread_s {
 	char const			*name;			//!< debug name for printing
 	proto_detail_work_t const	*inst;			//!< instance data
@@ -114,13 +131,22 @@ struct proto_detail_work_thread_s {
 	fr_network_t			*nr;			//!< for Linux-specific callbacks
 	fr_listen_t			*listen;		//!< talloc_parent() is slow
 	proto_detail_work_thread_t	*file_parent;		//!< thread instance of the directory reader that spawned us
+	proto_detail_file_slot_t	*file_slot;		//!< the work file we were spawned for
+
+	proto_detail_file_slot_t	*slots;			//!< work files, for the directory reader
+	uint32_t			num_slots;		//!< number of work files
 
 	char const			*filename_work;		//!< work file name
 	fr_dlist_head_t			list;			//!< for retransmissions
+	fr_dlist_head_t			in_flight;		//!< outstanding records, in file order
 
 	uint32_t       			outstanding;		//!< number of currently outstanding records;
+	uint32_t			window;			//!< current limit on outstanding records
+	uint32_t			window_acked;		//!< records completed since the window grew
+	int				window_mark;		//!< only records read after this can shrink the window
 	fr_time_delta_t			lock_interval;		//!< interval between trying the locks.
 
+	bool				binary;			//!< the file contains binary records
 	bool				eof;			//!< are we at EOF on reading?
 	bool				closing;		//!< we should be closing the file
 	bool				paused;			//!< Is reading paused?
@@ -137,6 +163,13 @@ struct proto_detail_work_thread_s {
 	off_t				header_offset;		//!< offset of the current header we're reading
 	off_t				read_offset;		//!< where we're reading from in filename_work
 
+	uint8_t				*map;			//!< filename_work mapped into memory
+	size_t				map_size;		//!< how much of the file is mapped
+
+	char const			*filename_progress;	//!< where checkpoints are written
+	int				progress_fd;		//!< file descriptor for checkpoints
+	uint32_t			since_checkpoint;	//!< records completed since the last checkpoint
+
 	fr_event_timer_t const		*ev;			//!< for detail file timers.
 
 	pthread_mutex_t			worker_mutex;		//!< for the workers
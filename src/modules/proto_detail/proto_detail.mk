@@ -6,4 +6,4 @@ endif
 
 SOURCES		:= proto_detail.c
 
-TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-util.a libfreeradius-io.a
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-util.a libfreeradius-io.a libfreeradius-internal.a
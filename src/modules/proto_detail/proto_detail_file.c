@@ -23,6 +23,7 @@
  * @copyright 2017 Alan DeKok (aland@deployingradius.com)
  */
 
+#include <freeradius-devel/internal/detail.h>
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/io/base.h>
 #include <freeradius-devel/io/listen.h>
@@ -70,6 +71,7 @@ typedef struct proto_detail_work_s proto_detail_file_t;
 typedef struct proto_detail_work_thread_s proto_detail_file_thread_t;
 
 static void work_init(proto_detail_file_thread_t *thread);
+static void work_init_slot(proto_detail_file_slot_t *slot);
 static void mod_vnode_delete(fr_event_list_t *el, int fd, UNUSED int fflags, void *ctx);
 
 static const CONF_PARSER file_listen_config[] = {
@@ -81,6 +83,8 @@ static const CONF_PARSER file_listen_config[] = {
 
 	{ FR_CONF_OFFSET("immediate", FR_TYPE_BOOL, proto_detail_file_t, immediate) },
 
+	{ FR_CONF_OFFSET("work_files", FR_TYPE_UINT32, proto_detail_file_t, num_work_files), .dflt = "1" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -106,18 +110,26 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 static void mod_vnode_extend(fr_listen_t *li, UNUSED uint32_t fflags)
 {
 	proto_detail_file_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_file_thread_t);
+	uint32_t i;
 
-	bool has_worker = false;
+	/*
+	 *	Something changed in the directory.  Look for new
+	 *	files for any work file which is idle.
+	 */
+	for (i = 0; i < thread->num_slots; i++) {
+		proto_detail_file_slot_t *slot = &thread->slots[i];
+		bool busy;
 
-	pthread_mutex_lock(&thread->worker_mutex);
-	has_worker = (thread->num_workers != 0);
-	pthread_mutex_unlock(&thread->worker_mutex);
+		pthread_mutex_lock(&thread->worker_mutex);
+		busy = slot->busy;
+		pthread_mutex_unlock(&thread->worker_mutex);
 
-	if (has_worker) return;
+		if (busy || (slot->vnode_fd >= 0)) continue;
 
-	if (thread->ev) fr_event_timer_delete(&thread->ev);
+		if (slot->ev) fr_event_timer_delete(&slot->ev);
 
-	work_init(thread);
+		work_init_slot(slot);
+	}
 }
 
 /** Open a detail listener
@@ -127,6 +139,7 @@ static int mod_open(fr_listen_t *li)
 {
 	proto_detail_file_t const  *inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_file_t);
 	proto_detail_file_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_file_thread_t);
+	uint32_t		   i;
 
 	if (inst->poll_interval == 0) {
 		int oflag;
@@ -150,14 +163,60 @@ static int mod_open(fr_listen_t *li)
 	thread->vnode_fd = -1;
 	pthread_mutex_init(&thread->worker_mutex, NULL);
 
+	/*
+	 *	The first work file is "detail.work", and any others
+	 *	are "detail.work1", "detail.work2", etc.
+	 */
+	thread->num_slots = inst->num_work_files;
+	MEM(thread->slots = talloc_zero_array(thread, proto_detail_file_slot_t, thread->num_slots));
+	for (i = 0; i < thread->num_slots; i++) {
+		thread->slots[i].thread = thread;
+		thread->slots[i].vnode_fd = -1;
+		if (i == 0) {
+			thread->slots[i].filename_work = inst->filename_work;
+		} else {
+			MEM(thread->slots[i].filename_work = talloc_typed_asprintf(thread->slots, "%s%u",
+										   inst->filename_work, i));
+		}
+	}
+
 	return 0;
 }
 
+/*
+ *	Whether a file is one of our work files, or their checkpoints.
+ */
+static bool work_is_ours(proto_detail_file_thread_t *thread, char const *filename)
+{
+	uint32_t i;
+
+	for (i = 0; i < thread->num_slots; i++) {
+		if (strncmp(filename, thread->slots[i].filename_work,
+			    strlen(thread->slots[i].filename_work)) == 0) return true;
+	}
+
+	return false;
+}
+
+/*
+ *	Whether a file is the index of a binary detail file, or one
+ *	being written.
+ */
+static bool work_is_index(char const *filename)
+{
+	size_t len = strlen(filename);
+
+	if ((len > 4) && (strcmp(filename + len - 4, ".tmp") == 0)) len -= 4;
+
+	return (len > 4) && (strncmp(filename + len - 4, ".idx", 4) == 0);
+}
+
 /*
  *	The "detail.work" file doesn't exist.  Let's see if we can rename one.
  */
-static int work_rename(proto_detail_file_thread_t *thread)
+static int work_rename(proto_detail_file_slot_t *slot)
 {
+	proto_detail_file_thread_t *thread = slot->thread;
 	proto_detail_file_t const *inst = thread->inst;
 	unsigned int	i;
 	int		found;
@@ -185,9 +244,20 @@ static int work_rename(proto_detail_file_thread_t *thread)
 	chtime = 0;
 	found = -1;
 	for (i = 0; i < files.gl_pathc; i++) {
+		/*
+		 *	Another work file may match the wildcard.
+		 *	Don't steal it from its reader.
+		 */
+		if (work_is_ours(thread, files.gl_pathv[i])) continue;
+
+		/*
+		 *	Indexes are read along with their detail file.
+		 */
+		if (work_is_index(files.gl_pathv[i])) continue;
+
 		if (stat(files.gl_pathv[i], &st) < 0) continue;
 
-		if ((i == 0) || (st.st_ctime < chtime)) {
+		if ((found < 0) || (st.st_ctime < chtime)) {
 			chtime = st.st_ctime;
 			found = i;
 		}
@@ -203,25 +273,52 @@ static int work_rename(proto_detail_file_thread_t *thread)
 	 */
 	filename = files.gl_pathv[found];
 
-	DEBUG("proto_detail (%s): Renaming %s -> %s", thread->name, filename, inst->filename_work);
-	if (rename(filename, inst->filename_work) < 0) {
+	DEBUG("proto_detail (%s): Renaming %s -> %s", thread->name, filename, slot->filename_work);
+	if (rename(filename, slot->filename_work) < 0) {
 		ERROR("detail (%s): Failed renaming %s to %s: %s",
-		      thread->name, filename, inst->filename_work, fr_syserror(errno));
+		      thread->name, filename, slot->filename_work, fr_syserror(errno));
 		goto noop;
 	}
 
+	/*
+	 *	Bring the index along, if there is one.  It's only
+	 *	used to find where to start reading, so it doesn't
+	 *	matter if this fails.
+	 */
+	{
+		char *index_from, *index_to;
+
+		index_from = fr_detail_index_name(NULL, filename);
+		index_to = fr_detail_index_name(index_from, slot->filename_work);
+		if ((rename(index_from, index_to) < 0) && (errno != ENOENT)) {
+			DEBUG("proto_detail (%s): Failed renaming %s to %s: %s",
+			      thread->name, index_from, index_to, fr_syserror(errno));
+		}
+		talloc_free(index_from);
+	}
+
 	globfree(&files);	/* Shouldn't be using anything in files now */
 
 	/*
 	 *	The file should now exist, return the open'd FD.
 	 */
-	return open(inst->filename_work, inst->mode);
+	return open(slot->filename_work, inst->mode);
 }
 
 /*
  *	Start polling again after a timeout.
  */
 static void work_retry_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	proto_detail_file_slot_t *slot = uctx;
+
+	work_init_slot(slot);
+}
+
+/*
+ *	Start polling all of the work files after a timeout.
+ */
+static void work_start_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
 {
 	proto_detail_file_thread_t *thread = talloc_get_type_abort(uctx, proto_detail_file_thread_t);
 
@@ -231,8 +328,9 @@ static void work_retry_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, v
 /*
  *	The "detail.work" file exists, and is open in the 'fd'.
  */
-static int work_exists(proto_detail_file_thread_t *thread, int fd)
+static int work_exists(proto_detail_file_slot_t *slot, int fd)
 {
+	proto_detail_file_thread_t *thread = slot->thread;
 	proto_detail_file_t const *inst = thread->inst;
 	bool			opened = false;
 	proto_detail_work_thread_t     *work;
@@ -241,7 +339,7 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 
 	fr_event_vnode_func_t	funcs = { .delete = mod_vnode_delete };
 
-	DEBUG3("proto_detail (%s): Trying to lock %s", thread->name, inst->filename_work);
+	DEBUG3("proto_detail (%s): Trying to lock %s", thread->name, slot->filename_work);
 
 	/*
 	 *	"detail.work" exists, try to lock it.
@@ -250,47 +348,47 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 		fr_time_t delay;
 
 		DEBUG3("proto_detail (%s): Failed locking %s: %s",
-		       thread->name, inst->filename_work, fr_syserror(errno));
+		       thread->name, slot->filename_work, fr_syserror(errno));
 
 		close(fd);
 
-		delay = thread->lock_interval;
+		delay = slot->lock_interval;
 
 		/*
 		 *	Set the next interval, and ensure that we
 		 *	don't do massive busy-polling.
 		 */
-		thread->lock_interval += thread->lock_interval / 2;
-		if (thread->lock_interval > ((fr_time_delta_t) 30) * NSEC) thread->lock_interval = ((fr_time_delta_t) 30) * NSEC;
+		slot->lock_interval += slot->lock_interval / 2;
+		if (slot->lock_interval > ((fr_time_delta_t) 30) * NSEC) slot->lock_interval = ((fr_time_delta_t) 30) * NSEC;
 
 		DEBUG3("proto_detail (%s): Waiting %d.%06ds for lock on file %s",
-		       thread->name, (int) (delay / NSEC), (int) ((delay % NSEC) / 1000), inst->filename_work);
+		       thread->name, (int) (delay / NSEC), (int) ((delay % NSEC) / 1000), slot->filename_work);
 
-		if (fr_event_timer_in(thread, thread->el, &thread->ev,
-				      delay, work_retry_timer, thread) < 0) {
-			ERROR("Failed inserting retry timer for %s", inst->filename_work);
+		if (fr_event_timer_in(thread, thread->el, &slot->ev,
+				      delay, work_retry_timer, slot) < 0) {
+			ERROR("Failed inserting retry timer for %s", slot->filename_work);
 		}
 		return 0;
 	}
 
 	DEBUG3("proto_detail (%s): Obtained lock and starting to process file %s",
-	       thread->name, inst->filename_work);
+	       thread->name, slot->filename_work);
 
 	/*
 	 *	Ignore empty files.
 	 */
 	if (fstat(fd, &st) < 0) {
-		ERROR("Failed opening %s: %s", inst->filename_work,
+		ERROR("Failed opening %s: %s", slot->filename_work,
 		      fr_syserror(errno));
-		unlink(inst->filename_work);
+		unlink(slot->filename_work);
 		close(fd);
 		return 1;
 	}
 
 	if (!st.st_size) {
 		DEBUG3("proto_detail (%s): %s file is empty, ignoring it.",
-		       thread->name, inst->filename_work);
-		unlink(inst->filename_work);
+		       thread->name, slot->filename_work);
+		unlink(slot->filename_work);
 		close(fd);
 		return 1;
 	}
@@ -324,12 +422,13 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 	li->app_io_instance = inst->parent->work_io_instance;
 	work->inst = li->app_io_instance;
 	work->file_parent = thread;
+	work->file_slot = slot;
 	work->ev = NULL;
 
 	li->fd = work->fd = dup(fd);
 	if (work->fd < 0) {
 		DEBUG("proto_detail (%s): Failed opening %s: %s",
-		      thread->name, inst->filename_work, fr_syserror(errno));
+		      thread->name, slot->filename_work, fr_syserror(errno));
 
 		close(fd);
 		talloc_free(li);
@@ -343,7 +442,7 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 	 *	maybe by creating a new instance?
 	 */
 	if (fr_event_filter_insert(thread, NULL, thread->el, fd, FR_EVENT_FILTER_VNODE,
-				   &funcs, NULL, thread) < 0) {
+				   &funcs, NULL, slot) < 0) {
 		PERROR("Failed adding work socket to event loop");
 		close(fd);
 		talloc_free(li);
@@ -353,7 +452,7 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 	/*
 	 *	Remember this for later.
 	 */
-	thread->vnode_fd = fd;
+	slot->vnode_fd = fd;
 
 	/*
 	 *	For us, this is the worker listener.
@@ -361,7 +460,7 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 	 */
 	thread->listen = li;
 
-	work->filename_work = talloc_strdup(work, inst->filename_work);
+	work->filename_work = talloc_strdup(work, slot->filename_work);
 
 	/*
 	 *	Set configurable parameters for message ring buffer.
@@ -371,6 +470,7 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 
 	pthread_mutex_lock(&thread->worker_mutex);
 	thread->num_workers++;
+	slot->busy = true;
 	pthread_mutex_unlock(&thread->worker_mutex);
 
 	/*
@@ -387,16 +487,21 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 
 	if (!fr_schedule_listen_add(inst->parent->sc, li)) {
 	error:
-		if (fr_event_fd_delete(thread->el, thread->vnode_fd, FR_EVENT_FILTER_VNODE) < 0) {
+		if (fr_event_fd_delete(thread->el, slot->vnode_fd, FR_EVENT_FILTER_VNODE) < 0) {
 			PERROR("Failed removing DELETE callback when opening work file");
 		}
-		close(thread->vnode_fd);
-		thread->vnode_fd = -1;
+		close(slot->vnode_fd);
+		slot->vnode_fd = -1;
 
 		if (opened) {
 			(void) li->app_io->close(li);
 			thread->listen = NULL;
 			li = NULL;
+		} else {
+			pthread_mutex_lock(&thread->worker_mutex);
+			thread->num_workers--;
+			slot->busy = false;
+			pthread_mutex_unlock(&thread->worker_mutex);
 		}
 
 		talloc_free(li);
@@ -414,10 +519,10 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 
 static void mod_vnode_delete(fr_event_list_t *el, int fd, UNUSED int fflags, void *ctx)
 {
-	proto_detail_file_thread_t *thread = talloc_get_type_abort(ctx, proto_detail_file_thread_t);
-	proto_detail_file_t const *inst = thread->inst;
+	proto_detail_file_slot_t *slot = ctx;
+	proto_detail_file_thread_t *thread = slot->thread;
 
-	DEBUG("proto_detail (%s): Deleted %s", thread->name, inst->filename_work);
+	DEBUG("proto_detail (%s): Deleted %s", thread->name, slot->filename_work);
 
 	/*
 	 *	Silently ignore notifications from the directory.  We
@@ -426,9 +531,9 @@ static void mod_vnode_delete(fr_event_list_t *el, int fd, UNUSED int fflags, voi
 	 */
 	if (fd == thread->fd) return;
 
-	if (fd != thread->vnode_fd) {
+	if (fd != slot->vnode_fd) {
 		ERROR("Received DELETE for FD %d, when we were expecting one on FD %d - ignoring it",
-		      fd, thread->vnode_fd);
+		      fd, slot->vnode_fd);
 		return;
 	}
 
@@ -436,7 +541,7 @@ static void mod_vnode_delete(fr_event_list_t *el, int fd, UNUSED int fflags, voi
 		PERROR("Failed removing DELETE callback after deletion");
 	}
 	close(fd);
-	thread->vnode_fd = -1;
+	slot->vnode_fd = -1;
 
 	/*
 	 *	Re-initialize the state machine.
@@ -445,18 +550,19 @@ static void mod_vnode_delete(fr_event_list_t *el, int fd, UNUSED int fflags, voi
 	 *	"move", which both deletes the old file, and creates
 	 *	the new one.
 	 */
-	work_init(thread);
+	work_init_slot(slot);
 }
 
 
-static void work_init(proto_detail_file_thread_t *thread)
+static void work_init_slot(proto_detail_file_slot_t *slot)
 {
+	proto_detail_file_thread_t *thread = slot->thread;
 	proto_detail_file_t const *inst = thread->inst;
 	int fd, rcode;
 	bool has_worker;
 
 	pthread_mutex_lock(&thread->worker_mutex);
-	has_worker = (thread->num_workers != 0);
+	has_worker = slot->busy;
 	pthread_mutex_unlock(&thread->worker_mutex);
 
 	/*
@@ -465,18 +571,18 @@ static void work_init(proto_detail_file_thread_t *thread)
 	 */
 	if (has_worker) {
 		DEBUG3("proto_detail (%s): worker %s is still alive, waiting for it to finish.",
-		       thread->name, inst->filename_work);
+		       thread->name, slot->filename_work);
 		goto delay;
 	}
 
-	fr_assert(thread->vnode_fd < 0);
+	fr_assert(slot->vnode_fd < 0);
 
 	/*
 	 *	See if there is a "detail.work" file.  If not, try to
 	 *	rename an existing file to "detail.work".
 	 */
-	DEBUG3("Trying to open %s", inst->filename_work);
-	fd = open(inst->filename_work, inst->mode);
+	DEBUG3("Trying to open %s", slot->filename_work);
+	fd = open(slot->filename_work, inst->mode);
 
 	/*
 	 *	If the work file didn't exist, try to rename detail* ->
@@ -485,13 +591,13 @@ static void work_init(proto_detail_file_thread_t *thread)
 	if (fd < 0) {
 		if (errno != ENOENT) {
 			DEBUG("proto_detail (%s): Failed opening %s: %s",
-			      thread->name, inst->filename_work,
+			      thread->name, slot->filename_work,
 			      fr_syserror(errno));
 			goto delay;
 		}
 
 retry:
-		fd = work_rename(thread);
+		fd = work_rename(slot);
 	}
 
 	/*
@@ -512,14 +618,14 @@ delay:
 		 */
 		DEBUG3("Waiting %d.000000s for new files in %s", inst->poll_interval, thread->name);
 
-		if (fr_event_timer_in(thread, thread->el, &thread->ev,
-				      fr_time_delta_from_sec(inst->poll_interval), work_retry_timer, thread) < 0) {
-			ERROR("Failed inserting poll timer for %s", inst->filename_work);
+		if (fr_event_timer_in(thread, thread->el, &slot->ev,
+				      fr_time_delta_from_sec(inst->poll_interval), work_retry_timer, slot) < 0) {
+			ERROR("Failed inserting poll timer for %s", slot->filename_work);
 		}
 		return;
 	}
 
-	thread->lock_interval = NSEC / 10;
+	slot->lock_interval = NSEC / 10;
 
 	/*
 	 *	It exists, go process it!
@@ -527,7 +633,7 @@ delay:
 	 *	We will get back to the main loop when the
 	 *	"detail.work" file is deleted.
 	 */
-	rcode = work_exists(thread, fd);
+	rcode = work_exists(slot, fd);
 	if (rcode < 0) goto delay;
 
 	/*
@@ -541,6 +647,16 @@ delay:
 	 */
 }
 
+/*
+ *	Start reading into each of the work files.
+ */
+static void work_init(proto_detail_file_thread_t *thread)
+{
+	uint32_t i;
+
+	for (i = 0; i < thread->num_slots; i++) work_init_slot(&thread->slots[i]);
+}
+
 
 /** Set the event list for a new IO instance
  *
@@ -568,7 +684,7 @@ static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, UNUSED void
 	 *	read it.
 	 */
 	if (fr_event_timer_in(thread, thread->el, &thread->ev,
-			      fr_time_delta_from_sec(1), work_retry_timer, thread) < 0) {
+			      fr_time_delta_from_sec(1), work_start_timer, thread) < 0) {
 		ERROR("Failed inserting poll timer for %s", thread->filename_work);
 	}
 }
@@ -626,6 +742,9 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 #endif
 	FR_INTEGER_BOUND_CHECK("poll_interval", inst->poll_interval, <=, 3600);
 
+	FR_INTEGER_BOUND_CHECK("work_files", inst->num_work_files, >=, 1);
+	FR_INTEGER_BOUND_CHECK("work_files", inst->num_work_files, <=, 64);
+
 	inst->parent = talloc_get_type_abort(dl_inst->parent->data, proto_detail_t);
 	inst->cs = cs;
 
@@ -655,6 +774,7 @@ static int mod_close(fr_listen_t *li)
 {
 	proto_detail_file_t const  *inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_file_t);
 	proto_detail_file_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_file_thread_t);
+	uint32_t		   i;
 
 	if (thread->nr) (void) fr_network_socket_delete(thread->nr, inst->parent->listen);
 
@@ -665,20 +785,24 @@ static int mod_close(fr_listen_t *li)
 	 */
 	close(thread->fd);
 
-	if (thread->vnode_fd >= 0) {
+	for (i = 0; i < thread->num_slots; i++) {
+		proto_detail_file_slot_t *slot = &thread->slots[i];
+
+		if (slot->vnode_fd < 0) continue;
+
 		if (thread->nr) {
 			(void) fr_network_socket_delete(thread->nr, inst->parent->listen);
 		} else {
-			if (fr_event_fd_delete(thread->el, thread->vnode_fd, FR_EVENT_FILTER_VNODE) < 0) {
+			if (fr_event_fd_delete(thread->el, slot->vnode_fd, FR_EVENT_FILTER_VNODE) < 0) {
 				PERROR("Failed removing DELETE callback on detach");
 			}
 		}
-		close(thread->vnode_fd);
-		thread->vnode_fd = -1;
-
-		pthread_mutex_destroy(&thread->worker_mutex);
+		close(slot->vnode_fd);
+		slot->vnode_fd = -1;
 	}
 
+	pthread_mutex_destroy(&thread->worker_mutex);
+
 	return 0;
 }
 
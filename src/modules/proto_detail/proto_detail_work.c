@@ -23,6 +23,7 @@
  * @copyright 2017 Alan DeKok (aland@deployingradius.com)
  */
 #include <netdb.h>
+#include <freeradius-devel/internal/detail.h>
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/io/base.h>
@@ -34,6 +35,7 @@
 #include "proto_detail.h"
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #ifndef NDEBUG
@@ -54,6 +56,8 @@
 typedef struct {
 	proto_detail_work_thread_t	*parent;		//!< talloc_parent is SLOW!
 	fr_time_t			timestamp;		//!< when we read the entry.
+	fr_time_t			sent;			//!< when we last gave the entry to a worker.
+	off_t				offset;			//!< where the entry starts in the file
 	off_t				done_offset;		//!< where we're tracking the status
 
 	int				id;			//!< for retransmission counters
@@ -64,8 +68,33 @@ typedef struct {
 	fr_retry_t			retry;			//!< our retry timers
 	fr_event_timer_t const		*ev;			//!< retransmission timer
 	fr_dlist_t			entry;			//!< for the retransmission list
+	fr_dlist_t			in_flight;		//!< for the list of outstanding entries
 } fr_detail_entry_t;
 
+/** Parse the date to start replaying binary detail files from
+ *
+ * @param[in] ctx	unused.
+ * @param[out] out	Where to write a fr_unix_time_t.
+ * @param[in] parent	unused.
+ * @param[in] ci	#CONF_PAIR specifying the date.
+ * @param[in] rule	unused.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int replay_from_parse(UNUSED TALLOC_CTX *ctx, void *out, UNUSED void *parent,
+			     CONF_ITEM *ci, UNUSED CONF_PARSER const *rule)
+{
+	char const *date_str = cf_pair_value(cf_item_to_pair(ci));
+
+	if (fr_unix_time_from_str((fr_unix_time_t *) out, date_str) < 0) {
+		cf_log_perr(ci, "Invalid date \"%s\"", date_str);
+		return -1;
+	}
+
+	return 0;
+}
+
 static CONF_PARSER limit_config[] = {
 	{ FR_CONF_OFFSET("initial_rtx_time", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.irt), .dflt = STRINGIFY(2) },
 	{ FR_CONF_OFFSET("max_rtx_time", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.mrt), .dflt = STRINGIFY(16) },
@@ -79,6 +108,7 @@ static CONF_PARSER limit_config[] = {
 	 */
 	{ FR_CONF_OFFSET("max_rtx_duration", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.mrd), .dflt = STRINGIFY(0) },
 	{ FR_CONF_OFFSET("maximum_outstanding", FR_TYPE_UINT32, proto_detail_work_t, max_outstanding), .dflt = STRINGIFY(1) },
+	{ FR_CONF_OFFSET("target_latency", FR_TYPE_TIME_DELTA, proto_detail_work_t, target_latency), .dflt = STRINGIFY(0) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -88,8 +118,12 @@ static const CONF_PARSER file_listen_config[] = {
 
 	{ FR_CONF_OFFSET("track", FR_TYPE_BOOL, proto_detail_work_t, track_progress ) },
 
+	{ FR_CONF_OFFSET("checkpoint_interval", FR_TYPE_UINT32, proto_detail_work_t, checkpoint_interval ), .dflt = "1000" },
+
 	{ FR_CONF_OFFSET("retransmit", FR_TYPE_BOOL, proto_detail_work_t, retransmit ), .dflt = "yes" },
 
+	{ FR_CONF_OFFSET("replay_from", FR_TYPE_VOID, proto_detail_work_t, replay_from ), .func = replay_from_parse },
+
 	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	CONF_PARSER_TERMINATOR
 };
@@ -144,6 +178,149 @@ static fr_event_update_t resume_read[] = {
 	{ 0 }
 };
 
+/** Read part of the work file, from the map if we can
+ *
+ */
+static ssize_t work_pread(proto_detail_work_thread_t *thread, uint8_t *buffer, size_t len, off_t offset)
+{
+	ssize_t slen;
+
+	if (thread->map && ((offset + len) <= thread->map_size)) {
+		memcpy(buffer, thread->map + offset, len);
+		return len;
+	}
+
+	do {
+		slen = pread(thread->fd, buffer, len, offset);
+	} while ((slen < 0) && (errno == EINTR));
+
+	return slen;
+}
+
+/** Read the next entry from a binary detail file
+ *
+ * The entries are length prefixed, so there's no need to search for the
+ * end of the entry, or to keep partial entries in the buffer.  Damaged
+ * entries are skipped by searching for the next sync marker.
+ */
+static ssize_t work_read_binary(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+				void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len,
+				uint32_t *priority)
+{
+	fr_detail_binary_t	hdr;
+	fr_detail_entry_t	*track;
+	ssize_t			slen, skip;
+	size_t			packet_len = 0;
+
+	fr_assert(buffer_len > FR_DETAIL_BINARY_HDR_LEN);
+
+	while (true) {
+		slen = work_pread(thread, buffer, FR_DETAIL_BINARY_HDR_LEN, thread->header_offset);
+		if (slen < 0) {
+		read_error:
+			ERROR("proto_detail (%s): Failed reading file %s: %s",
+			      thread->name, thread->filename_work, fr_syserror(errno));
+			return -1;
+		}
+
+		/*
+		 *	A partial entry at the end of the file is
+		 *	treated the same as EOF, as with text files.
+		 */
+		if (slen < FR_DETAIL_BINARY_HDR_LEN) break;
+
+		if (fr_detail_binary_hdr_decode(&hdr, buffer, slen) < 0) {
+			PWARN("proto_detail (%s): Invalid entry at offset %" PRIu64 " of file %s",
+			      thread->name, (uint64_t) thread->header_offset, thread->filename_work);
+			goto resync;
+		}
+
+		packet_len = FR_DETAIL_BINARY_HDR_LEN + hdr.length;
+		if ((packet_len > buffer_len) || (packet_len > inst->parent->max_packet_size)) {
+			DEBUG("Ignoring 'too large' entry at offset %zu of %s",
+			      (size_t) thread->header_offset, thread->filename_work);
+			DEBUG("Entry size %zu is greater than allowed maximum %u",
+			      packet_len, inst->parent->max_packet_size);
+			goto next;
+		}
+
+		slen = work_pread(thread, buffer + FR_DETAIL_BINARY_HDR_LEN, hdr.length,
+				  thread->header_offset + FR_DETAIL_BINARY_HDR_LEN);
+		if (slen < 0) goto read_error;
+		if ((size_t) slen < hdr.length) break;
+
+		if (fr_detail_binary_verify(buffer, packet_len) < 0) {
+			PWARN("proto_detail (%s): Damaged entry at offset %" PRIu64 " of file %s",
+			      thread->name, (uint64_t) thread->header_offset, thread->filename_work);
+			goto resync;
+		}
+
+		if (!(hdr.flags & FR_DETAIL_BINARY_FLAG_DONE) && (hdr.timestamp >= inst->replay_from)) goto found;
+
+	next:
+		thread->header_offset += packet_len;
+		continue;
+
+	resync:
+		slen = work_pread(thread, buffer, buffer_len, thread->header_offset + 1);
+		if (slen < 0) goto read_error;
+		if (slen < (ssize_t) sizeof(uint32_t)) break;
+
+		skip = fr_detail_binary_sync(buffer, slen);
+		if (skip < 0) {
+			thread->header_offset += slen - (sizeof(uint32_t) - 1);
+		} else {
+			thread->header_offset += skip + 1;
+		}
+	}
+
+	/*
+	 *	Nothing more to read.  Close the file now if there's
+	 *	nothing outstanding, otherwise when the last reply
+	 *	comes back.
+	 */
+	thread->read_offset = thread->header_offset;
+	(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
+	thread->eof = thread->closing = true;
+	MPRINT("AT EOF, outstanding %u", thread->outstanding);
+
+	return thread->outstanding ? 0 : -1;
+
+found:
+	track = talloc_zero(thread, fr_detail_entry_t);
+	track->parent = thread;
+	track->timestamp = track->sent = fr_time();
+	track->id = thread->count++;
+
+	track->offset = thread->header_offset;
+	track->done_offset = thread->header_offset + FR_DETAIL_BINARY_FLAGS_OFFSET;
+	fr_dlist_insert_tail(&thread->in_flight, track);
+	if (inst->retransmit) {
+		track->packet = talloc_memdup(track, buffer, packet_len);
+		track->packet_len = packet_len;
+	}
+
+	/*
+	 *	Keep the file offset in step, so that kqueue knows
+	 *	whether there's more to read.
+	 */
+	thread->header_offset += packet_len;
+	thread->read_offset = thread->header_offset;
+	(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
+	thread->outstanding++;
+
+	if (!thread->paused && (thread->outstanding >= thread->window)) {
+		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
+		thread->paused = true;
+	}
+
+	*packet_ctx = track;
+	*recv_time_p = track->timestamp;
+	*priority = inst->parent->priority;
+
+	return packet_len;
+}
+
 static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, UNUSED bool *is_dup)
 {
 	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
@@ -185,6 +362,7 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 		memcpy(buffer, track->packet, track->packet_len);
 
 		DEBUG("Retrying packet %d (retransmission %u)", track->id, track->retry.count);
+		track->sent = fr_time();
 		*packet_ctx = track;
 		*recv_time_p = track->timestamp;
 		*priority = inst->parent->priority;
@@ -206,11 +384,18 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 *	many packets.  So if we want to stop it from reading,
 	 *	we have to check this ourselves.
 	 */
-	if (thread->outstanding >= inst->max_outstanding) {
-		fr_assert(thread->paused);
+	if (thread->outstanding >= thread->window) {
+		if (!thread->paused) {
+			(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
+			thread->paused = true;
+		}
 		return 0;
 	}
 
+	if (thread->binary) {
+		return work_read_binary(inst, thread, packet_ctx, recv_time_p, buffer, buffer_len, priority);
+	}
+
 	/*
 	 *	If we've cached leftover data from the ring buffer,
 	 *	copy it back.
@@ -246,22 +431,37 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 
 		room = buffer_len - *leftover;
 
-		data_size = read(thread->fd, partial, room);
-		if (data_size < 0) {
-			ERROR("proto_detail (%s): Failed reading file %s: %s",
-			      thread->name, thread->filename_work, fr_syserror(errno));
-			return -1;
+		/*
+		 *	Copy from the mapped file if we can.  That
+		 *	avoids a system call for every buffer, and the
+		 *	kernel reads ahead of us.
+		 */
+		if (thread->map && (thread->read_offset < (off_t) thread->map_size)) {
+			data_size = thread->map_size - thread->read_offset;
+			if ((size_t) data_size > room) data_size = room;
+
+			memcpy(partial, thread->map + thread->read_offset, data_size);
+			thread->read_offset += data_size;
+
+		} else {
+			data_size = read(thread->fd, partial, room);
+			if (data_size < 0) {
+				ERROR("proto_detail (%s): Failed reading file %s: %s",
+				      thread->name, thread->filename_work, fr_syserror(errno));
+				return -1;
+			}
+
+			/*
+			 *	Remember the read offset.
+			 */
+			thread->read_offset = lseek(thread->fd, 0, SEEK_CUR);
 		}
 
 		MPRINT("GOT %zd bytes", data_size);
 
 		/*
-		 *	Remember the read offset, and whether we got EOF.
-		 */
-		thread->read_offset = lseek(thread->fd, 0, SEEK_CUR);
-
-		/*
-		 *	Only set EOF if there's no more data in the buffer to manage.
+		 *	Remember whether we got EOF.  Only set EOF if
+		 *	there's no more data in the buffer to manage.
 		 */
 		thread->eof = (data_size == 0) || (thread->read_offset == thread->file_size) || ((size_t) data_size < room);
 		if (thread->eof) {
@@ -297,10 +497,15 @@ redo:
 
 	p = buffer + thread->last_search;
 	while (p < end) {
-		if (p[0] != '\n') {
-			p++;
-			continue;
+		uint8_t *lf;
+
+		lf = memchr(p, '\n', end - p);
+		if (!lf) {
+			p = end;
+			break;
 		}
+		p = lf;
+
 		if ((p + 1) == end) {
 			/*
 			 *	Remember the last LF, so if the next
@@ -436,6 +641,8 @@ redo:
 	skip_record:
 		MPRINT("Skipping record");
 		if (next) {
+			thread->header_offset += (next - buffer);
+
 			memmove(buffer, next, (end - next));
 			data_size = (end - next);
 			*leftover = 0;
@@ -461,12 +668,7 @@ redo:
 	p = buffer;
 	done_offset = 0;
 
-	while (p < record_end) {
-		if (*p != '\0') {
-			p++;
-			continue;
-		}
-
+	while ((p = memchr(p, '\0', record_end - p)) != NULL) {
 		p++;
 		if (p == record_end) break;
 
@@ -487,10 +689,12 @@ redo:
 	 */
 	track = talloc_zero(thread, fr_detail_entry_t);
 	track->parent = thread;
-	track->timestamp = fr_time();
+	track->timestamp = track->sent = fr_time();
 	track->id = thread->count++;
 
+	track->offset = thread->header_offset;
 	track->done_offset = done_offset;
+	fr_dlist_insert_tail(&thread->in_flight, track);
 	if (inst->retransmit) {
 		track->packet = talloc_memdup(track, buffer, packet_len);
 		track->packet_len = packet_len;
@@ -520,7 +724,7 @@ done:
 	/*
 	 *	Pause reading until such time as we need more packets.
 	 */
-	if (!thread->paused && (thread->outstanding >= inst->max_outstanding)) {
+	if (!thread->paused && (thread->outstanding >= thread->window)) {
 		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
 		thread->paused = true;
 
@@ -541,6 +745,123 @@ done:
 }
 
 
+/** Record how far through the file every entry has been processed
+ *
+ * Everything before the oldest outstanding entry is done, so a restarted
+ * server can start reading from there, instead of from the start of the
+ * file.
+ */
+static void work_checkpoint(proto_detail_work_thread_t *thread)
+{
+	fr_detail_entry_t	*oldest;
+	struct stat		st;
+	char			buffer[64];
+	off_t			offset;
+	int			len;
+
+	oldest = fr_dlist_head(&thread->in_flight);
+	offset = oldest ? oldest->offset : thread->header_offset;
+
+	if (fstat(thread->fd, &st) < 0) return;
+
+	if (thread->progress_fd < 0) {
+		thread->progress_fd = open(thread->filename_progress, O_WRONLY | O_CREAT, 0600);
+		if (thread->progress_fd < 0) {
+			ERROR("proto_detail (%s): Failed opening %s: %s",
+			      thread->name, thread->filename_progress, fr_syserror(errno));
+			return;
+		}
+	}
+
+	/*
+	 *	Fixed width, so that each checkpoint completely
+	 *	over-writes the previous one.
+	 */
+	len = snprintf(buffer, sizeof(buffer), "%020" PRIu64 " %020" PRIu64 "\n",
+		       (uint64_t) st.st_ino, (uint64_t) offset);
+	if (pwrite(thread->progress_fd, buffer, len, 0) < 0) {
+		ERROR("proto_detail (%s): Failed writing %s: %s",
+		      thread->name, thread->filename_progress, fr_syserror(errno));
+		return;
+	}
+
+	MPRINT("CHECKPOINT at offset %ld", (long) offset);
+}
+
+/** Start reading from the last checkpoint, if there is one
+ *
+ */
+static void work_resume(proto_detail_work_thread_t *thread, struct stat const *st)
+{
+	char		buffer[64];
+	char		*p;
+	ssize_t		len;
+	uint64_t	ino, offset;
+	int		fd;
+
+	fd = open(thread->filename_progress, O_RDONLY);
+	if (fd < 0) return;
+
+	len = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (len <= 0) goto stale;
+	buffer[len] = '\0';
+
+	ino = strtoull(buffer, &p, 10);
+	if (*p != ' ') goto stale;
+	offset = strtoull(p + 1, &p, 10);
+	if (*p != '\n') goto stale;
+
+	/*
+	 *	The checkpoint is for a different file, which was
+	 *	finished before the server stopped.
+	 */
+	if ((ino != (uint64_t) st->st_ino) || (offset > (uint64_t) st->st_size)) {
+	stale:
+		DEBUG("proto_detail (%s): Ignoring stale checkpoint %s", thread->name, thread->filename_progress);
+		unlink(thread->filename_progress);
+		return;
+	}
+
+	DEBUG("proto_detail (%s): Resuming at offset %" PRIu64 " of %" PRIu64,
+	      thread->name, offset, (uint64_t) st->st_size);
+
+	thread->read_offset = thread->header_offset = offset;
+}
+
+/** Adjust how many entries we read ahead, based on how busy the workers are
+ *
+ * Entries which take longer than target_latency are waiting behind other
+ * work, so we halve the number of outstanding entries.  Otherwise we allow
+ * one more outstanding entry for each window's worth which complete, up to
+ * maximum_outstanding.
+ */
+static void work_pace(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+		      fr_detail_entry_t const *track)
+{
+	if (!inst->target_latency) return;
+
+	if ((fr_time() - track->sent) > inst->target_latency) {
+		/*
+		 *	Entries read before the last decrease were
+		 *	queued behind a larger window, so ignore them.
+		 */
+		if (track->id < thread->window_mark) return;
+
+		if (thread->window > 1) thread->window /= 2;
+		thread->window_acked = 0;
+		thread->window_mark = thread->count;
+
+		MPRINT("BACKLOG - window is now %u", thread->window);
+		return;
+	}
+
+	if (++thread->window_acked < thread->window) return;
+
+	thread->window_acked = 0;
+	if (thread->window < inst->max_outstanding) thread->window++;
+}
+
 static void work_retransmit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
 {
 	fr_detail_entry_t		*track = talloc_get_type_abort(uctx, fr_detail_entry_t);
@@ -551,7 +872,7 @@ static void work_retransmit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, vo
 
 	fr_dlist_insert_tail(&thread->list, track);
 
-	if (thread->paused && (thread->outstanding < thread->inst->max_outstanding)) {
+	if (thread->paused && (thread->outstanding < thread->window)) {
 		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, resume_read);
 		thread->paused = false;
 	}
@@ -617,7 +938,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 			goto free_track;
 		}
 
-		if (!thread->paused && (thread->outstanding >= inst->max_outstanding)) {
+		if (!thread->paused && (thread->outstanding >= thread->window)) {
 			(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
 			thread->paused = true;
 		}
@@ -631,19 +952,33 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 		 *	the point in the file where we were reading from.
 		 */
 		(void) lseek(thread->fd, track->done_offset, SEEK_SET);
-		if (write(thread->fd, "Done", 4) < 0) {
+		if (thread->binary) {
+			uint8_t flags = FR_DETAIL_BINARY_FLAG_DONE;
+
+			if (write(thread->fd, &flags, sizeof(flags)) < 0) goto done_error;
+
+		} else if (write(thread->fd, "Done", 4) < 0) {
+		done_error:
 			ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
 		}
 		(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
 	}
 
 free_track:
+	fr_dlist_remove(&thread->in_flight, track);
+	work_pace(inst, thread, track);
 	thread->outstanding--;
 
+	if (inst->track_progress && inst->checkpoint_interval &&
+	    (++thread->since_checkpoint >= inst->checkpoint_interval)) {
+		thread->since_checkpoint = 0;
+		work_checkpoint(thread);
+	}
+
 	/*
 	 *	If we need to read some more packet, let's do so.
 	 */
-	if (thread->paused && (thread->outstanding < inst->max_outstanding)) {
+	if (thread->paused && (thread->outstanding < thread->window)) {
 		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, resume_read);
 		thread->paused = false;
 
@@ -681,7 +1016,12 @@ static int mod_open(fr_listen_t *li)
 	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
 	proto_detail_work_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_detail_work_thread_t);
 
+	struct stat			buf;
+
 	fr_dlist_init(&thread->list, fr_detail_entry_t, entry);
+	fr_dlist_init(&thread->in_flight, fr_detail_entry_t, in_flight);
+	thread->window = inst->max_outstanding;
+	thread->progress_fd = -1;
 
 	/*
 	 *	Open the file if we haven't already been given one.
@@ -696,17 +1036,15 @@ static int mod_open(fr_listen_t *li)
 		}
 	}
 
+	if (fstat(thread->fd, &buf) < 0) {
+		cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
+		return -1;
+	}
+
 	/*
 	 *	If we're tracking progress, learn where the EOF is.
 	 */
 	if (inst->track_progress) {
-		struct stat buf;
-
-		if (fstat(thread->fd, &buf) < 0) {
-			cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
-			return -1;
-		}
-
 		thread->file_size = buf.st_size;
 	} else {
 		/*
@@ -719,6 +1057,59 @@ static int mod_open(fr_listen_t *li)
 	fr_assert(thread->filename_work != NULL);
 	thread->name = talloc_typed_asprintf(thread, "detail_work from filename %s", thread->filename_work);
 
+	/*
+	 *	Map the file, so that reading it doesn't need a
+	 *	system call for every buffer.  If that fails, we just
+	 *	read() it instead.
+	 */
+	if ((buf.st_size > 0) && ((uint64_t) buf.st_size <= SIZE_MAX)) {
+		void *map;
+
+		map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, thread->fd, 0);
+		if (map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+			(void) madvise(map, buf.st_size, MADV_SEQUENTIAL);
+#endif
+			thread->map = map;
+			thread->map_size = buf.st_size;
+		}
+	}
+
+	if (buf.st_size >= (off_t) sizeof(uint32_t)) {
+		uint8_t magic[sizeof(uint32_t)];
+
+		if (work_pread(thread, magic, sizeof(magic), 0) == sizeof(magic)) {
+			thread->binary = fr_detail_binary_is_binary(magic, sizeof(magic));
+		}
+	}
+
+	/*
+	 *	Skip the entries we finished before the server was
+	 *	restarted.
+	 */
+	if (inst->track_progress) {
+		thread->filename_progress = talloc_typed_asprintf(thread, "%s.progress", thread->filename_work);
+		work_resume(thread, &buf);
+	}
+
+	/*
+	 *	Use the index to skip most of the entries which are
+	 *	too old.  work_read_binary() skips the rest.
+	 */
+	if (thread->binary && inst->replay_from) {
+		off_t offset;
+
+		offset = fr_detail_index_find(thread->filename_work, &buf, inst->replay_from);
+		if (offset < 0) {
+			DEBUG("proto_detail (%s): Not using index - %s", thread->name, fr_strerror());
+
+		} else if (offset > thread->header_offset) {
+			DEBUG("proto_detail (%s): Index says to start at offset %" PRIu64 " of %" PRIu64,
+			      thread->name, (uint64_t) offset, (uint64_t) buf.st_size);
+			thread->read_offset = thread->header_offset = offset;
+		}
+	}
+
 	return 0;
 }
 
@@ -733,6 +1124,7 @@ static int mod_close_internal(proto_detail_work_thread_t *thread)
 	if (thread->file_parent) {
 		pthread_mutex_lock(&thread->file_parent->worker_mutex);
 		if (thread->file_parent->num_workers > 0) thread->file_parent->num_workers--;
+		if (thread->file_slot) thread->file_slot->busy = false;
 		pthread_mutex_unlock(&thread->file_parent->worker_mutex);
 	}
 
@@ -743,6 +1135,29 @@ static int mod_close_internal(proto_detail_work_thread_t *thread)
 #endif
 	fr_event_fd_delete(thread->el, thread->fd, FR_EVENT_FILTER_IO);
 
+	if (thread->map) {
+		(void) munmap(thread->map, thread->map_size);
+		thread->map = NULL;
+	}
+
+	/*
+	 *	Remove the checkpoint first, so that it can't be
+	 *	applied to a different file.
+	 */
+	if (thread->progress_fd >= 0) {
+		close(thread->progress_fd);
+		thread->progress_fd = -1;
+	}
+	if (thread->filename_progress) unlink(thread->filename_progress);
+
+	if (thread->binary) {
+		char *filename_index;
+
+		filename_index = fr_detail_index_name(thread, thread->filename_work);
+		unlink(filename_index);
+		talloc_free(filename_index);
+	}
+
 	unlink(thread->filename_work);
 
 	close(thread->fd);
@@ -878,6 +1293,8 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, >=, 1);
 	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, <=, 256);
 
+	FR_TIME_DELTA_BOUND_CHECK("limit.target_latency", inst->target_latency, <=, fr_time_delta_from_sec(60));
+
 	return 0;
 }
 
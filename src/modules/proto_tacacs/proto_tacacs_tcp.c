@@ -109,55 +109,72 @@ static const char *packet_name[] = {
 	[FR_TAC_PLUS_ACCT] = "Accounting",
 };
 
-static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, UNUSED fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover, UNUSED uint32_t *priority, UNUSED bool *is_dup)
+static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover, UNUSED uint32_t *priority, UNUSED bool *is_dup)
 {
 	// proto_tacacs_tcp_t const       	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_tacacs_tcp_t);
 	proto_tacacs_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_tacacs_tcp_thread_t);
-	ssize_t				data_size;
-	size_t				packet_len, in_buffer;
-
-	/*
-	 *      Read data into the buffer.
-	 */
-	data_size = read(thread->sockfd, buffer + *leftover, buffer_len - *leftover);
-	if (data_size < 0) {
-		PDEBUG2("proto_tacacs_tcp got read error %zd", data_size);
-		return data_size;
-	}
+	ssize_t				data_size, packet_len;
+	size_t				in_buffer = *leftover;
 
 	/*
 	 *	Note that we return ERROR for all bad packets, as
 	 *	there's no point in reading TACACS+ packets from a TCP
 	 *	connection which isn't sending us TACACS+ packets.
 	 */
+	packet_len = fr_tacacs_length(buffer, in_buffer);
+	if (packet_len < 0) goto invalid;
 
 	/*
-	 *	TCP read of zero means the socket is dead.
+	 *	In single-connect mode the client can send packets for
+	 *	many sessions without waiting for the replies.  So a
+	 *	previous read may have left complete packets in the
+	 *	buffer.  We only read more data if we need it, as the
+	 *	socket may have nothing more for us.
 	 */
-	if (!data_size) {
-		DEBUG2("proto_tacacs_tcp - other side closed the socket.");
-		return -1;
-	}
+	if (in_buffer < (size_t) packet_len) {
+		data_size = read(thread->sockfd, buffer + in_buffer, buffer_len - in_buffer);
+		if (data_size < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
 
-	in_buffer = *leftover + data_size;
+			PDEBUG2("proto_tacacs_tcp got read error %zd", data_size);
+			return data_size;
+		}
 
-	/*
-	 *	We don't have a complete TACACS+ packet.  Tell the
-	 *	caller that we need to read more.
-	 */
-	packet_len = fr_tacacs_length(buffer, in_buffer);
-	if (in_buffer < packet_len) {
-		*leftover = in_buffer;
-		return 0;
+		/*
+		 *	TCP read of zero means the socket is dead.
+		 */
+		if (!data_size) {
+			DEBUG2("proto_tacacs_tcp - other side closed the socket.");
+			return -1;
+		}
+
+		in_buffer += data_size;
+
+		packet_len = fr_tacacs_length(buffer, in_buffer);
+		if (packet_len < 0) goto invalid;
+
+		/*
+		 *	We don't have a complete TACACS+ packet.  Tell
+		 *	the caller that we need to read more.
+		 */
+		if (in_buffer < (size_t) packet_len) {
+			if ((size_t) packet_len > buffer_len) {
+				fr_strerror_printf("Packet is larger than our buffer (%zu > %zu)",
+						   (size_t) packet_len, buffer_len);
+				goto invalid;
+			}
+
+			*leftover = in_buffer;
+			return 0;
+		}
 	}
 
 	/*
-	 *	We've read more than one packet.  Tell the caller that
-	 *	there's more data available, and return only one packet.
+	 *	Tell the caller how much of the buffer is left over
+	 *	after this packet.  If it's more than zero, there's
+	 *	more data available, and we return only one packet.
 	 */
-	if (in_buffer > packet_len) {
-		*leftover = in_buffer - packet_len;
-	}
+	*leftover = in_buffer - packet_len;
 
 	*recv_time_p = fr_time();
 	thread->stats.total_requests++;
@@ -187,6 +204,11 @@ static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, UNUSED fr_tim
 	       (int) packet_len, thread->name);
 
 	return packet_len;
+
+invalid:
+	PDEBUG("proto_tacacs_tcp - Invalid packet from %s", thread->name);
+	thread->stats.total_malformed_requests++;
+	return -1;
 }
 
 static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, UNUSED fr_time_t request_time,
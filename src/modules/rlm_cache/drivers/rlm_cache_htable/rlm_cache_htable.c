@@ -0,0 +1,550 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_htable.c
+ * @brief Sharded, lock striped hash table based cache.
+ *
+ * Entries are distributed over a power of two number of shards using the
+ * high bits of the key hash.  Each shard has its own mutex, hash table,
+ * LRU list and timer wheel, so workers only contend with each other when
+ * they operate on keys which map to the same shard.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/debug.h>
+#include "../../rlm_cache.h"
+
+#define CACHE_LINE_SIZE	64
+
+/** A single shard of the cache
+ *
+ * Everything in here is protected by the shard's mutex.
+ */
+typedef struct CC_HINT(aligned(CACHE_LINE_SIZE)) {
+	pthread_mutex_t		mutex;		//!< Protects all fields of the shard.
+
+	fr_hash_table_t		*cache;		//!< Hash table for looking up cache keys.
+	fr_dlist_head_t		lru;		//!< Entries ordered by last access, most recent at the head.
+	fr_dlist_head_t		*wheel;		//!< Timer wheel slots, indexed by expiry second.
+
+	uint64_t		reaped;		//!< The second up to which the wheel has been reaped.
+	uint32_t		num_entries;	//!< Number of entries in this shard.
+
+	uint64_t		hits;		//!< Lookups which found an entry.
+	uint64_t		misses;		//!< Lookups which didn't find an entry.
+	uint64_t		evicted;	//!< Entries removed because the shard was full.
+	uint64_t		expired;	//!< Entries removed by the timer wheel.
+} rlm_cache_htable_shard_t;
+
+typedef struct {
+	uint32_t		num_shards;	//!< Number of shards (rounded up to a power of 2).
+	uint32_t		wheel_slots;	//!< Number of one second slots in each timer wheel.
+
+	uint32_t		shard_bits;	//!< log2(num_shards).
+
+	rlm_cache_htable_shard_t *shards;	//!< Array of shards.
+	uint32_t		shards_init;	//!< Number of shards which were fully initialised,
+						///< and must have their mutexes destroyed.
+} rlm_cache_htable_t;
+
+typedef struct {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+
+	uint32_t		hash;		//!< Hash of the key, selects the shard and bucket.
+	fr_dlist_t		lru_entry;	//!< Entry in the shard's LRU list.
+	fr_dlist_t		wheel_entry;	//!< Entry in one of the shard's timer wheel slots.
+	fr_dlist_head_t		*slot;		//!< Timer wheel slot the entry is currently in.
+} rlm_cache_htable_entry_t;
+
+/** Tracks which shard (if any) a request currently has locked
+ *
+ * Entries returned by find are only valid while the shard they belong to
+ * remains locked, so the lock is held until the handle is released.
+ */
+typedef struct {
+	rlm_cache_htable_t	*driver;
+	rlm_cache_htable_shard_t *shard;	//!< Locked shard, or NULL.
+} rlm_cache_htable_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", FR_TYPE_UINT32, rlm_cache_htable_t, num_shards), .dflt = "64" },
+	{ FR_CONF_OFFSET("wheel_slots", FR_TYPE_UINT32, rlm_cache_htable_t, wheel_slots), .dflt = "256" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Return the precomputed hash of an entry
+ *
+ */
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_htable_entry_t const *c = data;
+
+	return c->hash;
+}
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Map a key hash to a shard
+ *
+ * Uses the high bits of the hash, as the hash table uses the low bits
+ * to select buckets.
+ */
+static inline CC_HINT(always_inline) rlm_cache_htable_shard_t *cache_shard(rlm_cache_htable_t *driver, uint32_t hash)
+{
+	if (driver->shard_bits == 0) return &driver->shards[0];
+
+	return &driver->shards[hash >> (32 - driver->shard_bits)];
+}
+
+/** Lock the shard a key maps to, recording it in the handle
+ *
+ */
+static rlm_cache_htable_shard_t *cache_shard_lock(rlm_cache_htable_handle_t *handle, uint32_t hash)
+{
+	rlm_cache_htable_shard_t *shard = cache_shard(handle->driver, hash);
+
+	if (handle->shard == shard) return shard;
+
+	/*
+	 *	rlm_cache only ever operates on a single key
+	 *	between acquire and release, but be defensive.
+	 */
+	if (handle->shard) pthread_mutex_unlock(&handle->shard->mutex);
+
+	pthread_mutex_lock(&shard->mutex);
+	handle->shard = shard;
+
+	return shard;
+}
+
+/** Remove an entry from all the structures of a shard and free it
+ *
+ */
+static void cache_entry_remove(rlm_cache_htable_shard_t *shard, rlm_cache_htable_entry_t *c)
+{
+	fr_hash_table_yank(shard->cache, c);
+	fr_dlist_remove(&shard->lru, c);
+	fr_dlist_remove(c->slot, c);
+	shard->num_entries--;
+
+	talloc_free(c);
+}
+
+/** Insert an entry into the timer wheel slot matching its expiry time
+ *
+ */
+static inline void cache_entry_wheel_insert(rlm_cache_htable_t *driver, rlm_cache_htable_shard_t *shard,
+					    rlm_cache_htable_entry_t *c)
+{
+	c->slot = &shard->wheel[fr_unix_time_to_sec(c->fields.expires) % driver->wheel_slots];
+	fr_dlist_insert_tail(c->slot, c);
+}
+
+/** Remove expired entries from any wheel slots which have elapsed
+ *
+ * Only slots for seconds which have completely passed are processed, and
+ * each slot is visited at most once per call.  Entries in a slot which
+ * belong to a later rotation of the wheel are left where they are.
+ */
+static void cache_shard_reap(rlm_cache_htable_t *driver, rlm_cache_htable_shard_t *shard, fr_unix_time_t now)
+{
+	uint64_t	now_sec = fr_unix_time_to_sec(now);
+	uint64_t	sec;
+	uint32_t	visited;
+
+	if (shard->reaped == 0) {
+		shard->reaped = now_sec;
+		return;
+	}
+
+	for (sec = shard->reaped, visited = 0;
+	     (sec < now_sec) && (visited < driver->wheel_slots);
+	     sec++, visited++) {
+		fr_dlist_head_t			*slot = &shard->wheel[sec % driver->wheel_slots];
+		rlm_cache_htable_entry_t	*c, *next;
+
+		for (c = fr_dlist_head(slot); c; c = next) {
+			next = fr_dlist_next(slot, c);
+
+			if (c->fields.expires >= now) continue;
+
+			cache_entry_remove(shard, c);
+			shard->expired++;
+		}
+	}
+
+	shard->reaped = now_sec;
+}
+
+/** Cleanup a cache_htable instance
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_htable_t	*driver = talloc_get_type_abort(instance, rlm_cache_htable_t);
+	uint32_t		i;
+
+	for (i = 0; i < driver->shards_init; i++) {
+		rlm_cache_htable_shard_t	*shard = &driver->shards[i];
+		rlm_cache_htable_entry_t	*c;
+
+		DEBUG3("Shard %u - entries %u, hits %" PRIu64 ", misses %" PRIu64 ", evicted %" PRIu64
+		       ", expired %" PRIu64, i, shard->num_entries, shard->hits, shard->misses,
+		       shard->evicted, shard->expired);
+
+		while ((c = fr_dlist_head(&shard->lru))) cache_entry_remove(shard, c);
+
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	return 0;
+}
+
+/** Create a new cache_htable instance
+ *
+ * @param instance	A uint8_t array of inst_size if inst_size > 0, else NULL,
+ *			this should contain the result of parsing the driver's
+ *			CONF_PARSER array that it specified in the interface struct.
+ * @param conf		section holding driver specific #CONF_PAIR (s).
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+{
+	rlm_cache_htable_t	*driver = talloc_get_type_abort(instance, rlm_cache_htable_t);
+	uint32_t		i, j;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 4096);
+	FR_INTEGER_BOUND_CHECK("wheel_slots", driver->wheel_slots, >=, 8);
+	FR_INTEGER_BOUND_CHECK("wheel_slots", driver->wheel_slots, <=, 65536);
+
+	/*
+	 *	Round the number of shards up to a power of 2
+	 */
+	while ((1U << driver->shard_bits) < driver->num_shards) driver->shard_bits++;
+	driver->num_shards = 1U << driver->shard_bits;
+
+	driver->shards = talloc_zero_array(driver, rlm_cache_htable_shard_t, driver->num_shards);
+	if (!driver->shards) {
+		ERROR("Failed allocating cache shards");
+		return -1;
+	}
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_htable_shard_t *shard = &driver->shards[i];
+
+		shard->cache = fr_hash_table_create(driver->shards, cache_entry_hash, cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+
+		shard->wheel = talloc_array(driver->shards, fr_dlist_head_t, driver->wheel_slots);
+		if (!shard->wheel) {
+			ERROR("Failed to create timer wheel for the cache");
+			return -1;
+		}
+		for (j = 0; j < driver->wheel_slots; j++) {
+			fr_dlist_init(&shard->wheel[j], rlm_cache_htable_entry_t, wheel_entry);
+		}
+
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		fr_dlist_init(&shard->lru, rlm_cache_htable_entry_t, lru_entry);
+		driver->shards_init++;
+	}
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    request_t *request)
+{
+	rlm_cache_htable_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_htable_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * Locks the shard the key belongs to.  The shard stays locked until the
+ * handle is released.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       rlm_cache_config_t const *config, void *instance,
+				       request_t *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_htable_t		*driver = talloc_get_type_abort(instance, rlm_cache_htable_t);
+	rlm_cache_htable_shard_t	*shard;
+	rlm_cache_htable_entry_t	*c, find;
+
+	find.fields.key = key;
+	find.fields.key_len = key_len;
+	find.hash = fr_hash(key, key_len);
+
+	shard = cache_shard_lock(handle, find.hash);
+
+	/*
+	 *	Clear out old entries
+	 */
+	cache_shard_reap(driver, shard, fr_time_to_unix_time(request->packet->timestamp));
+
+	/*
+	 *	Is there an entry for this key?
+	 */
+	c = fr_hash_table_find_by_key(shard->cache, find.hash, &find);
+	if (!c) {
+		shard->misses++;
+		*out = NULL;
+		return CACHE_MISS;
+	}
+	shard->hits++;
+
+	/*
+	 *	Move to the front of the LRU list
+	 */
+	fr_dlist_remove(&shard->lru, c);
+	fr_dlist_insert_head(&shard->lru, c);
+
+	if (config->stats) {
+		RDEBUG3("Shard %u - entries %u, hits %" PRIu64 ", misses %" PRIu64 ", evicted %" PRIu64
+			", expired %" PRIu64, (unsigned int)(shard - driver->shards), shard->num_entries,
+			shard->hits, shard->misses, shard->evicted, shard->expired);
+	}
+
+	*out = &c->fields;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					 request_t *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_htable_shard_t	*shard;
+	rlm_cache_htable_entry_t	*c, find;
+
+	if (!request) return CACHE_ERROR;
+
+	find.fields.key = key;
+	find.fields.key_len = key_len;
+	find.hash = fr_hash(key, key_len);
+
+	shard = cache_shard_lock(handle, find.hash);
+
+	c = fr_hash_table_find_by_key(shard->cache, find.hash, &find);
+	if (!c) return CACHE_MISS;
+
+	cache_entry_remove(shard, c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * If the shard is full, the least recently used entry is evicted.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *instance,
+					 request_t *request, void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_htable_t		*driver = talloc_get_type_abort(instance, rlm_cache_htable_t);
+	rlm_cache_htable_shard_t	*shard;
+	rlm_cache_htable_entry_t	*my_c, *old;
+	uint32_t			max_entries = 0;
+
+	if (!request) return CACHE_ERROR;
+
+	memcpy(&my_c, &c, sizeof(my_c));
+	my_c->hash = fr_hash(c->key, c->key_len);
+
+	shard = cache_shard_lock(handle, my_c->hash);
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = fr_hash_table_find_by_key(shard->cache, my_c->hash, my_c);
+	if (old) {
+		if (old == my_c) return CACHE_OK;
+		cache_entry_remove(shard, old);
+	}
+
+	/*
+	 *	max_entries applies to the whole cache, we enforce
+	 *	it per shard to avoid a global counter.  Make space
+	 *	by evicting the least recently used entry.
+	 */
+	if (config->max_entries > 0) {
+		max_entries = (config->max_entries + (driver->num_shards - 1)) >> driver->shard_bits;
+	}
+	if (max_entries && (shard->num_entries >= max_entries)) {
+		old = fr_dlist_tail(&shard->lru);
+		if (old) {
+			RDEBUG3("Shard full, evicting least recently used entry");
+			cache_entry_remove(shard, old);
+			shard->evicted++;
+		}
+	}
+
+	if (!fr_hash_table_insert(shard->cache, my_c)) {
+		RERROR("Failed adding entry");
+		return CACHE_ERROR;
+	}
+
+	fr_dlist_insert_head(&shard->lru, my_c);
+	cache_entry_wheel_insert(driver, shard, my_c);
+	shard->num_entries++;
+
+	if (config->stats) {
+		RDEBUG3("Shard %u - entries %u", (unsigned int)(shard - driver->shards), shard->num_entries);
+	}
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * The entry is moved to the timer wheel slot matching its new expiry time.
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *instance,
+					  request_t *request, void *handle,
+					  rlm_cache_entry_t *c)
+{
+	rlm_cache_htable_t		*driver = talloc_get_type_abort(instance, rlm_cache_htable_t);
+	rlm_cache_htable_entry_t	*my_c = (rlm_cache_htable_entry_t *)c;
+	rlm_cache_htable_shard_t	*shard;
+
+#ifdef NDEBUG
+	if (!request) return CACHE_ERROR;
+#endif
+
+	shard = cache_shard_lock(handle, my_c->hash);
+
+	if (!fr_cond_assert(my_c->slot)) {
+		RERROR("Entry not in timer wheel");
+		return CACHE_ERROR;
+	}
+
+	fr_dlist_remove(my_c->slot, my_c);
+	cache_entry_wheel_insert(driver, shard, my_c);
+
+	return CACHE_OK;
+}
+
+/** Allocate a handle to track which shard is locked
+ *
+ * No locks are acquired here, as we don't know the key yet.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, void *instance,
+			 request_t *request)
+{
+	rlm_cache_htable_t		*driver = talloc_get_type_abort(instance, rlm_cache_htable_t);
+	rlm_cache_htable_handle_t	*h;
+
+	MEM(h = talloc_zero(request, rlm_cache_htable_handle_t));
+	h->driver = driver;
+
+	*handle = h;
+
+	return 0;
+}
+
+/** Release the handle, unlocking any shard we locked
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, request_t *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_htable_handle_t *h = talloc_get_type_abort(handle, rlm_cache_htable_handle_t);
+
+	if (h->shard) {
+		pthread_mutex_unlock(&h->shard->mutex);
+		RDEBUG3("Shard %u mutex released", (unsigned int)(h->shard - h->driver->shards));
+	}
+
+	talloc_free(h);
+}
+
+/*
+ *	No count callback, max_entries is enforced per shard
+ *	by evicting the least recently used entry on insert.
+ */
+extern rlm_cache_driver_t rlm_cache_htable;
+rlm_cache_driver_t rlm_cache_htable = {
+	.name		= "rlm_cache_htable",
+	.magic		= RLM_MODULE_INIT,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_htable_t),
+	.config		= driver_config,
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
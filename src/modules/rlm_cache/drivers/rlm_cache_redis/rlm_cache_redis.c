@@ -25,10 +25,17 @@
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/syserror.h>
 
 #include "../../rlm_cache.h"
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+
+#include <poll.h>
+
+#define SUBSCRIBE_TIMEOUT	(NSEC)		//!< Connection timeout for the notification connection.
+#define SUBSCRIBE_RETRY_DELAY	(NSEC)		//!< Delay between notification reconnection attempts.
+
 static CONF_PARSER driver_config[] = {
 	REDIS_COMMON_CONFIG,
 	CONF_PARSER_TERMINATOR
@@ -42,6 +49,12 @@ typedef struct {
 	tmpl_t		*expires_attr;	//!< LHS of the Cache-Expires map.
 
 	fr_redis_cluster_t	*cluster;
+
+	pthread_t		sub_thread;	//!< Thread receiving keyspace notifications.
+	bool			sub_running;	//!< Whether sub_thread was started.
+	atomic_bool		sub_stop;	//!< Tells sub_thread to exit.
+	cache_invalidate_t	invalidate;	//!< Called for each key changed.
+	void			*uctx;		//!< Passed to invalidate.
 } rlm_cache_redis_t;
 
 static fr_dict_t const *dict_freeradius;
@@ -110,6 +123,158 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Connect to the first configured server, and subscribe to keyspace notifications
+ *
+ */
+static redisContext *cache_subscribe_connect(rlm_cache_redis_t *driver, char const *pattern)
+{
+	redisContext	*handle;
+	redisReply	*reply;
+	fr_ipaddr_t	ipaddr;
+	uint16_t	port;
+	char		host[FR_IPADDR_STRLEN];
+
+	if (fr_inet_pton_port(&ipaddr, &port, driver->conf.hostname[0], -1, AF_UNSPEC, true, true) < 0) {
+		PERROR("Failed resolving server \"%s\"", driver->conf.hostname[0]);
+		return NULL;
+	}
+	if (!port) port = driver->conf.port;
+	fr_inet_ntop(host, sizeof(host), &ipaddr);
+
+	handle = redisConnectWithTimeout(host, port, fr_time_delta_to_timeval(SUBSCRIBE_TIMEOUT));
+	if (!handle || handle->err) {
+		ERROR("Notification connection to %s:%u failed: %s", host, port, handle ? handle->errstr : "unknown");
+		if (handle) redisFree(handle);
+		return NULL;
+	}
+
+	if (driver->conf.password) {
+		reply = redisCommand(handle, "AUTH %s", driver->conf.password);
+		if (!reply || (reply->type == REDIS_REPLY_ERROR)) {
+			ERROR("Failed authenticating notification connection");
+		error:
+			if (reply) freeReplyObject(reply);
+			redisFree(handle);
+			return NULL;
+		}
+		freeReplyObject(reply);
+	}
+
+	reply = redisCommand(handle, "PSUBSCRIBE %s", pattern);
+	if (!reply || (reply->type == REDIS_REPLY_ERROR)) {
+		ERROR("Failed subscribing to \"%s\"", pattern);
+		goto error;
+	}
+	freeReplyObject(reply);
+
+	DEBUG2("Subscribed to \"%s\" on %s:%u", pattern, host, port);
+
+	return handle;
+}
+
+/** Receive keyspace notifications, and pass the keys to rlm_cache
+ *
+ * Notifications are of the form `__keyspace@<db>__:<key>`, and require
+ * the server to be configured with `notify-keyspace-events` including
+ * `K` and the classes of command that modify cache entries (e.g. `Kgl`).
+ */
+static void *cache_subscribe_thread(void *arg)
+{
+	rlm_cache_redis_t	*driver = arg;
+	char			pattern[64];
+	size_t			prefix_len;
+
+	prefix_len = snprintf(pattern, sizeof(pattern), "__keyspace@%u__:", driver->conf.database);
+	strlcpy(pattern + prefix_len, "*", sizeof(pattern) - prefix_len);
+
+	while (!atomic_load_explicit(&driver->sub_stop, memory_order_acquire)) {
+		redisContext	*handle;
+		redisReply	*reply;
+
+		handle = cache_subscribe_connect(driver, pattern);
+		if (!handle) {
+			struct timespec delay = fr_time_delta_to_timespec(SUBSCRIBE_RETRY_DELAY);
+
+			nanosleep(&delay, NULL);
+			continue;
+		}
+
+		/*
+		 *	Poll so that we notice when we're told to exit.
+		 */
+		while (!atomic_load_explicit(&driver->sub_stop, memory_order_acquire)) {
+			struct pollfd	pfd = { .fd = handle->fd, .events = POLLIN };
+
+			reply = NULL;
+			if (redisGetReplyFromReader(handle, (void **)&reply) != REDIS_OK) break;
+
+			if (!reply) {
+				if (poll(&pfd, 1, 1000) <= 0) continue;
+				if (redisBufferRead(handle) != REDIS_OK) break;
+				continue;
+			}
+
+			if ((reply->type == REDIS_REPLY_ARRAY) && (reply->elements == 4) &&
+			    (reply->element[2]->type == REDIS_REPLY_STRING) &&
+			    (reply->element[2]->len > prefix_len)) {
+				driver->invalidate(driver->uctx,
+						   (uint8_t const *)reply->element[2]->str + prefix_len,
+						   reply->element[2]->len - prefix_len);
+			}
+			freeReplyObject(reply);
+		}
+
+		if (handle->err) ERROR("Notification connection failed: %s", handle->errstr);
+		redisFree(handle);
+	}
+
+	return NULL;
+}
+
+/** Start a thread to receive keyspace notifications
+ *
+ * @note Notifications are only received from the first server listed.  With
+ *	Redis cluster, each node only publishes notifications for the keys it
+ *	holds.
+ *
+ * @copydetails cache_subscribe_t
+ */
+static int cache_subscribe(UNUSED rlm_cache_config_t const *config, void *instance,
+			   cache_invalidate_t invalidate, void *uctx)
+{
+	rlm_cache_redis_t	*driver = instance;
+	int			ret;
+
+	driver->invalidate = invalidate;
+	driver->uctx = uctx;
+	atomic_init(&driver->sub_stop, false);
+
+	ret = pthread_create(&driver->sub_thread, NULL, cache_subscribe_thread, driver);
+	if (ret != 0) {
+		ERROR("Failed creating notification thread: %s", fr_syserror(ret));
+		return -1;
+	}
+	driver->sub_running = true;
+
+	return 0;
+}
+
+/** Stop the notification thread
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_redis_t *driver = instance;
+
+	if (!driver->sub_running) return 0;
+
+	atomic_store_explicit(&driver->sub_stop, true, memory_order_release);
+	pthread_join(driver->sub_thread, NULL);
+	driver->sub_running = false;
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -470,6 +635,7 @@ rlm_cache_driver_t rlm_cache_redis = {
 	.magic		= RLM_MODULE_INIT,
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.inst_size	= sizeof(rlm_cache_redis_t),
 	.config		= driver_config,
 	.free		= cache_entry_free,
@@ -477,4 +643,6 @@ rlm_cache_driver_t rlm_cache_redis = {
 	.find		= cache_entry_find,
 	.insert		= cache_entry_insert,
 	.expire		= cache_entry_expire,
+
+	.subscribe	= cache_subscribe,
 };
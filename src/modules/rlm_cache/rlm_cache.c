@@ -31,11 +31,47 @@ RCSID("$Id$")
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/dl_module.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 
 #include "rlm_cache.h"
 
 extern module_t rlm_cache;
 
+/** Per-thread L1 cache
+ *
+ * Only used with drivers that return a copy of the entry (i.e. provide a
+ * free callback).  Entries fetched from the driver are kept here, so
+ * repeated lookups for the same key on the same thread don't need to go
+ * back to the driver.
+ */
+typedef struct {
+	rlm_cache_t const	*inst;			//!< Instance of rlm_cache.
+	fr_hash_table_t		*l1;			//!< L1 entries, indexed by key.  NULL if the L1 cache
+							///< is disabled.
+	fr_dlist_head_t		lru;			//!< L1 entries, most recently used first.
+} rlm_cache_thread_t;
+
+typedef struct {
+	uint8_t const		*key;			//!< Copy of the key.
+	size_t			key_len;		//!< Length of the key.
+	uint32_t		hash;			//!< Hash of the key.
+
+	rlm_cache_entry_t	*c;			//!< Cached entry, or NULL for a negative entry.
+	fr_time_t		expires;		//!< When this entry must be refreshed from the driver.
+	uint32_t		generation;		//!< Value of the generation counter for the key
+							///< when the entry was added.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} rlm_cache_l1_entry_t;
+
+static const CONF_PARSER l1_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_cache_t, l1.max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("ttl", FR_TYPE_TIME_DELTA, rlm_cache_t, l1.ttl), .dflt = "1" },
+	{ FR_CONF_OFFSET("negative_ttl", FR_TYPE_TIME_DELTA, rlm_cache_t, l1.negative_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("invalidate", FR_TYPE_BOOL, rlm_cache_t, l1.invalidate), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_STRING, rlm_cache_config_t, driver_name), .dflt = "rlm_cache_rbtree" },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_cache_config_t, key) },
@@ -45,6 +81,7 @@ static const CONF_PARSER module_config[] = {
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", FR_TYPE_INT32, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", FR_TYPE_BOOL, rlm_cache_config_t, stats), .dflt = "no" },
+	{ FR_CONF_POINTER("l1", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) l1_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -142,10 +179,218 @@ static void cache_free(rlm_cache_t const *inst, rlm_cache_entry_t **c)
 {
 	if (!c || !*c || !inst->driver->free) return;
 
+	/*
+	 *	Entries owned by the L1 cache are freed
+	 *	when they're evicted.
+	 */
+	if (talloc_get_type(talloc_parent(*c), rlm_cache_l1_entry_t)) {
+		*c = NULL;
+		return;
+	}
+
 	inst->driver->free(*c);
 	*c = NULL;
 }
 
+/** Hash an L1 entry
+ *
+ */
+static uint32_t cache_l1_hash(void const *data)
+{
+	rlm_cache_l1_entry_t const *l1e = data;
+
+	return l1e->hash;
+}
+
+/** Compare two L1 entries by key
+ *
+ */
+static int cache_l1_cmp(void const *one, void const *two)
+{
+	rlm_cache_l1_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Return the generation counter for a key hash
+ *
+ */
+static inline CC_HINT(always_inline) atomic_uint_fast32_t *cache_l1_generation(rlm_cache_t const *inst, uint32_t hash)
+{
+	return &inst->l1_generation[hash & (L1_GENERATION_SLOTS - 1)];
+}
+
+/** Read the current generation counter for a key
+ *
+ * This must be read before the entry is fetched from the backend.  An
+ * invalidation which races the fetch then changes the counter after
+ * our snapshot, so the L1 copy is discarded rather than served as
+ * current.
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	the length of the key.
+ * @return the generation counter, or 0 if there's no L1 cache.
+ */
+static uint32_t cache_l1_generation_snapshot(rlm_cache_t const *inst, uint8_t const *key, size_t key_len)
+{
+	if (!inst->l1_generation) return 0;
+
+	return atomic_load_explicit(cache_l1_generation(inst, fr_hash(key, key_len)), memory_order_acquire);
+}
+
+/** Invalidate any copies of an entry held in the L1 caches of all threads
+ *
+ * Threads check the generation counter for the key when they retrieve an
+ * entry from their L1 cache, and discard it if the counter has changed.
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] key	of the entry which changed.
+ * @param[in] key_len	the length of the key.
+ */
+static void cache_l1_invalidate(rlm_cache_t const *inst, uint8_t const *key, size_t key_len)
+{
+	if (!inst->l1_generation) return;
+
+	atomic_fetch_add_explicit(cache_l1_generation(inst, fr_hash(key, key_len)), 1, memory_order_release);
+}
+
+/** Callback for drivers to notify us of entries changed by other servers
+ *
+ * May be called from any thread.
+ *
+ * @copydetails cache_invalidate_t
+ */
+static void _cache_l1_invalidate(void *uctx, uint8_t const *key, size_t key_len)
+{
+	cache_l1_invalidate(talloc_get_type_abort_const(uctx, rlm_cache_t), key, key_len);
+}
+
+/** Remove an entry from the L1 cache
+ *
+ * The entry may still be referenced by the current request, so it's
+ * parented by the request if we have one, and freed with it.
+ */
+static void cache_l1_remove(rlm_cache_thread_t *t, request_t *request, rlm_cache_l1_entry_t *l1e)
+{
+	fr_hash_table_yank(t->l1, l1e);
+	fr_dlist_remove(&t->lru, l1e);
+
+	if (request) {
+		talloc_steal(request, l1e);
+		return;
+	}
+	talloc_free(l1e);
+}
+
+/** Find an entry in the L1 cache
+ *
+ * Entries which have expired, or which have been changed by another
+ * thread or server are removed.
+ *
+ * @return
+ *	- The L1 entry.  l1e->c will be NULL if this is a negative entry.
+ *	- NULL if no valid L1 entry was found.
+ */
+static rlm_cache_l1_entry_t *cache_l1_find(rlm_cache_thread_t *t, request_t *request,
+					   uint8_t const *key, size_t key_len)
+{
+	rlm_cache_l1_entry_t	*l1e;
+
+	if (!t || !t->l1) return NULL;
+
+	l1e = fr_hash_table_find_by_data(t->l1, &(rlm_cache_l1_entry_t){
+						.key = key,
+						.key_len = key_len,
+						.hash = fr_hash(key, key_len)
+					 });
+	if (!l1e) return NULL;
+
+	if ((l1e->expires < request->packet->timestamp) ||
+	    (l1e->generation != (uint32_t) atomic_load_explicit(cache_l1_generation(t->inst, l1e->hash), memory_order_acquire))) {
+		RDEBUG3("Discarding stale L1 entry");
+		cache_l1_remove(t, request, l1e);
+		return NULL;
+	}
+
+	fr_dlist_remove(&t->lru, l1e);
+	fr_dlist_insert_head(&t->lru, l1e);
+
+	return l1e;
+}
+
+/** Remove the L1 entry for a key (if there is one)
+ *
+ */
+static void cache_l1_delete(rlm_cache_thread_t *t, request_t *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_l1_entry_t	*l1e;
+
+	if (!t || !t->l1) return;
+
+	l1e = fr_hash_table_find_by_data(t->l1, &(rlm_cache_l1_entry_t){
+						.key = key,
+						.key_len = key_len,
+						.hash = fr_hash(key, key_len)
+					 });
+	if (l1e) cache_l1_remove(t, request, l1e);
+}
+
+/** Add an entry to the L1 cache
+ *
+ * The L1 cache takes ownership of the entry.  Any existing L1 entry for
+ * the same key is replaced, and if the L1 cache is full the least recently
+ * used entry is evicted.
+ *
+ * @param[in] t		Thread specific data.
+ * @param[in] request	The current request.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	the length of the key.
+ * @param[in] generation	of the key, from #cache_l1_generation_snapshot, read
+ *				before the entry was fetched or written.
+ * @param[in] c		Entry to add, or NULL to add a negative entry.
+ */
+static void cache_l1_insert(rlm_cache_thread_t *t, request_t *request,
+			    uint8_t const *key, size_t key_len, uint32_t generation, rlm_cache_entry_t *c)
+{
+	rlm_cache_t const	*inst = t->inst;
+	rlm_cache_l1_entry_t	*l1e;
+
+	if (!t->l1) return;
+
+	cache_l1_delete(t, request, key, key_len);
+
+	if ((uint32_t)fr_hash_table_num_elements(t->l1) >= inst->l1.max_entries) {
+		l1e = fr_dlist_tail(&t->lru);
+		if (l1e) cache_l1_remove(t, request, l1e);
+	}
+
+	MEM(l1e = talloc_zero(t->l1, rlm_cache_l1_entry_t));
+	MEM(l1e->key = talloc_memdup(l1e, key, key_len));
+	l1e->key_len = key_len;
+	l1e->hash = fr_hash(key, key_len);
+	l1e->generation = generation;
+
+	if (c) {
+		l1e->c = talloc_steal(l1e, c);
+		l1e->expires = request->packet->timestamp + inst->l1.ttl;
+	} else {
+		l1e->expires = request->packet->timestamp + inst->l1.negative_ttl;
+	}
+
+	if (!fr_hash_table_insert(t->l1, l1e)) {
+		talloc_steal(request, l1e);	/* Still referenced by the request */
+		return;
+	}
+	fr_dlist_insert_head(&t->lru, l1e);
+
+	RDEBUG3("Added %s entry to L1 cache", c ? "positive" : "negative");
+}
+
 /** Merge a cached entry into a #request_t
  *
  * @return
@@ -200,15 +445,35 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, request_t *request, rlm_
  *	- #RLM_MODULE_NOTFOUND on cache miss.
  */
 static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out,
-				  rlm_cache_t const *inst, request_t *request,
+				  rlm_cache_t const *inst, rlm_cache_thread_t *t, request_t *request,
 				  rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
 {
-	cache_status_t ret;
+	cache_status_t		ret;
 
-	rlm_cache_entry_t *c;
+	rlm_cache_entry_t	*c;
+	rlm_cache_l1_entry_t	*l1e;
+	uint32_t		generation;
 
 	*out = NULL;
 
+	/*
+	 *	Check this thread's L1 cache first
+	 */
+	l1e = cache_l1_find(t, request, key, key_len);
+	if (l1e) {
+		if (!l1e->c) {
+			RDEBUG2("No cache entry found for \"%pV\" (negative L1 entry)",
+				fr_box_strvalue_len((char const *)key, key_len));
+			RETURN_MODULE_NOTFOUND;
+		}
+
+		RDEBUG3("Found L1 entry");
+		c = l1e->c;
+		goto found;
+	}
+
+	generation = cache_l1_generation_snapshot(inst, key, key_len);
+
 	for (;;) {
 		ret = inst->driver->find(&c, &inst->config, inst->driver_inst->dl_inst->data, request, *handle, key, key_len);
 		switch (ret) {
@@ -222,6 +487,7 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 
 		case CACHE_MISS:
 			RDEBUG2("No cache entry found for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
+			if (t && inst->l1.negative_ttl) cache_l1_insert(t, request, key, key_len, generation, NULL);
 			RETURN_MODULE_NOTFOUND;
 
 		default:
@@ -232,6 +498,12 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 		break;
 	}
 
+	/*
+	 *	Keep a copy in this thread's L1 cache.
+	 */
+	if (t) cache_l1_insert(t, request, key, key_len, generation, c);
+
+found:
 	/*
 	 *	Yes, but it expired, OR the "forget all" epoch has
 	 *	passed.  Delete it, and pretend it doesn't exist.
@@ -243,7 +515,9 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 			fr_box_date(fr_time_to_unix_time(request->packet->timestamp -
 							 fr_time_delta_from_sec(c->expires))));
 
-		inst->driver->expire(&inst->config, inst->driver_inst->dl_inst->data, request, handle, c->key, c->key_len);
+		inst->driver->expire(&inst->config, inst->driver_inst->dl_inst->data, request, *handle, c->key, c->key_len);
+		cache_l1_delete(t, request, key, key_len);
+		cache_l1_invalidate(inst, key, key_len);
 		cache_free(inst, &c);
 		RETURN_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
@@ -264,10 +538,14 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
  *	- #RLM_MODULE_FAIL on failure.
  */
 static unlang_action_t cache_expire(rlm_rcode_t *p_result,
-				    rlm_cache_t const *inst, request_t *request,
+				    rlm_cache_t const *inst, rlm_cache_thread_t *t, request_t *request,
 				    rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
 {
 	RDEBUG2("Expiring cache entry");
+
+	cache_l1_delete(t, request, key, key_len);
+	cache_l1_invalidate(inst, key, key_len);
+
 	for (;;) switch (inst->driver->expire(&inst->config, inst->driver_inst->dl_inst->data, request,
 					      *handle, key, key_len)) {
 	case CACHE_RECONNECT:
@@ -293,7 +571,8 @@ static unlang_action_t cache_expire(rlm_rcode_t *p_result,
  *	- #RLM_MODULE_FAIL on failure.
  */
 static unlang_action_t cache_insert(rlm_rcode_t *p_result,
-				    rlm_cache_t const *inst, request_t *request, rlm_cache_handle_t **handle,
+				    rlm_cache_t const *inst, rlm_cache_thread_t *t,
+				    request_t *request, rlm_cache_handle_t **handle,
 				    uint8_t const *key, size_t key_len, int ttl)
 {
 	map_t		const *map;
@@ -302,11 +581,12 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 	fr_pair_t		*vp;
 	bool			merge = false;
 	rlm_cache_entry_t	*c;
+	uint32_t		generation;
 
 	TALLOC_CTX		*pool;
 
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_inst->dl_inst->data, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_inst->dl_inst->data, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		RETURN_MODULE_FAIL;
 	}
@@ -436,6 +716,13 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 
 	if (merge) cache_merge(inst, request, c);
 
+	/*
+	 *	Our own invalidation below adds one.  If anyone
+	 *	else writes the key in the mean time, the counter
+	 *	moves further, and our L1 copy is discarded.
+	 */
+	generation = cache_l1_generation_snapshot(inst, key, key_len) + 1;
+
 	for (;;) {
 		cache_status_t ret;
 
@@ -447,6 +734,8 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 
 		case CACHE_OK:
 			RDEBUG2("Committed entry, TTL %d seconds", ttl);
+			cache_l1_invalidate(inst, key, key_len);
+			if (t && inst->driver->free) cache_l1_insert(t, request, key, key_len, generation, c);
 			cache_free(inst, &c);
 			RETURN_MODULE_RCODE(merge ? RLM_MODULE_UPDATED : RLM_MODULE_OK);
 
@@ -481,6 +770,7 @@ static unlang_action_t cache_set_ttl(rlm_rcode_t *p_result,
 
 		case CACHE_OK:
 			RDEBUG2("Updated entry TTL");
+			cache_l1_invalidate(inst, c->key, c->key_len);
 			RETURN_MODULE_OK;
 
 		default:
@@ -503,6 +793,7 @@ static unlang_action_t cache_set_ttl(rlm_rcode_t *p_result,
 
 		case CACHE_OK:
 			RDEBUG2("Updated entry TTL");
+			cache_l1_invalidate(inst, c->key, c->key_len);
 			RETURN_MODULE_OK;
 
 		default:
@@ -539,6 +830,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 {
 	rlm_cache_entry_t	*c = NULL;
 	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
 
 	rlm_cache_handle_t	*handle;
 
@@ -580,7 +872,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 			RETURN_MODULE_FAIL;
 		}
 
-		cache_find(&rcode, &c, inst, request, &handle, key, key_len);
+		cache_find(&rcode, &c, inst, t, request, &handle, key, key_len);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 		fr_assert(!inst->driver->acquire || handle);
 
@@ -627,7 +919,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	 *	recording whether the entry existed.
 	 */
 	if (merge) {
-		cache_find(&rcode, &c, inst, request, &handle, key, key_len);
+		cache_find(&rcode, &c, inst, t, request, &handle, key, key_len);
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 			goto finish;
@@ -660,7 +952,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 			rlm_rcode_t tmp;
 
 			fr_assert(!set_ttl);
-			cache_expire(&tmp, inst, request, &handle, key, key_len);
+			cache_expire(&tmp, inst, t, request, &handle, key, key_len);
 			switch (tmp) {
 			case RLM_MODULE_FAIL:
 				rcode = RLM_MODULE_FAIL;
@@ -692,7 +984,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	if ((exists < 0) && (insert || set_ttl)) {
 		rlm_rcode_t tmp;
 
-		cache_find(&tmp, &c, inst, request, &handle, key, key_len);
+		cache_find(&tmp, &c, inst, t, request, &handle, key, key_len);
 		switch (tmp) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -748,7 +1040,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	if (insert && (exists == 0)) {
 		rlm_rcode_t tmp;
 
-		cache_insert(&tmp, inst, request, &handle, key, key_len, ttl);
+		cache_insert(&tmp, inst, t, request, &handle, key, key_len, ttl);
 		switch (tmp) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -848,16 +1140,19 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 		return -1;
 	}
 
-	cache_find(&rcode, &c, mod_inst, request, &handle, key, key_len);
+	cache_find(&rcode, &c, mod_inst, NULL, request, &handle, key, key_len);
 	switch (rcode) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
 	case RLM_MODULE_NOTFOUND:	/* not found */
+		talloc_free(target);
+		cache_release(mod_inst, request, &handle);
 		return 0;
 
 	default:
 		talloc_free(target);
+		cache_release(mod_inst, request, &handle);
 		return -1;
 	}
 
@@ -872,14 +1167,14 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 
 	talloc_free(target);
 
+	cache_free(mod_inst, &c);
+	cache_release(mod_inst, request, &handle);
+
 	/*
 	 *	Check if we found a matching map
 	 */
 	if (!map) return 0;
 
-	cache_free(mod_inst, &c);
-	cache_release(mod_inst, request, &handle);
-
 	return ret;
 }
 
@@ -964,6 +1259,29 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Allocate the L1 cache for a thread
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_cache_t		*inst = talloc_get_type_abort(instance, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(thread, rlm_cache_thread_t);
+
+	t->inst = inst;
+
+	if (!inst->l1_generation) return 0;
+
+	t->l1 = fr_hash_table_create(t, cache_l1_hash, cache_l1_cmp, NULL);
+	if (!t->l1) {
+		ERROR("Failed creating L1 cache");
+		return -1;
+	}
+	fr_dlist_talloc_init(&t->lru, rlm_cache_l1_entry_t, entry);
+
+	return 0;
+}
+
 /** Create a new rlm_cache_instance
  *
  */
@@ -1012,6 +1330,34 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	The L1 cache holds copies of entries, which is
+	 *	pointless if the driver stores entries in memory.
+	 */
+	if (inst->l1.max_entries > 0) {
+		if (!inst->driver->free) {
+			cf_log_warn(conf, "Ignoring 'l1' section, driver \"%s\" already stores entries in memory",
+				    inst->config.driver_name);
+			return 0;
+		}
+
+		MEM(inst->l1_generation = talloc_zero_array(inst, atomic_uint_fast32_t, L1_GENERATION_SLOTS));
+
+		if (inst->l1.invalidate) {
+			if (!inst->driver->subscribe) {
+				cf_log_err(conf, "Driver \"%s\" does not support L1 invalidation",
+					   inst->config.driver_name);
+				return -1;
+			}
+
+			if (inst->driver->subscribe(&inst->config, inst->driver_inst->dl_inst->data,
+						    _cache_l1_invalidate, inst) < 0) {
+				cf_log_err(conf, "Failed subscribing to cache invalidation notifications");
+				return -1;
+			}
+		}
+	}
+
 	return 0;
 }
 
@@ -1032,6 +1378,10 @@ module_t rlm_cache = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+
+	.thread_inst_size	= sizeof(rlm_cache_thread_t),
+	.thread_inst_type	= "rlm_cache_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_cache_it,
 		[MOD_PREACCT]		= mod_cache_it,
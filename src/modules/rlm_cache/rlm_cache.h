@@ -29,12 +29,20 @@ RCSIDH(cache_h, "$Id$")
 #include <freeradius-devel/server/dl_module.h>
 #include <freeradius-devel/server/map.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 typedef struct rlm_cache_driver_s rlm_cache_driver_t;
 
 typedef void rlm_cache_handle_t;
 
 #define MAX_ATTRMAP	128
 
+#define L1_GENERATION_SLOTS	1024		//!< Must be a power of 2.
+
 typedef enum {
 	CACHE_RECONNECT	= -2,				//!< Handle needs to be reconnected
 	CACHE_ERROR	= -1,				//!< Fatal error
@@ -57,6 +65,20 @@ typedef struct {
 	bool			stats;			//!< Generate statistics.
 } rlm_cache_config_t;
 
+/** Configuration for the per-thread L1 cache
+ *
+ */
+typedef struct {
+	uint32_t		max_entries;		//!< Maximum entries in each thread's L1 cache.
+							///< 0 disables the L1 cache.
+	fr_time_delta_t		ttl;			//!< Maximum time an entry is served from the L1 cache
+							///< before being re-fetched from the driver.
+	fr_time_delta_t		negative_ttl;		//!< How long misses are remembered.  0 disables
+							///< negative caching.
+	bool			invalidate;		//!< Ask the driver to notify us of changes made
+							///< by other servers.
+} rlm_cache_l1_config_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -73,6 +95,11 @@ typedef struct {
 	map_t		*maps;			//!< Attribute map applied to users.
 							//!< and profiles.
 	CONF_SECTION		*cs;
+
+	rlm_cache_l1_config_t	l1;			//!< L1 cache configuration.
+	atomic_uint_fast32_t	*l1_generation;		//!< Generation counters, indexed by key hash.
+							///< Bumped whenever a key is changed, so
+							///< other threads discard their L1 copies.
 } rlm_cache_t;
 
 typedef struct {
@@ -263,6 +290,33 @@ typedef void		(*cache_release_t)(rlm_cache_config_t const *config, void *instanc
 typedef int		(*cache_reconnect_t)(rlm_cache_handle_t **handle, rlm_cache_config_t const *config,
 					     void *instance, request_t *request);
 
+/** Notify rlm_cache that an entry was changed or removed by another server
+ *
+ * @param[in] uctx	passed to #cache_subscribe_t.
+ * @param[in] key	of the entry that changed.
+ * @param[in] key_len	the length of the key.
+ */
+typedef void		(*cache_invalidate_t)(void *uctx, uint8_t const *key, size_t key_len);
+
+/** Subscribe to notifications of entries being changed outside of this server
+ *
+ * @note This callback is optional.  It is only used when the L1 cache is enabled
+ *	and `l1.invalidate` is set.
+ *
+ * The driver must call invalidate whenever it's notified that an entry was
+ * changed.  invalidate may be called from any thread.
+ *
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] instance Driver specific instance data.
+ * @param[in] invalidate callback to call when an entry changes.
+ * @param[in] uctx to pass to invalidate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+typedef int		(*cache_subscribe_t)(rlm_cache_config_t const *config, void *instance,
+					     cache_invalidate_t invalidate, void *uctx);
+
 struct rlm_cache_driver_s {
 	DL_MODULE_COMMON;					//!< Common fields for all loadable modules.
 	FR_MODULE_COMMON;					//!< Common fields for all instantiated modules.
@@ -283,4 +337,7 @@ struct rlm_cache_driver_s {
 	cache_release_t			release;		//!< (optional) Release access to resource acquired
 								//!< with acquire callback.
 	cache_reconnect_t		reconnect;		//!< (optional) Re-initialise resource.
+
+	cache_subscribe_t		subscribe;		//!< (optional) Receive notifications of entries
+								//!< changed by other servers.
 };
@@ -1,2 +1,3 @@
 TARGET		:= rlm_detail.a
 SOURCES		:= rlm_detail.c
+TGT_PREREQS	:= libfreeradius-internal.a libfreeradius-util.a
@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/internal/detail.h>
 
 #include <ctype.h>
 #include <fcntl.h>
@@ -45,6 +46,17 @@ RCSID("$Id$")
 
 #define DIRLEN	8192		//!< Maximum path length.
 
+typedef enum {
+	DETAIL_FORMAT_TEXT = 0,		//!< Attribute = value, one per line.
+	DETAIL_FORMAT_BINARY		//!< Records in the internal encoding.
+} rlm_detail_format_t;
+
+static fr_table_num_sorted_t const detail_format_table[] = {
+	{ L("binary"),	DETAIL_FORMAT_BINARY	},
+	{ L("text"),	DETAIL_FORMAT_TEXT	}
+};
+static size_t detail_format_table_len = NUM_ELEMENTS(detail_format_table);
+
 /** Instance configuration for rlm_detail
  *
  * Holds the configuration and preparsed data for a instance of rlm_detail.
@@ -54,7 +66,9 @@ typedef struct {
 	char const	*filename;	//!< File/path to write to.
 	uint32_t	perm;		//!< Permissions to use for new files.
 	char const	*group;		//!< Group to use for new files.
+	gid_t		gid;		//!< Resolved group.  -1 if the group isn't changed.
 
+	int		format;		//!< rlm_detail_format_t.
 	tmpl_t		*header;	//!< Header format.
 	bool		locking;	//!< Whether the file should be locked.
 
@@ -65,12 +79,15 @@ typedef struct {
 	xlat_escape_legacy_t	escape_func; //!< escape function
 
 	exfile_t    	*ef;		//!< Log file handler
+	exfile_writer_conf_t writer;	//!< Asynchronous writer configuration.
 
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
 } rlm_detail_t;
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_detail_t, filename), .dflt = "%A/%{Packet-Src-IP-Address}/detail" },
+	{ FR_CONF_OFFSET("format", FR_TYPE_INT32, rlm_detail_t, format),
+	  .func = cf_table_parse_int, .uctx = &(cf_table_parse_ctx_t){ .table = detail_format_table, .len = &detail_format_table_len }, .dflt = "text" },
 	{ FR_CONF_OFFSET("header", FR_TYPE_TMPL | FR_TYPE_XLAT | FR_TYPE_NON_BLOCKING, rlm_detail_t, header),
 	  .dflt = "%t", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_detail_t, perm), .dflt = "0600" },
@@ -78,6 +95,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("locking", FR_TYPE_BOOL, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", FR_TYPE_BOOL, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET("writer", FR_TYPE_SUBSECTION, rlm_detail_t, writer), .subcs = (void const *) exfile_writer_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -161,12 +179,32 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->escape_func = rad_filename_make_safe;
 	}
 
+	inst->gid = (gid_t) -1;
+	if (inst->group) {
+#ifdef HAVE_GRP_H
+		char *endptr;
+
+		inst->gid = strtol(inst->group, &endptr, 10);
+		if ((*endptr != '\0') && (rad_getgid(inst, &inst->gid, inst->group) < 0)) {
+			cf_log_warn(conf, "Unable to find system group '%s'", inst->group);
+			inst->gid = (gid_t) -1;
+		}
+#else
+		cf_log_warn(conf, "Ignoring 'group', as this system does not support groups");
+#endif
+	}
+
 	inst->ef = module_exfile_init(inst, conf, 256, 30, inst->locking, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
 		return -1;
 	}
 
+	if (exfile_writer_start(inst->ef, &inst->writer) < 0) {
+		cf_log_perr(conf, "Failed starting writer");
+		return -1;
+	}
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -364,21 +402,121 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 	return 0;
 }
 
+/** Filter for the pairs which go into a binary detail entry
+ *
+ */
+typedef struct {
+	rlm_detail_t const	*inst;
+	bool			compat;
+} detail_filter_t;
+
+static void *detail_filter(void **prev, void *to_eval, void *uctx)
+{
+	detail_filter_t const	*filter = uctx;
+	fr_pair_t		*c, *p;
+
+	if (!to_eval) return NULL;
+
+	for (p = *prev, c = to_eval; c; p = c, c = c->next) {
+		if (filter->inst->ht && fr_hash_table_find_by_data(filter->inst->ht, c->da)) continue;
+		if (filter->compat && (c->da == attr_user_password)) continue;
+		break;
+	}
+
+	*prev = p;
+
+	return c;
+}
+
+/** Encode a single binary detail entry
+ *
+ * The same information as detail_write(), except that the packet type,
+ * addresses and timestamp go in the fixed fields of the record.
+ *
+ * @param[out] out	Where to write the talloced entry.  NULL if the
+ *			packet was empty.
+ * @param[in] inst	Instance of rlm_detail.
+ * @param[in] request	The current request.
+ * @param[in] packet	associated with the request (request, reply...).
+ * @param[in] compat	Write out entry in compatibility mode.
+ * @return
+ *	- The length of the entry.
+ *	- -1 on error.
+ */
+static ssize_t detail_encode(uint8_t **out, rlm_detail_t const *inst, request_t *request,
+			     fr_radius_packet_t *packet, bool compat)
+{
+	fr_detail_binary_t	hdr;
+	detail_filter_t		filter = { .inst = inst, .compat = compat };
+	size_t			size;
+
+	*out = NULL;
+
+	if (!packet->vps) {
+		RWDEBUG("Skipping empty packet");
+		return 0;
+	}
+
+	hdr = (fr_detail_binary_t) {
+		.code = packet->code,
+		.timestamp = fr_time_to_unix_time(request->packet->timestamp)
+	};
+
+	if (inst->log_srcdst) {
+		hdr.src_ipaddr = packet->socket.inet.src_ipaddr;
+		hdr.dst_ipaddr = packet->socket.inet.dst_ipaddr;
+		hdr.src_port = packet->socket.inet.src_port;
+		hdr.dst_port = packet->socket.inet.dst_port;
+	}
+
+	/*
+	 *	Almost every entry fits in the first buffer.  If it
+	 *	doesn't, try again with a larger one.
+	 */
+	for (size = 4096; size <= (FR_DETAIL_BINARY_HDR_LEN + FR_DETAIL_BINARY_MAX_LEN); size *= 2) {
+		fr_cursor_t	cursor;
+		uint8_t		*buffer;
+		ssize_t		slen;
+
+		MEM(buffer = talloc_array(request, uint8_t, size));
+
+		fr_cursor_iter_init(&cursor, &packet->vps, detail_filter, &filter);
+		slen = fr_detail_binary_encode(&FR_DBUFF_TMP(buffer, size), &hdr, &cursor, request->dict);
+		if (slen > 0) {
+			*out = buffer;
+			return slen;
+		}
+
+		talloc_free(buffer);
+	}
+
+	RPERROR("Failed encoding detail entry");
+	return -1;
+}
+
+/** Append output from the formatting functions to a talloc buffer
+ *
+ */
+static ssize_t _detail_buffer_write(void *cookie, char const *in, size_t len)
+{
+	char **buffer = cookie;
+
+	MEM(*buffer = talloc_bstr_append(talloc_parent(*buffer), *buffer, in, len));
+
+	return len;
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
 static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
 						  fr_radius_packet_t *packet, bool compat)
 {
-	int		outfd, dupfd;
 	char		buffer[DIRLEN];
-
+	char		*entry;
 	FILE		*outfp;
-
-#ifdef HAVE_GRP_H
-	gid_t		gid;
-	char		*endptr;
-#endif
+	struct iovec	iov;
+	ssize_t		slen;
 
 	rlm_detail_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_detail_t);
 
@@ -393,53 +531,44 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 
 	RDEBUG2("%s expands to %s", inst->filename, buffer);
 
-	outfd = exfile_open(inst->ef, request, buffer, inst->perm);
-	if (outfd < 0) {
-		RPERROR("Couldn't open file %s", buffer);
-		/* coverity[missing_unlock] */
-		RETURN_MODULE_FAIL;
-	}
-
-	if (inst->group != NULL) {
-		gid = strtol(inst->group, &endptr, 10);
-		if (*endptr != '\0') {
-			if (rad_getgid(request, &gid, inst->group) < 0) {
-				RDEBUG2("Unable to find system group '%s'", inst->group);
-				goto skip_group;
-			}
-		}
-
-		if (chown(buffer, -1, gid) == -1) {
-			RDEBUG2("Unable to change system group of '%s'", buffer);
-		}
-	}
+	if (inst->format == DETAIL_FORMAT_BINARY) {
+		slen = detail_encode((uint8_t **) &entry, inst, request, packet, compat);
+		if (slen < 0) RETURN_MODULE_FAIL;
+		if (slen == 0) RETURN_MODULE_OK;
 
-skip_group:
-	outfp = NULL;
-	dupfd = dup(outfd);
-	if (dupfd < 0) {
-		RERROR("Failed to dup() file descriptor for detail file");
-		goto fail;
+		iov.iov_base = entry;
+		iov.iov_len = slen;
+		goto write;
 	}
 
 	/*
-	 *	Open the output fp for buffering.
+	 *	Format the entry in memory, so it can be written
+	 *	to the file in one go, possibly by another thread.
 	 */
-	if ((outfp = fdopen(dupfd, "a")) == NULL) {
-		RERROR("Couldn't open file %s: %s", buffer, fr_syserror(errno));
+	MEM(entry = talloc_strdup(request, ""));
+	outfp = fopencookie(&entry, "w", (cookie_io_functions_t){ .write = _detail_buffer_write });
+	if (!outfp) {
+		RERROR("Failed creating buffer for detail entry: %s", fr_syserror(errno));
 	fail:
-		if (outfp) fclose(outfp);
-		exfile_close(inst->ef, request, outfd);
+		talloc_free(entry);
 		RETURN_MODULE_FAIL;
 	}
 
-	if (detail_write(outfp, inst, request, packet, compat) < 0) goto fail;
-
-	/*
-	 *	Flush everything
-	 */
+	if (detail_write(outfp, inst, request, packet, compat) < 0) {
+		fclose(outfp);
+		goto fail;
+	}
 	fclose(outfp);
-	exfile_close(inst->ef, request, outfd);
+
+	iov.iov_base = entry;
+	iov.iov_len = talloc_array_length(entry) - 1;
+
+write:
+	if (exfile_write(inst->ef, request, buffer, inst->perm, inst->gid, &iov, 1) < 0) {
+		RPERROR("Couldn't write to %s", buffer);
+		goto fail;
+	}
+	talloc_free(entry);
 
 	/*
 	 *	And everything is fine.
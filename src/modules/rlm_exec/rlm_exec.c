@@ -28,9 +28,15 @@ RCSID("$Id$")
 #define LOG_PREFIX_ARGS inst->name
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/exec.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/pair_legacy.h>
+
+#include <signal.h>
 
 /*
  *	Define a structure for our module configuration.
@@ -46,6 +52,7 @@ typedef struct {
 	bool		shell_escape;
 	fr_time_delta_t	timeout;
 	bool		timeout_is_set;
+	bool		coprocess;
 
 	tmpl_t	*tmpl;
 } rlm_exec_t;
@@ -57,9 +64,33 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("output_pairs", FR_TYPE_STRING, rlm_exec_t, output) },
 	{ FR_CONF_OFFSET("shell_escape", FR_TYPE_BOOL, rlm_exec_t, shell_escape), .dflt = "yes" },
 	{ FR_CONF_OFFSET_IS_SET("timeout", FR_TYPE_TIME_DELTA, rlm_exec_t, timeout) },
+	{ FR_CONF_OFFSET("coprocess", FR_TYPE_BOOL, rlm_exec_t, coprocess), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Lines sent to a coprocess must fit in a pipe buffer.
+ */
+#define EXEC_COPROC_MAX_LINE	(16384)
+
+/** A request waiting for, or being processed by, the coprocess
+ *
+ */
+typedef struct {
+	fr_exec_helper_request_t er;			//!< er.result is the status from the coprocess,
+							///< or -1 on error.
+	fr_exec_helper_pool_t	*coproc;		//!< The request was given to.
+	char			*answer;		//!< Output pairs from the coprocess.
+} rlm_exec_coproc_ctx_t;
+
+/** Per-thread instance data
+ *
+ * In coprocess mode each worker thread runs its own copy of the program.
+ */
+typedef struct {
+	fr_exec_helper_pool_t	*coproc;		//!< Pool of one helper.  NULL if not in coprocess mode.
+} rlm_exec_thread_t;
+
 static char const special[] = "\\'\"`<>|; \t\r\n()[]?#$^&*=";
 
 /*
@@ -184,6 +215,11 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->coprocess && !inst->wait) {
+		cf_log_err(conf, "Cannot use coprocess = yes if wait = no");
+		return -1;
+	}
+
 	if (inst->timeout_is_set || !inst->timeout) {
 		/*
 		 *	Pick the shorter one
@@ -227,7 +263,19 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	rlm_exec_t		*inst = instance;
 	ssize_t			slen;
 
-	if (!inst->program) return 0;
+	if (!inst->program) {
+		if (inst->coprocess) {
+			cf_log_err(conf, "Must set 'program' if coprocess = yes");
+			return -1;
+		}
+		return 0;
+	}
+
+	/*
+	 *	The coprocess is started when the worker threads are,
+	 *	so the program is run as-is, without any expansions.
+	 */
+	if (inst->coprocess) return 0;
 
 	slen = tmpl_afrom_substr(inst, &inst->tmpl, &FR_SBUFF_IN(inst->program, strlen(inst->program)),
 				 T_BACK_QUOTED_STRING, NULL,
@@ -385,6 +433,180 @@ static unlang_action_t mod_exec_wait_resume(rlm_rcode_t *p_result, module_ctx_t
 	RETURN_MODULE_RCODE(rlm_exec_status2rcode(request, m->box, status));
 }
 
+/** Process the coprocess' answer
+ *
+ * The answer is the same status code the program would exit with,
+ * optionally followed by whitespace and a comma separated list of
+ * output pairs.
+ *
+ * @return
+ *	- 1, there's only ever one line.
+ *	- -1 if the answer is invalid.
+ */
+static int exec_coproc_line(fr_exec_helper_request_t *er, char *line, void *uctx)
+{
+	rlm_exec_t const	*inst = talloc_get_type_abort_const(uctx, rlm_exec_t);
+	rlm_exec_coproc_ctx_t	*cc;
+	unsigned long		status;
+	char			*p;
+
+	status = strtoul(line, &p, 10);
+	if ((p == line) || (status > 255) || ((*p != '\0') && !isspace((int) *p))) {
+		ERROR("Invalid answer from coprocess: %s", line);
+		return -1;
+	}
+
+	/*
+	 *	The request was cancelled while the coprocess was busy.
+	 */
+	if (!er) return 1;
+	cc = er->uctx;
+
+	fr_skip_whitespace(p);
+	if (*p) MEM(cc->answer = talloc_typed_strdup(cc, p));
+
+	er->result = (int) status;
+
+	return 1;
+}
+
+static unlang_action_t mod_exec_coproc_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					      request_t *request, void *rctx)
+{
+	rlm_exec_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_exec_t);
+	rlm_exec_coproc_ctx_t	*cc = talloc_get_type_abort(rctx, rlm_exec_coproc_ctx_t);
+	rlm_rcode_t		rcode;
+
+	(void) unlang_module_timeout_delete(request, cc);
+
+	if (cc->er.result < 0) {
+		talloc_free(cc);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (inst->output && cc->answer) {
+		fr_pair_t	*vps = NULL, **output_pairs;
+
+		RDEBUG("EXEC GOT -- %s", cc->answer);
+
+		output_pairs = radius_list(request, inst->output_list);
+		fr_assert(output_pairs != NULL);
+
+		if (fr_pair_list_afrom_str(radius_list_ctx(request, inst->output_list),
+					   request->dict, cc->answer, &vps) == T_INVALID) {
+			RPEDEBUG("Failed parsing output from coprocess");
+			fr_pair_list_free(&vps);
+			talloc_free(cc);
+			RETURN_MODULE_FAIL;
+		}
+		fr_pair_list_move(output_pairs, &vps);
+	}
+
+	rcode = rlm_exec_status2rcode(request, NULL, cc->er.result);
+	talloc_free(cc);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static void exec_coproc_timeout(UNUSED module_ctx_t const *mctx, request_t *request, void *rctx, UNUSED fr_time_t fired)
+{
+	rlm_exec_coproc_ctx_t	*cc = talloc_get_type_abort(rctx, rlm_exec_coproc_ctx_t);
+
+	/*
+	 *	The coprocess answered, but we haven't been resumed yet.
+	 */
+	if (!fr_exec_helper_dequeue(cc->coproc, &cc->er, true)) return;
+
+	REDEBUG("Timed out waiting for coprocess");
+	cc->er.result = -1;
+
+	unlang_interpret_resumable(request);
+}
+
+static void exec_coproc_signal(UNUSED module_ctx_t const *mctx, request_t *request, void *rctx, fr_state_signal_t action)
+{
+	rlm_exec_coproc_ctx_t	*cc = talloc_get_type_abort(rctx, rlm_exec_coproc_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	(void) fr_exec_helper_dequeue(cc->coproc, &cc->er, false);
+	(void) unlang_module_timeout_delete(request, cc);
+
+	talloc_free(cc);
+}
+
+/** Hand the input pairs to the coprocess, and yield until it answers
+ *
+ * The input pairs are sent as a single line, e.g.
+ *
+@verbatim
+User-Name = "bob", NAS-IP-Address = 192.0.2.1
+@endverbatim
+ *
+ * An empty line is sent if there are no input pairs.
+ */
+static unlang_action_t mod_exec_coproc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_exec_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_exec_t);
+	rlm_exec_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_exec_thread_t);
+	rlm_exec_coproc_ctx_t	*cc;
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+
+	MEM(cc = talloc_zero(unlang_interpret_frame_talloc_ctx(request), rlm_exec_coproc_ctx_t));
+	cc->coproc = t->coproc;
+
+	fr_sbuff_init_talloc(cc, &sbuff, &tctx, 256, EXEC_COPROC_MAX_LINE);
+
+	if (inst->input) {
+		fr_pair_t	**input_pairs, *vp;
+		fr_cursor_t	cursor;
+
+		input_pairs = radius_list(request, inst->input_list);
+		if (!input_pairs) {
+			talloc_free(cc);
+			RETURN_MODULE_INVALID;
+		}
+
+		for (vp = fr_cursor_init(&cursor, input_pairs);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			if (((fr_sbuff_used(&sbuff) > 0) && (fr_sbuff_in_strcpy_literal(&sbuff, ", ") < 0)) ||
+			    (fr_pair_print(&sbuff, vp) < 0)) {
+				REDEBUG("Input pairs are too long to send to coprocess");
+				talloc_free(cc);
+				RETURN_MODULE_FAIL;
+			}
+		}
+	}
+
+	if (inst->output && !radius_list(request, inst->output_list)) {
+		talloc_free(cc);
+		RETURN_MODULE_INVALID;
+	}
+
+	if (fr_sbuff_in_char(&sbuff, '\n') < 0) {
+		REDEBUG("Input pairs are too long to send to coprocess");
+		talloc_free(cc);
+		RETURN_MODULE_FAIL;
+	}
+	fr_exec_helper_request_init(&cc->er, request, fr_sbuff_buff(&sbuff), fr_sbuff_used(&sbuff), cc);
+
+	if (fr_exec_helper_enqueue(t->coproc, &cc->er) < 0) {
+		talloc_free(cc);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (unlang_module_timeout_add(request, exec_coproc_timeout, cc, fr_time() + inst->timeout) < 0) {
+		RPEDEBUG("Failed adding coprocess timeout");
+		(void) fr_exec_helper_dequeue(t->coproc, &cc->er, false);
+		talloc_free(cc);
+		RETURN_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_exec_coproc_resume, exec_coproc_signal, cc);
+}
+
 /*
  *  Dispatch an async exec method
  */
@@ -395,6 +617,8 @@ static unlang_action_t CC_HINT(nonnull) mod_exec_dispatch(rlm_rcode_t *p_result,
 	fr_pair_t		*env_pairs = NULL;
 	TALLOC_CTX		*ctx;
 
+	if (inst->coprocess) return mod_exec_coproc(p_result, mctx, request);
+
 	if (!inst->tmpl) {
 		RDEBUG("This module requires 'program' to be set.");
 		RETURN_MODULE_FAIL;
@@ -439,6 +663,39 @@ static unlang_action_t CC_HINT(nonnull) mod_exec_dispatch(rlm_rcode_t *p_result,
 	return unlang_module_yield_to_tmpl(m, &m->box, &m->status, request, inst->tmpl, env_pairs, mod_exec_wait_resume, NULL, m);
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_exec_t const	*inst = talloc_get_type_abort_const(instance, rlm_exec_t);
+	rlm_exec_thread_t	*t = talloc_get_type_abort(thread, rlm_exec_thread_t);
+	char			*name;
+	void			*uctx;
+
+	if (!inst->coprocess) return 0;
+
+	memcpy(&uctx, &inst, sizeof(uctx)); /* const issues */
+
+	MEM(name = talloc_typed_asprintf(NULL, "rlm_exec (%s) - coprocess", inst->name));
+	t->coproc = fr_exec_helper_pool_alloc(t, el, name, inst->program, 1, exec_coproc_line, uctx);
+	talloc_free(name);
+	if (!t->coproc) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_exec_thread_t	*t = talloc_get_type_abort(thread, rlm_exec_thread_t);
+
+	/*
+	 *	The event loop is going away, so the coprocess
+	 *	is reaped synchronously.
+	 */
+	if (t->coproc) fr_exec_helper_pool_stop(t->coproc);
+
+	return 0;
+}
+
 
 /*
  *	The module name should be the only globally exported symbol.
@@ -458,6 +715,10 @@ module_t rlm_exec = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_exec_thread_t),
+	.thread_inst_type	= "rlm_exec_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_exec_dispatch,
 		[MOD_AUTHORIZE]		= mod_exec_dispatch,
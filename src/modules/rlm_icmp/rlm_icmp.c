@@ -43,15 +43,26 @@ typedef struct {
 	char const	*xlat_name;
 	char const	*interface;
 	fr_time_delta_t	timeout;
+	fr_time_delta_t	cache_ttl;
 	fr_ipaddr_t	src_ipaddr;
 } rlm_icmp_t;
 
+/*
+ *	Maximum number of ICMP requests sent with one system call.
+ */
+#define ICMP_BATCH	64
+
 typedef struct {
 	rlm_icmp_t	*inst;
-	rbtree_t	*tree;
+	rbtree_t	*tree;			//!< Echoes waiting for a reply, keyed by counter.
+	rbtree_t	*inflight;		//!< Echoes waiting for a reply, keyed by IP.
+	fr_dlist_head_t	pending;		//!< Echoes to send at the end of this pass of the event loop.
 	int		fd;
 	fr_event_list_t *el;
 
+	rbtree_t	*cache;			//!< Recent results, keyed by IP.
+	fr_dlist_head_t	cache_expiry;		//!< Recent results, oldest first.
+
 	uint32_t	data;
 	uint16_t	ident;
 	uint32_t	counter;
@@ -59,15 +70,50 @@ typedef struct {
 	fr_type_t	ipaddr_type;
 	uint8_t		request_type;
 	uint8_t		reply_type;
+
+	uint64_t	lookups;		//!< Number of times the xlat was called.
+	uint64_t	sent;			//!< Number of ICMP requests sent.
 } rlm_icmp_thread_t;
 
+/** An ICMP request, and the requests waiting for its result
+ *
+ * All requests which ping the same IP while an echo is outstanding
+ * wait for the same echo, instead of sending their own.
+ */
 typedef struct {
-	bool		replied;		//!< do we have a reply?
-	fr_value_box_t	*ip;			//!< the IP we're pinging
-	uint32_t	counter;	       	//!< for pinging the same IP multiple times
-	request_t	*request;		//!< so it can be resumed when we get the echo reply
+	rlm_icmp_thread_t	*t;
+	fr_ipaddr_t		ip;		//!< the IP we're pinging
+	uint32_t		counter;	//!< for pinging the same IP multiple times
+	bool			replied;	//!< do we have a reply?
+	bool			failed;		//!< we couldn't send the ICMP request.
+
+	fr_event_timer_t const	*ev;		//!< When to give up waiting for the reply.
+	fr_dlist_head_t		waiting;	//!< Requests waiting for the result.
+	fr_dlist_t		entry;		//!< Entry in the thread's list of echoes to send.
 } rlm_icmp_echo_t;
 
+/** A request waiting for an echo
+ *
+ */
+typedef struct {
+	request_t		*request;	//!< so it can be resumed when we get the echo reply
+	rlm_icmp_echo_t		*echo;		//!< the echo we're waiting for.  NULL once it's finished.
+	bool			replied;	//!< result of the echo.
+	bool			failed;		//!< we couldn't send the ICMP request.
+	fr_dlist_t		entry;		//!< Entry in the echo's list of waiting requests.
+} rlm_icmp_wait_t;
+
+/** A recent result
+ *
+ */
+typedef struct {
+	rlm_icmp_thread_t	*t;
+	fr_ipaddr_t		ip;
+	bool			replied;
+	fr_time_t		expires;
+	fr_dlist_t		entry;		//!< Entry in the thread's list of results, oldest first.
+} rlm_icmp_result_t;
+
 /** Wrapper around the module thread stuct for individual xlats
  *
  */
@@ -119,54 +165,180 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("interface", FR_TYPE_STRING, rlm_icmp_t, interface) },
 	{ FR_CONF_OFFSET("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_icmp_t, src_ipaddr) },
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_icmp_t, timeout), .dflt = "1s" },
+	{ FR_CONF_OFFSET("cache_ttl", FR_TYPE_TIME_DELTA, rlm_icmp_t, cache_ttl), .dflt = "1s" },
 	CONF_PARSER_TERMINATOR
 };
 
+static int echo_cmp(void const *one, void const *two)
+{
+	rlm_icmp_echo_t const *a = one;
+	rlm_icmp_echo_t const *b = two;
+
+	/*
+	 *	No need to check IP, because "counter" is unique for each packet.
+	 */
+	return (a->counter < b->counter) - (a->counter > b->counter);
+}
+
+static int echo_ip_cmp(void const *one, void const *two)
+{
+	rlm_icmp_echo_t const *a = one;
+	rlm_icmp_echo_t const *b = two;
+
+	return fr_ipaddr_cmp(&a->ip, &b->ip);
+}
+
+static int result_cmp(void const *one, void const *two)
+{
+	rlm_icmp_result_t const *a = one;
+	rlm_icmp_result_t const *b = two;
+
+	return fr_ipaddr_cmp(&a->ip, &b->ip);
+}
+
+static int _icmp_result_free(rlm_icmp_result_t *result)
+{
+	(void) rbtree_deletebydata(result->t->cache, result);
+	fr_dlist_remove(&result->t->cache_expiry, result);
+
+	return 0;
+}
+
+/** Find a recent result for an IP
+ *
+ * All results have the same TTL, so the expiry list is in order of expiry,
+ * and expired results can be removed from the head.
+ */
+static rlm_icmp_result_t *icmp_cache_find(rlm_icmp_thread_t *t, fr_ipaddr_t const *ip, fr_time_t now)
+{
+	rlm_icmp_result_t *result;
+
+	while ((result = fr_dlist_head(&t->cache_expiry)) && (result->expires <= now)) talloc_free(result);
+
+	return rbtree_finddata(t->cache, &(rlm_icmp_result_t){ .ip = *ip });
+}
+
+static void icmp_cache_add(rlm_icmp_thread_t *t, fr_ipaddr_t const *ip, bool replied)
+{
+	rlm_icmp_result_t *result;
+
+	if (!t->inst->cache_ttl) return;
+
+	result = rbtree_finddata(t->cache, &(rlm_icmp_result_t){ .ip = *ip });
+	if (result) talloc_free(result);
+
+	MEM(result = talloc_zero(t, rlm_icmp_result_t));
+	result->t = t;
+	result->ip = *ip;
+	result->replied = replied;
+	result->expires = fr_time() + t->inst->cache_ttl;
+
+	if (!rbtree_insert(t->cache, result)) {
+		talloc_free(result);
+		return;
+	}
+	fr_dlist_insert_tail(&t->cache_expiry, result);
+	talloc_set_destructor(result, _icmp_result_free);
+}
+
+/** Remove an echo from the tracking tables, and detach any requests still waiting for it
+ *
+ */
+static int _icmp_echo_free(rlm_icmp_echo_t *echo)
+{
+	rlm_icmp_thread_t	*t = echo->t;
+	rlm_icmp_wait_t		*wait;
+
+	(void) rbtree_deletebydata(t->tree, echo);
+	(void) rbtree_deletebydata(t->inflight, echo);
+	if (fr_dlist_entry_in_list(&echo->entry)) fr_dlist_remove(&t->pending, echo);
+
+	while ((wait = fr_dlist_pop_head(&echo->waiting))) wait->echo = NULL;
+
+	return 0;
+}
+
+/** Give every request waiting for an echo its result, and free the echo
+ *
+ */
+static void icmp_echo_done(rlm_icmp_echo_t *echo)
+{
+	rlm_icmp_wait_t *wait;
+
+	if (!echo->failed) icmp_cache_add(echo->t, &echo->ip, echo->replied);
+
+	while ((wait = fr_dlist_pop_head(&echo->waiting))) {
+		request_t *request = wait->request;
+
+		if (!echo->replied && !echo->failed) {
+			RDEBUG2("No response to ICMP request for %pV (counter=%d)",
+				fr_box_ipaddr(echo->ip), echo->counter);
+		}
+
+		wait->replied = echo->replied;
+		wait->failed = echo->failed;
+		wait->echo = NULL;
+
+		unlang_interpret_resumable(request);
+	}
+
+	talloc_free(echo);
+}
+
+static void _icmp_echo_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_icmp_echo_t *echo = talloc_get_type_abort(uctx, rlm_icmp_echo_t);
+
+	icmp_echo_done(echo);
+}
+
+static int _icmp_wait_free(rlm_icmp_wait_t *wait)
+{
+	if (wait->echo) fr_dlist_remove(&wait->echo->waiting, wait);
+
+	return 0;
+}
+
 static xlat_action_t xlat_icmp_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
 				      UNUSED request_t *request,
-				      UNUSED void const *xlat_inst, void *xlat_thread_inst,
+				      UNUSED void const *xlat_inst, UNUSED void *xlat_thread_inst,
 				      UNUSED fr_value_box_t **in, void *rctx)
 {
-	rlm_icmp_echo_t *echo = talloc_get_type_abort(rctx, rlm_icmp_echo_t);
-	xlat_icmp_thread_inst_t	*thread = talloc_get_type_abort(xlat_thread_inst, xlat_icmp_thread_inst_t);
+	rlm_icmp_wait_t *wait = talloc_get_type_abort(rctx, rlm_icmp_wait_t);
 	fr_value_box_t	*vb;
 
+	if (wait->failed) {
+		talloc_free(wait);
+		return XLAT_ACTION_FAIL;
+	}
+
 	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_BOOL, NULL, false));
-	vb->vb_bool = echo->replied;
+	vb->vb_bool = wait->replied;
 
-	(void) rbtree_deletebydata(thread->t->tree, echo);
-	talloc_free(echo);
+	talloc_free(wait);
 
 	fr_cursor_insert(out, vb);
 
 	return XLAT_ACTION_DONE;
 }
 
-static void xlat_icmp_cancel(request_t *request, UNUSED void *xlat_inst, void *xlat_thread_inst,
+static void xlat_icmp_cancel(request_t *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
 			     void *rctx, fr_state_signal_t action)
 {
-	rlm_icmp_echo_t *echo = talloc_get_type_abort(rctx, rlm_icmp_echo_t);
-	xlat_icmp_thread_inst_t	*thread = talloc_get_type_abort(xlat_thread_inst, xlat_icmp_thread_inst_t);
+	rlm_icmp_wait_t *wait = talloc_get_type_abort(rctx, rlm_icmp_wait_t);
 
 	if (action != FR_SIGNAL_CANCEL) return;
 
-	RDEBUG2("Cancelling ICMP request for %pV (counter=%d)", echo->ip, echo->counter);
-
-	(void) rbtree_deletebydata(thread->t->tree, echo);
-	talloc_free(echo);
-}
-
-
-static void _xlat_icmp_timeout(request_t *request,
-			     UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst, void *rctx, UNUSED fr_time_t fired)
-{
-	rlm_icmp_echo_t *echo = talloc_get_type_abort(rctx, rlm_icmp_echo_t);
-
-	if (echo->replied) return; /* it MUST already have been marked resumable. */
-
-	RDEBUG2("No response to ICMP request for %pV (counter=%d)", echo->ip, echo->counter);
+	if (wait->echo) {
+		RDEBUG2("Cancelling ICMP request for %pV (counter=%d)",
+			fr_box_ipaddr(wait->echo->ip), wait->echo->counter);
+	}
 
-	unlang_interpret_resumable(request);
+	/*
+	 *	The echo carries on, as other requests may be
+	 *	waiting for it, and the result can be cached.
+	 */
+	talloc_free(wait);
 }
 
 /** Xlat to delay the request
@@ -178,19 +350,18 @@ static void _xlat_icmp_timeout(request_t *request,
  *
  * @ingroup xlat_functions
  */
-static xlat_action_t xlat_icmp(TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
+static xlat_action_t xlat_icmp(TALLOC_CTX *ctx, fr_cursor_t *out,
 			       request_t *request, void const *xlat_inst, void *xlat_thread_inst,
 			       fr_value_box_t **in)
 {
 	void			*instance;
 	rlm_icmp_t const	*inst;
 	xlat_icmp_thread_inst_t	*thread = talloc_get_type_abort(xlat_thread_inst, xlat_icmp_thread_inst_t);
+	rlm_icmp_thread_t	*t = thread->t;
 	rlm_icmp_echo_t		*echo;
-	icmp_header_t		icmp;
-	uint16_t		checksum;
-	ssize_t			rcode;
-	socklen_t      		salen;
-	struct sockaddr_storage	dst;
+	rlm_icmp_wait_t		*wait;
+	rlm_icmp_result_t	*result;
+	fr_value_box_t		*vb;
 
 	memcpy(&instance, xlat_inst, sizeof(instance));	/* Stupid const issues */
 
@@ -206,47 +377,145 @@ static xlat_action_t xlat_icmp(TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
 		return XLAT_ACTION_FAIL;
 	}
 
-	if (fr_value_box_cast_in_place(ctx, *in, thread->t->ipaddr_type, NULL) < 0) {
+	if (fr_value_box_cast_in_place(ctx, *in, t->ipaddr_type, NULL) < 0) {
 		RPEDEBUG("Failed casting result to IP address");
 		return XLAT_ACTION_FAIL;
 	}
 
-	MEM(echo = talloc_zero(ctx, rlm_icmp_echo_t));
-	echo->ip = *in;
-	echo->request = request;
-	echo->counter = thread->t->counter++;
+	t->lookups++;
 
 	/*
-	 *	Add the IP to the local tracking heap, so that the IO
-	 *	functions can find it.
-	 *
-	 *	This insert will never fail, because of the unique
-	 *	counter above.
+	 *	We pinged this IP very recently, so use that result.
+	 */
+	result = icmp_cache_find(t, &(*in)->vb_ip, fr_time());
+	if (result) {
+		RDEBUG2("Using cached ICMP result for %pV", *in);
+
+		MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_BOOL, NULL, false));
+		vb->vb_bool = result->replied;
+		fr_cursor_insert(out, vb);
+
+		return XLAT_ACTION_DONE;
+	}
+
+	/*
+	 *	If there's already an echo outstanding for this IP,
+	 *	wait for its result, instead of sending another.
 	 */
-	if (!rbtree_insert(thread->t->tree, echo)) {
-		RPEDEBUG("Failed inserting IP into tracking table");
-		talloc_free(echo);
+	echo = rbtree_finddata(t->inflight, &(rlm_icmp_echo_t){ .ip = (*in)->vb_ip });
+	if (echo) {
+		RDEBUG("Waiting for existing ICMP request to %pV (counter=%d)", *in, echo->counter);
+	} else {
+		MEM(echo = talloc_zero(t, rlm_icmp_echo_t));
+		echo->t = t;
+		echo->ip = (*in)->vb_ip;
+		echo->counter = t->counter++;
+		fr_dlist_init(&echo->waiting, rlm_icmp_wait_t, entry);
+		fr_dlist_entry_init(&echo->entry);
+
+		/*
+		 *	Add the IP to the local tracking heap, so that the IO
+		 *	functions can find it.
+		 *
+		 *	This insert will never fail, because of the unique
+		 *	counter above.
+		 */
+		if (!rbtree_insert(t->tree, echo) || !rbtree_insert(t->inflight, echo)) {
+			RPEDEBUG("Failed inserting IP into tracking table");
+			(void) rbtree_deletebydata(t->tree, echo);
+			talloc_free(echo);
+			return XLAT_ACTION_FAIL;
+		}
+		talloc_set_destructor(echo, _icmp_echo_free);
+
+		if (fr_event_timer_in(echo, t->el, &echo->ev, inst->timeout, _icmp_echo_timeout, echo) < 0) {
+			RPEDEBUG("Failed adding timeout");
+			talloc_free(echo);
+			return XLAT_ACTION_FAIL;
+		}
+
+		RDEBUG("Sending ICMP request to %pV (counter=%d)", *in, echo->counter);
+
+		/*
+		 *	Sent with any other new echoes, at the end
+		 *	of this pass of the event loop.
+		 */
+		fr_dlist_insert_tail(&t->pending, echo);
+	}
+
+	MEM(wait = talloc_zero(ctx, rlm_icmp_wait_t));
+	wait->request = request;
+	wait->echo = echo;
+	fr_dlist_insert_tail(&echo->waiting, wait);
+	talloc_set_destructor(wait, _icmp_wait_free);
+
+	return unlang_xlat_yield(request, xlat_icmp_resume, xlat_icmp_cancel, wait);
+}
+
+/** Return one of this thread's counters
+ *
+ * "lookups" is the number of times the xlat was called, and "sent"
+ * is the number of ICMP requests sent.  Pings which wait for an
+ * outstanding echo, or use a cached result, don't send anything.
+ *
+ * Example:
+@verbatim
+"%{icmp_stats:sent}"
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_icmp_stats(TALLOC_CTX *ctx, fr_cursor_t *out,
+				     request_t *request, UNUSED void const *xlat_inst, void *xlat_thread_inst,
+				     fr_value_box_t **in)
+{
+	xlat_icmp_thread_inst_t	*thread = talloc_get_type_abort(xlat_thread_inst, xlat_icmp_thread_inst_t);
+	rlm_icmp_thread_t	*t = thread->t;
+	fr_value_box_t		*vb;
+
+	if (!*in) {
+		REDEBUG("Missing counter name, expected \"lookups\" or \"sent\"");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
+		RPEDEBUG("Failed concatenating input");
 		return XLAT_ACTION_FAIL;
 	}
 
-	if (unlang_xlat_event_timeout_add(request, _xlat_icmp_timeout, echo, fr_time() + inst->timeout) < 0) {
-		RPEDEBUG("Failed adding timeout");
-		(void) rbtree_deletebydata(thread->t->tree, echo);
-		talloc_free(echo);
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT64, NULL, false));
+
+	if (strcmp((*in)->vb_strvalue, "lookups") == 0) {
+		vb->vb_uint64 = t->lookups;
+
+	} else if (strcmp((*in)->vb_strvalue, "sent") == 0) {
+		vb->vb_uint64 = t->sent;
+
+	} else {
+		REDEBUG("Unknown counter \"%s\", expected \"lookups\" or \"sent\"", (*in)->vb_strvalue);
+		talloc_free(vb);
 		return XLAT_ACTION_FAIL;
 	}
 
-	RDEBUG("Sending ICMP request to %pV (counter=%d)", echo->ip, echo->counter);
+	fr_cursor_insert(out, vb);
 
-	icmp = (icmp_header_t) {
-		.type = thread->t->request_type,
-		.ident = thread->t->ident,
-		.data = thread->t->data,
+	return XLAT_ACTION_DONE;
+}
+
+/** Fill in the ICMP request for an echo
+ *
+ */
+static void icmp_request_init(rlm_icmp_thread_t *t, rlm_icmp_echo_t *echo, icmp_header_t *icmp)
+{
+	uint16_t checksum;
+
+	*icmp = (icmp_header_t) {
+		.type = t->request_type,
+		.ident = t->ident,
+		.data = t->data,
 		.counter = echo->counter
 	};
 
-	(void) fr_ipaddr_to_sockaddr(&dst, &salen, &echo->ip->vb_ip, 0);
-
 	/*
 	 *	Calculate the checksum
 	 */
@@ -255,43 +524,115 @@ static xlat_action_t xlat_icmp(TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
 	/*
 	 *	Start off with the IPv6 pseudo-header checksum
 	 */
-	if (thread->t->ipaddr_type == FR_TYPE_IPV6_ADDR) {
-		checksum = fr_ip6_pesudo_header_checksum(&thread->t->inst->src_ipaddr.addr.v6, &echo->ip->vb_ip.addr.v6,
-							 sizeof(ip_header6_t) + sizeof(icmp), IPPROTO_ICMPV6);
+	if (t->ipaddr_type == FR_TYPE_IPV6_ADDR) {
+		checksum = fr_ip6_pesudo_header_checksum(&t->inst->src_ipaddr.addr.v6, &echo->ip.addr.v6,
+							 sizeof(ip_header6_t) + sizeof(*icmp), IPPROTO_ICMPV6);
 	}
 
 	/*
 	 *	Followed by checksumming the actual ICMP packet.
 	 */
-	icmp.checksum = htons(icmp_checksum((uint8_t *) &icmp, sizeof(icmp), checksum));
+	icmp->checksum = htons(icmp_checksum((uint8_t *) icmp, sizeof(*icmp), checksum));
+}
 
-	rcode = sendto(thread->t->fd, &icmp, sizeof(icmp), 0, (struct sockaddr *) &dst, salen);
-	if (rcode < 0) {
-		REDEBUG("Failed sending ICMP request to %pV: %s", echo->ip, fr_syserror(errno));
-		(void) rbtree_deletebydata(thread->t->tree, echo);
-		talloc_free(echo);
-		return XLAT_ACTION_FAIL;
-	}
+/** Send the echoes created during this pass of the event loop
+ *
+ * With sendmmsg(), each batch of ICMP requests is sent with one
+ * system call.
+ */
+static void mod_icmp_flush(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_icmp_thread_t	*t = talloc_get_type_abort(uctx, rlm_icmp_thread_t);
+	rlm_icmp_t		*inst = t->inst;
+	rlm_icmp_echo_t		*batch[ICMP_BATCH];
+	icmp_header_t		icmp[ICMP_BATCH];
+	struct sockaddr_storage	dst[ICMP_BATCH];
+	socklen_t		salen[ICMP_BATCH];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr		msg[ICMP_BATCH];
+	struct iovec		iov[ICMP_BATCH];
+#endif
+	unsigned int		i, num, sent;
 
-	if ((size_t) rcode < sizeof(icmp)) {
-		REDEBUG("Failed sending entire ICMP packet");
-		(void) rbtree_deletebydata(thread->t->tree, echo);
-		talloc_free(echo);
-		return XLAT_ACTION_FAIL;
-	}
+	while (!fr_dlist_empty(&t->pending)) {
+		for (num = 0; num < ICMP_BATCH; num++) {
+			rlm_icmp_echo_t *echo;
 
-	return unlang_xlat_yield(request, xlat_icmp_resume, xlat_icmp_cancel, echo);
-}
+			echo = fr_dlist_pop_head(&t->pending);
+			if (!echo) break;
 
-static int echo_cmp(void const *one, void const *two)
-{
-	rlm_icmp_echo_t const *a = one;
-	rlm_icmp_echo_t const *b = two;
+			icmp_request_init(t, echo, &icmp[num]);
+			(void) fr_ipaddr_to_sockaddr(&dst[num], &salen[num], &echo->ip, 0);
+			batch[num] = echo;
+		}
 
-	/*
-	 *	No need to check IP, because "counter" is unique for each packet.
-	 */
-	return (a->counter < b->counter) - (a->counter > b->counter);
+		sent = 0;
+
+#ifdef HAVE_SENDMMSG
+		for (i = 0; i < num; i++) {
+			iov[i].iov_base = &icmp[i];
+			iov[i].iov_len = sizeof(icmp[i]);
+
+			memset(&msg[i], 0, sizeof(msg[i]));
+			msg[i].msg_hdr.msg_name = &dst[i];
+			msg[i].msg_hdr.msg_namelen = salen[i];
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		while (sent < num) {
+			int rcode;
+
+			rcode = sendmmsg(t->fd, &msg[sent], num - sent, 0);
+			if (rcode < 0) {
+				if (errno == EINTR) continue;
+
+				/*
+				 *	Fail the echo which couldn't be
+				 *	sent, and carry on with the rest.
+				 */
+				ERROR("Failed sending ICMP request to %pV: %s",
+				      fr_box_ipaddr(batch[sent]->ip), fr_syserror(errno));
+				batch[sent]->failed = true;
+				icmp_echo_done(batch[sent]);
+				sent++;
+				continue;
+			}
+
+			for (i = sent; i < sent + rcode; i++) {
+				if (msg[i].msg_len < sizeof(icmp[i])) {
+					ERROR("Failed sending entire ICMP packet");
+					batch[i]->failed = true;
+					icmp_echo_done(batch[i]);
+					continue;
+				}
+				t->sent++;
+			}
+			sent += rcode;
+		}
+#else
+		for (i = 0; i < num; i++) {
+			ssize_t rcode;
+
+			rcode = sendto(t->fd, &icmp[i], sizeof(icmp[i]), 0, (struct sockaddr *) &dst[i], salen[i]);
+			if (rcode < 0) {
+				ERROR("Failed sending ICMP request to %pV: %s",
+				      fr_box_ipaddr(batch[i]->ip), fr_syserror(errno));
+				batch[i]->failed = true;
+				icmp_echo_done(batch[i]);
+				continue;
+			}
+
+			if ((size_t) rcode < sizeof(icmp[i])) {
+				ERROR("Failed sending entire ICMP packet");
+				batch[i]->failed = true;
+				icmp_echo_done(batch[i]);
+				continue;
+			}
+			t->sent++;
+		}
+#endif
+	}
 }
 
 static void mod_icmp_read(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUSED int flags, void *ctx)
@@ -369,13 +710,11 @@ static void mod_icmp_read(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUSED
 		return;
 	}
 
-	(void) rbtree_deletebydata(t->tree, echo);
-
 	/*
-	 *	We have a reply!
+	 *	We have a reply!  Tell everyone who's waiting.
 	 */
 	echo->replied = true;
-	unlang_interpret_resumable(echo->request);
+	icmp_echo_done(echo);
 }
 
 static void mod_icmp_error(fr_event_list_t *el, UNUSED int sockfd, UNUSED int flags,
@@ -430,6 +769,10 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
 	fr_ipaddr_t ipaddr, *src;
 
 	MEM(t->tree = rbtree_alloc(t, echo_cmp, NULL, RBTREE_FLAG_NONE));
+	MEM(t->inflight = rbtree_alloc(t, echo_ip_cmp, NULL, RBTREE_FLAG_NONE));
+	MEM(t->cache = rbtree_alloc(t, result_cmp, NULL, RBTREE_FLAG_NONE));
+	fr_dlist_init(&t->pending, rlm_icmp_echo_t, entry);
+	fr_dlist_init(&t->cache_expiry, rlm_icmp_result_t, entry);
 	t->inst = inst;
 	t->el = el;
 
@@ -528,6 +871,14 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
 	}
 	t->fd = fd;
 
+	if (fr_event_post_insert(el, mod_icmp_flush, t) < 0) {
+		fr_strerror_printf_push("Failed adding ICMP flush callback to event loop");
+		(void) fr_event_fd_delete(el, fd, FR_EVENT_FILTER_IO);
+		close(fd);
+		t->fd = -1;
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -535,6 +886,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
 	rlm_icmp_t *inst = instance;
 	xlat_t const *xlat;
+	char *stats_name;
 
 	inst->xlat_name = cf_section_name2(conf);
 	if (!inst->xlat_name) inst->xlat_name = cf_section_name1(conf);
@@ -544,8 +896,19 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	xlat_async_instantiate_set(xlat, mod_xlat_instantiate, rlm_icmp_t *, NULL, inst);
 	xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, xlat_icmp_thread_inst_t, NULL, inst);
 
+	/*
+	 *	Counters, so that it's possible to see how many
+	 *	pings were coalesced, or answered from the cache.
+	 */
+	stats_name = talloc_typed_asprintf(inst, "%s_stats", inst->xlat_name);
+	xlat = xlat_register(inst, stats_name, xlat_icmp_stats, false);
+	xlat_async_instantiate_set(xlat, mod_xlat_instantiate, rlm_icmp_t *, NULL, inst);
+	xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, xlat_icmp_thread_inst_t, NULL, inst);
+	talloc_free(stats_name);
+
 	FR_TIME_DELTA_BOUND_CHECK("timeout", inst->timeout, >=, fr_time_delta_from_msec(100)); /* 1/10s minimum timeout */
 	FR_TIME_DELTA_BOUND_CHECK("timeout", inst->timeout, <=, fr_time_delta_from_sec(10));
+	FR_TIME_DELTA_BOUND_CHECK("cache_ttl", inst->cache_ttl, <=, fr_time_delta_from_sec(60));
 
 #ifdef __linux__
 #  ifndef HAVE_CAPABILITY_H
@@ -571,6 +934,11 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 static int mod_thread_detach(fr_event_list_t *el, void *thread)
 {
 	rlm_icmp_thread_t *t = talloc_get_type_abort(thread, rlm_icmp_thread_t);
+	rlm_icmp_t *inst = t->inst;
+
+	DEBUG2("%" PRIu64 " lookups, %" PRIu64 " ICMP requests sent", t->lookups, t->sent);
+
+	(void) fr_event_post_delete(el, mod_icmp_flush, t);
 
 	if (t->fd < 0) return 0;
 
@@ -103,6 +103,7 @@ typedef struct {
 		char const		*group_str;		//!< Group to set on new files.
 		gid_t			group;			//!< Resolved gid.
 		exfile_t		*ef;			//!< Exclusive file access handle.
+		exfile_writer_conf_t	writer;			//!< Asynchronous writer configuration.
 		bool			escape;			//!< Do filename escaping, yes / no.
 		xlat_escape_legacy_t	escape_func;		//!< Escape function.
 	} file;
@@ -128,6 +129,7 @@ static const CONF_PARSER file_config[] = {
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_linelog_t, file.permissions), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", FR_TYPE_STRING, rlm_linelog_t, file.group_str) },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_linelog_t, file.escape), .dflt = "no" },
+	{ FR_CONF_OFFSET("writer", FR_TYPE_SUBSECTION, rlm_linelog_t, file.writer), .subcs = (void const *) exfile_writer_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -329,6 +331,12 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 			return -1;
 		}
 
+		if (exfile_writer_start(inst->file.ef, &inst->file.writer) < 0) {
+			cf_log_perr(conf, "Failed starting writer");
+			return -1;
+		}
+
+		inst->file.group = (gid_t) -1;
 		if (inst->file.group_str) {
 			char *endptr;
 
@@ -643,7 +651,6 @@ build_vector:
 	switch (inst->log_dst) {
 	case LINELOG_DST_FILE:
 	{
-		int fd = -1;
 		char path[2048];
 
 		if (xlat_eval(path, sizeof(path), request, inst->file.name, inst->file.escape_func, NULL) < 0) {
@@ -662,28 +669,12 @@ build_vector:
 			*p = '/';
 		}
 
-		fd = exfile_open(inst->file.ef, request, path, inst->file.permissions);
-		if (fd < 0) {
-			RERROR("Failed to open %s: %s", path, fr_syserror(errno));
+		if (exfile_write(inst->file.ef, request, path, inst->file.permissions, inst->file.group,
+				 vector_p, vector_len) < 0) {
+			RPERROR("Failed writing to \"%s\"", path);
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
-
-		if (inst->file.group_str && (chown(path, -1, inst->file.group) == -1)) {
-			RPWARN("Unable to change system group of \"%s\": %s", path, fr_strerror());
-		}
-
-		if (writev(fd, vector_p, vector_len) < 0) {
-			RERROR("Failed writing to \"%s\": %s", path, fr_syserror(errno));
-			exfile_close(inst->file.ef, request, fd);
-
-			/* Assert on the extra fatal errors */
-			fr_assert((errno != EINVAL) && (errno != EFAULT));
-
-			RETURN_MODULE_FAIL;
-		}
-
-		exfile_close(inst->file.ef, request, fd);
 	}
 		break;
 
@@ -0,0 +1,3 @@
+SUBMAKEFILES := \
+	rlm_mem_ippool.mk \
+	mem_ippool_tests.mk
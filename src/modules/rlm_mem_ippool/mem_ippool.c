@@ -0,0 +1,1319 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file mem_ippool.c
+ * @brief In-memory IP pools, with an append-only journal.
+ *
+ * Each pool is split into shards.  Every address belongs to exactly one
+ * shard at a time, and each shard has its own lock, free list, expiry heap
+ * and owner index.  Leases are always held by the shard selected by the
+ * hash of their owner, so requests for different owners rarely contend.
+ * When a shard runs out of addresses it takes free addresses from another
+ * shard.
+ *
+ * Changes are appended to a journal by a write-behind thread, which also
+ * periodically writes a snapshot of all leases, and starts a new journal.
+ * On startup the snapshot and journals are replayed.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/heap.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include "mem_ippool.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define CACHE_LINE_SIZE		64
+
+#define JOURNAL_MAGIC		"FRMIPJ01"
+#define JOURNAL_MAGIC_LEN	(sizeof(JOURNAL_MAGIC) - 1)
+#define JOURNAL_FLUSH_SIZE	(1024 * 1024)	//!< Wake the writer when this much is pending.
+
+typedef struct {
+	fr_ipaddr_t		start;		//!< First address in the range.
+	uint32_t		first;		//!< Index of the first address in the range.
+	uint32_t		num;		//!< Number of addresses in the range.
+} mem_ippool_range_t;
+
+typedef struct {
+	char			*owner;		//!< Of the lease.  NULL if the address is free.
+	char			*gateway;	//!< Of the lease owner.
+	fr_unix_time_t		expires;	//!< When the lease expires.
+	uint32_t		index;		//!< Of the address in the pool.
+	uint32_t		counter;	//!< How many times the address has been allocated.
+	atomic_uint_fast32_t	shard;		//!< Which currently holds this address.
+	int32_t			heap_id;	//!< Position in the shard's expiry heap.
+	fr_dlist_t		entry;		//!< Entry in the shard's free list.
+} mem_ippool_lease_t;
+
+typedef struct CC_HINT(aligned(CACHE_LINE_SIZE)) {
+	pthread_mutex_t		mutex;		//!< Protects everything in the shard.
+	TALLOC_CTX		*ctx;		//!< Everything the shard allocates is parented here.
+	fr_dlist_head_t		free;		//!< Addresses never leased, or released.
+	fr_heap_t		*expiry;	//!< Leased addresses, soonest expiry first.
+	fr_hash_table_t		*owners;	//!< Leased addresses, indexed by owner.
+	uint64_t		rebalanced;	//!< Addresses taken from other shards.
+} mem_ippool_shard_t;
+
+struct mem_ippool_s {
+	char const		*name;		//!< Of the pool.
+	mem_ippool_range_t	*ranges;	//!< Address ranges, in index order.
+	uint32_t		num;		//!< Total number of addresses.
+	mem_ippool_lease_t	*leases;	//!< One per address.
+	mem_ippool_shard_t	*shards;
+	uint32_t		num_shards;
+	mem_ippool_journal_t	*journal;	//!< To record changes in.  May be NULL.
+};
+
+typedef enum {
+	JOURNAL_OP_SET = 1,			//!< Lease was allocated or updated.
+	JOURNAL_OP_CLEAR = 2			//!< Lease was released.
+} mem_ippool_journal_op_t;
+
+/** Journal record header
+ *
+ * Followed by the pool name, owner and gateway.  Records are written in
+ * host byte order, so journals can't be moved between architectures.
+ */
+typedef struct {
+	uint8_t			op;		//!< One of #mem_ippool_journal_op_t.
+	uint8_t			af;		//!< Of the address.
+	uint8_t			pool_len;	//!< Length of the pool name.
+	uint8_t			reserved;
+	uint16_t		owner_len;	//!< Length of the owner.
+	uint16_t		gateway_len;	//!< Length of the gateway.
+	uint64_t		expires;	//!< When the lease expires.
+	uint32_t		counter;	//!< How many times the address has been allocated.
+	uint8_t			addr[16];	//!< The address, in network byte order.
+} mem_ippool_record_t;
+
+struct mem_ippool_journal_s {
+	char const		*filename;	//!< Of the current journal.
+	char			*rotate;	//!< Journal being written while a snapshot is taken.
+	char			*snapshot;	//!< Last complete snapshot.
+	char			*snapshot_tmp;	//!< Snapshot being written.
+
+	bool			sync;		//!< fsync() after every write.
+	fr_time_delta_t		flush_interval;	//!< Maximum time records wait to be written.
+	fr_time_delta_t		snapshot_interval;	//!< How often to write a snapshot.
+
+	int			fd;		//!< Of the current journal.
+	bool			rotated;	//!< fd is writing to the rotate file, which hasn't
+						///< yet replaced the journal.
+
+	pthread_mutex_t		mutex;		//!< Protects pending and stop.
+	pthread_cond_t		cond;		//!< Signalled to wake the writer.
+	uint8_t			*pending;	//!< Records waiting to be written (malloc'd).
+	size_t			pending_len;	//!< Bytes used in pending.
+	size_t			pending_size;	//!< Size of pending.
+	bool			stop;		//!< Tells the writer to exit.
+
+	pthread_t		thread;		//!< Writer thread.
+	bool			running;	//!< Whether the writer thread was started.
+
+	mem_ippool_t		**pools;	//!< Pools recorded in this journal.
+};
+
+static uint32_t lease_owner_hash(void const *data)
+{
+	mem_ippool_lease_t const *lease = data;
+
+	return fr_hash_string(lease->owner);
+}
+
+static int lease_owner_cmp(void const *one, void const *two)
+{
+	mem_ippool_lease_t const *a = one, *b = two;
+
+	return strcmp(a->owner, b->owner);
+}
+
+static int8_t lease_expiry_cmp(void const *one, void const *two)
+{
+	mem_ippool_lease_t const *a = one, *b = two;
+
+	return STABLE_COMPARE(a->expires, b->expires);
+}
+
+/** Return a pointer to the bytes of an address, and its length
+ *
+ */
+static inline CC_HINT(always_inline) uint8_t *ipaddr_bytes(fr_ipaddr_t *ip, size_t *len)
+{
+	if (ip->af == AF_INET) {
+		*len = 4;
+		return (uint8_t *)&ip->addr.v4.s_addr;
+	}
+
+	*len = 16;
+	return ip->addr.v6.s6_addr;
+}
+
+/** Convert an index into an address
+ *
+ */
+static void lease_ipaddr(fr_ipaddr_t *out, mem_ippool_t const *pool, uint32_t index)
+{
+	mem_ippool_range_t const	*range = pool->ranges;
+	size_t				i, len;
+	uint8_t				*p;
+
+	for (i = 0; i < talloc_array_length(pool->ranges); i++) {
+		if ((index >= pool->ranges[i].first) && (index < (pool->ranges[i].first + pool->ranges[i].num))) {
+			range = &pool->ranges[i];
+			break;
+		}
+	}
+
+	*out = range->start;
+	p = ipaddr_bytes(out, &len);
+	fr_net_from_uint32(p + len - 4, fr_net_to_uint32(p + len - 4) + (index - range->first));
+	out->prefix = len * 8;
+}
+
+/** Convert an address into an index
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the address is not in the pool.
+ */
+static int lease_index(uint32_t *out, mem_ippool_t const *pool, fr_ipaddr_t const *ip)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(pool->ranges); i++) {
+		mem_ippool_range_t const	*range = &pool->ranges[i];
+		uint32_t			low, start;
+
+		if (range->start.af != ip->af) continue;
+
+		/*
+		 *	Ranges only vary in the last 32 bits.
+		 */
+		if ((ip->af == AF_INET6) &&
+		    (memcmp(ip->addr.v6.s6_addr, range->start.addr.v6.s6_addr, 12) != 0)) continue;
+
+		low = mem_ippool_ipaddr_low(ip);
+		start = mem_ippool_ipaddr_low(&range->start);
+		if ((low < start) || ((low - start) >= range->num)) continue;
+
+		*out = range->first + (low - start);
+		return 0;
+	}
+
+	return -1;
+}
+
+static inline CC_HINT(always_inline) uint32_t owner_shard(mem_ippool_t const *pool, char const *owner)
+{
+	return fr_hash_string(owner) % pool->num_shards;
+}
+
+/** Lock the shard currently holding a lease
+ *
+ * Free leases may be moved between shards, so we check the lease is
+ * still held by the same shard once we have the lock.
+ */
+static mem_ippool_shard_t *lease_lock(mem_ippool_t *pool, mem_ippool_lease_t *lease)
+{
+	for (;;) {
+		uint32_t		id = atomic_load_explicit(&lease->shard, memory_order_acquire);
+		mem_ippool_shard_t	*s = &pool->shards[id];
+
+		pthread_mutex_lock(&s->mutex);
+		if (atomic_load_explicit(&lease->shard, memory_order_relaxed) == id) return s;
+		pthread_mutex_unlock(&s->mutex);
+	}
+}
+
+/** Find a lease by its owner
+ *
+ */
+static inline CC_HINT(always_inline) mem_ippool_lease_t *lease_by_owner(mem_ippool_shard_t *s, char const *owner)
+{
+	char *p;
+
+	memcpy(&p, &owner, sizeof(p));
+
+	return fr_hash_table_find_by_data(s->owners, &(mem_ippool_lease_t){ .owner = p });
+}
+
+/** Remove the owner of a lease, leaving the address unattached to any list
+ *
+ */
+static void lease_clear(mem_ippool_shard_t *s, mem_ippool_lease_t *lease)
+{
+	if (!lease->owner) return;
+
+	fr_heap_extract(s->expiry, lease);
+	fr_hash_table_yank(s->owners, lease);
+	TALLOC_FREE(lease->owner);
+	TALLOC_FREE(lease->gateway);
+}
+
+/** Set the owner, gateway and expiry of a lease
+ *
+ * The lease must either be owned, or have been removed from the free list.
+ */
+static void lease_set(mem_ippool_shard_t *s, mem_ippool_lease_t *lease,
+		      char const *owner, char const *gateway, fr_unix_time_t expires)
+{
+	if (lease->owner) {
+		fr_heap_extract(s->expiry, lease);
+
+		if (strcmp(lease->owner, owner) != 0) {
+			fr_hash_table_yank(s->owners, lease);
+			TALLOC_FREE(lease->owner);
+		}
+	}
+
+	if (!lease->owner) {
+		MEM(lease->owner = talloc_typed_strdup(s->ctx, owner));
+		fr_hash_table_insert(s->owners, lease);
+	}
+
+	if (gateway && (!lease->gateway || (strcmp(lease->gateway, gateway) != 0))) {
+		talloc_free(lease->gateway);
+		MEM(lease->gateway = talloc_typed_strdup(s->ctx, gateway));
+	}
+
+	lease->expires = expires;
+	fr_heap_insert(s->expiry, lease);
+}
+
+/** Append a record to the journal
+ *
+ * Must be called with the shard lock held, so that the records for an
+ * address are written in the order the changes were made.
+ */
+static void journal_append(mem_ippool_journal_t *j, mem_ippool_t const *pool,
+			   mem_ippool_journal_op_t op, mem_ippool_lease_t const *lease, fr_ipaddr_t const *ip)
+{
+	mem_ippool_record_t	rec;
+	size_t			pool_len, owner_len = 0, gateway_len = 0, len;
+	uint8_t			*p;
+
+	pool_len = strlen(pool->name);
+	if (op == JOURNAL_OP_SET) {
+		owner_len = strlen(lease->owner);
+		if (lease->gateway) gateway_len = strlen(lease->gateway);
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	rec.af = ip->af;
+	rec.pool_len = pool_len;
+	rec.owner_len = owner_len;
+	rec.gateway_len = gateway_len;
+	rec.expires = lease->expires;
+	rec.counter = lease->counter;
+	if (ip->af == AF_INET) {
+		memcpy(rec.addr, &ip->addr.v4.s_addr, 4);
+	} else {
+		memcpy(rec.addr, ip->addr.v6.s6_addr, 16);
+	}
+
+	len = sizeof(rec) + pool_len + owner_len + gateway_len;
+
+	pthread_mutex_lock(&j->mutex);
+	if ((j->pending_len + len) > j->pending_size) {
+		size_t	size = j->pending_size ? j->pending_size * 2 : JOURNAL_FLUSH_SIZE;
+		uint8_t	*pending;
+
+		while (size < (j->pending_len + len)) size *= 2;
+
+		pending = realloc(j->pending, size);
+		if (!pending) {
+			pthread_mutex_unlock(&j->mutex);
+			ERROR("Out of memory, dropping journal record for pool \"%s\"", pool->name);
+			return;
+		}
+		j->pending = pending;
+		j->pending_size = size;
+	}
+
+	p = j->pending + j->pending_len;
+	memcpy(p, &rec, sizeof(rec));
+	p += sizeof(rec);
+	memcpy(p, pool->name, pool_len);
+	p += pool_len;
+	if (owner_len) {
+		memcpy(p, lease->owner, owner_len);
+		p += owner_len;
+	}
+	if (gateway_len) memcpy(p, lease->gateway, gateway_len);
+	j->pending_len += len;
+
+	if (j->pending_len >= JOURNAL_FLUSH_SIZE) pthread_cond_signal(&j->cond);
+	pthread_mutex_unlock(&j->mutex);
+}
+
+static inline CC_HINT(always_inline) void lease_journal(mem_ippool_t const *pool, mem_ippool_journal_op_t op,
+							 mem_ippool_lease_t const *lease)
+{
+	fr_ipaddr_t ip;
+
+	if (!pool->journal) return;
+
+	lease_ipaddr(&ip, pool, lease->index);
+	journal_append(pool->journal, pool, op, lease, &ip);
+}
+
+/** Move free addresses from one shard to another
+ *
+ * Both shards must be locked.
+ *
+ * @return the number of addresses moved.
+ */
+static uint32_t shard_steal(mem_ippool_shard_t *to, uint32_t to_id, mem_ippool_shard_t *from, fr_unix_time_t now)
+{
+	mem_ippool_lease_t	*lease;
+	uint32_t		moved = 0, count;
+
+	/*
+	 *	Take half of the other shard's free addresses
+	 */
+	count = (fr_dlist_num_elements(&from->free) + 1) / 2;
+	while ((moved < count) && (lease = fr_dlist_head(&from->free))) {
+		fr_dlist_remove(&from->free, lease);
+		atomic_store_explicit(&lease->shard, to_id, memory_order_release);
+		fr_dlist_insert_tail(&to->free, lease);
+		moved++;
+	}
+	if (moved) return moved;
+
+	/*
+	 *	...or some of its expired leases.
+	 */
+	while ((moved < 16) && (lease = fr_heap_peek(from->expiry)) && (lease->expires <= now)) {
+		lease_clear(from, lease);
+		atomic_store_explicit(&lease->shard, to_id, memory_order_release);
+		fr_dlist_insert_tail(&to->free, lease);
+		moved++;
+	}
+
+	return moved;
+}
+
+/** Refill a shard which has run out of addresses
+ *
+ * The shard must be locked.  Other shards are locked with trylock first,
+ * and only if that fails, in index order (dropping our own lock), so that
+ * two shards rebalancing at the same time can't deadlock.
+ *
+ * @return the number of addresses moved.
+ */
+static uint32_t shard_rebalance(mem_ippool_t *pool, mem_ippool_shard_t *s, fr_unix_time_t now)
+{
+	uint32_t	id = s - pool->shards;
+	uint32_t	i, moved = 0;
+	bool		busy = false;
+
+	for (i = 1; i < pool->num_shards; i++) {
+		mem_ippool_shard_t *o = &pool->shards[(id + i) % pool->num_shards];
+
+		if (pthread_mutex_trylock(&o->mutex) != 0) {
+			busy = true;
+			continue;
+		}
+
+		moved = shard_steal(s, id, o, now);
+		pthread_mutex_unlock(&o->mutex);
+		if (moved) goto done;
+	}
+
+	if (!busy) return 0;
+
+	for (i = 1; i < pool->num_shards; i++) {
+		uint32_t		o_id = (id + i) % pool->num_shards;
+		mem_ippool_shard_t	*o = &pool->shards[o_id];
+
+		pthread_mutex_unlock(&s->mutex);
+		if (o_id < id) {
+			pthread_mutex_lock(&o->mutex);
+			pthread_mutex_lock(&s->mutex);
+		} else {
+			pthread_mutex_lock(&s->mutex);
+			pthread_mutex_lock(&o->mutex);
+		}
+
+		moved = shard_steal(s, id, o, now);
+		pthread_mutex_unlock(&o->mutex);
+
+		/*
+		 *	Addresses may also have been released
+		 *	while we didn't hold the lock.
+		 */
+		if (moved || (fr_dlist_num_elements(&s->free) > 0)) goto done;
+	}
+
+	return 0;
+
+done:
+	s->rebalanced += moved;
+	return moved;
+}
+
+static int _mem_ippool_free(mem_ippool_t *pool)
+{
+	uint32_t i;
+
+	if (!pool->shards) return 0;
+
+	for (i = 0; i < pool->num_shards; i++) pthread_mutex_destroy(&pool->shards[i].mutex);
+
+	return 0;
+}
+
+/** Allocate a new pool
+ *
+ * Ranges must be added with #mem_ippool_add_range, and then the pool
+ * initialised with #mem_ippool_init.
+ *
+ * @param[in] ctx		to allocate the pool in.
+ * @param[in] name		of the pool.
+ * @param[in] num_shards	to split the pool into.
+ * @param[in] journal		to record changes in.  May be NULL.
+ */
+mem_ippool_t *mem_ippool_alloc(TALLOC_CTX *ctx, char const *name, uint32_t num_shards,
+			       mem_ippool_journal_t *journal)
+{
+	mem_ippool_t *pool;
+
+	MEM(pool = talloc_zero(ctx, mem_ippool_t));
+	MEM(pool->name = talloc_typed_strdup(pool, name));
+	MEM(pool->ranges = talloc_array(pool, mem_ippool_range_t, 0));
+	pool->num_shards = num_shards;
+	if (pool->num_shards < 1) pool->num_shards = 1;
+	if (pool->num_shards > MEM_IPPOOL_MAX_SHARDS) pool->num_shards = MEM_IPPOOL_MAX_SHARDS;
+	pool->journal = journal;
+
+	return pool;
+}
+
+/** Add a range of addresses to a pool
+ *
+ * @param[in] pool	to add the range to.
+ * @param[in] start	first address in the range.
+ * @param[in] num	number of addresses in the range.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int mem_ippool_add_range(mem_ippool_t *pool, fr_ipaddr_t const *start, uint32_t num)
+{
+	size_t			n = talloc_array_length(pool->ranges);
+	mem_ippool_range_t	*range;
+
+	if (pool->leases) {
+		fr_strerror_printf("Pool \"%s\" has already been initialised", pool->name);
+		return -1;
+	}
+
+	if ((num == 0) || (num > MEM_IPPOOL_MAX_ADDRESSES) || ((pool->num + num) > MEM_IPPOOL_MAX_ADDRESSES)) {
+		fr_strerror_printf("Pool \"%s\" would contain more than %u addresses",
+				   pool->name, MEM_IPPOOL_MAX_ADDRESSES);
+		return -1;
+	}
+
+	/*
+	 *	We only do arithmetic on the last 32 bits of the address.
+	 */
+	if ((UINT32_MAX - mem_ippool_ipaddr_low(start)) < (num - 1)) {
+		fr_strerror_printf("Range is too large");
+		return -1;
+	}
+
+	MEM(pool->ranges = talloc_realloc(pool, pool->ranges, mem_ippool_range_t, n + 1));
+	range = &pool->ranges[n];
+	range->start = *start;
+	range->start.prefix = (start->af == AF_INET) ? 32 : 128;
+	range->first = pool->num;
+	range->num = num;
+	pool->num += num;
+
+	return 0;
+}
+
+/** Create the leases for all addresses in the pool, and split them between the shards
+ *
+ */
+int mem_ippool_init(mem_ippool_t *pool)
+{
+	uint32_t i;
+
+	if (pool->num == 0) {
+		fr_strerror_printf("Pool \"%s\" contains no addresses", pool->name);
+		return -1;
+	}
+
+	if (pool->num_shards > pool->num) pool->num_shards = pool->num;
+
+	pool->leases = talloc_zero_array(pool, mem_ippool_lease_t, pool->num);
+	if (!pool->leases) {
+		fr_strerror_printf("Out of memory allocating %u leases", pool->num);
+		return -1;
+	}
+
+	MEM(pool->shards = talloc_zero_array(pool, mem_ippool_shard_t, pool->num_shards));
+	talloc_set_destructor(pool, _mem_ippool_free);
+
+	for (i = 0; i < pool->num_shards; i++) {
+		mem_ippool_shard_t *s = &pool->shards[i];
+
+		pthread_mutex_init(&s->mutex, NULL);
+		MEM(s->ctx = talloc_named_const(pool, 0, "mem_ippool_shard_ctx"));
+		fr_dlist_init(&s->free, mem_ippool_lease_t, entry);
+		MEM(s->expiry = fr_heap_alloc(s->ctx, lease_expiry_cmp, mem_ippool_lease_t, heap_id));
+		MEM(s->owners = fr_hash_table_create(s->ctx, lease_owner_hash, lease_owner_cmp, NULL));
+	}
+
+	for (i = 0; i < pool->num; i++) {
+		mem_ippool_lease_t *lease = &pool->leases[i];
+
+		lease->index = i;
+		atomic_init(&lease->shard, i % pool->num_shards);
+		fr_dlist_insert_tail(&pool->shards[i % pool->num_shards].free, lease);
+	}
+
+	return 0;
+}
+
+char const *mem_ippool_name(mem_ippool_t const *pool)
+{
+	return pool->name;
+}
+
+uint32_t mem_ippool_num_addresses(mem_ippool_t const *pool)
+{
+	return pool->num;
+}
+
+/** Allocate an address to an owner
+ *
+ * If the owner already holds an address, it's returned.  Otherwise the
+ * least recently released address, or failing that the address which
+ * expired longest ago, is allocated.
+ *
+ * @param[in] pool	to allocate from.
+ * @param[out] out	The address allocated.
+ * @param[out] expires	When the lease expires.
+ * @param[in] owner	of the lease.
+ * @param[in] gateway	of the owner.  May be NULL.
+ * @param[in] now	The current time.
+ * @param[in] ttl	How long the lease should last.
+ */
+mem_ippool_rcode_t mem_ippool_allocate(mem_ippool_t *pool, fr_ipaddr_t *out, fr_unix_time_t *expires,
+				       char const *owner, char const *gateway,
+				       fr_unix_time_t now, fr_time_delta_t ttl)
+{
+	mem_ippool_shard_t	*s = &pool->shards[owner_shard(pool, owner)];
+	mem_ippool_lease_t	*lease;
+	bool			rebalanced = false;
+
+	pthread_mutex_lock(&s->mutex);
+
+again:
+	/*
+	 *	Existing lease.  If it hasn't expired, return it
+	 *	as is, otherwise extend it.
+	 */
+	lease = lease_by_owner(s, owner);
+	if (lease) {
+		if (lease->expires > now) {
+			if (gateway) lease_set(s, lease, owner, gateway, lease->expires);
+			goto done;
+		}
+		goto found;
+	}
+
+	lease = fr_dlist_head(&s->free);
+	if (!lease) {
+		lease = fr_heap_peek(s->expiry);
+		if (lease && (lease->expires <= now)) {
+			lease_clear(s, lease);
+			goto found;
+		}
+
+		if (rebalanced) {
+			pthread_mutex_unlock(&s->mutex);
+			return MEM_IPPOOL_RCODE_POOL_EMPTY;
+		}
+
+		/*
+		 *	Rebalancing may release and re-take the
+		 *	shard's mutex.  In the meantime another
+		 *	request for the same owner may have been
+		 *	given a lease, or addresses may have been
+		 *	released, so start again from the top.
+		 */
+		(void) shard_rebalance(pool, s, now);
+		rebalanced = true;
+		goto again;
+	}
+	fr_dlist_remove(&s->free, lease);
+
+found:
+	lease->counter++;
+	lease_set(s, lease, owner, gateway, now + ttl);
+
+done:
+	lease_journal(pool, JOURNAL_OP_SET, lease);
+	*expires = lease->expires;
+	lease_ipaddr(out, pool, lease->index);
+	pthread_mutex_unlock(&s->mutex);
+
+	return MEM_IPPOOL_RCODE_SUCCESS;
+}
+
+/** Extend a lease
+ *
+ */
+mem_ippool_rcode_t mem_ippool_update(mem_ippool_t *pool, fr_ipaddr_t const *ip, fr_unix_time_t *expires,
+				     char const *owner, char const *gateway,
+				     fr_unix_time_t now, fr_time_delta_t ttl)
+{
+	mem_ippool_shard_t	*s;
+	mem_ippool_lease_t	*lease;
+	uint32_t		index;
+
+	if (lease_index(&index, pool, ip) < 0) return MEM_IPPOOL_RCODE_NOT_FOUND;
+
+	lease = &pool->leases[index];
+	s = lease_lock(pool, lease);
+
+	if (!lease->owner) {
+		pthread_mutex_unlock(&s->mutex);
+		return MEM_IPPOOL_RCODE_EXPIRED;
+	}
+
+	if (strcmp(lease->owner, owner) != 0) {
+		pthread_mutex_unlock(&s->mutex);
+		return MEM_IPPOOL_RCODE_DEVICE_MISMATCH;
+	}
+
+	lease_set(s, lease, owner, gateway, now + ttl);
+	lease_journal(pool, JOURNAL_OP_SET, lease);
+	*expires = lease->expires;
+	pthread_mutex_unlock(&s->mutex);
+
+	return MEM_IPPOOL_RCODE_SUCCESS;
+}
+
+/** Release a lease
+ *
+ * @param[in] pool	the address belongs to.
+ * @param[in] ip	to release.
+ * @param[in] owner	of the lease.  If NULL, the lease is released
+ *			regardless of who holds it.
+ */
+mem_ippool_rcode_t mem_ippool_release(mem_ippool_t *pool, fr_ipaddr_t const *ip, char const *owner)
+{
+	mem_ippool_shard_t	*s;
+	mem_ippool_lease_t	*lease;
+	uint32_t		index;
+
+	if (lease_index(&index, pool, ip) < 0) return MEM_IPPOOL_RCODE_NOT_FOUND;
+
+	lease = &pool->leases[index];
+	s = lease_lock(pool, lease);
+
+	if (!lease->owner) {
+		pthread_mutex_unlock(&s->mutex);
+		return MEM_IPPOOL_RCODE_SUCCESS;
+	}
+
+	if (owner && (strcmp(lease->owner, owner) != 0)) {
+		pthread_mutex_unlock(&s->mutex);
+		return MEM_IPPOOL_RCODE_DEVICE_MISMATCH;
+	}
+
+	lease_clear(s, lease);
+	fr_dlist_insert_tail(&s->free, lease);
+	lease_journal(pool, JOURNAL_OP_CLEAR, lease);
+	pthread_mutex_unlock(&s->mutex);
+
+	return MEM_IPPOOL_RCODE_SUCCESS;
+}
+
+/** Release all leases held by owners behind a gateway
+ *
+ * @return the number of leases released.
+ */
+uint32_t mem_ippool_bulk_release(mem_ippool_t *pool, char const *gateway)
+{
+	uint32_t i, released = 0;
+
+	for (i = 0; i < pool->num; i++) {
+		mem_ippool_lease_t	*lease = &pool->leases[i];
+		mem_ippool_shard_t	*s = lease_lock(pool, lease);
+
+		if (lease->owner && lease->gateway && (strcmp(lease->gateway, gateway) == 0)) {
+			lease_clear(s, lease);
+			fr_dlist_insert_tail(&s->free, lease);
+			lease_journal(pool, JOURNAL_OP_CLEAR, lease);
+			released++;
+		}
+		pthread_mutex_unlock(&s->mutex);
+	}
+
+	return released;
+}
+
+/** Return the number of leased addresses, and how many addresses have been moved between shards
+ *
+ */
+void mem_ippool_stats(mem_ippool_t *pool, uint32_t *leased, uint64_t *rebalanced)
+{
+	uint32_t i;
+
+	*leased = 0;
+	*rebalanced = 0;
+
+	for (i = 0; i < pool->num_shards; i++) {
+		mem_ippool_shard_t *s = &pool->shards[i];
+
+		pthread_mutex_lock(&s->mutex);
+		*leased += fr_heap_num_elements(s->expiry);
+		*rebalanced += s->rebalanced;
+		pthread_mutex_unlock(&s->mutex);
+	}
+}
+
+/** Write a buffer to a file, retrying on short writes
+ *
+ */
+static int journal_write(int fd, uint8_t const *buff, size_t len)
+{
+	while (len > 0) {
+		ssize_t slen;
+
+		slen = write(fd, buff, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buff += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+/** Open a new journal or snapshot file, and write the header
+ *
+ * @param[in] filename	to open.
+ * @param[in] flags	O_TRUNC to discard any existing contents, or O_EXCL
+ *			to fail if the file already exists.
+ */
+static int journal_open(char const *filename, int flags)
+{
+	int fd;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | flags, 0600);
+	if (fd < 0) {
+		ERROR("Failed opening \"%s\": %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (journal_write(fd, (uint8_t const *)JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) < 0) {
+		ERROR("Failed writing \"%s\": %s", filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/** Write any pending records to the current journal
+ *
+ */
+static void journal_flush(mem_ippool_journal_t *j)
+{
+	uint8_t	*pending;
+	size_t	len;
+
+	pthread_mutex_lock(&j->mutex);
+	pending = j->pending;
+	len = j->pending_len;
+	j->pending = NULL;
+	j->pending_len = 0;
+	j->pending_size = 0;
+	pthread_mutex_unlock(&j->mutex);
+
+	if (!pending) return;
+
+	if (journal_write(j->fd, pending, len) < 0) {
+		ERROR("Failed writing journal \"%s\": %s", j->filename, fr_syserror(errno));
+	} else if (j->sync) {
+		fsync(j->fd);
+	}
+	free(pending);
+}
+
+/** Write all current leases to a new snapshot, and make it the current one
+ *
+ */
+static int snapshot_write(mem_ippool_journal_t *j)
+{
+	int	fd;
+	size_t	i;
+
+	fd = journal_open(j->snapshot_tmp, O_TRUNC);
+	if (fd < 0) return -1;
+
+	for (i = 0; i < talloc_array_length(j->pools); i++) {
+		mem_ippool_t	*pool = j->pools[i];
+		uint32_t	s_id;
+
+		for (s_id = 0; s_id < pool->num_shards; s_id++) {
+			mem_ippool_shard_t	*s = &pool->shards[s_id];
+			mem_ippool_journal_t	tmp = { .pending = NULL };
+			fr_heap_iter_t		iter;
+			mem_ippool_lease_t	*lease;
+
+			/*
+			 *	Serialise the shard into a private buffer,
+			 *	so the lock is only held while copying.
+			 */
+			pthread_mutex_init(&tmp.mutex, NULL);
+			pthread_cond_init(&tmp.cond, NULL);
+
+			pthread_mutex_lock(&s->mutex);
+			for (lease = fr_heap_iter_init(s->expiry, &iter);
+			     lease;
+			     lease = fr_heap_iter_next(s->expiry, &iter)) {
+				fr_ipaddr_t ip;
+
+				lease_ipaddr(&ip, pool, lease->index);
+				journal_append(&tmp, pool, JOURNAL_OP_SET, lease, &ip);
+			}
+			pthread_mutex_unlock(&s->mutex);
+
+			if (tmp.pending && (journal_write(fd, tmp.pending, tmp.pending_len) < 0)) {
+				ERROR("Failed writing snapshot \"%s\": %s", j->snapshot_tmp, fr_syserror(errno));
+				free(tmp.pending);
+				close(fd);
+				return -1;
+			}
+			free(tmp.pending);
+			pthread_cond_destroy(&tmp.cond);
+			pthread_mutex_destroy(&tmp.mutex);
+		}
+	}
+
+	if (fsync(fd) < 0) {
+		ERROR("Failed syncing snapshot \"%s\": %s", j->snapshot_tmp, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(j->snapshot_tmp, j->snapshot) < 0) {
+		ERROR("Failed renaming snapshot \"%s\": %s", j->snapshot_tmp, fr_syserror(errno));
+		return -1;
+	}
+
+	DEBUG2("Wrote snapshot \"%s\"", j->snapshot);
+
+	return 0;
+}
+
+/** Write all current leases to a snapshot, and start a new journal
+ *
+ * Records are absolute (they set or clear a lease), so replaying records
+ * which are already reflected in the snapshot is harmless.  What matters
+ * is that every change made after the journal is rotated ends up in the
+ * new journal.
+ *
+ * Nothing is truncated until the snapshot holding its records has been
+ * renamed into place.  The new journal is only created if it doesn't
+ * exist, and it only replaces the old journal once the snapshot has been
+ * written.  If writing the snapshot fails, the next attempt carries on
+ * writing to the same new journal, and the old one is kept.
+ */
+static int journal_snapshot(mem_ippool_journal_t *j)
+{
+	/*
+	 *	Rotate the journal.  Records pending at this point
+	 *	must go into the old journal.
+	 */
+	journal_flush(j);
+	if (!j->rotated) {
+		int new_fd;
+
+		new_fd = journal_open(j->rotate, O_EXCL);
+		if (new_fd < 0) return -1;
+
+		pthread_mutex_lock(&j->mutex);
+		if (j->pending && (journal_write(j->fd, j->pending, j->pending_len) < 0)) {
+			ERROR("Failed writing journal \"%s\": %s", j->filename, fr_syserror(errno));
+		}
+		free(j->pending);
+		j->pending = NULL;
+		j->pending_len = j->pending_size = 0;
+		close(j->fd);
+		j->fd = new_fd;
+		j->rotated = true;
+		pthread_mutex_unlock(&j->mutex);
+	}
+
+	if (snapshot_write(j) < 0) return -1;
+
+	/*
+	 *	Everything in the old journal is now in the snapshot,
+	 *	so the new journal can replace it.
+	 */
+	if (rename(j->rotate, j->filename) < 0) {
+		ERROR("Failed renaming journal \"%s\": %s", j->rotate, fr_syserror(errno));
+		return -1;
+	}
+	j->rotated = false;
+
+	return 0;
+}
+
+/** Apply a journal record to a pool
+ *
+ */
+static void journal_apply(mem_ippool_t *pool, mem_ippool_record_t const *rec,
+			  char const *owner, char const *gateway)
+{
+	fr_ipaddr_t		ip = { .af = rec->af };
+	mem_ippool_lease_t	*lease;
+	mem_ippool_shard_t	*s;
+	uint32_t		index;
+	size_t			len;
+	uint8_t			*p;
+
+	if ((rec->af != AF_INET) && (rec->af != AF_INET6)) return;
+	p = ipaddr_bytes(&ip, &len);
+	memcpy(p, rec->addr, len);
+
+	if (lease_index(&index, pool, &ip) < 0) {
+		DEBUG3("Ignoring journal record for address no longer in pool \"%s\"", pool->name);
+		return;
+	}
+
+	lease = &pool->leases[index];
+	s = &pool->shards[atomic_load(&lease->shard)];
+
+	if (lease->owner) {
+		lease_clear(s, lease);
+	} else {
+		fr_dlist_remove(&s->free, lease);
+	}
+
+	switch (rec->op) {
+	case JOURNAL_OP_SET:
+		if (owner) {
+			uint32_t id = owner_shard(pool, owner);
+
+			mem_ippool_lease_t *other;
+
+			s = &pool->shards[id];
+
+			/*
+			 *	Records are in order, and an owner only
+			 *	holds one lease at a time, so any other
+			 *	lease for this owner was since released.
+			 */
+			other = lease_by_owner(s, owner);
+			if (other) {
+				lease_clear(s, other);
+				fr_dlist_insert_tail(&s->free, other);
+			}
+
+			atomic_store(&lease->shard, id);
+			lease->counter = rec->counter;
+			lease_set(s, lease, owner, gateway, rec->expires);
+			break;
+		}
+		FALL_THROUGH;
+
+	default:
+		fr_dlist_insert_tail(&s->free, lease);
+		break;
+	}
+}
+
+/** Replay a snapshot or journal file
+ *
+ */
+static int journal_replay(mem_ippool_journal_t *j, char const *filename)
+{
+	int			fd;
+	struct stat		st;
+	uint8_t			*buff, *p, *end;
+	uint32_t		records = 0;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+		ERROR("Failed opening \"%s\": %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ERROR("Failed reading \"%s\": %s", filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t)st.st_size < JOURNAL_MAGIC_LEN) {
+		close(fd);
+		return 0;
+	}
+
+	MEM(buff = talloc_array(NULL, uint8_t, st.st_size));
+	if (read(fd, buff, st.st_size) != st.st_size) {
+		ERROR("Failed reading \"%s\": %s", filename, fr_syserror(errno));
+	error:
+		talloc_free(buff);
+		close(fd);
+		return -1;
+	}
+
+	if (memcmp(buff, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+		ERROR("\"%s\" is not an IP pool journal", filename);
+		goto error;
+	}
+
+	p = buff + JOURNAL_MAGIC_LEN;
+	end = buff + st.st_size;
+
+	while ((size_t)(end - p) >= sizeof(mem_ippool_record_t)) {
+		mem_ippool_record_t	rec;
+		char			pool_name[UINT8_MAX + 1];
+		char			*owner = NULL, *gateway = NULL;
+		size_t			i;
+
+		memcpy(&rec, p, sizeof(rec));
+		if ((size_t)(end - p) < (sizeof(rec) + rec.pool_len + rec.owner_len + rec.gateway_len)) break;
+		p += sizeof(rec);
+
+		memcpy(pool_name, p, rec.pool_len);
+		pool_name[rec.pool_len] = '\0';
+		p += rec.pool_len;
+
+		if (rec.owner_len) {
+			MEM(owner = talloc_bstrndup(NULL, (char const *)p, rec.owner_len));
+			p += rec.owner_len;
+		}
+		if (rec.gateway_len) {
+			MEM(gateway = talloc_bstrndup(NULL, (char const *)p, rec.gateway_len));
+			p += rec.gateway_len;
+		}
+
+		for (i = 0; i < talloc_array_length(j->pools); i++) {
+			if (strcmp(j->pools[i]->name, pool_name) != 0) continue;
+
+			journal_apply(j->pools[i], &rec, owner, gateway);
+			break;
+		}
+
+		talloc_free(owner);
+		talloc_free(gateway);
+		records++;
+	}
+
+	/*
+	 *	A partial record at the end means we crashed
+	 *	while writing it.  Everything before it is fine.
+	 */
+	if (p != end) WARN("Ignoring truncated record at the end of \"%s\"", filename);
+
+	DEBUG2("Replayed %u records from \"%s\"", records, filename);
+
+	talloc_free(buff);
+	close(fd);
+
+	return 0;
+}
+
+/** Write pending records, and periodic snapshots
+ *
+ */
+static void *journal_thread(void *arg)
+{
+	mem_ippool_journal_t	*j = arg;
+	fr_time_t		next_snapshot = fr_time() + j->snapshot_interval;
+
+	pthread_mutex_lock(&j->mutex);
+	while (!j->stop) {
+		struct timespec	ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += j->flush_interval / NSEC;
+		ts.tv_nsec += j->flush_interval % NSEC;
+		if (ts.tv_nsec >= NSEC) {
+			ts.tv_sec++;
+			ts.tv_nsec -= NSEC;
+		}
+
+		if (j->pending_len < JOURNAL_FLUSH_SIZE) pthread_cond_timedwait(&j->cond, &j->mutex, &ts);
+		pthread_mutex_unlock(&j->mutex);
+
+		journal_flush(j);
+
+		if (j->snapshot_interval && (fr_time() >= next_snapshot)) {
+			journal_snapshot(j);
+			next_snapshot = fr_time() + j->snapshot_interval;
+		}
+
+		pthread_mutex_lock(&j->mutex);
+	}
+	pthread_mutex_unlock(&j->mutex);
+
+	return NULL;
+}
+
+static int _mem_ippool_journal_free(mem_ippool_journal_t *j)
+{
+	mem_ippool_journal_stop(j);
+
+	pthread_cond_destroy(&j->cond);
+	pthread_mutex_destroy(&j->mutex);
+
+	return 0;
+}
+
+/** Allocate a journal
+ *
+ * @param[in] ctx		to allocate the journal in.
+ * @param[in] filename		of the journal.  Snapshots are written to
+ *				"<filename>.snapshot".
+ * @param[in] sync		fsync() the journal after every write.
+ * @param[in] flush_interval	Maximum time changes are buffered for before
+ *				being written.
+ * @param[in] snapshot_interval	How often to write a snapshot, and start a new
+ *				journal.  0 to only write snapshots at startup
+ *				and shutdown.
+ */
+mem_ippool_journal_t *mem_ippool_journal_alloc(TALLOC_CTX *ctx, char const *filename, bool sync,
+					       fr_time_delta_t flush_interval, fr_time_delta_t snapshot_interval)
+{
+	mem_ippool_journal_t *j;
+
+	MEM(j = talloc_zero(ctx, mem_ippool_journal_t));
+	MEM(j->filename = talloc_typed_strdup(j, filename));
+	MEM(j->rotate = talloc_typed_asprintf(j, "%s.new", filename));
+	MEM(j->snapshot = talloc_typed_asprintf(j, "%s.snapshot", filename));
+	MEM(j->snapshot_tmp = talloc_typed_asprintf(j, "%s.snapshot.tmp", filename));
+	j->sync = sync;
+	j->flush_interval = flush_interval;
+	j->snapshot_interval = snapshot_interval;
+	j->fd = -1;
+
+	pthread_mutex_init(&j->mutex, NULL);
+	pthread_cond_init(&j->cond, NULL);
+	talloc_set_destructor(j, _mem_ippool_journal_free);
+
+	return j;
+}
+
+/** Restore leases from the journal, and start the writer thread
+ *
+ * @param[in] journal	to replay.
+ * @param[in] pools	talloced array of initialised pools recorded in the journal.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int mem_ippool_journal_start(mem_ippool_journal_t *journal, mem_ippool_t **pools)
+{
+	int ret;
+
+	journal->pools = pools;
+
+	/*
+	 *	The snapshot, then changes made since it was
+	 *	written, then changes made while the next
+	 *	snapshot was being written.
+	 */
+	if ((journal_replay(journal, journal->snapshot) < 0) ||
+	    (journal_replay(journal, journal->filename) < 0) ||
+	    (journal_replay(journal, journal->rotate) < 0)) return -1;
+
+	/*
+	 *	Start again from a clean snapshot.  The journals
+	 *	are only discarded once it's been renamed into place.
+	 *
+	 *	The current journal is truncated before the rotated
+	 *	one is removed.  If we crash in between, replaying the
+	 *	rotated journal after the snapshot leaves every lease
+	 *	as the snapshot has it.
+	 */
+	if (snapshot_write(journal) < 0) return -1;
+
+	journal->fd = journal_open(journal->filename, O_TRUNC);
+	if (journal->fd < 0) return -1;
+
+	if ((unlink(journal->rotate) < 0) && (errno != ENOENT)) {
+		ERROR("Failed removing journal \"%s\": %s", journal->rotate, fr_syserror(errno));
+		return -1;
+	}
+
+	ret = pthread_create(&journal->thread, NULL, journal_thread, journal);
+	if (ret != 0) {
+		ERROR("Failed creating journal thread: %s", fr_syserror(ret));
+		return -1;
+	}
+	journal->running = true;
+
+	return 0;
+}
+
+/** Stop the writer thread, and write a final snapshot
+ *
+ */
+void mem_ippool_journal_stop(mem_ippool_journal_t *journal)
+{
+	if (journal->running) {
+		pthread_mutex_lock(&journal->mutex);
+		journal->stop = true;
+		pthread_cond_signal(&journal->cond);
+		pthread_mutex_unlock(&journal->mutex);
+
+		pthread_join(journal->thread, NULL);
+		journal->running = false;
+
+		journal_snapshot(journal);
+	}
+
+	if (journal->fd >= 0) {
+		journal_flush(journal);
+		close(journal->fd);
+		journal->fd = -1;
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file mem_ippool.h
+ * @brief In-memory IP pools, with an append-only journal.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(mem_ippool_h, "$Id$")
+
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/net.h>
+#include <freeradius-devel/util/time.h>
+
+/** Maximum number of addresses in a single pool
+ *
+ */
+#define MEM_IPPOOL_MAX_ADDRESSES	(1 << 24)
+
+/** Maximum number of shards in a pool
+ *
+ */
+#define MEM_IPPOOL_MAX_SHARDS		1024
+
+typedef enum {
+	MEM_IPPOOL_RCODE_SUCCESS = 0,			//!< Lease allocated, updated or released.
+	MEM_IPPOOL_RCODE_NOT_FOUND = -1,		//!< Address is not a member of the pool.
+	MEM_IPPOOL_RCODE_EXPIRED = -2,			//!< Lease expired before it was updated.
+	MEM_IPPOOL_RCODE_DEVICE_MISMATCH = -3,		//!< Lease belongs to another owner.
+	MEM_IPPOOL_RCODE_POOL_EMPTY = -4,		//!< No free addresses.
+	MEM_IPPOOL_RCODE_FAIL = -5			//!< Internal error.
+} mem_ippool_rcode_t;
+
+typedef struct mem_ippool_s mem_ippool_t;
+typedef struct mem_ippool_journal_s mem_ippool_journal_t;
+
+/** Read the last 32 bits of an address
+ *
+ */
+static inline CC_HINT(always_inline) uint32_t mem_ippool_ipaddr_low(fr_ipaddr_t const *ip)
+{
+	if (ip->af == AF_INET) return ntohl(ip->addr.v4.s_addr);
+
+	return fr_net_to_uint32(ip->addr.v6.s6_addr + 12);
+}
+
+mem_ippool_t		*mem_ippool_alloc(TALLOC_CTX *ctx, char const *name, uint32_t num_shards,
+					  mem_ippool_journal_t *journal);
+
+int			mem_ippool_add_range(mem_ippool_t *pool, fr_ipaddr_t const *start, uint32_t num);
+
+int			mem_ippool_init(mem_ippool_t *pool);
+
+char const		*mem_ippool_name(mem_ippool_t const *pool);
+
+uint32_t		mem_ippool_num_addresses(mem_ippool_t const *pool);
+
+mem_ippool_rcode_t	mem_ippool_allocate(mem_ippool_t *pool, fr_ipaddr_t *out, fr_unix_time_t *expires,
+					    char const *owner, char const *gateway,
+					    fr_unix_time_t now, fr_time_delta_t ttl);
+
+mem_ippool_rcode_t	mem_ippool_update(mem_ippool_t *pool, fr_ipaddr_t const *ip, fr_unix_time_t *expires,
+					  char const *owner, char const *gateway,
+					  fr_unix_time_t now, fr_time_delta_t ttl);
+
+mem_ippool_rcode_t	mem_ippool_release(mem_ippool_t *pool, fr_ipaddr_t const *ip, char const *owner);
+
+uint32_t		mem_ippool_bulk_release(mem_ippool_t *pool, char const *gateway);
+
+void			mem_ippool_stats(mem_ippool_t *pool, uint32_t *leased, uint64_t *rebalanced);
+
+mem_ippool_journal_t	*mem_ippool_journal_alloc(TALLOC_CTX *ctx, char const *filename, bool sync,
+						  fr_time_delta_t flush_interval, fr_time_delta_t snapshot_interval);
+
+int			mem_ippool_journal_start(mem_ippool_journal_t *journal, mem_ippool_t **pools);
+
+void			mem_ippool_journal_stop(mem_ippool_journal_t *journal);
@@ -0,0 +1,298 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "mem_ippool.c"
+
+/*
+ *	Everything is written to a temporary directory, which each
+ *	test removes when it's done.
+ */
+#define TEST_ADDRESSES	8
+#define TEST_TTL	fr_time_delta_from_sec(3600)
+
+static char const *owners[] = { "owner-a", "owner-b", "owner-c" };
+
+static void test_init(void)
+{
+	static bool done;
+
+	if (done) return;
+
+	fr_time_start();
+	done = true;
+}
+
+static char *test_dir(TALLOC_CTX *ctx)
+{
+	char	tmp[] = "/tmp/mem_ippool_tests.XXXXXX";
+
+	TEST_ASSERT(mkdtemp(tmp) != NULL);
+
+	return talloc_typed_strdup(ctx, tmp);
+}
+
+static void test_dir_free(char *dir)
+{
+	char	cmd[256];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	TEST_CHECK(system(cmd) == 0);
+	talloc_free(dir);
+}
+
+/*
+ *	Copy a file, optionally dropping bytes from the end.  This
+ *	is what's on disk if we crash at that point.
+ */
+static void test_copy(char const *from, char const *to, size_t chop)
+{
+	int		in, out;
+	struct stat	st;
+	uint8_t		*buff;
+
+	in = open(from, O_RDONLY);
+	TEST_ASSERT(in >= 0);
+	TEST_ASSERT(fstat(in, &st) == 0);
+	TEST_ASSERT((size_t) st.st_size > chop);
+
+	buff = talloc_array(NULL, uint8_t, st.st_size);
+	TEST_ASSERT(read(in, buff, st.st_size) == st.st_size);
+	close(in);
+
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	TEST_ASSERT(out >= 0);
+	TEST_CHECK(write(out, buff, st.st_size - chop) == (ssize_t) (st.st_size - chop));
+	close(out);
+
+	talloc_free(buff);
+}
+
+/*
+ *	One pool of TEST_ADDRESSES, recorded in the journal at
+ *	"<dir>/<name>".
+ */
+static mem_ippool_t *test_pool(TALLOC_CTX *ctx, char const *dir, char const *name, mem_ippool_journal_t **journal)
+{
+	mem_ippool_t	*pool;
+	mem_ippool_t	**pools;
+	fr_ipaddr_t	start;
+	char		*filename;
+
+	filename = talloc_typed_asprintf(ctx, "%s/%s", dir, name);
+
+	*journal = mem_ippool_journal_alloc(ctx, filename, false,
+					    fr_time_delta_from_msec(1), 0);
+
+	/*
+	 *	Parented by the journal, so they're still around
+	 *	for the final snapshot when it's freed.
+	 */
+	pool = mem_ippool_alloc(*journal, "test", 4, *journal);
+	TEST_ASSERT(fr_inet_pton4(&start, "192.0.2.1", -1, false, false, false) == 0);
+	TEST_CHECK(mem_ippool_add_range(pool, &start, TEST_ADDRESSES) == 0);
+	TEST_CHECK(mem_ippool_init(pool) == 0);
+
+	MEM(pools = talloc_array(*journal, mem_ippool_t *, 1));
+	pools[0] = pool;
+	TEST_CHECK(mem_ippool_journal_start(*journal, pools) == 0);
+	TEST_MSG("journal start failed: %s", fr_strerror());
+
+	return pool;
+}
+
+/*
+ *	Wait until the writer thread has written everything.
+ */
+static void test_flushed(mem_ippool_journal_t *journal)
+{
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		bool empty;
+
+		pthread_mutex_lock(&journal->mutex);
+		empty = (journal->pending_len == 0);
+		pthread_mutex_unlock(&journal->mutex);
+
+		if (empty) break;
+		usleep(1000);
+	}
+
+	/*
+	 *	The buffer may have been taken, but not yet written.
+	 */
+	usleep(20000);
+}
+
+/*
+ *	Allocate a lease to each owner, then release the second
+ *	one.  Returns the addresses and expiry times.
+ */
+static void test_leases(mem_ippool_t *pool, fr_ipaddr_t *ip, fr_unix_time_t *expires)
+{
+	fr_unix_time_t	now = fr_time_to_unix_time(fr_time());
+	size_t		i;
+
+	for (i = 0; i < NUM_ELEMENTS(owners); i++) {
+		TEST_CHECK(mem_ippool_allocate(pool, &ip[i], &expires[i], owners[i], "gw", now, TEST_TTL) ==
+			   MEM_IPPOOL_RCODE_SUCCESS);
+	}
+
+	TEST_CHECK(mem_ippool_release(pool, &ip[1], owners[1]) == MEM_IPPOOL_RCODE_SUCCESS);
+}
+
+/*
+ *	Check that a restored pool has the leases we expect.  Owners
+ *	with leases get the same address back, with the original
+ *	expiry, which they only would if the lease was restored.
+ */
+static void test_restored(mem_ippool_t *pool, fr_ipaddr_t const *ip, fr_unix_time_t const *expires,
+			  bool second_leased)
+{
+	fr_unix_time_t	now = fr_time_to_unix_time(fr_time());
+	uint32_t	leased;
+	uint64_t	rebalanced;
+	size_t		i;
+
+	mem_ippool_stats(pool, &leased, &rebalanced);
+	TEST_CHECK(leased == (second_leased ? 3 : 2));
+	TEST_MSG("expected %u leases, got %u", second_leased ? 3 : 2, leased);
+
+	for (i = 0; i < NUM_ELEMENTS(owners); i++) {
+		fr_ipaddr_t	found;
+		fr_unix_time_t	found_expires;
+
+		if ((i == 1) && !second_leased) continue;
+
+		TEST_CHECK(mem_ippool_allocate(pool, &found, &found_expires, owners[i], NULL, now, TEST_TTL) ==
+			   MEM_IPPOOL_RCODE_SUCCESS);
+		TEST_CHECK(fr_ipaddr_cmp(&found, &ip[i]) == 0);
+		TEST_MSG("%s was given a different address", owners[i]);
+		TEST_CHECK(found_expires == expires[i]);
+		TEST_MSG("%s was given a new lease", owners[i]);
+	}
+
+	/*
+	 *	The released address is free, and someone else
+	 *	holding it means it wasn't restored as leased.
+	 */
+	if (!second_leased) {
+		TEST_CHECK(mem_ippool_update(pool, &ip[1], &(fr_unix_time_t){ 0 }, owners[1], NULL, now, TEST_TTL) ==
+			   MEM_IPPOOL_RCODE_EXPIRED);
+	}
+}
+
+/*
+ *	A crash after the records were written, but before a
+ *	snapshot.  The leases come back from the journal.
+ */
+static void mem_ippool_journal_replay(void)
+{
+	TALLOC_CTX		*ctx = talloc_new(NULL);
+	char			*dir;
+	mem_ippool_t		*pool;
+	mem_ippool_journal_t	*journal;
+	fr_ipaddr_t		ip[NUM_ELEMENTS(owners)];
+	fr_unix_time_t		expires[NUM_ELEMENTS(owners)];
+	char			*from, *to;
+
+	test_init();
+	dir = test_dir(ctx);
+
+	pool = test_pool(ctx, dir, "journal", &journal);
+	test_leases(pool, ip, expires);
+	test_flushed(journal);
+
+	from = talloc_typed_asprintf(ctx, "%s/journal", dir);
+	to = talloc_typed_asprintf(ctx, "%s/crash", dir);
+	test_copy(from, to, 0);
+
+	from = talloc_typed_asprintf(ctx, "%s/journal.snapshot", dir);
+	to = talloc_typed_asprintf(ctx, "%s/crash.snapshot", dir);
+	test_copy(from, to, 0);
+
+	pool = test_pool(ctx, dir, "crash", &journal);
+	test_restored(pool, ip, expires, false);
+
+	talloc_free(ctx);
+	test_dir_free(dir);
+}
+
+/*
+ *	A crash part way through writing the last record, which
+ *	released the second lease.  Everything before it is used,
+ *	so the second owner still has its lease.
+ */
+static void mem_ippool_journal_truncated(void)
+{
+	TALLOC_CTX		*ctx = talloc_new(NULL);
+	char			*dir;
+	mem_ippool_t		*pool;
+	mem_ippool_journal_t	*journal;
+	fr_ipaddr_t		ip[NUM_ELEMENTS(owners)];
+	fr_unix_time_t		expires[NUM_ELEMENTS(owners)];
+	char			*from, *to;
+
+	test_init();
+	dir = test_dir(ctx);
+
+	pool = test_pool(ctx, dir, "journal", &journal);
+	test_leases(pool, ip, expires);
+	test_flushed(journal);
+
+	from = talloc_typed_asprintf(ctx, "%s/journal", dir);
+	to = talloc_typed_asprintf(ctx, "%s/crash", dir);
+	test_copy(from, to, 3);
+
+	from = talloc_typed_asprintf(ctx, "%s/journal.snapshot", dir);
+	to = talloc_typed_asprintf(ctx, "%s/crash.snapshot", dir);
+	test_copy(from, to, 0);
+
+	pool = test_pool(ctx, dir, "crash", &journal);
+	test_restored(pool, ip, expires, true);
+
+	talloc_free(ctx);
+	test_dir_free(dir);
+}
+
+/*
+ *	A clean shutdown writes a snapshot, and empties the journal.
+ *	The leases come back from the snapshot.
+ */
+static void mem_ippool_snapshot_replay(void)
+{
+	TALLOC_CTX		*ctx = talloc_new(NULL);
+	char			*dir, *filename;
+	mem_ippool_t		*pool;
+	mem_ippool_journal_t	*journal;
+	fr_ipaddr_t		ip[NUM_ELEMENTS(owners)];
+	fr_unix_time_t		expires[NUM_ELEMENTS(owners)];
+	struct stat		st;
+
+	test_init();
+	dir = test_dir(ctx);
+
+	pool = test_pool(ctx, dir, "journal", &journal);
+	test_leases(pool, ip, expires);
+	mem_ippool_journal_stop(journal);
+
+	/*
+	 *	The journal is only truncated at startup, so
+	 *	remove it, to be sure the snapshot has everything.
+	 */
+	filename = talloc_typed_asprintf(ctx, "%s/journal", dir);
+	TEST_CHECK(stat(filename, &st) == 0);
+	TEST_CHECK(unlink(filename) == 0);
+
+	pool = test_pool(ctx, dir, "journal", &journal);
+	test_restored(pool, ip, expires, false);
+
+	talloc_free(ctx);
+	test_dir_free(dir);
+}
+
+TEST_LIST = {
+	{ "mem_ippool_journal_replay",		mem_ippool_journal_replay	},
+	{ "mem_ippool_journal_truncated",	mem_ippool_journal_truncated	},
+	{ "mem_ippool_snapshot_replay",		mem_ippool_snapshot_replay	},
+	{ NULL }
+};
@@ -0,0 +1,8 @@
+TARGET		:= mem_ippool_tests
+
+SOURCES		:= mem_ippool_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a
@@ -0,0 +1,623 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_mem_ippool.c
+ * @brief IP Allocation module with pools held in memory.
+ *
+ * Leases are allocated from pools held in the server's memory, so no
+ * database round trips are needed.  Changes are optionally written to a
+ * journal so that leases survive restarts.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module.h>
+
+#include <freeradius-devel/util/debug.h>
+
+#include <freeradius-devel/dhcpv4/dhcpv4.h>
+
+#include "mem_ippool.h"
+
+/** Actions, as set by &control.Pool-Action
+ *
+ */
+typedef enum {
+	POOL_ACTION_ALLOCATE = 1,
+	POOL_ACTION_UPDATE = 2,
+	POOL_ACTION_RELEASE = 3,
+	POOL_ACTION_BULK_RELEASE = 4
+} mem_ippool_action_t;
+
+/** rlm_mem_ippool module instance
+ *
+ */
+typedef struct {
+	char const		*name;		//!< Instance name.
+
+	tmpl_t			*pool_name;	//!< Name of the pool we're allocating IP addresses from.
+
+	fr_time_delta_t		offer_time;	//!< How long we should reserve a lease for during
+						//!< the pre-allocation stage (typically responding
+						//!< to DHCP discover).
+	fr_time_delta_t		lease_time;	//!< How long an IP address should be allocated for.
+
+	tmpl_t			*owner;		//!< Unique lease owner identifier.
+
+	tmpl_t			*gateway_id;	//!< Gateway identifier, used for bulk lease cleanups.
+
+	tmpl_t			*requested_address;		//!< Attribute to read the IP for renewal from.
+
+	tmpl_t			*allocated_address_attr;	//!< IP attribute and destination.
+
+	tmpl_t			*expiry_attr;	//!< Where to write the lease time.
+
+	bool			copy_on_update; //!< Copy the address provided by requested_address to the
+						//!< allocated_address_attr if updates are successful.
+
+	uint32_t		shards;		//!< How many shards to split each pool into.
+
+	char const		*journal_filename;	//!< Where to record lease changes.
+	bool			journal_sync;		//!< fsync() after every write to the journal.
+	fr_time_delta_t		journal_flush_interval;	//!< Maximum time changes are buffered for.
+	fr_time_delta_t		journal_snapshot_interval;	//!< How often to write a snapshot.
+
+	mem_ippool_journal_t	*journal;	//!< Lease change journal.  NULL if not persistent.
+	mem_ippool_t		**pools;	//!< Talloced array of pools.
+} rlm_mem_ippool_t;
+
+static CONF_PARSER journal_config[] = {
+	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT, rlm_mem_ippool_t, journal_filename) },
+	{ FR_CONF_OFFSET("sync", FR_TYPE_BOOL, rlm_mem_ippool_t, journal_sync), .dflt = "no" },
+	{ FR_CONF_OFFSET("flush_interval", FR_TYPE_TIME_DELTA, rlm_mem_ippool_t, journal_flush_interval), .dflt = "0.1" },
+	{ FR_CONF_OFFSET("snapshot_interval", FR_TYPE_TIME_DELTA, rlm_mem_ippool_t, journal_snapshot_interval), .dflt = "300" },
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("pool_name", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_mem_ippool_t, pool_name), .dflt = "&control.Pool-Name", .quote = T_BARE_WORD },
+
+	{ FR_CONF_OFFSET("owner", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_mem_ippool_t, owner) },
+	{ FR_CONF_OFFSET("gateway", FR_TYPE_TMPL, rlm_mem_ippool_t, gateway_id) },
+
+	{ FR_CONF_OFFSET("offer_time", FR_TYPE_TIME_DELTA, rlm_mem_ippool_t, offer_time) },
+	{ FR_CONF_OFFSET("lease_time", FR_TYPE_TIME_DELTA, rlm_mem_ippool_t, lease_time), .dflt = "3600" },
+
+	{ FR_CONF_OFFSET("requested_address", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_mem_ippool_t, requested_address), .dflt = "%{%{DHCP-Requested-IP-Address}:-%{DHCP-Client-IP-Address}}", .quote = T_DOUBLE_QUOTED_STRING },
+
+	{ FR_CONF_OFFSET("allocated_address_attr", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE | FR_TYPE_REQUIRED, rlm_mem_ippool_t, allocated_address_attr), .dflt = "&reply.DHCP-Your-IP-Address", .quote = T_BARE_WORD },
+
+	{ FR_CONF_OFFSET("expiry_attr", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE, rlm_mem_ippool_t, expiry_attr) },
+
+	{ FR_CONF_OFFSET("copy_on_update", FR_TYPE_BOOL, rlm_mem_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
+
+	{ FR_CONF_OFFSET("shards", FR_TYPE_UINT32, rlm_mem_ippool_t, shards), .dflt = "16" },
+
+	{ FR_CONF_POINTER("journal", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) journal_config },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_freeradius;
+static fr_dict_t const *dict_radius;
+static fr_dict_t const *dict_dhcpv4;
+
+extern fr_dict_autoload_t rlm_mem_ippool_dict[];
+fr_dict_autoload_t rlm_mem_ippool_dict[] = {
+	{ .out = &dict_freeradius, .proto = "freeradius" },
+	{ .out = &dict_radius, .proto = "radius" },
+	{ .out = &dict_dhcpv4, .proto = "dhcpv4" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_pool_action;
+static fr_dict_attr_t const *attr_acct_status_type;
+static fr_dict_attr_t const *attr_message_type;
+
+extern fr_dict_attr_autoload_t rlm_mem_ippool_dict_attr[];
+fr_dict_attr_autoload_t rlm_mem_ippool_dict_attr[] = {
+	{ .out = &attr_pool_action, .name = "Pool-Action", .type = FR_TYPE_UINT32, .dict = &dict_freeradius },
+	{ .out = &attr_acct_status_type, .name = "Acct-Status-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_message_type, .name = "DHCP-Message-Type", .type = FR_TYPE_UINT8, .dict = &dict_dhcpv4 },
+	{ NULL }
+};
+
+/** Find a pool by name
+ *
+ */
+static mem_ippool_t *mem_ippool_find(rlm_mem_ippool_t const *inst, char const *name)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(inst->pools); i++) {
+		if (strcmp(mem_ippool_name(inst->pools[i]), name) == 0) return inst->pools[i];
+	}
+
+	return NULL;
+}
+
+/** Write the allocated address, and the lease time, to the request
+ *
+ * @param[in] inst	of rlm_mem_ippool.
+ * @param[in] request	to write the attributes to.
+ * @param[in] ip	to write to allocated_address_attr.  May be NULL.
+ * @param[in] expires	when the lease expires.
+ * @param[in] now	the current time.
+ */
+static int mem_ippool_reply(rlm_mem_ippool_t const *inst, request_t *request,
+			    fr_ipaddr_t const *ip, fr_unix_time_t expires, fr_unix_time_t now)
+{
+	tmpl_t	rhs;
+	map_t	map = {
+			.lhs = inst->allocated_address_attr,
+			.op = T_OP_SET,
+			.rhs = &rhs
+		};
+
+	if (ip) {
+		tmpl_init_shallow(&rhs, TMPL_TYPE_DATA, T_BARE_WORD, "", 0);
+		fr_value_box_ipaddr(&rhs.data.literal, NULL, ip, false);
+		if (map_to_request(request, &map, map_to_vp, NULL) < 0) return -1;
+	}
+
+	if (inst->expiry_attr) {
+		map.lhs = inst->expiry_attr;
+		tmpl_init_shallow(&rhs, TMPL_TYPE_DATA, T_BARE_WORD, "", 0);
+		fr_value_box_shallow(&rhs.data.literal,
+				     (uint32_t)((expires > now) ? fr_time_delta_to_sec(expires - now) : 0), false);
+		if (map_to_request(request, &map, map_to_vp, NULL) < 0) return -1;
+	}
+
+	return 0;
+}
+
+static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_mem_ippool_t const *inst, request_t *request,
+				  mem_ippool_action_t action)
+{
+	char		pool_name_buff[256], owner_buff[256], gateway_buff[256];
+	char const	*pool_name, *owner, *gateway = NULL;
+	mem_ippool_t	*pool;
+	fr_ipaddr_t	ip;
+	fr_unix_time_t	now, expires;
+	ssize_t		slen;
+
+	slen = tmpl_expand(&pool_name, pool_name_buff, sizeof(pool_name_buff), request, inst->pool_name, NULL, NULL);
+	if (slen < 0) {
+		if (tmpl_is_attr(inst->pool_name)) {
+			RDEBUG2("Pool attribute not present in request.  Doing nothing");
+			RETURN_MODULE_NOOP;
+		}
+		REDEBUG("Failed expanding pool name");
+		RETURN_MODULE_FAIL;
+	}
+	if (slen == 0) {
+		RDEBUG2("Empty pool name.  Doing nothing");
+		RETURN_MODULE_NOOP;
+	}
+
+	pool = mem_ippool_find(inst, pool_name);
+	if (!pool) {
+		REDEBUG("No pool \"%s\" is configured", pool_name);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (tmpl_expand(&owner, owner_buff, sizeof(owner_buff), request, inst->owner, NULL, NULL) < 0) {
+		REDEBUG("Failed expanding owner (%s)", inst->owner->name);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (inst->gateway_id) {
+		if (tmpl_expand(&gateway, gateway_buff, sizeof(gateway_buff),
+				request, inst->gateway_id, NULL, NULL) < 0) {
+			REDEBUG("Failed expanding gateway (%s)", inst->gateway_id->name);
+			RETURN_MODULE_FAIL;
+		}
+		if (!*gateway) gateway = NULL;
+	}
+
+	now = fr_time_to_unix_time(fr_time());
+
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		if (!*owner) {
+			REDEBUG("Owner (%s) expanded to an empty string", inst->owner->name);
+			RETURN_MODULE_INVALID;
+		}
+
+		RDEBUG2("Allocating lease from pool \"%s\" to owner \"%s\"", pool_name, owner);
+		switch (mem_ippool_allocate(pool, &ip, &expires, owner, gateway, now, inst->offer_time)) {
+		case MEM_IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address %pV lease allocated", fr_box_ipaddr(ip));
+			if (mem_ippool_reply(inst, request, &ip, expires, now) < 0) RETURN_MODULE_FAIL;
+			RETURN_MODULE_UPDATED;
+
+		case MEM_IPPOOL_RCODE_POOL_EMPTY:
+			RWDEBUG("Pool contains no free addresses");
+			RETURN_MODULE_NOTFOUND;
+
+		default:
+			RETURN_MODULE_FAIL;
+		}
+
+	case POOL_ACTION_UPDATE:
+	case POOL_ACTION_RELEASE:
+	{
+		char		ip_buff[INET6_ADDRSTRLEN + 4];
+		char const	*ip_str;
+
+		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
+			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
+			RETURN_MODULE_FAIL;
+		}
+
+		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
+			RPEDEBUG("Failed parsing address");
+			RETURN_MODULE_FAIL;
+		}
+
+		if (action == POOL_ACTION_RELEASE) {
+			RDEBUG2("Releasing IP address \"%s\" in pool \"%s\" from owner \"%s\"", ip_str, pool_name, owner);
+			switch (mem_ippool_release(pool, &ip, owner)) {
+			case MEM_IPPOOL_RCODE_SUCCESS:
+				RDEBUG2("IP address \"%s\" released", ip_str);
+				RETURN_MODULE_UPDATED;
+
+			case MEM_IPPOOL_RCODE_NOT_FOUND:
+				REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
+				RETURN_MODULE_NOTFOUND;
+
+			case MEM_IPPOOL_RCODE_DEVICE_MISMATCH:
+				REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
+				RETURN_MODULE_INVALID;
+
+			default:
+				RETURN_MODULE_FAIL;
+			}
+		}
+
+		RDEBUG2("Updating IP address \"%s\" in pool \"%s\" for owner \"%s\"", ip_str, pool_name, owner);
+		switch (mem_ippool_update(pool, &ip, &expires, owner, gateway, now, inst->lease_time)) {
+		case MEM_IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
+
+			if (mem_ippool_reply(inst, request, inst->copy_on_update ? &ip : NULL, expires, now) < 0) {
+				RETURN_MODULE_FAIL;
+			}
+			RETURN_MODULE_UPDATED;
+
+		/*
+		 *	It's useful to be able to identify the 'not found' case
+		 *	as we can relay to a server where the IP address might
+		 *	be found.  This extremely useful for migrations.
+		 */
+		case MEM_IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
+			RETURN_MODULE_NOTFOUND;
+
+		case MEM_IPPOOL_RCODE_EXPIRED:
+			REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", ip_str);
+			RETURN_MODULE_INVALID;
+
+		case MEM_IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
+			RETURN_MODULE_INVALID;
+
+		default:
+			RETURN_MODULE_FAIL;
+		}
+	}
+
+	case POOL_ACTION_BULK_RELEASE:
+		if (!gateway) {
+			RWDEBUG("No gateway, can't bulk release");
+			RETURN_MODULE_NOOP;
+		}
+
+		RDEBUG2("Released %u leases in pool \"%s\" for gateway \"%s\"",
+			mem_ippool_bulk_release(pool, gateway), pool_name, gateway);
+		RETURN_MODULE_UPDATED;
+
+	default:
+		fr_assert(0);
+		RETURN_MODULE_FAIL;
+	}
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_mem_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_mem_ippool_t);
+	fr_pair_t		*vp;
+
+	/*
+	 *	Pool-Action override
+	 */
+	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action);
+	if (vp) return mod_action(p_result, inst, request, vp->vp_uint32);
+
+	/*
+	 *	Otherwise, guess the action by Acct-Status-Type
+	 */
+	vp = fr_pair_find_by_da(&request->request_pairs, attr_acct_status_type);
+	if (!vp) {
+		RDEBUG2("Couldn't find &request.Acct-Status-Type or &control.Pool-Action, doing nothing...");
+		RETURN_MODULE_NOOP;
+	}
+
+	switch (vp->vp_uint32) {
+	case FR_STATUS_START:
+	case FR_STATUS_ALIVE:
+		return mod_action(p_result, inst, request, POOL_ACTION_UPDATE);
+
+	case FR_STATUS_STOP:
+		return mod_action(p_result, inst, request, POOL_ACTION_RELEASE);
+
+	case FR_STATUS_ACCOUNTING_OFF:
+	case FR_STATUS_ACCOUNTING_ON:
+		return mod_action(p_result, inst, request, POOL_ACTION_BULK_RELEASE);
+
+	default:
+		RETURN_MODULE_NOOP;
+	}
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_mem_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_mem_ippool_t);
+	fr_pair_t		*vp;
+	mem_ippool_action_t	action = POOL_ACTION_ALLOCATE;
+
+	/*
+	 *	Unless it's overridden the default action is to allocate
+	 *	when called in Post-Auth.
+	 */
+	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action);
+	if (vp) {
+		if ((vp->vp_uint32 > 0) && (vp->vp_uint32 <= POOL_ACTION_BULK_RELEASE)) {
+			action = vp->vp_uint32;
+
+		} else {
+			RWDEBUG("Ignoring invalid action %d", vp->vp_uint32);
+			RETURN_MODULE_NOOP;
+		}
+
+	} else if (request->dict == dict_dhcpv4) {
+		vp = fr_pair_find_by_da(&request->control_pairs, attr_message_type);
+		if (vp && (vp->vp_uint8 == FR_DHCP_REQUEST)) action = POOL_ACTION_UPDATE;
+	}
+
+	return mod_action(p_result, inst, request, action);
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_request(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_mem_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_mem_ippool_t);
+	fr_pair_t		*vp;
+
+	/*
+	 *	Unless it's overridden the default action is to update
+	 *	when called by DHCP request
+	 */
+	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action);
+	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_UPDATE);
+}
+
+/** Parse a range of addresses, either a prefix, or "<start>-<end>"
+ *
+ */
+static int mem_ippool_range_parse(mem_ippool_t *pool, CONF_PAIR *cp)
+{
+	char const	*value = cf_pair_value(cp);
+	char const	*p;
+	fr_ipaddr_t	start, end;
+	uint64_t	num;
+
+	p = strchr(value, '-');
+	if (p) {
+		if ((fr_inet_pton(&start, value, p - value, AF_UNSPEC, false, false) < 0) ||
+		    (fr_inet_pton(&end, p + 1, -1, start.af, false, false) < 0)) {
+			cf_log_perr(cp, "Invalid range");
+			return -1;
+		}
+
+		if (fr_ipaddr_cmp(&start, &end) > 0) {
+			cf_log_err(cp, "Start of range must not be after the end");
+			return -1;
+		}
+
+		/*
+		 *	Ranges must fit within the last 32 bits
+		 *	of the address.
+		 */
+		if ((start.af == AF_INET6) &&
+		    (memcmp(start.addr.v6.s6_addr, end.addr.v6.s6_addr, 12) != 0)) {
+			cf_log_err(cp, "Range is too large");
+			return -1;
+		}
+		num = (uint64_t)mem_ippool_ipaddr_low(&end) - mem_ippool_ipaddr_low(&start) + 1;
+	} else {
+		int bits;
+
+		if (fr_inet_pton(&start, value, -1, AF_UNSPEC, false, true) < 0) {
+			cf_log_perr(cp, "Invalid range");
+			return -1;
+		}
+
+		bits = ((start.af == AF_INET) ? 32 : 128) - start.prefix;
+		if (bits > 24) {
+			cf_log_err(cp, "Range is too large");
+			return -1;
+		}
+		fr_ipaddr_mask(&start, start.prefix);
+		num = (uint64_t)1 << bits;
+	}
+
+	if (num > MEM_IPPOOL_MAX_ADDRESSES) {
+		cf_log_err(cp, "Range is too large");
+		return -1;
+	}
+
+	if (mem_ippool_add_range(pool, &start, (uint32_t)num) < 0) {
+		cf_log_perr(cp, "Failed adding range");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_mem_ippool_t	*inst = instance;
+	CONF_SECTION		*subcs;
+
+	fr_assert(tmpl_is_attr(inst->allocated_address_attr));
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	FR_INTEGER_BOUND_CHECK("shards", inst->shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", inst->shards, <=, MEM_IPPOOL_MAX_SHARDS);
+
+	/*
+	 *	If we don't have a separate time specifically for offers
+	 *	just use the lease time.
+	 */
+	if (!inst->offer_time) inst->offer_time = inst->lease_time;
+
+	if (inst->journal_filename) {
+		/*
+		 *	The writer thread wakes up every flush_interval,
+		 *	so 0 would have it spin.
+		 */
+		FR_TIME_DELTA_BOUND_CHECK("journal.flush_interval", inst->journal_flush_interval,
+					  >=, fr_time_delta_from_msec(1));
+		FR_TIME_DELTA_BOUND_CHECK("journal.flush_interval", inst->journal_flush_interval,
+					  <=, fr_time_delta_from_sec(10));
+
+		if (inst->journal_snapshot_interval) {
+			FR_TIME_DELTA_BOUND_CHECK("journal.snapshot_interval", inst->journal_snapshot_interval,
+						  >=, fr_time_delta_from_sec(1));
+		}
+
+		inst->journal = mem_ippool_journal_alloc(inst, inst->journal_filename, inst->journal_sync,
+							 inst->journal_flush_interval,
+							 inst->journal_snapshot_interval);
+	}
+
+	MEM(inst->pools = talloc_array(inst, mem_ippool_t *, 0));
+
+	for (subcs = cf_section_find_next(conf, NULL, "pool", CF_IDENT_ANY);
+	     subcs;
+	     subcs = cf_section_find_next(conf, subcs, "pool", CF_IDENT_ANY)) {
+		char const	*name = cf_section_name2(subcs);
+		mem_ippool_t	*pool;
+		CONF_PAIR	*cp;
+		size_t		n;
+
+		if (!name) {
+			cf_log_err(subcs, "Pool must have a name");
+			return -1;
+		}
+
+		if (strlen(name) > UINT8_MAX) {
+			cf_log_err(subcs, "Pool name must be shorter than %u characters", UINT8_MAX);
+			return -1;
+		}
+
+		if (mem_ippool_find(inst, name)) {
+			cf_log_err(subcs, "Duplicate pool \"%s\"", name);
+			return -1;
+		}
+
+		pool = mem_ippool_alloc(inst, name, inst->shards, inst->journal);
+
+		for (cp = cf_pair_find_next(subcs, NULL, "range");
+		     cp;
+		     cp = cf_pair_find_next(subcs, cp, "range")) {
+			if (mem_ippool_range_parse(pool, cp) < 0) return -1;
+		}
+
+		if (mem_ippool_init(pool) < 0) {
+			cf_log_perr(subcs, "Failed creating pool");
+			return -1;
+		}
+
+		n = talloc_array_length(inst->pools);
+		MEM(inst->pools = talloc_realloc(inst, inst->pools, mem_ippool_t *, n + 1));
+		inst->pools[n] = pool;
+
+		DEBUG2("%s - Pool \"%s\" contains %u addresses", inst->name, name, mem_ippool_num_addresses(pool));
+	}
+
+	if (talloc_array_length(inst->pools) == 0) {
+		cf_log_err(conf, "At least one pool must be configured");
+		return -1;
+	}
+
+	if (inst->journal && (mem_ippool_journal_start(inst->journal, inst->pools) < 0)) {
+		cf_log_err(conf, "Failed restoring leases from journal");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_mem_ippool_t	*inst = talloc_get_type_abort(instance, rlm_mem_ippool_t);
+	size_t			i;
+
+	/*
+	 *	Write the final snapshot while the pools
+	 *	still exist.
+	 */
+	if (inst->journal) mem_ippool_journal_stop(inst->journal);
+
+	for (i = 0; i < talloc_array_length(inst->pools); i++) {
+		uint32_t	leased;
+		uint64_t	rebalanced;
+
+		mem_ippool_stats(inst->pools[i], &leased, &rebalanced);
+		DEBUG2("%s - Pool \"%s\" has %u of %u addresses leased, %" PRIu64 " addresses moved between shards",
+		       inst->name, mem_ippool_name(inst->pools[i]), leased,
+		       mem_ippool_num_addresses(inst->pools[i]), rebalanced);
+	}
+
+	return 0;
+}
+
+extern module_t rlm_mem_ippool;
+module_t rlm_mem_ippool = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "mem_ippool",
+	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_mem_ippool_t),
+	.config		= module_config,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.methods = {
+		[MOD_ACCOUNTING]	= mod_accounting,
+		[MOD_AUTHORIZE]		= mod_post_auth,
+		[MOD_POST_AUTH]		= mod_post_auth,
+	},
+	.method_names = (module_method_names_t[]) {
+		{ "recv",	"DHCP-Request",	mod_request },
+		MODULE_NAME_TERMINATOR
+	}
+};
@@ -0,0 +1,3 @@
+TARGET		:= rlm_mem_ippool.a
+SOURCES		:= rlm_mem_ippool.c mem_ippool.c
+TGT_LDLIBS	:= $(LIBS)
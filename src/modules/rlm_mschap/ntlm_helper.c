@@ -0,0 +1,260 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file ntlm_helper.c
+ * @brief NTLM authentication via long-lived ntlm_auth helpers
+ *
+ * Instead of running ntlm_auth once for every authentication, each
+ * worker thread keeps a small number of
+ * "ntlm_auth --helper-protocol=ntlm-server-1" processes running.
+ * The helpers are managed by the fr_exec_helper_pool_t API, which
+ * queues requests, and restarts helpers which exit or hang.  This file
+ * only deals with the protocol.
+ *
+ * The protocol is line based.  We send:
+ *
+@verbatim
+Username: bob
+NT-Domain: EXAMPLE
+LANMAN-Challenge: 0011223344556677
+NT-Response: 00112233...
+Request-User-Session-Key: Yes
+.
+@endverbatim
+ *
+ * and the helper answers with either:
+ *
+@verbatim
+Authenticated: Yes
+User-Session-Key: 000102030405060708090a0b0c0d0e0f
+.
+@endverbatim
+ *
+ * or "Authenticated: No", followed by an "Authentication-Error: ..." line,
+ * and a ".".  Values which can't be sent as a single line are base64
+ * encoded, and sent as "Key:: value".
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_mschap (%s) - "
+#define LOG_PREFIX_ARGS dl_module_instance_name_by_data(inst)
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/exec.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/base64.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hex.h>
+#include <freeradius-devel/util/misc.h>
+
+#include "rlm_mschap.h"
+#include "mschap.h"
+#include "ntlm_helper.h"
+
+/** Process one line of a helper's answer
+ *
+ * @return
+ *	- 1 if this was the end of the answer.
+ *	- 0 if there's more to come.
+ */
+static int ntlm_helper_line(fr_exec_helper_request_t *er, char *line, void *uctx)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(uctx, rlm_mschap_t);
+	ntlm_helper_request_t	*hr;
+	request_t		*request;
+	char			*value;
+	size_t			len;
+
+	if (strcmp(line, ".") == 0) {
+		/*
+		 *	The request was cancelled while the helper was busy.
+		 */
+		if (!er) return 1;
+
+		hr = er->uctx;
+		request = er->request;
+
+		if (!hr->authenticated) {
+			er->result = mschap_ntlm_auth_error(request, hr->error);
+			return 1;
+		}
+
+		if (!hr->have_key) {
+			REDEBUG("Invalid output from ntlm_auth helper: missing User-Session-Key");
+			er->result = -1;
+			return 1;
+		}
+
+		er->result = 0;
+		return 1;
+	}
+
+	value = strchr(line, ':');
+	if (!value) {
+		WARN("Ignoring invalid line from ntlm_auth helper: %s", line);
+		return 0;
+	}
+	*(value++) = '\0';
+
+	if (!er) return 0;
+	hr = er->uctx;
+
+	/*
+	 *	"Key:: value" means the value is base64 encoded.
+	 *	None of the values we use need encoding, so the
+	 *	only ones we see are error messages, which are
+	 *	used as-is.
+	 */
+	if (*value == ':') value++;
+	fr_skip_whitespace(value);
+	len = strlen(value);
+
+	if (strcasecmp(line, "Authenticated") == 0) {
+		hr->authenticated = (strcasecmp(value, "Yes") == 0);
+
+	} else if (strcasecmp(line, "User-Session-Key") == 0) {
+		if (fr_hex2bin(NULL, &FR_DBUFF_TMP(hr->nthashhash, sizeof(hr->nthashhash)),
+			       &FR_SBUFF_IN(value, len), false) == sizeof(hr->nthashhash)) {
+			hr->have_key = true;
+		}
+
+	} else if ((strcasecmp(line, "Authentication-Error") == 0) || (strcasecmp(line, "Error") == 0)) {
+		strlcpy(hr->error, value, sizeof(hr->error));
+	}
+
+	return 0;
+}
+
+/** Add a "Key: value" line to a query, base64 encoding the value if necessary
+ *
+ */
+static char *ntlm_helper_query_add(char *query, char const *key, char const *value)
+{
+	char const	*p;
+	char		*b64;
+	size_t		len = strlen(value);
+
+	for (p = value; *p; p++) {
+		if ((*p == '\r') || (*p == '\n') || (*p == ':')) break;
+	}
+	if (!*p && (*value != ' ')) return talloc_asprintf_append_buffer(query, "%s: %s\n", key, value);
+
+	MEM(b64 = talloc_array(query, char, FR_BASE64_ENC_LENGTH(len) + 1));
+	fr_base64_encode(b64, FR_BASE64_ENC_LENGTH(len) + 1, (uint8_t const *) value, len);
+	query = talloc_asprintf_append_buffer(query, "%s:: %s\n", key, b64);
+	talloc_free(b64);
+
+	return query;
+}
+
+/** Create the query for a request
+ *
+ * @param[in] ctx		to allocate the query in.
+ * @param[out] hr		to initialise.
+ * @param[in] request		The current request.
+ * @param[in] username		Username, without the domain.
+ * @param[in] domain		NT domain.  May be NULL.
+ * @param[in] challenge		The 8 octet challenge which the NT-Response was calculated over.
+ * @param[in] response		The 24 octet NT-Response.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int ntlm_helper_request_init(TALLOC_CTX *ctx, ntlm_helper_request_t *hr, request_t *request,
+			     char const *username, char const *domain,
+			     uint8_t const challenge[static 8], uint8_t const response[static 24])
+{
+	char	challenge_hex[(8 * 2) + 1];
+	char	response_hex[(24 * 2) + 1];
+	char	*query;
+
+	memset(hr, 0, sizeof(*hr));
+
+	fr_bin2hex(&FR_SBUFF_OUT(challenge_hex, sizeof(challenge_hex)), &FR_DBUFF_TMP(challenge, 8), SIZE_MAX);
+	fr_bin2hex(&FR_SBUFF_OUT(response_hex, sizeof(response_hex)), &FR_DBUFF_TMP(response, 24), SIZE_MAX);
+
+	MEM(query = talloc_strdup(ctx, ""));
+	query = ntlm_helper_query_add(query, "Username", username);
+	if (domain && *domain) query = ntlm_helper_query_add(query, "NT-Domain", domain);
+	query = talloc_asprintf_append_buffer(query,
+					      "LANMAN-Challenge: %s\n"
+					      "NT-Response: %s\n"
+					      "Request-User-Session-Key: Yes\n"
+					      ".\n", challenge_hex, response_hex);
+	if (!query) return -1;
+
+	hr->query = query;
+	fr_exec_helper_request_init(&hr->er, request, query, talloc_array_length(query) - 1, hr);
+
+	return 0;
+}
+
+/** Give a request to an idle helper, or queue it until one is available
+ *
+ * When the helper answers, hr->er.result is set, and the request is
+ * marked as resumable.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the request couldn't be sent to a helper.
+ */
+int ntlm_helper_enqueue(rlm_mschap_thread_t *t, ntlm_helper_request_t *hr)
+{
+	return fr_exec_helper_enqueue(t->helpers, &hr->er);
+}
+
+/** Stop waiting for a helper
+ *
+ * @copydetails fr_exec_helper_dequeue
+ */
+bool ntlm_helper_dequeue(rlm_mschap_thread_t *t, ntlm_helper_request_t *hr, bool timeout)
+{
+	return fr_exec_helper_dequeue(t->helpers, &hr->er, timeout);
+}
+
+int ntlm_helper_thread_instantiate(rlm_mschap_thread_t *t, rlm_mschap_t const *inst, fr_event_list_t *el)
+{
+	char	*name;
+	void	*uctx;
+
+	t->inst = inst;
+	t->el = el;
+
+	memcpy(&uctx, &inst, sizeof(uctx)); /* const issues */
+
+	MEM(name = talloc_typed_asprintf(NULL, LOG_PREFIX "ntlm_auth helper", LOG_PREFIX_ARGS));
+	t->helpers = fr_exec_helper_pool_alloc(t, el, name, inst->ntlm_helper, inst->ntlm_helper_count,
+					       ntlm_helper_line, uctx);
+	talloc_free(name);
+	if (!t->helpers) return -1;
+
+	return 0;
+}
+
+void ntlm_helper_thread_detach(rlm_mschap_thread_t *t)
+{
+	if (!t->helpers) return;
+
+	/*
+	 *	The event loop is going away, so the helpers
+	 *	are reaped synchronously.
+	 */
+	fr_exec_helper_pool_stop(t->helpers);
+}
@@ -0,0 +1,43 @@
+#pragma once
+/* @copyright 2021 The FreeRADIUS server project */
+RCSIDH(ntlm_helper_h, "$Id$")
+
+#include <freeradius-devel/server/exec.h>
+
+/** A request waiting for, or being processed by, an ntlm_auth helper
+ *
+ */
+typedef struct {
+	fr_exec_helper_request_t er;			//!< er.result is 0 on success, or one of the
+							///< do_mschap() error codes.
+	char			*query;			//!< Lines to send to the helper, ending with ".\n".
+
+	bool			authenticated;		//!< State for the answer being read.
+	bool			have_key;
+	char			error[256];
+
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];
+} ntlm_helper_request_t;
+
+/** Per-thread instance data
+ *
+ * Each worker thread runs its own ntlm_auth helpers, so they need no locking.
+ */
+typedef struct {
+	rlm_mschap_t const	*inst;
+	fr_event_list_t		*el;
+
+	fr_exec_helper_pool_t	*helpers;		//!< inst->ntlm_helper_count helpers.
+} rlm_mschap_thread_t;
+
+int	ntlm_helper_thread_instantiate(rlm_mschap_thread_t *t, rlm_mschap_t const *inst, fr_event_list_t *el);
+
+void	ntlm_helper_thread_detach(rlm_mschap_thread_t *t);
+
+int	ntlm_helper_request_init(TALLOC_CTX *ctx, ntlm_helper_request_t *hr, request_t *request,
+				 char const *username, char const *domain,
+				 uint8_t const challenge[static 8], uint8_t const response[static 24]);
+
+int	ntlm_helper_enqueue(rlm_mschap_thread_t *t, ntlm_helper_request_t *hr);
+
+bool	ntlm_helper_dequeue(rlm_mschap_thread_t *t, ntlm_helper_request_t *hr, bool timeout);
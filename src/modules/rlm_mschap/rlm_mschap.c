@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/password.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 
 #include <freeradius-devel/util/hex.h>
@@ -44,6 +45,7 @@ RCSID("$Id$")
 
 #include "rlm_mschap.h"
 #include "mschap.h"
+#include "ntlm_helper.h"
 #include "smbdes.h"
 
 #ifdef WITH_AUTH_WINBIND
@@ -90,6 +92,14 @@ static const CONF_PARSER winbind_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER ntlm_auth_helper_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, rlm_mschap_t, ntlm_helper) },
+	{ FR_CONF_OFFSET("username", FR_TYPE_TMPL, rlm_mschap_t, ntlm_helper_username) },
+	{ FR_CONF_OFFSET("domain", FR_TYPE_TMPL, rlm_mschap_t, ntlm_helper_domain) },
+	{ FR_CONF_OFFSET("count", FR_TYPE_UINT32, rlm_mschap_t, ntlm_helper_count), .dflt = "2" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_mschap_t, normify), .dflt = "yes" },
 
@@ -102,6 +112,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("with_ntdomain_hack", FR_TYPE_BOOL, rlm_mschap_t, with_ntdomain_hack), .dflt = "yes" },
 	{ FR_CONF_OFFSET("ntlm_auth", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_auth_timeout) },
+	{ FR_CONF_POINTER("ntlm_auth_helper", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) ntlm_auth_helper_config },
 
 	{ FR_CONF_POINTER("passchange", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
 	{ FR_CONF_OFFSET("allow_retry", FR_TYPE_BOOL, rlm_mschap_t, allow_retry), .dflt = "yes" },
@@ -1060,6 +1071,104 @@ ntlm_auth_err:
 	return -1;
 }
 
+/** Map an error message from ntlm_auth to an MS-CHAP error
+ *
+ * @param[in] request	The current request.
+ * @param[in] buffer	Output of ntlm_auth, or the Authentication-Error
+ *			from an ntlm_auth helper.
+ * @return
+ *	- -648 if the password has expired.
+ *	- -647 if the account is locked out.
+ *	- -691 if the account is disabled.
+ *	- -2 if the domain controller couldn't be reached.
+ *	- -1 for any other failure.
+ */
+int mschap_ntlm_auth_error(request_t *request, char const *buffer)
+{
+	char const	*p;
+	int		result;
+
+	/*
+	 *	Do checks for numbers, which are
+	 *	language neutral.  They're also
+	 *	faster.
+	 */
+	p = strcasestr(buffer, "0xC0000");
+	if (p) {
+		result = 0;
+
+		p += 7;
+		if (strcmp(p, "224") == 0) {
+			result = -648;
+
+		} else if (strcmp(p, "234") == 0) {
+			result = -647;
+
+		} else if (strcmp(p, "072") == 0) {
+			result = -691;
+
+		} else if (strcasecmp(p, "05E") == 0) {
+			result = -2;
+		}
+
+		if (result != 0) {
+			REDEBUG2("%s", buffer);
+			return result;
+		}
+
+		/*
+		 *	Else fall through to more ridiculous checks.
+		 */
+	}
+
+	/*
+	 *	Look for variants of expire password.  The NT_STATUS
+	 *	names are what the ntlm_auth helper protocol returns.
+	 */
+	if (strcasestr(buffer, "0xC0000224") ||
+	    strcasestr(buffer, "Password expired") ||
+	    strcasestr(buffer, "Password has expired") ||
+	    strcasestr(buffer, "Password must be changed") ||
+	    strcasestr(buffer, "Must change password") ||
+	    strcasestr(buffer, "NT_STATUS_PASSWORD_EXPIRED") ||
+	    strcasestr(buffer, "NT_STATUS_PASSWORD_MUST_CHANGE")) {
+		return -648;
+	}
+
+	if (strcasestr(buffer, "0xC0000234") ||
+	    strcasestr(buffer, "Account locked out") ||
+	    strcasestr(buffer, "NT_STATUS_ACCOUNT_LOCKED_OUT")) {
+		REDEBUG2("%s", buffer);
+		return -647;
+	}
+
+	if (strcasestr(buffer, "0xC0000072") ||
+	    strcasestr(buffer, "Account disabled") ||
+	    strcasestr(buffer, "NT_STATUS_ACCOUNT_DISABLED")) {
+		REDEBUG2("%s", buffer);
+		return -691;
+	}
+
+	if (strcasestr(buffer, "0xC000005E") ||
+	    strcasestr(buffer, "No logon servers") ||
+	    strcasestr(buffer, "NT_STATUS_NO_LOGON_SERVERS")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	if (strcasestr(buffer, "could not obtain winbind separator") ||
+	    strcasestr(buffer, "Reading winbind reply failed")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	RDEBUG2("External script failed");
+	p = strchr(buffer, '\n');
+
+	REDEBUG("External script says: %.*s", p ? (int)(p - buffer) : (int)strlen(buffer), buffer);
+	return -1;
+}
+
 /*
  *	Do the MS-CHAP stuff.
  *
@@ -1120,84 +1229,7 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 		 */
 		result = radius_exec_program(request, buffer, sizeof(buffer), NULL, request, inst->ntlm_auth, NULL,
 					     true, true, inst->ntlm_auth_timeout);
-		if (result != 0) {
-			char *p;
-
-			/*
-			 *	Do checks for numbers, which are
-			 *	language neutral.  They're also
-			 *	faster.
-			 */
-			p = strcasestr(buffer, "0xC0000");
-			if (p) {
-				result = 0;
-
-				p += 7;
-				if (strcmp(p, "224") == 0) {
-					result = -648;
-
-				} else if (strcmp(p, "234") == 0) {
-					result = -647;
-
-				} else if (strcmp(p, "072") == 0) {
-					result = -691;
-
-				} else if (strcasecmp(p, "05E") == 0) {
-					result = -2;
-				}
-
-				if (result != 0) {
-					REDEBUG2("%s", buffer);
-					return result;
-				}
-
-				/*
-				 *	Else fall through to more ridiculous checks.
-				 */
-			}
-
-			/*
-			 *	Look for variants of expire password.
-			 */
-			if (strcasestr(buffer, "0xC0000224") ||
-			    strcasestr(buffer, "Password expired") ||
-			    strcasestr(buffer, "Password has expired") ||
-			    strcasestr(buffer, "Password must be changed") ||
-			    strcasestr(buffer, "Must change password")) {
-				return -648;
-			}
-
-			if (strcasestr(buffer, "0xC0000234") ||
-			    strcasestr(buffer, "Account locked out")) {
-				REDEBUG2("%s", buffer);
-				return -647;
-			}
-
-			if (strcasestr(buffer, "0xC0000072") ||
-			    strcasestr(buffer, "Account disabled")) {
-				REDEBUG2("%s", buffer);
-				return -691;
-			}
-
-			if (strcasestr(buffer, "0xC000005E") ||
-			    strcasestr(buffer, "No logon servers")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			if (strcasestr(buffer, "could not obtain winbind separator") ||
-			    strcasestr(buffer, "Reading winbind reply failed")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			RDEBUG2("External script failed");
-			p = strchr(buffer, '\n');
-			if (p) *p = '\0';
-
-			REDEBUG("External script says: %s", buffer);
-			return -1;
-		}
+		if (result != 0) return mschap_ntlm_auth_error(request, buffer);
 
 		/*
 		 *	Parse the answer as an nthashhash.
@@ -1707,21 +1739,43 @@ static unlang_action_t CC_HINT(nonnull) mschap_process_cpw_request(rlm_rcode_t *
 	RETURN_MODULE_OK;
 }
 
-static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
-									       int *mschap_version,
-									       uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									       rlm_mschap_t const *inst,
-									       request_t *request,
-									       fr_pair_t *smb_ctrl,
-									       fr_pair_t *nt_password,
-									       fr_pair_t *challenge,
-									       fr_pair_t *response,
-									       MSCHAP_AUTH_METHOD method)
+/** State for an MS-CHAP authentication, kept across the yield to an ntlm_auth helper
+ *
+ */
+typedef struct {
+	MSCHAP_AUTH_METHOD	method;
+	int			mschap_version;
+	fr_pair_t		*smb_ctrl;
+	fr_pair_t		*nt_password;
+	bool			ephemeral;		//!< nt_password was created by us, and must be freed.
+
+	fr_pair_t		*challenge;
+	fr_pair_t		*response;
+
+	uint8_t			auth_challenge[MSCHAP_CHALLENGE_LENGTH];	//!< What the NT-Response was
+										///< calculated over.
+	uint8_t const		*peer_challenge;	//!< MS-CHAPv2 only.
+	char const		*username_str;		//!< MS-CHAPv2 only.  Without the domain.
+	size_t			username_len;
+
+	int			mschap_result;
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];
+
+	rlm_mschap_thread_t	*t;			//!< For AUTH_NTLMAUTH_HELPER.
+	ntlm_helper_request_t	hr;
+#ifdef __APPLE__
+	bool			od_authenticated;	//!< OpenDirectory did the authentication.
+#endif
+} mschap_auth_ctx_t;
+
+static CC_HINT(nonnull) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
+								mschap_auth_ctx_t *auth_ctx,
+								request_t *request)
 {
-	int			offset;
-	rlm_rcode_t		mschap_result;
+	fr_pair_t	*challenge = auth_ctx->challenge;
+	fr_pair_t	*response = auth_ctx->response;
 
-	*mschap_version = 1;
+	auth_ctx->mschap_version = 1;
 
 	RDEBUG2("Processing MS-CHAPv1 response");
 
@@ -1750,41 +1804,26 @@ static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(r
 		RETURN_MODULE_FAIL;
 	}
 
-	offset = 26;
+	memcpy(auth_ctx->auth_challenge, challenge->vp_octets, MSCHAP_CHALLENGE_LENGTH);
 
-	/*
-	 *	Do the MS-CHAP authentication.
-	 */
-	mschap_result = do_mschap(inst, request, nt_password, challenge->vp_octets,
-				  response->vp_octets + offset, nthashhash, method);
-
-	/*
-	 *	Check for errors, and add MSCHAP-Error if necessary.
-	 */
-	return mschap_error(p_result, inst, request, *response->vp_octets, mschap_result, *mschap_version, smb_ctrl);
+	RETURN_MODULE_OK;
 }
 
-static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_response(rlm_rcode_t *p_result,
-										  int *mschap_version,
-									    	  uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									    	  rlm_mschap_t const *inst,
-									    	  request_t *request,
-									    	  fr_pair_t *smb_ctrl,
-									   	  fr_pair_t *nt_password,
-									    	  fr_pair_t *challenge,
-									    	  fr_pair_t *response,
-									    	  MSCHAP_AUTH_METHOD method)
+static unlang_action_t CC_HINT(nonnull) mschap_process_v2_response(rlm_rcode_t *p_result,
+								   mschap_auth_ctx_t *auth_ctx,
+								   rlm_mschap_t const *inst,
+								   request_t *request)
 {
-		uint8_t		mschap_challenge[16];
+		fr_pair_t	*challenge = auth_ctx->challenge;
+		fr_pair_t	*response = auth_ctx->response;
 		fr_pair_t	*user_name, *name_vp, *response_name, *peer_challenge_attr;
-		uint8_t const	*peer_challenge;
 		char const	*username_str;
 		size_t		username_len;
-		int		mschap_result;
+#ifdef __APPLE__
 		rlm_rcode_t	rcode;
-		char		msch2resp[42];
+#endif
 
-		*mschap_version = 2;
+		auth_ctx->mschap_version = 2;
 
 		RDEBUG2("Processing MS-CHAPv2 response");
 
@@ -1851,18 +1890,21 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		 *  indicates the auth process should continue directly to AD.
 		 *  Otherwise OD will determine auth success/fail.
 		 */
-		if (!nt_password && inst->open_directory) {
+		if (!auth_ctx->nt_password && inst->open_directory) {
 			RDEBUG2("No NT-Password available. Trying OpenDirectory Authentication");
 			rcode = od_mschap_auth(request, challenge, user_name);
-			if (rcode != RLM_MODULE_NOOP) RETURN_MODULE_RCODE(rcode);
+			if (rcode != RLM_MODULE_NOOP) {
+				auth_ctx->od_authenticated = (rcode == RLM_MODULE_OK);
+				RETURN_MODULE_RCODE(rcode);
+			}
 		}
 #endif
-		peer_challenge = response->vp_octets + 2;
+		auth_ctx->peer_challenge = response->vp_octets + 2;
 
 		peer_challenge_attr = fr_pair_find_by_da(&request->control_pairs, attr_ms_chap_peer_challenge);
 		if (peer_challenge_attr) {
 			RDEBUG2("Overriding peer challenge");
-			peer_challenge = peer_challenge_attr->vp_octets;
+			auth_ctx->peer_challenge = peer_challenge_attr->vp_octets;
 		}
 
 		/*
@@ -1874,23 +1916,37 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		 */
 		RDEBUG2("Creating challenge with username \"%pV\"",
 			fr_box_strvalue_len(username_str, username_len));
-		mschap_challenge_hash(mschap_challenge,		/* resulting challenge */
-				      peer_challenge,			/* peer challenge */
+		mschap_challenge_hash(auth_ctx->auth_challenge,	/* resulting challenge */
+				      auth_ctx->peer_challenge,		/* peer challenge */
 				      challenge->vp_octets,		/* our challenge */
 				      username_str, username_len);	/* user name */
 
-		mschap_result = do_mschap(inst, request, nt_password, mschap_challenge,
-					  response->vp_octets + 26, nthashhash, method);
+		auth_ctx->username_str = username_str;
+		auth_ctx->username_len = username_len;
 
-		/*
-		 *	Check for errors, and add MSCHAP-Error if necessary.
-		 */
-		mschap_error(&rcode, inst, request, *response->vp_octets,
-			     mschap_result, *mschap_version, smb_ctrl);
-		if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
+		RETURN_MODULE_OK;
+}
+
+/** Add MS-CHAP2-Success once the MS-CHAPv2 response has been verified
+ *
+ */
+static void CC_HINT(nonnull) mschap_v2_success(mschap_auth_ctx_t *auth_ctx,
+#ifdef WITH_AUTH_WINBIND
+					       rlm_mschap_t const *inst,
+#else
+					       UNUSED rlm_mschap_t const *inst,
+#endif
+					       request_t *request)
+{
+		fr_pair_t	*response = auth_ctx->response;
+		char const	*username_str = auth_ctx->username_str;
+		size_t		username_len = auth_ctx->username_len;
+		char		msch2resp[42];
 
 #ifdef WITH_AUTH_WINBIND
 		if (inst->wb_retry_with_normalised_username) {
+			fr_pair_t *response_name;
+
 			response_name = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_user_name);
 			if (response_name) {
 				if (strcmp(username_str, response_name->vp_strvalue)) {
@@ -1905,14 +1961,174 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 
 		mschap_auth_response(username_str,		/* without the domain */
 				     username_len,		/* Length of username str */
-				     nthashhash,		/* nt-hash-hash */
+				     auth_ctx->nthashhash,	/* nt-hash-hash */
 				     response->vp_octets + 26,	/* peer response */
-				     peer_challenge,		/* peer challenge */
-				     challenge->vp_octets,	/* our challenge */
+				     auth_ctx->peer_challenge,	/* peer challenge */
+				     auth_ctx->challenge->vp_octets,	/* our challenge */
 				     msch2resp);		/* calculated MPPE key */
 		mschap_add_reply(request, *response->vp_octets, attr_ms_chap2_success, msch2resp, 42);
+}
 
-		RETURN_MODULE_OK;
+/** Create the MPPE attributes
+ *
+ */
+static void CC_HINT(nonnull) mschap_mppe_add(mschap_auth_ctx_t *auth_ctx, rlm_mschap_t const *inst, request_t *request)
+{
+	fr_pair_t	*vp;
+	uint8_t		mppe_sendkey[34];
+	uint8_t		mppe_recvkey[34];
+
+	switch (auth_ctx->mschap_version) {
+	case 1:
+		RDEBUG2("Generating MS-CHAPv1 MPPE keys");
+		memset(mppe_sendkey, 0, 32);
+
+		/*
+		 *	According to RFC 2548 we
+		 *	should send NT hash.  But in
+		 *	practice it doesn't work.
+		 *	Instead, we should send nthashhash
+		 *
+		 *	This is an error in RFC 2548.
+		 */
+		/*
+		 *	do_mschap cares to zero nthashhash if NT hash
+		 *	is not available.
+		 */
+		memcpy(mppe_sendkey + 8, auth_ctx->nthashhash, NT_DIGEST_LENGTH);
+		mppe_add_reply(inst, request, attr_ms_chap_mppe_keys, mppe_sendkey, 24);	//-V666
+		break;
+
+	case 2:
+		RDEBUG2("Generating MS-CHAPv2 MPPE keys");
+		mppe_chap2_gen_keys128(auth_ctx->nthashhash, auth_ctx->response->vp_octets + 26,
+				       mppe_sendkey, mppe_recvkey);
+
+		mppe_add_reply(inst, request, attr_ms_mppe_recv_key, mppe_recvkey, 16);
+		mppe_add_reply(inst, request, attr_ms_mppe_send_key, mppe_sendkey, 16);
+		break;
+
+	default:
+		fr_assert(0);
+		break;
+	}
+
+	MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_policy) >= 0);
+	vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+
+	MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_types) >= 0);
+	vp->vp_uint32 = inst->require_strong ? 4 : 6;
+}
+
+/** Finish authentication, once the response has been verified
+ *
+ * Called directly for the synchronous methods, or when an ntlm_auth
+ * helper answers, or times out.
+ */
+static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					       request_t *request, void *rctx)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_mschap_t);
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(rctx, mschap_auth_ctx_t);
+	rlm_rcode_t		rcode;
+
+	if (auth_ctx->method == AUTH_NTLMAUTH_HELPER) {
+		(void) unlang_module_timeout_delete(request, auth_ctx);
+
+		auth_ctx->mschap_result = auth_ctx->hr.er.result;
+		memcpy(auth_ctx->nthashhash, auth_ctx->hr.nthashhash, NT_DIGEST_LENGTH);
+	}
+
+	/*
+	 *	Check for errors, and add MSCHAP-Error if necessary.
+	 */
+	mschap_error(&rcode, inst, request, *auth_ctx->response->vp_octets,
+		     auth_ctx->mschap_result, auth_ctx->mschap_version, auth_ctx->smb_ctrl);
+	if (rcode != RLM_MODULE_OK) goto finish;
+
+	if (auth_ctx->mschap_version == 2) mschap_v2_success(auth_ctx, inst, request);
+
+	/* now create MPPE attributes */
+	if (inst->use_mppe) mschap_mppe_add(auth_ctx, inst, request);
+
+finish:
+	if (auth_ctx->ephemeral) talloc_list_free(&auth_ctx->nt_password);
+	talloc_free(auth_ctx);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static void mschap_helper_timeout(UNUSED module_ctx_t const *mctx, request_t *request, void *rctx, UNUSED fr_time_t fired)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(rctx, mschap_auth_ctx_t);
+
+	/*
+	 *	The helper answered, but we haven't been resumed yet.
+	 */
+	if (!ntlm_helper_dequeue(auth_ctx->t, &auth_ctx->hr, true)) return;
+
+	REDEBUG("Timed out waiting for ntlm_auth helper");
+	auth_ctx->hr.er.result = -1;
+
+	unlang_interpret_resumable(request);
+}
+
+static void mschap_helper_signal(UNUSED module_ctx_t const *mctx, request_t *request, void *rctx, fr_state_signal_t action)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(rctx, mschap_auth_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	(void) ntlm_helper_dequeue(auth_ctx->t, &auth_ctx->hr, false);
+	(void) unlang_module_timeout_delete(request, auth_ctx);
+
+	if (auth_ctx->ephemeral) talloc_list_free(&auth_ctx->nt_password);
+	talloc_free(auth_ctx);
+}
+
+/** Hand the response to an ntlm_auth helper, and yield until it answers
+ *
+ */
+static unlang_action_t mschap_helper_yield(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					   request_t *request, mschap_auth_ctx_t *auth_ctx)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_mschap_t);
+	char			*username = NULL, *domain = NULL;
+	int			ret;
+
+	auth_ctx->t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+
+	if (tmpl_aexpand(auth_ctx, &username, request, inst->ntlm_helper_username, NULL, NULL) < 0) {
+		RPEDEBUG("Unable to expand ntlm_auth_helper username");
+		goto fail;
+	}
+
+	if (inst->ntlm_helper_domain &&
+	    (tmpl_aexpand(auth_ctx, &domain, request, inst->ntlm_helper_domain, NULL, NULL) < 0)) {
+		RPEDEBUG("Unable to expand ntlm_auth_helper domain");
+		goto fail;
+	}
+
+	ret = ntlm_helper_request_init(auth_ctx, &auth_ctx->hr, request, username, domain,
+				       auth_ctx->auth_challenge, auth_ctx->response->vp_octets + 26);
+	talloc_free(username);
+	talloc_free(domain);
+	if (ret < 0) goto fail;
+
+	if (ntlm_helper_enqueue(auth_ctx->t, &auth_ctx->hr) < 0) goto fail;
+
+	if (unlang_module_timeout_add(request, mschap_helper_timeout, auth_ctx,
+				      fr_time() + inst->ntlm_auth_timeout) < 0) {
+		RPEDEBUG("Failed adding ntlm_auth helper timeout");
+		(void) ntlm_helper_dequeue(auth_ctx->t, &auth_ctx->hr, false);
+		goto fail;
+	}
+
+	return unlang_module_yield(request, mod_authenticate_resume, mschap_helper_signal, auth_ctx);
+
+fail:
+	auth_ctx->hr.er.result = -1;
+	return mod_authenticate_resume(p_result, mctx, request, auth_ctx);
 }
 
 /*
@@ -1934,15 +2150,11 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_mschap_t);
-	fr_pair_t		*challenge = NULL;
-	fr_pair_t		*response = NULL;
+	mschap_auth_ctx_t	*auth_ctx;
 	fr_pair_t		*cpw = NULL;
-	fr_pair_t		*nt_password = NULL, *smb_ctrl;
-	uint8_t			nthashhash[NT_DIGEST_LENGTH];
-	int			mschap_version = 0;
+	fr_pair_t		*smb_ctrl;
 
 	MSCHAP_AUTH_METHOD	method;
-	bool			ephemeral = false;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
 	/*
@@ -1989,6 +2201,10 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		}
 	}
 
+	MEM(auth_ctx = talloc_zero(request, mschap_auth_ctx_t));
+	auth_ctx->method = method;
+	auth_ctx->smb_ctrl = smb_ctrl;
+
 	/*
 	 *	Look for or create an NT-Password
 	 *
@@ -1996,7 +2212,10 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	 *	input attribute, and we're calling out to an
 	 *	external password store.
 	 */
-	if (nt_password_find(&ephemeral, &nt_password, mctx->instance, request) < 0) RETURN_MODULE_FAIL;
+	if (nt_password_find(&auth_ctx->ephemeral, &auth_ctx->nt_password, mctx->instance, request) < 0) {
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
 
 	/*
 	 *	Check to see if this is a change password request, and process
@@ -2006,7 +2225,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	if (cpw) {
 		uint8_t		*p;
 
-		mschap_process_cpw_request(&rcode, mctx->instance, request, cpw, nt_password);
+		mschap_process_cpw_request(&rcode, mctx->instance, request, cpw, auth_ctx->nt_password);
 		if (rcode != RLM_MODULE_OK) goto finish;
 
 		/*
@@ -2024,8 +2243,8 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		 *	password change, add them into the request and then
 		 *	continue with the authentication.
 		 */
-		MEM(pair_update_request(&response, attr_ms_chap2_response) >= 0);
-		MEM(fr_pair_value_mem_alloc(response, &p, 50, cpw->vp_tainted) == 0);
+		MEM(pair_update_request(&auth_ctx->response, attr_ms_chap2_response) >= 0);
+		MEM(fr_pair_value_mem_alloc(auth_ctx->response, &p, 50, cpw->vp_tainted) == 0);
 
 		/* ident & flags */
 		p[0] = cpw->vp_octets[1];
@@ -2034,8 +2253,8 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		memcpy(p + 2, cpw->vp_octets + 18, 48);
 	}
 
-	challenge = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_challenge);
-	if (!challenge) {
+	auth_ctx->challenge = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_challenge);
+	if (!auth_ctx->challenge) {
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s",
 			inst->name, attr_ms_chap_challenge->name);
 		rcode = RLM_MODULE_INVALID;
@@ -2045,22 +2264,15 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	/*
 	 *	We also require an MS-CHAP-Response.
 	 */
-	if ((response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_response))) {
-		mschap_process_response(&rcode,
-					&mschap_version, nthashhash,
-					inst, request,
-					smb_ctrl, nt_password,
-					challenge, response,
-					method);
+	if ((auth_ctx->response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_response))) {
+		mschap_process_response(&rcode, auth_ctx, request);
 		if (rcode != RLM_MODULE_OK) goto finish;
-	} else if ((response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap2_response))) {
-		mschap_process_v2_response(&rcode,
-					   &mschap_version, nthashhash,
-					   inst, request,
-					   smb_ctrl, nt_password,
-					   challenge, response,
-					   method);
+	} else if ((auth_ctx->response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap2_response))) {
+		mschap_process_v2_response(&rcode, auth_ctx, inst, request);
 		if (rcode != RLM_MODULE_OK) goto finish;
+#ifdef __APPLE__
+		if (auth_ctx->od_authenticated) goto finish;
+#endif
 	} else {		/* Neither CHAPv1 or CHAPv2 response: die */
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s or &%s attributes",
 			inst->name, attr_ms_chap_response->name, attr_ms_chap2_response->name);
@@ -2068,55 +2280,22 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		goto finish;
 	}
 
-	/* now create MPPE attributes */
-	if (inst->use_mppe) {
-		fr_pair_t	*vp;
-		uint8_t		mppe_sendkey[34];
-		uint8_t		mppe_recvkey[34];
-
-		switch (mschap_version) {
-		case 1:
-			RDEBUG2("Generating MS-CHAPv1 MPPE keys");
-			memset(mppe_sendkey, 0, 32);
-
-			/*
-			 *	According to RFC 2548 we
-			 *	should send NT hash.  But in
-			 *	practice it doesn't work.
-			 *	Instead, we should send nthashhash
-			 *
-			 *	This is an error in RFC 2548.
-			 */
-			/*
-			 *	do_mschap cares to zero nthashhash if NT hash
-			 *	is not available.
-			 */
-			memcpy(mppe_sendkey + 8, nthashhash, NT_DIGEST_LENGTH);
-			mppe_add_reply(inst, request, attr_ms_chap_mppe_keys, mppe_sendkey, 24);	//-V666
-			break;
-
-		case 2:
-			RDEBUG2("Generating MS-CHAPv2 MPPE keys");
-			mppe_chap2_gen_keys128(nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
-
-			mppe_add_reply(inst, request, attr_ms_mppe_recv_key, mppe_recvkey, 16);
-			mppe_add_reply(inst, request, attr_ms_mppe_send_key, mppe_sendkey, 16);
-			break;
-
-		default:
-			fr_assert(0);
-			break;
-		}
+	/*
+	 *	ntlm_auth helpers answer asynchronously.
+	 */
+	if (method == AUTH_NTLMAUTH_HELPER) return mschap_helper_yield(p_result, mctx, request, auth_ctx);
 
-		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_policy) >= 0);
-		vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+	/*
+	 *	Do the MS-CHAP authentication.
+	 */
+	auth_ctx->mschap_result = do_mschap(inst, request, auth_ctx->nt_password, auth_ctx->auth_challenge,
+					    auth_ctx->response->vp_octets + 26, auth_ctx->nthashhash, method);
 
-		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_types) >= 0);
-		vp->vp_uint32 = inst->require_strong ? 4 : 6;
-	} /* else we weren't asked to use MPPE */
+	return mod_authenticate_resume(p_result, mctx, request, auth_ctx);
 
 finish:
-	if (ephemeral) talloc_list_free(&nt_password);
+	if (auth_ctx->ephemeral) talloc_list_free(&auth_ctx->nt_password);
+	talloc_free(auth_ctx);
 
 	RETURN_MODULE_RCODE(rcode);
 }
@@ -2160,6 +2339,23 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->method = AUTH_NTLMAUTH_EXEC;
 	}
 
+	if (inst->ntlm_helper) {
+		if (inst->ntlm_auth) {
+			cf_log_err(conf, "Only one of 'ntlm_auth' and 'ntlm_auth_helper' can be used");
+			return -1;
+		}
+
+		if (!inst->ntlm_helper_username) {
+			cf_log_err(conf, "'ntlm_auth_helper' requires a 'username'");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("ntlm_auth_helper.count", inst->ntlm_helper_count, >=, 1);
+		FR_INTEGER_BOUND_CHECK("ntlm_auth_helper.count", inst->ntlm_helper_count, <=, 64);
+
+		inst->method = AUTH_NTLMAUTH_HELPER;
+	}
+
 	switch (inst->method) {
 	case AUTH_INTERNAL:
 		DEBUG("Using internal authentication");
@@ -2167,6 +2363,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("Authenticating by calling 'ntlm_auth'");
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("Authenticating with %u 'ntlm_auth' helper(s) per thread", inst->ntlm_helper_count);
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 		DEBUG("Authenticating directly to winbind");
@@ -2229,6 +2428,31 @@ static int mod_detach(
 	return 0;
 }
 
+/*
+ *	Start the ntlm_auth helpers for this thread
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(instance, rlm_mschap_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(thread, rlm_mschap_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+
+	if (inst->method != AUTH_NTLMAUTH_HELPER) return 0;
+
+	return ntlm_helper_thread_instantiate(t, inst, el);
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(thread, rlm_mschap_thread_t);
+
+	ntlm_helper_thread_detach(t);
+
+	return 0;
+}
 
 extern module_t rlm_mschap;
 module_t rlm_mschap = {
@@ -2240,6 +2464,10 @@ module_t rlm_mschap = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_mschap_thread_t),
+	.thread_inst_type	= "rlm_mschap_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
@@ -13,7 +13,8 @@ RCSIDH(rlm_mschap_h, "$Id$")
 /* Method of authentication we are going to use */
 typedef enum {
 	AUTH_INTERNAL		= 0,
-	AUTH_NTLMAUTH_EXEC	= 1
+	AUTH_NTLMAUTH_EXEC	= 1,
+	AUTH_NTLMAUTH_HELPER	= 3
 #ifdef WITH_AUTH_WINBIND
 	,AUTH_WBCLIENT       	= 2
 #endif
@@ -62,6 +63,10 @@ typedef struct {
 
 	char const		*ntlm_auth;
 	fr_time_delta_t		ntlm_auth_timeout;
+	char const		*ntlm_helper;		//!< ntlm_auth command, run with --helper-protocol=ntlm-server-1.
+	tmpl_t			*ntlm_helper_username;
+	tmpl_t			*ntlm_helper_domain;
+	uint32_t		ntlm_helper_count;	//!< How many helpers each worker thread runs.
 	char const		*ntlm_cpw;
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
@@ -80,3 +85,5 @@ typedef struct {
 	bool			open_directory;
 #endif
 } rlm_mschap_t;
+
+int mschap_ntlm_auth_error(request_t *request, char const *buffer);
@@ -121,6 +121,14 @@ static CONF_PARSER const module_config[] = {
 
 	{ FR_CONF_OFFSET("revive_interval", FR_TYPE_TIME_DELTA, rlm_radius_t, revive_interval) },
 
+	{ FR_CONF_OFFSET("adaptive_rtx", FR_TYPE_BOOL, rlm_radius_t, adaptive_rtx), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("min_rtx_time", FR_TYPE_TIME_DELTA, rlm_radius_t, min_rtx_time), .dflt = "0.1" },
+
+	{ FR_CONF_OFFSET("hedge", FR_TYPE_BOOL, rlm_radius_t, hedge), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("hedge_percentile", FR_TYPE_UINT32, rlm_radius_t, hedge_percentile), .dflt = "95" },
+
 	{ FR_CONF_OFFSET("pool", FR_TYPE_SUBSECTION, rlm_radius_t, trunk_conf), .subcs = (void const *) fr_trunk_config, },
 
 	CONF_PARSER_TERMINATOR
@@ -593,6 +601,23 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	FR_TIME_DELTA_BOUND_CHECK("zombie_period", inst->zombie_period, >=, fr_time_delta_from_sec(1));
 	FR_TIME_DELTA_BOUND_CHECK("zombie_period", inst->zombie_period, <=, fr_time_delta_from_sec(120));
 
+	FR_TIME_DELTA_BOUND_CHECK("min_rtx_time", inst->min_rtx_time, >=, fr_time_delta_from_msec(10));
+	FR_TIME_DELTA_BOUND_CHECK("min_rtx_time", inst->min_rtx_time, <=, fr_time_delta_from_sec(3));
+
+	FR_INTEGER_BOUND_CHECK("hedge_percentile", inst->hedge_percentile, >=, 50);
+	FR_INTEGER_BOUND_CHECK("hedge_percentile", inst->hedge_percentile, <=, 99);
+
+	/*
+	 *	Hedging sends a second copy of the request, and waits
+	 *	for a reply.  Neither makes sense when replicating, or
+	 *	when the NAS drives retransmissions.
+	 */
+	if (inst->hedge && (inst->replicate || inst->synchronous)) {
+		cf_log_warn(conf, "Ignoring 'hedge = yes' due to '%s = true'",
+			    inst->replicate ? "replicate" : "synchronous");
+		inst->hedge = false;
+	}
+
 	if (!inst->status_check) {
 		FR_TIME_DELTA_BOUND_CHECK("revive_interval", inst->revive_interval, >=, fr_time_delta_from_sec(10));
 		FR_TIME_DELTA_BOUND_CHECK("revive_interval", inst->revive_interval, <=, fr_time_delta_from_sec(3600));
@@ -614,6 +639,14 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		inst->allowed[code] = true;
 	}
 
+	/*
+	 *	Only Access-Requests are hedged, see rlm_radius_udp.
+	 */
+	if (inst->hedge && !inst->allowed[FR_CODE_ACCESS_REQUEST]) {
+		cf_log_warn(conf, "Ignoring 'hedge = yes', as it only applies to 'type = Access-Request'");
+		inst->hedge = false;
+	}
+
 	fr_assert(inst->status_check < FR_RADIUS_MAX_PACKET_CODE);
 
 	/*
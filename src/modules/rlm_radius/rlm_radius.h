@@ -58,6 +58,13 @@ struct rlm_radius_s {
 	fr_time_delta_t		zombie_period;
 	fr_time_delta_t		revive_interval;
 
+	bool			adaptive_rtx;		//!< Set the initial retransmission timer from
+							///< the measured round trip time.
+	fr_time_delta_t		min_rtx_time;		//!< Lower bound for adaptive retransmission timers.
+
+	bool			hedge;			//!< Send a second copy of slow requests.
+	uint32_t		hedge_percentile;	//!< How slow a request has to be before it's hedged.
+
 	bool			replicate;		//!< Ignore responses.
 	bool			synchronous;		//!< Retransmit when receiving a duplicate request.
 	bool			originate;  		//!< Originating packets, instead of proxying existing ones.
@@ -0,0 +1,3099 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_radius_tcp.c
+ * @brief RADIUS TCP and RADIUS/TLS (RFC 6614) transport
+ *
+ * Requests are pipelined over a small number of long lived
+ * connections.  Packets are encoded into a per-connection output
+ * buffer, and written with as few system calls as possible.  Replies
+ * are read into a per-connection input buffer, and split back into
+ * packets using the length field in the RADIUS header.
+ *
+ * As per RFC 6613, packets are never retransmitted over TCP.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/pair.h>
+#include <freeradius-devel/missing.h>
+#include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/heap.h>
+
+#ifdef WITH_TLS
+#  include <freeradius-devel/tls/base.h>
+#  include <freeradius-devel/tls/log.h>
+#endif
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "rlm_radius.h"
+#include "track.h"
+
+/** Static configuration for the module.
+ *
+ */
+typedef struct {
+	rlm_radius_t		*parent;		//!< rlm_radius instance.
+	CONF_SECTION		*config;
+
+	fr_ipaddr_t		dst_ipaddr;		//!< IP of the home server.
+	fr_ipaddr_t		src_ipaddr;		//!< IP we open our socket on.
+	uint16_t		dst_port;		//!< Port of the home server.
+	char const		*secret;		//!< Shared secret.
+
+	uint32_t		recv_buff;		//!< How big the kernel's receive buffer should be.
+	uint32_t		send_buff;		//!< How big the kernel's send buffer should be.
+
+	uint32_t		max_packet_size;	//!< Maximum packet size.
+	uint16_t		max_send_coalesce;	//!< Maximum number of packets to coalesce into one write.
+
+	bool			recv_buff_is_set;	//!< Whether we were provided with a recv_buf
+	bool			send_buff_is_set;	//!< Whether we were provided with a send_buf
+	bool			replicate;		//!< Copied from parent->replicate
+
+#ifdef WITH_TLS
+	fr_tls_conf_t		*tls;			//!< TLS configuration.  NULL if we're not using TLS.
+#endif
+
+	fr_trunk_conf_t		*trunk_conf;		//!< trunk configuration
+} rlm_radius_tcp_t;
+
+typedef struct {
+	fr_event_list_t		*el;			//!< Event list.
+
+	rlm_radius_tcp_t const	*inst;			//!< our instance
+
+	fr_trunk_t		*trunk;			//!< trunk handler
+} tcp_thread_t;
+
+typedef struct {
+	fr_trunk_request_t	*treq;
+	rlm_rcode_t		rcode;			//!< from the transport
+} tcp_result_t;
+
+typedef struct tcp_request_s tcp_request_t;
+
+/** A buffer of data waiting to be written, or waiting to be decoded
+ *
+ * Data between start and end is valid.  When start catches up with end,
+ * both are reset to zero.
+ */
+typedef struct {
+	uint8_t			*data;			//!< The buffer.
+	size_t			len;			//!< How much data the buffer can hold.
+	size_t			start;			//!< First byte which hasn't been written or decoded.
+	size_t			end;			//!< One past the last byte of valid data.
+} tcp_buffer_t;
+
+/** Track the handle, which is tightly correlated with the FD
+ *
+ */
+typedef struct {
+	char const     		*name;			//!< From IP PORT to IP PORT.
+	char const		*module_name;		//!< the module that opened the connection
+
+	int			fd;			//!< File descriptor.
+
+#ifdef WITH_TLS
+	SSL			*ssl;			//!< TLS session.  NULL if we're not using TLS.
+#endif
+
+	rlm_radius_tcp_t const	*inst;			//!< Our module instance.
+	tcp_thread_t		*thread;
+
+	fr_trunk_connection_t	*tconn;			//!< Trunk connection, set when the trunk
+							///< first asks us for I/O events.
+	fr_trunk_connection_event_t events;		//!< I/O events the trunk last asked for.
+
+	uint8_t			last_id;		//!< Used when replicating to ensure IDs are distributed
+							///< evenly.
+
+	uint32_t		max_packet_size;	//!< Our max packet size. may be different from the parent.
+
+	fr_ipaddr_t		src_ipaddr;		//!< Source IP address.  Updated once the
+							///< connection is open.
+	uint16_t		src_port;		//!< Source port specific to this connection.
+
+	tcp_buffer_t		recv;			//!< Data read from the home server, which hasn't
+							///< been decoded yet.
+	tcp_buffer_t		send;			//!< Encoded packets which haven't been written yet.
+
+	radius_track_t		*tt;			//!< RADIUS ID tracking structure.
+
+	fr_time_t		mrs_time;		//!< Most recent sent time which had a reply.
+	fr_time_t		last_reply;		//!< When we last received a reply.
+	fr_time_t		first_sent;		//!< first time we sent a packet since going idle
+	fr_time_t		last_sent;		//!< last time we sent a packet.
+	fr_time_t		last_idle;		//!< last time we had nothing to do
+
+	fr_event_timer_t const	*zombie_ev;		//!< Zombie timeout.
+
+	bool			status_checking;       	//!< whether we're doing status checks
+	tcp_request_t		*status_u;		//!< for sending status check packets
+	tcp_result_t		*status_r;		//!< for faking out status checks as real packets
+	request_t		*status_request;
+} tcp_handle_t;
+
+
+/** Connect request_t to local tracking structure
+ *
+ */
+struct tcp_request_s {
+	uint32_t		priority;		//!< copied from request->async->priority
+	fr_time_t		recv_time;		//!< copied from request->async->recv_time
+
+	uint32_t		num_replies;		//!< number of reply packets, sent is in retry.count
+
+	bool			synchronous;		//!< cached from inst->parent->synchronous
+	bool			require_ma;		//!< saved from the original packet.
+	bool			status_check;		//!< is this packet a status check?
+
+	fr_pair_t		*extra;			//!< VPs for debugging, like Proxy-State.
+
+	uint8_t			code;			//!< Packet code.
+	uint8_t			id;			//!< Last ID assigned to this packet.
+	uint8_t			*packet;		//!< Packet we write to the network.
+	size_t			packet_len;		//!< Length of the packet.
+
+	radius_track_entry_t	*rr;			//!< ID tracking, resend count, etc.
+	fr_event_timer_t const	*ev;			//!< timer for the response timeout
+	fr_retry_t		retry;			//!< response timers
+};
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_tcp_t, dst_ipaddr), },
+	{ FR_CONF_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_tcp_t, dst_ipaddr) },
+	{ FR_CONF_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_tcp_t, dst_ipaddr) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, rlm_radius_tcp_t, dst_port) },
+
+	{ FR_CONF_OFFSET("secret", FR_TYPE_STRING, rlm_radius_tcp_t, secret) },
+
+	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, rlm_radius_tcp_t, recv_buff) },
+	{ FR_CONF_OFFSET_IS_SET("send_buff", FR_TYPE_UINT32, rlm_radius_tcp_t, send_buff) },
+
+	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, rlm_radius_tcp_t, max_packet_size), .dflt = "4096" },
+	{ FR_CONF_OFFSET("max_send_coalesce", FR_TYPE_UINT16, rlm_radius_tcp_t, max_send_coalesce), .dflt = "32" },
+
+	{ FR_CONF_OFFSET("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_radius;
+
+extern fr_dict_autoload_t rlm_radius_tcp_dict[];
+fr_dict_autoload_t rlm_radius_tcp_dict[] = {
+	{ .out = &dict_radius, .proto = "radius" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_acct_delay_time;
+static fr_dict_attr_t const *attr_event_timestamp;
+static fr_dict_attr_t const *attr_extended_attribute_1;
+static fr_dict_attr_t const *attr_message_authenticator;
+static fr_dict_attr_t const *attr_nas_identifier;
+static fr_dict_attr_t const *attr_original_packet_code;
+static fr_dict_attr_t const *attr_proxy_state;
+static fr_dict_attr_t const *attr_user_password;
+static fr_dict_attr_t const *attr_packet_type;
+
+extern fr_dict_attr_autoload_t rlm_radius_tcp_dict_attr[];
+fr_dict_attr_autoload_t rlm_radius_tcp_dict_attr[] = {
+	{ .out = &attr_acct_delay_time, .name = "Acct-Delay-Time", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_event_timestamp, .name = "Event-Timestamp", .type = FR_TYPE_DATE, .dict = &dict_radius},
+	{ .out = &attr_extended_attribute_1, .name = "Extended-Attribute-1", .type = FR_TYPE_TLV, .dict = &dict_radius},
+	{ .out = &attr_message_authenticator, .name = "Message-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_nas_identifier, .name = "NAS-Identifier", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ .out = &attr_original_packet_code, .name = "Original-Packet-Code", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_proxy_state, .name = "Proxy-State", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ NULL }
+};
+
+/** If we get a reply, the request must come from one of a small
+ * number of packet types.
+ */
+static FR_CODE allowed_replies[FR_RADIUS_MAX_PACKET_CODE] = {
+	[FR_CODE_ACCESS_ACCEPT]		= FR_CODE_ACCESS_REQUEST,
+	[FR_CODE_ACCESS_CHALLENGE]	= FR_CODE_ACCESS_REQUEST,
+	[FR_CODE_ACCESS_REJECT]		= FR_CODE_ACCESS_REQUEST,
+
+	[FR_CODE_ACCOUNTING_RESPONSE]	= FR_CODE_ACCOUNTING_REQUEST,
+
+	[FR_CODE_COA_ACK]		= FR_CODE_COA_REQUEST,
+	[FR_CODE_COA_NAK]		= FR_CODE_COA_REQUEST,
+
+	[FR_CODE_DISCONNECT_ACK]	= FR_CODE_DISCONNECT_REQUEST,
+	[FR_CODE_DISCONNECT_NAK]	= FR_CODE_DISCONNECT_REQUEST,
+
+	[FR_CODE_PROTOCOL_ERROR]	= FR_CODE_PROTOCOL_ERROR,	/* Any */
+};
+
+/** Turn a reply code into a module rcode;
+ *
+ */
+static rlm_rcode_t radius_code_to_rcode[FR_RADIUS_MAX_PACKET_CODE] = {
+	[FR_CODE_ACCESS_ACCEPT]		= RLM_MODULE_OK,
+	[FR_CODE_ACCESS_CHALLENGE]	= RLM_MODULE_UPDATED,
+	[FR_CODE_ACCESS_REJECT]		= RLM_MODULE_REJECT,
+
+	[FR_CODE_ACCOUNTING_RESPONSE]	= RLM_MODULE_OK,
+
+	[FR_CODE_COA_ACK]		= RLM_MODULE_OK,
+	[FR_CODE_COA_NAK]		= RLM_MODULE_REJECT,
+
+	[FR_CODE_DISCONNECT_ACK]	= RLM_MODULE_OK,
+	[FR_CODE_DISCONNECT_NAK]	= RLM_MODULE_REJECT,
+
+	[FR_CODE_PROTOCOL_ERROR]	= RLM_MODULE_HANDLED,
+};
+
+static void		conn_writable_status_check(UNUSED fr_event_list_t *el, UNUSED int fd,
+						   UNUSED int flags, void *uctx);
+
+static int 		encode(rlm_radius_tcp_t const *inst, request_t *request, tcp_request_t *u, uint8_t id);
+
+static decode_fail_t	decode(TALLOC_CTX *ctx, fr_pair_t **reply, uint8_t *response_code,
+			       tcp_handle_t *h, request_t *request, tcp_request_t *u,
+			       uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
+			       uint8_t *data, size_t data_len);
+
+static void		protocol_error_reply(tcp_request_t *u, tcp_result_t *r, uint8_t const *data);
+
+static void		conn_events_update(tcp_handle_t *h, fr_event_list_t *el);
+
+#ifndef NDEBUG
+/** Log additional information about a tracking entry
+ *
+ * @param[in] te	Tracking entry we're logging information for.
+ * @param[in] log	destination.
+ * @param[in] log_type	Type of log message.
+ * @param[in] file	the logging request was made in.
+ * @param[in] line 	logging request was made on.
+ */
+static void tcp_tracking_entry_log(fr_log_t const *log, fr_log_type_t log_type, char const *file, int line,
+				   radius_track_entry_t *te)
+{
+	request_t		*request;
+
+	if (!te->request) return;	/* Free entry */
+
+	request = talloc_get_type_abort(te->request, request_t);
+
+	fr_log(log, log_type, file, line, "request %s, allocated %s:%u", request->name,
+	       request->alloc_file, request->alloc_line);
+
+	fr_trunk_request_state_log(log, log_type, file, line, talloc_get_type_abort(te->uctx, fr_trunk_request_t));
+}
+#endif
+
+/** Read data from the connection, decrypting it if we're using TLS
+ *
+ * @param[in] h		connection to read from.
+ * @param[out] buffer	to write the data to.
+ * @param[in] len	of the buffer.
+ * @return
+ *	- >0 the number of bytes read.
+ *	- 0 if there's no data available.
+ *	- -1 on error, or if the home server closed the connection.
+ */
+static ssize_t tcp_recv(tcp_handle_t *h, uint8_t *buffer, size_t len)
+{
+	ssize_t slen;
+
+#ifdef WITH_TLS
+	if (h->ssl) {
+		int ret;
+
+		ERR_clear_error();
+		ret = SSL_read(h->ssl, buffer, len);
+		if (ret > 0) return ret;
+
+		switch (SSL_get_error(h->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return 0;
+
+		case SSL_ERROR_ZERO_RETURN:
+			fr_strerror_printf("Connection closed by home server");
+			return -1;
+
+		default:
+			tls_strerror_printf("Failed reading from TLS session");
+			return -1;
+		}
+	}
+#endif
+
+	slen = read(h->fd, buffer, len);
+	if (slen > 0) return slen;
+
+	if (slen == 0) {
+		fr_strerror_printf("Connection closed by home server");
+		return -1;
+	}
+
+	switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+	case EWOULDBLOCK:
+#endif
+	case EAGAIN:
+	case EINTR:
+		return 0;
+
+	default:
+		fr_strerror_printf("%s", fr_syserror(errno));
+		return -1;
+	}
+}
+
+/** Write data to the connection, encrypting it if we're using TLS
+ *
+ * @param[in] h		connection to write to.
+ * @param[in] buffer	containing the data to write.
+ * @param[in] len	of the data.
+ * @return
+ *	- >0 the number of bytes written.
+ *	- 0 if the connection isn't writable.
+ *	- -1 on error.
+ */
+static ssize_t tcp_send(tcp_handle_t *h, uint8_t const *buffer, size_t len)
+{
+	ssize_t slen;
+
+#ifdef WITH_TLS
+	if (h->ssl) {
+		int ret;
+
+		ERR_clear_error();
+		ret = SSL_write(h->ssl, buffer, len);
+		if (ret > 0) return ret;
+
+		switch (SSL_get_error(h->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return 0;
+
+		default:
+			tls_strerror_printf("Failed writing to TLS session");
+			return -1;
+		}
+	}
+#endif
+
+	slen = write(h->fd, buffer, len);
+	if (slen >= 0) return slen;
+
+	switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+	case EWOULDBLOCK:
+#endif
+	case EAGAIN:
+	case EINTR:
+	case ENOBUFS:
+		return 0;
+
+	default:
+		fr_strerror_printf("%s", fr_syserror(errno));
+		return -1;
+	}
+}
+
+/** Write as much of the output buffer as the connection will take
+ *
+ * @return
+ *	- 1 if there's still data waiting to be written.
+ *	- 0 if the output buffer is empty.
+ *	- -1 on error.
+ */
+static int conn_flush(tcp_handle_t *h)
+{
+	while (h->send.start < h->send.end) {
+		ssize_t slen;
+
+		slen = tcp_send(h, h->send.data + h->send.start, h->send.end - h->send.start);
+		if (slen < 0) return -1;
+		if (slen == 0) return 1;
+
+		h->send.start += slen;
+	}
+
+	h->send.start = h->send.end = 0;
+
+	return 0;
+}
+
+/** Read as much data as will fit into the input buffer
+ *
+ * @return
+ *	- >0 if we read data.
+ *	- 0 if there was nothing to read.
+ *	- -1 on error, or if the home server closed the connection.
+ */
+static ssize_t conn_fill(tcp_handle_t *h)
+{
+	ssize_t total = 0;
+
+	/*
+	 *	Move any partial packet to the start of the buffer,
+	 *	so that there's always room to finish reading it.
+	 */
+	if (h->recv.start > 0) {
+		memmove(h->recv.data, h->recv.data + h->recv.start, h->recv.end - h->recv.start);
+		h->recv.end -= h->recv.start;
+		h->recv.start = 0;
+	}
+
+	while (h->recv.end < h->recv.len) {
+		ssize_t slen;
+
+		slen = tcp_recv(h, h->recv.data + h->recv.end, h->recv.len - h->recv.end);
+		if (slen < 0) return -1;
+		if (slen == 0) break;
+
+		h->recv.end += slen;
+		total += slen;
+	}
+
+	return total;
+}
+
+/** Return the next complete packet from the input buffer
+ *
+ * The packet is only valid until the next call to conn_fill().
+ *
+ * @param[in] h			connection to read the packet from.
+ * @param[out] packet		the next packet.
+ * @param[out] packet_len	the length of the packet.
+ * @return
+ *	- 1 if a packet was returned.
+ *	- 0 if we need more data.
+ *	- -1 if the home server sent us garbage.  The stream is now
+ *	  unusable, and the connection should be closed.
+ */
+static int conn_packet_next(tcp_handle_t *h, uint8_t **packet, size_t *packet_len)
+{
+	uint8_t	*p = h->recv.data + h->recv.start;
+	size_t	available = h->recv.end - h->recv.start;
+	size_t	len;
+
+	if (available < 4) return 0;
+
+	len = (p[2] << 8) | p[3];
+	if ((len < RADIUS_HEADER_LENGTH) || (len > h->max_packet_size)) {
+		fr_strerror_printf("Received packet with invalid length %zu", len);
+		return -1;
+	}
+
+	if (available < len) return 0;
+
+	h->recv.start += len;
+	if (h->recv.start == h->recv.end) h->recv.start = h->recv.end = 0;
+
+	*packet = p;
+	*packet_len = len;
+
+	return 1;
+}
+
+/** Clear out any connection specific resources from a tcp request
+ *
+ */
+static void tcp_request_reset(tcp_request_t *u)
+{
+	TALLOC_FREE(u->packet);
+	u->extra = NULL;	/* Freed with packet */
+
+	/*
+	 *	Can have packet put no u->rr
+	 *	if this is part of a pre-trunk status check.
+	 */
+	if (u->rr) radius_track_entry_release(&u->rr);
+}
+
+/** Reset a status_check packet, ready to re-use
+ *
+ */
+static void status_check_reset(tcp_handle_t *h, tcp_request_t *u)
+{
+	fr_assert(u->status_check == true);
+
+	h->status_checking = false;
+	u->num_replies = 0;	/* Reset */
+	u->retry.start = 0;
+
+	if (u->ev) (void) fr_event_timer_delete(&u->ev);
+
+	tcp_request_reset(u);
+}
+
+/*
+ *	Status-Server checks.  Manually build the packet, and
+ *	all of its associated glue.
+ */
+static void CC_HINT(nonnull) status_check_alloc(fr_event_list_t *el, tcp_handle_t *h)
+{
+	tcp_request_t		*u;
+	request_t		*request;
+	rlm_radius_tcp_t const	*inst = h->inst;
+	map_t			*map;
+
+	fr_assert(!h->status_u && !h->status_r && !h->status_request);
+
+	u = talloc_zero(h, tcp_request_t);
+
+	/*
+	 *	Status checks are prioritized over any other packet
+	 */
+	u->priority = ~(uint32_t) 0;
+	u->status_check = true;
+
+	/*
+	 *	Allocate outside of the free list, for the same
+	 *	reasons as rlm_radius_udp.
+	 */
+	request = request_local_alloc(u);
+	request->async = talloc_zero(request, fr_async_t);
+	talloc_const_free(request->name);
+	request->name = talloc_strdup(request, h->module_name);
+
+	request->el = el;
+	request->packet = fr_radius_alloc(request, false);
+	request->reply = fr_radius_alloc(request, false);
+
+	/*
+	 *	Create the VPs, and ignore any errors
+	 *	creating them.
+	 */
+	for (map = inst->parent->status_check_map; map != NULL; map = map->next) {
+		/*
+		 *	Skip things which aren't attributes.
+		 */
+		if (!tmpl_is_attr(map->lhs)) continue;
+
+		/*
+		 *	Ignore internal attributes.
+		 */
+		if (tmpl_da(map->lhs)->flags.internal) continue;
+
+		/*
+		 *	Ignore signalling attributes.  They shouldn't exist.
+		 */
+		if ((tmpl_da(map->lhs) == attr_proxy_state) ||
+		    (tmpl_da(map->lhs) == attr_message_authenticator)) continue;
+
+		/*
+		 *	Allow passwords only in Access-Request packets.
+		 */
+		if ((inst->parent->status_check != FR_CODE_ACCESS_REQUEST) &&
+		    (tmpl_da(map->lhs) == attr_user_password)) continue;
+
+		(void) map_to_request(request, map, map_to_vp, NULL);
+	}
+
+	/*
+	 *	Ensure that there's a NAS-Identifier, if one wasn't
+	 *	already added.
+	 */
+	if (!fr_pair_find_by_da(&request->request_pairs, attr_nas_identifier)) {
+		fr_pair_t *vp;
+
+		MEM(pair_add_request(&vp, attr_nas_identifier) >= 0);
+		fr_pair_value_strdup(vp, "status check - are you alive?");
+	}
+
+	/*
+	 *	Always add an Event-Timestamp, which will be the time
+	 *	at which the packet is sent.
+	 */
+	if (!fr_pair_find_by_da(&request->request_pairs, attr_event_timestamp)) {
+		MEM(pair_add_request(NULL, attr_event_timestamp) >= 0);
+	}
+
+	/*
+	 *	Initialize the request IO ctx.  Note that we don't set
+	 *	destructors.
+	 */
+	u->code = inst->parent->status_check;
+	request->packet->code = u->code;
+
+	DEBUG3("%s - Status check packet type will be %s", h->module_name, fr_packet_codes[u->code]);
+	log_request_pair_list(L_DBG_LVL_3, request, request->request_pairs, NULL);
+
+	MEM(h->status_r = talloc_zero(request, tcp_result_t));
+	h->status_u = u;
+	h->status_request = request;
+}
+
+/** Connection errored before it was open
+ *
+ * We were signalled by the event loop that a fatal error occurred on this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that errored.
+ * @param[in] flags	El flags.
+ * @param[in] fd_errno	The nature of the error.
+ * @param[in] uctx	The connection.
+ */
+static void conn_error_connecting(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	tcp_handle_t		*h;
+
+	/*
+	 *	Connection must be in the connecting state when this fires
+	 */
+	fr_assert(conn->state == FR_CONNECTION_STATE_CONNECTING);
+
+	h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	ERROR("%s - Connection %s failed: %s", h->module_name, h->name, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+}
+
+/** Hand the connection over to the trunk
+ *
+ * Removes the I/O handlers we used to open the connection.  The trunk
+ * will ask for the ones it needs.
+ */
+static void conn_open(fr_connection_t *conn, tcp_handle_t *h)
+{
+	fr_event_fd_delete(conn->el, h->fd, FR_EVENT_FILTER_IO);
+
+	DEBUG("%s - Connection open - %s", h->module_name, h->name);
+
+	fr_connection_signal_connected(conn);
+}
+
+/** Status check timedout
+ *
+ * Setup retries, or fail the connection.
+ */
+static void conn_status_check_timeout(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	tcp_handle_t		*h;
+	tcp_request_t		*u;
+
+	/*
+	 *	Connection must be in the connecting state when this fires
+	 */
+	fr_assert(conn->state == FR_CONNECTION_STATE_CONNECTING);
+
+	h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	u = h->status_u;
+
+	/*
+	 *	We're only interested in contiguous, good, replies.
+	 */
+	u->num_replies = 0;
+
+	switch (fr_retry_next(&u->retry, now)) {
+	case FR_RETRY_MRD:
+		DEBUG("%s - Reached maximum_retransmit_duration, failing status checks",
+		      h->module_name);
+		goto fail;
+
+	case FR_RETRY_MRC:
+		DEBUG("%s - Reached maximum_retransmit_count, failing status checks",
+		      h->module_name);
+	fail:
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+
+	case FR_RETRY_CONTINUE:
+		if (fr_event_fd_insert(h, el, h->fd, NULL, conn_writable_status_check,
+				       conn_error_connecting, conn) < 0) {
+			PERROR("%s - Failed inserting FD event", h->module_name);
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		}
+		return;
+	}
+
+	fr_assert(0);
+}
+
+/** Send the next status check packet
+ *
+ */
+static void conn_status_check_again(fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	if (fr_event_fd_insert(h, el, h->fd, NULL, conn_writable_status_check, conn_error_connecting, conn) < 0) {
+		PERROR("%s - Failed inserting FD event", h->module_name);
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Read the incoming status-check response.  If it's correct mark the connection as connected
+ *
+ */
+static void conn_readable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	fr_trunk_t		*trunk = h->thread->trunk;
+	rlm_radius_t const 	*inst = h->inst->parent;
+	tcp_request_t		*u = h->status_u;
+	uint8_t			*packet;
+	size_t			packet_len;
+	int			ret;
+
+	if (conn_fill(h) < 0) {
+		PERROR("%s - Failed reading response from connection %s", h->module_name, h->name);
+	fail:
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	Where we just return in this function, we're letting
+	 *	the response timer take care of progressing the
+	 *	connection attempt.
+	 */
+	while ((ret = conn_packet_next(h, &packet, &packet_len)) > 0) {
+		fr_pair_t		*reply = NULL;
+		uint8_t			code = 0;
+
+		/*
+		 *	Replies to earlier status checks
+		 */
+		if (u->id != packet[1]) {
+			DEBUG("%s - Ignoring response with incorrect or expired ID.  Expected %u, got %u",
+			      h->module_name, u->id, packet[1]);
+			continue;
+		}
+
+		if (!u->packet) continue;
+
+		if (decode(h, &reply, &code,
+			   h, h->status_request, h->status_u, u->packet + RADIUS_AUTH_VECTOR_OFFSET,
+			   packet, packet_len) != DECODE_FAIL_NONE) continue;
+
+		fr_pair_list_free(&reply);
+
+		/*
+		 *	Last trunk event was a failure, be more careful about
+		 *	bringing up the connection (require multiple responses).
+		 */
+		if ((trunk->last_failed && (trunk->last_failed > trunk->last_connected)) &&
+		    (u->num_replies < inst->num_answers_to_alive)) {
+			/*
+			 *	Leave the timer in place.  This timer is BOTH when we
+			 *	give up on the current status check, AND when we send
+			 *	the next status check.
+			 */
+			DEBUG("%s - Received %u / %u replies for status check, on connection - %s",
+			      h->module_name, u->num_replies, inst->num_answers_to_alive, h->name);
+			DEBUG("%s - Next status check packet will be in %pVs",
+			      h->module_name, fr_box_time_delta(u->retry.next - fr_time()));
+
+			/*
+			 *	Set the timer for the next status check.
+			 */
+			if (fr_event_timer_at(h, el, &u->ev, u->retry.next, conn_status_check_again, conn) < 0) {
+				goto fail;
+			}
+			continue;
+		}
+
+		/*
+		 *	It's alive!
+		 */
+		status_check_reset(h, u);
+		conn_open(conn, h);
+		return;
+	}
+
+	if (ret < 0) {
+		PERROR("%s - Failed reading response from connection %s", h->module_name, h->name);
+		goto fail;
+	}
+}
+
+/** Send our status-check packet as soon as the connection becomes writable
+ *
+ * Status checks are sent on a connection before it's handed to the trunk.
+ * If there's no reply, the next status check is sent with a new ID, in
+ * exactly the same way as rlm_radius_udp.
+ */
+static void conn_writable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	tcp_request_t		*u = h->status_u;
+
+	/*
+	 *	Still writing the previous status check.
+	 */
+	if (h->send.end > h->send.start) goto flush;
+
+	if (!u->retry.start) {
+		u->id = fr_rand() & 0xff;	/* We don't care what the value is here */
+		h->status_checking = true;	/* Ensure this is valid */
+		(void) fr_retry_init(&u->retry, fr_time(), &h->inst->parent->retry[u->code]);
+
+	/*
+	 *	Status checks can never be retransmitted
+	 *	So increment the ID here.
+	 */
+	} else {
+		tcp_request_reset(u);
+		u->id++;
+	}
+
+	if (encode(h->inst, h->status_request, u, u->id) < 0) {
+	fail:
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	DEBUG("%s - Sending %s ID %d length %ld over connection %s",
+	      h->module_name, fr_packet_codes[u->code], u->id, u->packet_len, h->name);
+	HEXDUMP3(u->packet, u->packet_len, "Encoded packet");
+
+	memcpy(h->send.data, u->packet, u->packet_len);
+	h->send.start = 0;
+	h->send.end = u->packet_len;
+
+	DEBUG("%s - %s request.  Expecting response within %pVs",
+	      h->module_name, (u->retry.count == 1) ? "Originated" : "Retransmitted",
+	      fr_box_time_delta(u->retry.rt));
+
+	if (fr_event_timer_at(u, el, &u->ev, u->retry.next, conn_status_check_timeout, conn) < 0) {
+		PERROR("%s - Failed inserting timer event", h->module_name);
+		goto fail;
+	}
+
+flush:
+	switch (conn_flush(h)) {
+	case -1:
+		PERROR("%s - Failed sending %s ID %d length %ld over connection %s",
+		       h->module_name, fr_packet_codes[u->code], u->id, u->packet_len, h->name);
+		goto fail;
+
+	case 1:
+		return;		/* Wait until we're writable again */
+
+	default:
+		break;
+	}
+
+	/*
+	 *	Switch to waiting on read.
+	 */
+	if (fr_event_fd_insert(h, el, h->fd, conn_readable_status_check, NULL, conn_error_connecting, conn) < 0) {
+		PERROR("%s - Failed inserting FD event", h->module_name);
+		goto fail;
+	}
+}
+
+/** The connection (and TLS session, if we have one) is ready for use
+ *
+ */
+static void conn_established(fr_connection_t *conn, tcp_handle_t *h)
+{
+	/*
+	 *	If we're doing status checks, then we want at least
+	 *	one positive response before signalling that the
+	 *	connection is open.
+	 *
+	 *	If we've had no recent failures we need exactly
+	 *	one response to bring the connection online,
+	 *	otherwise we need inst->num_answers_to_alive
+	 */
+	if (h->inst->parent->status_check) {
+		if (!h->status_u) status_check_alloc(conn->el, h);
+
+		if (fr_event_fd_insert(h, conn->el, h->fd, NULL,
+				       conn_writable_status_check, conn_error_connecting, conn) < 0) {
+			PERROR("%s - Failed inserting FD event", h->module_name);
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		}
+		return;
+	}
+
+	conn_open(conn, h);
+}
+
+#ifdef WITH_TLS
+/** Check the home server's certificate was issued by the configured issuer
+ *
+ * The chain, and the name or address in the certificate, have already
+ * been checked by OpenSSL during the handshake.
+ */
+static int conn_tls_check_issuer(tcp_handle_t *h)
+{
+	fr_tls_conf_t	*conf = h->inst->tls;
+	X509		*cert;
+	char		issuer[1024];
+
+	if (!conf->check_cert_issuer) return 0;
+
+	cert = SSL_get_peer_certificate(h->ssl);		/* Increases ref count */
+	if (!cert) {
+		fr_strerror_printf("Home server didn't send a certificate");
+		return -1;
+	}
+
+	issuer[0] = '\0';
+	X509_NAME_oneline(X509_get_issuer_name(cert), issuer, sizeof(issuer));
+	issuer[sizeof(issuer) - 1] = '\0';
+	X509_free(cert);
+
+	if (strcmp(issuer, conf->check_cert_issuer) != 0) {
+		fr_strerror_printf("Certificate issuer (%s) does not match specified value (%s)",
+				   issuer, conf->check_cert_issuer);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Drive the TLS handshake
+ *
+ * Called once the TCP connection is open, and then whenever the socket
+ * is ready for whatever OpenSSL is waiting for.
+ */
+static void conn_tls_handshake(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	fr_event_fd_cb_t	read_fn = NULL;
+	fr_event_fd_cb_t	write_fn = NULL;
+	int			ret;
+
+	ERR_clear_error();
+	ret = SSL_connect(h->ssl);
+	if (ret == 1) {
+		if (conn_tls_check_issuer(h) < 0) {
+			PERROR("%s - Connection %s failed", h->module_name, h->name);
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		DEBUG("%s - TLS session established on connection %s using %s (%s)", h->module_name, h->name,
+		      SSL_get_version(h->ssl), SSL_get_cipher_name(h->ssl));
+		conn_established(conn, h);
+		return;
+	}
+
+	switch (SSL_get_error(h->ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		read_fn = conn_tls_handshake;
+		break;
+
+	case SSL_ERROR_WANT_WRITE:
+		write_fn = conn_tls_handshake;
+		break;
+
+	default:
+		tls_strerror_printf("TLS handshake failed");
+		PERROR("%s - Connection %s failed", h->module_name, h->name);
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	if (fr_event_fd_insert(h, el, h->fd, read_fn, write_fn, conn_error_connecting, conn) < 0) {
+		PERROR("%s - Failed inserting FD event", h->module_name);
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Start a TLS session on a newly opened connection
+ *
+ */
+static int conn_tls_init(tcp_handle_t *h)
+{
+	fr_tls_conf_t		*conf = h->inst->tls;
+	SSL_CTX			*ctx;
+	X509_VERIFY_PARAM	*param;
+
+	ctx = conf->ctx[(conf->ctx_count == 1) ? 0 : conf->ctx_next++ % conf->ctx_count];	/* mutex not needed */
+
+	h->ssl = SSL_new(ctx);
+	if (!h->ssl) {
+		tls_strerror_printf("Failed allocating TLS session");
+		return -1;
+	}
+
+	/*
+	 *	The output buffer is compacted between writes, and
+	 *	we write whatever we have, so OpenSSL has to accept
+	 *	both partial writes, and a buffer which moves.
+	 */
+	SSL_set_mode(h->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_set_connect_state(h->ssl);
+	SSL_set_ex_data(h->ssl, FR_TLS_EX_INDEX_CONF, conf);
+
+	/*
+	 *	The certificate validation callback set in the
+	 *	context needs a request and a TLS session, which
+	 *	we don't have.  Use OpenSSL's own validation of the
+	 *	chain against the configured CAs instead.
+	 *
+	 *	Chaining to a CA isn't enough, as any certificate
+	 *	issued by that CA would then be accepted as the home
+	 *	server.  If check_cert_cn is set, it's the name the
+	 *	certificate must be for.  Otherwise the certificate
+	 *	must be for the address we're connecting to.
+	 */
+	param = SSL_get0_param(h->ssl);
+	X509_VERIFY_PARAM_set_hostflags(param, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+	if (conf->check_cert_cn) {
+		if (X509_VERIFY_PARAM_set1_host(param, conf->check_cert_cn, 0) != 1) {
+			tls_strerror_printf("Failed setting expected certificate name \"%s\"", conf->check_cert_cn);
+			return -1;
+		}
+	} else {
+		char	ipaddr[FR_IPADDR_STRLEN];
+
+		fr_inet_ntop(ipaddr, sizeof(ipaddr), &h->inst->dst_ipaddr);
+		if (X509_VERIFY_PARAM_set1_ip_asc(param, ipaddr) != 1) {
+			tls_strerror_printf("Failed setting expected certificate address %s", ipaddr);
+			return -1;
+		}
+	}
+	SSL_set_verify(h->ssl, SSL_VERIFY_PEER, NULL);
+
+	if (!SSL_set_fd(h->ssl, h->fd)) {
+		tls_strerror_printf("Failed binding TLS session to socket");
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/** The TCP connection is open, or failed to open
+ *
+ */
+static void conn_writable_connect(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	int			err = 0, on = 1;
+	socklen_t		socklen = sizeof(err);
+	struct sockaddr_storage	salocal;
+
+	if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &socklen) < 0) err = errno;
+	if (err) {
+		ERROR("%s - Connection %s failed: %s", h->module_name, h->name, fr_syserror(err));
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	We do our own coalescing, so don't wait for more
+	 *	data before sending a partial segment.
+	 */
+	if (setsockopt(h->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+		WARN("%s - Failed setting 'TCP_NODELAY': %s", h->module_name, fr_syserror(errno));
+	}
+
+	/*
+	 *	Now that we're connected, we know our source port.
+	 */
+	socklen = sizeof(salocal);
+	if ((getsockname(h->fd, (struct sockaddr *) &salocal, &socklen) == 0) &&
+	    (fr_ipaddr_from_sockaddr(&h->src_ipaddr, &h->src_port, &salocal, socklen) == 0)) {
+		talloc_const_free(h->name);
+		h->name = fr_asprintf(h, "proto %s local %pV port %u remote %pV port %u",
+#ifdef WITH_TLS
+				      h->inst->tls ? "tls" :
+#endif
+				      "tcp",
+				      fr_box_ipaddr(h->src_ipaddr), h->src_port,
+				      fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port);
+	}
+
+#ifdef WITH_TLS
+	if (h->inst->tls) {
+		if (conn_tls_init(h) < 0) {
+			PERROR("%s - Connection %s failed", h->module_name, h->name);
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		conn_tls_handshake(el, h->fd, 0, conn);
+		return;
+	}
+#else
+	(void) el;
+#endif
+
+	conn_established(conn, h);
+}
+
+/** Free a connection handle, closing associated resources
+ *
+ */
+static int _tcp_handle_free(tcp_handle_t *h)
+{
+	fr_assert(h->fd >= 0);
+
+	if (h->status_u) fr_event_timer_delete(&h->status_u->ev);
+
+	fr_event_fd_delete(h->thread->el, h->fd, FR_EVENT_FILTER_IO);
+
+#ifdef WITH_TLS
+	if (h->ssl) {
+		/*
+		 *	Best effort.  We don't wait around for the
+		 *	home server to acknowledge the close_notify.
+		 */
+		(void) SSL_shutdown(h->ssl);
+		SSL_free(h->ssl);
+		h->ssl = NULL;
+	}
+#endif
+
+	if (shutdown(h->fd, SHUT_RDWR) < 0) {
+		DEBUG3("%s - Failed shutting down connection %s: %s",
+		       h->module_name, h->name, fr_syserror(errno));
+	}
+
+	if (close(h->fd) < 0) {
+		DEBUG3("%s - Failed closing connection %s: %s",
+		       h->module_name, h->name, fr_syserror(errno));
+	}
+
+	h->fd = -1;
+
+	DEBUG("%s - Connection closed - %s", h->module_name, h->name);
+
+	return 0;
+}
+
+/** Initialise a new outbound connection
+ *
+ * @param[out] h_out	Where to write the new file descriptor.
+ * @param[in] conn	to initialise.
+ * @param[in] uctx	A #tcp_thread_t
+ */
+static fr_connection_state_t conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	int			fd;
+	tcp_handle_t		*h;
+	tcp_thread_t		*thread = talloc_get_type_abort(uctx, tcp_thread_t);
+
+	MEM(h = talloc_zero(conn, tcp_handle_t));
+	h->thread = thread;
+	h->inst = thread->inst;
+	h->module_name = h->inst->parent->name;
+	h->src_ipaddr = h->inst->src_ipaddr;
+	h->src_port = 0;
+	h->max_packet_size = h->inst->max_packet_size;
+	h->last_idle = fr_time();
+
+	/*
+	 *	Both buffers can hold many packets.  The output
+	 *	buffer lets us coalesce packets into one write, and
+	 *	is sized so max_send_coalesce packets always fit.
+	 *	The input buffer lets us read many replies with one
+	 *	read.
+	 */
+	h->send.len = h->max_packet_size * h->inst->max_send_coalesce;
+	MEM(h->send.data = talloc_array(h, uint8_t, h->send.len));
+	h->recv.len = h->max_packet_size * 16;
+	MEM(h->recv.data = talloc_array(h, uint8_t, h->recv.len));
+
+	if (!h->inst->replicate) MEM(h->tt = radius_track_alloc(h));
+
+	/*
+	 *	Open the outgoing socket.  The connect() completes
+	 *	asynchronously, and we're told when it's done by the
+	 *	socket becoming writable.
+	 */
+	fd = fr_socket_client_tcp(&h->src_ipaddr, &h->inst->dst_ipaddr, h->inst->dst_port, true);
+	if (fd < 0) {
+		PERROR("%s - Failed opening socket", h->module_name);
+		talloc_free(h);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+	h->fd = fd;
+
+	/*
+	 *	Set the connection name.  We don't know the source
+	 *	port until the connection is open.
+	 */
+	h->name = fr_asprintf(h, "proto %s local %pV remote %pV port %u",
+#ifdef WITH_TLS
+			      h->inst->tls ? "tls" :
+#endif
+			      "tcp",
+			      fr_box_ipaddr(h->src_ipaddr),
+			      fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port);
+
+	talloc_set_destructor(h, _tcp_handle_free);
+
+#ifdef SO_RCVBUF
+	if (h->inst->recv_buff_is_set) {
+		int opt;
+
+		opt = h->inst->recv_buff;
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(int)) < 0) {
+			WARN("%s - Failed setting 'SO_RCVBUF': %s", h->module_name, fr_syserror(errno));
+		}
+	}
+#endif
+
+#ifdef SO_SNDBUF
+	if (h->inst->send_buff_is_set) {
+		int opt;
+
+		opt = h->inst->send_buff;
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(int)) < 0) {
+			WARN("%s - Failed setting 'SO_SNDBUF', write performance may be sub-optimal: %s",
+			     h->module_name, fr_syserror(errno));
+		}
+	}
+#endif
+
+	if (fr_event_fd_insert(h, conn->el, h->fd, NULL,
+			       conn_writable_connect, conn_error_connecting, conn) < 0) {
+		PERROR("%s - Failed inserting FD event", h->module_name);
+		talloc_free(h);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	*h_out = h;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+/** Shutdown/close a file descriptor
+ *
+ */
+static void conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uctx)
+{
+	tcp_handle_t *h = talloc_get_type_abort(handle, tcp_handle_t);
+
+	/*
+	 *	There's tracking entries still allocated
+	 *	this is bad, they should have all been
+	 *	released.
+	 */
+	if (h->tt && (h->tt->num_requests != 0)) {
+#ifndef NDEBUG
+		radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__, h->tt, tcp_tracking_entry_log);
+#endif
+		fr_assert_fail("%u tracking entries still allocated at conn close", h->tt->num_requests);
+	}
+
+	DEBUG4("Freeing rlm_radius_tcp handle %p", handle);
+
+	talloc_free(h);
+}
+
+/** Connection failed
+ *
+ * @param[in] handle   	of connection that failed.
+ * @param[in] state	the connection was in when it failed.
+ * @param[in] uctx	UNUSED.
+ */
+static fr_connection_state_t conn_failed(void *handle, fr_connection_state_t state, UNUSED void *uctx)
+{
+	switch (state) {
+	/*
+	 *	If the connection was connected when it failed,
+	 *	we need to handle any outstanding packets and
+	 *	timer events before reconnecting.
+	 */
+	case FR_CONNECTION_STATE_CONNECTED:
+	{
+		tcp_handle_t	*h = talloc_get_type_abort(handle, tcp_handle_t); /* h only available if connected */
+
+		/*
+		 *	Reset the Status-Server checks.
+		 */
+		if (h->status_u && h->status_u->ev) (void) fr_event_timer_delete(&h->status_u->ev);
+	}
+		break;
+
+	default:
+		break;
+	}
+
+	return FR_CONNECTION_STATE_INIT;
+}
+
+static fr_connection_t *thread_conn_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+					  fr_connection_conf_t const *conf,
+					  char const *log_prefix, void *uctx)
+{
+	fr_connection_t		*conn;
+	tcp_thread_t		*thread = talloc_get_type_abort(uctx, tcp_thread_t);
+
+	conn = fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = conn_init,
+					.close = conn_close,
+					.failed = conn_failed
+				   },
+				   conf,
+				   log_prefix,
+				   thread);
+	if (!conn) {
+		PERROR("%s - Failed allocating state handler for new connection", thread->inst->parent->name);
+		return NULL;
+	}
+
+	return conn;
+}
+
+/** Read and discard data
+ *
+ * We still need to read replies when replicating, otherwise the home
+ * server would eventually stop being able to write them, and stop
+ * reading our requests.
+ */
+static void conn_discard(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+	ssize_t			slen;
+
+	while ((slen = tcp_recv(h, h->recv.data, h->recv.len)) > 0);
+
+	if (slen < 0) {
+		PERROR("%s - Failed draining connection %s", h->module_name, h->name);
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Standard I/O read function
+ *
+ * Underlying FD in now readable, so call the trunk to read any pending requests
+ * from this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that's now readable.
+ * @param[in] flags	describing the read event.
+ * @param[in] uctx	The trunk connection handle (tconn).
+ */
+static void conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+/** Standard I/O write function
+ *
+ * Finish writing any data left over from the last call to request_mux,
+ * and then call the trunk to write any pending requests to this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that's now writable.
+ * @param[in] flags	describing the write event.
+ * @param[in] uctx	The trunk connection handle (tcon).
+ */
+static void conn_writable(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+
+	switch (conn_flush(h)) {
+	case -1:
+		PERROR("%s - Failed sending data over connection %s", h->module_name, h->name);
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+
+	case 1:
+		return;		/* Still can't write everything */
+
+	default:
+		break;
+	}
+
+	if (h->events & FR_TRUNK_CONN_EVENT_WRITE) {
+		fr_trunk_connection_signal_writable(tconn);
+		return;
+	}
+
+	/*
+	 *	The output buffer is empty, and the trunk doesn't
+	 *	have anything for us.  Stop watching for writes.
+	 */
+	conn_events_update(h, el);
+}
+
+/** Connection errored
+ *
+ * We were signalled by the event loop that a fatal error occurred on this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that errored.
+ * @param[in] flags	El flags.
+ * @param[in] fd_errno	The nature of the error.
+ * @param[in] uctx	The trunk connection handle (tconn).
+ */
+static void conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	fr_connection_t		*conn = tconn->conn;
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	ERROR("%s - Connection %s failed: %s", h->module_name, h->name, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+}
+
+/** Register the I/O events we need
+ *
+ * We always watch for reads, so that we notice the home server closing
+ * the connection even when we have nothing outstanding.  We watch for
+ * writes if the trunk has requests for us, or if we still have data to
+ * write from a previous call to request_mux.
+ */
+static void conn_events_update(tcp_handle_t *h, fr_event_list_t *el)
+{
+	fr_event_fd_cb_t	read_fn = h->inst->replicate ? conn_discard : conn_readable;
+	fr_event_fd_cb_t	write_fn = NULL;
+
+	if ((h->events & FR_TRUNK_CONN_EVENT_WRITE) || (h->send.end > h->send.start)) write_fn = conn_writable;
+
+	if (fr_event_fd_insert(h, el, h->fd,
+			       read_fn,
+			       write_fn,
+			       conn_error,
+			       h->tconn) < 0) {
+		PERROR("%s - Failed inserting FD event", h->module_name);
+
+		/*
+		 *	May free the connection!
+		 */
+		fr_trunk_connection_signal_reconnect(h->tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+static void thread_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+			       fr_event_list_t *el,
+			       fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	h->tconn = tconn;
+	h->events = notify_on;
+
+	conn_events_update(h, el);
+}
+
+/*
+ *  Return negative numbers to put 'a' at the top of the heap.
+ *  Return positive numbers to put 'b' at the top of the heap.
+ *
+ *  We want the value with the lowest timestamp to be prioritized at
+ *  the top of the heap.
+ */
+static int8_t request_prioritise(void const *one, void const *two)
+{
+	tcp_request_t const *a = one;
+	tcp_request_t const *b = two;
+	int8_t ret;
+
+	/*
+	 *	Prioritise status check packets
+	 */
+	ret = (b->status_check - a->status_check);
+	if (ret != 0) return ret;
+
+	/*
+	 *	Larger priority is more important.
+	 */
+	ret = (a->priority < b->priority) - (a->priority > b->priority);
+	if (ret != 0) return ret;
+
+	/*
+	 *	Smaller timestamp (i.e. earlier) is more important.
+	 */
+	return (a->recv_time > b->recv_time) - (a->recv_time < b->recv_time);
+}
+
+/** Decode response packet data, extracting relevant information and validating the packet
+ *
+ * @param[in] ctx			to allocate pairs in.
+ * @param[out] reply			Pointer to head of pair list to add reply attributes to.
+ * @param[out] response_code		The type of response packet.
+ * @param[in] h				connection handle.
+ * @param[in] request			the request.
+ * @param[in] u				TCP request.
+ * @param[in] request_authenticator	from the original request.
+ * @param[in] data			to decode.
+ * @param[in] data_len			Length of input data.
+ * @return
+ *	- DECODE_FAIL_NONE on success.
+ *	- DECODE_FAIL_* on failure.
+ */
+static decode_fail_t decode(TALLOC_CTX *ctx, fr_pair_t **reply, uint8_t *response_code,
+			    tcp_handle_t *h, request_t *request, tcp_request_t *u,
+			    uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
+			    uint8_t *data, size_t data_len)
+{
+	rlm_radius_tcp_t const *inst = h->thread->inst;
+	size_t			packet_len;
+	decode_fail_t		reason;
+	uint8_t			code;
+	uint8_t			original[RADIUS_HEADER_LENGTH];
+	fr_cursor_t		cursor;
+
+	*response_code = 0;	/* Initialise to keep the rest of the code happy */
+
+	packet_len = data_len;
+	if (!fr_radius_ok(data, &packet_len, inst->parent->max_attributes, false, &reason)) {
+		RWARN("Ignoring malformed packet");
+		return reason;
+	}
+
+	RHEXDUMP3(data, packet_len, "Read packet");
+
+	original[0] = u->code;
+	original[1] = 0;			/* not looked at by fr_radius_verify() */
+	original[2] = 0;
+	original[3] = RADIUS_HEADER_LENGTH;	/* for debugging */
+	memcpy(original + RADIUS_AUTH_VECTOR_OFFSET, request_authenticator, RADIUS_AUTH_VECTOR_LENGTH);
+
+	if (fr_radius_verify(data, original,
+			     (uint8_t const *) inst->secret, talloc_array_length(inst->secret) - 1) < 0) {
+		RPWDEBUG("Ignoring response with invalid signature");
+		return DECODE_FAIL_MA_INVALID;
+	}
+
+	code = data[0];
+	if (!code || (code >= FR_RADIUS_MAX_PACKET_CODE)) {
+		REDEBUG("Unknown reply code %d", code);
+		return DECODE_FAIL_UNKNOWN_PACKET_CODE;
+	}
+
+	if (!allowed_replies[code]) {
+		REDEBUG("%s packet received invalid reply code %s",
+			fr_packet_codes[u->code], fr_packet_codes[code]);
+		return DECODE_FAIL_UNKNOWN_PACKET_CODE;
+	}
+
+	/*
+	 *	Protocol error is allowed as a response to any
+	 *	packet code.
+	 *
+	 *	Status checks accept any response code.
+	 */
+	if (!u->status_check && (code != FR_CODE_PROTOCOL_ERROR)) {
+		if (allowed_replies[code] != (FR_CODE) u->code) {
+			REDEBUG("%s packet received invalid reply code %s",
+				fr_packet_codes[u->code], fr_packet_codes[code]);
+			return DECODE_FAIL_UNKNOWN_PACKET_CODE;
+		}
+	}
+
+	/*
+	 *	Decode the attributes, in the context of the reply.
+	 *	This only fails if the packet is strangely malformed,
+	 *	or if we run out of memory.
+	 */
+	fr_cursor_init(&cursor, reply);
+	if (fr_radius_decode(ctx, data, packet_len, original,
+			     inst->secret, talloc_array_length(inst->secret) - 1, &cursor) < 0) {
+		REDEBUG("Failed decoding attributes for packet");
+		fr_pair_list_free(reply);
+		return DECODE_FAIL_UNKNOWN;
+	}
+
+	RDEBUG("Received %s ID %d length %ld reply packet on connection %s",
+	       fr_packet_codes[code], data[1], packet_len, h->name);
+	log_request_pair_list(L_DBG_LVL_2, request, *reply, NULL);
+
+	*response_code = code;
+
+	/*
+	 *	Record the fact we've seen a response
+	 */
+	u->num_replies++;
+
+	/*
+	 *	Fixup retry times
+	 */
+	if (u->retry.start > h->mrs_time) h->mrs_time = u->retry.start;
+
+	return DECODE_FAIL_NONE;
+}
+
+static int encode(rlm_radius_tcp_t const *inst, request_t *request, tcp_request_t *u, uint8_t id)
+{
+	ssize_t			packet_len;
+	uint8_t			*msg = NULL;
+	int			message_authenticator = u->require_ma * (RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2);
+	int			proxy_state = 6;
+
+	fr_assert(inst->parent->allowed[u->code]);
+	fr_assert(!u->packet);
+
+	/*
+	 *	This is essentially free, as this memory was
+	 *	pre-allocated as part of the treq.
+	 */
+	u->packet_len = inst->max_packet_size;
+	MEM(u->packet = talloc_array(u, uint8_t, u->packet_len));
+
+	/*
+	 *	All proxied Access-Request packets MUST have a
+	 *	Message-Authenticator, otherwise they're insecure.
+	 *	Same goes for Status-Server.
+	 *
+	 *	And we set the authentication vector to a random
+	 *	number...
+	 */
+	switch (u->code) {
+	case FR_CODE_ACCESS_REQUEST:
+	case FR_CODE_STATUS_SERVER:
+	{
+		size_t i;
+		uint32_t hash, base;
+
+		message_authenticator = RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2;
+
+		base = fr_rand();
+		for (i = 0; i < RADIUS_AUTH_VECTOR_LENGTH; i += sizeof(uint32_t)) {
+			hash = fr_rand() ^ base;
+			memcpy(u->packet + RADIUS_AUTH_VECTOR_OFFSET + i, &hash, sizeof(hash));
+		}
+	}
+		FALL_THROUGH;
+
+	default:
+		break;
+	}
+
+	/*
+	 *	If we're sending a status check packet, update any
+	 *	necessary timestamps.  Also, don't add Proxy-State, as
+	 *	we're originating the packet.
+	 */
+	if (u->status_check) {
+		fr_pair_t *vp;
+
+		proxy_state = 0;
+		vp = fr_pair_find_by_da(&request->request_pairs, attr_event_timestamp);
+		if (vp) vp->vp_date = fr_time_to_unix_time(u->retry.updated);
+
+	} else if (inst->parent->originate) {
+		/*
+		 *	We're originating packets instead of proxying
+		 *	them.  We don't add a Proxy-State attribute.
+		 */
+		proxy_state = 0;
+	}
+
+	/*
+	 *	We should have at mininum 64-byte packets, so don't
+	 *	bother doing run-time checks here.
+	 */
+	fr_assert(u->packet_len >= (size_t) (RADIUS_HEADER_LENGTH + proxy_state + message_authenticator));
+
+	/*
+	 *	Encode it, leaving room for Proxy-State and
+	 *	Message-Authenticator if necessary.
+	 */
+	packet_len = fr_radius_encode(u->packet, u->packet_len - (proxy_state + message_authenticator), NULL,
+				      inst->secret, talloc_array_length(inst->secret) - 1,
+				      u->code, id, request->request_pairs);
+	if (fr_pair_encode_is_error(packet_len)) {
+		RPERROR("Failed encoding packet");
+
+	error:
+		TALLOC_FREE(u->packet);
+		return -1;
+	}
+
+	if (packet_len < 0) {
+		size_t have;
+		size_t need;
+
+		have = u->packet_len - (proxy_state + message_authenticator);
+		need = have - packet_len;
+
+		if (need > RADIUS_MAX_PACKET_SIZE) {
+			RERROR("Failed encoding packet.  Have %zu bytes of buffer, need %zu bytes",
+			       have, need);
+		} else {
+			RERROR("Failed encoding packet.  Have %zu bytes of buffer, need %zu bytes.  "
+			       "Increase 'max_packet_size'", have, need);
+		}
+
+		goto error;
+	}
+	/*
+	 *	The encoded packet should NOT over-run the input buffer.
+	 */
+	fr_assert((size_t) (packet_len + proxy_state + message_authenticator) <= u->packet_len);
+
+	/*
+	 *	Add Proxy-State to the tail end of the packet.
+	 *
+	 *	We need to add it here, and NOT in
+	 *	request->request_pairs, because multiple modules
+	 *	may be sending the packets at the same time.
+	 */
+	if (proxy_state) {
+		uint8_t		*attr = u->packet + packet_len;
+		fr_pair_t	*vp;
+		fr_cursor_t	cursor;
+		int		count = 0;
+
+		/*
+		 *	Count how many Proxy-State attributes have
+		 *	*our* magic number.  Note that we also add a
+		 *	counter to each Proxy-State, so we're double
+		 *	sure that it's a loop.
+		 */
+		if (DEBUG_ENABLED) {
+			for (vp = fr_cursor_iter_by_da_init(&cursor, &request->request_pairs, attr_proxy_state);
+			     vp;
+			     vp = fr_cursor_next(&cursor)) {
+				if ((vp->vp_length == 5) && (memcmp(vp->vp_octets, &inst->parent->proxy_state, 4) == 0)) {
+					count++;
+				}
+			}
+
+			/*
+			 *	Some configurations may proxy to
+			 *	ourselves for tests / simplicity.  But
+			 *	warn if there are a large number of
+			 *	identical Proxy-State attributes.
+			 */
+			if (count >= 4) RWARN("Potential proxy loop detected!  Please recheck your configuration.");
+		}
+
+		attr[0] = (uint8_t)attr_proxy_state->attr;
+		attr[1] = 7;
+		memcpy(attr + 2, &inst->parent->proxy_state, 4);
+		attr[6] = count & 0xff;
+		packet_len += 7;
+
+		MEM(vp = fr_pair_afrom_da(u->packet, attr_proxy_state));
+		fr_pair_value_memdup(vp, attr + 2, 5, true);
+		fr_pair_add(&u->extra, vp);
+	}
+
+	/*
+	 *	Add Message-Authenticator manually.
+	 *
+	 *	Note that the length check will always pass, due to
+	 *	the buflen manipulation done above.
+	 */
+	if (message_authenticator) {
+		msg = u->packet + packet_len;
+
+		msg[0] = (uint8_t) attr_message_authenticator->attr;
+		msg[1] = RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2;
+		memset(msg + 2, 0,  RADIUS_MESSAGE_AUTHENTICATOR_LENGTH);
+
+		packet_len += msg[1];
+	}
+
+	/*
+	 *	Update the packet header based on the new attributes.
+	 */
+	u->packet[2] = (packet_len >> 8) & 0xff;
+	u->packet[3] = packet_len & 0xff;
+	u->packet_len = packet_len;
+
+	/*
+	 *	Ensure that we update the Acct-Delay-Time based on the
+	 *	time difference between now, and when we originally
+	 *	received the request.
+	 */
+	if ((u->code == FR_CODE_ACCOUNTING_REQUEST) &&
+	    (fr_pair_find_by_da(&request->request_pairs, attr_acct_delay_time) != NULL)) {
+		uint8_t *attr, *end;
+		uint32_t delay;
+		fr_time_t now;
+
+		/*
+		 *	Change Acct-Delay-Time in the packet, but not
+		 *	in the debug output.  Oh well.  We don't want
+		 *	to edit the incoming VPs, and we want to
+		 *	update the encoded version of Acct-Delay-Time.
+		 *	So we just walk through the packet to find it.
+		 */
+		end = u->packet + packet_len;
+
+		for (attr = u->packet + RADIUS_HEADER_LENGTH;
+		     attr < end;
+		     attr += attr[1]) {
+			if (attr[0] != attr_acct_delay_time->attr) continue;
+			if (attr[1] != 6) continue;
+
+			now = u->retry.updated;
+
+			/*
+			 *	Add in the time between when
+			 *	we received the packet, and
+			 *	when we're sending the packet.
+			 */
+			memcpy(&delay, attr + 2, 4);
+			delay = ntohl(delay);
+			delay += fr_time_delta_to_sec(now - u->recv_time);
+			delay = htonl(delay);
+			memcpy(attr + 2, &delay, 4);
+			break;
+		}
+	}
+
+	/*
+	 *	Only certain types of packet, and those with a
+	 *	message_authenticator need signing.
+	 */
+	if (message_authenticator) goto sign;
+	switch (u->code) {
+	case FR_CODE_ACCOUNTING_REQUEST:
+	case FR_CODE_DISCONNECT_REQUEST:
+	case FR_CODE_COA_REQUEST:
+	sign:
+		/*
+		 *	Now that we're done mangling the packet, sign it.
+		 */
+		if (fr_radius_sign(u->packet, NULL, (uint8_t const *) inst->secret,
+				   talloc_array_length(inst->secret) - 1) < 0) {
+			RERROR("Failed signing packet");
+			goto error;
+		}
+		break;
+
+	default:
+		break;
+
+	}
+	return 0;
+}
+
+
+/** Revive a connection after "revive_interval"
+ *
+ */
+static void revive_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	tcp_handle_t	 	*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+
+	INFO("%s - Shutting down and reviving connection %s", h->module_name, h->name);
+	fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+/** See if the connection is zombied.
+ *
+ * This works the same way as rlm_radius_udp.  We check for zombie when
+ * a request times out, when a DUP packet comes in, and when we're
+ * sending packets.
+ *
+ * A TCP connection which is open isn't necessarily a connection which
+ * works.  The home server may be up, but unable to process requests.
+ *
+ * @return
+ *	- true if a connection state change was triggered.
+ *	  The connection is likely now a zombie or was reconnected.
+ *	- false if the connection did not change state.  It may
+ *	  still be a zombie, but it was a zombie when this
+ */
+static bool check_for_zombie(fr_event_list_t *el, fr_trunk_connection_t *tconn, fr_time_t now)
+{
+	tcp_handle_t	*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+
+	/*
+	 *	We're replicating, and don't care about the health of
+	 *	the home server, and this function should not be called.
+	 */
+	fr_assert(!h->inst->replicate);
+
+	/*
+	 *	If there's already a zombie check started, don't do
+	 *	another one.
+	 *
+	 *	Or if we never sent a packet, we don't know (or care)
+	 *	if the home server is up.
+	 *
+	 *	Or if we had sent packets, and then went idle.
+	 *
+	 *	Or we had replies, and then went idle.
+	 */
+	if (h->status_checking || h->zombie_ev || !h->last_sent || (h->last_sent <= h->last_idle) ||
+	    (h->last_reply && (h->last_reply <= h->last_idle))) {
+		return false;
+	}
+
+	if (now == 0) now = fr_time();
+
+	/*
+	 *	If we have a reply, then set the zombie timeout from
+	 *	when we received the last reply.
+	 *
+	 *	If we haven't seen a reply, then set the zombie
+	 *	timeout from when we first started sending packets.
+	 */
+	if (h->last_reply) {
+		if ((h->last_reply + h->inst->parent->zombie_period) >= now) return false;
+		DEBUG2("%s - We have passed 'zombie_period' time since the last reply on connection %s",
+		       h->module_name, h->name);
+	} else {
+		if ((h->first_sent + h->inst->parent->zombie_period) >= now) return false;
+		DEBUG2("%s - We have passed 'zombie_period' time since we first sent a packet, and "
+		       "there have been no replies on connection %s", h->module_name, h->name);
+	}
+
+	/*
+	 *	No status checks: this connection is dead.
+	 *
+	 *	We will requeue this packet on another
+	 *	connection.
+	 */
+	if (!h->inst->parent->status_check) {
+		fr_time_t when;
+
+		WARN("%s - Connection failed.  Reviving it in %pVs", h->module_name,
+		     fr_box_time_delta(h->inst->parent->revive_interval));
+		fr_trunk_connection_signal_inactive(tconn);
+		(void) fr_trunk_connection_requests_requeue(tconn, FR_TRUNK_REQUEST_STATE_ALL, 0, false);
+
+		when = now + h->inst->parent->revive_interval;
+		if (fr_event_timer_at(h, el, &h->zombie_ev, when, revive_timer, tconn) < 0) {
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return true;
+		}
+
+		return true;
+	}
+
+	/*
+	 *	Mark the connection as inactive, but keep sending
+	 *	packets on it.
+	 */
+	WARN("%s - Entering Zombie state - connection %s", h->module_name, h->name);
+	h->status_checking = true;
+
+	/*
+	 *	Move ALL requests to other connections!
+	 */
+	fr_trunk_connection_signal_inactive(tconn);
+	(void) fr_trunk_connection_requests_requeue(tconn, FR_TRUNK_REQUEST_STATE_ALL, 0, false);
+
+	/*
+	 *	Queue up the status check packet.  It will be sent
+	 *	when the connection is writable.
+	 */
+	h->status_u->retry.start = 0;
+	h->status_r->treq = NULL;
+
+	if (fr_trunk_request_enqueue_on_conn(&h->status_r->treq, tconn, h->status_request,
+					     h->status_u, h->status_r, true) != FR_TRUNK_ENQUEUE_OK) {
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+
+	return true;
+}
+
+/** Handle timeouts for a request_t
+ *
+ * TCP is reliable, so we don't retransmit (RFC 6613 Section 2.6.1).  The
+ * retransmission timers are still used, so that a request is failed
+ * after the same amount of time as it would be with UDP.
+ */
+static void request_timeout(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_trunk_request_t	*treq = talloc_get_type_abort(uctx, fr_trunk_request_t);
+	tcp_handle_t		*h;
+	tcp_request_t		*u = talloc_get_type_abort(treq->preq, tcp_request_t);
+	tcp_result_t		*r = talloc_get_type_abort(treq->rctx, tcp_result_t);
+	request_t		*request = treq->request;
+	fr_trunk_connection_t	*tconn = treq->tconn;
+
+	fr_assert(treq->state == FR_TRUNK_REQUEST_STATE_SENT);		/* No other states should be timing out */
+	fr_assert(treq->preq);						/* Must still have a protocol request */
+	fr_assert(u->rr);
+	fr_assert(tconn);
+
+	h = talloc_get_type_abort(treq->tconn->conn->h, tcp_handle_t);
+
+	if (!u->status_check) {
+		/*
+		 *	If the connection just became a zombie
+		 *	the request that just timedout will
+		 *	have moved back into the trunk backlog,
+		 *	been assigned to another connection
+		 *	or freed.
+		 *
+		 *	In any case we must not continue to
+		 *	work with it, because we have no idea
+		 *	what state its in.
+		 */
+		if (check_for_zombie(el, tconn, now)) return;
+
+	} else {
+		/*
+		 *	Reset replies to 0 as we only count
+		 *	contiguous, good, replies.
+		 */
+		u->num_replies = 0;
+	}
+
+	switch (fr_retry_next(&u->retry, now)) {
+	case FR_RETRY_CONTINUE:
+		/*
+		 *	Status checks are new packets, with new IDs,
+		 *	so they're sent again.
+		 */
+		if (u->status_check) {
+			fr_trunk_request_requeue(treq);
+			return;
+		}
+
+		/*
+		 *	Everything else just keeps waiting.
+		 */
+		if (fr_event_timer_at(u, el, &u->ev, u->retry.next, request_timeout, treq) < 0) {
+			RERROR("Failed inserting response timeout for connection");
+			break;
+		}
+		return;
+
+	case FR_RETRY_MRD:
+		RDEBUG("Reached maximum_retransmit_duration, failing request");
+		break;
+
+	case FR_RETRY_MRC:
+		RDEBUG("Reached maximum_retransmit_count, failing request");
+		break;
+	}
+
+	r->rcode = RLM_MODULE_FAIL;
+	fr_trunk_request_signal_complete(treq);
+
+	if (!u->status_check) return;
+
+	WARN("%s - No response to status check, marking connection as dead - %s", h->module_name, h->name);
+
+	h->status_checking = false;
+	fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+/** Encode as many requests as will fit into the output buffer, and write them
+ *
+ * We don't encode anything new until everything from the previous call
+ * has been written.  That way the output buffer is only ever as large as
+ * one batch of requests, and OpenSSL is always given the same data to
+ * retry a partial write with.
+ */
+static void request_mux(fr_event_list_t *el,
+			fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	rlm_radius_tcp_t const	*inst = h->inst;
+	uint16_t		i;
+
+	/*
+	 *	If the connection just became a zombie
+	 *	don't try and enqueue things on it!
+	 */
+	if (check_for_zombie(el, tconn, 0)) return;
+
+	switch (conn_flush(h)) {
+	case -1:
+		goto fail;
+
+	case 1:
+		return;
+
+	default:
+		break;
+	}
+
+	for (i = 0; (i < inst->max_send_coalesce) && ((h->send.len - h->send.end) >= h->max_packet_size); i++) {
+		fr_trunk_request_t	*treq;
+		tcp_request_t		*u;
+		request_t		*request;
+		char const		*action;
+
+ 		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+
+		/*
+		 *	No more requests to send
+		 */
+		if (!treq) break;
+
+ 		fr_assert((treq->state == FR_TRUNK_REQUEST_STATE_PENDING) ||
+			   (treq->state == FR_TRUNK_REQUEST_STATE_PARTIAL));
+
+		request = treq->request;
+		u = talloc_get_type_abort(treq->preq, tcp_request_t);
+
+		/*
+		 *	Start the response timer from when the request
+		 *	is first written.
+		 */
+		if (!u->retry.start) {
+			(void) fr_retry_init(&u->retry, fr_time(), &h->inst->parent->retry[u->code]);
+			fr_assert(u->retry.rt > 0);
+			fr_assert(u->retry.next > 0);
+		}
+
+		/*
+		 *	We never retransmit, so any packet from a
+		 *	previous connection has already been freed.
+		 */
+		fr_assert(!u->packet && !u->rr);
+
+		if (unlikely(radius_track_entry_reserve(&u->rr, treq, h->tt, request, u->code, treq) < 0)) {
+#ifndef NDEBUG
+			radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__,
+					       h->tt, tcp_tracking_entry_log);
+#endif
+			fr_assert_fail("Tracking entry allocation failed: %s", fr_strerror());
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+		u->id = u->rr->id;
+
+		if (encode(h->inst, request, u, u->id) < 0) {
+			/*
+			 *	Need to do this because request_conn_release
+			 *	may not be called.
+			 */
+			tcp_request_reset(u);
+			if (u->ev) (void) fr_event_timer_delete(&u->ev);
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		RDEBUG("Sending %s ID %d length %ld over connection %s",
+		       fr_packet_codes[u->code], u->id, u->packet_len, h->name);
+		RHEXDUMP3(u->packet, u->packet_len, "Encoded packet");
+
+		/*
+		 *	Remember the authentication vector, which now has the
+		 *	packet signature.
+		 */
+		(void) radius_track_entry_update(u->rr, u->packet + RADIUS_AUTH_VECTOR_OFFSET);
+
+		log_request_pair_list(L_DBG_LVL_2, request, request->request_pairs, NULL);
+		if (u->extra) log_request_pair_list(L_DBG_LVL_2, request, u->extra, NULL);
+
+		memcpy(h->send.data + h->send.end, u->packet, u->packet_len);
+		h->send.end += u->packet_len;
+
+		/*
+		 *	Tell the trunk API that this request is now in
+		 *	the "sent" state.  If the write fails, the
+		 *	connection is reconnected, and the trunk moves
+		 *	the request to another connection.
+		 */
+		fr_trunk_request_signal_sent(treq);
+
+		action = inst->parent->originate ? "Originated" : "Proxied";
+		h->last_sent = u->retry.start;
+		if (h->first_sent <= h->last_idle) h->first_sent = h->last_sent;
+
+		if (!inst->parent->synchronous) {
+			RDEBUG("%s request.  Expecting response within %pVs", action,
+			       fr_box_time_delta(u->retry.rt));
+
+			if (fr_event_timer_at(u, el, &u->ev, u->retry.next, request_timeout, treq) < 0) {
+				RERROR("Failed inserting response timeout for connection");
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
+		} else {
+			RDEBUG("%s request.  Relying on NAS to time out the request", action);
+		}
+	}
+
+	/*
+	 *	Verify nothing accidentally freed the connection handle
+	 */
+	(void)talloc_get_type_abort(h, tcp_handle_t);
+
+	switch (conn_flush(h)) {
+	case -1:
+	fail:
+		PERROR("%s - Failed sending data over connection %s", h->module_name, h->name);
+
+		/*
+		 *	Will re-queue any 'sent' requests, so we don't
+		 *	have to do any cleanup.
+		 */
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+
+	case 1:
+		/*
+		 *	Make sure we're told when we can write
+		 *	the rest, even if the trunk has nothing
+		 *	more for us.
+		 */
+		if (!(h->events & FR_TRUNK_CONN_EVENT_WRITE)) conn_events_update(h, el);
+		return;
+
+	default:
+		return;
+	}
+}
+
+static void request_mux_replicate(fr_event_list_t *el,
+				  fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	rlm_radius_tcp_t const	*inst = h->inst;
+	uint16_t		i;
+
+	switch (conn_flush(h)) {
+	case -1:
+		goto fail;
+
+	case 1:
+		return;
+
+	default:
+		break;
+	}
+
+	for (i = 0; (i < inst->max_send_coalesce) && ((h->send.len - h->send.end) >= h->max_packet_size); i++) {
+		fr_trunk_request_t	*treq;
+		tcp_request_t		*u;
+		tcp_result_t		*r;
+		request_t		*request;
+
+ 		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+
+		/*
+		 *	No more requests to send
+		 */
+		if (!treq) break;
+
+ 		fr_assert((treq->state == FR_TRUNK_REQUEST_STATE_PENDING) ||
+			   (treq->state == FR_TRUNK_REQUEST_STATE_PARTIAL));
+
+		request = treq->request;
+		u = talloc_get_type_abort(treq->preq, tcp_request_t);
+		r = talloc_get_type_abort(treq->rctx, tcp_result_t);
+
+		u->id = h->last_id++;
+
+		if (encode(h->inst, request, u, u->id) < 0) {
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		RDEBUG("Sending %s ID %d length %ld over connection %s",
+		       fr_packet_codes[u->code], u->id, u->packet_len, h->name);
+		RHEXDUMP3(u->packet, u->packet_len, "Encoded packet");
+
+		memcpy(h->send.data + h->send.end, u->packet, u->packet_len);
+		h->send.end += u->packet_len;
+
+		/*
+		 *	We don't wait for replies, so the request is
+		 *	done as soon as it's in the output buffer.
+		 */
+		fr_trunk_request_signal_sent(treq);
+		r->rcode = RLM_MODULE_OK;
+		fr_trunk_request_signal_complete(treq);
+	}
+
+	/*
+	 *	Verify nothing accidentally freed the connection handle
+	 */
+	(void)talloc_get_type_abort(h, tcp_handle_t);
+
+	switch (conn_flush(h)) {
+	case -1:
+	fail:
+		PERROR("%s - Failed sending data over connection %s", h->module_name, h->name);
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+
+	case 1:
+		if (!(h->events & FR_TRUNK_CONN_EVENT_WRITE)) conn_events_update(h, el);
+		return;
+
+	default:
+		return;
+	}
+}
+
+/** Deal with Protocol-Error replies
+ *
+ * There's no need for Response-Length negotiation over TCP, as we read
+ * packets of up to max_packet_size, whatever the size of the request.
+ */
+static void protocol_error_reply(tcp_request_t *u, tcp_result_t *r, uint8_t const *data)
+{
+	uint8_t const	*attr, *end;
+
+	end = data + ((data[2] << 8) | data[3]);
+
+	for (attr = data + RADIUS_HEADER_LENGTH;
+	     attr < end;
+	     attr += attr[1]) {
+		/*
+		 *	Protocol-Error packets MUST contain an
+		 *	Original-Packet-Code attribute.
+		 *
+		 *	The attribute containing the
+		 *	Original-Packet-Code is an extended
+		 *	attribute.
+		 */
+		if (attr[0] != attr_extended_attribute_1->attr) continue;
+
+		/*
+		 *	ATTR + LEN + EXT-Attr + uint32
+		 */
+		if (attr[1] != 7) continue;
+
+		/*
+		 *	See if there's an Original-Packet-Code.
+		 */
+		if (attr[2] != (uint8_t)attr_original_packet_code->attr) continue;
+
+		/*
+		 *	Has to be an 8-bit number.
+		 */
+		if ((attr[3] != 0) ||
+		    (attr[4] != 0) ||
+		    (attr[5] != 0)) {
+			if (r) r->rcode = RLM_MODULE_FAIL;
+			return;
+		}
+
+		/*
+		 *	The value has to match.  We don't
+		 *	currently multiplex different codes
+		 *	with the same IDs on connections.  So
+		 *	this check is just for RFC compliance,
+		 *	and for sanity.
+		 */
+		if (attr[6] != u->code) {
+			if (r) r->rcode = RLM_MODULE_FAIL;
+			return;
+		}
+	}
+
+	/*
+	 *	fail - something went wrong internally, or with the connection.
+	 *	invalid - wrong response to packet
+	 *	handled - best remaining alternative :(
+	 *
+	 *	i.e. if the response is NOT accept, reject, whatever,
+	 *	then we shouldn't allow the caller to do any more
+	 *	processing of this packet.  There was a protocol
+	 *	error, and the response is valid, but not useful for
+	 *	anything.
+	 */
+	if (r) r->rcode = RLM_MODULE_HANDLED;
+}
+
+
+/** Handle retries for a status check
+ *
+ */
+static void status_check_next(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+
+	if (fr_trunk_request_enqueue_on_conn(&h->status_r->treq, tconn, h->status_request,
+					     h->status_u, h->status_r, true) != FR_TRUNK_ENQUEUE_OK) {
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+
+/** Deal with replies to status checks
+ *
+ */
+static void status_check_reply(fr_trunk_request_t *treq, fr_time_t now)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(treq->tconn->conn->h, tcp_handle_t);
+	rlm_radius_t const 	*inst = h->inst->parent;
+	tcp_request_t		*u = talloc_get_type_abort(treq->preq, tcp_request_t);
+	tcp_result_t		*r = talloc_get_type_abort(treq->rctx, tcp_result_t);
+
+	fr_assert(treq->preq == h->status_u);
+	fr_assert(treq->rctx == h->status_r);
+
+	r->treq = NULL;
+
+	if (u->num_replies < inst->num_answers_to_alive) {
+		DEBUG("Received %d / %u replies for status check, on connection - %s",
+		      u->num_replies, inst->num_answers_to_alive, h->name);
+		DEBUG("Next status check packet will be in %pVs", fr_box_time_delta(u->retry.next - now));
+
+		/*
+		 *	Status checks are never retransmitted, so
+		 *	free the packet and ID.
+		 */
+		tcp_request_reset(u);
+
+		/*
+		 *	Set the timer for the next status check.
+		 */
+		if (fr_event_timer_at(h, h->thread->el, &u->ev, u->retry.next, status_check_next, treq->tconn) < 0) {
+			fr_trunk_connection_signal_reconnect(treq->tconn, FR_CONNECTION_FAILED);
+		}
+		return;
+	}
+
+	DEBUG("Received enough replies to status check, marking connection as active - %s", h->name);
+
+	/*
+	 *	Set the "last idle" time to now, so that we don't
+	 *	restart zombie_period until sufficient time has
+	 *	passed.
+	 */
+	h->last_idle = fr_time();
+
+	/*
+	 *	Reset retry interval and retransmission counters
+	 *	also frees u->ev.
+	 */
+	status_check_reset(h, u);
+	fr_trunk_connection_signal_active(treq->tconn);
+}
+
+/** Process one reply packet
+ *
+ */
+static void request_demux_packet(tcp_handle_t *h, uint8_t *packet, size_t packet_len)
+{
+	fr_trunk_request_t	*treq;
+	request_t		*request;
+	tcp_request_t		*u;
+	tcp_result_t		*r;
+	radius_track_entry_t	*rr;
+	decode_fail_t		reason;
+	uint8_t			code = 0;
+	fr_pair_t		*reply = NULL;
+	fr_time_t		now;
+
+	/*
+	 *	Note that we don't care about packet codes.  All
+	 *	packet codes share the same ID space.
+	 */
+	rr = radius_track_entry_find(h->tt, packet[1], NULL);
+	if (!rr) {
+		WARN("%s - Ignoring reply with ID %i that arrived too late",
+		     h->module_name, packet[1]);
+		return;
+	}
+
+	treq = talloc_get_type_abort(rr->uctx, fr_trunk_request_t);
+	request = treq->request;
+	fr_assert(request != NULL);
+	u = talloc_get_type_abort(treq->preq, tcp_request_t);
+	r = talloc_get_type_abort(treq->rctx, tcp_result_t);
+
+	/*
+	 *	Validate and decode the incoming packet
+	 */
+	reason = decode(request->reply, &reply, &code, h, request, u, rr->vector, packet, packet_len);
+	if (reason != DECODE_FAIL_NONE) {
+		RWDEBUG("Ignoring invalid response");
+		return;
+	}
+
+	/*
+	 *	Only valid packets are processed
+	 *	Otherwise an attacker could perform
+	 *	a DoS attack against the proxying servers
+	 *	by sending fake responses for upstream
+	 *	servers.
+	 */
+	h->last_reply = now = fr_time();
+
+	/*
+	 *	Status-Server can have any reply code, we don't care
+	 *	what it is.  So long as it's signed properly, we
+	 *	accept it.
+	 */
+	if (u == h->status_u) {
+		fr_pair_list_free(&reply);
+		status_check_reply(treq, now);
+		fr_trunk_request_signal_complete(treq);
+		return;
+	}
+
+	/*
+	 *	Protocol-Error is permitted as a reply to any
+	 *	packet.
+	 */
+	if (code == FR_CODE_PROTOCOL_ERROR) protocol_error_reply(u, r, packet);
+
+	/*
+	 *	Mark up the request as being an Access-Challenge, if
+	 *	required.
+	 *
+	 *	We don't do this for other packet types, because the
+	 *	ok/fail nature of the module return code will
+	 *	automatically result in it the parent request
+	 *	returning an ok/fail packet code.
+	 */
+	if ((u->code == FR_CODE_ACCESS_REQUEST) && (code == FR_CODE_ACCESS_CHALLENGE)) {
+		fr_pair_t	*vp;
+
+		vp = fr_pair_find_by_da(&request->reply_pairs, attr_packet_type);
+		if (!vp) {
+			MEM(vp = fr_pair_afrom_da(request->reply, attr_packet_type));
+			vp->vp_uint32 = FR_CODE_ACCESS_CHALLENGE;
+			fr_pair_add(&request->reply_pairs, vp);
+		}
+	}
+
+	/*
+	 *	Delete Proxy-State attributes from the reply.
+	 */
+	fr_pair_delete_by_da(&reply, attr_proxy_state);
+
+	/*
+	 *	If the reply has Message-Authenticator, delete
+	 *	it from the proxy reply so that it isn't
+	 *	copied over to our reply.  But also create a
+	 *	reply.Message-Authenticator attribute, so that
+	 *	it ends up in our reply.
+	 */
+	if (fr_pair_find_by_da(&reply, attr_message_authenticator)) {
+		fr_pair_t *vp;
+
+		fr_pair_delete_by_da(&reply, attr_message_authenticator);
+
+		MEM(vp = fr_pair_afrom_da(request->reply, attr_message_authenticator));
+		(void) fr_pair_value_memdup(vp, (uint8_t const *) "", 1, false);
+		fr_pair_add(&request->reply_pairs, vp);
+	}
+
+	treq->request->reply->code = code;
+	r->rcode = radius_code_to_rcode[code];
+	fr_pair_add(&request->reply_pairs, reply);
+	fr_trunk_request_signal_complete(treq);
+}
+
+static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	DEBUG3("%s - Reading data for connection %s", h->module_name, h->name);
+
+	/*
+	 *	Drain the connection.  Each read may return many
+	 *	replies, and the last one may be incomplete.  It's
+	 *	kept in the input buffer until the rest arrives.
+	 */
+	while (true) {
+		uint8_t		*packet;
+		size_t		packet_len;
+		ssize_t		slen;
+		int		ret;
+
+		while ((ret = conn_packet_next(h, &packet, &packet_len)) > 0) {
+			request_demux_packet(h, packet, packet_len);
+		}
+
+		if (ret < 0) {
+			PERROR("%s - Failed reading response from connection %s", h->module_name, h->name);
+		fail:
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		slen = conn_fill(h);
+		if (slen == 0) return;
+
+		if (slen < 0) {
+			PERROR("%s - Failed reading response from connection %s", h->module_name, h->name);
+			goto fail;
+		}
+	}
+}
+
+/** Remove the request from any tracking structures
+ *
+ * Frees encoded packets if the request is being moved to a new connection
+ */
+static void request_cancel(UNUSED fr_connection_t *conn, void *preq_to_reset,
+			   fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
+{
+	tcp_request_t	*u = talloc_get_type_abort(preq_to_reset, tcp_request_t);
+
+	/*
+	 *	Request has been requeued on the same connection.
+	 *	We never retransmit, so it gets a new packet and
+	 *	a new ID when it's sent again.
+	 */
+	if (reason == FR_TRUNK_CANCEL_REASON_REQUEUE) {
+		if (u->ev) (void) fr_event_timer_delete(&u->ev);
+		tcp_request_reset(u);
+	}
+
+	/*
+	 *      Other cancellations are dealt with by
+	 *      request_conn_release as the request is removed
+	 *	from the trunk.
+	 */
+}
+
+/** Clear out anything associated with the handle from the request
+ *
+ */
+static void request_conn_release(fr_connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	tcp_request_t		*u = talloc_get_type_abort(preq_to_reset, tcp_request_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	if (u->ev) (void)fr_event_timer_delete(&u->ev);
+	if (u->packet) tcp_request_reset(u);
+
+	u->num_replies = 0;
+
+	/*
+	 *	If there are no outstanding tracking entries
+	 *	allocated then the connection is "idle".
+	 */
+	if (!h->tt || (h->tt->num_requests == 0)) h->last_idle = fr_time();
+}
+
+/** Clear out anything associated with the handle from the request
+ *
+ */
+static void request_conn_release_replicate(UNUSED fr_connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	tcp_request_t		*u = talloc_get_type_abort(preq_to_reset, tcp_request_t);
+
+	fr_assert(!u->ev);
+
+	if (u->packet) tcp_request_reset(u);
+}
+
+/** Write out a canned failure
+ *
+ */
+static void request_fail(request_t *request, void *preq, void *rctx,
+			 NDEBUG_UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	tcp_result_t		*r = talloc_get_type_abort(rctx, tcp_result_t);
+	tcp_request_t		*u = talloc_get_type_abort(preq, tcp_request_t);
+
+	fr_assert(!u->rr && !u->packet && !u->extra && !u->ev);	/* Dealt with by request_conn_release */
+
+	fr_assert(state != FR_TRUNK_REQUEST_STATE_INIT);
+
+	if (u->status_check) return;
+
+	r->rcode = RLM_MODULE_FAIL;
+	r->treq = NULL;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Response has already been written to the rctx at this point
+ *
+ */
+static void request_complete(request_t *request, void *preq, void *rctx, UNUSED void *uctx)
+{
+	tcp_result_t		*r = talloc_get_type_abort(rctx, tcp_result_t);
+	tcp_request_t		*u = talloc_get_type_abort(preq, tcp_request_t);
+
+	fr_assert(!u->rr && !u->packet && !u->extra && !u->ev);	/* Dealt with by request_conn_release */
+
+	if (u->status_check) return;
+
+	r->treq = NULL;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Explicitly free resources associated with the protocol request
+ *
+ */
+static void request_free(UNUSED request_t *request, void *preq_to_free, UNUSED void *uctx)
+{
+	tcp_request_t		*u = talloc_get_type_abort(preq_to_free, tcp_request_t);
+
+	fr_assert(!u->rr && !u->packet && !u->extra && !u->ev);	/* Dealt with by request_conn_release */
+
+	/*
+	 *	Don't free status check requests.
+	 */
+	if (u->status_check) return;
+
+	talloc_free(u);
+}
+
+/** Resume execution of the request, returning the rcode set during trunk execution
+ *
+ */
+static unlang_action_t mod_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx, UNUSED request_t *request, void *rctx)
+{
+	tcp_result_t	*r = talloc_get_type_abort(rctx, tcp_result_t);
+	rlm_rcode_t	rcode = r->rcode;
+
+	talloc_free(rctx);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static void mod_signal(module_ctx_t const *mctx, UNUSED request_t *request,
+		       void *rctx, fr_state_signal_t action)
+{
+	tcp_thread_t		*t = talloc_get_type_abort(mctx->thread, tcp_thread_t);
+	tcp_result_t		*r = talloc_get_type_abort(rctx, tcp_result_t);
+
+	/*
+	 *	If we don't have a treq associated with the
+	 *	rctx it's likely because the request was
+	 *	scheduled, but hasn't yet been resumed, and
+	 *	has received a signal, OR has been resumed
+	 *	and immediately cancelled as the event loop
+	 *	is exiting, in which case
+	 *	unlang_request_is_scheduled will return false
+	 *	(don't use it).
+	 */
+	if (!r->treq) {
+		talloc_free(rctx);
+		return;
+	}
+
+	switch (action) {
+	/*
+	 *	The request is being cancelled, tell the
+	 *	trunk so it can clean up the treq.
+	 */
+	case FR_SIGNAL_CANCEL:
+		fr_trunk_request_signal_cancel(r->treq);
+		talloc_free(rctx);	/* Should be freed soon anyway, but better to be explicit */
+		return;
+
+	/*
+	 *	We don't retransmit over TCP, as the home server
+	 *	already has the request.  But the NAS retransmitting
+	 *	is a good hint that the connection may be dead.
+	 */
+	case FR_SIGNAL_DUP:
+		if (t->inst->replicate || (r->treq->state != FR_TRUNK_REQUEST_STATE_SENT)) return;
+		(void) check_for_zombie(t->el, r->treq->tconn, 0);
+		return;
+
+	default:
+		return;
+	}
+}
+
+/** Free a tcp_request_t
+ */
+static int _tcp_request_free(tcp_request_t *u)
+{
+	if (u->ev) (void) fr_event_timer_delete(&u->ev);
+
+	fr_assert(u->rr == NULL);
+
+	return 0;
+}
+
+static unlang_action_t mod_enqueue(rlm_rcode_t *p_result, void **rctx_out, void *instance, void *thread, request_t *request)
+{
+	rlm_radius_tcp_t		*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+	tcp_thread_t			*t = talloc_get_type_abort(thread, tcp_thread_t);
+	tcp_result_t			*r;
+	tcp_request_t			*u;
+	fr_trunk_request_t		*treq;
+
+	fr_assert(request->packet->code > 0);
+	fr_assert(request->packet->code < FR_RADIUS_MAX_PACKET_CODE);
+
+	if (request->packet->code == FR_CODE_STATUS_SERVER) {
+		RWDEBUG("Status-Server is reserved for internal use, and cannot be sent manually.");
+		RETURN_MODULE_NOOP;
+	}
+
+	treq = fr_trunk_request_alloc(t->trunk, request);
+	if (!treq) RETURN_MODULE_FAIL;
+
+	MEM(r = talloc_zero(request, tcp_result_t));
+	MEM(u = talloc(treq, tcp_request_t));
+
+	*u = (tcp_request_t){
+		.code = request->packet->code,
+		.synchronous = inst->parent->synchronous,
+		.priority = request->async->priority,
+		.recv_time = request->async->recv_time
+	};
+
+	r->rcode = RLM_MODULE_FAIL;
+
+	/*
+	 *	Make sure that we print out the actual encoded value
+	 *	of the Message-Authenticator attribute.  If the caller
+	 *	asked for one, delete theirs (which has a bad value),
+	 *	and remember to add one manually when we encode the
+	 *	packet.  This is the only editing we do on the input
+	 *	request.
+	 */
+	if (fr_pair_find_by_da(&request->request_pairs, attr_message_authenticator)) {
+		u->require_ma = true;
+		pair_delete_request(attr_message_authenticator);
+	}
+
+	if (fr_trunk_request_enqueue(&treq, t->trunk, request, u, r) < 0) {
+		fr_assert(!u->rr && !u->packet);	/* Should not have been fed to the muxer */
+		fr_trunk_request_free(&treq);		/* Return to the free list */
+		talloc_free(r);
+		RETURN_MODULE_FAIL;
+	}
+
+	r->treq = treq;	/* Remember for signalling purposes */
+	talloc_set_destructor(u, _tcp_request_free);
+
+	*rctx_out = r;
+
+	return UNLANG_ACTION_YIELD;
+}
+
+/** Instantiate thread data for the submodule.
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *tctx)
+{
+	rlm_radius_tcp_t		*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+	tcp_thread_t			*thread = talloc_get_type_abort(tctx, tcp_thread_t);
+
+	static fr_trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = thread_conn_alloc,
+						.connection_notify = thread_conn_notify,
+						.request_prioritise = request_prioritise,
+						.request_mux = request_mux,
+						.request_demux = request_demux,
+						.request_conn_release = request_conn_release,
+						.request_complete = request_complete,
+						.request_fail = request_fail,
+						.request_cancel = request_cancel,
+						.request_free = request_free
+					};
+
+	static fr_trunk_io_funcs_t	io_funcs_replicate = {
+						.connection_alloc = thread_conn_alloc,
+						.connection_notify = thread_conn_notify,
+						.request_prioritise = request_prioritise,
+						.request_mux = request_mux_replicate,
+						.request_conn_release = request_conn_release_replicate,
+						.request_complete = request_complete,
+						.request_fail = request_fail,
+						.request_free = request_free
+					};
+
+	inst->trunk_conf = &inst->parent->trunk_conf;
+
+	inst->trunk_conf->req_pool_headers = 4;	/* One for the request, one for the buffer, one for the tracking binding, one for Proxy-State VP */
+	inst->trunk_conf->req_pool_size = sizeof(tcp_request_t) + inst->max_packet_size + sizeof(radius_track_entry_t ***) + sizeof(fr_pair_t) + 20;
+
+	thread->el = el;
+	thread->inst = inst;
+	thread->trunk = fr_trunk_alloc(thread, el, inst->replicate ? &io_funcs_replicate : &io_funcs,
+				       inst->trunk_conf, inst->parent->name, thread, false);
+	if (!thread->trunk) return -1;
+
+	return 0;
+}
+
+/** Instantiate the module
+ *
+ * Instantiate I/O and type submodules.
+ *
+ * @param[in] instance	data for this module
+ * @param[in] conf	our configuration section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_radius_t		*parent = talloc_get_type_abort(dl_module_parent_data_by_child_data(instance),
+								rlm_radius_t);
+	rlm_radius_tcp_t	*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+	CONF_SECTION		*tls_cs;
+
+	if (!parent) {
+		ERROR("IO module cannot be instantiated directly");
+		return -1;
+	}
+
+	inst->parent = parent;
+	inst->replicate = parent->replicate;
+
+	/*
+	 *	A connection can't have more than 255 requests
+	 *	outstanding, so there's no point in coalescing more.
+	 */
+	FR_INTEGER_BOUND_CHECK("max_send_coalesce", inst->max_send_coalesce, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_send_coalesce", inst->max_send_coalesce, <=, 255);
+
+	/*
+	 *	Ensure that we have a destination address.
+	 */
+	if (inst->dst_ipaddr.af == AF_UNSPEC) {
+		cf_log_err(conf, "A value must be given for 'ipaddr'");
+		return -1;
+	}
+
+	/*
+	 *	If src_ipaddr isn't set, make sure it's INADDR_ANY, of
+	 *	the same address family as dst_ipaddr.
+	 */
+	if (inst->src_ipaddr.af == AF_UNSPEC) {
+		memset(&inst->src_ipaddr, 0, sizeof(inst->src_ipaddr));
+
+		inst->src_ipaddr.af = inst->dst_ipaddr.af;
+
+		if (inst->src_ipaddr.af == AF_INET) {
+			inst->src_ipaddr.prefix = 32;
+		} else {
+			inst->src_ipaddr.prefix = 128;
+		}
+	}
+
+	else if (inst->src_ipaddr.af != inst->dst_ipaddr.af) {
+		cf_log_err(conf, "The 'ipaddr' and 'src_ipaddr' configuration items must "
+			   "be both of the same address family");
+		return -1;
+	}
+
+	if (!inst->dst_port) {
+		cf_log_err(conf, "A value must be given for 'port'");
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 64);
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
+
+	if (inst->recv_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, >=, inst->max_packet_size);
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, <=, (1 << 30));
+	}
+
+	if (inst->send_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, >=, inst->max_packet_size);
+		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, <=, (1 << 30));
+	}
+
+	/*
+	 *	A "tls" subsection turns this into a RADIUS/TLS
+	 *	connection.
+	 */
+	tls_cs = cf_section_find(conf, "tls", NULL);
+	if (tls_cs) {
+#ifdef WITH_TLS
+		inst->tls = fr_tls_conf_parse_client(tls_cs);
+		if (!inst->tls) {
+			cf_log_perr(tls_cs, "Failed parsing TLS configuration");
+			return -1;
+		}
+
+		/*
+		 *	There's no request when the connection is
+		 *	opened, so the certificate checks can't
+		 *	contain expansions.  Refuse them rather
+		 *	than silently ignoring them.
+		 */
+		if (inst->tls->check_cert_cn && strchr(inst->tls->check_cert_cn, '%')) {
+			cf_log_err(tls_cs, "'check_cert_cn' cannot contain expansions when connecting to a home server");
+			return -1;
+		}
+
+		if (inst->tls->check_cert_issuer && strchr(inst->tls->check_cert_issuer, '%')) {
+			cf_log_err(tls_cs, "'check_cert_issuer' cannot contain expansions when connecting to a home server");
+			return -1;
+		}
+#else
+		cf_log_err(tls_cs, "Server was built without TLS support");
+		return -1;
+#endif
+	}
+
+	/*
+	 *	RFC 6614 Section 2.3 says the secret for RADIUS/TLS
+	 *	is "radsec".
+	 */
+	if (!inst->secret) {
+		if (!tls_cs) {
+			cf_log_err(conf, "A value must be given for 'secret'");
+			return -1;
+		}
+
+		inst->secret = talloc_typed_strdup(inst, "radsec");
+	}
+
+	return 0;
+}
+
+/** Bootstrap the module
+ *
+ * Bootstrap I/O and type submodules.
+ *
+ * @param[in] instance	Ctx data for this module
+ * @param[in] conf    our configuration section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	rlm_radius_tcp_t *inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+
+	(void) talloc_set_type(inst, rlm_radius_tcp_t);
+	inst->config = conf;
+
+	return 0;
+}
+
+extern rlm_radius_io_t rlm_radius_tcp;
+rlm_radius_io_t rlm_radius_tcp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "radius_tcp",
+	.inst_size		= sizeof(rlm_radius_tcp_t),
+
+	.thread_inst_size	= sizeof(tcp_thread_t),
+	.thread_inst_type	= "tcp_thread_t",
+
+	.config			= module_config,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate 	= mod_thread_instantiate,
+
+	.enqueue		= mod_enqueue,
+	.signal			= mod_signal,
+	.resume			= mod_resume,
+};
@@ -32,6 +32,7 @@ RCSID("$Id$")
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/heap.h>
+#include <freeradius-devel/util/histogram.h>
 #include <freeradius-devel/util/udp.h>
 
 #include <sys/socket.h>
@@ -39,6 +40,14 @@ RCSID("$Id$")
 #include "rlm_radius.h"
 #include "track.h"
 
+/*
+ *	How many replies we need before we start hedging, how often we
+ *	recalculate the hedge delay, and when we start a new histogram.
+ */
+#define HEDGE_MIN_SAMPLES	(256)
+#define HEDGE_RECALC_SAMPLES	(64)
+#define HEDGE_MAX_SAMPLES	(16384)
+
 /** Static configuration for the module.
  *
  */
@@ -72,11 +81,17 @@ typedef struct {
 	rlm_radius_udp_t const	*inst;			//!< our instance
 
 	fr_trunk_t		*trunk;			//!< trunk handler
+
+	fr_histogram_t		*rtt;			//!< Round trip times of replies, in microseconds.
+	uint32_t		rtt_samples;		//!< Samples added since hedge_delay was calculated.
+	fr_time_delta_t		hedge_delay;		//!< How long to wait before hedging a request.
 } udp_thread_t;
 
 typedef struct {
 	fr_trunk_request_t	*treq;
+	fr_trunk_request_t	*hedge;			//!< Second copy of the request, if we sent one.
 	rlm_rcode_t		rcode;			//!< from the transport
+	bool			resumed;		//!< We've told the request to resume.
 } udp_result_t;
 
 typedef struct udp_request_s udp_request_t;
@@ -129,6 +144,10 @@ typedef struct {
 
 	fr_event_timer_t const	*zombie_ev;		//!< Zombie timeout.
 
+	fr_time_delta_t		srtt;			//!< Smoothed round trip time.  Zero until
+							///< we've had a reply.
+	fr_time_delta_t		rttvar;			//!< Round trip time variation.
+
 	bool			status_checking;       	//!< whether we're doing status checks
 	udp_request_t		*status_u;		//!< for sending status check packets
 	udp_result_t		*status_r;		//!< for faking out status checks as real packets
@@ -149,6 +168,8 @@ struct udp_request_s {
 	bool			require_ma;		//!< saved from the original packet.
 	bool			can_retransmit;		//!< can we retransmit this packet?
 	bool			status_check;		//!< is this packet a status check?
+	bool			hedge;			//!< is this the second copy of a request?
+	bool			can_hedge;		//!< is it safe to send a second copy?
 
 	fr_pair_t		*extra;			//!< VPs for debugging, like Proxy-State.
 
@@ -159,6 +180,7 @@ struct udp_request_s {
 
 	radius_track_entry_t	*rr;			//!< ID tracking, resend count, etc.
 	fr_event_timer_t const	*ev;			//!< timer for retransmissions
+	fr_event_timer_t const	*hedge_ev;		//!< timer for sending a second copy
 	fr_retry_t		retry;			//!< retransmission timers
 };
 
@@ -195,6 +217,7 @@ fr_dict_autoload_t rlm_radius_udp_dict[] = {
 };
 
 static fr_dict_attr_t const *attr_acct_delay_time;
+static fr_dict_attr_t const *attr_eap_message;
 static fr_dict_attr_t const *attr_error_cause;
 static fr_dict_attr_t const *attr_event_timestamp;
 static fr_dict_attr_t const *attr_extended_attribute_1;
@@ -209,6 +232,7 @@ static fr_dict_attr_t const *attr_packet_type;
 extern fr_dict_attr_autoload_t rlm_radius_udp_dict_attr[];
 fr_dict_attr_autoload_t rlm_radius_udp_dict_attr[] = {
 	{ .out = &attr_acct_delay_time, .name = "Acct-Delay-Time", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_eap_message, .name = "EAP-Message", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_error_cause, .name = "Error-Cause", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ .out = &attr_event_timestamp, .name = "Event-Timestamp", .type = FR_TYPE_DATE, .dict = &dict_radius},
 	{ .out = &attr_extended_attribute_1, .name = "Extended-Attribute-1", .type = FR_TYPE_TLV, .dict = &dict_radius},
@@ -272,6 +296,8 @@ static decode_fail_t	decode(TALLOC_CTX *ctx, fr_pair_t **reply, uint8_t *respons
 
 static void		protocol_error_reply(udp_request_t *u, udp_result_t *r, udp_handle_t *h);
 
+static int		_udp_request_free(udp_request_t *u);
+
 #ifndef NDEBUG
 /** Log additional information about a tracking entry
  *
@@ -1669,6 +1695,117 @@ static bool check_for_zombie(fr_event_list_t *el, fr_trunk_connection_t *tconn,
 	return true;
 }
 
+/** Update the round trip time estimates with a new sample
+ *
+ * The smoothed RTT, and its variation, are calculated as per RFC 6298.
+ * They're used to set the first retransmission timer for requests sent
+ * on this connection.
+ *
+ * The sample is also added to the thread's histogram, which is used to
+ * decide how long we wait before hedging a request.
+ */
+static void rtt_sample(udp_handle_t *h, udp_request_t *u, fr_time_delta_t rtt)
+{
+	rlm_radius_t const	*parent = h->inst->parent;
+	udp_thread_t		*t = h->thread;
+
+	if (!h->srtt) {
+		h->srtt = rtt;
+		h->rttvar = rtt / 2;
+	} else {
+		fr_time_delta_t delta = (h->srtt > rtt) ? (h->srtt - rtt) : (rtt - h->srtt);
+
+		h->rttvar = ((3 * h->rttvar) + delta) / 4;
+		h->srtt = ((7 * h->srtt) + rtt) / 8;
+	}
+
+	if (!t->rtt || u->status_check) return;
+
+	fr_histogram_add(t->rtt, fr_time_delta_to_usec(rtt));
+
+	/*
+	 *	Walking the histogram isn't free, so only recalculate
+	 *	the delay every so often.  Once we have plenty of
+	 *	samples, start again, so that the delay follows
+	 *	changes in the home server's latency.
+	 */
+	if (++t->rtt_samples < HEDGE_RECALC_SAMPLES) return;
+	t->rtt_samples = 0;
+
+	if (fr_histogram_count(t->rtt) < HEDGE_MIN_SAMPLES) return;
+
+	t->hedge_delay = fr_time_delta_from_usec(fr_histogram_percentile(t->rtt, parent->hedge_percentile));
+
+	if (fr_histogram_count(t->rtt) >= HEDGE_MAX_SAMPLES) fr_histogram_clear(t->rtt);
+}
+
+/** Set the first retransmission timer from the measured round trip time
+ *
+ * Until we've had a reply on this connection, initial_rtx_time is used.
+ */
+static void retry_adapt(udp_handle_t *h, fr_retry_t *retry)
+{
+	rlm_radius_t const	*parent = h->inst->parent;
+	fr_time_delta_t		rto;
+
+	if (!h->srtt) return;
+
+	rto = h->srtt + (4 * h->rttvar);
+	if (rto < parent->min_rtx_time) rto = parent->min_rtx_time;
+	if (retry->config->mrt && (rto > retry->config->mrt)) rto = retry->config->mrt;
+
+	retry->rt = rto;
+	retry->next = retry->start + rto;
+}
+
+/** Send a second copy of a request which is taking longer than usual
+ *
+ * The copy is a new trunk request, so it has its own ID, and is usually
+ * sent on a different connection.  Whichever copy is answered first
+ * provides the reply.  The other copy is cancelled when the request
+ * resumes.
+ *
+ * Only Access-Requests without EAP-Message are hedged, see mod_enqueue().
+ */
+static void request_hedge(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_trunk_request_t	*treq = talloc_get_type_abort(uctx, fr_trunk_request_t);
+	udp_request_t		*u = talloc_get_type_abort(treq->preq, udp_request_t);
+	udp_result_t		*r = talloc_get_type_abort(treq->rctx, udp_result_t);
+	udp_handle_t		*h = talloc_get_type_abort(treq->tconn->conn->h, udp_handle_t);
+	request_t		*request = treq->request;
+	fr_trunk_request_t	*hedge;
+	udp_request_t		*hu;
+
+	if (r->hedge || r->resumed) return;
+
+	hedge = fr_trunk_request_alloc(h->thread->trunk, request);
+	if (!hedge) return;
+
+	MEM(hu = talloc(hedge, udp_request_t));
+
+	*hu = (udp_request_t){
+		.code = u->code,
+		.synchronous = u->synchronous,
+		.require_ma = u->require_ma,
+		.hedge = true,
+		.priority = u->priority,
+		.recv_time = u->recv_time
+	};
+
+	if (fr_trunk_request_enqueue(&hedge, h->thread->trunk, request, hu, r) < 0) {
+		RWDEBUG("Failed sending a second copy of the request");
+		fr_trunk_request_free(&hedge);
+		return;
+	}
+
+	r->hedge = hedge;
+	talloc_set_destructor(hu, _udp_request_free);
+
+	RDEBUG("No reply after %pVs, sending a second copy of the request",
+	       fr_box_time_delta(h->thread->hedge_delay));
+}
+
 /** Handle retries for a request_t
  *
  */
@@ -1689,6 +1826,13 @@ static void request_timeout(fr_event_list_t *el, fr_time_t now, void *uctx)
 	h = talloc_get_type_abort(treq->tconn->conn->h, udp_handle_t);
 
 	if (!u->status_check) {
+		/*
+		 *	The other copy of the request was answered,
+		 *	and this one will be cancelled when the
+		 *	request resumes.
+		 */
+		if (r->resumed) return;
+
 		/*
 		 *	If the connection just became a zombie
 		 *	the request that just timedout will
@@ -1732,6 +1876,15 @@ static void request_timeout(fr_event_list_t *el, fr_time_t now, void *uctx)
 		break;
 	}
 
+	/*
+	 *	The other copy of the request may still be
+	 *	answered.
+	 */
+	if (!u->status_check && (u->hedge ? r->treq : r->hedge)) {
+		fr_trunk_request_signal_fail(treq);
+		return;
+	}
+
 	r->rcode = RLM_MODULE_FAIL;
 	fr_trunk_request_signal_complete(treq);
 
@@ -1785,6 +1938,7 @@ static void request_mux(fr_event_list_t *el,
 		 */
 		if (!u->retry.start) {
 			(void) fr_retry_init(&u->retry, fr_time(), &h->inst->parent->retry[u->code]);
+			if (inst->parent->adaptive_rtx && !u->status_check) retry_adapt(h, &u->retry);
 			fr_assert(u->retry.rt > 0);
 			fr_assert(u->retry.next > 0);
 		}
@@ -1968,6 +2122,18 @@ static void request_mux(fr_event_list_t *el,
 				fr_trunk_request_signal_fail(treq);
 				continue;
 			}
+
+			/*
+			 *	If the reply takes longer than most
+			 *	replies do, send a second copy of the
+			 *	request, unless we'd retransmit first.
+			 */
+			if (u->can_hedge && (u->retry.count == 1) &&
+			    h->thread->hedge_delay && (h->thread->hedge_delay < u->retry.rt) &&
+			    (fr_event_timer_at(u, el, &u->hedge_ev, u->retry.start + h->thread->hedge_delay,
+					       request_hedge, treq) < 0)) {
+				RWDEBUG("Failed inserting hedge timer");
+			}
 		} else {
 			/*
 			 *	If the packet doesn't get a response,
@@ -2387,6 +2553,13 @@ static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, U
 		 */
 		h->last_reply = now = fr_time();
 
+		/*
+		 *	Karn's algorithm.  We can't tell which
+		 *	transmission a reply to a retransmitted packet
+		 *	is for, so we only measure packets we sent once.
+		 */
+		if (u->retry.count == 1) rtt_sample(h, u, now - u->retry.start);
+
 		/*
 		 *	Status-Server can have any reply code, we don't care
 		 *	what it is.  So long as it's signed properly, we
@@ -2401,6 +2574,17 @@ static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, U
 			continue;
 		}
 
+		/*
+		 *	We sent two copies of this request, and the
+		 *	other one has already been answered.
+		 */
+		if (r->resumed) {
+			RDEBUG("Ignoring reply, the other copy of this request was answered first");
+			fr_pair_list_free(&reply);
+			fr_trunk_request_signal_complete(treq);
+			continue;
+		}
+
 		/*
 		 *	Handle any state changes, etc. needed by receiving a
 		 *	Protocol-Error reply packet.
@@ -2509,6 +2693,7 @@ static void request_conn_release(fr_connection_t *conn, void *preq_to_reset, UNU
 	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);
 
 	if (u->ev) (void)fr_event_timer_delete(&u->ev);
+	if (u->hedge_ev) (void)fr_event_timer_delete(&u->hedge_ev);
 	if (u->packet) udp_request_reset(u);
 
 	u->num_replies = 0;
@@ -2547,8 +2732,20 @@ static void request_fail(request_t *request, void *preq, void *rctx,
 
 	if (u->status_check) return;
 
+	if (u->hedge) {
+		r->hedge = NULL;
+	} else {
+		r->treq = NULL;
+	}
+
+	/*
+	 *	Wait for the other copy of the request, if there
+	 *	is one.
+	 */
+	if (r->resumed || r->treq || r->hedge) return;
+
 	r->rcode = RLM_MODULE_FAIL;
-	r->treq = NULL;
+	r->resumed = true;
 
 	unlang_interpret_resumable(request);
 }
@@ -2565,7 +2762,17 @@ static void request_complete(request_t *request, void *preq, void *rctx, UNUSED
 
 	if (u->status_check) return;
 
-	r->treq = NULL;
+	if (u->hedge) {
+		r->hedge = NULL;
+	} else {
+		r->treq = NULL;
+	}
+
+	/*
+	 *	The other copy of the request was answered first.
+	 */
+	if (r->resumed) return;
+	r->resumed = true;
 
 	unlang_interpret_resumable(request);
 }
@@ -2595,6 +2802,13 @@ static unlang_action_t mod_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t con
 	udp_result_t	*r = talloc_get_type_abort(rctx, udp_result_t);
 	rlm_rcode_t	rcode = r->rcode;
 
+	/*
+	 *	If we sent two copies of the request, one of them
+	 *	may still be outstanding.
+	 */
+	if (r->treq) fr_trunk_request_signal_cancel(r->treq);
+	if (r->hedge) fr_trunk_request_signal_cancel(r->hedge);
+
 	talloc_free(rctx);
 
 	RETURN_MODULE_RCODE(rcode);
@@ -2616,7 +2830,7 @@ static void mod_signal(module_ctx_t const *mctx, UNUSED request_t *request,
 	 *	unlang_request_is_scheduled will return false
 	 *	(don't use it).
 	 */
-	if (!r->treq) {
+	if (!r->treq && !r->hedge) {
 		talloc_free(rctx);
 		return;
 	}
@@ -2627,7 +2841,8 @@ static void mod_signal(module_ctx_t const *mctx, UNUSED request_t *request,
 	 *	trunk so it can clean up the treq.
 	 */
 	case FR_SIGNAL_CANCEL:
-		fr_trunk_request_signal_cancel(r->treq);
+		if (r->treq) fr_trunk_request_signal_cancel(r->treq);
+		if (r->hedge) fr_trunk_request_signal_cancel(r->hedge);
 		talloc_free(rctx);	/* Should be freed soon anyway, but better to be explicit */
 		return;
 
@@ -2637,6 +2852,8 @@ static void mod_signal(module_ctx_t const *mctx, UNUSED request_t *request,
 	 *	has already been sent out.
 	 */
 	case FR_SIGNAL_DUP:
+		if (!r->treq || r->resumed) return;
+
 		/*
 		 *	Connection just became a zombie
 		 *	we don't want to retransmit
@@ -2658,6 +2875,7 @@ static void mod_signal(module_ctx_t const *mctx, UNUSED request_t *request,
 static int _udp_request_free(udp_request_t *u)
 {
 	if (u->ev) (void) fr_event_timer_delete(&u->ev);
+	if (u->hedge_ev) (void) fr_event_timer_delete(&u->hedge_ev);
 
 	fr_assert(u->rr == NULL);
 
@@ -2710,6 +2928,17 @@ static unlang_action_t mod_enqueue(rlm_rcode_t *p_result, void **rctx_out, void
 		pair_delete_request(attr_message_authenticator);
 	}
 
+	/*
+	 *	The second copy has a new ID, so the home server
+	 *	sees two different requests.  That's only harmless
+	 *	for Access-Requests which don't carry any state.
+	 *	Accounting and CoA packets would be acted on twice,
+	 *	and an EAP conversation would see the same round
+	 *	twice.
+	 */
+	u->can_hedge = inst->parent->hedge && (u->code == FR_CODE_ACCESS_REQUEST) &&
+		       !fr_pair_find_by_da(&request->request_pairs, attr_eap_message);
+
 	if (fr_trunk_request_enqueue(&treq, t->trunk, request, u, r) < 0) {
 		fr_assert(!u->rr && !u->packet);	/* Should not have been fed to the muxer */
 		fr_trunk_request_free(&treq);		/* Return to the free list */
@@ -2768,6 +2997,14 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
 				       inst->trunk_conf, inst->parent->name, thread, false);
 	if (!thread->trunk) return -1;
 
+	/*
+	 *	Replies slower than this are all the same to us.
+	 */
+	if (inst->parent->hedge) {
+		thread->rtt = fr_histogram_alloc(thread, 5, fr_time_delta_to_usec(fr_time_delta_from_sec(60)));
+		if (!thread->rtt) return -1;
+	}
+
 	return 0;
 }
 
@@ -71,6 +71,21 @@ DIAG_ON(strict-prototypes)
 
 #include "rlm_sql.h"
 
+/*
+ *	MySQL 8.0 replaced my_bool with bool in the client API
+ */
+#if defined(MARIADB_BASE_VERSION) || (MYSQL_VERSION_ID < 80000)
+typedef my_bool mysql_bool_t;
+#else
+typedef bool mysql_bool_t;
+#endif
+
+/*
+ *	Initial size of the result buffers for prepared statements.
+ *	Longer values are fetched separately.
+ */
+#define MYSQL_COLUMN_BUFFER_LEN	256
+
 typedef enum {
 	SERVER_WARNINGS_AUTO = 0,
 	SERVER_WARNINGS_YES,
@@ -84,10 +99,25 @@ static fr_table_num_sorted_t const server_warnings_table[] = {
 };
 static size_t server_warnings_table_len = NUM_ELEMENTS(server_warnings_table);
 
+/** Result buffer for a column returned by a prepared statement
+ *
+ */
+typedef struct {
+	unsigned long	length;			//!< Length of the value, may be longer than the buffer.
+	mysql_bool_t	is_null;		//!< Value was NULL.
+	char		buffer[MYSQL_COLUMN_BUFFER_LEN];
+} rlm_sql_mysql_column_t;
+
 typedef struct {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
+
+	MYSQL_STMT	**stmts;		//!< Prepared statements, indexed by sql_prepared_t id.
+	MYSQL_STMT	*stmt;			//!< Statement which was last executed, if it hasn't
+						///< been finished.
+	MYSQL_BIND	*bind;			//!< Result bindings for stmt.
+	rlm_sql_mysql_column_t	*columns;	//!< Result buffers for stmt.
 } rlm_sql_mysql_conn_t;
 
 typedef struct {
@@ -161,6 +191,11 @@ static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 	DEBUG2("Socket destructor called, closing socket");
 
 	if (conn->sock){
+		size_t i;
+
+		for (i = 0; i < talloc_array_length(conn->stmts); i++) {
+			if (conn->stmts[i]) mysql_stmt_close(conn->stmts[i]);
+		}
 		mysql_close(conn->sock);
 	}
 
@@ -474,6 +509,8 @@ static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *con
 	int num = 0;
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_field_count(conn->stmt);
+
 #if MYSQL_VERSION_ID >= 32224
 	/*
 	 *	Count takes a connection handle
@@ -512,10 +549,144 @@ static sql_rcode_t sql_select_query(rlm_sql_handle_t *handle, rlm_sql_config_t *
 	return rcode;
 }
 
+/** Convert an error from a prepared statement into a #sql_rcode_t
+ *
+ */
+static sql_rcode_t sql_stmt_check_error(MYSQL_STMT *stmt)
+{
+	sql_rcode_t rcode;
+
+	rcode = sql_check_error(NULL, mysql_stmt_errno(stmt));
+
+	return (rcode == RLM_SQL_OK) ? RLM_SQL_ERROR : rcode;
+}
+
+/** Find the server side statement for stmt, preparing it if this connection hasn't seen it before
+ *
+ */
+static sql_rcode_t sql_stmt_prepare(MYSQL_STMT **out, rlm_sql_mysql_conn_t *conn, sql_prepared_t const *stmt)
+{
+	MYSQL_STMT	*ps;
+	size_t		num = talloc_array_length(conn->stmts);
+	sql_rcode_t	rcode;
+
+	if ((stmt->id < num) && conn->stmts[stmt->id]) {
+		*out = conn->stmts[stmt->id];
+		return RLM_SQL_OK;
+	}
+
+	if (stmt->id >= num) {
+		MEM(conn->stmts = talloc_realloc(conn, conn->stmts, MYSQL_STMT *, stmt->id + 1));
+		memset(conn->stmts + num, 0, sizeof(conn->stmts[0]) * (stmt->id + 1 - num));
+	}
+
+	ps = mysql_stmt_init(conn->sock);
+	if (!ps) {
+		ERROR("Failed allocating statement %s", stmt->name);
+		return RLM_SQL_ERROR;
+	}
+
+	if (mysql_stmt_prepare(ps, stmt->query, strlen(stmt->query)) != 0) {
+		ERROR("Failed preparing statement %s: %s", stmt->name, mysql_stmt_error(ps));
+		rcode = sql_stmt_check_error(ps);
+		mysql_stmt_close(ps);
+
+		/*
+		 *	A statement which can't be prepared won't
+		 *	work any better as an alternative query.
+		 */
+		return (rcode == RLM_SQL_ALT_QUERY) ? RLM_SQL_QUERY_INVALID : rcode;
+	}
+
+	DEBUG2("Prepared statement %s", stmt->name);
+	*out = conn->stmts[stmt->id] = ps;
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_prepared_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				      sql_prepared_t const *stmt, char const * const values[])
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	MYSQL_STMT		*ps;
+	MYSQL_BIND		*bind = NULL;
+	sql_rcode_t		rcode;
+	uint32_t		i;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	rcode = sql_stmt_prepare(&ps, conn, stmt);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	conn->stmt = ps;
+
+	/*
+	 *	Values are all sent as strings, and converted
+	 *	by the server, the same as they would be if they
+	 *	appeared as literals in the query.
+	 */
+	if (stmt->num_params > 0) {
+		MEM(bind = talloc_zero_array(conn, MYSQL_BIND, stmt->num_params));
+		for (i = 0; i < stmt->num_params; i++) {
+			bind[i].buffer_type = MYSQL_TYPE_STRING;
+			memcpy(&bind[i].buffer, &values[i], sizeof(bind[i].buffer));
+			bind[i].buffer_length = strlen(values[i]);
+		}
+
+		if (mysql_stmt_bind_param(ps, bind) != 0) {
+			talloc_free(bind);
+			return sql_stmt_check_error(ps);
+		}
+	}
+
+	if (mysql_stmt_execute(ps) != 0) {
+		talloc_free(bind);
+		return sql_stmt_check_error(ps);
+	}
+	talloc_free(bind);
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_prepared_select_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					     sql_prepared_t const *stmt, char const * const values[])
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+	unsigned int		num_fields, i;
+
+	rcode = sql_prepared_query(handle, config, stmt, values);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	if (mysql_stmt_store_result(conn->stmt) != 0) return sql_stmt_check_error(conn->stmt);
+
+	num_fields = mysql_stmt_field_count(conn->stmt);
+	if (num_fields == 0) return RLM_SQL_OK;
+
+	MEM(conn->bind = talloc_zero_array(conn, MYSQL_BIND, num_fields));
+	MEM(conn->columns = talloc_zero_array(conn, rlm_sql_mysql_column_t, num_fields));
+	for (i = 0; i < num_fields; i++) {
+		conn->bind[i].buffer_type = MYSQL_TYPE_STRING;
+		conn->bind[i].buffer = conn->columns[i].buffer;
+		conn->bind[i].buffer_length = sizeof(conn->columns[i].buffer);
+		conn->bind[i].length = &conn->columns[i].length;
+		conn->bind[i].is_null = &conn->columns[i].is_null;
+	}
+
+	if (mysql_stmt_bind_result(conn->stmt, conn->bind) != 0) return sql_stmt_check_error(conn->stmt);
+
+	return RLM_SQL_OK;
+}
+
 static int sql_num_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_num_rows(conn->stmt);
+
 	if (conn->result) {
 		return mysql_num_rows(conn->result);
 	}
@@ -554,6 +725,56 @@ static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, rlm_
 	return RLM_SQL_OK;
 }
 
+/** Fetch the next row of the result of a prepared statement
+ *
+ */
+static sql_rcode_t sql_stmt_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	unsigned int		num_fields, i;
+	int			ret;
+
+	if (!conn->bind) return RLM_SQL_NO_MORE_ROWS;
+
+	ret = mysql_stmt_fetch(conn->stmt);
+	if (ret == MYSQL_NO_DATA) return RLM_SQL_NO_MORE_ROWS;
+	if ((ret != 0) && (ret != MYSQL_DATA_TRUNCATED)) return sql_stmt_check_error(conn->stmt);
+
+	num_fields = talloc_array_length(conn->bind);
+
+	MEM(*out = handle->row = talloc_zero_array(handle, char *, num_fields + 1));
+	for (i = 0; i < num_fields; i++) {
+		rlm_sql_mysql_column_t	*column = &conn->columns[i];
+		MYSQL_BIND		bind;
+
+		if (column->is_null) continue;
+
+		if (column->length <= sizeof(column->buffer)) {
+			MEM(handle->row[i] = talloc_bstrndup(handle->row, column->buffer, column->length));
+			continue;
+		}
+
+		/*
+		 *	Value didn't fit in the buffer, fetch
+		 *	the whole thing.
+		 */
+		MEM(handle->row[i] = talloc_array(handle->row, char, column->length + 1));
+		memset(&bind, 0, sizeof(bind));
+		bind.buffer_type = MYSQL_TYPE_STRING;
+		bind.buffer = handle->row[i];
+		bind.buffer_length = column->length;
+
+		if (mysql_stmt_fetch_column(conn->stmt, &bind, i, 0) != 0) {
+			*out = NULL;
+			TALLOC_FREE(handle->row);
+			return sql_stmt_check_error(conn->stmt);
+		}
+		handle->row[i][column->length] = '\0';
+	}
+
+	return RLM_SQL_OK;
+}
+
 static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t	*conn = handle->conn;
@@ -565,13 +786,15 @@ static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, r
 
 	*out = NULL;
 
+	TALLOC_FREE(handle->row);		/* Clear previous row set */
+
+	if (conn->stmt) return sql_stmt_fetch_row(out, handle);
+
 	/*
 	 *  Check pointer before de-referencing it.
 	 */
 	if (!conn->result) return RLM_SQL_RECONNECT;
 
-	TALLOC_FREE(handle->row);		/* Clear previous row set */
-
 retry_fetch_row:
 	row = mysql_fetch_row(conn->result);
 	if (!row) {
@@ -610,6 +833,17 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	/*
+	 *	The statement stays prepared on the connection,
+	 *	only its results are freed.
+	 */
+	if (conn->stmt) {
+		mysql_stmt_free_result(conn->stmt);
+		conn->stmt = NULL;
+		TALLOC_FREE(conn->bind);
+		TALLOC_FREE(conn->columns);
+	}
+
 	if (conn->result) {
 		mysql_free_result(conn->result);
 		conn->result = NULL;
@@ -712,14 +946,23 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
 	fr_assert(conn && conn->sock);
 	fr_assert(outlen > 0);
 
-	error = mysql_error(conn->sock);
-
 	/*
-	 *	Grab the error now in case it gets cleared on the next operation.
+	 *	Errors from prepared statements are recorded
+	 *	against the statement, not the connection.
 	 */
-	if (error && (error[0] != '\0')) {
-		error = talloc_typed_asprintf(ctx, "ERROR %u (%s): %s", mysql_errno(conn->sock), error,
-					mysql_sqlstate(conn->sock));
+	if (conn->stmt && mysql_stmt_errno(conn->stmt)) {
+		error = talloc_typed_asprintf(ctx, "ERROR %u (%s): %s", mysql_stmt_errno(conn->stmt),
+					      mysql_stmt_error(conn->stmt), mysql_stmt_sqlstate(conn->stmt));
+	} else {
+		error = mysql_error(conn->sock);
+
+		/*
+		 *	Grab the error now in case it gets cleared on the next operation.
+		 */
+		if (error && (error[0] != '\0')) {
+			error = talloc_typed_asprintf(ctx, "ERROR %u (%s): %s", mysql_errno(conn->sock), error,
+						mysql_sqlstate(conn->sock));
+		}
 	}
 
 	/*
@@ -778,6 +1021,12 @@ static sql_rcode_t sql_finish_query(rlm_sql_handle_t *handle, rlm_sql_config_t *
 	int			ret;
 	MYSQL_RES		*result;
 
+	/*
+	 *	Prepared statements don't leave results
+	 *	on the connection.
+	 */
+	if (conn->stmt) return sql_free_result(handle, config);
+
 	/*
 	 *	If there's no result associated with the
 	 *	connection handle, assume the first result in the
@@ -821,6 +1070,8 @@ static int sql_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_affected_rows(conn->stmt);
+
 	return mysql_affected_rows(conn->sock);
 }
 
@@ -854,6 +1105,8 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
 	.sql_select_query		= sql_select_query,
+	.sql_prepared_query		= sql_prepared_query,
+	.sql_prepared_select_query	= sql_prepared_select_query,
 	.sql_store_result		= sql_store_result,
 	.sql_num_fields			= sql_num_fields,
 	.sql_num_rows			= sql_num_rows,
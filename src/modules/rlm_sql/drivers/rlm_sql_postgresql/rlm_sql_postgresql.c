@@ -72,6 +72,8 @@ typedef struct {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	bool		*prepared;		//!< Which prepared statements exist on this connection,
+						///< indexed by sql_prepared_t id.
 } rlm_sql_postgres_conn_t;
 
 static CONF_PARSER driver_config[] = {
@@ -254,22 +256,14 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
-					      char const *query)
+/** Wait for the result of the last command sent on the connection
+ *
+ */
+static sql_rcode_t sql_wait(rlm_sql_postgres_conn_t *conn, rlm_sql_config_t *config)
 {
-	rlm_sql_postgres_conn_t	*conn = handle->conn;
-	rlm_sql_postgres_t	*inst = config->driver;
 	fr_time_delta_t		timeout = fr_time_delta_from_sec(config->query_timeout);
 	fr_time_t		start;
 	int			sockfd;
-	PGresult		*tmp_result;
-	int			numfields = 0;
-	ExecStatusType		status;
-
-	if (!conn->db) {
-		ERROR("Socket not connected");
-		return RLM_SQL_RECONNECT;
-	}
 
 	sockfd = PQsocket(conn->db);
 	if (sockfd < 0) {
@@ -277,11 +271,6 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 		return RLM_SQL_RECONNECT;
 	}
 
-	if (!PQsendQuery(conn->db, query)) {
-		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
-		return RLM_SQL_RECONNECT;
-	}
-
 	/*
 	 *  We try to avoid blocking by waiting until the driver indicates that
 	 *  the result is ready or our timeout expires
@@ -317,6 +306,23 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 		}
 	}
 
+	return RLM_SQL_OK;
+}
+
+/** Wait for, and process the result of the last query sent on the connection
+ *
+ */
+static sql_rcode_t sql_result(rlm_sql_postgres_conn_t *conn, rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_t	*inst = config->driver;
+	PGresult		*tmp_result;
+	int			numfields = 0;
+	ExecStatusType		status;
+	sql_rcode_t		rcode;
+
+	rcode = sql_wait(conn, config);
+	if (rcode != RLM_SQL_OK) return rcode;
+
 	/*
 	 *  Returns a PGresult pointer or possibly a null pointer.
 	 *  A non-null pointer will generally be returned except in
@@ -385,7 +391,25 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 		break;
 	}
 
-	return sql_classify_error(inst, status, conn->result);;
+	return sql_classify_error(inst, status, conn->result);
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					      char const *query)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQsendQuery(conn->db, query)) {
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return sql_result(conn, config);
 }
 
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config, char const *query)
@@ -393,6 +417,88 @@ static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t
 	return sql_query(handle, config, query);
 }
 
+/** Prepare a statement on the connection, if it hasn't been already
+ *
+ */
+static sql_rcode_t sql_stmt_prepare(rlm_sql_postgres_conn_t *conn, rlm_sql_config_t *config, sql_prepared_t const *stmt)
+{
+	rlm_sql_postgres_t	*inst = config->driver;
+	PGresult		*result, *tmp_result;
+	ExecStatusType		status;
+	sql_rcode_t		rcode;
+	size_t			num = talloc_array_length(conn->prepared);
+
+	if ((stmt->id < num) && conn->prepared[stmt->id]) return RLM_SQL_OK;
+
+	if (stmt->id >= num) {
+		MEM(conn->prepared = talloc_realloc(conn, conn->prepared, bool, stmt->id + 1));
+		memset(conn->prepared + num, 0, sizeof(conn->prepared[0]) * (stmt->id + 1 - num));
+	}
+
+	/*
+	 *  Let the server infer the parameter types.
+	 */
+	if (!PQsendPrepare(conn->db, stmt->name, stmt->query, stmt->num_params, NULL)) {
+		ERROR("Failed to send prepare: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	rcode = sql_wait(conn, config);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	result = PQgetResult(conn->db);
+	while ((tmp_result = PQgetResult(conn->db)) != NULL) PQclear(tmp_result);
+
+	if (!result) {
+		ERROR("Failed getting prepare result: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	status = PQresultStatus(result);
+	if (status != PGRES_COMMAND_OK) {
+		rcode = sql_classify_error(inst, status, result);
+		PQclear(result);
+
+		/*
+		 *  A statement which can't be prepared won't
+		 *  work any better as an alternative query.
+		 */
+		return (rcode == RLM_SQL_ALT_QUERY) ? RLM_SQL_QUERY_INVALID : rcode;
+	}
+	PQclear(result);
+
+	DEBUG2("Prepared statement %s", stmt->name);
+	conn->prepared[stmt->id] = true;
+
+	return RLM_SQL_OK;
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_prepared_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+						       sql_prepared_t const *stmt, char const * const values[])
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	rcode = sql_stmt_prepare(conn, config, stmt);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	/*
+	 *  Parameters are sent in text format, and the
+	 *  results are returned in text format.
+	 */
+	if (!PQsendQueryPrepared(conn->db, stmt->name, stmt->num_params, values, NULL, NULL, 0)) {
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return sql_result(conn, config);
+}
+
 static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_postgres_conn_t *conn = handle->conn;
@@ -657,7 +763,7 @@ extern rlm_sql_driver_t rlm_sql_postgresql;
 rlm_sql_driver_t rlm_sql_postgresql = {
 	.name				= "rlm_sql_postgresql",
 	.magic				= RLM_MODULE_INIT,
-	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,
+	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY | RLM_SQL_FLAGS_NUMBERED_PARAMS,
 	.inst_size			= sizeof(rlm_sql_postgres_t),
 	.onload				= mod_load,
 	.config				= driver_config,
@@ -665,6 +771,8 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
 	.sql_select_query		= sql_select_query,
+	.sql_prepared_query		= sql_prepared_query,
+	.sql_prepared_select_query	= sql_prepared_query,
 	.sql_num_fields			= sql_num_fields,
 	.sql_fields			= sql_fields,
 	.sql_fetch_row			= sql_fetch_row,
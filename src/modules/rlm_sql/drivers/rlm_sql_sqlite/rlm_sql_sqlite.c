@@ -53,6 +53,8 @@ typedef struct {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int col_count;
+	bool cached;			//!< statement belongs to stmts, and should be reset, not finalized.
+	sqlite3_stmt **stmts;		//!< Prepared statements, indexed by sql_prepared_t id.
 } rlm_sql_sqlite_conn_t;
 
 typedef struct {
@@ -386,6 +388,16 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 	DEBUG2("Socket destructor called, closing socket");
 
 	if (conn->db) {
+		size_t i;
+
+		/*
+		 *	The database can't be closed while it
+		 *	has prepared statements.
+		 */
+		for (i = 0; i < talloc_array_length(conn->stmts); i++) {
+			if (conn->stmts[i]) sqlite3_finalize(conn->stmts[i]);
+		}
+
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) WARN("Got SQLite error when closing socket: %s",
 					      sqlite3_errmsg(conn->db));
@@ -501,6 +513,95 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return sql_check_error(conn->db, status);
 }
 
+/** Find the cached statement for stmt, preparing it if this connection hasn't seen it before
+ *
+ */
+static sql_rcode_t sql_stmt_prepare(sqlite3_stmt **out, rlm_sql_sqlite_conn_t *conn, sql_prepared_t const *stmt)
+{
+	sqlite3_stmt	*ps = NULL;
+	size_t		num = talloc_array_length(conn->stmts);
+	char const	*z_tail;
+	int		status;
+	sql_rcode_t	rcode;
+
+	if ((stmt->id < num) && conn->stmts[stmt->id]) {
+		*out = conn->stmts[stmt->id];
+		return RLM_SQL_OK;
+	}
+
+	if (stmt->id >= num) {
+		MEM(conn->stmts = talloc_realloc(conn, conn->stmts, sqlite3_stmt *, stmt->id + 1));
+		memset(conn->stmts + num, 0, sizeof(conn->stmts[0]) * (stmt->id + 1 - num));
+	}
+
+#ifdef HAVE_SQLITE3_PREPARE_V2
+	status = sqlite3_prepare_v2(conn->db, stmt->query, strlen(stmt->query), &ps, &z_tail);
+#else
+	status = sqlite3_prepare(conn->db, stmt->query, strlen(stmt->query), &ps, &z_tail);
+#endif
+	rcode = sql_check_error(conn->db, status);
+	if (rcode != RLM_SQL_OK) {
+		sql_print_error(conn->db, status, "Failed preparing statement %s", stmt->name);
+		if (ps) sqlite3_finalize(ps);
+
+		/*
+		 *	A statement which can't be prepared won't
+		 *	work any better as an alternative query.
+		 */
+		return (rcode == RLM_SQL_ALT_QUERY) ? RLM_SQL_QUERY_INVALID : rcode;
+	}
+
+	DEBUG2("Prepared statement %s", stmt->name);
+	*out = conn->stmts[stmt->id] = ps;
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_prepared_select_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+					     sql_prepared_t const *stmt, char const * const values[])
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	sqlite3_stmt		*ps;
+	sql_rcode_t		rcode;
+	uint32_t		i;
+	int			status;
+
+	rcode = sql_stmt_prepare(&ps, conn, stmt);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	(void) sqlite3_reset(ps);
+
+	conn->statement = ps;
+	conn->cached = true;
+	conn->col_count = 0;
+
+	/*
+	 *	The values are freed before the results are fetched,
+	 *	so SQLite has to copy them.
+	 */
+	for (i = 0; i < stmt->num_params; i++) {
+		status = sqlite3_bind_text(ps, i + 1, values[i], -1, SQLITE_TRANSIENT);
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_prepared_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				      sql_prepared_t const *stmt, char const * const values[])
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+	int			status;
+
+	rcode = sql_prepared_select_query(handle, config, stmt, values);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	status = sqlite3_step(conn->statement);
+	return sql_check_error(conn->db, status);
+}
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -621,7 +722,16 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		/*
+		 *	Cached statements are kept for the next
+		 *	query, and just need resetting.
+		 */
+		if (conn->cached) {
+			(void) sqlite3_reset(conn->statement);
+			conn->cached = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
@@ -814,6 +924,8 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
 	.sql_select_query		= sql_select_query,
+	.sql_prepared_query		= sql_prepared_query,
+	.sql_prepared_select_query	= sql_prepared_select_query,
 	.sql_num_fields			= sql_num_fields,
 	.sql_affected_rows		= sql_affected_rows,
 	.sql_fetch_row			= sql_fetch_row,
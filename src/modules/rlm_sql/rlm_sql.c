@@ -96,6 +96,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("logfile", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, logfile) },
 	{ FR_CONF_OFFSET("default_user_profile", FR_TYPE_STRING, rlm_sql_config_t, default_profile), .dflt = "" },
 	{ FR_CONF_OFFSET("open_query", FR_TYPE_STRING, rlm_sql_config_t, connect_query) },
+	{ FR_CONF_OFFSET("prepared_statements", FR_TYPE_BOOL, rlm_sql_config_t, prepared_statements), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("authorize_check_query", FR_TYPE_STRING | FR_TYPE_XLAT | FR_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_check_query) },
 	{ FR_CONF_OFFSET("authorize_reply_query", FR_TYPE_STRING | FR_TYPE_XLAT | FR_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_reply_query) },
@@ -688,11 +689,15 @@ static int sql_get_grouplist(rlm_sql_t const *inst, rlm_sql_handle_t **handle, r
 	entry = *phead = NULL;
 
 	if (!inst->config->groupmemb_query || !*inst->config->groupmemb_query) return 0;
-	if (xlat_aeval(request, &expanded, request, inst->config->groupmemb_query,
-			 inst->sql_escape_func, *handle) < 0) return -1;
+	if (inst->groupmemb_stmt) {
+		ret = rlm_sql_prepared_select_query(inst, request, handle, inst->groupmemb_stmt);
+	} else {
+		if (xlat_aeval(request, &expanded, request, inst->config->groupmemb_query,
+				 inst->sql_escape_func, *handle) < 0) return -1;
 
-	ret = rlm_sql_select_query(inst, request, handle, expanded);
-	talloc_free(expanded);
+		ret = rlm_sql_select_query(inst, request, handle, expanded);
+		talloc_free(expanded);
+	}
 	if (ret != RLM_SQL_OK) return -1;
 
 	while (rlm_sql_fetch_row(&row, inst, request, handle) == RLM_SQL_OK) {
@@ -857,15 +862,17 @@ static unlang_action_t rlm_sql_process_groups(rlm_rcode_t *p_result,
 			/*
 			 *	Expand the group query
 			 */
-			if (xlat_aeval(request, &expanded, request, inst->config->authorize_group_check_query,
-					 inst->sql_escape_func, *handle) < 0) {
+			if (!inst->authorize_group_check_stmt &&
+			    (xlat_aeval(request, &expanded, request, inst->config->authorize_group_check_query,
+					inst->sql_escape_func, *handle) < 0)) {
 				REDEBUG("Error generating query");
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
 
 			fr_cursor_init(&cursor, &check_tmp);
-			rows = sql_getvpdata(request, inst, request, handle, &cursor, expanded);
+			rows = sql_getvpdata(request, inst, request, handle, &cursor,
+					     inst->authorize_group_check_stmt, expanded);
 			TALLOC_FREE(expanded);
 			if (rows < 0) {
 				REDEBUG("Error retrieving check pairs for group %s", entry->name);
@@ -912,15 +919,17 @@ static unlang_action_t rlm_sql_process_groups(rlm_rcode_t *p_result,
 			/*
 			 *	Now get the reply pairs since the paircmp matched
 			 */
-			if (xlat_aeval(request, &expanded, request, inst->config->authorize_group_reply_query,
-					 inst->sql_escape_func, *handle) < 0) {
+			if (!inst->authorize_group_reply_stmt &&
+			    (xlat_aeval(request, &expanded, request, inst->config->authorize_group_reply_query,
+					inst->sql_escape_func, *handle) < 0)) {
 				REDEBUG("Error generating query");
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
 
 			fr_cursor_init(&cursor, &reply_tmp);
-			rows = sql_getvpdata(request->reply, inst, request, handle, &cursor, expanded);
+			rows = sql_getvpdata(request->reply, inst, request, handle, &cursor,
+					     inst->authorize_group_reply_stmt, expanded);
 			TALLOC_FREE(expanded);
 			if (rows < 0) {
 				REDEBUG("Error retrieving reply pairs for group %s", entry->name);
@@ -1093,6 +1102,50 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 }
 
 
+/** Tokenise all the queries in an accounting or post-auth section
+ *
+ * The prepared statements are attached to the CONF_PAIR of the query
+ * template, where acct_redundant() can find them.
+ */
+static void sql_prepare_section(rlm_sql_t *inst, CONF_SECTION *cs)
+{
+	CONF_ITEM	*ci = NULL;
+
+	while ((ci = cf_item_next(cs, ci))) {
+		CONF_PAIR	*cp;
+		char const	*attr;
+		sql_prepared_t	*stmt;
+
+		if (cf_item_is_section(ci)) {
+			sql_prepare_section(inst, cf_item_to_section(ci));
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		cp = cf_item_to_pair(ci);
+		attr = cf_pair_attr(cp);
+		if ((strcmp(attr, "reference") == 0) || (strcmp(attr, "logfile") == 0)) continue;
+
+		stmt = sql_prepare(inst, inst, ci, cf_pair_value(cp));
+		if (stmt) cf_data_add(cp, stmt, inst->name, false);
+	}
+}
+
+/** Tokenise one of the top level queries
+ *
+ */
+static sql_prepared_t *sql_prepare_query(rlm_sql_t *inst, CONF_SECTION *cs, char const *name, char const *query)
+{
+	CONF_PAIR	*cp;
+
+	if (!query) return NULL;
+
+	cp = cf_pair_find(cs, name);
+
+	return sql_prepare(inst, inst, cp ? cf_pair_to_item(cp) : cf_section_to_item(cs), query);
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_sql_t *inst = instance;
@@ -1140,6 +1193,31 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->config->postauth.cs = cf_section_find(conf, "post-auth", NULL);
 	inst->config->postauth.reference_cp = (cf_pair_find(inst->config->postauth.cs, "reference") != NULL);
 
+	/*
+	 *	Tokenise the queries into prepared statements, if
+	 *	the driver supports them.
+	 */
+	if (inst->config->prepared_statements) {
+		if (!inst->driver->sql_prepared_query || !inst->driver->sql_prepared_select_query) {
+			WARN("Driver %s does not support prepared statements, ignoring prepared_statements",
+			     inst->driver->name);
+		} else {
+			inst->authorize_check_stmt = sql_prepare_query(inst, conf, "authorize_check_query",
+								       inst->config->authorize_check_query);
+			inst->authorize_reply_stmt = sql_prepare_query(inst, conf, "authorize_reply_query",
+								       inst->config->authorize_reply_query);
+			inst->authorize_group_check_stmt = sql_prepare_query(inst, conf, "authorize_group_check_query",
+									     inst->config->authorize_group_check_query);
+			inst->authorize_group_reply_stmt = sql_prepare_query(inst, conf, "authorize_group_reply_query",
+									     inst->config->authorize_group_reply_query);
+			inst->groupmemb_stmt = sql_prepare_query(inst, conf, "group_membership_query",
+								 inst->config->groupmemb_query);
+
+			if (inst->config->accounting.cs) sql_prepare_section(inst, inst->config->accounting.cs);
+			if (inst->config->postauth.cs) sql_prepare_section(inst, inst->config->postauth.cs);
+		}
+	}
+
 	/*
 	 *	Cache the SQL-User-Name fr_dict_attr_t, so we can be slightly
 	 *	more efficient about creating SQL-User-Name attributes.
@@ -1232,8 +1310,9 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 		fr_cursor_t	cursor;
 		fr_pair_t	*vp;
 
-		if (xlat_aeval(request, &expanded, request, inst->config->authorize_check_query,
-				 inst->sql_escape_func, handle) < 0) {
+		if (!inst->authorize_check_stmt &&
+		    (xlat_aeval(request, &expanded, request, inst->config->authorize_check_query,
+				inst->sql_escape_func, handle) < 0)) {
 			REDEBUG("Failed generating query");
 			rcode = RLM_MODULE_FAIL;
 
@@ -1248,7 +1327,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 		}
 
 		fr_cursor_init(&cursor, &check_tmp);
-		rows = sql_getvpdata(request, inst, request, &handle, &cursor, expanded);
+		rows = sql_getvpdata(request, inst, request, &handle, &cursor, inst->authorize_check_stmt, expanded);
 		TALLOC_FREE(expanded);
 		if (rows < 0) {
 			REDEBUG("Failed getting check attributes");
@@ -1290,15 +1369,17 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 		/*
 		 *	Now get the reply pairs since the paircmp matched
 		 */
-		if (xlat_aeval(request, &expanded, request, inst->config->authorize_reply_query,
-				 inst->sql_escape_func, handle) < 0) {
+		if (!inst->authorize_reply_stmt &&
+		    (xlat_aeval(request, &expanded, request, inst->config->authorize_reply_query,
+				inst->sql_escape_func, handle) < 0)) {
 			REDEBUG("Error generating query");
 			rcode = RLM_MODULE_FAIL;
 			goto error;
 		}
 
 		fr_cursor_init(&cursor, &reply_tmp);
-		rows = sql_getvpdata(request->reply, inst, request, &handle, &cursor, expanded);
+		rows = sql_getvpdata(request->reply, inst, request, &handle, &cursor,
+				     inst->authorize_reply_stmt, expanded);
 		TALLOC_FREE(expanded);
 		if (rows < 0) {
 			REDEBUG("SQL query error getting reply attributes");
@@ -1449,6 +1530,8 @@ static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *in
 	CONF_PAIR 		*pair;
 	char const		*attr = NULL;
 	char const		*value;
+	sql_prepared_t const	*stmt;
+	bool			log_queries;
 
 	char			path[FR_MAX_STRING_LEN];
 	char			*p = path;
@@ -1496,6 +1579,12 @@ static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *in
 
 	sql_set_user(inst, request, NULL);
 
+	/*
+	 *	The query log needs the expanded text of the query,
+	 *	so prepared statements can't be used with it.
+	 */
+	log_queries = ((inst->config->logfile && *inst->config->logfile) || (section->logfile && *section->logfile));
+
 	while (true) {
 		value = cf_pair_value(pair);
 		if (!value) {
@@ -1505,23 +1594,28 @@ static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *in
 			goto finish;
 		}
 
-		if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
-			rcode = RLM_MODULE_FAIL;
+		stmt = log_queries ? NULL : cf_data_value(cf_data_find(pair, sql_prepared_t, inst->name));
+		if (stmt) {
+			sql_ret = rlm_sql_prepared_query(inst, request, &handle, stmt);
+		} else {
+			if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
+				rcode = RLM_MODULE_FAIL;
 
-			goto finish;
-		}
+				goto finish;
+			}
 
-		if (!*expanded) {
-			RDEBUG2("Ignoring null query");
-			rcode = RLM_MODULE_NOOP;
+			if (!*expanded) {
+				RDEBUG2("Ignoring null query");
+				rcode = RLM_MODULE_NOOP;
 
-			goto finish;
-		}
+				goto finish;
+			}
 
-		rlm_sql_query_log(inst, request, section, expanded);
+			rlm_sql_query_log(inst, request, section, expanded);
 
-		sql_ret = rlm_sql_query(inst, request, &handle, expanded);
-		TALLOC_FREE(expanded);
+			sql_ret = rlm_sql_query(inst, request, &handle, expanded);
+			TALLOC_FREE(expanded);
+		}
 		RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, sql_ret, "<INVALID>"));
 
 		switch (sql_ret) {
@@ -85,6 +85,22 @@ typedef struct {
 	char const		**query;			/* for xlat parsing */
 } sql_acct_section_t;
 
+/** A query template, tokenised so it can be prepared by the driver
+ *
+ * Expansions which form an entire quoted string literal in the query
+ * template are replaced by placeholders, and expanded separately for
+ * each request.  The expanded values are passed to the driver as bound
+ * parameters, so they don't need escaping.
+ */
+typedef struct {
+	uint32_t		id;				//!< Unique within the rlm_sql instance.  Drivers use
+								///< this to find the statement on a connection.
+	char const		*name;				//!< Statement name, for drivers which require one.
+	char const		*query;				//!< Query with placeholders substituted for expansions.
+	xlat_exp_t		**params;			//!< Expansions producing the parameter values.
+	uint32_t		num_params;			//!< Number of parameters.
+} sql_prepared_t;
+
 typedef struct {
 	char const 		*sql_driver_name;		//!< SQL driver module name e.g. rlm_sql_sqlite.
 	char const 		*sql_server;			//!< Server to connect to.
@@ -125,6 +141,9 @@ typedef struct {
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
 
+	bool			prepared_statements;		//!< Prepare queries once per connection, and send
+								//!< expansions as bound parameters.
+
 	void			*driver;			//!< Where drivers should write a
 								//!< pointer to their configurations.
 
@@ -160,6 +179,8 @@ extern size_t sql_rcode_table_len;
  */
 #define RLM_SQL_RCODE_FLAGS_ALT_QUERY	1			//!< Can distinguish between other errors and those
 								//!< resulting from a unique key violation.
+#define RLM_SQL_FLAGS_NUMBERED_PARAMS	2			//!< Prepared statement placeholders are $1, $2...
+								//!< instead of ?.
 
 /** Retrieve errors from the last query operation
  *
@@ -197,6 +218,16 @@ typedef struct {
 	sql_rcode_t (*sql_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query);
 	sql_rcode_t (*sql_store_result)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
+	/*
+	 *	Optional.  Prepare stmt on the connection if it hasn't been
+	 *	already, and execute it with the parameter values provided.
+	 *	Results are retrieved and freed with the normal callbacks.
+	 */
+	sql_rcode_t (*sql_prepared_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					  sql_prepared_t const *stmt, char const * const values[]);
+	sql_rcode_t (*sql_prepared_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+						 sql_prepared_t const *stmt, char const * const values[]);
+
 	int (*sql_num_fields)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 	int (*sql_num_rows)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 	int (*sql_affected_rows)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
@@ -234,6 +265,19 @@ struct sql_inst {
 
 	char const		*name;			//!< Module instance name.
 	fr_dict_attr_t const	*group_da;		//!< Group dictionary attribute.
+
+	uint32_t		num_prepared;		//!< Number of statements tokenised by sql_prepare().
+
+	/*
+	 *	Prepared forms of the authorize queries.  NULL if
+	 *	prepared statements are disabled, or the query can't
+	 *	be prepared.
+	 */
+	sql_prepared_t		*authorize_check_stmt;
+	sql_prepared_t		*authorize_reply_stmt;
+	sql_prepared_t		*authorize_group_check_stmt;
+	sql_prepared_t		*authorize_group_reply_stmt;
+	sql_prepared_t		*groupmemb_stmt;
 };
 
 typedef struct rlm_sql_grouplist_s rlm_sql_grouplist_t;
@@ -245,15 +289,22 @@ struct rlm_sql_grouplist_s {
 void		*sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
 int		sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, request_t *request, fr_cursor_t *cursor, rlm_sql_row_t row);
 int		sql_read_realms(rlm_sql_handle_t *handle);
-int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, fr_cursor_t *cursor, char const *query);
+int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, fr_cursor_t *cursor, sql_prepared_t const *stmt, char const *query);
 int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, request_t *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_prepared_select_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, sql_prepared_t const *stmt) CC_HINT(nonnull);
+sql_rcode_t	rlm_sql_prepared_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, sql_prepared_t const *stmt) CC_HINT(nonnull);
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, request_t *request, char const *username);
 
+/*
+ *	sql_prepare.c
+ */
+sql_prepared_t	*sql_prepare(TALLOC_CTX *ctx, rlm_sql_t *inst, CONF_ITEM *ci, char const *query);
+
 /*
  *	sql_state.c
  */
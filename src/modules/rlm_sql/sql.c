@@ -317,36 +317,37 @@ void rlm_sql_print_error(rlm_sql_t const *inst, request_t *request, rlm_sql_hand
 	talloc_free_children(handle->log_ctx);
 }
 
-/** Call the driver's sql_query method, reconnecting if necessary.
+/** Calls one of the driver's query methods with a handle
  *
- * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
- *	after they're done with the result.
+ */
+typedef sql_rcode_t (*sql_driver_call_t)(rlm_sql_t const *inst, request_t *request,
+					 rlm_sql_handle_t *handle, void const *uctx);
+
+/** Call a driver query method, reconnecting if necessary
+ *
+ * This is the retry loop shared by #rlm_sql_query, #rlm_sql_select_query and
+ * their prepared statement equivalents.  On error, the result is finished with
+ * sql_finish_select_query if is_select is true, and sql_finish_query if it isn't.
  *
- * @param handle to query the database with. *handle should not be NULL, as this indicates
- * 	previous reconnection attempt has failed.
- * @param request Current request.
  * @param inst #rlm_sql_t instance data.
- * @param query to execute. Should not be zero length.
+ * @param request Current request.  May be NULL.
+ * @param handle to query the database with. *handle should not be NULL.
+ * @param is_select Whether the query returns rows.  Only queries which don't can
+ *	  return #RLM_SQL_ALT_QUERY.
+ * @param call to make with each handle.
+ * @param uctx passed to call.
  * @return
  *	- #RLM_SQL_OK on success.
  *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
  *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
  *	- #RLM_SQL_ALT_QUERY on constraints violation.
  */
-sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query)
+static sql_rcode_t sql_query_retry(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle,
+				   bool is_select, sql_driver_call_t call, void const *uctx)
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
 
-	/* Caller should check they have a valid handle */
-	fr_assert(*handle);
-
-	/* There's no query to run, return an error */
-	if (query[0] == '\0') {
-		if (request) REDEBUG("Zero length query");
-		return RLM_SQL_QUERY_INVALID;
-	}
-
 	/*
 	 *  inst->pool may be NULL is this function is called by sql_mod_conn_create.
 	 */
@@ -357,9 +358,7 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_han
 	 *  a new connection, then give up.
 	 */
 	for (i = 0; i < (count + 1); i++) {
-		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query);
-
-		ret = (inst->driver->sql_query)(*handle, inst->config, query);
+		ret = call(inst, request, *handle, uctx);
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -375,17 +374,32 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_han
 			/* Reconnection succeeded, try again with the new handle */
 			continue;
 
+		/*
+		 *	Anything else is only an error for select queries.
+		 */
+		default:
+			if (!is_select) break;
+			FALL_THROUGH;
+
 		/*
 		 *	These are bad and should make rlm_sql return invalid
 		 */
 		case RLM_SQL_QUERY_INVALID:
+		error:
 			rlm_sql_print_error(inst, request, *handle, false);
-			(inst->driver->sql_finish_query)(*handle, inst->config);
+			if (is_select) {
+				(inst->driver->sql_finish_select_query)(*handle, inst->config);
+			} else {
+				(inst->driver->sql_finish_query)(*handle, inst->config);
+			}
 			break;
 
 		/*
 		 *	Server or client errors.
 		 *
+		 *	Select queries can't use an alternative query, so
+		 *	these are always failures for them.
+		 *
 		 *	If the driver claims to be able to distinguish between
 		 *	duplicate row errors and other errors, and we hit a
 		 *	general error treat it as a failure.
@@ -393,11 +407,7 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_han
 		 *	Otherwise rewrite it to RLM_SQL_ALT_QUERY.
 		 */
 		case RLM_SQL_ERROR:
-			if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
-				rlm_sql_print_error(inst, request, *handle, false);
-				(inst->driver->sql_finish_query)(*handle, inst->config);
-				break;
-			}
+			if (is_select || (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY)) goto error;
 			ret = RLM_SQL_ALT_QUERY;
 			FALL_THROUGH;
 
@@ -405,10 +415,11 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_han
 		 *	Driver suggested using an alternative query
 		 */
 		case RLM_SQL_ALT_QUERY:
+			if (is_select) goto error;
+
 			rlm_sql_print_error(inst, request, *handle, true);
 			(inst->driver->sql_finish_query)(*handle, inst->config);
 			break;
-
 		}
 
 		return ret;
@@ -419,6 +430,56 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_han
 	return RLM_SQL_ERROR;
 }
 
+static sql_rcode_t sql_query_call(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle,
+				  void const *uctx)
+{
+	char const *query = uctx;
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query);
+
+	return (inst->driver->sql_query)(handle, inst->config, query);
+}
+
+/** Call the driver's sql_query method, reconnecting if necessary.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ * 	previous reconnection attempt has failed.
+ * @param request Current request.
+ * @param inst #rlm_sql_t instance data.
+ * @param query to execute. Should not be zero length.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query)
+{
+	/* Caller should check they have a valid handle */
+	fr_assert(*handle);
+
+	/* There's no query to run, return an error */
+	if (query[0] == '\0') {
+		if (request) REDEBUG("Zero length query");
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	return sql_query_retry(inst, request, handle, false, sql_query_call, query);
+}
+
+static sql_rcode_t sql_select_query_call(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle,
+					 void const *uctx)
+{
+	char const *query = uctx;
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Executing select query: %s", query);
+
+	return (inst->driver->sql_select_query)(handle, inst->config, query);
+}
+
 /** Call the driver's sql_select_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_select_query)(handle, inst->config);``
@@ -436,9 +497,6 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_han
  */
 sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query)
 {
-	int ret = RLM_SQL_ERROR;
-	int i, count;
-
 	/* Caller should check they have a valid handle */
 	fr_assert(*handle);
 
@@ -449,47 +507,144 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, request_t *request, rlm_
 		return RLM_SQL_QUERY_INVALID;
 	}
 
-	/*
-	 *  inst->pool may be NULL is this function is called by sql_mod_conn_create.
-	 */
-	count = inst->pool ? fr_pool_state(inst->pool)->num : 0;
+	return sql_query_retry(inst, request, handle, true, sql_select_query_call, query);
+}
 
-	/*
-	 *  For sanity, for when no connections are viable, and we can't make a new one
-	 */
-	for (i = 0; i < (count + 1); i++) {
-		ROPTIONAL(RDEBUG2, DEBUG2, "Executing select query: %s", query);
 
-		ret = (inst->driver->sql_select_query)(*handle, inst->config, query);
-		switch (ret) {
-		case RLM_SQL_OK:
-			break;
+/** Expand the parameters of a prepared statement
+ *
+ * @param[in] ctx	to allocate the values in.
+ * @param[out] out	Where to write the array of values.
+ * @param[in] request	to expand the parameters for.
+ * @param[in] stmt	the parameters belong to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sql_prepared_values(TALLOC_CTX *ctx, char ***out, request_t *request, sql_prepared_t const *stmt)
+{
+	char		**values;
+	uint32_t	i;
 
+	MEM(values = talloc_zero_array(ctx, char *, stmt->num_params + 1));
+
+	RDEBUG2("Executing prepared statement %s: %s", stmt->name, stmt->query);
+	RINDENT();
+	for (i = 0; i < stmt->num_params; i++) {
 		/*
-		 *	Run through all available sockets until we exhaust all existing
-		 *	sockets in the pool and fail to establish a *new* connection.
+		 *	No escaping, the values are never
+		 *	interpreted as SQL.
 		 */
-		case RLM_SQL_RECONNECT:
-			*handle = fr_pool_connection_reconnect(inst->pool, request, *handle);
-			/* Reconnection failed */
-			if (!*handle) return RLM_SQL_RECONNECT;
-			/* Reconnection succeeded, try again with the new handle */
-			continue;
-
-		case RLM_SQL_QUERY_INVALID:
-		case RLM_SQL_ERROR:
-		default:
-			rlm_sql_print_error(inst, request, *handle, false);
-			(inst->driver->sql_finish_select_query)(*handle, inst->config);
-			break;
+		if (xlat_aeval_compiled(values, &values[i], request, stmt->params[i], NULL, NULL) < 0) {
+			REXDENT();
+			RPEDEBUG("Failed expanding parameter %u", i + 1);
+			talloc_free(values);
+			return -1;
 		}
-
-		return ret;
+		RDEBUG2("%u: '%s'", i + 1, values[i]);
 	}
+	REXDENT();
 
-	ROPTIONAL(RERROR, ERROR, "Hit reconnection limit");
+	*out = values;
 
-	return RLM_SQL_ERROR;
+	return 0;
+}
+
+/** A prepared statement, and the values of its parameters for this request
+ *
+ */
+typedef struct {
+	sql_prepared_t const	*stmt;
+	char const * const	*values;
+} sql_prepared_call_t;
+
+static sql_rcode_t sql_prepared_query_call(rlm_sql_t const *inst, UNUSED request_t *request,
+					   rlm_sql_handle_t *handle, void const *uctx)
+{
+	sql_prepared_call_t const *prepared = uctx;
+
+	return (inst->driver->sql_prepared_query)(handle, inst->config, prepared->stmt, prepared->values);
+}
+
+/** Execute a prepared statement, reconnecting if necessary
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param stmt to execute, with parameters expanded for this request.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_prepared_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle,
+				   sql_prepared_t const *stmt)
+{
+	sql_rcode_t		ret;
+	char			**values;
+	sql_prepared_call_t	prepared;
+
+	fr_assert(*handle);
+
+	if (sql_prepared_values(request, &values, request, stmt) < 0) return RLM_SQL_QUERY_INVALID;
+
+	prepared = (sql_prepared_call_t) {
+		.stmt = stmt,
+		.values = (char const * const *)values
+	};
+	ret = sql_query_retry(inst, request, handle, false, sql_prepared_query_call, &prepared);
+	talloc_free(values);
+
+	return ret;
+}
+
+static sql_rcode_t sql_prepared_select_query_call(rlm_sql_t const *inst, UNUSED request_t *request,
+						  rlm_sql_handle_t *handle, void const *uctx)
+{
+	sql_prepared_call_t const *prepared = uctx;
+
+	return (inst->driver->sql_prepared_select_query)(handle, inst->config, prepared->stmt, prepared->values);
+}
+
+/** Execute a prepared select statement, reconnecting if necessary
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_select_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param stmt to execute, with parameters expanded for this request.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ */
+sql_rcode_t rlm_sql_prepared_select_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle,
+					  sql_prepared_t const *stmt)
+{
+	sql_rcode_t		ret;
+	char			**values;
+	sql_prepared_call_t	prepared;
+
+	fr_assert(*handle);
+
+	if (sql_prepared_values(request, &values, request, stmt) < 0) return RLM_SQL_QUERY_INVALID;
+
+	prepared = (sql_prepared_call_t) {
+		.stmt = stmt,
+		.values = (char const * const *)values
+	};
+	ret = sql_query_retry(inst, request, handle, true, sql_prepared_select_query_call, &prepared);
+	talloc_free(values);
+
+	return ret;
 }
 
 
@@ -497,11 +652,12 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, request_t *request, rlm_
  *
  *	Function: sql_getvpdata
  *
- *	Purpose: Get any group check or reply pairs
+ *	Purpose: Get any group check or reply pairs, using the prepared
+ *	statement if there is one, or the expanded query if not.
  *
  *************************************************************************/
 int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle,
-		  fr_cursor_t *cursor, char const *query)
+		  fr_cursor_t *cursor, sql_prepared_t const *stmt, char const *query)
 {
 	rlm_sql_row_t	row;
 	int		rows = 0;
@@ -509,7 +665,11 @@ int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, rl
 
 	fr_assert(request);
 
-	rcode = rlm_sql_select_query(inst, request, handle, query);
+	if (stmt) {
+		rcode = rlm_sql_prepared_select_query(inst, request, handle, stmt);
+	} else {
+		rcode = rlm_sql_select_query(inst, request, handle, query);
+	}
 	if (rcode != RLM_SQL_OK) return -1; /* error handled by rlm_sql_select_query */
 
 	while (rlm_sql_fetch_row(&row, inst, request, handle) == RLM_SQL_OK) {
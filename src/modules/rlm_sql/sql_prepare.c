@@ -0,0 +1,224 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sql_prepare.c
+ * @brief Converts query templates into prepared statements
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+
+#include <ctype.h>
+
+#include "rlm_sql.h"
+
+/** Return the length of the expansion at the start of p
+ *
+ * @param[in] p		pointing to a '%'.
+ * @return
+ *	- Length of the expansion, including the '%'.
+ *	- 0 if this isn't an expansion we can bind as a parameter.
+ */
+static size_t sql_expansion_len(char const *p)
+{
+	char const	*q;
+	int		depth = 0;
+
+	fr_assert(*p == '%');
+
+	/*
+	 *	%[a-z] - A one letter expansion
+	 */
+	if (isalpha((uint8_t) p[1])) return 2;
+
+	if (p[1] != '{') return 0;
+
+	for (q = p + 1; *q; q++) {
+		switch (*q) {
+		case '{':
+			depth++;
+			break;
+
+		case '}':
+			if (--depth == 0) return (q - p) + 1;
+			break;
+
+		/*
+		 *	Escaped braces would throw the count off.
+		 */
+		case '\\':
+			return 0;
+
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/** Tokenise a query template into a prepared statement
+ *
+ * Every expansion in the template must be the entire contents of a
+ * single quoted string literal, i.e. `'%{User-Name}'`.  The literal,
+ * quotes included, is replaced with a placeholder, and the expansion is
+ * compiled so it can be evaluated separately for each request.
+ *
+ * Templates with expansions anywhere else (unquoted, within identifiers,
+ * or forming part of a larger literal) can't be expressed as a prepared
+ * statement, and are left for the caller to expand and escape as before.
+ *
+ * @param[in] ctx	to allocate the statement in.
+ * @param[in] inst	rlm_sql instance the statement belongs to.
+ * @param[in] ci	the query template was read from.  Used to find the
+ *			dictionary for the expansions, and for error messages.
+ * @param[in] query	template to tokenise.
+ * @return
+ *	- A new prepared statement.
+ *	- NULL if the query can't be prepared, or the driver doesn't support
+ *	  prepared statements.
+ */
+sql_prepared_t *sql_prepare(TALLOC_CTX *ctx, rlm_sql_t *inst, CONF_ITEM *ci, char const *query)
+{
+	sql_prepared_t		*stmt;
+	fr_dict_t const		*dict;
+	char const		*p = query, *quote_start = NULL;
+	char			*out;
+	char			quote = '\0';
+	bool			numbered = (inst->driver->flags & RLM_SQL_FLAGS_NUMBERED_PARAMS);
+
+	if (!inst->config->prepared_statements ||
+	    !inst->driver->sql_prepared_query || !inst->driver->sql_prepared_select_query) return NULL;
+
+	if (!query || !*query) return NULL;
+
+	dict = virtual_server_namespace_by_ci(ci);
+
+	MEM(stmt = talloc_zero(ctx, sql_prepared_t));
+	MEM(out = talloc_strdup(stmt, ""));
+
+	while (*p) {
+		size_t		len;
+		xlat_exp_t	*head = NULL;
+		ssize_t		slen;
+
+		switch (*p) {
+		/*
+		 *	We can't tell whether a backslash escapes the
+		 *	SQL or the expansion, so don't try.
+		 */
+		case '\\':
+		not_preparable:
+			cf_log_debug(ci, "Query can't be prepared, using text query: %s", query);
+			talloc_free(stmt);
+			return NULL;
+
+		case '\'':
+		case '"':
+		case '`':
+			if (!quote) {
+				/*
+				 *	Prefixed literals like E'...' or X'...'
+				 *	change how the contents are interpreted.
+				 */
+				if ((*p == '\'') && (p > query) && isalnum((uint8_t) p[-1])) goto not_preparable;
+
+				quote = *p;
+				quote_start = p;
+				break;
+			}
+
+			if (*p != quote) break;
+
+			/*
+			 *	Doubled quote within a literal
+			 */
+			if (p[1] == quote) {
+				MEM(out = talloc_strndup_append_buffer(out, p, 2));
+				p += 2;
+				continue;
+			}
+			quote = '\0';
+			break;
+
+		case '%':
+			len = sql_expansion_len(p);
+			if (!len) goto not_preparable;
+
+			/*
+			 *	The expansion must be the whole string literal.
+			 */
+			if ((quote != '\'') || (quote_start != (p - 1)) ||
+			    (p[len] != '\'') || (p[len + 1] == '\'')) goto not_preparable;
+
+			slen = xlat_tokenize(stmt, &head, NULL, &FR_SBUFF_IN(p, len), NULL,
+					     &(tmpl_rules_t){
+						.dict_def = dict,
+						.allow_unknown = false,
+						.allow_unresolved = false,
+						.allow_foreign = (dict == NULL)
+					     });
+			if (slen <= 0) {
+				cf_log_perr(ci, "Failed parsing query parameter %u", stmt->num_params + 1);
+				talloc_free(stmt);
+				return NULL;
+			}
+
+			MEM(stmt->params = talloc_realloc(stmt, stmt->params, xlat_exp_t *, stmt->num_params + 1));
+			stmt->params[stmt->num_params++] = head;
+
+			/*
+			 *	Replace the opening quote we already
+			 *	copied with the placeholder.
+			 */
+			out[talloc_array_length(out) - 2] = '\0';
+			MEM(out = talloc_realloc(stmt, out, char, talloc_array_length(out) - 1));
+			if (numbered) {
+				MEM(out = talloc_asprintf_append_buffer(out, "$%u", stmt->num_params));
+			} else {
+				MEM(out = talloc_strdup_append_buffer(out, "?"));
+			}
+
+			p += len + 1;		/* Skip the closing quote */
+			quote = '\0';
+			continue;
+
+		default:
+			break;
+		}
+
+		MEM(out = talloc_strndup_append_buffer(out, p, 1));
+		p++;
+	}
+
+	if (quote) goto not_preparable;
+
+	stmt->id = inst->num_prepared++;
+	stmt->query = out;
+	MEM(stmt->name = talloc_typed_asprintf(stmt, "fr_%u", stmt->id));
+
+	cf_log_debug(ci, "Prepared statement %s with %u parameter(s): %s", stmt->name, stmt->num_params, stmt->query);
+
+	return stmt;
+}
@@ -30,6 +30,8 @@ RCSID("$Id$")
 
 #include <rlm_sql.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 
 #include <ctype.h>
 
@@ -59,6 +61,13 @@ typedef struct {
 	char const	*alloc_update;		//!< SQL query to mark an IP as used.
 	char const	*alloc_commit;		//!< SQL query to commit.
 
+						/* Prefetch sequence */
+	uint32_t	prefetch;		//!< How many free IPs to reserve at once.  0 disables
+						///< prefetching.
+	fr_time_delta_t	prefetch_lifetime;	//!< How long a reserved IP may be handed out for.
+	char const	*alloc_prefetch;	//!< SQL query to reserve a batch of free IPs.
+	char const	*alloc_claim;		//!< SQL query to allocate a reserved IP.
+
 	char const	*pool_check;		//!< Query to check for the existence of the pool.
 
 						/* Update sequence */
@@ -94,6 +103,37 @@ typedef struct {
 
 } rlm_sqlippool_t;
 
+/** A free IP reserved by this thread
+ *
+ */
+typedef struct {
+	char		*address;		//!< As returned by alloc_prefetch.
+	fr_time_t	expires;		//!< When the reservation lapses.
+	fr_dlist_t	entry;			//!< Entry in the pool's queue.
+} sqlippool_reserved_t;
+
+/** Queue of reserved IPs for a single pool
+ *
+ */
+typedef struct {
+	char		*name;			//!< Value of Pool-Name.
+	fr_dlist_head_t	reserved;		//!< Reserved IPs, oldest first.
+} sqlippool_queue_t;
+
+typedef struct {
+	rlm_sqlippool_t const *inst;		//!< Instance of rlm_sqlippool.
+
+	fr_hash_table_t	*queues;		//!< Queues of reserved IPs, indexed by pool name.
+						///< NULL if prefetching is disabled.
+
+	uint64_t	queries;		//!< Queries sent to the database.
+	uint64_t	alloc;			//!< Allocations attempted.
+	uint64_t	alloc_queries;		//!< Queries sent to the database by allocations.
+	uint64_t	prefetch_hit;		//!< Allocations satisfied from a queue.
+	uint64_t	prefetch_lost;		//!< Reserved IPs which lapsed, or were taken by
+						///< another server.
+} rlm_sqlippool_thread_t;
+
 static CONF_PARSER message_config[] = {
 	{ FR_CONF_OFFSET("exists", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, log_exists) },
 	{ FR_CONF_OFFSET("success", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, log_success) },
@@ -130,6 +170,15 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("alloc_commit", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, alloc_commit), .dflt = "COMMIT" },
 
 
+	{ FR_CONF_OFFSET("prefetch", FR_TYPE_UINT32, rlm_sqlippool_t, prefetch), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("prefetch_lifetime", FR_TYPE_TIME_DELTA, rlm_sqlippool_t, prefetch_lifetime), .dflt = "10" },
+
+	{ FR_CONF_OFFSET("alloc_prefetch", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, alloc_prefetch) },
+
+	{ FR_CONF_OFFSET("alloc_claim", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, alloc_claim) },
+
+
 	{ FR_CONF_OFFSET("pool_check", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, pool_check) },
 
 
@@ -273,6 +322,7 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
  * @param fmt sql query to expand.
  * @param handle sql connection handle.
  * @param data Instance of rlm_sqlippool.
+ * @param t Thread specific data, used to count queries.  May be NULL.
  * @param request Current request.
  * @param param ip address string.
  * @param param_len ip address string len.
@@ -281,7 +331,7 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
  *	- < 0 on error.
  */
 static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
-			     rlm_sqlippool_t const *data, request_t *request,
+			     rlm_sqlippool_t const *data, rlm_sqlippool_thread_t *t, request_t *request,
 			     char *param, int param_len)
 {
 	char query[MAX_QUERY_LEN];
@@ -307,6 +357,7 @@ static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
 
 	if (xlat_aeval(request, &expanded, request, query, data->sql_inst->sql_escape_func, *handle) < 0) return -1;
 
+	if (t) t->queries++;
 	ret = data->sql_inst->sql_query(data->sql_inst, request, handle, expanded);
 	if (ret < 0){
 		talloc_free(expanded);
@@ -330,15 +381,16 @@ static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
  *	Don't repeat yourself
  */
 #undef DO
-#define DO(_x) if(sqlippool_command(inst->_x, handle, inst, request, NULL, 0) < 0) return RLM_MODULE_FAIL
-#define DO_PART(_x) if(sqlippool_command(inst->_x, &handle, inst, request, NULL, 0) <0) goto error
+#define DO(_x) if(sqlippool_command(inst->_x, handle, inst, t, request, NULL, 0) < 0) return RLM_MODULE_FAIL
+#define DO_PART(_x) if(sqlippool_command(inst->_x, &handle, inst, t, request, NULL, 0) <0) goto error
 
 /*
  * Query the database expecting a single result row
  */
-static int CC_HINT(nonnull (1, 3, 4, 5)) sqlippool_query1(char *out, int outlen, char const *fmt,
+static int CC_HINT(nonnull (1, 3, 4, 5, 7)) sqlippool_query1(char *out, int outlen, char const *fmt,
 							  rlm_sql_handle_t **handle, rlm_sqlippool_t *data,
-							  request_t *request, char *param, int param_len)
+							  rlm_sqlippool_thread_t *t, request_t *request,
+							  char *param, int param_len)
 {
 	char query[MAX_QUERY_LEN];
 	char *expanded = NULL;
@@ -360,6 +412,7 @@ static int CC_HINT(nonnull (1, 3, 4, 5)) sqlippool_query1(char *out, int outlen,
 	if (xlat_aeval(request, &expanded, request, query, data->sql_inst->sql_escape_func, *handle) < 0) {
 		return 0;
 	}
+	if (t) t->queries++;
 	retval = data->sql_inst->sql_select_query(data->sql_inst, request, handle, expanded);
 	talloc_free(expanded);
 
@@ -398,6 +451,160 @@ finish:
 	return retval;
 }
 
+/** Hash a queue of reserved IPs by pool name
+ *
+ */
+static uint32_t sqlippool_queue_hash(void const *data)
+{
+	sqlippool_queue_t const *q = data;
+
+	return fr_hash_string(q->name);
+}
+
+/** Compare two queues of reserved IPs by pool name
+ *
+ */
+static int sqlippool_queue_cmp(void const *one, void const *two)
+{
+	sqlippool_queue_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Reserve a batch of free IPs, and add them to the pool's queue
+ *
+ * alloc_prefetch must mark the IPs it returns as in use (for at least
+ * prefetch_lifetime), so they're not handed out by other threads or servers.
+ *
+ * @return
+ *	- The number of IPs reserved.
+ *	- < 0 on error.
+ */
+static int sqlippool_prefetch(rlm_sqlippool_thread_t *t, sqlippool_queue_t *q,
+			      rlm_sql_handle_t **handle, request_t *request)
+{
+	rlm_sqlippool_t const	*inst = t->inst;
+	char			query[MAX_QUERY_LEN];
+	char			*expanded = NULL;
+	rlm_sql_row_t		row;
+	fr_time_t		expires = fr_time() + inst->prefetch_lifetime;
+	int			ret, count = 0;
+
+	sqlippool_expand(query, sizeof(query), inst->alloc_prefetch, inst, NULL, 0);
+
+	if (xlat_aeval(request, &expanded, request, query, inst->sql_inst->sql_escape_func, *handle) < 0) return -1;
+
+	t->queries++;
+	ret = inst->sql_inst->sql_select_query(inst->sql_inst, request, handle, expanded);
+	talloc_free(expanded);
+
+	if ((ret != 0) || !*handle) {
+		REDEBUG("database query error on '%s'", query);
+		return -1;
+	}
+
+	while ((inst->sql_inst->sql_fetch_row(&row, inst->sql_inst, request, handle) == 0) && row) {
+		sqlippool_reserved_t *r;
+
+		if (!row[0]) continue;
+
+		MEM(r = talloc_zero(q, sqlippool_reserved_t));
+		MEM(r->address = talloc_typed_strdup(r, row[0]));
+		r->expires = expires;
+		fr_dlist_insert_tail(&q->reserved, r);
+		count++;
+	}
+
+	(inst->sql_inst->driver->sql_finish_select_query)(*handle, inst->sql_inst->config);
+
+	RDEBUG2("Reserved %i IP(s) from pool \"%s\"", count, q->name);
+
+	return count;
+}
+
+/** Allocate an IP previously reserved by this thread
+ *
+ * Takes IPs from the head of the pool's queue, and attempts to allocate
+ * them with alloc_claim.  If the queue is empty it's refilled (once) with
+ * alloc_prefetch.
+ *
+ * @return
+ *	- The length of the IP address written to out.
+ *	- 0 if no IPs are available.
+ *	- < 0 on error.
+ */
+static int sqlippool_prefetch_claim(char *out, size_t outlen, rlm_sqlippool_thread_t *t,
+				    rlm_sql_handle_t **handle, request_t *request, char const *pool_name)
+{
+	rlm_sqlippool_t const	*inst = t->inst;
+	sqlippool_queue_t	*q;
+	sqlippool_reserved_t	*r;
+	bool			refilled = false;
+	fr_time_t		now = fr_time();
+
+	char			*name;
+
+	memcpy(&name, &pool_name, sizeof(name));
+	q = fr_hash_table_find_by_data(t->queues, &(sqlippool_queue_t){ .name = name });
+	if (!q) {
+		MEM(q = talloc_zero(t->queues, sqlippool_queue_t));
+		MEM(q->name = talloc_typed_strdup(q, pool_name));
+		fr_dlist_talloc_init(&q->reserved, sqlippool_reserved_t, entry);
+		if (!fr_hash_table_insert(t->queues, q)) {
+			talloc_free(q);
+			return -1;
+		}
+	}
+
+	for (;;) {
+		while ((r = fr_dlist_head(&q->reserved))) {
+			int affected;
+
+			fr_dlist_remove(&q->reserved, r);
+
+			if (r->expires <= now) {
+				RDEBUG3("Reservation for %s has lapsed", r->address);
+				t->prefetch_lost++;
+				talloc_free(r);
+				continue;
+			}
+
+			affected = sqlippool_command(inst->alloc_claim, handle, inst, t, request,
+						     r->address, strlen(r->address));
+			if (affected < 0) {
+				talloc_free(r);
+				return -1;
+			}
+
+			/*
+			 *	Reservation lapsed in the database, and
+			 *	the IP was allocated by someone else.
+			 */
+			if (affected == 0) {
+				RDEBUG3("Reserved IP %s is no longer available", r->address);
+				t->prefetch_lost++;
+				talloc_free(r);
+				continue;
+			}
+
+			if (strlcpy(out, r->address, outlen) >= outlen) {
+				REDEBUG("Reserved IP %s is too long", r->address);
+				talloc_free(r);
+				return -1;
+			}
+			talloc_free(r);
+
+			t->prefetch_hit++;
+			return strlen(out);
+		}
+
+		if (refilled) return 0;
+		refilled = true;
+
+		if (sqlippool_prefetch(t, q, handle, request) < 0) return -1;
+	}
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -452,6 +659,16 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		}
 	}
 
+	if (inst->prefetch > 0) {
+		FR_INTEGER_BOUND_CHECK("prefetch", inst->prefetch, <=, 1000);
+
+		if (!inst->alloc_prefetch || !*inst->alloc_prefetch ||
+		    !inst->alloc_claim || !*inst->alloc_claim) {
+			cf_log_err(conf, "'alloc_prefetch' and 'alloc_claim' must be set when 'prefetch' is enabled");
+			return -1;
+		}
+	}
+
 	inst->sql_inst = (rlm_sql_t *) sql_inst->dl_inst->data;
 
 	if (strcmp(cf_section_name1(inst->sql_inst->cs), "sql") != 0) {
@@ -463,6 +680,49 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Allocate the queues of reserved IPs for a thread
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_sqlippool_t		*inst = talloc_get_type_abort(instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(thread, rlm_sqlippool_thread_t);
+
+	t->inst = inst;
+
+	if (!inst->prefetch) return 0;
+
+	t->queues = fr_hash_table_create(t, sqlippool_queue_hash, sqlippool_queue_cmp, NULL);
+	if (!t->queues) {
+		ERROR("Failed creating prefetch queues");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Report how many queries each allocation needed
+ *
+ * IPs still reserved by this thread are returned to the pool when their
+ * reservation lapses in the database.
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(thread, rlm_sqlippool_thread_t);
+	rlm_sqlippool_t const	*inst = t->inst;
+
+	if (!t->alloc) return 0;
+
+	DEBUG2("%" PRIu64 " allocations, %.2f queries per allocation, %" PRIu64 " queries in total",
+	       t->alloc, (double)t->alloc_queries / t->alloc, t->queries);
+	if (inst->prefetch) {
+		DEBUG2("%" PRIu64 " allocations from reserved IPs, %" PRIu64 " reservations lost",
+		       t->prefetch_hit, t->prefetch_lost);
+	}
+
+	return 0;
+}
 
 /*
  *	If we have something to log, then we log it.
@@ -490,13 +750,14 @@ static unlang_action_t do_logging(rlm_rcode_t *p_result, UNUSED rlm_sqlippool_t
 /*
  *	Allocate an IP number from the pool.
  */
-static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t CC_HINT(nonnull) sqlippool_alloc(rlm_rcode_t *p_result, rlm_sqlippool_t *inst,
+							 rlm_sqlippool_thread_t *t, request_t *request)
 {
-	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
 	char			allocation[FR_MAX_STRING_LEN];
 	int			allocation_len;
-	fr_pair_t		*vp;
+	fr_pair_t		*vp, *pool_name;
 	rlm_sql_handle_t	*handle;
+	bool			claimed = false;
 
 	/*
 	 *	If there is a Framed-IP-Address attribute in the reply do nothing
@@ -507,7 +768,8 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 		return do_logging(p_result, inst, request, inst->log_exists, RLM_MODULE_NOOP);
 	}
 
-	if (fr_pair_find_by_da(&request->control_pairs, attr_pool_name) == NULL) {
+	pool_name = fr_pair_find_by_da(&request->control_pairs, attr_pool_name);
+	if (!pool_name) {
 		RDEBUG2("No %s defined", attr_pool_name->name);
 
 		return do_logging(p_result, inst, request, inst->log_nopool, RLM_MODULE_NOOP);
@@ -532,7 +794,7 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 	if (inst->alloc_existing && *inst->alloc_existing) {
 		allocation_len = sqlippool_query1(allocation, sizeof(allocation),
 						  inst->alloc_existing, &handle,
-						  inst, request, (char *) NULL, 0);
+						  inst, t, request, (char *) NULL, 0);
 		if (!handle) RETURN_MODULE_FAIL;
 	} else {
 		allocation_len = 0;
@@ -553,19 +815,31 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 		if (slen > 0) {
 			allocation_len = sqlippool_query1(allocation, sizeof(allocation),
 							  inst->alloc_requested, &handle,
-							  inst, request, (char *) NULL, 0);
+							  inst, t, request, (char *) NULL, 0);
 			if (!handle) RETURN_MODULE_FAIL;
 		}
 	}
 
+	/*
+	 *	Use one of the IPs we reserved earlier.  If there
+	 *	are none left, and we can't reserve more, the pool
+	 *	is full.
+	 */
+	if ((allocation_len == 0) && t->queues) {
+		allocation_len = sqlippool_prefetch_claim(allocation, sizeof(allocation), t,
+							  &handle, request, pool_name->vp_strvalue);
+		if (allocation_len < 0) goto error;
+		if (allocation_len > 0) claimed = true;
+	}
+
 	/*
 	 *	If no existing IP was found (or no query was run),
 	 *	run the query to find a free IP
 	 */
-	if (allocation_len == 0) {
+	if ((allocation_len == 0) && !t->queues) {
 		allocation_len = sqlippool_query1(allocation, sizeof(allocation),
 						  inst->alloc_find, &handle,
-						  inst, request, (char *) NULL, 0);
+						  inst, t, request, (char *) NULL, 0);
 		if (!handle) RETURN_MODULE_FAIL;
 	}
 
@@ -585,7 +859,7 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 			 *Let's check if the pool exists at all
 			 */
 			allocation_len = sqlippool_query1(allocation, sizeof(allocation),
-							  inst->pool_check, &handle, inst, request,
+							  inst->pool_check, &handle, inst, t, request,
 							  (char *) NULL, 0);
 			if (!handle) RETURN_MODULE_FAIL;
 
@@ -639,10 +913,10 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 	fr_pair_add(&request->reply_pairs, vp);
 
 	/*
-	 *	UPDATE
+	 *	UPDATE, unless alloc_claim already did.
 	 */
-	if (sqlippool_command(inst->alloc_update, &handle, inst, request,
-			      allocation, allocation_len) < 0) {
+	if (!claimed && (sqlippool_command(inst->alloc_update, &handle, inst, t, request,
+					   allocation, allocation_len) < 0)) {
 	error:
 		if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
 		RETURN_MODULE_FAIL;
@@ -655,12 +929,38 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 	return do_logging(p_result, inst, request, inst->log_success, RLM_MODULE_OK);
 }
 
+/*
+ *	Allocate an IP number from the pool, recording how
+ *	many queries it took.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sqlippool_thread_t);
+	uint64_t		queries = t->queries;
+	unlang_action_t		ua;
+
+	ua = sqlippool_alloc(p_result, inst, t, request);
+
+	/*
+	 *	Nothing to allocate
+	 */
+	if (t->queries == queries) return ua;
+
+	t->alloc++;
+	t->alloc_queries += t->queries - queries;
+	RDEBUG2("Allocation took %" PRIu64 " queries", t->queries - queries);
+
+	return ua;
+}
+
 /*
  *	Update a lease.
  */
 static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sqlippool_thread_t);
 	rlm_sql_handle_t	*handle;
 	int			affected;
 
@@ -683,7 +983,7 @@ static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module
 	 */
 	DO_PART(update_free);
 
-	affected = sqlippool_command(inst->update_update, &handle, inst, request, NULL, 0);
+	affected = sqlippool_command(inst->update_update, &handle, inst, t, request, NULL, 0);
 
 	if (affected < 0) {
 	error:
@@ -714,6 +1014,7 @@ static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module
 static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sqlippool_thread_t);
 	rlm_sql_handle_t	*handle;
 
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
@@ -744,6 +1045,7 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 static unlang_action_t CC_HINT(nonnull) mod_bulk_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sqlippool_thread_t);
 	rlm_sql_handle_t	*handle;
 
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
@@ -775,6 +1077,7 @@ static unlang_action_t CC_HINT(nonnull) mod_bulk_release(rlm_rcode_t *p_result,
 static unlang_action_t CC_HINT(nonnull) mod_mark(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sqlippool_thread_t);
 	rlm_sql_handle_t	*handle;
 
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
@@ -852,6 +1155,11 @@ module_t rlm_sqlippool = {
 	.inst_size	= sizeof(rlm_sqlippool_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+
+	.thread_inst_size	= sizeof(rlm_sqlippool_thread_t),
+	.thread_inst_type	= "rlm_sqlippool_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_POST_AUTH]		= mod_alloc
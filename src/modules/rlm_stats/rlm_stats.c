@@ -19,15 +19,23 @@
  * @file rlm_stats.c
  * @brief Keep RADIUS statistics. Eventually, also non-RADIUS statistics
  *
+ * Each thread counts the packets it sends replies for, without locks.
+ * The counters are only added together when someone asks for them, via
+ * Status-Server, radmin, or the Prometheus exporter.
+ *
  * @copyright 2017 Network RADIUS SARL (license@networkradius.com)
  */
 RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/command.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/histogram.h>
+#include <freeradius-devel/util/socket.h>
+#include <freeradius-devel/util/syserror.h>
 
 #include <freeradius-devel/protocol/radius/freeradius.h>
 
@@ -39,39 +47,91 @@ RCSID("$Id$")
  */
 
 #include <pthread.h>
+#include <poll.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define RLM_STATS_CACHE_LINE		64
+#define RLM_STATS_LATENCY_PRECISION	5		//!< Latencies are accurate to ~3%.
+#define RLM_STATS_LATENCY_MAX		(60 * USEC)	//!< Latencies are in microseconds.
+
+/*
+ *	The owning thread is the only writer, so there's no need for
+ *	an atomic increment.  The relaxed load and store just make sure
+ *	readers never see a torn value.
+ */
+#define COUNTER_ADD(_c, _n) atomic_store_explicit(&(_c), atomic_load_explicit(&(_c), memory_order_relaxed) + (_n), \
+						  memory_order_relaxed)
+#define COUNTER_GET(_c) atomic_load_explicit(&(_c), memory_order_relaxed)
 
 typedef struct {
-	pthread_mutex_t		mutex;
+	_Atomic(uint64_t)	requests[FR_RADIUS_MAX_PACKET_CODE];	//!< By the code of the request.
+	_Atomic(uint64_t)	replies[FR_RADIUS_MAX_PACKET_CODE];	//!< By the code of the reply.
+} rlm_stats_counters_t;
+
+typedef struct {
+	fr_ipaddr_t		ipaddr;				//!< Address to listen on.
+	uint16_t		port;				//!< Port to listen on.  0 means no exporter.
+
+	int			sockfd;
+	pthread_t		thread;
+	bool			running;
+	atomic_bool		stop;
+} rlm_stats_prometheus_t;
+
+typedef struct {
+	char const		*name;				//!< Instance name.
+
+	rlm_stats_prometheus_t	prometheus;
+
 	fr_dict_attr_t const	*type_da;			//!< FreeRADIUS-Stats4-Type
 	fr_dict_attr_t const	*ipv4_da;			//!< FreeRADIUS-Stats4-IPv4-Address
 	fr_dict_attr_t const	*ipv6_da;			//!< FreeRADIUS-Stats4-IPv6-Address
+
+	pthread_mutex_t		mutex;				//!< Protects everything below.
 	fr_dlist_head_t		list;				//!< for threads to know about each other
 
-	uint64_t		stats[FR_RADIUS_MAX_PACKET_CODE];
+	rlm_stats_counters_t	retired;			//!< Counters from threads which have exited.
+	fr_histogram_t		*retired_latency[FR_RADIUS_MAX_PACKET_CODE];
 } rlm_stats_t;
 
 typedef struct {
 	fr_ipaddr_t		ipaddr;				//!< IP address of this thing
 	fr_time_t		created;			//!< when it was created
-	fr_time_t		last_packet;			//!< when we last saw a packet
-	uint64_t		stats[FR_RADIUS_MAX_PACKET_CODE];	//!< actual statistic
+	_Atomic(fr_time_t)	last_packet;			//!< when we last saw a packet
+	rlm_stats_counters_t	counters;			//!< actual statistic
 } rlm_stats_data_t;
 
 typedef struct {
 	rlm_stats_t		*inst;
 
-	fr_time_t		last_global_update;
 	fr_dlist_t		entry;				//!< for threads to know about each other
 
-	fr_time_t		last_manage;			//!< when we deleted old things
-
+	/*
+	 *	Only this thread changes the trees, so it doesn't need
+	 *	to lock them to look things up.  It locks them to add
+	 *	entries, and readers lock them to walk over them.
+	 */
+	pthread_mutex_t		mutex;
 	rbtree_t		*src;				//!< stats by source
 	rbtree_t		*dst;				//!< stats by destination
 
-	uint64_t		stats[FR_RADIUS_MAX_PACKET_CODE];
+	rlm_stats_counters_t	*counters;			//!< On their own cache lines.
+	_Atomic(fr_histogram_t *) latency[FR_RADIUS_MAX_PACKET_CODE];	//!< By the code of the request.
 } rlm_stats_thread_t;
 
+static const CONF_PARSER prometheus_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_stats_prometheus_t, ipaddr), .dflt = "127.0.0.1" },
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, rlm_stats_prometheus_t, port) },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("prometheus", FR_TYPE_SUBSECTION, rlm_stats_t, prometheus), .subcs = (void const *) prometheus_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -95,51 +155,197 @@ fr_dict_attr_autoload_t rlm_stats_dict_attr[] = {
 	{ NULL }
 };
 
-static void coalesce(uint64_t final_stats[FR_RADIUS_MAX_PACKET_CODE], rlm_stats_thread_t *t,
-		     size_t tree_offset, rlm_stats_data_t *mydata)
+static void counters_init(rlm_stats_counters_t *counters)
 {
-	rlm_stats_data_t *stats;
-	rlm_stats_thread_t *other;
-	rbtree_t **tree;
-	uint64_t local_stats[FR_RADIUS_MAX_PACKET_CODE];
+	int i;
 
-	tree = (rbtree_t **) (((uint8_t *) t) + tree_offset);
+	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
+		atomic_init(&counters->requests[i], 0);
+		atomic_init(&counters->replies[i], 0);
+	}
+}
 
-	/*
-	 *	Bootstrap with my statistics, where we don't need a
-	 *	lock.
-	 */
-	stats = rbtree_finddata(*tree, mydata);
-	if (!stats) {
-		memset(final_stats, 0, sizeof(uint64_t) * FR_RADIUS_MAX_PACKET_CODE);
-	} else {
-		memcpy(final_stats, stats->stats, sizeof(stats->stats));
+/** Add one set of counters to another
+ *
+ * src may be being updated by another thread.  dst must be owned by the
+ * caller, or protected by a lock.
+ */
+static void counters_merge(rlm_stats_counters_t *dst, rlm_stats_counters_t const *src)
+{
+	int i;
+
+	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
+		COUNTER_ADD(dst->requests[i], COUNTER_GET(src->requests[i]));
+		COUNTER_ADD(dst->replies[i], COUNTER_GET(src->replies[i]));
 	}
+}
 
-	/*
-	 *	Loop over all of the other thread instances, locking
-	 *	them, and adding their statistics in.
-	 */
-	for (other = fr_dlist_head(&t->inst->list);
-	     other != NULL;
-	     other = fr_dlist_next(&t->inst->list, other)) {
-		int i;
+static int latency_merge(TALLOC_CTX *ctx, fr_histogram_t *dst[FR_RADIUS_MAX_PACKET_CODE],
+			 fr_histogram_t const *src, int code)
+{
+	if (!src) return 0;
 
-		if (other == t) continue;
+	if (!dst[code]) {
+		dst[code] = fr_histogram_alloc(ctx, RLM_STATS_LATENCY_PRECISION, RLM_STATS_LATENCY_MAX);
+		if (!dst[code]) return -1;
+	}
 
-		tree = (rbtree_t **) (((uint8_t *) other) + tree_offset);
-		stats = rbtree_finddata(*tree, mydata);
-		if (!stats) {
-			continue;
-		}
-		memcpy(&local_stats, stats->stats, sizeof(stats->stats));
+	return fr_histogram_merge(dst[code], src);
+}
+
+/** Add up the global statistics from all of the threads
+ *
+ * @param[in] ctx	to allocate the histograms in.
+ * @param[in] inst	of the module.
+ * @param[out] out	counters to add to.  Must be initialised.
+ * @param[out] latency	if not NULL, histograms to add to, by request code.
+ */
+static void stats_global(TALLOC_CTX *ctx, rlm_stats_t *inst, rlm_stats_counters_t *out,
+			 fr_histogram_t *latency[FR_RADIUS_MAX_PACKET_CODE])
+{
+	rlm_stats_thread_t	*t;
+	int			i;
+
+	pthread_mutex_lock(&inst->mutex);
+	counters_merge(out, &inst->retired);
+	if (latency) for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
+		(void) latency_merge(ctx, latency, inst->retired_latency[i], i);
+	}
+
+	for (t = fr_dlist_head(&inst->list);
+	     t != NULL;
+	     t = fr_dlist_next(&inst->list, t)) {
+		counters_merge(out, t->counters);
+
+		if (!latency) continue;
 
 		for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-			final_stats[i] += local_stats[i];
+			(void) latency_merge(ctx, latency,
+					     atomic_load_explicit(&t->latency[i], memory_order_acquire), i);
 		}
 	}
+	pthread_mutex_unlock(&inst->mutex);
+}
+
+/** Add up the statistics for one source or destination from all of the threads
+ *
+ */
+static void stats_one(rlm_stats_t *inst, size_t tree_offset, fr_ipaddr_t const *ipaddr, rlm_stats_counters_t *out)
+{
+	rlm_stats_thread_t	*t;
+	rlm_stats_data_t	mydata, *stats;
+
+	mydata.ipaddr = *ipaddr;
+
+	pthread_mutex_lock(&inst->mutex);
+	for (t = fr_dlist_head(&inst->list);
+	     t != NULL;
+	     t = fr_dlist_next(&inst->list, t)) {
+		rbtree_t *tree = *(rbtree_t **) (((uint8_t *) t) + tree_offset);
+
+		pthread_mutex_lock(&t->mutex);
+		stats = rbtree_finddata(tree, &mydata);
+		if (stats) counters_merge(out, &stats->counters);
+		pthread_mutex_unlock(&t->mutex);
+	}
+	pthread_mutex_unlock(&inst->mutex);
 }
 
+static int data_cmp(const void *one, const void *two)
+{
+	rlm_stats_data_t const *a = one;
+	rlm_stats_data_t const *b = two;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+static int _stats_all_merge(void *data, void *uctx)
+{
+	rlm_stats_data_t	*stats = data, *total;
+	rbtree_t		*out = uctx;
+	fr_time_t		last_packet;
+
+	total = rbtree_finddata(out, stats);
+	if (!total) {
+		MEM(total = talloc_zero(out, rlm_stats_data_t));
+		total->ipaddr = stats->ipaddr;
+		total->created = stats->created;
+		counters_init(&total->counters);
+		(void) rbtree_insert(out, total);
+	}
+
+	if (stats->created < total->created) total->created = stats->created;
+
+	last_packet = atomic_load_explicit(&stats->last_packet, memory_order_relaxed);
+	if (last_packet > atomic_load_explicit(&total->last_packet, memory_order_relaxed)) {
+		atomic_store_explicit(&total->last_packet, last_packet, memory_order_relaxed);
+	}
+
+	counters_merge(&total->counters, &stats->counters);
+
+	return 0;
+}
+
+/** Add up the statistics for every source or destination, from all of the threads
+ *
+ * @return a tree of rlm_stats_data_t, which the caller must free.
+ */
+static rbtree_t *stats_all(TALLOC_CTX *ctx, rlm_stats_t *inst, size_t tree_offset)
+{
+	rlm_stats_thread_t	*t;
+	rbtree_t		*out;
+
+	out = rbtree_talloc_alloc(ctx, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_NONE);
+	if (!out) return NULL;
+
+	pthread_mutex_lock(&inst->mutex);
+	for (t = fr_dlist_head(&inst->list);
+	     t != NULL;
+	     t = fr_dlist_next(&inst->list, t)) {
+		rbtree_t *tree = *(rbtree_t **) (((uint8_t *) t) + tree_offset);
+
+		pthread_mutex_lock(&t->mutex);
+		(void) rbtree_walk(tree, RBTREE_IN_ORDER, _stats_all_merge, out);
+		pthread_mutex_unlock(&t->mutex);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	return out;
+}
+
+static char const *stats_code_name(int code)
+{
+	if (!code || !fr_packet_codes[code][0]) return "unknown";
+
+	return fr_packet_codes[code];
+}
+
+/** Count a packet against a source or destination
+ *
+ */
+static void stats_update(rlm_stats_thread_t *t, rbtree_t *tree, fr_ipaddr_t const *ipaddr,
+			 request_t *request, int src_code, int dst_code)
+{
+	rlm_stats_data_t mydata, *stats;
+
+	mydata.ipaddr = *ipaddr;
+	stats = rbtree_finddata(tree, &mydata);
+	if (!stats) {
+		MEM(stats = talloc_zero(t, rlm_stats_data_t));
+
+		stats->ipaddr = *ipaddr;
+		stats->created = request->async->recv_time;
+		counters_init(&stats->counters);
+
+		pthread_mutex_lock(&t->mutex);
+		(void) rbtree_insert(tree, stats);
+		pthread_mutex_unlock(&t->mutex);
+	}
+
+	atomic_store_explicit(&stats->last_packet, request->async->recv_time, memory_order_relaxed);
+	COUNTER_ADD(stats->counters.requests[src_code], 1);
+	COUNTER_ADD(stats->counters.replies[dst_code], 1);
+}
 
 /*
  *	Do the statistics
@@ -153,10 +359,9 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 
 
 	fr_pair_t *vp;
-	rlm_stats_data_t mydata, *stats;
 	fr_cursor_t cursor;
 	char buffer[64];
-	uint64_t local_stats[NUM_ELEMENTS(inst->stats)];
+	rlm_stats_counters_t local_stats;
 
 	/*
 	 *	Increment counters only in "send foo" sections.
@@ -164,7 +369,8 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 	 *	i.e. only when we have a reply to send.
 	 */
 	if (request->request_state == REQUEST_SEND) {
-		int src_code, dst_code;
+		int		src_code, dst_code;
+		fr_histogram_t	*latency;
 
 		src_code = request->packet->code;
 		if (src_code >= FR_RADIUS_MAX_PACKET_CODE) src_code = 0;
@@ -172,62 +378,31 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		dst_code = request->reply->code;
 		if (dst_code >= FR_RADIUS_MAX_PACKET_CODE) dst_code = 0;
 
-		t->stats[src_code]++;
-		t->stats[dst_code]++;
+		COUNTER_ADD(t->counters->requests[src_code], 1);
+		COUNTER_ADD(t->counters->replies[dst_code], 1);
 
 		/*
-		 *	Update source statistics
+		 *	Readers may look at the histogram as soon as
+		 *	it's published, so it's published after it's
+		 *	initialised.
 		 */
-		mydata.ipaddr = request->packet->socket.inet.src_ipaddr;
-		stats = rbtree_finddata(t->src, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
-
-			stats->ipaddr = request->packet->socket.inet.src_ipaddr;
-			stats->created = request->async->recv_time;
-
-			(void) rbtree_insert(t->src, stats);
+		latency = atomic_load_explicit(&t->latency[src_code], memory_order_relaxed);
+		if (!latency) {
+			MEM(latency = fr_histogram_alloc(t, RLM_STATS_LATENCY_PRECISION, RLM_STATS_LATENCY_MAX));
+			atomic_store_explicit(&t->latency[src_code], latency, memory_order_release);
 		}
-
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
+		fr_histogram_add(latency, fr_time_delta_to_usec(fr_time() - request->async->recv_time));
 
 		/*
-		 *	Update destination statistics
+		 *	Update source and destination statistics
 		 */
-		mydata.ipaddr = request->packet->socket.inet.dst_ipaddr;
-		stats = rbtree_finddata(t->dst, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
-
-			stats->ipaddr = request->packet->socket.inet.dst_ipaddr;
-			stats->created = request->async->recv_time;
-
-			(void) rbtree_insert(t->dst, stats);
-		}
-
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
+		stats_update(t, t->src, &request->packet->socket.inet.src_ipaddr, request, src_code, dst_code);
+		stats_update(t, t->dst, &request->packet->socket.inet.dst_ipaddr, request, src_code, dst_code);
 
 		/*
 		 *	@todo - periodically clean up old entries.
 		 */
 
-		if ((t->last_global_update + NSEC) > request->async->recv_time) {
-			RETURN_MODULE_UPDATED;
-		}
-
-		t->last_global_update = request->async->recv_time;
-
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
-		pthread_mutex_unlock(&inst->mutex);
-
 		RETURN_MODULE_UPDATED;
 	}
 
@@ -254,21 +429,11 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 	MEM(pair_update_reply(&vp, attr_freeradius_stats4_type) >= 0);
 	vp->vp_uint32 = stats_type;
 
+	counters_init(&local_stats);
+
 	switch (stats_type) {
 	case FR_FREERADIUS_STATS4_TYPE_VALUE_GLOBAL:			/* global */
-		/*
-		 *	Merge our stats with the global stats, and then copy
-		 *	the global stats to a thread-local variable.
-		 *
-		 *	The copy helps minimize mutex contention.
-		 */
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
-		memcpy(&local_stats, inst->stats, sizeof(inst->stats));
-		pthread_mutex_unlock(&inst->mutex);
+		stats_global(NULL, inst, &local_stats, NULL);
 		vp = NULL;
 		break;
 
@@ -277,8 +442,7 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		if (!vp) vp = fr_pair_find_by_da(&request->request_pairs, attr_freeradius_stats4_ipv6_address);
 		if (!vp) RETURN_MODULE_NOOP;
 
-		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, src), &mydata);
+		stats_one(inst, offsetof(rlm_stats_thread_t, src), &vp->vp_ip, &local_stats);
 		break;
 
 	case FR_FREERADIUS_STATS4_TYPE_VALUE_LISTENER:			/* dst */
@@ -286,8 +450,7 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		if (!vp) vp = fr_pair_find_by_da(&request->request_pairs, attr_freeradius_stats4_ipv6_address);
 		if (!vp) RETURN_MODULE_NOOP;
 
-		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, dst), &mydata);
+		stats_one(inst, offsetof(rlm_stats_thread_t, dst), &vp->vp_ip, &local_stats);
 		break;
 
 	default:
@@ -307,15 +470,20 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 
 	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
 		fr_dict_attr_t const *da;
+		uint64_t count;
 
-		if (!local_stats[i]) continue;
+		/*
+		 *	Request and reply codes don't overlap.
+		 */
+		count = COUNTER_GET(local_stats.requests[i]) + COUNTER_GET(local_stats.replies[i]);
+		if (!count) continue;
 
 		strlcpy(buffer + 18, fr_packet_codes[i], sizeof(buffer) - 18);
 		da = fr_dict_attr_by_name(dict_radius, buffer);
 		if (!da) continue;
 
 		MEM(vp = fr_pair_afrom_da(request->reply, da));
-		vp->vp_uint64 = local_stats[i];
+		vp->vp_uint64 = count;
 
 		fr_cursor_append(&cursor, vp);
 		(void) fr_cursor_tail(&cursor);
@@ -324,13 +492,380 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 	RETURN_MODULE_OK;
 }
 
+/*
+ *	The percentiles we print for latency summaries.
+ */
+static double const stats_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
 
-static int data_cmp(const void *one, const void *two)
+static void prometheus_counters(FILE *fp, char const *name, char const *metric, char const *label,
+				char const *value, _Atomic(uint64_t) const counters[FR_RADIUS_MAX_PACKET_CODE])
 {
-	rlm_stats_data_t const *a = one;
-	rlm_stats_data_t const *b = two;
+	int i;
 
-	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
+		uint64_t count = COUNTER_GET(counters[i]);
+
+		if (!count) continue;
+
+		fprintf(fp, "freeradius_%s{module=\"%s\",%s%s%s%scode=\"%s\"} %" PRIu64 "\n",
+			metric, name, label ? label : "", label ? "=\"" : "", label ? value : "", label ? "\"," : "",
+			stats_code_name(i), count);
+	}
+}
+
+typedef struct {
+	FILE		*fp;
+	char const	*name;
+	char const	*metric;
+	char const	*label;
+	bool		replies;
+} prometheus_walk_t;
+
+static int _prometheus_data(void *data, void *uctx)
+{
+	rlm_stats_data_t	*stats = data;
+	prometheus_walk_t	*walk = uctx;
+	char			buffer[FR_IPADDR_STRLEN];
+
+	fr_inet_ntop(buffer, sizeof(buffer), &stats->ipaddr);
+
+	prometheus_counters(walk->fp, walk->name, walk->metric, walk->label, buffer,
+			    walk->replies ? stats->counters.replies : stats->counters.requests);
+
+	return 0;
+}
+
+/** Print the statistics in the Prometheus text exposition format
+ *
+ */
+/** Export one of the server's latency trackers as a summary
+ *
+ */
+static int _prometheus_latency(char const *name, fr_histogram_t const *merged, void *uctx)
+{
+	FILE		*fp = uctx;
+	size_t		i;
+
+	if (!fr_histogram_count(merged)) return 0;
+
+	for (i = 0; i < NUM_ELEMENTS(stats_quantiles); i++) {
+		fprintf(fp, "freeradius_latency_seconds{tracker=\"%s\",quantile=\"%g\"} %.6f\n",
+			name, stats_quantiles[i],
+			(double) fr_histogram_percentile(merged, stats_quantiles[i] * 100) / USEC);
+	}
+	fprintf(fp, "freeradius_latency_seconds_sum{tracker=\"%s\"} %.6f\n",
+		name, (double) fr_histogram_sum(merged) / USEC);
+	fprintf(fp, "freeradius_latency_seconds_count{tracker=\"%s\"} %" PRIu64 "\n",
+		name, fr_histogram_count(merged));
+
+	return 0;
+}
+
+static void stats_prometheus(FILE *fp, rlm_stats_t *inst)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("rlm_stats");
+	rlm_stats_counters_t	global;
+	fr_histogram_t		*latency[FR_RADIUS_MAX_PACKET_CODE] = { NULL };
+	rbtree_t		*src, *dst;
+	prometheus_walk_t	walk = { .fp = fp, .name = inst->name };
+	size_t			i;
+	int			code;
+
+	counters_init(&global);
+	stats_global(ctx, inst, &global, latency);
+	src = stats_all(ctx, inst, offsetof(rlm_stats_thread_t, src));
+	dst = stats_all(ctx, inst, offsetof(rlm_stats_thread_t, dst));
+
+	fprintf(fp, "# HELP freeradius_requests_total Requests which were replied to, by packet code.\n");
+	fprintf(fp, "# TYPE freeradius_requests_total counter\n");
+	prometheus_counters(fp, inst->name, "requests_total", NULL, NULL, global.requests);
+
+	fprintf(fp, "# HELP freeradius_replies_total Replies sent, by packet code.\n");
+	fprintf(fp, "# TYPE freeradius_replies_total counter\n");
+	prometheus_counters(fp, inst->name, "replies_total", NULL, NULL, global.replies);
+
+	if (src) {
+		fprintf(fp, "# HELP freeradius_client_requests_total Requests which were replied to, by client and packet code.\n");
+		fprintf(fp, "# TYPE freeradius_client_requests_total counter\n");
+		walk.metric = "client_requests_total";
+		walk.label = "client";
+		walk.replies = false;
+		(void) rbtree_walk(src, RBTREE_IN_ORDER, _prometheus_data, &walk);
+
+		fprintf(fp, "# HELP freeradius_client_replies_total Replies sent, by client and packet code.\n");
+		fprintf(fp, "# TYPE freeradius_client_replies_total counter\n");
+		walk.metric = "client_replies_total";
+		walk.replies = true;
+		(void) rbtree_walk(src, RBTREE_IN_ORDER, _prometheus_data, &walk);
+	}
+
+	if (dst) {
+		fprintf(fp, "# HELP freeradius_listener_requests_total Requests which were replied to, by listener and packet code.\n");
+		fprintf(fp, "# TYPE freeradius_listener_requests_total counter\n");
+		walk.metric = "listener_requests_total";
+		walk.label = "listener";
+		walk.replies = false;
+		(void) rbtree_walk(dst, RBTREE_IN_ORDER, _prometheus_data, &walk);
+	}
+
+	fprintf(fp, "# HELP freeradius_request_duration_seconds Time from receiving a request to sending the reply.\n");
+	fprintf(fp, "# TYPE freeradius_request_duration_seconds summary\n");
+	for (code = 0; code < FR_RADIUS_MAX_PACKET_CODE; code++) {
+		if (!latency[code] || !fr_histogram_count(latency[code])) continue;
+
+		for (i = 0; i < NUM_ELEMENTS(stats_quantiles); i++) {
+			fprintf(fp, "freeradius_request_duration_seconds{module=\"%s\",code=\"%s\",quantile=\"%g\"} %.6f\n",
+				inst->name, stats_code_name(code), stats_quantiles[i],
+				(double) fr_histogram_percentile(latency[code], stats_quantiles[i] * 100) / USEC);
+		}
+		fprintf(fp, "freeradius_request_duration_seconds_sum{module=\"%s\",code=\"%s\"} %.6f\n",
+			inst->name, stats_code_name(code), (double) fr_histogram_sum(latency[code]) / USEC);
+		fprintf(fp, "freeradius_request_duration_seconds_count{module=\"%s\",code=\"%s\"} %" PRIu64 "\n",
+			inst->name, stats_code_name(code), fr_histogram_count(latency[code]));
+	}
+
+	/*
+	 *	And the server wide trackers, for requests, module
+	 *	calls and connection trunks.
+	 */
+	fprintf(fp, "# HELP freeradius_latency_seconds Latency of requests, module calls and trunk requests.\n");
+	fprintf(fp, "# TYPE freeradius_latency_seconds summary\n");
+	(void) fr_latency_walk(_prometheus_latency, fp);
+
+	talloc_free(ctx);
+}
+
+static int cmd_show_stats_counters(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	rlm_stats_t		*inst = talloc_get_type_abort(ctx, rlm_stats_t);
+	TALLOC_CTX		*tmp_ctx = talloc_init_const("rlm_stats");
+	rlm_stats_counters_t	global;
+	fr_histogram_t		*latency[FR_RADIUS_MAX_PACKET_CODE] = { NULL };
+	int			i;
+
+	counters_init(&global);
+	stats_global(tmp_ctx, inst, &global, latency);
+
+	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
+		uint64_t count = COUNTER_GET(global.requests[i]);
+
+		if (!count) continue;
+
+		fprintf(fp, "%-24s\t%" PRIu64 "\n", stats_code_name(i), count);
+		if (!latency[i]) continue;
+
+		fprintf(fp, "\tlatency (usec)\tp50 %" PRIu64 "\tp90 %" PRIu64 "\tp99 %" PRIu64 "\tp99.9 %" PRIu64
+			"\tmax %" PRIu64 "\n",
+			fr_histogram_percentile(latency[i], 50), fr_histogram_percentile(latency[i], 90),
+			fr_histogram_percentile(latency[i], 99), fr_histogram_percentile(latency[i], 99.9),
+			fr_histogram_max(latency[i]));
+	}
+
+	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
+		uint64_t count = COUNTER_GET(global.replies[i]);
+
+		if (!count) continue;
+
+		fprintf(fp, "%-24s\t%" PRIu64 "\n", stats_code_name(i), count);
+	}
+
+	talloc_free(tmp_ctx);
+
+	return 0;
+}
+
+static int _show_data(void *data, void *uctx)
+{
+	rlm_stats_data_t	*stats = data;
+	FILE			*fp = uctx;
+	char			buffer[FR_IPADDR_STRLEN];
+	int			i;
+
+	fprintf(fp, "%s\n", fr_inet_ntop(buffer, sizeof(buffer), &stats->ipaddr));
+
+	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
+		uint64_t count = COUNTER_GET(stats->counters.requests[i]) + COUNTER_GET(stats->counters.replies[i]);
+
+		if (!count) continue;
+
+		fprintf(fp, "\t%-24s\t%" PRIu64 "\n", stats_code_name(i), count);
+	}
+
+	return 0;
+}
+
+static int cmd_show_stats_clients(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	rlm_stats_t	*inst = talloc_get_type_abort(ctx, rlm_stats_t);
+	rbtree_t	*src;
+
+	src = stats_all(NULL, inst, offsetof(rlm_stats_thread_t, src));
+	if (!src) return -1;
+
+	(void) rbtree_walk(src, RBTREE_IN_ORDER, _show_data, fp);
+	talloc_free(src);
+
+	return 0;
+}
+
+static int cmd_show_stats_prometheus(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	stats_prometheus(fp, talloc_get_type_abort(ctx, rlm_stats_t));
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "counters",
+		.func = cmd_show_stats_counters,
+		.help = "Show packet counts and latency by packet code.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "clients",
+		.func = cmd_show_stats_clients,
+		.help = "Show packet counts for each client.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "prometheus",
+		.func = cmd_show_stats_prometheus,
+		.help = "Show all statistics in the Prometheus text format.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
+/** How long one scrape may take, in total
+ *
+ * There's only one exporter thread, so a client which connects and
+ * then sends nothing (or reads nothing) would otherwise hold up every
+ * other scrape.
+ */
+#define PROMETHEUS_DEADLINE	fr_time_delta_from_sec(2)
+
+/** Answer one HTTP request from Prometheus
+ *
+ * Whatever is asked for, the answer is the same.
+ */
+static void prometheus_answer(rlm_stats_t *inst, int fd)
+{
+	struct pollfd	pfd = { .fd = fd, .events = POLLIN };
+	struct timeval	tv = fr_time_delta_to_timeval(PROMETHEUS_DEADLINE);
+	fr_time_t	deadline = fr_time() + PROMETHEUS_DEADLINE;
+	char		buffer[4096];
+	size_t		used = 0;
+	FILE		*fp;
+
+	/*
+	 *	Read the request headers, but give up on them once
+	 *	the deadline has passed, no matter how slowly the
+	 *	client is trickling them in.
+	 */
+	while (used < (sizeof(buffer) - 1)) {
+		fr_time_t	now = fr_time();
+		ssize_t		len;
+
+		if (now >= deadline) break;
+		if (poll(&pfd, 1, fr_time_delta_to_msec(deadline - now) + 1) <= 0) break;
+
+		len = read(fd, buffer + used, sizeof(buffer) - 1 - used);
+		if (len <= 0) break;
+
+		used += len;
+		buffer[used] = '\0';
+		if (strstr(buffer, "\r\n\r\n") || strstr(buffer, "\n\n")) break;
+	}
+
+	/*
+	 *	A client which doesn't read the answer mustn't block
+	 *	the thread either.
+	 */
+	(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		return;
+	}
+
+	fprintf(fp, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Connection: close\r\n\r\n");
+	stats_prometheus(fp, inst);
+	fclose(fp);
+}
+
+static void *prometheus_thread(void *arg)
+{
+	rlm_stats_t	*inst = arg;
+	struct pollfd	pfd = { .fd = inst->prometheus.sockfd, .events = POLLIN };
+
+	while (!atomic_load(&inst->prometheus.stop)) {
+		int fd;
+
+		if (poll(&pfd, 1, 500) <= 0) continue;
+
+		fd = accept(inst->prometheus.sockfd, NULL, NULL);
+		if (fd < 0) continue;
+
+		prometheus_answer(inst, fd);
+	}
+
+	return NULL;
+}
+
+/** Start the thread which answers Prometheus
+ *
+ */
+static int prometheus_start(rlm_stats_t *inst, CONF_SECTION *conf)
+{
+	rlm_stats_prometheus_t	*p = &inst->prometheus;
+	uint16_t		port = p->port;
+	int			ret;
+
+	atomic_init(&p->stop, false);
+	p->sockfd = -1;
+
+	if (!port) return 0;
+
+	p->sockfd = fr_socket_server_tcp(&p->ipaddr, &port, NULL, true);
+	if (p->sockfd < 0) {
+		cf_log_perr(conf, "Failed opening Prometheus socket");
+		return -1;
+	}
+
+	if (fr_socket_bind(p->sockfd, &p->ipaddr, &port, NULL) < 0) {
+		cf_log_perr(conf, "Failed binding Prometheus socket");
+	error:
+		close(p->sockfd);
+		p->sockfd = -1;
+		return -1;
+	}
+
+	if (listen(p->sockfd, 8) < 0) {
+		cf_log_err(conf, "Failed listening on Prometheus socket: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ret = pthread_create(&p->thread, NULL, prometheus_thread, inst);
+	if (ret != 0) {
+		cf_log_err(conf, "Failed creating Prometheus thread: %s", fr_syserror(ret));
+		goto error;
+	}
+	p->running = true;
+
+	return 0;
 }
 
 /** Instantiate thread data for the submodule.
@@ -340,13 +875,24 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
 {
 	rlm_stats_t *inst = talloc_get_type_abort(instance, rlm_stats_t);
 	rlm_stats_thread_t *t = thread;
+	int i;
 
 	(void) talloc_set_type(t, rlm_stats_thread_t);
 
 	t->inst = inst;
 
-	t->src = rbtree_talloc_alloc(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_LOCK);
-	t->dst = rbtree_talloc_alloc(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_LOCK);
+	/*
+	 *	Keep each thread's global counters on their own cache
+	 *	lines, so that threads don't slow each other down.
+	 */
+	if (!talloc_aligned_array(t, (void **) &t->counters, RLM_STATS_CACHE_LINE, sizeof(*t->counters))) return -1;
+	counters_init(t->counters);
+
+	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) atomic_init(&t->latency[i], NULL);
+
+	pthread_mutex_init(&t->mutex, NULL);
+	t->src = rbtree_talloc_alloc(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_NONE);
+	t->dst = rbtree_talloc_alloc(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_NONE);
 
 	pthread_mutex_lock(&inst->mutex);
 	fr_dlist_insert_head(&inst->list, t);
@@ -365,24 +911,41 @@ static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 	rlm_stats_t *inst = t->inst;
 	int i;
 
+	/*
+	 *	Keep the global statistics, so that they don't go
+	 *	backwards.
+	 */
 	pthread_mutex_lock(&inst->mutex);
+	counters_merge(&inst->retired, t->counters);
 	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-		inst->stats[i] += t->stats[i];
+		(void) latency_merge(inst, inst->retired_latency,
+				     atomic_load_explicit(&t->latency[i], memory_order_relaxed), i);
 	}
 	fr_dlist_remove(&inst->list, t);
 	pthread_mutex_unlock(&inst->mutex);
 
+	pthread_mutex_destroy(&t->mutex);
+
 	return 0;
 }
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_stats_t	*inst = instance;
 
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
 	pthread_mutex_init(&inst->mutex, NULL);
 	fr_dlist_init(&inst->list, rlm_stats_thread_t, entry);
+	counters_init(&inst->retired);
 
-	return 0;
+	if (fr_command_register_hook(NULL, inst->name, inst, cmd_table) < 0) {
+		cf_log_perr(conf, "Failed registering radmin commands");
+		return -1;
+	}
+
+	return prometheus_start(inst, conf);
 }
 
 /*
@@ -393,6 +956,12 @@ static int mod_detach(void *instance)
 {
 	rlm_stats_t *inst = talloc_get_type_abort(instance, rlm_stats_t);
 
+	if (inst->prometheus.running) {
+		atomic_store(&inst->prometheus.stop, true);
+		pthread_join(inst->prometheus.thread, NULL);
+	}
+	if (inst->prometheus.sockfd >= 0) close(inst->prometheus.sockfd);
+
 	pthread_mutex_destroy(&inst->mutex);
 
 	/* free things here */
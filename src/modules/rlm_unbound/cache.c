@@ -0,0 +1,169 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_unbound/cache.c
+ * @brief Per-thread cache of positive and negative DNS answers
+ *
+ * libunbound has its own caches, but answering from them still means
+ * a round trip through the resolver state machine, and a yield of the
+ * request.  This cache lets the xlats answer repeated lookups inline,
+ * for as long as the TTL of the answer allows.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include "cache.h"
+
+static int unbound_cache_cmp(void const *one, void const *two)
+{
+	unbound_cache_entry_t const *a = one;
+	unbound_cache_entry_t const *b = two;
+
+	if (a->rrtype != b->rrtype) return (a->rrtype > b->rrtype) - (a->rrtype < b->rrtype);
+
+	return strcasecmp(a->name, b->name);
+}
+
+static int _unbound_cache_entry_free(unbound_cache_entry_t *entry)
+{
+	(void) rbtree_deletebydata(entry->cache->tree, entry);
+	fr_dlist_remove(&entry->cache->lru, entry);
+
+	return 0;
+}
+
+/** Free the entries before the tree they're in
+ *
+ */
+static int _unbound_cache_free(unbound_cache_t *cache)
+{
+	unbound_cache_entry_t *entry;
+
+	while ((entry = fr_dlist_head(&cache->lru))) talloc_free(entry);
+
+	return 0;
+}
+
+/** Allocate a new answer cache
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of answers to cache.  0 disables caching.
+ * @return
+ *	- A new cache.
+ *	- NULL on failure.
+ */
+unbound_cache_t *unbound_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries)
+{
+	unbound_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, unbound_cache_t));
+	cache->max_entries = max_entries;
+	fr_dlist_init(&cache->lru, unbound_cache_entry_t, entry);
+
+	cache->tree = rbtree_alloc(cache, unbound_cache_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!cache->tree) {
+		talloc_free(cache);
+		return NULL;
+	}
+	talloc_set_destructor(cache, _unbound_cache_free);
+
+	return cache;
+}
+
+/** Find an unexpired answer
+ *
+ * Expired entries are removed as they're found.
+ *
+ * @param[in] cache	to search.
+ * @param[in] rrtype	Record type.
+ * @param[in] name	Owner name.
+ * @param[in] now	The current time.
+ * @return
+ *	- The cached answer.
+ *	- NULL if there isn't one.
+ */
+unbound_cache_entry_t *unbound_cache_find(unbound_cache_t *cache, uint16_t rrtype, char const *name, fr_time_t now)
+{
+	unbound_cache_entry_t *entry;
+
+	entry = rbtree_finddata(cache->tree, &(unbound_cache_entry_t){ .rrtype = rrtype, .name = name });
+	if (!entry) return NULL;
+
+	if (entry->expires <= now) {
+		talloc_free(entry);
+		return NULL;
+	}
+
+	fr_dlist_remove(&cache->lru, entry);
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	return entry;
+}
+
+/** Add an answer to the cache, replacing any existing answer for the same query
+ *
+ * @param[in] cache	to add the answer to.
+ * @param[in] rrtype	Record type.
+ * @param[in] name	Owner name.
+ * @param[in] rcode	DNS rcode of the answer.
+ * @param[in] vb	First record in the answer.  NULL for negative answers.
+ * @param[in] expires	When the answer should no longer be used.
+ * @return
+ *	- 0 on success, or if the answer wasn't cacheable.
+ *	- -1 on failure.
+ */
+int unbound_cache_insert(unbound_cache_t *cache, uint16_t rrtype, char const *name,
+			 int rcode, fr_value_box_t const *vb, fr_time_t expires)
+{
+	unbound_cache_entry_t *entry;
+
+	if (!cache->max_entries) return 0;
+
+	entry = rbtree_finddata(cache->tree, &(unbound_cache_entry_t){ .rrtype = rrtype, .name = name });
+	if (entry) talloc_free(entry);
+
+	if (fr_dlist_num_elements(&cache->lru) >= cache->max_entries) talloc_free(fr_dlist_tail(&cache->lru));
+
+	MEM(entry = talloc_zero(cache, unbound_cache_entry_t));
+	entry->cache = cache;
+	entry->rrtype = rrtype;
+	entry->name = talloc_typed_strdup(entry, name);
+	entry->rcode = rcode;
+	entry->expires = expires;
+
+	if (vb) {
+		MEM(entry->vb = fr_value_box_alloc_null(entry));
+		if (fr_value_box_copy(entry->vb, entry->vb, vb) < 0) {
+			talloc_free(entry);
+			return -1;
+		}
+	}
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		talloc_free(entry);
+		return -1;
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+	talloc_set_destructor(entry, _unbound_cache_entry_free);
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Function prototypes and datatypes for the per-thread DNS answer cache.
+ * @file rlm_unbound/cache.h
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(rlm_unbound_cache_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rbtree.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/value.h>
+
+typedef struct unbound_cache_s unbound_cache_t;
+
+/** A cached answer
+ *
+ * Negative answers (NXDOMAIN, or no records of the requested type)
+ * are cached with a NULL vb.
+ */
+typedef struct {
+	unbound_cache_t		*cache;		//!< Cache this entry belongs to.
+
+	uint16_t		rrtype;		//!< Record type which was queried.
+	char const		*name;		//!< Owner name which was queried.
+
+	int			rcode;		//!< DNS rcode of the answer.
+	fr_value_box_t		*vb;		//!< First record in the answer.  NULL if negative.
+
+	fr_time_t		expires;	//!< When the entry should no longer be used.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+} unbound_cache_entry_t;
+
+/** Per-thread answer cache
+ *
+ * Each worker thread has its own ub_ctx, and its own cache, so they need no locking.
+ */
+struct unbound_cache_s {
+	rbtree_t		*tree;		//!< Entries, keyed by rrtype and name.
+	fr_dlist_head_t		lru;		//!< Entries, most recently used first.
+	uint32_t		max_entries;	//!< Evict the least recently used entry above this.
+};
+
+unbound_cache_t		*unbound_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries);
+
+unbound_cache_entry_t	*unbound_cache_find(unbound_cache_t *cache, uint16_t rrtype, char const *name, fr_time_t now);
+
+int			unbound_cache_insert(unbound_cache_t *cache, uint16_t rrtype, char const *name,
+					     int rcode, fr_value_box_t const *vb, fr_time_t expires);
+
+#ifdef __cplusplus
+}
+#endif
@@ -29,388 +29,668 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/log.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/net.h>
 #include <fcntl.h>
 
 #include "io.h"
 #include "log.h"
+#include "cache.h"
 
 typedef struct {
-	struct ub_ctx	*ub;   /* This must come first.  Do not move */
-
 	char const	*name;
 	char const	*xlat_a_name;
 	char const	*xlat_aaaa_name;
 	char const	*xlat_ptr_name;
+	char const	*xlat_stats_name;
 
 	uint32_t	timeout;
 
 	char const	*filename;
 
-	unbound_log_t	*u_log;
+	uint32_t	cache_max_entries;	//!< Answers cached per thread.  0 disables the cache.
+	uint32_t	cache_max_ttl;		//!< Upper bound on the TTL of cached answers.
+	uint32_t	cache_negative_ttl;	//!< Upper bound on the TTL of cached negative answers.
 } rlm_unbound_t;
 
+/** Per-thread instance data
+ *
+ * Each worker thread has its own ub_ctx, which runs on the worker's
+ * event loop, so lookups never block the worker.
+ */
+typedef struct {
+	rlm_unbound_t const	*inst;
+
+	unbound_io_event_base_t	*ev_b;		//!< Event base, and the ub_ctx which uses it.
+	unbound_log_t		*u_log;		//!< Unbound log stream for this thread.
+	unbound_cache_t		*cache;		//!< Answers from previous lookups.
+
+	uint64_t		lookups;	//!< Calls to the lookup xlats.
+	uint64_t		hits;		//!< Lookups answered from the cache.
+	uint64_t		yields;		//!< Lookups which waited for libunbound on the event loop.
+} rlm_unbound_thread_t;
+
+/** Wrapper around the module thread struct for individual xlats
+ *
+ */
+typedef struct {
+	rlm_unbound_t const	*inst;		//!< Instance of rlm_unbound.
+	rlm_unbound_thread_t	*t;		//!< rlm_unbound thread instance.
+} unbound_xlat_thread_inst_t;
+
+/** A lookup which is in progress
+ *
+ */
+typedef struct {
+	request_t		*request;	//!< Request which started the lookup.
+	rlm_unbound_thread_t	*t;		//!< Thread the lookup is running in.
+
+	char const		*xlat_name;	//!< For log messages.
+	char			*name;		//!< Owner name being looked up.
+	uint16_t		rrtype;		//!< Record type being looked up.
+
+	int			async_id;	//!< So the lookup can be cancelled.
+	bool			done;		//!< libunbound has called us back, or the lookup timed out.
+	bool			yielded;	//!< The request is waiting for the lookup.
+
+	int			rcode;		//!< DNS rcode of the answer.
+	uint32_t		ttl;		//!< How long the answer may be cached for.
+	fr_value_box_t		*vb;		//!< First record in the answer.
+} unbound_request_t;
+
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_unbound_t, cache_max_entries), .dflt = "1024" },
+	{ FR_CONF_OFFSET("max_ttl", FR_TYPE_UINT32, rlm_unbound_t, cache_max_ttl), .dflt = "3600" },
+	{ FR_CONF_OFFSET("negative_ttl", FR_TYPE_UINT32, rlm_unbound_t, cache_negative_ttl), .dflt = "60" },
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED, rlm_unbound_t, filename), .dflt = "${modconfdir}/unbound/default.conf" },
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, rlm_unbound_t, timeout), .dflt = "3000" },
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
-/*
- *	Callback sent to libunbound for xlat functions.  Simply links the
- *	new ub_result via a pointer that has been allocated from the heap.
- *	This pointer has been pre-initialized to a magic value.
+#define DNS_HDR_LEN	12
+#define DNS_CLASS_IN	1
+#define DNS_TYPE_A	1
+#define DNS_TYPE_SOA	6
+#define DNS_TYPE_PTR	12
+#define DNS_TYPE_AAAA	28
+
+#define DNS_RCODE_NOERROR	0
+#define DNS_RCODE_NXDOMAIN	3
+
+/** Skip over a domain name in a DNS packet
+ *
+ * @return
+ *	- A pointer to the first byte after the name.
+ *	- NULL if the name runs off the end of the packet, or is malformed.
  */
-static void link_ubres(void *my_arg, int err, struct ub_result *result)
+static uint8_t const *dns_name_skip(uint8_t const *p, uint8_t const *end)
 {
-	struct ub_result **ubres = (struct ub_result **)my_arg;
+	while (p < end) {
+		uint8_t len = *p;
 
-	/*
-	 *	Note that while result will be NULL on error, we are explicit
-	 *	here because that is actually a behavior that is suboptimal
-	 *	and only documented in the examples.  It could change.
-	 */
-	if (err) {
-		ERROR("%s", ub_strerror(err));
-		*ubres = NULL;
-	} else {
-		*ubres = result;
+		if (len == 0) return p + 1;
+
+		if ((len & 0xc0) == 0xc0) return ((p + 2) <= end) ? p + 2 : NULL;
+
+		if (len & 0xc0) return NULL;
+
+		p += len + 1;
 	}
+
+	return NULL;
 }
 
-/*
- *	Convert labels as found in a DNS result to a NULL terminated string.
+/** Convert a (possibly compressed) domain name in a DNS packet to a NULL terminated string
  *
- *	Result is written to memory pointed to by "out" but no result will
- *	be written unless it and its terminating NULL character fit in "left"
- *	bytes.  Returns the number of bytes written excluding the terminating
- *	NULL, or -1 if nothing was written because it would not fit or due
- *	to a violation in the labels format.
+ * @param[out] out	Where to write the name.
+ * @param[in] outlen	Length of the output buffer.
+ * @param[in] packet	The start of the DNS packet, which compression pointers are relative to.
+ * @param[in] end	The end of the DNS packet.
+ * @param[in] p		The start of the name.
+ * @return
+ *	- The length of the name, excluding the terminating NULL.
+ *	- -1 if the name would not fit, or violates the label format.
  */
-static int rrlabels_tostr(char *out, char *rr, size_t left)
+static ssize_t dns_name_to_str(char *out, size_t outlen, uint8_t const *packet, uint8_t const *end, uint8_t const *p)
 {
-	int offset = 0;
+	size_t	offset = 0;
+	int	jumps = 0;
 
-	/*
-	 * TODO: verify that unbound results (will) always use this label
-	 * format, and review the specs on this label format for nuances.
-	 */
+	while (p < end) {
+		uint8_t len = *p;
 
-	if (!left) {
-		return -1;
-	}
-	if (left > 253) {
-		left = 253; /* DNS length limit */
-	}
-	/* As a whole this should be "NULL terminated" by the 0-length label */
-	if (strnlen(rr, left) > left - 1) {
-		return -1;
-	}
+		if (len == 0) {
+			if (!outlen) return -1;
+			out[offset] = '\0';
+			return offset;
+		}
 
-	/* It will fit, but does it it look well formed? */
-	while (1) {
-		size_t count;
+		/*
+		 *	Compression pointer.  Limit the number we
+		 *	follow, so loops can't keep us here forever.
+		 */
+		if ((len & 0xc0) == 0xc0) {
+			if (((p + 2) > end) || (++jumps > 64)) return -1;
+			p = packet + (((len & 0x3f) << 8) | p[1]);
+			continue;
+		}
 
-		count = *((unsigned char *)(rr + offset));
-		if (!count) break;
+		if (len & 0xc0) return -1;
+		if ((p + 1 + len) > end) return -1;
+		if ((offset + len + 2) > outlen) return -1;	/* '.', the label, and the terminating NULL */
 
-		offset++;
-		if (count > 63 || strlen(rr + offset) < count) {
-			return -1;
-		}
-		offset += count;
+		if (offset) out[offset++] = '.';
+		memcpy(out + offset, p + 1, len);
+		offset += len;
+		p += len + 1;
 	}
 
-	/* Data is valid and fits.  Copy it. */
-	offset = 0;
-	while (1) {
-		int count;
+	return -1;
+}
 
-		count = *((unsigned char *)(rr));
-		if (!count) break;
+/** Convert the rdata of a record we asked for to a value box
+ *
+ */
+static int unbound_rdata_to_box(unbound_request_t *ur, uint8_t const *packet, uint8_t const *end,
+				uint8_t const *rdata, uint16_t rdlen)
+{
+	fr_ipaddr_t	ipaddr = {};
+	char		name[256];
 
-		if (offset) {
-			*(out + offset) = '.';
-			offset++;
-		}
+	MEM(ur->vb = fr_value_box_alloc_null(ur));
+
+	switch (ur->rrtype) {
+	case DNS_TYPE_A:
+		if (rdlen != sizeof(ipaddr.addr.v4)) break;
+
+		ipaddr.af = AF_INET;
+		ipaddr.prefix = 32;
+		memcpy(&ipaddr.addr.v4, rdata, rdlen);
+
+		if (fr_value_box_ipaddr(ur->vb, NULL, &ipaddr, true) < 0) break;
+		return 0;
 
-		rr++;
-		memcpy(out + offset, rr, count);
-		rr += count;
-		offset += count;
+	case DNS_TYPE_AAAA:
+		if (rdlen != sizeof(ipaddr.addr.v6)) break;
+
+		ipaddr.af = AF_INET6;
+		ipaddr.prefix = 128;
+		memcpy(&ipaddr.addr.v6, rdata, rdlen);
+
+		if (fr_value_box_ipaddr(ur->vb, NULL, &ipaddr, true) < 0) break;
+		return 0;
+
+	case DNS_TYPE_PTR:
+		if (dns_name_to_str(name, sizeof(name), packet, end, rdata) < 0) break;
+
+		if (fr_value_box_strdup(ur->vb, ur->vb, NULL, name, true) < 0) break;
+		return 0;
+
+	default:
+		break;
 	}
 
-	*(out + offset) = '\0';
-	return offset;
+	TALLOC_FREE(ur->vb);
+	return -1;
 }
 
-static int ub_common_wait(rlm_unbound_t const *inst, request_t *request,
-			  char const *name, struct ub_result **ub, int async_id)
+/** Extract the first record of the requested type, and the TTL of the answer
+ *
+ * For positive answers the TTL is the lowest TTL of the records in
+ * the answer section, so a CNAME which expires earlier than its target
+ * also expires the cache entry.
+ *
+ * For negative answers the TTL is the lesser of the TTL of the SOA in
+ * the authority section, and its MINIMUM field (RFC 2308).  Negative
+ * answers without an SOA get a TTL of 0, and aren't cached.
+ */
+static int unbound_answer_parse(unbound_request_t *ur, uint8_t const *packet, size_t packet_len)
 {
-	useconds_t iv, waited;
+	uint8_t const	*p, *end = packet + packet_len;
+	uint16_t	qdcount, ancount, nscount, i;
+	uint32_t	negative_ttl = 0;
+
+	if (packet_len < DNS_HDR_LEN) return -1;
+
+	ur->rcode = packet[3] & 0x0f;
+	qdcount = fr_net_to_uint16(packet + 4);
+	ancount = fr_net_to_uint16(packet + 6);
+	nscount = fr_net_to_uint16(packet + 8);
+
+	p = packet + DNS_HDR_LEN;
+	for (i = 0; i < qdcount; i++) {
+		p = dns_name_skip(p, end);
+		if (!p || ((p + 4) > end)) return -1;
+		p += 4;				/* qtype, qclass */
+	}
 
-	iv = inst->timeout > 64 ? 64000 : inst->timeout * 1000;
-	ub_process(inst->ub);
+	ur->ttl = UINT32_MAX;
 
-	for (waited = 0; (void const *)*ub == (void const *)inst; waited += iv, iv *= 2) {
+	for (i = 0; i < (ancount + nscount); i++) {
+		uint16_t	type, class, rdlen;
+		uint32_t	ttl;
+		uint8_t const	*rdata;
 
-		if (waited + iv > (useconds_t)inst->timeout * 1000) {
-			usleep(inst->timeout * 1000 - waited);
-			ub_process(inst->ub);
-			break;
-		}
+		p = dns_name_skip(p, end);
+		if (!p || ((p + 10) > end)) return -1;
 
-		usleep(iv);
+		type = fr_net_to_uint16(p);
+		class = fr_net_to_uint16(p + 2);
+		ttl = fr_net_to_uint32(p + 4);
+		rdlen = fr_net_to_uint16(p + 8);
 
-		/* Check if already handled by event loop */
-		if ((void const *)*ub != (void const *)inst) {
-			break;
-		}
+		rdata = p + 10;
+		p = rdata + rdlen;
+		if (p > end) return -1;
 
-		/* In case we are running single threaded */
-		ub_process(inst->ub);
-	}
+		if (class != DNS_CLASS_IN) continue;
 
-	if ((void const *)*ub == (void const *)inst) {
-		int res;
+		if (i < ancount) {
+			if (ttl < ur->ttl) ur->ttl = ttl;
 
-		REDEBUG2("%s - DNS took too long", name);
+			if ((type != ur->rrtype) || ur->vb) continue;
 
-		res = ub_cancel(inst->ub, async_id);
-		if (res) {
-			REDEBUG("%s - ub_cancel: %s", name, ub_strerror(res));
+			if (unbound_rdata_to_box(ur, packet, end, rdata, rdlen) < 0) return -1;
+			continue;
+		}
+
+		/*
+		 *	The SOA rdata ends with SERIAL, REFRESH, RETRY,
+		 *	EXPIRE and MINIMUM, after two names.
+		 */
+		if ((type == DNS_TYPE_SOA) && (rdlen >= 22)) {
+			uint32_t minimum = fr_net_to_uint32(rdata + rdlen - 4);
+
+			negative_ttl = (ttl < minimum) ? ttl : minimum;
 		}
-		return -1;
 	}
 
+	if (!ur->vb) ur->ttl = negative_ttl;
+
 	return 0;
 }
 
-static int ub_common_fail(request_t *request, char const *name, struct ub_result *ub)
+/** Called by libunbound when a lookup completes
+ *
+ * This is usually called from the worker's event loop, but may be
+ * called from within ub_resolve_event() if libunbound can answer
+ * from local data.
+ */
+static void xlat_unbound_callback(void *mydata, int rcode, void *packet, int packet_len, int sec,
+				  char *why_bogus
+#if UNBOUND_VERSION_MAJOR > 1 || (UNBOUND_VERSION_MAJOR == 1 && UNBOUND_VERSION_MINOR > 7)
+				  , UNUSED int rate_limited
+#endif
+				  )
 {
-	if (ub->bogus) {
-		RWDEBUG("%s - Bogus DNS response", name);
-		return -1;
+	unbound_request_t	*ur = talloc_get_type_abort(mydata, unbound_request_t);
+	request_t		*request = ur->request;
+	rlm_unbound_t const	*inst = ur->t->inst;
+	uint32_t		ttl;
+
+	ur->done = true;
+	ur->rcode = rcode;
+
+	/*
+	 *	sec is 0 for insecure, 1 for bogus and 2 for secure.
+	 */
+	if (sec == 1) {
+		RWDEBUG("%s - Bogus DNS response for %s: %s", ur->xlat_name, ur->name,
+			why_bogus ? why_bogus : "no reason given");
+		goto resume;
 	}
 
-	if (ub->nxdomain) {
-		RDEBUG2("%s - NXDOMAIN", name);
-		return -1;
+	if (!packet) {
+		RDEBUG2("%s - No response for %s", ur->xlat_name, ur->name);
+		goto resume;
 	}
 
-	if (!ub->havedata) {
-		RDEBUG2("%s - Empty result", name);
-		return -1;
+	if (unbound_answer_parse(ur, packet, packet_len) < 0) {
+		RWDEBUG("%s - Malformed DNS response for %s", ur->xlat_name, ur->name);
+		TALLOC_FREE(ur->vb);
+		goto resume;
 	}
 
-	return 0;
+	switch (ur->rcode) {
+	case DNS_RCODE_NOERROR:
+		if (ur->vb) {
+			ttl = inst->cache_max_ttl;
+			break;
+		}
+
+		RDEBUG2("%s - Empty result for %s", ur->xlat_name, ur->name);
+		ttl = inst->cache_negative_ttl;
+		break;
+
+	case DNS_RCODE_NXDOMAIN:
+		RDEBUG2("%s - NXDOMAIN for %s", ur->xlat_name, ur->name);
+		TALLOC_FREE(ur->vb);
+		ttl = inst->cache_negative_ttl;
+		break;
+
+	/*
+	 *	SERVFAIL etc. are not cached
+	 */
+	default:
+		RDEBUG2("%s - DNS rcode %i for %s", ur->xlat_name, ur->rcode, ur->name);
+		TALLOC_FREE(ur->vb);
+		goto resume;
+	}
+
+	if (ur->ttl < ttl) ttl = ur->ttl;
+	if (ttl && (unbound_cache_insert(ur->t->cache, ur->rrtype, ur->name, ur->rcode, ur->vb,
+					 fr_time() + fr_time_delta_from_sec(ttl)) < 0)) {
+		RPWDEBUG("%s - Failed caching answer for %s", ur->xlat_name, ur->name);
+	}
+
+resume:
+	if (ur->yielded) unlang_interpret_resumable(request);
 }
 
-/** Perform a DNS lookup for an A record
- *
- * @ingroup xlat_functions
- */
-static ssize_t xlat_a(TALLOC_CTX *ctx, char **out, size_t outlen,
-		      void const *mod_inst, UNUSED void const *xlat_inst,
-		      request_t *request, char const *fmt)
+static xlat_action_t xlat_unbound_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
+					 UNUSED request_t *request,
+					 UNUSED void const *xlat_inst, UNUSED void *xlat_thread_inst,
+					 UNUSED fr_value_box_t **in, void *rctx)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	unbound_request_t	*ur = talloc_get_type_abort(rctx, unbound_request_t);
+	fr_value_box_t		*vb;
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+	if (!ur->vb) {
+		talloc_free(ur);
+		return XLAT_ACTION_FAIL;
+	}
 
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+	vb = talloc_steal(ctx, ur->vb);
+	talloc_free(ur);
 
-	fmt2 = talloc_typed_strdup(ctx, fmt);
-	ub_resolve_async(inst->ub, fmt2, 1, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+	fr_cursor_insert(out, vb);
 
-	if (ub_common_wait(inst, request, inst->xlat_a_name, ubres, async_id)) {
-		goto error0;
-	}
+	return XLAT_ACTION_DONE;
+}
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_a_name, *ubres)) {
-			goto error1;
-		}
+static void xlat_unbound_timeout(request_t *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
+				 void *rctx, UNUSED fr_time_t fired)
+{
+	unbound_request_t	*ur = talloc_get_type_abort(rctx, unbound_request_t);
+	int			res;
 
-		if (!inet_ntop(AF_INET, (*ubres)->data[0], *out, outlen)) {
-			goto error1;
-		};
+	REDEBUG2("%s - DNS took too long", ur->xlat_name);
 
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
-	}
+	res = ub_cancel(ur->t->ev_b->ub, ur->async_id);
+	if (res) REDEBUG("%s - ub_cancel: %s", ur->xlat_name, ub_strerror(res));
 
-	RWDEBUG("%s - No result", inst->xlat_a_name);
+	ur->done = true;
+	unlang_interpret_resumable(request);
+}
 
- error1:
-	ub_resolve_free(*ubres); /* Handles NULL gracefully */
+static void xlat_unbound_signal(request_t *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
+				void *rctx, fr_state_signal_t action)
+{
+	unbound_request_t	*ur = talloc_get_type_abort(rctx, unbound_request_t);
 
- error0:
-	talloc_free(ubres);
-	return -1;
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	RDEBUG2("%s - Cancelling DNS lookup for %s", ur->xlat_name, ur->name);
+
+	if (!ur->done) (void) ub_cancel(ur->t->ev_b->ub, ur->async_id);
+	talloc_free(ur);
 }
 
-/** Perform a DNS lookup for an AAAA record
+/** Look up a record, from the cache, or by yielding until libunbound answers
  *
- * @ingroup xlat_functions
  */
-static ssize_t xlat_aaaa(TALLOC_CTX *ctx, char **out, size_t outlen,
-			 void const *mod_inst, UNUSED void const *xlat_inst,
-			 request_t *request, char const *fmt)
+static xlat_action_t xlat_unbound(TALLOC_CTX *ctx, fr_cursor_t *out, request_t *request, void *xlat_thread_inst,
+				  fr_value_box_t **in, uint16_t rrtype, char const *xlat_name)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	unbound_xlat_thread_inst_t	*xt = talloc_get_type_abort(xlat_thread_inst, unbound_xlat_thread_inst_t);
+	rlm_unbound_thread_t		*t = xt->t;
+	unbound_cache_entry_t		*entry;
+	unbound_request_t		*ur;
+	fr_value_box_t			*vb;
+	size_t				len;
+	int				res;
+
+	if (!*in) {
+		REDEBUG("%s - Missing owner name", xlat_name);
+		return XLAT_ACTION_FAIL;
+	}
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
+		RPEDEBUG("Failed concatenating input");
+		return XLAT_ACTION_FAIL;
+	}
 
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+	MEM(ur = talloc_zero(ctx, unbound_request_t));
+	ur->request = request;
+	ur->t = t;
+	ur->xlat_name = xlat_name;
+	ur->rrtype = rrtype;
+	MEM(ur->name = talloc_bstrndup(ur, (*in)->vb_strvalue, (*in)->vb_length));
 
-	fmt2 = talloc_typed_strdup(ctx, fmt);
-	ub_resolve_async(inst->ub, fmt2, 28, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+	/*
+	 *	"example.com." and "example.com" are the same
+	 *	name, so they should share a cache entry.
+	 */
+	len = strlen(ur->name);
+	if ((len > 1) && (ur->name[len - 1] == '.')) ur->name[len - 1] = '\0';
 
-	if (ub_common_wait(inst, request, inst->xlat_aaaa_name, ubres, async_id)) {
-		goto error0;
-	}
+	t->lookups++;
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_aaaa_name, *ubres)) {
-			goto error1;
+	entry = unbound_cache_find(t->cache, rrtype, ur->name, fr_time());
+	if (entry) {
+		t->hits++;
+
+		if (!entry->vb) {
+			RDEBUG2("%s - Cached negative answer for %s", xlat_name, ur->name);
+			talloc_free(ur);
+			return XLAT_ACTION_FAIL;
 		}
-		if (!inet_ntop(AF_INET6, (*ubres)->data[0], *out, outlen)) {
-			goto error1;
-		};
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
-	}
 
-	RWDEBUG("%s - No result", inst->xlat_aaaa_name);
+		RDEBUG2("%s - Cached answer for %s", xlat_name, ur->name);
 
-error1:
-	ub_resolve_free(*ubres); /* Handles NULL gracefully */
+		MEM(vb = fr_value_box_alloc_null(ctx));
+		if (fr_value_box_copy(vb, vb, entry->vb) < 0) {
+			RPEDEBUG("Failed copying cached answer");
+			talloc_free(vb);
+			talloc_free(ur);
+			return XLAT_ACTION_FAIL;
+		}
+		talloc_free(ur);
 
-error0:
-	talloc_free(ubres);
-	return -1;
-}
+		fr_cursor_insert(out, vb);
+		return XLAT_ACTION_DONE;
+	}
 
-typedef struct {
-	struct ub_result	*result;	//!< The result from the previous operation.
-} dns_resume_ctx_t;
+	unbound_log_to_request(t->u_log, t->ev_b->ub, request);
+	res = ub_resolve_event(t->ev_b->ub, ur->name, rrtype, DNS_CLASS_IN, ur, xlat_unbound_callback, &ur->async_id);
+	unbound_log_to_global(t->u_log, t->ev_b->ub);
+	if (res) {
+		REDEBUG("%s - %s", xlat_name, ub_strerror(res));
+		talloc_free(ur);
+		return XLAT_ACTION_FAIL;
+	}
 
-/*
-static xlat_action_t xlat_ptr(TALLOC_CTX *ctx, fr_cursor_t *out,
-			      request_t *request, void const *xlat_inst, void *xlat_thread_inst,
-			      fr_value_box_t **in)
-{
-	if (!*in) return XLAT_ACTION_DONE;
+	/*
+	 *	Answered from libunbound's local data
+	 *	without needing to yield.
+	 */
+	if (ur->done) return xlat_unbound_resume(ctx, out, request, NULL, xlat_thread_inst, in, ur);
 
-	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
-		RPEDEBUG("Failed concatenating input string for attribute reference");
+	if (unlang_xlat_event_timeout_add(request, xlat_unbound_timeout, ur,
+					  fr_time() + fr_time_delta_from_msec(t->inst->timeout)) < 0) {
+		RPEDEBUG("Failed adding timeout");
+		(void) ub_cancel(t->ev_b->ub, ur->async_id);
+		talloc_free(ur);
 		return XLAT_ACTION_FAIL;
 	}
 
-	yield_to
+	ur->yielded = true;
+	t->yields++;
+
+	return unlang_xlat_yield(request, xlat_unbound_resume, xlat_unbound_signal, ur);
+}
+
+/** Perform a DNS lookup for an A record
+ *
+ * Only the first A record in the RRSET is returned.
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_a(TALLOC_CTX *ctx, fr_cursor_t *out,
+			    request_t *request, void const *xlat_inst, void *xlat_thread_inst,
+			    fr_value_box_t **in)
+{
+	rlm_unbound_t const *inst = *((rlm_unbound_t const * const *)xlat_inst);
 
+	return xlat_unbound(ctx, out, request, xlat_thread_inst, in, DNS_TYPE_A, inst->xlat_a_name);
+}
+
+/** Perform a DNS lookup for an AAAA record
+ *
+ * Only the first AAAA record in the RRSET is returned.
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_aaaa(TALLOC_CTX *ctx, fr_cursor_t *out,
+			       request_t *request, void const *xlat_inst, void *xlat_thread_inst,
+			       fr_value_box_t **in)
+{
+	rlm_unbound_t const *inst = *((rlm_unbound_t const * const *)xlat_inst);
+
+	return xlat_unbound(ctx, out, request, xlat_thread_inst, in, DNS_TYPE_AAAA, inst->xlat_aaaa_name);
 }
-*/
 
 /** Perform a DNS lookup for a PTR record
  *
  * @ingroup xlat_functions
  */
-static ssize_t xlat_ptr(TALLOC_CTX *ctx, char **out, size_t outlen,
-			void const *mod_inst, UNUSED void const *xlat_inst,
-			request_t *request, char const *fmt)
+static xlat_action_t xlat_ptr(TALLOC_CTX *ctx, fr_cursor_t *out,
+			      request_t *request, void const *xlat_inst, void *xlat_thread_inst,
+			      fr_value_box_t **in)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	rlm_unbound_t const *inst = *((rlm_unbound_t const * const *)xlat_inst);
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+	return xlat_unbound(ctx, out, request, xlat_thread_inst, in, DNS_TYPE_PTR, inst->xlat_ptr_name);
+}
 
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+/** Return one of this thread's counters
+ *
+ * "lookups" is the number of calls to the lookup xlats, "hits" the
+ * number answered from the cache, and "yields" the number which
+ * waited on the event loop for libunbound to answer.
+ *
+ * Example:
+@verbatim
+"%{dns-stats:hits}"
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_stats(TALLOC_CTX *ctx, fr_cursor_t *out,
+				request_t *request, UNUSED void const *xlat_inst, void *xlat_thread_inst,
+				fr_value_box_t **in)
+{
+	unbound_xlat_thread_inst_t	*xt = talloc_get_type_abort(xlat_thread_inst, unbound_xlat_thread_inst_t);
+	rlm_unbound_thread_t		*t = xt->t;
+	fr_value_box_t			*vb;
 
-	fmt2 = talloc_typed_strdup(ctx, fmt);
-	ub_resolve_async(inst->ub, fmt2, 12, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+	if (!*in) {
+		REDEBUG("Missing counter name, expected \"lookups\", \"hits\" or \"yields\"");
+		return XLAT_ACTION_FAIL;
+	}
 
-	if (ub_common_wait(inst, request, inst->xlat_ptr_name,
-			   ubres, async_id)) {
-		goto error0;
+	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
+		RPEDEBUG("Failed concatenating input");
+		return XLAT_ACTION_FAIL;
 	}
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_ptr_name, *ubres)) {
-			goto error1;
-		}
-		if (rrlabels_tostr(*out, (*ubres)->data[0], outlen) < 0) {
-			goto error1;
-		}
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT64, NULL, false));
+
+	if (strcmp((*in)->vb_strvalue, "lookups") == 0) {
+		vb->vb_uint64 = t->lookups;
+
+	} else if (strcmp((*in)->vb_strvalue, "hits") == 0) {
+		vb->vb_uint64 = t->hits;
+
+	} else if (strcmp((*in)->vb_strvalue, "yields") == 0) {
+		vb->vb_uint64 = t->yields;
+
+	} else {
+		REDEBUG("Unknown counter \"%s\", expected \"lookups\", \"hits\" or \"yields\"",
+			(*in)->vb_strvalue);
+		talloc_free(vb);
+		return XLAT_ACTION_FAIL;
 	}
 
-	RWDEBUG("%s - No result", inst->xlat_ptr_name);
+	fr_cursor_insert(out, vb);
 
-error1:
-	ub_resolve_free(*ubres);  /* Handles NULL gracefully */
+	return XLAT_ACTION_DONE;
+}
 
-error0:
-	talloc_free(ubres);
-	return -1;
+/** Resolves and caches the module's thread instance for use by a specific xlat instance
+ *
+ * @param[in] xlat_inst			UNUSED.
+ * @param[in] xlat_thread_inst		pre-allocated structure to hold pointer to module's
+ *					thread instance.
+ * @param[in] exp			UNUSED.
+ * @param[in] uctx			Module's global instance.  Used to lookup thread
+ *					specific instance.
+ * @return 0.
+ */
+static int mod_xlat_thread_instantiate(UNUSED void *xlat_inst, void *xlat_thread_inst,
+				       UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	rlm_unbound_t			*inst = talloc_get_type_abort(uctx, rlm_unbound_t);
+	unbound_xlat_thread_inst_t	*xt = xlat_thread_inst;
+
+	xt->inst = inst;
+	xt->t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_unbound_thread_t);
+
+	return 0;
 }
 
-static int mod_instantiate(void *instance, CONF_SECTION *conf)
+static int mod_xlat_instantiate(void *xlat_inst, UNUSED xlat_exp_t const *exp, void *uctx)
 {
-	rlm_unbound_t	*inst = instance;
-	int		res;
-	char		k[64]; /* To silence const warns until newer unbound in distros */
+	*((void **)xlat_inst) = talloc_get_type_abort(uctx, rlm_unbound_t);
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_unbound_t		*inst = talloc_get_type_abort(instance, rlm_unbound_t);
+	rlm_unbound_thread_t	*t = talloc_get_type_abort(thread, rlm_unbound_thread_t);
+	int			res;
+	char			k[64]; /* To silence const warns until newer unbound in distros */
+
+	t->inst = inst;
 
 	/*
-	 *	@todo - move this to the thread-instantiate function
+	 *	The ub_ctx registers its sockets and timers
+	 *	with this thread's event loop.
 	 */
-	inst->ub = ub_ctx_create();
-	if (!inst->ub) {
-		cf_log_err(conf, "ub_ctx_create failed");
+	if (unbound_io_init(t, &t->ev_b, el) < 0) {
+		PERROR("Failed creating unbound context");
 		return -1;
 	}
 
-	/*
-	 *	Note unbound threads WILL happen with -s option, if it matters.
-	 *	We cannot tell from here whether that option is in effect.
-	 */
-	res = ub_ctx_async(inst->ub, 1);
-	if (res) goto error;
-
 	/* Now load the config file, which can override gleaned settings. */
 	{
 		char *file;
 
 		memcpy(&file, &inst->filename, sizeof(file));
-		res = ub_ctx_config(inst->ub, file);
+		res = ub_ctx_config(t->ev_b->ub, file);
 		if (res) goto error;
 	}
 
-	if (unbound_log_init(inst, &inst->u_log, inst->ub) < 0) goto error;
+	if (unbound_log_init(t, &t->u_log, t->ev_b->ub) < 0) return -1;
 
 	/*
 	 *  Now we need to finalize the context.
@@ -421,18 +701,41 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	 *  data did not exist.
 	 */
 	strcpy(k, "notar33lsite.foo123.nottld A 127.0.0.1");
-	ub_ctx_data_remove(inst->ub, k);
+	ub_ctx_data_remove(t->ev_b->ub, k);
+
+	t->cache = unbound_cache_alloc(t, inst->cache_max_entries);
+	if (!t->cache) {
+		ERROR("Failed allocating DNS cache");
+		return -1;
+	}
+
 	return 0;
 
  error:
-	cf_log_err(conf, "%s", ub_strerror(res));
+	ERROR("%s", ub_strerror(res));
 
 	return -1;
 }
 
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_unbound_thread_t	*t = talloc_get_type_abort(thread, rlm_unbound_thread_t);
+
+	/*
+	 *	Free the ub_ctx (via the event base's destructor)
+	 *	before the log stream it writes to.
+	 */
+	TALLOC_FREE(t->ev_b);
+	TALLOC_FREE(t->u_log);
+	TALLOC_FREE(t->cache);
+
+	return 0;
+}
+
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
-	rlm_unbound_t *inst = instance;
+	rlm_unbound_t	*inst = instance;
+	xlat_t const	*xlat;
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
@@ -445,31 +748,24 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	MEM(inst->xlat_a_name = talloc_typed_asprintf(inst, "%s-a", inst->name));
 	MEM(inst->xlat_aaaa_name = talloc_typed_asprintf(inst, "%s-aaaa", inst->name));
 	MEM(inst->xlat_ptr_name = talloc_typed_asprintf(inst, "%s-ptr", inst->name));
-
-	if (xlat_register_legacy(inst, inst->xlat_a_name, xlat_a, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN) ||
-	    xlat_register_legacy(inst, inst->xlat_aaaa_name, xlat_aaaa, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN) ||
-	    xlat_register_legacy(inst, inst->xlat_ptr_name, xlat_ptr, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN)) {
-		cf_log_err(conf, "Failed registering xlats");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int mod_detach(void *instance)
-{
-	rlm_unbound_t *inst = instance;
-
-	ub_process(inst->ub);
-
-	/*
-	 *	This can hang/leave zombies currently
-	 *	see upstream bug #519
-	 *	...so expect valgrind to complain with -m
-	 */
-	talloc_free(inst->u_log);	/* Free logging first */
-
-	ub_ctx_delete(inst->ub);
+	MEM(inst->xlat_stats_name = talloc_typed_asprintf(inst, "%s-stats", inst->name));
+
+#define UNBOUND_XLAT_REGISTER(_name, _func, _async) \
+	do { \
+		xlat = xlat_register(inst, _name, _func, _async); \
+		if (!xlat) { \
+			cf_log_err(conf, "Failed registering xlats"); \
+			return -1; \
+		} \
+		xlat_async_instantiate_set(xlat, mod_xlat_instantiate, rlm_unbound_t *, NULL, inst); \
+		xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, \
+						  unbound_xlat_thread_inst_t, NULL, inst); \
+	} while (0)
+
+	UNBOUND_XLAT_REGISTER(inst->xlat_a_name, xlat_a, true);
+	UNBOUND_XLAT_REGISTER(inst->xlat_aaaa_name, xlat_aaaa, true);
+	UNBOUND_XLAT_REGISTER(inst->xlat_ptr_name, xlat_ptr, true);
+	UNBOUND_XLAT_REGISTER(inst->xlat_stats_name, xlat_stats, false);
 
 	return 0;
 }
@@ -482,6 +778,9 @@ module_t rlm_unbound = {
 	.inst_size		= sizeof(rlm_unbound_t),
 	.config			= module_config,
 	.bootstrap		= mod_bootstrap,
-	.instantiate		= mod_instantiate,
-	.detach			= mod_detach
+
+	.thread_inst_size	= sizeof(rlm_unbound_thread_t),
+	.thread_inst_type	= "rlm_unbound_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach
 };
@@ -0,0 +1,537 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file protocols/internal/detail.c
+ * @brief Functions to read and write binary detail records, and their indexes.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+#include <freeradius-devel/internal/detail.h>
+#include <freeradius-devel/internal/internal.h>
+#include <freeradius-devel/util/net.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ *	CRC-32 (IEEE 802.3), four bits at a time.  The records are
+ *	small, and this avoids a 1K table.
+ */
+static uint32_t const crc32_nibble[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+static uint32_t detail_crc32(uint32_t crc, uint8_t const *p, size_t len)
+{
+	uint8_t const *end = p + len;
+
+	crc = ~crc;
+	while (p < end) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ crc32_nibble[crc & 0x0f];
+		crc = (crc >> 4) ^ crc32_nibble[crc & 0x0f];
+	}
+
+	return ~crc;
+}
+
+/** CRC a record, skipping the flags, and the CRC itself
+ *
+ */
+static uint32_t detail_record_crc32(uint8_t const *hdr, uint8_t const *pairs, size_t len)
+{
+	uint32_t crc;
+
+	crc = detail_crc32(0, hdr, FR_DETAIL_BINARY_FLAGS_OFFSET);
+	crc = detail_crc32(crc, hdr + FR_DETAIL_BINARY_FLAGS_OFFSET + 1,
+			   FR_DETAIL_BINARY_HDR_LEN - sizeof(uint32_t) - (FR_DETAIL_BINARY_FLAGS_OFFSET + 1));
+
+	return detail_crc32(crc, pairs, len);
+}
+
+/** Return whether the data starts with a binary detail record
+ *
+ * Text detail files start with a date, so this can be used to decide how
+ * to read a file.
+ */
+bool fr_detail_binary_is_binary(uint8_t const *data, size_t data_len)
+{
+	if (data_len < sizeof(uint32_t)) return false;
+
+	return (fr_net_to_uint32(data) == FR_DETAIL_BINARY_MAGIC);
+}
+
+/** Encode a binary detail record
+ *
+ * Pairs which aren't from the protocol dictionary are skipped.  The
+ * source and destination addresses go in the header instead.
+ *
+ * @param[in] dbuff	to write the record to.
+ * @param[in] hdr	Fixed fields of the record.  The length is ignored.
+ * @param[in] cursor	pointing to the first pair to encode.
+ * @param[in] dict	the pairs are encoded relative to.
+ * @return
+ *	- >0 the number of bytes written.
+ *	- <0 on error.
+ */
+ssize_t fr_detail_binary_encode(fr_dbuff_t *dbuff, fr_detail_binary_t const *hdr,
+				fr_cursor_t *cursor, fr_dict_t const *dict)
+{
+	fr_dbuff_t		work_dbuff = FR_DBUFF_NO_ADVANCE(dbuff);
+	fr_dbuff_marker_t	hdr_field;
+	fr_pair_t		*vp;
+	uint8_t			*p;
+	size_t			len;
+
+	fr_dbuff_marker(&hdr_field, &work_dbuff);
+	FR_DBUFF_MEMSET_RETURN(&work_dbuff, 0, FR_DETAIL_BINARY_HDR_LEN);
+
+	while ((vp = fr_cursor_current(cursor))) {
+		ssize_t slen;
+
+		if (fr_dict_by_da(vp->da) != dict) {
+			fr_cursor_next(cursor);
+			continue;
+		}
+
+		slen = fr_internal_encode_pair(&work_dbuff, cursor, NULL);
+		if (slen < 0) return slen;
+		if (slen == 0) fr_cursor_next(cursor);
+	}
+
+	len = fr_dbuff_used(&work_dbuff) - FR_DETAIL_BINARY_HDR_LEN;
+	if (len > FR_DETAIL_BINARY_MAX_LEN) {
+		fr_strerror_printf("Record is too large (%zu bytes)", len);
+		return -1;
+	}
+
+	/*
+	 *	The buffer may have moved if it was extended, but the
+	 *	marker follows it.
+	 */
+	p = fr_dbuff_current(&hdr_field);
+
+	fr_net_from_uint32(p, FR_DETAIL_BINARY_MAGIC);
+	p[4] = FR_DETAIL_BINARY_VERSION;
+	p[5] = hdr->flags;
+	fr_net_from_uint32(p + 8, len);
+	fr_net_from_uint32(p + 12, hdr->code);
+	fr_net_from_uint64(p + 16, hdr->timestamp);
+
+	switch (hdr->src_ipaddr.af) {
+	case AF_INET:
+		p[6] = 4;
+		memcpy(p + 28, &hdr->src_ipaddr.addr.v4, sizeof(hdr->src_ipaddr.addr.v4));
+		memcpy(p + 44, &hdr->dst_ipaddr.addr.v4, sizeof(hdr->dst_ipaddr.addr.v4));
+		break;
+
+	case AF_INET6:
+		p[6] = 6;
+		memcpy(p + 28, &hdr->src_ipaddr.addr.v6, sizeof(hdr->src_ipaddr.addr.v6));
+		memcpy(p + 44, &hdr->dst_ipaddr.addr.v6, sizeof(hdr->dst_ipaddr.addr.v6));
+		break;
+
+	default:
+		break;
+	}
+
+	if (p[6]) {
+		fr_net_from_uint16(p + 24, hdr->src_port);
+		fr_net_from_uint16(p + 26, hdr->dst_port);
+	}
+
+	fr_net_from_uint32(p + 60, detail_record_crc32(p, p + FR_DETAIL_BINARY_HDR_LEN, len));
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
+/** Decode the fixed fields of a binary detail record
+ *
+ * @param[out] hdr	Where to write the fields.
+ * @param[in] data	the record.
+ * @param[in] data_len	Length of the data.
+ * @return
+ *	- FR_DETAIL_BINARY_HDR_LEN on success.
+ *	- 0 if there isn't enough data for a header.
+ *	- <0 if the data isn't a valid header.
+ */
+ssize_t fr_detail_binary_hdr_decode(fr_detail_binary_t *hdr, uint8_t const *data, size_t data_len)
+{
+	if (data_len < FR_DETAIL_BINARY_HDR_LEN) return 0;
+
+	if (!fr_detail_binary_is_binary(data, data_len)) {
+		fr_strerror_printf("Missing sync marker");
+		return -1;
+	}
+
+	if (data[4] != FR_DETAIL_BINARY_VERSION) {
+		fr_strerror_printf("Unknown record version %u", data[4]);
+		return -1;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+
+	hdr->flags = data[5];
+	hdr->length = fr_net_to_uint32(data + 8);
+	hdr->code = fr_net_to_uint32(data + 12);
+	hdr->timestamp = fr_net_to_uint64(data + 16);
+
+	if (hdr->length > FR_DETAIL_BINARY_MAX_LEN) {
+		fr_strerror_printf("Invalid record length %u", hdr->length);
+		return -1;
+	}
+
+	switch (data[6]) {
+	case 0:
+		hdr->src_ipaddr.af = hdr->dst_ipaddr.af = AF_UNSPEC;
+		return FR_DETAIL_BINARY_HDR_LEN;
+
+	case 4:
+		hdr->src_ipaddr.af = hdr->dst_ipaddr.af = AF_INET;
+		hdr->src_ipaddr.prefix = hdr->dst_ipaddr.prefix = 32;
+		memcpy(&hdr->src_ipaddr.addr.v4, data + 28, sizeof(hdr->src_ipaddr.addr.v4));
+		memcpy(&hdr->dst_ipaddr.addr.v4, data + 44, sizeof(hdr->dst_ipaddr.addr.v4));
+		break;
+
+	case 6:
+		hdr->src_ipaddr.af = hdr->dst_ipaddr.af = AF_INET6;
+		hdr->src_ipaddr.prefix = hdr->dst_ipaddr.prefix = 128;
+		memcpy(&hdr->src_ipaddr.addr.v6, data + 28, sizeof(hdr->src_ipaddr.addr.v6));
+		memcpy(&hdr->dst_ipaddr.addr.v6, data + 44, sizeof(hdr->dst_ipaddr.addr.v6));
+		break;
+
+	default:
+		fr_strerror_printf("Invalid address family %u", data[6]);
+		return -1;
+	}
+
+	hdr->src_port = fr_net_to_uint16(data + 24);
+	hdr->dst_port = fr_net_to_uint16(data + 26);
+
+	return FR_DETAIL_BINARY_HDR_LEN;
+}
+
+/** Check the CRC of a complete record
+ *
+ * @param[in] data	the record, starting with the header.
+ * @param[in] data_len	Length of the data.  Must be at least the length
+ *			of the header and the pairs.
+ * @return
+ *	- 0 if the record is intact.
+ *	- -1 if it isn't.
+ */
+int fr_detail_binary_verify(uint8_t const *data, size_t data_len)
+{
+	uint32_t	len, crc;
+
+	if (data_len < FR_DETAIL_BINARY_HDR_LEN) {
+		fr_strerror_printf("Record is truncated");
+		return -1;
+	}
+
+	len = fr_net_to_uint32(data + 8);
+	if ((data_len - FR_DETAIL_BINARY_HDR_LEN) < len) {
+		fr_strerror_printf("Record is truncated");
+		return -1;
+	}
+
+	crc = detail_record_crc32(data, data + FR_DETAIL_BINARY_HDR_LEN, len);
+	if (crc != fr_net_to_uint32(data + 60)) {
+		fr_strerror_printf("Record CRC mismatch, expected %08x got %08x", fr_net_to_uint32(data + 60), crc);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Decode the pairs from a binary detail record
+ *
+ * @param[in] ctx	to allocate the pairs in.
+ * @param[in] cursor	to append the pairs to.
+ * @param[in] dict	the pairs were encoded relative to.
+ * @param[in] data	the pairs, i.e. the record after the header.
+ * @param[in] data_len	the length of the pairs, from the header.
+ * @return
+ *	- The number of bytes decoded.
+ *	- <0 on error.
+ */
+ssize_t fr_detail_binary_decode_pairs(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_t const *dict,
+				      uint8_t const *data, size_t data_len)
+{
+	uint8_t const *p = data, *end = data + data_len;
+
+	while (p < end) {
+		ssize_t slen;
+
+		slen = fr_internal_decode_pair(ctx, cursor, dict, p, end - p, NULL);
+		if (slen <= 0) return -((p - data) + 1);
+
+		p += slen;
+	}
+
+	return p - data;
+}
+
+/** Find the next sync marker
+ *
+ * @param[in] data	to search.
+ * @param[in] data_len	Length of the data.
+ * @return
+ *	- The offset of the next sync marker.
+ *	- -1 if there isn't one.
+ */
+ssize_t fr_detail_binary_sync(uint8_t const *data, size_t data_len)
+{
+	uint8_t const	*p = data, *end = data + data_len;
+	uint8_t		magic[sizeof(uint32_t)];
+
+	fr_net_from_uint32(magic, FR_DETAIL_BINARY_MAGIC);
+
+	while ((end - p) >= (ssize_t) sizeof(magic)) {
+		p = memchr(p, magic[0], (end - p) - (sizeof(magic) - 1));
+		if (!p) break;
+
+		if (memcmp(p, magic, sizeof(magic)) == 0) return p - data;
+		p++;
+	}
+
+	return -1;
+}
+
+/** Return the name of the index for a detail file
+ *
+ */
+char *fr_detail_index_name(TALLOC_CTX *ctx, char const *filename)
+{
+	return talloc_typed_asprintf(ctx, "%s.idx", filename);
+}
+
+static int detail_index_write(int fd, uint8_t const *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t slen;
+
+		slen = write(fd, data, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		data += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+/** Write an index for a binary detail file
+ *
+ * The index is written to a temporary file, and renamed into place, so
+ * that readers never see a partial index.
+ *
+ * @param[in] filename	of the binary detail file.
+ * @param[in] interval	Write an index entry for every interval records.
+ * @return
+ *	- The number of index entries written.
+ *	- -1 on error.
+ */
+int fr_detail_index_build(char const *filename, uint32_t interval)
+{
+	int			fd, idx_fd = -1, ret = -1, entries = 0;
+	struct stat		st;
+	off_t			offset = 0;
+	uint64_t		count = 0;
+	fr_unix_time_t		latest = 0;
+	char			*idx_name, *tmp_name;
+	uint8_t			buffer[4096];
+	fr_detail_binary_t	hdr;
+
+	if (!interval) interval = 1;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fr_strerror_printf("Failed examining %s: %s", filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	idx_name = fr_detail_index_name(NULL, filename);
+	tmp_name = talloc_typed_asprintf(idx_name, "%s.tmp", idx_name);
+
+	idx_fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0666);
+	if (idx_fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", tmp_name, fr_syserror(errno));
+		goto finish;
+	}
+
+	/*
+	 *	Leave room for the header.  We don't know how much of
+	 *	the file we've covered until we're done.
+	 */
+	memset(buffer, 0, FR_DETAIL_INDEX_HDR_LEN);
+	if (detail_index_write(idx_fd, buffer, FR_DETAIL_INDEX_HDR_LEN) < 0) {
+	write_error:
+		fr_strerror_printf("Failed writing %s: %s", tmp_name, fr_syserror(errno));
+		goto finish;
+	}
+
+	while ((offset + FR_DETAIL_BINARY_HDR_LEN) <= st.st_size) {
+		ssize_t		slen;
+		uint8_t		entry[FR_DETAIL_INDEX_ENTRY_LEN];
+
+		slen = pread(fd, buffer, sizeof(buffer), offset);
+		if (slen < FR_DETAIL_BINARY_HDR_LEN) break;
+
+		/*
+		 *	Skip garbage.  The reader checks the CRCs, so
+		 *	the index only has to point near the records.
+		 */
+		if ((fr_detail_binary_hdr_decode(&hdr, buffer, slen) <= 0) ||
+		    ((offset + FR_DETAIL_BINARY_HDR_LEN + hdr.length) > st.st_size)) {
+			ssize_t skip;
+
+			skip = fr_detail_binary_sync(buffer + 1, slen - 1);
+			offset += (skip < 0) ? (slen - (ssize_t) (sizeof(uint32_t) - 1)) : (skip + 1);
+			continue;
+		}
+
+		if ((count++ % interval) == 0) {
+			fr_net_from_uint64(entry, latest);
+			fr_net_from_uint64(entry + 8, offset);
+			if (detail_index_write(idx_fd, entry, sizeof(entry)) < 0) goto write_error;
+			entries++;
+		}
+
+		if (hdr.timestamp > latest) latest = hdr.timestamp;
+		offset += FR_DETAIL_BINARY_HDR_LEN + hdr.length;
+	}
+
+	fr_net_from_uint32(buffer, FR_DETAIL_INDEX_MAGIC);
+	fr_net_from_uint32(buffer + 4, FR_DETAIL_INDEX_VERSION);
+	fr_net_from_uint64(buffer + 8, st.st_ino);
+	fr_net_from_uint64(buffer + 16, offset);
+	fr_net_from_uint32(buffer + 24, interval);
+	memset(buffer + 28, 0, 4);
+
+	if (pwrite(idx_fd, buffer, FR_DETAIL_INDEX_HDR_LEN, 0) != FR_DETAIL_INDEX_HDR_LEN) goto write_error;
+
+	if (rename(tmp_name, idx_name) < 0) {
+		fr_strerror_printf("Failed renaming %s to %s: %s", tmp_name, idx_name, fr_syserror(errno));
+		goto finish;
+	}
+
+	ret = entries;
+
+finish:
+	if (idx_fd >= 0) {
+		close(idx_fd);
+		if (ret < 0) unlink(tmp_name);
+	}
+	close(fd);
+	talloc_free(idx_name);
+
+	return ret;
+}
+
+/** Use the index to find where to start reading a binary detail file
+ *
+ * @param[in] filename	of the binary detail file.
+ * @param[in] st	of the binary detail file.  The index must have been
+ *			built for the same file, or a file it was renamed from.
+ * @param[in] when	Find the first record with a timestamp at or after this.
+ * @return
+ *	- The offset to start reading from.  Every record before it is
+ *	  earlier than "when".  Records after it may still be earlier.
+ *	- -1 if there is no usable index.
+ */
+off_t fr_detail_index_find(char const *filename, struct stat const *st, fr_unix_time_t when)
+{
+	int		fd;
+	char		*idx_name;
+	struct stat	idx_st;
+	uint8_t		buffer[FR_DETAIL_INDEX_HDR_LEN];
+	uint64_t	covered, lo, hi;
+	off_t		offset = -1;
+
+	idx_name = fr_detail_index_name(NULL, filename);
+	fd = open(idx_name, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", idx_name, fr_syserror(errno));
+		talloc_free(idx_name);
+		return -1;
+	}
+
+	if ((fstat(fd, &idx_st) < 0) ||
+	    (pread(fd, buffer, FR_DETAIL_INDEX_HDR_LEN, 0) != FR_DETAIL_INDEX_HDR_LEN) ||
+	    (fr_net_to_uint32(buffer) != FR_DETAIL_INDEX_MAGIC) ||
+	    (fr_net_to_uint32(buffer + 4) != FR_DETAIL_INDEX_VERSION)) {
+		fr_strerror_printf("Invalid index %s", idx_name);
+		goto finish;
+	}
+
+	/*
+	 *	Detail files are only ever appended to.
+	 */
+	covered = fr_net_to_uint64(buffer + 16);
+	if ((fr_net_to_uint64(buffer + 8) != (uint64_t) st->st_ino) || (covered > (uint64_t) st->st_size)) {
+		fr_strerror_printf("Index %s is for a different file", idx_name);
+		goto finish;
+	}
+
+	/*
+	 *	Find the last entry where every record before it is
+	 *	earlier than "when".
+	 */
+	offset = 0;
+	lo = 0;
+	hi = (idx_st.st_size - FR_DETAIL_INDEX_HDR_LEN) / FR_DETAIL_INDEX_ENTRY_LEN;
+	while (lo < hi) {
+		uint64_t	mid = lo + ((hi - lo) / 2);
+		uint8_t		entry[FR_DETAIL_INDEX_ENTRY_LEN];
+
+		if (pread(fd, entry, sizeof(entry),
+			  FR_DETAIL_INDEX_HDR_LEN + (mid * FR_DETAIL_INDEX_ENTRY_LEN)) != sizeof(entry)) {
+			fr_strerror_printf("Failed reading %s", idx_name);
+			offset = -1;
+			break;
+		}
+
+		if (fr_net_to_uint64(entry) < when) {
+			offset = fr_net_to_uint64(entry + 8);
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+finish:
+	close(fd);
+	talloc_free(idx_name);
+
+	return offset;
+}
@@ -0,0 +1,127 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file protocols/internal/detail.h
+ * @brief Binary detail file records, and their indexes.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/cursor.h>
+#include <freeradius-devel/util/dbuff.h>
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/pair.h>
+#include <freeradius-devel/util/time.h>
+
+#include <sys/stat.h>
+#include <talloc.h>
+
+/*
+ *	Every record starts with the magic number, so a reader can
+ *	find the next record after a damaged one.
+ *
+ *	0                   1                   2                   3
+ *	0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                       Magic ("FRDB")                          |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|    Version    |     Flags     |    Family     |   Reserved    |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                     Length of the pairs                       |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                         Packet code                           |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                 Timestamp (ns since the epoch)                |
+ *	|                                                               |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|         Source port           |       Destination port        |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                  Source address (16 octets)                   |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|               Destination address (16 octets)                 |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                            CRC-32                             |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|              Pairs, in the internal encoding ...
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ *	The CRC covers the header and the pairs, except for the flags,
+ *	so that a reader can mark the record as done in place.
+ */
+#define FR_DETAIL_BINARY_MAGIC		0x46524442
+#define FR_DETAIL_BINARY_VERSION	1
+#define FR_DETAIL_BINARY_HDR_LEN	64
+#define FR_DETAIL_BINARY_FLAGS_OFFSET	5		//!< Where the flags are, for marking records as done.
+#define FR_DETAIL_BINARY_MAX_LEN	(1 << 24)	//!< Anything larger than this is garbage.
+
+#define FR_DETAIL_BINARY_FLAG_DONE	0x01		//!< The record has been processed.
+
+/*
+ *	The index is a header, followed by (timestamp, offset) entries.
+ *	Each timestamp is the latest timestamp of any record before the
+ *	offset, so the entries are sorted by both fields, even if the
+ *	records aren't quite in time order.
+ */
+#define FR_DETAIL_INDEX_MAGIC		0x46524449
+#define FR_DETAIL_INDEX_VERSION		1
+#define FR_DETAIL_INDEX_HDR_LEN		32
+#define FR_DETAIL_INDEX_ENTRY_LEN	16
+
+/** The fixed fields of a binary detail record
+ *
+ */
+typedef struct {
+	uint8_t			flags;			//!< FR_DETAIL_BINARY_FLAG_*
+	uint32_t		length;			//!< Length of the encoded pairs.
+	uint32_t		code;			//!< Packet code.
+	fr_unix_time_t		timestamp;		//!< When the packet was received.
+
+	fr_ipaddr_t		src_ipaddr;		//!< af is AF_UNSPEC if the addresses weren't written.
+	fr_ipaddr_t		dst_ipaddr;
+	uint16_t		src_port;
+	uint16_t		dst_port;
+} fr_detail_binary_t;
+
+/** Where to find the first record at or after a given time
+ *
+ */
+typedef struct {
+	fr_unix_time_t		timestamp;		//!< Latest timestamp of any record before the offset.
+	uint64_t		offset;			//!< Offset of a record.
+} fr_detail_index_entry_t;
+
+bool	fr_detail_binary_is_binary(uint8_t const *data, size_t data_len);
+
+ssize_t	fr_detail_binary_encode(fr_dbuff_t *dbuff, fr_detail_binary_t const *hdr,
+				fr_cursor_t *cursor, fr_dict_t const *dict);
+
+ssize_t	fr_detail_binary_hdr_decode(fr_detail_binary_t *hdr, uint8_t const *data, size_t data_len);
+
+int	fr_detail_binary_verify(uint8_t const *data, size_t data_len);
+
+ssize_t	fr_detail_binary_decode_pairs(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_t const *dict,
+				      uint8_t const *data, size_t data_len);
+
+ssize_t	fr_detail_binary_sync(uint8_t const *data, size_t data_len);
+
+char	*fr_detail_index_name(TALLOC_CTX *ctx, char const *filename);
+
+int	fr_detail_index_build(char const *filename, uint32_t interval);
+
+off_t	fr_detail_index_find(char const *filename, struct stat const *st, fr_unix_time_t when);
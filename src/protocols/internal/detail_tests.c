@@ -0,0 +1,276 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/internal/detail.h>
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/util/pair_legacy.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ *	Run from the top of the source tree, or set DICT_DIR.
+ */
+static fr_dict_t	*dict_freeradius;
+static fr_dict_t	*dict_radius;
+
+static void test_init(void)
+{
+	char const *dict_dir;
+
+	if (dict_radius) return;
+
+	dict_dir = getenv("DICT_DIR");
+	if (!dict_dir) dict_dir = "share/dictionary";
+
+	if (!fr_dict_global_ctx_init(NULL, dict_dir) ||
+	    (fr_dict_internal_afrom_file(&dict_freeradius, FR_DICTIONARY_INTERNAL_DIR) < 0) ||
+	    (fr_dict_protocol_afrom_file(&dict_radius, "radius", NULL) < 0)) {
+		fr_perror("detail_tests");
+		fr_exit_now(EXIT_FAILURE);
+	}
+}
+
+static fr_pair_t *test_pairs(bool internal)
+{
+	fr_pair_t	*vps = NULL, *vp;
+
+	TEST_CHECK(fr_pair_list_afrom_str(NULL, dict_radius,
+					  "User-Name = \"bob\", NAS-Port = 42, Framed-IP-Address = 192.0.2.10, "
+					  "Acct-Session-Id = \"0123456789abcdef\", Acct-Status-Type = Start",
+					  &vps) > 0);
+
+	if (!internal) return vps;
+
+	/*
+	 *	Not from the protocol dictionary, so it's not written.
+	 */
+	vp = NULL;
+	TEST_CHECK(fr_pair_list_afrom_str(NULL, dict_freeradius, "Tmp-Integer-0 = 1", &vp) > 0);
+	fr_pair_add(&vps, vp);
+
+	return vps;
+}
+
+static void test_hdr(fr_detail_binary_t *hdr, uint32_t seconds)
+{
+	memset(hdr, 0, sizeof(*hdr));
+
+	hdr->code = 4;
+	hdr->timestamp = fr_unix_time_from_sec(seconds);
+	TEST_CHECK(fr_inet_pton4(&hdr->src_ipaddr, "192.0.2.1", -1, false, false, false) == 0);
+	TEST_CHECK(fr_inet_pton4(&hdr->dst_ipaddr, "192.0.2.2", -1, false, false, false) == 0);
+	hdr->src_port = 1645;
+	hdr->dst_port = 1813;
+}
+
+static ssize_t test_encode(uint8_t *buffer, size_t buffer_len, fr_detail_binary_t const *hdr)
+{
+	fr_dbuff_t	dbuff = FR_DBUFF_TMP(buffer, buffer_len);
+	fr_pair_t	*vps;
+	fr_cursor_t	cursor;
+	ssize_t		slen;
+
+	vps = test_pairs(true);
+	fr_cursor_init(&cursor, &vps);
+	slen = fr_detail_binary_encode(&dbuff, hdr, &cursor, dict_radius);
+	fr_pair_list_free(&vps);
+
+	TEST_CHECK(slen > FR_DETAIL_BINARY_HDR_LEN);
+	TEST_MSG("encode failed: %s", fr_strerror());
+
+	return slen;
+}
+
+/*
+ *	Everything which is encoded must come back out.
+ */
+static void detail_encode_decode(void)
+{
+	uint8_t			buffer[1024];
+	ssize_t			slen;
+	fr_detail_binary_t	in, out;
+	fr_pair_t		*expected, *decoded = NULL;
+	fr_cursor_t		cursor;
+
+	test_init();
+	test_hdr(&in, 1600000000);
+
+	slen = test_encode(buffer, sizeof(buffer), &in);
+
+	TEST_CHECK(fr_detail_binary_is_binary(buffer, slen));
+	TEST_CHECK(fr_detail_binary_verify(buffer, slen) == 0);
+	TEST_MSG("verify failed: %s", fr_strerror());
+
+	TEST_CHECK(fr_detail_binary_hdr_decode(&out, buffer, slen) == FR_DETAIL_BINARY_HDR_LEN);
+	TEST_CHECK(out.flags == 0);
+	TEST_CHECK(out.length == (size_t) slen - FR_DETAIL_BINARY_HDR_LEN);
+	TEST_CHECK(out.code == in.code);
+	TEST_CHECK(out.timestamp == in.timestamp);
+	TEST_CHECK(fr_ipaddr_cmp(&out.src_ipaddr, &in.src_ipaddr) == 0);
+	TEST_CHECK(fr_ipaddr_cmp(&out.dst_ipaddr, &in.dst_ipaddr) == 0);
+	TEST_CHECK(out.src_port == in.src_port);
+	TEST_CHECK(out.dst_port == in.dst_port);
+
+	fr_cursor_init(&cursor, &decoded);
+	TEST_CHECK(fr_detail_binary_decode_pairs(NULL, &cursor, dict_radius,
+						 buffer + FR_DETAIL_BINARY_HDR_LEN, out.length) == out.length);
+
+	/*
+	 *	The internal attribute was skipped.
+	 */
+	expected = test_pairs(false);
+	TEST_CHECK(fr_pair_list_cmp(&expected, &decoded) == 0);
+
+	fr_pair_list_free(&expected);
+	fr_pair_list_free(&decoded);
+
+	/*
+	 *	Not enough data for a header.
+	 */
+	TEST_CHECK(fr_detail_binary_hdr_decode(&out, buffer, FR_DETAIL_BINARY_HDR_LEN - 1) == 0);
+	TEST_CHECK(!fr_detail_binary_is_binary((uint8_t const *) "Mon Jan  1", 10));
+}
+
+/*
+ *	Changing any byte except the flags must be caught by the CRC.
+ */
+static void detail_crc(void)
+{
+	uint8_t			buffer[1024];
+	ssize_t			slen, i;
+	fr_detail_binary_t	hdr;
+
+	test_init();
+	test_hdr(&hdr, 1600000000);
+
+	slen = test_encode(buffer, sizeof(buffer), &hdr);
+
+	for (i = 0; i < slen; i++) {
+		buffer[i] ^= 0x20;
+
+		if (i == FR_DETAIL_BINARY_FLAGS_OFFSET) {
+			TEST_CHECK(fr_detail_binary_verify(buffer, slen) == 0);
+			TEST_MSG("changing the flags broke the CRC");
+		} else {
+			TEST_CHECK(fr_detail_binary_verify(buffer, slen) < 0);
+			TEST_MSG("corrupting offset %zd wasn't detected", i);
+		}
+
+		buffer[i] ^= 0x20;
+	}
+
+	TEST_CHECK(fr_detail_binary_verify(buffer, slen) == 0);
+	TEST_CHECK(fr_detail_binary_verify(buffer, slen - 1) < 0);
+}
+
+/*
+ *	A reader must be able to find the next record after garbage.
+ */
+static void detail_sync(void)
+{
+	uint8_t			buffer[1024];
+	ssize_t			slen;
+	fr_detail_binary_t	hdr;
+	size_t			garbage = 13;
+
+	test_init();
+	test_hdr(&hdr, 1600000000);
+
+	/*
+	 *	Garbage, including the start of a sync marker.
+	 */
+	memset(buffer, 0xaa, garbage);
+	memcpy(buffer + 5, "FRD", 3);
+
+	slen = test_encode(buffer + garbage, sizeof(buffer) - garbage, &hdr);
+
+	TEST_CHECK(fr_detail_binary_sync(buffer, garbage + slen) == (ssize_t) garbage);
+	TEST_CHECK(fr_detail_binary_sync(buffer, garbage) == -1);
+}
+
+/*
+ *	Write records a second apart, and check that every lookup
+ *	returns a record boundary, with only earlier records before
+ *	it, and no more than one index interval before the first
+ *	record which matches.
+ */
+#define INDEX_RECORDS	100
+#define INDEX_INTERVAL	10
+#define INDEX_START	1600000000
+
+static void detail_index(void)
+{
+	char			filename[] = "/tmp/detail_tests.XXXXXX";
+	char			*idx_name;
+	int			fd, i;
+	off_t			offsets[INDEX_RECORDS + 1];
+	struct stat		st, other;
+	uint8_t			buffer[1024];
+	fr_detail_binary_t	hdr;
+
+	test_init();
+
+	fd = mkstemp(filename);
+	TEST_ASSERT(fd >= 0);
+
+	offsets[0] = 0;
+	for (i = 0; i < INDEX_RECORDS; i++) {
+		ssize_t slen;
+
+		test_hdr(&hdr, INDEX_START + i);
+		slen = test_encode(buffer, sizeof(buffer), &hdr);
+		TEST_CHECK(write(fd, buffer, slen) == slen);
+
+		offsets[i + 1] = offsets[i] + slen;
+	}
+	close(fd);
+
+	TEST_CHECK(fr_detail_index_build(filename, INDEX_INTERVAL) == INDEX_RECORDS / INDEX_INTERVAL);
+	TEST_MSG("index build failed: %s", fr_strerror());
+
+	TEST_CHECK(stat(filename, &st) == 0);
+
+	for (i = 0; i <= INDEX_RECORDS; i++) {
+		off_t	offset;
+		int	first;
+
+		offset = fr_detail_index_find(filename, &st, fr_unix_time_from_sec(INDEX_START + i));
+		TEST_CHECK(offset >= 0);
+		TEST_MSG("lookup for record %d failed: %s", i, fr_strerror());
+
+		for (first = 0; first <= INDEX_RECORDS; first++) {
+			if (offsets[first] == offset) break;
+		}
+		TEST_CHECK(first <= INDEX_RECORDS);
+		TEST_MSG("lookup for record %d returned %zu, which isn't a record", i, (size_t) offset);
+
+		TEST_CHECK(first <= i);
+		TEST_MSG("lookup for record %d skipped it, returning record %d", i, first);
+
+		TEST_CHECK((i - first) <= INDEX_INTERVAL);
+		TEST_MSG("lookup for record %d returned record %d", i, first);
+	}
+
+	/*
+	 *	The index is only for the file it was built from.
+	 */
+	TEST_CHECK(stat("/", &other) == 0);
+	TEST_CHECK(fr_detail_index_find(filename, &other, fr_unix_time_from_sec(INDEX_START)) < 0);
+
+	idx_name = fr_detail_index_name(NULL, filename);
+	unlink(idx_name);
+	talloc_free(idx_name);
+
+	TEST_CHECK(fr_detail_index_find(filename, &st, fr_unix_time_from_sec(INDEX_START)) < 0);
+
+	unlink(filename);
+}
+
+TEST_LIST = {
+	{ "detail_encode_decode",	detail_encode_decode	},
+	{ "detail_crc",			detail_crc		},
+	{ "detail_sync",		detail_sync		},
+	{ "detail_index",		detail_index		},
+	{ NULL }
+};
@@ -28,6 +28,7 @@
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/log.h>
 #include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/thread_local.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/struct.h>
 #include <freeradius-devel/protocol/tacacs/dictionary.h>
@@ -129,11 +130,74 @@ void fr_tacacs_free(void)
 	fr_dict_autofree(libfreeradius_tacacs_dict);
 }
 
+/** XOR one block of the pseudo pad into the body
+ *
+ */
+static inline CC_HINT(always_inline) void tacacs_xor_block(uint8_t *body, uint8_t const pad[static MD5_DIGEST_LENGTH])
+{
+	uint64_t	b[2], p[2];
+
+	/*
+	 *	memcpy() rather than casts, as the body may not
+	 *	be aligned.  The compiler turns these into plain
+	 *	loads and stores.
+	 */
+	memcpy(b, body, sizeof(b));
+	memcpy(p, pad, sizeof(p));
+	b[0] ^= p[0];
+	b[1] ^= p[1];
+	memcpy(body, b, sizeof(b));
+}
+
+static _Thread_local fr_md5_ctx_t *md5_ctx_prefix_tl;
+
+static void _tacacs_md5_ctx_prefix_free_on_exit(void *arg)
+{
+	fr_md5_ctx_t *ctx = arg;
+
+	fr_md5_ctx_free(&ctx);
+}
+
+/** Return the thread local context used to hold the pad prefix state
+ *
+ * fr_md5_ctx_alloc(true) always returns the same context, so the
+ * prefix needs a context of its own.  It's allocated once per thread
+ * and reset after each packet.  It's registered after the MD5 code's
+ * own thread local state, so it's freed before that state is.
+ */
+static fr_md5_ctx_t *tacacs_md5_ctx_prefix(void)
+{
+	fr_md5_ctx_t *ctx;
+
+	if (likely(md5_ctx_prefix_tl != NULL)) return md5_ctx_prefix_tl;
+
+	ctx = fr_md5_ctx_alloc(false);
+	if (unlikely(!ctx)) return NULL;
+	fr_thread_local_set_destructor(md5_ctx_prefix_tl, _tacacs_md5_ctx_prefix_free_on_exit, ctx);
+
+	return ctx;
+}
+
+/** Obfuscate or de-obfuscate a packet body
+ *
+ * The pseudo pad is:
+ *
+ *	MD5_1 = MD5{session_id, key, version, seq_no}
+ *	MD5_n = MD5{session_id, key, version, seq_no, MD5_n-1}
+ *
+ * Nothing is allocated per packet.  The MD5 input is fed to a thread
+ * local context, rather than being copied into a buffer.  When the
+ * {session_id, key, version, seq_no} prefix fills at least one MD5
+ * block, its state is calculated once per packet in a second thread
+ * local context, and copied for each block of the pad.  The prefix
+ * starts with the session_id, so it can't be cached across packets.
+ */
 int fr_tacacs_body_xor(fr_tacacs_packet_t const *pkt, uint8_t *body, size_t body_len, char const *secret, size_t secret_len)
 {
-	uint8_t pad[MD5_DIGEST_LENGTH];
-	uint8_t *buf;
-	int pad_offset;
+	uint8_t		pad[MD5_DIGEST_LENGTH];
+	fr_md5_ctx_t	*md5_ctx, *md5_ctx_prefix = NULL;
+	size_t		prefix_len;
+	uint8_t		*p, *end;
 
 	if (!secret) {
 		if (pkt->hdr.flags & FR_TAC_PLUS_UNENCRYPTED_FLAG)
@@ -149,32 +213,72 @@ int fr_tacacs_body_xor(fr_tacacs_packet_t const *pkt, uint8_t *body, size_t body
 		return -1;
 	}
 
-	pad_offset = sizeof(pkt->hdr.session_id) + secret_len + sizeof(pkt->hdr.version) + sizeof(pkt->hdr.seq_no);
+	if (body_len == 0) return 0;
 
-	/* MD5_1 = MD5{session_id, key, version, seq_no} */
-	/* MD5_n = MD5{session_id, key, version, seq_no, MD5_n-1} */
-	buf = talloc_array(NULL, uint8_t, pad_offset + MD5_DIGEST_LENGTH);
+	prefix_len = sizeof(pkt->hdr.session_id) + secret_len + sizeof(pkt->hdr.version) + sizeof(pkt->hdr.seq_no);
+
+	md5_ctx = fr_md5_ctx_alloc(true);
+	if (!md5_ctx) return -1;
+
+#define TACACS_PAD_PREFIX(_ctx) \
+do { \
+	fr_md5_update(_ctx, (uint8_t const *) &pkt->hdr.session_id, sizeof(pkt->hdr.session_id)); \
+	fr_md5_update(_ctx, (uint8_t const *) secret, secret_len); \
+	fr_md5_update(_ctx, &pkt->hdr.version, sizeof(pkt->hdr.version)); \
+	fr_md5_update(_ctx, &pkt->hdr.seq_no, sizeof(pkt->hdr.seq_no)); \
+} while (0)
+
+	/*
+	 *	Copying the context is only cheaper than re-hashing
+	 *	the prefix if the prefix fills a whole MD5 block, and
+	 *	more than one pad block is needed.
+	 */
+	if ((prefix_len >= 64) && (body_len > MD5_DIGEST_LENGTH)) {
+		md5_ctx_prefix = tacacs_md5_ctx_prefix();
+		if (md5_ctx_prefix) TACACS_PAD_PREFIX(md5_ctx_prefix);
+	}
 
-	memcpy(&buf[0], &pkt->hdr.session_id, sizeof(pkt->hdr.session_id));
-	memcpy(&buf[sizeof(pkt->hdr.session_id)], secret, secret_len);
-	memcpy(&buf[sizeof(pkt->hdr.session_id) + secret_len], &pkt->hdr.version, sizeof(pkt->hdr.version));
-	memcpy(&buf[sizeof(pkt->hdr.session_id) + secret_len + sizeof(pkt->hdr.version)], &pkt->hdr.seq_no, sizeof(pkt->hdr.seq_no));
+	/* MD5_1 = MD5{session_id, key, version, seq_no} */
+	if (md5_ctx_prefix) {
+		fr_md5_ctx_copy(md5_ctx, md5_ctx_prefix);
+	} else {
+		TACACS_PAD_PREFIX(md5_ctx);
+	}
+	fr_md5_final(pad, md5_ctx);
 
-	fr_md5_calc(pad, buf, pad_offset);
+	p = body;
+	end = body + body_len;
 
-	size_t pos = 0;
-	do {
-		for (size_t i = 0; i < MD5_DIGEST_LENGTH && pos < body_len; i++, pos++)
-			body[pos] ^= pad[i];
+	for (;;) {
+		if ((size_t)(end - p) <= MD5_DIGEST_LENGTH) {
+			size_t i;
 
-		if (pos == body_len)
+			if ((size_t)(end - p) == MD5_DIGEST_LENGTH) {
+				tacacs_xor_block(p, pad);
+			} else {
+				for (i = 0; p < end; i++, p++) *p ^= pad[i];
+			}
 			break;
+		}
+
+		tacacs_xor_block(p, pad);
+		p += MD5_DIGEST_LENGTH;
+
+		/* MD5_n = MD5{session_id, key, version, seq_no, MD5_n-1} */
+		fr_md5_ctx_reset(md5_ctx);
+		if (md5_ctx_prefix) {
+			fr_md5_ctx_copy(md5_ctx, md5_ctx_prefix);
+		} else {
+			TACACS_PAD_PREFIX(md5_ctx);
+		}
+		fr_md5_update(md5_ctx, pad, sizeof(pad));
+		fr_md5_final(pad, md5_ctx);
+	}
 
-		memcpy(&buf[pad_offset], pad, MD5_DIGEST_LENGTH);
-		fr_md5_calc(pad, buf, pad_offset + MD5_DIGEST_LENGTH);
-	} while (1);
+#undef TACACS_PAD_PREFIX
 
-	talloc_free(buf);
+	fr_md5_ctx_free(&md5_ctx);
+	if (md5_ctx_prefix) fr_md5_ctx_reset(md5_ctx_prefix);
 
 	return 0;
 }
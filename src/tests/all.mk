@@ -55,6 +55,9 @@ test: \
 		test.modules	\
 		test.radiusd-c	\
 		test.radclient	\
+		test.raddetail	\
+		test.radius_tcp	\
+		test.radius_hedge	\
 		test.radsniff	\
 		test.auth	\
 		test.digest	\
@@ -79,10 +82,10 @@ ci-test: raddb/test.conf test
 #
 #  The tests do a lot of rooting through files, which slows down non-test builds.
 #
-#  Therefore only include the test subdirectories if we're running the tests.
-#  Or, if we're trying to clean things up.
+#  Therefore only include the test subdirectories if we're running the tests
+#  or the benchmarks.  Or, if we're trying to clean things up.
 #
-ifneq "$(findstring test,$(MAKECMDGOALS))$(findstring clean,$(MAKECMDGOALS))" ""
+ifneq "$(findstring test,$(MAKECMDGOALS))$(findstring bench,$(MAKECMDGOALS))$(findstring clean,$(MAKECMDGOALS))" ""
 SUBMAKEFILES := rbmonkey.mk $(subst src/tests/,,$(wildcard src/tests/*/all.mk))
 endif
 
@@ -0,0 +1,2 @@
+mem_ippool.test:
+
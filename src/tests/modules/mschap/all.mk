@@ -0,0 +1,3 @@
+#
+#  Test the "mschap" module
+#
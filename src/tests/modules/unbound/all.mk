@@ -0,0 +1,20 @@
+#
+#  Test the "unbound" module
+#
+
+#
+#  The stub zone in unbound.conf is served by dns_responder, which
+#  has to be running before the test starts.  It exits by itself
+#  once the tests stop asking it anything.
+#
+UNBOUND_RESPONDER_PID := $(BUILD_DIR)/tests/modules/unbound/dns_responder.pid
+
+.PHONY: unbound.responder
+unbound.responder:
+	${Q}mkdir -p $(dir $(UNBOUND_RESPONDER_PID))
+	${Q}if ! test -f $(UNBOUND_RESPONDER_PID) || ! kill -0 $$(cat $(UNBOUND_RESPONDER_PID)) 2>/dev/null; then \
+		src/tests/modules/unbound/dns_responder --port 15353 --idle 60 --pidfile $(UNBOUND_RESPONDER_PID) & \
+		for i in 1 2 3 4 5; do test -f $(UNBOUND_RESPONDER_PID) && break; sleep 1; done; \
+	fi
+
+$(BUILD_DIR)/tests/modules/unbound/stub: rlm_delay.la | unbound.responder
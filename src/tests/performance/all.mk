@@ -0,0 +1,26 @@
+#
+#	Benchmarks for radiusd.
+#
+#	These aren't part of "make test", as the results depend on the
+#	machine they're run on.  Run "make bench" on the same machine
+#	before and after a change, and compare the JSON files which
+#	are written to build/tests/bench/.
+#
+#	"make bench.<scenario>" runs a single scenario, e.g. "make bench.pap".
+#
+BENCH_SCENARIOS := $(patsubst $(DIR)/bench/%.txt,%,$(wildcard $(DIR)/bench/*.txt))
+BENCH_SCRIPT    := $(DIR)/benchmark
+BENCH_OUTPUT    := $(BUILD_DIR)/tests/bench
+
+.PHONY: bench $(addprefix bench.,$(BENCH_SCENARIOS))
+bench: $(TEST_BIN_DIR)/radiusd $(TEST_BIN_DIR)/radclient
+	${Q}BENCH_BIN="$(TEST_BIN)" BENCH_OUTPUT=$(BENCH_OUTPUT) $(BENCH_SCRIPT) $(BENCH_SCENARIOS)
+
+$(addprefix bench.,$(BENCH_SCENARIOS)): bench.%: $(TEST_BIN_DIR)/radiusd $(TEST_BIN_DIR)/radclient
+	${Q}BENCH_BIN="$(TEST_BIN)" BENCH_OUTPUT=$(BENCH_OUTPUT) $(BENCH_SCRIPT) $*
+
+.PHONY: clean.bench
+clean.bench:
+	${Q}rm -rf $(BENCH_OUTPUT)
+
+clean.test: clean.bench
@@ -0,0 +1,22 @@
+#
+#	Tests for raddetail, and the binary detail format.
+#
+#	The "roundtrip" script does the work, see there for details.
+#
+
+#
+#	Test name
+#
+TEST  := test.raddetail
+FILES := $(subst $(DIR)/,,$(wildcard $(DIR)/*.detail))
+
+$(eval $(call TEST_BOOTSTRAP))
+
+$(OUTPUT)/%.detail: $(DIR)/%.detail $(DIR)/roundtrip $(TEST_BIN_DIR)/raddetail
+	$(eval TARGET := $(notdir $<))
+	$(Q)echo "RADDETAIL-TEST $(TARGET)"
+	$(Q)if ! TEST_BIN="$(TEST_BIN)" DICT_DIR="$(top_srcdir)/share/dictionary" $(dir $<)roundtrip $< $(basename $@); then \
+		echo "TEST_BIN=\"$(TEST_BIN)\" DICT_DIR=\"$(top_srcdir)/share/dictionary\" $(dir $<)roundtrip $< $(basename $@)"; \
+		exit 1; \
+	fi
+	$(Q)touch $@
@@ -0,0 +1,28 @@
+#
+#	Hedged requests, proxied over UDP to a home server which
+#	answers some of them slowly.
+#
+#	The "run" script does the work, see there for details.
+#
+
+#
+#	Test name
+#
+TEST  := test.radius_hedge
+FILES := hedge
+
+$(eval $(call TEST_BOOTSTRAP))
+
+#
+#	Port for the home server.  The proxy listens on $(PORT).
+#
+RADIUS_HEDGE_HOME_PORT := $(shell expr $(PORT) + 1)
+
+$(OUTPUT)/hedge: $(DIR)/run $(DIR)/slow_home $(wildcard $(DIR)/config/*.conf) $(TEST_BIN_DIR)/radiusd $(TEST_BIN_DIR)/radclient | build.raddb
+	$(Q)echo "RADIUS_HEDGE-TEST hedge"
+	$(Q)if ! TEST_BIN="$(TEST_BIN)" OUTPUT=$(dir $@) TEST_PORT=$(PORT) HOME_PORT=$(RADIUS_HEDGE_HOME_PORT) \
+		$< hedge; then \
+		echo "TEST_BIN=\"$(TEST_BIN)\" OUTPUT=$(dir $@) TEST_PORT=$(PORT) HOME_PORT=$(RADIUS_HEDGE_HOME_PORT) $< hedge"; \
+		exit 1; \
+	fi
+	$(Q)touch $@
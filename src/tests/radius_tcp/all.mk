@@ -0,0 +1,30 @@
+#
+#	Proxy through a local home server, over TCP and RADIUS/TLS.
+#
+#	The "run" script does the work, see there for details.
+#
+
+#
+#	Test name
+#
+TEST  := test.radius_tcp
+FILES := tcp.txt tls.txt
+
+$(eval $(call TEST_BOOTSTRAP))
+
+#
+#	Ports for the home server, and for the RADIUS/TLS relay.
+#	The proxy listens on $(PORT).
+#
+RADIUS_TCP_HOME_PORT  := $(shell expr $(PORT) + 1)
+RADIUS_TCP_RELAY_PORT := $(shell expr $(PORT) + 2)
+
+$(OUTPUT)/%.txt: $(DIR)/%.txt $(wildcard $(DIR)/config/*.conf) $(DIR)/run $(DIR)/radsec_relay $(TEST_BIN_DIR)/radiusd $(TEST_BIN_DIR)/radclient | build.raddb
+	$(eval TARGET := $(notdir $<))
+	$(Q)echo "RADIUS_TCP-TEST $(TARGET)"
+	$(Q)if ! TEST_BIN="$(TEST_BIN)" OUTPUT=$(dir $@) TEST_PORT=$(PORT) HOME_PORT=$(RADIUS_TCP_HOME_PORT) RELAY_PORT=$(RADIUS_TCP_RELAY_PORT) \
+		$(dir $<)run $(basename $(TARGET)); then \
+		echo "TEST_BIN=\"$(TEST_BIN)\" OUTPUT=$(dir $@) TEST_PORT=$(PORT) HOME_PORT=$(RADIUS_TCP_HOME_PORT) RELAY_PORT=$(RADIUS_TCP_RELAY_PORT) $(dir $<)run $(basename $(TARGET))"; \
+		exit 1; \
+	fi
+	$(Q)touch $@
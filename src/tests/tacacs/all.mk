@@ -15,12 +15,15 @@ $(TACACS_BUILD_DIR)/depends.mk:
 #
 #	Unit tests for scripts/tacacs/tacacs_client against the radiusd/proto_tacacs.
 #
-ifeq "$(WITH_TACACS)" "yes"
-#
-#	Test name
+#	The *.load tests run src/tests/util/tacacs_load instead, which
+#	doesn't need Python, so they're always run.
 #
 TEST  := test.tacacs
-FILES := $(subst $(DIR)/,,$(wildcard $(DIR)/*.txt))
+FILES := $(subst $(DIR)/,,$(wildcard $(DIR)/*.load))
+
+ifeq "$(WITH_TACACS)" "yes"
+FILES += $(subst $(DIR)/,,$(wildcard $(DIR)/*.txt))
+endif
 
 $(eval $(call TEST_BOOTSTRAP))
 
@@ -42,6 +45,28 @@ TACCLIENT := scripts/tacacs/tacacs_client
 include src/tests/radiusd.mk
 $(eval $(call RADIUSD_SERVICE,radiusd,$(OUTPUT)))
 
+#
+#	Run many pipelined Authorization sessions over a few single-connect
+#	connections.  Every one must be answered, and passed.
+#
+$(OUTPUT)/%.load: $(DIR)/%.load $(TEST_BIN_DIR)/tacacs_load | $(TEST).radiusd_kill $(TEST).radiusd_start
+	$(eval FOUND    := $(patsubst %.load,%.out,$@))
+	$(eval ARGV     := $(shell grep "#.*ARGV:" $< | cut -f2 -d ':'))
+	$(Q)echo "TACACS-TEST INPUT=$(notdir $<) TACACS_LOAD_ARGV=\"$(ARGV)\""
+	$(Q)[ -f $(dir $@)/radiusd.pid ] || exit 1
+	$(Q)if ! $(TEST_BIN)/tacacs_load -x $(SECRET) -p $(PORT) -u tapioca $(ARGV) 1> $(FOUND) 2>&1 || \
+	    ! grep -q ', fail 0, bad 0,' $(FOUND); then                   \
+		echo "FAILED";                                              \
+		cat $(FOUND);                                               \
+		rm -f $(BUILD_DIR)/tests/test.tacacs;                       \
+		$(MAKE) --no-print-directory test.tacacs.radiusd_kill;      \
+		echo "RADIUSD:     $(RADIUSD_RUN)";                         \
+		echo "TACACS_LOAD: $(TEST_BIN)/tacacs_load -x $(SECRET) -p $(PORT) -u tapioca $(ARGV)"; \
+		exit 1;                                                     \
+	fi
+	$(Q)touch $@
+
+ifeq "$(WITH_TACACS)" "yes"
 #
 #	Run the tacacs_client commands against the radiusd.
 #
@@ -80,14 +105,12 @@ $(OUTPUT)/%: $(DIR)/% | $(TEST).radiusd_kill $(TEST).radiusd_start
 		exit 1;                                                     \
 	fi
 	$(Q)touch $@
+endif
 
 $(TEST):
+ifneq "$(WITH_TACACS)" "yes"
+	$(Q)echo "WARNING: The tacacs_client tests require 'tacacs_plus' Python3 module. e.g: pip3 install tacacs_plus"
+	$(Q)echo "Skipping them, and only running the tacacs_load tests"
+endif
 	$(Q)$(MAKE) --no-print-directory $@.radiusd_stop
 	@touch $(BUILD_DIR)/tests/$@
-
-else
-.PHONY: test.tacacs
-test.tacacs:
-	$(Q)echo "WARNING: 'tests.tacacs' requires 'tacacs_plus' Python3 module. e.g: pip3 install tacacs_plus"
-	$(Q)echo "Skipping 'test.tacacs'"
-endif
@@ -1,5 +1,11 @@
 SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk 
 
+#
+#  Benchmarks, which are built but not run as part of "make test".
+#  The exception is tacacs_load, which test.tacacs also uses.
+#
+SUBMAKEFILES += bfd_bench.mk cache_bench.mk client_bench.mk ippool_bench.mk state_bench.mk tacacs_bench.mk tacacs_load.mk
+
 #
 #  This uses an old API, and we don't have time to fix it.
 #
@@ -0,0 +1,486 @@
+/*
+ * bfd_bench.c	Benchmark proto_bfd with many simulated peers over loopback
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/listen.h>
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/histogram.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include "../../modules/proto_bfd/proto_bfd.h"
+
+#include <sys/resource.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+/*
+ *	Each peer sends from its own address in 127.0.0.0/8, so that
+ *	proto_bfd sees a different peer.  They all share one socket,
+ *	and pick the source address with IP_PKTINFO.
+ */
+#ifdef IP_PKTINFO
+
+#define BENCH_BATCH	64
+
+extern rad_protocol_t proto_bfd;
+
+static int		debug_lvl = 0;
+static int		num_peers = 10000;
+static int		interval = 1000;		/* ms */
+static int		duration = 30;			/* s */
+
+typedef struct {
+	struct in_addr		addr;
+	uint32_t		my_disc;
+	uint32_t		your_disc;
+	bfd_session_state_t	state;			//!< Our state.
+	bool			server_up;		//!< The last packet from the server said "up".
+	fr_time_t		last_rx;
+} bfd_bench_peer_t;
+
+typedef struct {
+	int			fd;
+	fr_event_list_t		*el;
+	struct sockaddr_in	server;
+
+	bfd_bench_peer_t	*peers;
+	fr_time_t		start;
+	fr_time_t		all_up;
+	uint64_t		tick;
+	fr_event_timer_t const	*ev;
+	fr_event_timer_t const	*ev_done;
+
+	int			up;
+	uint64_t		flaps;
+	uint64_t		sent;
+	uint64_t		received;
+	uint64_t		unknown;
+	fr_histogram_t		*gaps;			//!< Time between packets from the server, once it's up.
+
+	struct mmsghdr		tx[BENCH_BATCH];
+	struct iovec		tx_iov[BENCH_BATCH];
+	bfd_packet_t		tx_packet[BENCH_BATCH];
+	uint8_t			tx_cmsg[BENCH_BATCH][CMSG_SPACE(sizeof(struct in_pktinfo))];
+	unsigned int		tx_queued;
+
+	struct mmsghdr		rx[BENCH_BATCH];
+	struct iovec		rx_iov[BENCH_BATCH];
+	bfd_packet_t		rx_packet[BENCH_BATCH];
+} bfd_bench_t;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: bfd_bench [OPTS]\n");
+	fprintf(stderr, "  -d <seconds>           How long to run for.\n");
+	fprintf(stderr, "  -i <msec>              Transmit and receive interval.\n");
+	fprintf(stderr, "  -n <peers>             Number of peers.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+static void bench_flush(bfd_bench_t *b)
+{
+	unsigned int	sent = 0;
+	int		rcode;
+
+	while (sent < b->tx_queued) {
+		rcode = sendmmsg(b->fd, &b->tx[sent], b->tx_queued - sent, 0);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			fprintf(stderr, "bfd_bench: Failed sending packet: %s\n", fr_syserror(errno));
+			sent++;
+			continue;
+		}
+		sent += rcode;
+		b->sent += rcode;
+	}
+
+	b->tx_queued = 0;
+}
+
+/** Queue a control packet from a peer
+ *
+ */
+static void bench_send(bfd_bench_t *b, bfd_bench_peer_t *peer, bool final)
+{
+	unsigned int		i;
+	bfd_packet_t		*bfd;
+	struct cmsghdr		*cmsg;
+	struct in_pktinfo	*pi;
+
+	if (b->tx_queued == BENCH_BATCH) bench_flush(b);
+
+	i = b->tx_queued++;
+	bfd = &b->tx_packet[i];
+
+	memset(bfd, 0, sizeof(*bfd));
+	bfd->version = 1;
+	bfd->state = peer->state;
+	bfd->final = final;
+	bfd->detect_multi = 3;
+	bfd->length = 24;
+	bfd->my_disc = peer->my_disc;
+	bfd->your_disc = peer->your_disc;
+	bfd->desired_min_tx_interval = interval * 1000;
+	bfd->required_min_rx_interval = interval * 1000;
+
+	b->tx_iov[i].iov_base = bfd;
+	b->tx_iov[i].iov_len = bfd->length;
+
+	memset(&b->tx[i], 0, sizeof(b->tx[i]));
+	b->tx[i].msg_hdr.msg_name = &b->server;
+	b->tx[i].msg_hdr.msg_namelen = sizeof(b->server);
+	b->tx[i].msg_hdr.msg_iov = &b->tx_iov[i];
+	b->tx[i].msg_hdr.msg_iovlen = 1;
+	b->tx[i].msg_hdr.msg_control = b->tx_cmsg[i];
+	b->tx[i].msg_hdr.msg_controllen = sizeof(b->tx_cmsg[i]);
+
+	cmsg = CMSG_FIRSTHDR(&b->tx[i].msg_hdr);
+	cmsg->cmsg_level = IPPROTO_IP;
+	cmsg->cmsg_type = IP_PKTINFO;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(*pi));
+
+	pi = (struct in_pktinfo *)CMSG_DATA(cmsg);
+	memset(pi, 0, sizeof(*pi));
+	pi->ipi_spec_dst = peer->addr;
+}
+
+/** Every millisecond, send for the peers which are due
+ *
+ * Peer "i" sends in slot (i % interval), so the load is spread
+ * evenly over the interval.
+ */
+static void bench_tick(fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	bfd_bench_t	*b = uctx;
+	int		i;
+
+	for (i = (int) (b->tick % interval); i < num_peers; i += interval) bench_send(b, &b->peers[i], false);
+	bench_flush(b);
+
+	b->tick++;
+	if (fr_event_timer_at(b, el, &b->ev, b->start + fr_time_delta_from_msec(b->tick), bench_tick, b) < 0) {
+		fr_perror("bfd_bench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+}
+
+/** Run the peer side of the state machine (RFC 5880 Section 6.8.6)
+ *
+ */
+static void bench_recv_packet(bfd_bench_t *b, bfd_packet_t *bfd, size_t len, fr_time_t now)
+{
+	bfd_bench_peer_t *peer;
+
+	b->received++;
+
+	/*
+	 *	The server doesn't know who we are yet, so we can't
+	 *	tell which peer it's talking to.  It will find out
+	 *	from the next packet the peer sends.
+	 */
+	if ((len < 24) || !bfd->your_disc || (bfd->your_disc > (uint32_t) num_peers)) {
+		b->unknown++;
+		return;
+	}
+
+	peer = &b->peers[bfd->your_disc - 1];
+	peer->your_disc = bfd->my_disc;
+
+	switch (peer->state) {
+	case BFD_STATE_DOWN:
+		if (bfd->state == BFD_STATE_DOWN) peer->state = BFD_STATE_INIT;
+		if (bfd->state == BFD_STATE_INIT) peer->state = BFD_STATE_UP;
+		break;
+
+	case BFD_STATE_INIT:
+		if ((bfd->state == BFD_STATE_INIT) || (bfd->state == BFD_STATE_UP)) peer->state = BFD_STATE_UP;
+		break;
+
+	case BFD_STATE_UP:
+		if (bfd->state == BFD_STATE_DOWN) peer->state = BFD_STATE_DOWN;
+		break;
+
+	default:
+		break;
+	}
+
+	if (bfd->state == BFD_STATE_UP) {
+		if (peer->server_up) {
+			fr_histogram_add(b->gaps, fr_time_delta_to_usec(now - peer->last_rx));
+		} else {
+			peer->server_up = true;
+			if (++b->up == num_peers) b->all_up = now;
+		}
+
+	} else if (peer->server_up) {
+		peer->server_up = false;
+		b->up--;
+		b->flaps++;
+	}
+	peer->last_rx = now;
+
+	if (bfd->poll) bench_send(b, peer, true);
+}
+
+static void bench_recv(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	bfd_bench_t	*b = uctx;
+	int		i, received;
+	fr_time_t	now;
+
+	do {
+		received = recvmmsg(b->fd, b->rx, BENCH_BATCH, MSG_DONTWAIT, NULL);
+		if (received <= 0) break;
+
+		now = fr_time();
+		for (i = 0; i < received; i++) bench_recv_packet(b, &b->rx_packet[i], b->rx[i].msg_len, now);
+	} while (received == BENCH_BATCH);
+
+	bench_flush(b);
+}
+
+static void bench_done(fr_event_list_t *el, UNUSED fr_time_t now, UNUSED void *uctx)
+{
+	fr_event_loop_exit(el, 1);
+}
+
+/** Create the BFD listener, with one peer section per simulated peer
+ *
+ */
+static int bench_listen(TALLOC_CTX *ctx, rad_listen_t *listener, uint16_t peer_port)
+{
+	CONF_SECTION	*server, *cs, *peer_cs;
+	char		buffer[32];
+	int		i;
+
+	server = cf_section_alloc(ctx, NULL, "server", "bfd_bench");
+	cs = cf_section_alloc(server, server, "listen", NULL);
+
+	snprintf(buffer, sizeof(buffer), "%d", interval);
+	cf_pair_alloc(cs, "ipaddr", "127.0.0.1", T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+	cf_pair_alloc(cs, "port", "0", T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+	cf_pair_alloc(cs, "auth_type", "none", T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+	cf_pair_alloc(cs, "min_transmit_interval", buffer, T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+	cf_pair_alloc(cs, "min_receive_interval", buffer, T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+
+	for (i = 0; i < num_peers; i++) {
+		uint32_t addr = (127 << 24) + (1 << 16) + i + 1;
+
+		peer_cs = cf_section_alloc(cs, cs, "peer", NULL);
+
+		snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u",
+			 addr >> 24, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+		cf_pair_alloc(peer_cs, "ipaddr", buffer, T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+
+		snprintf(buffer, sizeof(buffer), "%u", peer_port);
+		cf_pair_alloc(peer_cs, "port", buffer, T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+	}
+
+	memset(listener, 0, sizeof(*listener));
+	listener->proto = &proto_bfd;
+	listener->server = "bfd_bench";
+	listener->print = proto_bfd.print;
+	listener->data = talloc_zero_size(ctx, proto_bfd.inst_size);
+
+	if (proto_bfd.parse(cs, listener) < 0) return -1;
+
+	return proto_bfd.open(cs, listener);
+}
+
+/** CPU time used by the whole process
+ *
+ */
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0) return 0;
+
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		((double) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000);
+}
+
+/** CPU time used by this thread, i.e. by the peers
+ *
+ */
+static double cpu_time_self(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0) return 0;
+
+	return ts.tv_sec + ((double) ts.tv_nsec / NSEC);
+}
+
+int main(int argc, char *argv[])
+{
+	TALLOC_CTX		*ctx;
+	bfd_bench_t		*b;
+	rad_listen_t		listener;
+	struct sockaddr_in	sin;
+	socklen_t		len = sizeof(sin);
+	double			cpu_start, cpu_end, self_start, self_end;
+	int			c, i;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "d:hi:n:x")) != -1) switch (c) {
+		case 'd':
+			duration = atoi(optarg);
+			if (duration <= 0) usage();
+			break;
+
+		case 'i':
+			interval = atoi(optarg);
+			if ((interval < 100) || (interval > 10000)) usage();
+			break;
+
+		case 'n':
+			num_peers = atoi(optarg);
+			if ((num_peers <= 0) || (num_peers > (1 << 22))) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	fr_debug_lvl = debug_lvl;
+
+	ctx = talloc_init_const("bfd_bench");
+	b = talloc_zero(ctx, bfd_bench_t);
+
+	/*
+	 *	The socket all of the peers send and receive on.
+	 */
+	b->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (b->fd < 0) {
+		fprintf(stderr, "bfd_bench: Failed creating socket: %s\n", fr_syserror(errno));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	if ((bind(b->fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) ||
+	    (getsockname(b->fd, (struct sockaddr *) &sin, &len) < 0)) {
+		fprintf(stderr, "bfd_bench: Failed binding socket: %s\n", fr_syserror(errno));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (bench_listen(ctx, &listener, ntohs(sin.sin_port)) < 0) {
+		fr_perror("bfd_bench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	len = sizeof(b->server);
+	if (getsockname(listener.fd, (struct sockaddr *) &b->server, &len) < 0) {
+		fprintf(stderr, "bfd_bench: Failed getting server address: %s\n", fr_syserror(errno));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	b->peers = talloc_zero_array(b, bfd_bench_peer_t, num_peers);
+	for (i = 0; i < num_peers; i++) {
+		b->peers[i].addr.s_addr = htonl((127 << 24) + (1 << 16) + i + 1);
+		b->peers[i].my_disc = i + 1;
+		b->peers[i].state = BFD_STATE_DOWN;
+	}
+
+	for (i = 0; i < BENCH_BATCH; i++) {
+		b->rx_iov[i].iov_base = &b->rx_packet[i];
+		b->rx_iov[i].iov_len = sizeof(b->rx_packet[i]);
+		b->rx[i].msg_hdr.msg_iov = &b->rx_iov[i];
+		b->rx[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	b->gaps = fr_histogram_alloc(b, 5, (uint64_t) 60 * 1000000);
+	b->el = fr_event_list_alloc(b, NULL, NULL);
+	if (!b->gaps || !b->el) {
+		fr_perror("bfd_bench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (fr_event_fd_insert(b, b->el, b->fd, bench_recv, NULL, NULL, b) < 0) {
+		fr_perror("bfd_bench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	b->start = fr_time();
+	if ((fr_event_timer_at(b, b->el, &b->ev, b->start, bench_tick, b) < 0) ||
+	    (fr_event_timer_in(b, b->el, &b->ev_done, fr_time_delta_from_sec(duration), bench_done, b) < 0)) {
+		fr_perror("bfd_bench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	cpu_start = cpu_time();
+	self_start = cpu_time_self();
+
+	fr_event_loop(b->el);
+
+	cpu_end = cpu_time();
+	self_end = cpu_time_self();
+
+	printf("peers %d, interval %dms, %d seconds\n", num_peers, interval, duration);
+	printf("  up at end            %d\n", b->up);
+	if (b->all_up) {
+		printf("  all up after         %.3fs\n", (double) (b->all_up - b->start) / NSEC);
+	} else {
+		printf("  all up after         never\n");
+	}
+	printf("  flaps                %" PRIu64 "\n", b->flaps);
+	printf("  peer packets sent    %" PRIu64 "\n", b->sent);
+	printf("  server packets       %" PRIu64 " (%.0f/s), %" PRIu64 " before the peer was known\n",
+	       b->received, (double) b->received / duration, b->unknown);
+	printf("  server tx gap        p50 %.1fms, p99 %.1fms, max %.1fms\n",
+	       (double) fr_histogram_percentile(b->gaps, 50) / 1000,
+	       (double) fr_histogram_percentile(b->gaps, 99) / 1000,
+	       (double) fr_histogram_max(b->gaps) / 1000);
+	printf("  server CPU           %.3fs (%.1f%%)\n",
+	       (cpu_end - cpu_start) - (self_end - self_start),
+	       100 * ((cpu_end - cpu_start) - (self_end - self_start)) / duration);
+
+	close(b->fd);
+
+	/*
+	 *	The BFD thread is still running, so exit without
+	 *	freeing anything it uses.
+	 */
+	fr_exit_now(EXIT_SUCCESS);
+}
+#else
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	fprintf(stderr, "bfd_bench needs IP_PKTINFO to simulate multiple peers\n");
+	return 1;
+}
+#endif
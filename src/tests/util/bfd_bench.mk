@@ -0,0 +1,6 @@
+TARGET := bfd_bench
+
+SOURCES		:= bfd_bench.c
+
+TGT_PREREQS	:= proto_bfd.a $(LIBFREERADIUS_SERVER) libfreeradius-util.a libfreeradius-io.a
+TGT_LDLIBS	:= $(LIBS)
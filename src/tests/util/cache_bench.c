@@ -0,0 +1,243 @@
+/*
+ * cache_bench.c	Multi-threaded benchmark for the in-memory rlm_cache drivers
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include "../../modules/rlm_cache/rlm_cache.h"
+
+#include <pthread.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+extern rlm_cache_driver_t rlm_cache_rbtree;
+extern rlm_cache_driver_t rlm_cache_htable;
+
+static int		debug_lvl = 0;
+static int		num_threads = 16;
+static int		num_ops = 1000000;
+static int		num_keys = 100000;
+static int		ttl = 60;
+
+typedef struct {
+	pthread_t		pthread_id;
+	int			id;
+
+	rlm_cache_driver_t const *driver;
+	void			*driver_inst;
+	rlm_cache_config_t const *config;
+
+	uint64_t		hits;
+	uint64_t		misses;
+} cache_bench_thread_t;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: cache_bench [OPTS]\n");
+	fprintf(stderr, "  -k <keys>              Number of distinct keys.\n");
+	fprintf(stderr, "  -m <max_entries>       Maximum entries in the cache.\n");
+	fprintf(stderr, "  -o <ops>               Operations per thread.\n");
+	fprintf(stderr, "  -s <shards>            Number of shards for rlm_cache_htable.\n");
+	fprintf(stderr, "  -t <threads>           Number of threads.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+/** Perform find-or-insert operations against a driver, the same way rlm_cache does
+ *
+ */
+static void *cache_bench_thread(void *arg)
+{
+	cache_bench_thread_t	*t = arg;
+	request_t		*request;
+	fr_fast_rand_t		rand_ctx = { .a = 6809 + t->id, .b = 2112 * (t->id + 1) };
+	int			i;
+
+	request = request_alloc(NULL);
+	request->packet = fr_radius_alloc(request, false);
+
+	for (i = 0; i < num_ops; i++) {
+		rlm_cache_handle_t	*handle = NULL;
+		rlm_cache_entry_t	*c = NULL;
+		char			key[32];
+		size_t			key_len;
+
+		key_len = snprintf(key, sizeof(key), "key-%u", fr_fast_rand(&rand_ctx) % num_keys);
+		request->packet->timestamp = fr_time();
+
+		if (t->driver->acquire &&
+		    (t->driver->acquire(&handle, t->config, t->driver_inst, request) < 0)) {
+			fprintf(stderr, "cache_bench: Failed acquiring handle\n");
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		if (t->driver->find(&c, t->config, t->driver_inst, request, handle,
+				    (uint8_t const *)key, key_len) == CACHE_OK) {
+			c->hits++;
+			t->hits++;
+		} else {
+			t->misses++;
+
+			c = t->driver->alloc(t->config, t->driver_inst, request);
+			c->key = talloc_memdup(c, key, key_len);
+			c->key_len = key_len;
+			c->created = c->expires = fr_time_to_unix_time(request->packet->timestamp);
+			c->expires += fr_time_delta_from_sec(ttl);
+
+			if (t->driver->insert(t->config, t->driver_inst, request, handle, c) != CACHE_OK) {
+				talloc_free(c);
+			}
+		}
+
+		if (t->driver->release) t->driver->release(t->config, t->driver_inst, request, handle);
+	}
+
+	talloc_free(request);
+
+	return NULL;
+}
+
+/** Instantiate a driver and run all the threads against it
+ *
+ */
+static int cache_bench_driver(rlm_cache_driver_t const *driver, rlm_cache_config_t const *config, char const *shards)
+{
+	CONF_SECTION		*cs;
+	void			*driver_inst;
+	cache_bench_thread_t	*threads;
+	fr_time_t		start, end;
+	uint64_t		hits = 0, misses = 0;
+	int			i;
+
+	cs = cf_section_alloc(NULL, NULL, strrchr(driver->name, '_') + 1, NULL);
+	if (shards && (strcmp(driver->name, "rlm_cache_htable") == 0)) {
+		cf_pair_alloc(cs, "shards", shards, T_OP_EQ, T_BARE_WORD, T_BARE_WORD);
+	}
+
+	driver_inst = talloc_zero_array(NULL, uint8_t, driver->inst_size);
+	talloc_set_name(driver_inst, "%s_t", driver->name);
+
+	if (driver->config &&
+	    ((cf_section_rules_push(cs, driver->config) < 0) || (cf_section_parse(driver_inst, driver_inst, cs) < 0))) {
+		fr_perror("cache_bench");
+		return -1;
+	}
+
+	if (driver->instantiate(driver_inst, cs) < 0) {
+		fr_perror("cache_bench");
+		return -1;
+	}
+
+	threads = talloc_zero_array(NULL, cache_bench_thread_t, num_threads);
+
+	start = fr_time();
+	for (i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		threads[i].driver = driver;
+		threads[i].driver_inst = driver_inst;
+		threads[i].config = config;
+
+		if (pthread_create(&threads[i].pthread_id, NULL, cache_bench_thread, &threads[i]) != 0) {
+			fprintf(stderr, "cache_bench: Failed creating thread: %s\n", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].pthread_id, NULL);
+		hits += threads[i].hits;
+		misses += threads[i].misses;
+	}
+	end = fr_time();
+
+	printf("%-20s threads %d, ops %" PRIu64 ", hits %" PRIu64 ", misses %" PRIu64 ", "
+	       "%.3f seconds, %.0f ops/s\n",
+	       driver->name, num_threads, hits + misses, hits, misses,
+	       (double)(end - start) / NSEC, (double)(hits + misses) / ((double)(end - start) / NSEC));
+
+	if (driver->detach) driver->detach(driver_inst);
+
+	talloc_free(threads);
+	talloc_free(driver_inst);
+	talloc_free(cs);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	char const		*shards = NULL;
+	rlm_cache_config_t	config = { .name = "cache_bench", .ttl = 60 };
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "hk:m:o:s:t:x")) != -1) switch (c) {
+		case 'k':
+			num_keys = atoi(optarg);
+			if (num_keys <= 0) usage();
+			break;
+
+		case 'm':
+			config.max_entries = atoi(optarg);
+			break;
+
+		case 'o':
+			num_ops = atoi(optarg);
+			if (num_ops <= 0) usage();
+			break;
+
+		case 's':
+			shards = optarg;
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			if (num_threads <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	fr_debug_lvl = debug_lvl;
+
+	/*
+	 *	rlm_cache_rbtree doesn't evict, so only
+	 *	the htable driver honours max_entries.
+	 */
+	if (cache_bench_driver(&rlm_cache_rbtree, &config, NULL) < 0) fr_exit_now(EXIT_FAILURE);
+	if (cache_bench_driver(&rlm_cache_htable, &config, shards) < 0) fr_exit_now(EXIT_FAILURE);
+
+	return 0;
+}
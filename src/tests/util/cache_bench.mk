@@ -0,0 +1,6 @@
+TARGET := cache_bench
+
+SOURCES		:= cache_bench.c
+
+TGT_PREREQS	:= rlm_cache_rbtree.a rlm_cache_htable.a $(LIBFREERADIUS_SERVER) libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
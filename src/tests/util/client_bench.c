@@ -0,0 +1,307 @@
+/*
+ * client_bench.c	Compare client lookups using the trie with lookups using an rbtree per prefix
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+static int		num_threads = 4;
+static int		num_ops = 1000000;
+static int		num_clients = 100000;
+
+/*
+ *	The mix of prefix lengths.  Mostly hosts, with a tail of
+ *	progressively larger networks.
+ */
+static uint8_t const	prefixes[] = { 32, 32, 32, 32, 32, 32, 32, 32, 30, 29, 28, 27, 26, 24, 24, 24, 22, 20, 16, 12 };
+
+/** The lookup structure client.c used before the trie
+ *
+ */
+typedef struct {
+	rbtree_t		*tree[33];
+} client_bench_rbtree_t;
+
+typedef struct {
+	pthread_t		pthread_id;
+	int			id;
+
+	RADCLIENT_LIST		*clients;
+	client_bench_rbtree_t	*rbtree;
+	fr_ipaddr_t		*addrs;			//!< Addresses of the clients, to look up hits.
+
+	bool			use_trie;
+
+	uint64_t		found;
+	uint64_t		mismatch;
+} client_bench_thread_t;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: client_bench [OPTS]\n");
+	fprintf(stderr, "  -c <clients>           Number of clients.\n");
+	fprintf(stderr, "  -o <ops>               Lookups per thread.\n");
+	fprintf(stderr, "  -t <threads>           Number of threads.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+static void client_bench_ipaddr(fr_ipaddr_t *ipaddr, uint32_t addr)
+{
+	*ipaddr = (fr_ipaddr_t){
+		.af = AF_INET,
+		.prefix = 32,
+		.addr.v4.s_addr = addr
+	};
+}
+
+static int client_bench_cmp(void const *one, void const *two)
+{
+	RADCLIENT const *a = one;
+	RADCLIENT const *b = two;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+static RADCLIENT *client_bench_rbtree_find(client_bench_rbtree_t *rbtree, fr_ipaddr_t const *ipaddr)
+{
+	RADCLIENT	my_client, *client;
+	int		i;
+
+	for (i = ipaddr->prefix; i >= 0; i--) {
+		if (!rbtree->tree[i]) continue;
+
+		my_client.ipaddr = *ipaddr;
+		fr_ipaddr_mask(&my_client.ipaddr, i);
+		client = rbtree_finddata(rbtree->tree[i], &my_client);
+		if (client) return client;
+	}
+
+	return NULL;
+}
+
+/** Look up a mix of configured clients and random addresses
+ *
+ */
+static void *client_bench_thread(void *arg)
+{
+	client_bench_thread_t	*t = arg;
+	fr_fast_rand_t		rand_ctx = { .a = 6809 + t->id, .b = 2112 * (t->id + 1) };
+	int			i;
+
+	for (i = 0; i < num_ops; i++) {
+		fr_ipaddr_t	ipaddr;
+		RADCLIENT	*client;
+		uint32_t	r = fr_fast_rand(&rand_ctx);
+
+		/*
+		 *	Half the lookups are for an address within a
+		 *	configured client, the rest are random.
+		 */
+		if (r & 0x01) {
+			ipaddr = t->addrs[(r >> 1) % num_clients];
+			ipaddr.addr.v4.s_addr |= htonl(fr_fast_rand(&rand_ctx) & (((uint32_t) 1 << (32 - ipaddr.prefix)) - 1));
+			ipaddr.prefix = 32;
+		} else {
+			client_bench_ipaddr(&ipaddr, fr_fast_rand(&rand_ctx));
+		}
+
+		if (t->use_trie) {
+			client = client_find(t->clients, &ipaddr, IPPROTO_UDP);
+		} else {
+			client = client_bench_rbtree_find(t->rbtree, &ipaddr);
+		}
+		if (client) t->found++;
+
+		/*
+		 *	Check the two agree, outside of the timed runs.
+		 */
+		if (debug_lvl && (client != (t->use_trie ? client_bench_rbtree_find(t->rbtree, &ipaddr) :
+					     client_find(t->clients, &ipaddr, IPPROTO_UDP)))) t->mismatch++;
+	}
+
+	return NULL;
+}
+
+static int client_bench_run(char const *name, RADCLIENT_LIST *clients, client_bench_rbtree_t *rbtree,
+			    fr_ipaddr_t *addrs, bool use_trie)
+{
+	client_bench_thread_t	*threads;
+	fr_time_t		begin, end;
+	uint64_t		found = 0, mismatch = 0;
+	int			i;
+
+	threads = talloc_zero_array(NULL, client_bench_thread_t, num_threads);
+
+	begin = fr_time();
+	for (i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		threads[i].clients = clients;
+		threads[i].rbtree = rbtree;
+		threads[i].addrs = addrs;
+		threads[i].use_trie = use_trie;
+
+		if (pthread_create(&threads[i].pthread_id, NULL, client_bench_thread, &threads[i]) != 0) {
+			fprintf(stderr, "client_bench: Failed creating thread: %s\n", fr_syserror(errno));
+			talloc_free(threads);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].pthread_id, NULL);
+		found += threads[i].found;
+		mismatch += threads[i].mismatch;
+	}
+	end = fr_time();
+
+	printf("%-6s threads %d, lookups %" PRIu64 ", found %" PRIu64 ", %.3f seconds, %.0f lookups/s\n",
+	       name, num_threads, (uint64_t) num_threads * num_ops, found,
+	       (double)(end - begin) / NSEC, (double) num_threads * num_ops / ((double)(end - begin) / NSEC));
+
+	if (mismatch) {
+		fprintf(stderr, "client_bench: %" PRIu64 " lookups returned different clients\n", mismatch);
+		talloc_free(threads);
+		return -1;
+	}
+
+	talloc_free(threads);
+
+	return 0;
+}
+
+/** Create the clients, add them to both structures, and run the lookups
+ *
+ */
+static int client_bench(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("client_bench");
+	RADCLIENT_LIST		*clients;
+	client_bench_rbtree_t	*rbtree;
+	fr_ipaddr_t		*addrs;
+	fr_fast_rand_t		rand_ctx = { .a = 1, .b = 2 };
+	fr_time_t		begin, end;
+	int			i, ret = -1;
+
+	/*
+	 *	Install the list as the global one, as a reload would,
+	 *	so lookups go through the same path as the listeners.
+	 */
+	clients = client_list_init(NULL);
+	talloc_free(client_list_swap(clients));
+
+	rbtree = talloc_zero(ctx, client_bench_rbtree_t);
+	addrs = talloc_array(ctx, fr_ipaddr_t, num_clients);
+
+	begin = fr_time();
+	for (i = 0; i < num_clients; i++) {
+		RADCLIENT *client;
+
+		client = talloc_zero(ctx, RADCLIENT);
+		client->proto = IPPROTO_UDP;
+
+		/*
+		 *	Retry until we get a prefix nobody has yet.
+		 */
+		do {
+			uint32_t r = fr_fast_rand(&rand_ctx);
+
+			client_bench_ipaddr(&client->ipaddr, fr_fast_rand(&rand_ctx));
+			fr_ipaddr_mask(&client->ipaddr, prefixes[r % sizeof(prefixes)]);
+
+			if (!rbtree->tree[client->ipaddr.prefix]) {
+				rbtree->tree[client->ipaddr.prefix] = rbtree_talloc_alloc(rbtree, client_bench_cmp, RADCLIENT,
+											  NULL, RBTREE_FLAG_NONE);
+			}
+		} while (!rbtree_insert(rbtree->tree[client->ipaddr.prefix], client));
+
+		client->longname = client->shortname = talloc_typed_asprintf(client, "client%d", i);
+		addrs[i] = client->ipaddr;
+
+		if (!client_add(clients, client)) {
+			fr_perror("client_bench");
+			goto finish;
+		}
+	}
+	end = fr_time();
+
+	printf("added %d clients in %.3f seconds\n", num_clients, (double)(end - begin) / NSEC);
+
+	if (client_bench_run("rbtree", NULL, rbtree, addrs, false) < 0) goto finish;
+	if (client_bench_run("trie", NULL, rbtree, addrs, true) < 0) goto finish;
+
+	ret = 0;
+
+finish:
+	client_list_free();
+	talloc_free(ctx);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "c:ho:t:x")) != -1) switch (c) {
+		case 'c':
+			num_clients = atoi(optarg);
+			if (num_clients <= 0) usage();
+			break;
+
+		case 'o':
+			num_ops = atoi(optarg);
+			if (num_ops <= 0) usage();
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			if (num_threads <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	fr_debug_lvl = debug_lvl;
+
+	if (client_bench() < 0) fr_exit_now(EXIT_FAILURE);
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := client_bench
+
+SOURCES		:= client_bench.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
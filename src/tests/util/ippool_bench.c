@@ -0,0 +1,227 @@
+/*
+ * ippool_bench.c	Multi-threaded benchmark for rlm_mem_ippool
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include "../../modules/rlm_mem_ippool/mem_ippool.h"
+
+#include <pthread.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+static int		num_threads = 16;
+static int		num_ops = 1000000;
+static int		num_owners = 50000;
+static uint32_t		num_addresses = 65536;
+static char const	*journal_file = NULL;
+
+typedef struct {
+	pthread_t		pthread_id;
+	int			id;
+
+	mem_ippool_t		*pool;
+
+	uint64_t		allocated;
+	uint64_t		released;
+	uint64_t		empty;
+} ippool_bench_thread_t;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: ippool_bench [OPTS]\n");
+	fprintf(stderr, "  -a <addresses>         Number of addresses in the pool.\n");
+	fprintf(stderr, "  -j <file>              Write changes to a journal.\n");
+	fprintf(stderr, "  -k <owners>            Number of distinct lease owners.\n");
+	fprintf(stderr, "  -o <ops>               Operations per thread.\n");
+	fprintf(stderr, "  -s <shards>            Number of shards to compare with a single shard.\n");
+	fprintf(stderr, "  -t <threads>           Number of threads.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+/** Allocate a lease for a random owner, and release one in four of them
+ *
+ */
+static void *ippool_bench_thread(void *arg)
+{
+	ippool_bench_thread_t	*t = arg;
+	fr_fast_rand_t		rand_ctx = { .a = 6809 + t->id, .b = 2112 * (t->id + 1) };
+	int			i;
+
+	for (i = 0; i < num_ops; i++) {
+		char		owner[32];
+		fr_ipaddr_t	ip;
+		fr_unix_time_t	expires;
+		uint32_t	r = fr_fast_rand(&rand_ctx);
+
+		snprintf(owner, sizeof(owner), "owner-%u", r % num_owners);
+
+		if (mem_ippool_allocate(t->pool, &ip, &expires, owner, "gateway",
+					fr_time_to_unix_time(fr_time()), fr_time_delta_from_sec(60)) != MEM_IPPOOL_RCODE_SUCCESS) {
+			t->empty++;
+			continue;
+		}
+		t->allocated++;
+
+		if ((r >> 24) < 64) {
+			mem_ippool_release(t->pool, &ip, owner);
+			t->released++;
+		}
+	}
+
+	return NULL;
+}
+
+/** Create a pool and run all the threads against it
+ *
+ */
+static int ippool_bench_pool(uint32_t num_shards)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("ippool_bench");
+	mem_ippool_t		*pool;
+	mem_ippool_t		**pools;
+	mem_ippool_journal_t	*journal = NULL;
+	ippool_bench_thread_t	*threads;
+	fr_ipaddr_t		start;
+	fr_time_t		begin, end;
+	uint64_t		allocated = 0, released = 0, empty = 0, rebalanced;
+	uint32_t		leased;
+	int			i;
+
+	if (journal_file) {
+		unlink(journal_file);
+		journal = mem_ippool_journal_alloc(ctx, journal_file, false,
+						   fr_time_delta_from_msec(100), fr_time_delta_from_sec(300));
+	}
+
+	fr_inet_pton(&start, "10.0.0.0", -1, AF_INET, false, false);
+	pool = mem_ippool_alloc(ctx, "bench", num_shards, journal);
+	if ((mem_ippool_add_range(pool, &start, num_addresses) < 0) || (mem_ippool_init(pool) < 0)) {
+		fr_perror("ippool_bench");
+		return -1;
+	}
+
+	if (journal) {
+		pools = talloc_array(ctx, mem_ippool_t *, 1);
+		pools[0] = pool;
+		if (mem_ippool_journal_start(journal, pools) < 0) {
+			fr_perror("ippool_bench");
+			return -1;
+		}
+	}
+
+	threads = talloc_zero_array(ctx, ippool_bench_thread_t, num_threads);
+
+	begin = fr_time();
+	for (i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		threads[i].pool = pool;
+
+		if (pthread_create(&threads[i].pthread_id, NULL, ippool_bench_thread, &threads[i]) != 0) {
+			fprintf(stderr, "ippool_bench: Failed creating thread: %s\n", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].pthread_id, NULL);
+		allocated += threads[i].allocated;
+		released += threads[i].released;
+		empty += threads[i].empty;
+	}
+	end = fr_time();
+
+	mem_ippool_stats(pool, &leased, &rebalanced);
+
+	printf("shards %-5u threads %d, allocated %" PRIu64 ", released %" PRIu64 ", empty %" PRIu64 ", "
+	       "leased %u, rebalanced %" PRIu64 ", %.3f seconds, %.0f ops/s\n",
+	       num_shards, num_threads, allocated, released, empty, leased, rebalanced,
+	       (double)(end - begin) / NSEC, (double)(allocated + released + empty) / ((double)(end - begin) / NSEC));
+
+	if (journal) mem_ippool_journal_stop(journal);
+
+	talloc_free(ctx);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	uint32_t	shards = 64;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "a:hj:k:o:s:t:x")) != -1) switch (c) {
+		case 'a':
+			num_addresses = atoi(optarg);
+			if ((num_addresses == 0) || (num_addresses > MEM_IPPOOL_MAX_ADDRESSES)) usage();
+			break;
+
+		case 'j':
+			journal_file = optarg;
+			break;
+
+		case 'k':
+			num_owners = atoi(optarg);
+			if (num_owners <= 0) usage();
+			break;
+
+		case 'o':
+			num_ops = atoi(optarg);
+			if (num_ops <= 0) usage();
+			break;
+
+		case 's':
+			shards = atoi(optarg);
+			if ((shards == 0) || (shards > MEM_IPPOOL_MAX_SHARDS)) usage();
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			if (num_threads <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	fr_debug_lvl = debug_lvl;
+
+	if (ippool_bench_pool(1) < 0) fr_exit_now(EXIT_FAILURE);
+	if (ippool_bench_pool(shards) < 0) fr_exit_now(EXIT_FAILURE);
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := ippool_bench
+
+SOURCES		:= ippool_bench.c
+
+TGT_PREREQS	:= rlm_mem_ippool.a $(LIBFREERADIUS_SERVER) libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
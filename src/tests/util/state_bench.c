@@ -0,0 +1,293 @@
+/*
+ * state_bench.c	Multi-threaded benchmark for the session state tree
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/state.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+static int		num_threads = 16;
+static int		num_ops = 1000000;
+static int		num_sessions = 1000;
+static int		num_rounds = 8;
+
+static fr_dict_t const *dict_radius;
+
+extern fr_dict_autoload_t state_bench_dict[];
+fr_dict_autoload_t state_bench_dict[] = {
+	{ .out = &dict_radius, .proto = "radius" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_state;
+
+extern fr_dict_attr_autoload_t state_bench_dict_attr[];
+fr_dict_attr_autoload_t state_bench_dict_attr[] = {
+	{ .out = &attr_state, .name = "State", .type = FR_TYPE_OCTETS, .dict = &dict_radius },
+	{ NULL }
+};
+
+/** A session in progress, i.e. what the NAS remembers between rounds
+ *
+ */
+typedef struct {
+	uint8_t			state[16];			//!< State from the last reply.
+	size_t			state_len;
+	int			round;				//!< 0 if the session hasn't started.
+} state_bench_session_t;
+
+typedef struct {
+	pthread_t		pthread_id;
+	int			id;
+
+	fr_state_tree_t		*tree;
+	CONF_SECTION		*server_cs;
+
+	uint64_t		rounds;
+	uint64_t		completed;
+	uint64_t		failed;
+} state_bench_thread_t;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: state_bench [OPTS]\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -k <sessions>          Sessions in progress per thread.\n");
+	fprintf(stderr, "  -o <ops>               Rounds per thread.\n");
+	fprintf(stderr, "  -r <rounds>            Rounds per session.\n");
+	fprintf(stderr, "  -t <threads>           Number of threads.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+/** Process one round of a session, the same way proto_radius_auth does
+ *
+ */
+static int state_bench_round(state_bench_thread_t *t, state_bench_session_t *session)
+{
+	request_t	*request;
+	fr_pair_t	*vp;
+	int		ret = 0;
+
+	request = request_alloc(NULL);
+	request->packet = fr_radius_alloc(request, false);
+	request->reply = fr_radius_alloc(request, false);
+	request->server_cs = t->server_cs;
+
+	if (session->round > 0) {
+		MEM(vp = fr_pair_afrom_da(request->packet, attr_state));
+		fr_pair_value_memdup(vp, session->state, session->state_len, false);
+		fr_pair_add(&request->request_pairs, vp);
+	}
+
+	fr_state_to_request(t->tree, request);
+
+	/*
+	 *	The last round is an Access-Accept.
+	 */
+	if (session->round == (num_rounds - 1)) {
+		fr_state_discard(t->tree, request);
+		session->round = 0;
+		t->completed++;
+		goto finish;
+	}
+
+	/*
+	 *	Give the first round something to save.
+	 */
+	if (!request->state) {
+		MEM(vp = fr_pair_afrom_da(request->state_ctx, attr_state));
+		fr_pair_value_memdup(vp, (uint8_t const *)"bench", 5, false);
+		fr_pair_add(&request->state, vp);
+	}
+
+	if (fr_request_to_state(t->tree, request) < 0) {
+		session->round = 0;
+		ret = -1;
+		goto finish;
+	}
+
+	vp = fr_pair_find_by_da(&request->reply->vps, attr_state);
+	if (!vp || (vp->vp_length > sizeof(session->state))) {
+		session->round = 0;
+		ret = -1;
+		goto finish;
+	}
+	memcpy(session->state, vp->vp_octets, vp->vp_length);
+	session->state_len = vp->vp_length;
+	session->round++;
+
+finish:
+	talloc_free(request);
+
+	return ret;
+}
+
+/** Advance each session in turn, so there are always num_sessions in progress
+ *
+ */
+static void *state_bench_thread(void *arg)
+{
+	state_bench_thread_t	*t = arg;
+	state_bench_session_t	*sessions;
+	int			i;
+
+	sessions = talloc_zero_array(NULL, state_bench_session_t, num_sessions);
+
+	for (i = 0; i < num_ops; i++) {
+		if (state_bench_round(t, &sessions[i % num_sessions]) < 0) t->failed++;
+		t->rounds++;
+	}
+
+	talloc_free(sessions);
+
+	return NULL;
+}
+
+static int state_bench(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("state_bench");
+	CONF_SECTION		*server_cs;
+	fr_state_tree_t		*tree;
+	state_bench_thread_t	*threads;
+	fr_time_t		begin, end;
+	uint64_t		rounds = 0, completed = 0, failed = 0, locked, contended;
+	int			i;
+
+	server_cs = cf_section_alloc(ctx, NULL, "server", "bench");
+
+	/*
+	 *	Leave headroom so the shards don't fill up.
+	 */
+	tree = fr_state_tree_init(ctx, attr_state, true, num_threads * num_sessions * 2, 60, 0);
+	if (!tree) {
+		fr_perror("state_bench");
+		return -1;
+	}
+
+	threads = talloc_zero_array(ctx, state_bench_thread_t, num_threads);
+
+	begin = fr_time();
+	for (i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		threads[i].tree = tree;
+		threads[i].server_cs = server_cs;
+
+		if (pthread_create(&threads[i].pthread_id, NULL, state_bench_thread, &threads[i]) != 0) {
+			fprintf(stderr, "state_bench: Failed creating thread: %s\n", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].pthread_id, NULL);
+		rounds += threads[i].rounds;
+		completed += threads[i].completed;
+		failed += threads[i].failed;
+	}
+	end = fr_time();
+
+	fr_state_lock_stats(tree, &locked, &contended);
+
+	printf("shards %-3u threads %d, sessions %d, rounds %" PRIu64 ", completed %" PRIu64 ", failed %" PRIu64 ", "
+	       "tracked %u, %.3f seconds, %.0f rounds/s\n",
+	       fr_state_num_shards(tree), num_threads, num_threads * num_sessions, rounds, completed, failed,
+	       fr_state_entries_tracked(tree),
+	       (double)(end - begin) / NSEC, (double)rounds / ((double)(end - begin) / NSEC));
+	printf("locks acquired %" PRIu64 ", contended %" PRIu64 " (%.2f%%)\n",
+	       locked, contended, locked ? ((double)contended * 100) / locked : 0);
+
+	talloc_free(ctx);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int		c, ret = EXIT_SUCCESS;
+	char const	*dict_dir = DICTDIR;
+	TALLOC_CTX	*autofree = talloc_autofree_context();
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "D:hk:o:r:t:x")) != -1) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'k':
+			num_sessions = atoi(optarg);
+			if (num_sessions <= 0) usage();
+			break;
+
+		case 'o':
+			num_ops = atoi(optarg);
+			if (num_ops <= 0) usage();
+			break;
+
+		case 'r':
+			num_rounds = atoi(optarg);
+			if (num_rounds < 2) usage();
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			if (num_threads <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	fr_debug_lvl = debug_lvl;
+
+	if (!fr_dict_global_ctx_init(autofree, dict_dir)) {
+		fr_perror("state_bench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if ((fr_dict_autoload(state_bench_dict) < 0) || (fr_dict_attr_autoload(state_bench_dict_attr) < 0)) {
+		fr_perror("state_bench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (state_bench() < 0) ret = EXIT_FAILURE;
+
+	fr_dict_autofree(state_bench_dict);
+
+	return ret;
+}
@@ -0,0 +1,6 @@
+TARGET := state_bench
+
+SOURCES		:= state_bench.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
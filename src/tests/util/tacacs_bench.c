@@ -0,0 +1,197 @@
+/*
+ * tacacs_bench.c	Benchmark TACACS+ body obfuscation
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/tacacs/tacacs.h>
+#include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/rand.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		num_ops = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: tacacs_bench [OPTS]\n");
+	fprintf(stderr, "  -o <ops>               Packets per test (default scales with body size).\n");
+	fprintf(stderr, "  -s <secret>            Shared secret (default tests a short and a long secret).\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+/** The original implementation, which concatenates the MD5 input into a new buffer for every packet
+ *
+ */
+static void tacacs_body_xor_reference(fr_tacacs_packet_t const *pkt, uint8_t *body, size_t body_len,
+				      char const *secret, size_t secret_len)
+{
+	uint8_t	pad[MD5_DIGEST_LENGTH];
+	uint8_t	*buf;
+	size_t	pad_offset, pos = 0;
+
+	pad_offset = sizeof(pkt->hdr.session_id) + secret_len + sizeof(pkt->hdr.version) + sizeof(pkt->hdr.seq_no);
+
+	buf = talloc_array(NULL, uint8_t, pad_offset + MD5_DIGEST_LENGTH);
+
+	memcpy(&buf[0], &pkt->hdr.session_id, sizeof(pkt->hdr.session_id));
+	memcpy(&buf[sizeof(pkt->hdr.session_id)], secret, secret_len);
+	memcpy(&buf[sizeof(pkt->hdr.session_id) + secret_len], &pkt->hdr.version, sizeof(pkt->hdr.version));
+	memcpy(&buf[sizeof(pkt->hdr.session_id) + secret_len + sizeof(pkt->hdr.version)],
+	       &pkt->hdr.seq_no, sizeof(pkt->hdr.seq_no));
+
+	fr_md5_calc(pad, buf, pad_offset);
+
+	for (;;) {
+		size_t i;
+
+		for (i = 0; (i < MD5_DIGEST_LENGTH) && (pos < body_len); i++, pos++) body[pos] ^= pad[i];
+		if (pos == body_len) break;
+
+		memcpy(&buf[pad_offset], pad, MD5_DIGEST_LENGTH);
+		fr_md5_calc(pad, buf, pad_offset + MD5_DIGEST_LENGTH);
+	}
+
+	talloc_free(buf);
+}
+
+/** Check fr_tacacs_body_xor() produces the same output as the reference
+ *
+ */
+static int tacacs_bench_check(fr_tacacs_packet_t const *pkt, uint8_t *body, uint8_t *check, size_t len,
+			      char const *secret, size_t secret_len)
+{
+	memcpy(check, body, len);
+	tacacs_body_xor_reference(pkt, check, len, secret, secret_len);
+
+	if (fr_tacacs_body_xor(pkt, body, len, secret, secret_len) < 0) {
+		fr_perror("tacacs_bench");
+		return -1;
+	}
+
+	if (memcmp(body, check, len) != 0) {
+		fprintf(stderr, "tacacs_bench: Output differs from the reference for a %zu byte body\n", len);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Check the two implementations agree, then time them
+ *
+ */
+static int tacacs_bench_run(size_t body_len, char const *secret, int ops)
+{
+	fr_tacacs_packet_t	pkt = { .hdr = { .version = 0xc0, .seq_no = 1 } };
+	fr_fast_rand_t		rand_ctx = { .a = 6809, .b = 2112 };
+	size_t			secret_len = strlen(secret);
+	uint8_t			*body, *check;
+	fr_time_t		start;
+	fr_time_delta_t		ref_time, new_time;
+	size_t			i;
+	int			j;
+
+	body = talloc_array(NULL, uint8_t, body_len);
+	check = talloc_array(body, uint8_t, body_len);
+
+	for (i = 0; i < body_len; i++) body[i] = fr_fast_rand(&rand_ctx);
+
+	/*
+	 *	Check every length up to a few pad blocks, and the full body.
+	 */
+	for (i = 1; i <= 4 * MD5_DIGEST_LENGTH; i++) {
+		pkt.hdr.session_id = fr_fast_rand(&rand_ctx);
+		if (tacacs_bench_check(&pkt, body, check, i, secret, secret_len) < 0) return -1;
+	}
+	if (tacacs_bench_check(&pkt, body, check, body_len, secret, secret_len) < 0) return -1;
+
+	start = fr_time();
+	for (j = 0; j < ops; j++) {
+		pkt.hdr.session_id = j;
+		tacacs_body_xor_reference(&pkt, body, body_len, secret, secret_len);
+	}
+	ref_time = fr_time() - start;
+
+	start = fr_time();
+	for (j = 0; j < ops; j++) {
+		pkt.hdr.session_id = j;
+		(void) fr_tacacs_body_xor(&pkt, body, body_len, secret, secret_len);
+	}
+	new_time = fr_time() - start;
+
+	printf("body %6zu, secret %3zu, ops %8d, reference %.3f s (%.1f MB/s), "
+	       "fr_tacacs_body_xor %.3f s (%.1f MB/s)\n",
+	       body_len, secret_len, ops,
+	       (double)ref_time / NSEC, ((double)body_len * ops) / ((double)ref_time / NSEC) / (1024 * 1024),
+	       (double)new_time / NSEC, ((double)body_len * ops) / ((double)new_time / NSEC) / (1024 * 1024));
+
+	talloc_free(body);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	char const	*secret = NULL;
+	char const	*secrets[] = {
+		"testing123",
+		"a-much-longer-shared-secret-which-fills-more-than-one-md5-block",
+	};
+	size_t		sizes[] = { 1024, 65536 };
+	size_t		i, k;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "ho:s:")) != -1) switch (c) {
+		case 'o':
+			num_ops = atoi(optarg);
+			if (num_ops <= 0) usage();
+			break;
+
+		case 's':
+			secret = optarg;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	for (i = 0; i < NUM_ELEMENTS(sizes); i++) {
+		int ops = num_ops ? num_ops : (int)((64 * 1024 * 1024) / sizes[i]);
+
+		if (secret) {
+			if (tacacs_bench_run(sizes[i], secret, ops) < 0) fr_exit_now(EXIT_FAILURE);
+			continue;
+		}
+
+		for (k = 0; k < NUM_ELEMENTS(secrets); k++) {
+			if (tacacs_bench_run(sizes[i], secrets[k], ops) < 0) fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := tacacs_bench
+
+SOURCES		:= tacacs_bench.c
+
+TGT_PREREQS	:= libfreeradius-tacacs.a $(LIBFREERADIUS_SERVER) libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
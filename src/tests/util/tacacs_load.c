@@ -0,0 +1,361 @@
+/*
+ * tacacs_load.c	Load a TACACS+ server with many pipelined sessions
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+/*
+ *	Simulates a NAS which keeps a few single-connect TCP connections
+ *	open to the server, and runs many Authorization sessions over
+ *	each of them without waiting for the previous reply.
+ *
+ *	e.g. against the server in src/tests/tacacs:
+ *
+ *	    tacacs_load -p $TEST_PORT -c 4 -n 100000 -w 64
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/tacacs/tacacs.h>
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/socket.h>
+
+#include <poll.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+#define TACACS_LOAD_MAX_CONN	256
+
+typedef struct {
+	int		fd;
+	uint32_t	first;			//!< Index of the first session this connection runs.
+	uint32_t	sent;			//!< Sessions sent.
+	uint32_t	received;		//!< Replies received.
+
+	uint8_t		buffer[16 * FR_TACACS_MAX_PACKET_SIZE];
+	size_t		used;
+} tacacs_load_conn_t;
+
+static char const	*secret = "testing123";
+static size_t		secret_len;
+static char const	*user = "tapioca";
+static uint32_t		num_sessions = 10000;
+static uint32_t		window = 64;
+static uint32_t		session_base;
+
+static fr_time_t	*sent_at;		//!< When each session's request was written.
+
+static uint64_t		num_pass, num_fail, num_bad;
+static fr_time_delta_t	latency_total, latency_max;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: tacacs_load [OPTS]\n");
+	fprintf(stderr, "  -c <connections>       Number of TCP connections (default 4).\n");
+	fprintf(stderr, "  -n <sessions>          Sessions per connection (default 10000).\n");
+	fprintf(stderr, "  -p <port>              Server port (default 49).\n");
+	fprintf(stderr, "  -s <server>            Server address (default 127.0.0.1).\n");
+	fprintf(stderr, "  -u <user>              User-Name to authorize (default tapioca).\n");
+	fprintf(stderr, "  -w <window>            Sessions in flight per connection (default 64).\n");
+	fprintf(stderr, "  -x <secret>            Shared secret (default testing123).\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+/** Write the next Authorization-Request on a connection
+ *
+ */
+static int tacacs_load_send(tacacs_load_conn_t *conn)
+{
+	static char const	*args[] = { "service=shell", "cmd=" };
+	uint8_t			packet[FR_TACACS_MAX_PACKET_SIZE];
+	fr_tacacs_packet_t	*pkt = (fr_tacacs_packet_t *)packet;
+	uint8_t			*p, *body;
+	size_t			user_len = strlen(user), i, body_len;
+	uint32_t		index = conn->first + conn->sent;
+
+	memset(pkt, 0, sizeof(pkt->hdr) + sizeof(pkt->author.req));
+
+	pkt->hdr.ver.major = FR_TAC_PLUS_MAJOR_VER;
+	pkt->hdr.ver.minor = FR_TAC_PLUS_MINOR_VER_DEFAULT;
+	pkt->hdr.type = FR_TAC_PLUS_AUTHOR;
+	pkt->hdr.seq_no = 1;
+	pkt->hdr.flags = FR_TAC_PLUS_SINGLE_CONNECT_FLAG;
+	pkt->hdr.session_id = htonl(session_base + index);
+
+	pkt->author.req.authen_method = FR_TAC_PLUS_AUTHEN_METH_TACACSPLUS;
+	pkt->author.req.priv_lvl = FR_TAC_PLUS_PRIV_LVL_USER;
+	pkt->author.req.authen_type = FR_TAC_PLUS_AUTHEN_TYPE_PAP;
+	pkt->author.req.authen_service = FR_TAC_PLUS_AUTHEN_SVC_LOGIN;
+	pkt->author.req.user_len = user_len;
+	pkt->author.req.port_len = 4;
+	pkt->author.req.rem_addr_len = 9;
+	pkt->author.req.arg_cnt = NUM_ELEMENTS(args);
+
+	p = pkt->author.req.body;
+	for (i = 0; i < NUM_ELEMENTS(args); i++) *p++ = strlen(args[i]);
+
+	memcpy(p, user, user_len);
+	p += user_len;
+	memcpy(p, "tty0", 4);
+	p += 4;
+	memcpy(p, "127.0.0.1", 9);
+	p += 9;
+	for (i = 0; i < NUM_ELEMENTS(args); i++) {
+		memcpy(p, args[i], strlen(args[i]));
+		p += strlen(args[i]);
+	}
+
+	body = packet + sizeof(pkt->hdr);
+	body_len = p - body;
+	pkt->hdr.length = htonl(body_len);
+
+	if (fr_tacacs_body_xor(pkt, body, body_len, secret, secret_len) < 0) return -1;
+
+	sent_at[index] = fr_time();
+
+	if (write(conn->fd, packet, p - packet) != (p - packet)) {
+		fprintf(stderr, "tacacs_load: Failed writing request: %s\n", fr_syserror(errno));
+		return -1;
+	}
+
+	conn->sent++;
+	return 0;
+}
+
+/** Check one reply, and record the latency of its session
+ *
+ */
+static int tacacs_load_reply(tacacs_load_conn_t *conn, uint8_t *packet, size_t packet_len)
+{
+	fr_tacacs_packet_t	*pkt = (fr_tacacs_packet_t *)packet;
+	uint8_t			*body = packet + sizeof(pkt->hdr);
+	size_t			body_len = packet_len - sizeof(pkt->hdr);
+	uint32_t		index = ntohl(pkt->hdr.session_id) - session_base;
+	fr_time_delta_t		latency;
+
+	if ((index < conn->first) || (index >= conn->first + conn->sent) ||
+	    (pkt->hdr.type != FR_TAC_PLUS_AUTHOR) || (pkt->hdr.seq_no != 2) ||
+	    (body_len < sizeof(pkt->author.res))) {
+		fprintf(stderr, "tacacs_load: Unexpected reply for session %08x\n", ntohl(pkt->hdr.session_id));
+		conn->received++;
+		num_bad++;
+		return 0;
+	}
+
+	latency = fr_time() - sent_at[index];
+	latency_total += latency;
+	if (latency > latency_max) latency_max = latency;
+
+	if (!(pkt->hdr.flags & FR_TAC_PLUS_UNENCRYPTED_FLAG) &&
+	    (fr_tacacs_body_xor(pkt, body, body_len, secret, secret_len) < 0)) return -1;
+
+	switch (pkt->author.res.status) {
+	case FR_TAC_PLUS_AUTHOR_STATUS_PASS_ADD:
+	case FR_TAC_PLUS_AUTHOR_STATUS_PASS_REPL:
+		num_pass++;
+		break;
+
+	case FR_TAC_PLUS_AUTHOR_STATUS_FAIL:
+		num_fail++;
+		break;
+
+	default:
+		num_bad++;
+		break;
+	}
+
+	conn->received++;
+	return 0;
+}
+
+/** Read whatever the server has sent, and process every complete reply
+ *
+ */
+static int tacacs_load_read(tacacs_load_conn_t *conn)
+{
+	ssize_t	data_len;
+	size_t	used = 0;
+
+	data_len = read(conn->fd, conn->buffer + conn->used, sizeof(conn->buffer) - conn->used);
+	if (data_len <= 0) {
+		if (data_len == 0) {
+			fprintf(stderr, "tacacs_load: Server closed the connection\n");
+		} else {
+			fprintf(stderr, "tacacs_load: Failed reading reply: %s\n", fr_syserror(errno));
+		}
+		return -1;
+	}
+	conn->used += data_len;
+
+	while ((conn->used - used) >= FR_TACACS_HEADER_LENGTH) {
+		fr_tacacs_packet_t const *pkt = (fr_tacacs_packet_t const *)(conn->buffer + used);
+		size_t packet_len = FR_TACACS_HEADER_LENGTH + ntohl(pkt->hdr.length);
+
+		if (packet_len > FR_TACACS_MAX_PACKET_SIZE) {
+			fprintf(stderr, "tacacs_load: Reply is too large (%zu bytes)\n", packet_len);
+			return -1;
+		}
+		if ((conn->used - used) < packet_len) break;
+
+		if (tacacs_load_reply(conn, conn->buffer + used, packet_len) < 0) return -1;
+		used += packet_len;
+	}
+
+	memmove(conn->buffer, conn->buffer + used, conn->used - used);
+	conn->used -= used;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	char const		*server = "127.0.0.1";
+	uint16_t		port = 49;
+	uint32_t		num_conns = 4, i, active;
+	fr_ipaddr_t		ipaddr;
+	tacacs_load_conn_t	*conns;
+	struct pollfd		*fds;
+	fr_time_t		start;
+	fr_time_delta_t		elapsed;
+	uint64_t		total;
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "c:hn:p:s:u:w:x:")) != -1) switch (c) {
+		case 'c':
+			num_conns = atoi(optarg);
+			if ((num_conns == 0) || (num_conns > TACACS_LOAD_MAX_CONN)) usage();
+			break;
+
+		case 'n':
+			num_sessions = atoi(optarg);
+			if (num_sessions == 0) usage();
+			break;
+
+		case 'p':
+			port = atoi(optarg);
+			break;
+
+		case 's':
+			server = optarg;
+			break;
+
+		case 'u':
+			user = optarg;
+			if (strlen(user) > 255) usage();
+			break;
+
+		case 'w':
+			window = atoi(optarg);
+			if (window == 0) usage();
+			break;
+
+		case 'x':
+			secret = optarg;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+	secret_len = strlen(secret);
+
+	if (fr_inet_pton(&ipaddr, server, -1, AF_UNSPEC, true, true) < 0) {
+		fr_perror("tacacs_load");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	total = (uint64_t)num_conns * num_sessions;
+	if (total > UINT32_MAX) usage();
+
+	session_base = fr_rand();
+	sent_at = talloc_array(NULL, fr_time_t, total);
+	conns = talloc_zero_array(NULL, tacacs_load_conn_t, num_conns);
+	fds = talloc_zero_array(NULL, struct pollfd, num_conns);
+
+	for (i = 0; i < num_conns; i++) {
+		conns[i].fd = fr_socket_client_tcp(NULL, &ipaddr, port, false);
+		if (conns[i].fd < 0) {
+			fr_perror("tacacs_load");
+			fr_exit_now(EXIT_FAILURE);
+		}
+		conns[i].first = i * num_sessions;
+
+		fds[i].fd = conns[i].fd;
+		fds[i].events = POLLIN;
+	}
+
+	start = fr_time();
+
+	/*
+	 *	Keep "window" sessions in flight on every connection
+	 *	until they have all been answered.
+	 */
+	for (;;) {
+		active = 0;
+
+		for (i = 0; i < num_conns; i++) {
+			tacacs_load_conn_t *conn = &conns[i];
+
+			while ((conn->sent < num_sessions) && ((conn->sent - conn->received) < window)) {
+				if (tacacs_load_send(conn) < 0) fr_exit_now(EXIT_FAILURE);
+			}
+
+			if (conn->received < num_sessions) {
+				fds[i].fd = conn->fd;
+				active++;
+			} else {
+				fds[i].fd = -1;
+			}
+		}
+		if (!active) break;
+
+		if (poll(fds, num_conns, 10000) <= 0) {
+			fprintf(stderr, "tacacs_load: Timed out waiting for replies\n");
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < num_conns; i++) {
+			if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+			if (tacacs_load_read(&conns[i]) < 0) fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	elapsed = fr_time() - start;
+
+	printf("connections %u, sessions %" PRIu64 ", window %u, %.3f s, %.0f sessions/s\n",
+	       num_conns, total, window, (double)elapsed / NSEC, (double)total / ((double)elapsed / NSEC));
+	printf("pass %" PRIu64 ", fail %" PRIu64 ", bad %" PRIu64 ", latency avg %.3f ms, max %.3f ms\n",
+	       num_pass, num_fail, num_bad,
+	       ((double)latency_total / total) / 1000000, (double)latency_max / 1000000);
+
+	for (i = 0; i < num_conns; i++) close(conns[i].fd);
+
+	talloc_free(fds);
+	talloc_free(conns);
+	talloc_free(sent_at);
+
+	return (num_bad == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
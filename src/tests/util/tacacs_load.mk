@@ -0,0 +1,6 @@
+TARGET := tacacs_load
+
+SOURCES		:= tacacs_load.c
+
+TGT_PREREQS	:= libfreeradius-tacacs.a $(LIBFREERADIUS_SERVER) libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)